@@ -26,21 +26,61 @@
 #include <GL/freeglut_ext.h>          // for glutSetOption, glutLeaveMainLoop
 #include <signal.h>                   // for signal, SIGINT
 #include <stdio.h>                    // for printf, NULL, fprintf, getchar
-#include <stdlib.h>                   // for exit
+#include <stdlib.h>                   // for exit, atexit
 #include <tclap/CmdLine.h>            // for CmdLine
 #include <algorithm>                  // for find
 #include <atomic>
 #include <iostream>                   // for operator<<, basic_ostream, endl
+#include <memory>                     // for unique_ptr
 #include <scoped_allocator>           // for allocator_traits<>::value_type
 #include <string>                     // for string, basic_string
 #include <utility>                    // for pair
 #include <vector>                     // for vector
+#include "Cluster.h"                  // for Cluster
+#include "Coverage.h"                 // for Coverage
+#include "EEPROMProfile.h"            // for EEPROMProfile
+#include "FarmView.h"                 // for FarmView
+#include "FastBoot.h"                 // for FastBoot
 #include "FatImage.h"                 // for FatImage
+#include "FirmwareVars.h"             // for FirmwareVars
+#include "ForkServer.h"               // for ForkServer
+#include "GCodeSniffer.h"             // for GCodeSniffer
+#include "GCodeStreamer.h"            // for GCodeStreamer
+#include "Heater.h"                   // for Heater
+#include "IRQArena.h"                 // for IRQArena
+#include "IRQBinding.h"               // for PrintStats
+#include "ISRStats.h"                 // for ISRStats
+#include "IdleSkip.h"                 // for IdleSkip
+#include "InputLog.h"                 // for InputLog
+#include "LCDMirror.h"                // for LCDMirror
+#include "Lockstep.h"                 // for Lockstep
+#include "Log.h"                      // for Log
+#include "MMU2Model.h"                // for MMU2Model
+#include "Metrics.h"                  // for Metric, MetricsExporter
+#include "PCProfiler.h"               // for PCProfiler
+#include "ParallelReplay.h"           // for ParallelReplay
+#include "PrintCapture.h"             // for PrintCapture
 #include "Printer.h"                  // for Printer, Printer::VisualType
 #include "PrinterFactory.h"           // for PrinterFactory
+#include "RedrawFlag.h"               // for RedrawFlag
+#include "RemoteControl.h"            // for RemoteControl
+#include "RenderQuality.h"            // for RenderQuality
+#include "ResultCache.h"              // for ResultCache
+#include "SDCard.h"                   // for SDCard
+#include "ScriptBatch.h"              // for ScriptBatch
 #include "ScriptHost.h"               // for ScriptHost
+#include "ShmExport.h"                // for ShmExport
+#include "StackGuard.h"               // for StackGuard
+#include "StartupTimeline.h"          // for StartupTimeline, StartupTimeline::Phase
+#include "StepTiming.h"               // for StepTiming
+#include "TMC2130.h"                  // for TMC2130
 #include "TelemetryHost.h"
+#include "ThreadPolicy.h"             // for ThreadPolicy
+#include "ToolpathWriter.h"           // for ToolpathWriter
+#include "TraceWriter.h"              // for TraceWriter
+#include "Watchdog.h"                 // for Watchdog
 #include "parts/Board.h"              // for Board
+#include "parts/printers/Prusa_MK3SMMU2.h" // for Prusa_MK3SMMU2
 #include "sim_avr.h"                  // for avr_t
 #include "tclap/MultiArg.h"           // for MultiArg
 #include "tclap/MultiSwitchArg.h"     // for MultiSwitchArg
@@ -48,6 +88,7 @@
 #include "tclap/UnlabeledValueArg.h"  // for UnlabeledValueArg
 #include "tclap/ValueArg.h"           // for ValueArg
 #include "tclap/ValuesConstraint.h"   // for ValuesConstraint
+#include "uart_pty.h"                 // for uart_pty
 #include <gitversion/version.h>
 
 int window = 0;
@@ -57,6 +98,9 @@ atomic_int iWinH{0}, iWinW{0};
 Printer *printer = nullptr;
 Boards::Board *pBoard = nullptr;
 
+// All printers in this process when using --instances. The first is printer/pBoard above.
+vector<Printer*> vPrinters;
+
 bool m_bStopping = false;
 
 // Exit cleanly on ^C
@@ -65,8 +109,8 @@ void OnSigINT(int iSig) {
 	{
 		printf("Caught SIGINT... stopping...\n");
 		m_bStopping = true;
-		if (printer)
-			printer->OnKeyPress('q',0,0);
+		for (auto p : vPrinters)
+			p->OnKeyPress('q',0,0);
 	}
 	else
 	{
@@ -93,6 +137,12 @@ GLErrorCB( GLenum source,
 
 atomic_bool bIsQuitting {false};
 
+// Frame pacing: frames are only rendered when something flagged a visible change (or once
+// a second regardless), and the timer backs off so drawing stays under about half a core.
+static constexpr int iMinFrameMs = 33, iMaxFrameMs = 200, iIdleRefreshMs = 1000;
+int iLastFrameMs = 0, iLastDrawAt = 0;
+Metric mtrFrameMs;
+
 void displayCB(void)		/* function called whenever redisplay needed */
 {
 	if (bIsQuitting || pBoard->GetQuitFlag()) // Stop drawing if shutting down.
@@ -101,6 +151,7 @@ void displayCB(void)		/* function called whenever redisplay needed */
 		glutLeaveMainLoop();
 		return;
 	}
+	int iStart = glutGet(GLUT_ELAPSED_TIME);
 	glLoadIdentity();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	int iW = glutGet(GLUT_WINDOW_WIDTH);
@@ -133,10 +184,14 @@ void displayCB(void)		/* function called whenever redisplay needed */
 
 	}
 	glutSwapBuffers();
+	iLastFrameMs = glutGet(GLUT_ELAPSED_TIME) - iStart;
+	mtrFrameMs.Set(iLastFrameMs);
+	RenderQuality::OnFrame(iLastFrameMs);
 }
 
 void keyCB(unsigned char key, int x, int y)	/* called on key press */
 {
+	RedrawFlag::Set();
 	switch(key)
 	{
 		case '+':
@@ -154,15 +209,17 @@ void keyCB(unsigned char key, int x, int y)	/* called on key press */
 
 void MouseCB(int button, int action, int x, int y)	/* called on key press */
 {
+	RedrawFlag::Set();
 	printer->OnMousePress(button,action,x,y);
 }
 
 void MotionCB(int x, int y)
 {
+	RedrawFlag::Set();
 	printer->OnMouseMove(x,y);
 }
 
-// gl timer. if the lcd is dirty, refresh display
+// gl timer. if anything visible changed, refresh display
 void timerCB(int i)
 {
 	if (bIsQuitting)
@@ -170,8 +227,13 @@ void timerCB(int i)
 	glutSetWindow(window);
 	if (iWinH!=glutGet(GLUT_WINDOW_HEIGHT) || iWinW != glutGet(GLUT_WINDOW_WIDTH))
 		glutReshapeWindow(iWinW, iWinH);
-	glutTimerFunc(50, timerCB, i^1);
-	glutPostRedisplay();
+	glutTimerFunc(min(iMaxFrameMs, max(RenderQuality::GetMinFrameMs(iMinFrameMs), 2*iLastFrameMs)), timerCB, i^1);
+	int iNow = glutGet(GLUT_ELAPSED_TIME);
+	if (RedrawFlag::Take() || pBoard->GetQuitFlag() || iNow - iLastDrawAt >= iIdleRefreshMs)
+	{
+		iLastDrawAt = iNow;
+		glutPostRedisplay();
+	}
 }
 
 
@@ -234,10 +296,34 @@ int main(int argc, char *argv[])
 	cmd.add(argSpam);
 	ValueArg<int> argVCDRate("","tracerate", "Sets the logging frequency of the VCD trace (default 100uS)",false, 100,"integer");
 	cmd.add(argVCDRate);
+	vector<string> vstrTraceFmt = {"vcd","events","bin"};
+	ValuesConstraint<string> vcTraceFmt(vstrTraceFmt);
+	ValueArg<string> argTraceFmt("","traceformat","Trace output format. vcd samples at --tracerate. events logs every change at its exact cycle to a VCD. bin does the same in a compact binary format that is much faster to write; convert it with --convert-trace.",false,"vcd",&vcTraceFmt);
+	cmd.add(argTraceFmt);
+	ValueArg<unsigned int> argTraceChunk("","trace-chunk","With --traceformat events or bin, cuts the trace into gzipped files of this many seconds of simulated time (compressed on worker threads), listed with their cycle ranges in a .index file, so long traces stay manageable and a window can be opened on its own.",false,0,"seconds");
+	cmd.add(argTraceChunk);
+	ValueArg<string> argConvert("","convert-trace","Converts the given binary trace file to VCD (same name, .vcd extension) and exits.",false,"","filename.trace");
+	cmd.add(argConvert);
+	ValueArg<string> argCoordinator("","cluster-coordinator","Serves the --cluster-jobs list to MK404 --cluster-worker processes connecting on this [host:]port, collects their results and exits (0 if every job passed). See utility/Cluster.h for the protocol.",false,"","[host:]port");
+	cmd.add(argCoordinator);
+	ValueArg<string> argClusterJobs("","cluster-jobs","For --cluster-coordinator, the jobs: one '<name> <MK404 arguments>...' per line, where an @<path> argument is a file (firmware, script, SD image...) to send to the workers.",false,"","filename");
+	cmd.add(argClusterJobs);
+	ValueArg<string> argClusterResults("","cluster-results","For --cluster-coordinator, where each job's output and files go, in a directory per job name (default cluster_results)",false,"cluster_results","directory");
+	cmd.add(argClusterResults);
+	ValueArg<string> argWorker("","cluster-worker","Runs jobs from the --cluster-coordinator at host:port, waiting for it to come up, until it has no more.",false,"","host:port");
+	cmd.add(argWorker);
+	ValueArg<unsigned int> argWorkerSlots("","cluster-slots","For --cluster-worker, how many jobs to run at once (default: one per CPU)",false,0,"integer");
+	cmd.add(argWorkerSlots);
+	ValueArg<string> argWorkerDir("","cluster-cache","For --cluster-worker, where inputs, job directories and the result cache are kept (default mk404_cluster)",false,"mk404_cluster","directory");
+	cmd.add(argWorkerDir);
 	MultiArg<string> argVCD("t","trace","Enables VCD traces for the specified categories or IRQs. use '-t ?' to get a printout of available traces",false,"string");
 	cmd.add(argVCD);
-	ValueArg<string> argSD("","sdimage","Use the given SD card .img file instead of the default", false ,"", "filename.img");
+	ValueArg<string> argSD("","sdimage","Use the given SD card .img file instead of the default. A directory is presented as a read-only FAT32 card with its contents", false ,"", "filename.img");
 	cmd.add(argSD);
+	SwitchArg argSDLazyCRC("","sd-lazy-crc","Only compute the CRCs of SD card reads once the firmware turns CRC checking on (CMD59), sending 0xFFFF until then, as firmwares in SPI mode don't check them.");
+	cmd.add(argSDLazyCRC);
+	SwitchArg argSDOverlay("","sd-overlay","Mount the SD image read-only and keep the card's writes in memory, so several simulators can share one base image. Implied by --instances.");
+	cmd.add(argSDOverlay);
 	SwitchArg argSerial("s","serial","Connect a printer's serial port to a PTY instead of printing its output to the console.");
 	cmd.add(argSerial);
 	SwitchArg argScriptHelp("","scripthelp", "Prints the available scripting commands for the current printer/context",false);
@@ -254,18 +340,136 @@ int main(int argc, char *argv[])
 	ValuesConstraint<string> vcSizes(vstrSizes);
 	ValueArg<string> argImgSize("","image-size","Specify a size for a new SD image. You must specify an image with --sdimage",false,"256M",&vcSizes);
 	cmd.add(argImgSize);
-	SwitchArg argGDB("","gdb","Enable SimAVR's GDB support");
+	MultiArg<string> argImgAdd("","image-add","With --image-size, a file (e.g. gcode) to copy into the root of the new image. May be given more than once.",false,"filename");
+	cmd.add(argImgAdd);
+	SwitchArg argGDB("","gdb","Starts halted, waiting for avr-gdb on port 1234 (target remote :1234). Breakpoints and write watchpoints cost little, so it can stay attached through long runs.");
 	cmd.add(argGDB);
+	ValueArg<unsigned int> argBatch("","batch","Number of AVR instructions to run between host-side updates (scripts, menus, input). Larger values run faster but respond more coarsely. (default 1)",false,1,"integer");
+	cmd.add(argBatch);
+	ValueArg<float> argSpeed("","speed","Run the simulated MCU at this multiple of real time, e.g. 1 for real-time or 10 for 10x. 0 runs as fast as possible. (default 0)",false,0,"float");
+	cmd.add(argSpeed);
+	ValueArg<float> argThermalScale("","thermal-scale","Runs the heaters' thermal model this many times faster than the MCU, e.g. 10 to heat (and cool) in a tenth of the simulated time, for tests that are not about the heaters. The firmware's PID sees a faster plant, so expect more overshoot at high values; keep 1 for thermal tests. (default 1)",false,1.f,"float");
+	cmd.add(argThermalScale);
+	ValueArg<float> argFrameBudget("","frame-budget","Holds drawing to about this many milliseconds per frame by turning off multisampling, simplifying the print, lowering the 3D view's resolution and the frame rate in steps as needed, and back as it recovers. Leaves more CPU for the simulation on slow or shared machines. 0 keeps full quality. (default 0)",false,0.f,"ms");
+	cmd.add(argFrameBudget);
+	ValueArg<unsigned int> argLockstep("","lockstep","Runs multi-MCU printers (e.g. with an MMU) in step, syncing the boards every N us of simulated time so their interaction is repeatable. They still run on separate cores. 0 lets them run freely. (default 0)",false,0,"integer");
+	cmd.add(argLockstep);
+	SwitchArg argMMUModel("","mmu-model","Replaces the MMU's MM-control-01 board (a second simulated AVR) on MMU printers with a behavioural model that answers the same serial protocol and moves the selector, idler, pulley and FINDA with about the real timings. It never fails a load, so the MMU firmware's error handling needs the real board.");
+	cmd.add(argMMUModel);
+	ValueArg<unsigned int> argMMUSameThread("","mmu-same-thread","Runs the MMU board on the printer's AVR thread instead of its own, the two taking turns every N us of simulated time (each running as many cycles as its clock does in that). Uses one core and keeps the boards in step. 0 gives the MMU its own thread. (default 0)",false,0,"integer");
+	cmd.add(argMMUSameThread);
+	ValueArg<unsigned int> argStepCoalesce("","step-coalesce","Limits how often each stepper driver reports its position to the rest of the printer (visuals, PINDA, etc.) while stepping, to at most once every N us of simulated time. Direction changes, stalls and stopping always report immediately. 0 reports every step. (default 0)",false,0,"integer");
+	cmd.add(argStepCoalesce);
+	ValueArg<unsigned int> argUARTTurbo("","uart-turbo","Moves serial bytes on the host-connected UARTs (the PTYs) every N AVR cycles, ignoring the baud rate the firmware set, e.g. 160 for ten times 115200 baud at 16 MHz. Reception is still limited by the UART's FIFO and how fast the firmware reads it. 0 keeps baud timing. (default 0)",false,0,"cycles");
+	cmd.add(argUARTTurbo);
+	SwitchArg argGCodeLatency("","gcode-latency","Times every G-code command from the end of its line to the firmware's \"ok\" (host serial, and the MMU link if present) and prints a per-command summary at exit.");
+	cmd.add(argGCodeLatency);
+	ValueArg<string> argGCodeStream("","gcode-stream","Prints the G-code file over the host serial port from inside the simulator, as a host program would (line numbers, checksums, one line per \"ok\", resends), starting when the firmware prints \"start\". Scripts can wait for the end with GCodeStream::WaitForFinish.",false,"","filename");
+	cmd.add(argGCodeStream);
+	SwitchArg argStackGuard("","stack-guard","Paints the MCU's free SRAM at boot and watches the stack pointer. Reports the lowest SP and untouched RAM at exit, and flags (and fails any script on) the stack running into the heap or static data, using __heap_start/__brkval from the ELF/AFX firmware. Adds the low-water mark to the telemetry (Misc).");
+	cmd.add(argStackGuard);
+	MultiArg<string> argFWVar("","fw-var","Adds a firmware global, found by name in the ELF/AFX symbols, to the telemetry (Misc) as <board>_fw_<name>. Format: name[+offset][:type], type one of u8 u16 u32 i8 i16 i32 f (floats times 256). Sampled at --fw-var-rate.",false,"string");
+	cmd.add(argFWVar);
+	ValueArg<unsigned int> argFWVarRate("","fw-var-rate","How often --fw-var variables are sampled, in us of AVR time (default 1000)",false,1000,"integer");
+	cmd.add(argFWVarRate);
+	SwitchArg argISRStats("","isr-stats","Accounts the cycles spent in each of the MCU's interrupt vectors (entries, total/self time, worst duration, worst latency from flag to vector, nesting) and prints the budget at exit or on Board::PrintISRStats. Also adds the running/pending vector to the telemetry (Misc).");
+	cmd.add(argISRStats);
+	SwitchArg argStepTiming("","step-timing","Analyses every driver's steps as they happen: interval and jitter (against the ideal smooth profile) histograms, peak speed and acceleration. Each move's worst jitter, speed and acceleration go to the telemetry (Stepper, e.g. X_step_timing.jitter_ns); <axis>::PrintStepTiming prints the totals.");
+	cmd.add(argStepTiming);
+	SwitchArg argIdleSkip("","idle-skip","Fast-forwards the MCU clock while the firmware spins in a polling loop (waiting on a flag or status bit) that only a timer or interrupt can end, up to the next of those. Heating waits and dwells then take a fraction of the host time. Prints how much was skipped at exit.");
+	cmd.add(argIdleSkip);
+	ValueArg<unsigned int> argProfile("","profile-pc","Samples the MCU's program counter every N cycles and writes a per-function profile (symbolized from the ELF/AFX firmware) and flamegraph-ready collapsed stacks, split by interrupt vector, to <board>_profile.txt/.folded at exit. 0 disables. (default 0)",false,0,"cycles");
+	cmd.add(argProfile);
+	SwitchArg argCoverage("","coverage","Records which firmware instructions run and merges that into <board>_coverage.cov at exit, so it adds up over runs. Also writes the per-function totals to <board>_coverage.txt and, with DWARF line info in the ELF/AFX, lcov lines to <board>_coverage.info.");
+	cmd.add(argCoverage);
+	ValueArg<unsigned int> argPerf("","perfstats","Collects performance counters (cycles, instructions, timers and per-IRQ raise rates) and dumps them to stderr as JSON every N ms. 0 collects without dumping, see TelHost::PrintPerf().",false,0,"integer");
+	cmd.add(argPerf);
+	ValueArg<unsigned int> argFlight("","flight-recorder","Keeps the last N seconds (AVR time) of every telemetry signal in memory, whatever -t says, and writes them out as a VCD when the script fails or times out, the AVR crashes, or on TelHost::DumpFlightRecorder(). 0 disables. (default 0)",false,0,"integer");
+	cmd.add(argFlight);
+	MultiArg<string> argTelStats("","tel-stats","Keeps min/max/mean, change counts and time nonzero of the telemetry whose names start with this (see '-t ?'), without a trace file. Printed at exit and exported with --metrics/--statsd, see also TelHost::PrintStats().",false,"string");
+	cmd.add(argTelStats);
+	ValueArg<unsigned int> argInstances("","instances","Runs this many printers in one process, each on its own AVR thread with its own scripting and telemetry. Implies --headless (unless --farm). Instances past the first store their flash/EEPROM/traces under a numbered name, but share any --sdimage (as an overlay, see --sd-overlay).",false,1,"integer");
+	cmd.add(argInstances);
+	SwitchArg argFarm("","farm","With --instances, shows all the printers in one 3D window (lite visuals, each with its LCD) instead of running headless. Keys pressed there go to every printer, 'r' resets the view.");
+	cmd.add(argFarm);
+	ValueArg<string> argForkServer("","fork-server","Boots the printer once, running --script (if given) to its end as a warm-up, then serves runs on this Unix socket: each RUN request forks a copy-on-write child from that state to run its own script. Implies --headless. See utility/ForkServer.h for the protocol.",false,"","socket");
+	cmd.add(argForkServer);
+	ValueArg<string> argScriptBatch("","script-batch","Sets the printer up once and runs each script listed in this file (one per line, # comments) in turn, each from the power-on state (a snapshot taken before the first), with the SD card's writes discarded in between. Implies --headless and --sd-overlay, flash and EEPROM changes aren't saved. Exits as a --script run would for the first that didn't finish.",false,"","list.txt");
+	cmd.add(argScriptBatch);
+	ValueArg<string> argScriptBatchReport("","script-batch-report","Writes the --script-batch results here, as JUnit XML if the name ends in .xml, JSON otherwise.",false,"","file");
+	cmd.add(argScriptBatchReport);
+	ValueArg<string> argRemote("","remote","Takes script lines (Context::Action(args)) as commands and streams subscribed telemetry on this Unix socket, or on localhost with tcp:<port>, while the printer runs (the first one with --instances). See utility/RemoteControl.h for the protocol.",false,"","socket");
+	cmd.add(argRemote);
+	ValueArg<string> argMetrics("","metrics","Serves live metrics (real-time factor, cycle rate, serial queues, temperatures, stepper positions, SD I/O, frame times) for Prometheus to scrape, over HTTP on [host:]port.",false,"","[host:]port");
+	cmd.add(argMetrics);
+	ValueArg<string> argStatsD("","statsd","Pushes the --metrics values as StatsD gauges (with DogStatsD tags) to host:port over UDP once a second.",false,"","host:port");
+	cmd.add(argStatsD);
+	ValueArg<unsigned int> argCaptureMs("","capture-interval","With --capture, also takes a snapshot every N ms of simulated time. 0 only captures on the Capture script actions and at exit. (default 0)",false,0,"integer");
+	cmd.add(argCaptureMs);
+	ValueArg<unsigned int> argCheckpointMs("","checkpoint-ms","Checkpoints the whole simulation in memory every N ms of simulated time, so the Board::RewindTo/Rewind script actions can go back and replay from there. 0 disables. (default 0)",false,0,"integer");
+	cmd.add(argCheckpointMs);
+	ValueArg<unsigned int> argCheckpointKeep("","checkpoint-keep","How many --checkpoint-ms checkpoints to keep, the oldest go first. (default 600)",false,600,"integer");
+	cmd.add(argCheckpointKeep);
+	ValueArg<string> argRecordInputs("","record-inputs","Records every external input (serial bytes, keys, mouse, menu picks) with the AVR cycle it arrived in, for --replay-inputs.",false,"","file");
+	cmd.add(argRecordInputs);
+	ValueArg<string> argReplayInputs("","replay-inputs","Replays a --record-inputs file at the recorded cycles, ignoring live input, so the run repeats bit-exactly given the same firmware, flash, EEPROM and SD images.",false,"","file");
+	cmd.add(argReplayInputs);
+	ValueArg<unsigned int> argReplayParallel("","replay-parallel","With --replay-inputs and --checkpoint-ms, replays without tracing as a scout that forks a copy at each checkpoint to run the next segment with the -t trace on, this many at a time, each in its own segment_<N> directory. Every segment's end state is checked against the scout's. Implies --headless. (default 0, off)",false,0,"jobs");
+	cmd.add(argReplayParallel);
+	ValueArg<string> argToolpath("","toolpath","Streams the nozzle path (X/Y/Z/E and MMU tool, merged over straight runs) to this file as it prints, from a writer thread, for prints of any length. Works with --headless.",false,"","file");
+	cmd.add(argToolpath);
+	ValueArg<string> argLCDMirror("","lcd-mirror","Shows the LCD on this terminal (-) or in a file as it changes, for --headless runs. A terminal gets the screen pinned at the top with just the changed characters redrawn, a file or pipe the whole screen as text each time.",false,"","file|-");
+	cmd.add(argLCDMirror);
+	ValueArg<unsigned int> argLCDMirrorRate("","lcd-mirror-rate","The most times a (wall clock) second --lcd-mirror shows the LCD. (default 10)",false,10,"integer");
+	cmd.add(argLCDMirrorRate);
+	ValueArg<string> argShmExport("","shm-export","Publishes each MCU's data space (registers, I/O, SRAM), EEPROM and a status block (cycle, PC, SP, SREG) in the POSIX shared memory segment /<name>_<board>_<mcu> (e.g. /<name>_Einsy_atmega2560, _N appended for further instances), behind a sequence lock, for other processes to read without stopping it. Layout in utility/ShmExport.h.",false,"","name");
+	cmd.add(argShmExport);
+	ValueArg<unsigned int> argShmExportUs("","shm-export-us","How often (in AVR microseconds) --shm-export takes a snapshot. (default 1000)",false,1000,"integer");
+	cmd.add(argShmExportUs);
+	MultiArg<string> argEEPROMProfile("","eeprom-profile","Patches the printer's EEPROM at startup, e.g. --eeprom-profile calibrated to skip the language prompt, wizard and calibrations, or field=value (e.g. sheet1.z=-250) for one setting, applied in order. May be given more than once. The changes persist to the EEPROM file. Use '--eeprom-profile ?' for the list.",false,"profile|field=value");
+	cmd.add(argEEPROMProfile);
+	MultiArg<string> argThread("","thread","Names the simulator's threads and places them by role (avr, gl, io, audio, worker): role:cpus=LIST, :pin=LIST (one CPU each, in turn), :fifo=PRIORITY and/or :nice=N, e.g. --thread avr:pin=2-7 --thread gl:cpus=0-1. May be given more than once. Use '--thread ?' for details.",false,"role:key=value");
+	cmd.add(argThread);
+	ValueArg<unsigned int> argWatchdog("","watchdog","Reports any board that goes this many seconds without executing a cycle while it is neither paused nor halted by gdb, with its PC, script line, lock contention and (on Linux) every thread's stack. 0 is off. (default 0)",false,0,"seconds");
+	cmd.add(argWatchdog);
+	ValueArg<float> argWatchdogRTF("","watchdog-rtf","With --watchdog, also reports a board that runs slower than this multiple of real time over the watchdog's window, e.g. 0.1. (default 0, stalls only)",false,0.f,"float");
+	cmd.add(argWatchdogRTF);
+	ValueArg<string> argStartupTrace("","startup-trace","Writes a timeline of startup (argument parsing, creating the boards, loading firmware and EEPROM, GL and model setup, PTYs, up to the firmware printing \"start\") to this file as a Chrome trace, for chrome://tracing or Perfetto.",false,"","file.json");
+	cmd.add(argStartupTrace);
+	ValueArg<string> argResultCache("","result-cache","Keeps the outcome of --script runs in this directory, keyed by a hash of the MK404 version, the command line and its input files (firmware, script, SD image, EEPROM and flash state...). A run seen before is not simulated: its console output, exit code and the files it wrote are replayed from the cache. Headless runs only.",false,"","directory");
+	cmd.add(argResultCache);
+	ValueArg<string> argToolpathConvert("","toolpath-convert","Converts a --toolpath recording to an STL of its extrusions (same name, .stl extension), or with --toolpath-expect compares it against a G-code file, and exits.",false,"","file");
+	cmd.add(argToolpathConvert);
+	ValueArg<string> argToolpathExpect("","toolpath-expect","With --toolpath-convert, the sliced G-code to compare the recording's extrusions against instead, failing if any stray further than --toolpath-tolerance.",false,"","file.gcode");
+	cmd.add(argToolpathExpect);
+	ValueArg<string> argToolpathCheck("","toolpath-check","Follows this G-code file (the one being printed) along the toolpath while printing, reporting each deviation as it starts, and at exit the deviations, expected moves missed and time against the feed rates. Needs no --toolpath file.",false,"","file.gcode");
+	cmd.add(argToolpathCheck);
+	ValueArg<float> argToolpathTol("","toolpath-tolerance","The distance (mm) for --toolpath-expect and --toolpath-check. (default 0.1)",false,0.1f,"mm");
+	cmd.add(argToolpathTol);
+	ValueArg<string> argCapture("","capture","Writes PNG snapshots (top and front views) of the simulated print into this directory, at exit and on the Capture::Capture script action. Works with --headless.",false,"","directory");
+	cmd.add(argCapture);
+	SwitchArg argHeadless("","headless","Run without any GL/GLUT window or menus (implies -g none). Execution continues until the printer quits, e.g. via ^C or a script.");
+	cmd.add(argHeadless);
 	vector<string> vstrGfx = {"none","lite","fancy", "bear"};
 	ValuesConstraint<string> vcGfxAllowed(vstrGfx);
 	ValueArg<string> argGfx("g","graphics","Whether to enable fancy (advanced) or lite (minimal advanced) visuals. If not specified, only the basic 2D visuals are shown.",false,"lite",&vcGfxAllowed);
 	cmd.add(argGfx);
 	ValueArg<string> argFW("f","firmware","hex/afx/elf Firmware file to load (default MK3S.afx)",false,"MK3S.afx","filename");
 	cmd.add(argFW);
-	MultiSwitchArg argDebug("d","debug","Increases debugging output, where supported.");
+	MultiSwitchArg argDebug("d","debug","Increases debugging output, where supported: once for the debug log level, twice for trace (see --log).");
 	cmd.add(argDebug);
+	ValueArg<string> argLog("","log","Log levels (error, warning, info, debug, trace), comma separated: a level on its own for everything, Module=level for one, e.g. warning,TMC2130=trace. Applied after -d.",false,"","levels");
+	cmd.add(argLog);
+	ValueArg<string> argLogFile("","log-file","Writes the log to this file instead of the console, one \"<cycle> <level> <module>: <text>\" line per record.",false,"","file");
+	cmd.add(argLogFile);
+	SwitchArg argLogBinary("","log-binary","With --log-file, writes compact binary records instead of text (see utility/Log.cpp for the layout).");
+	cmd.add(argLogBinary);
 	SwitchArg argBootloader("b","bootloader","Run bootloader on first start instead of going straight to the firmware.");
 	cmd.add(argBootloader);
+	SwitchArg argFastBoot("","fastboot","Boots straight into the firmware (even with -b) with MCUSR reading as a power-on reset, and returns at once from any --fastboot-skip function called before the firmware reaches loop().");
+	cmd.add(argFastBoot);
+	MultiArg<string> argFastBootSkip("","fastboot-skip","With --fastboot, a firmware function (by ELF/AFX symbol, e.g. lcd_splash) to skip during boot. It must return nothing, and boot must be fine without it.",false,"symbol");
+	cmd.add(argFastBootSkip);
 	SwitchArg argMD("","markdown","Used to auto-generate the items in refs/ as markdown");
 	cmd.add(argMD);
 	vector<string> vstrPrinters = PrinterFactory::GetModels();
@@ -283,7 +487,19 @@ int main(int argc, char *argv[])
 		printf("***************************************\n");
 	}
 
+	uint64_t uiParse = StartupTimeline::Now();
 	cmd.parse(argc,argv);
+	StartupTimeline::Add("command line", uiParse, StartupTimeline::Now());
+	StartupTimeline::SetFile(argStartupTrace.getValue());
+
+	if (argThread.isSet() && argThread.getValue().at(0).compare("?")==0)
+	{
+		ThreadPolicy::PrintHelp();
+		return 0;
+	}
+	if (!ThreadPolicy::Configure(argThread.getValue()))
+		return 1;
+	ThreadPolicy::Apply(ThreadPolicy::Role::GL, "mk404"); // The main thread runs the GLUT loop.
 
 	// Make new image.
 	if (argImgSize.isSet())
@@ -293,15 +509,173 @@ int main(int argc, char *argv[])
 			fprintf(stderr,"Cannot create an SD image without a filename.\n");
 			exit(1);
 		}
-		FatImage::MakeFatImage(argSD.getValue(), argImgSize.getValue());
+		if (!FatImage::MakeFatImage(argSD.getValue(), argImgSize.getValue(), argImgAdd.getValue()))
+			return 1;
 		printf("Wrote %s. You can now use mcopy to copy gcode files into the image.\n",argSD.getValue().c_str());
 		return 0;
 	}
-	bool bNoGraphics = argGfx.isSet() && (argGfx.getValue().compare("none")==0);
+	if (argConvert.isSet())
+	{
+		string strOut = argConvert.getValue();
+		strOut.replace(strOut.rfind('.') == string::npos ? strOut.size() : strOut.rfind('.'), string::npos, ".vcd");
+		return TraceWriter::ConvertToVCD(argConvert.getValue(), strOut) ? 0 : 1;
+	}
+	if (argCoordinator.isSet())
+	{
+		if (!argClusterJobs.isSet())
+		{
+			fprintf(stderr, "ERROR: --cluster-coordinator needs a --cluster-jobs list.\n");
+			return 1;
+		}
+		return Cluster::Coordinate(argCoordinator.getValue(), argClusterJobs.getValue(), argClusterResults.getValue());
+	}
+	if (argWorker.isSet())
+		return Cluster::Work(argWorker.getValue(), argWorkerDir.getValue(), argWorkerSlots.getValue());
+	if (argToolpathConvert.isSet())
+	{
+		if (argToolpathExpect.isSet())
+			return ToolpathWriter::Compare(argToolpathConvert.getValue(), argToolpathExpect.getValue(), argToolpathTol.getValue()) ? 0 : 1;
+		string strOut = argToolpathConvert.getValue();
+		strOut.replace(strOut.rfind('.') == string::npos ? strOut.size() : strOut.rfind('.'), string::npos, ".stl");
+		return ToolpathWriter::ConvertToSTL(argToolpathConvert.getValue(), strOut) ? 0 : 1;
+	}
+
+	unsigned int uiInstances = max(argInstances.getValue(),1U);
+	bool bFarm = argFarm.isSet() && !argHeadless.isSet() && !argForkServer.isSet();
+	bool bHeadless = argHeadless.isSet() || (uiInstances>1 && !bFarm) || argForkServer.isSet() || argReplayParallel.isSet() || argScriptBatch.isSet();
+	bool bNoGraphics = bHeadless || bFarm || (argGfx.isSet() && (argGfx.getValue().compare("none")==0)); // The farm has its own window, without menus.
+	FarmView::SetEnabled(bFarm);
+	MMU2Model::SetEnabled(argMMUModel.isSet());
+	bool bMMUBoard = argModel.getValue().find("MMU")!=string::npos && !argMMUModel.isSet(); // A second AVR, on its own thread.
+	Prusa_MK3SMMU2::SetSameThreadUs(argMMUSameThread.getValue());
+	SDCard::SetDefaultOverlay(argSDOverlay.isSet() || uiInstances>1 || argScriptBatch.isSet());
+	SDCard::SetLazyCRC(argSDLazyCRC.isSet());
+	if ((argRecordInputs.isSet() || argReplayInputs.isSet()) && bMMUBoard && argLockstep.getValue()==0 && argMMUSameThread.getValue()==0)
+	{
+		printf("Input record/replay needs the MMU to run in step, using --lockstep 100\n");
+		Lockstep::SetDefaultQuantum(100);
+	}
+	else
+		Lockstep::SetDefaultQuantum(argLockstep.getValue());
+	TMC2130::SetDefaultCoalesce(argStepCoalesce.getValue());
+	uart_pty::SetDefaultTurbo(argUARTTurbo.getValue());
+	uart_pty::SetNoPtys(argForkServer.isSet() || argReplayParallel.getValue());
+	Heater::SetTimeScale(argThermalScale.getValue());
+	RenderQuality::SetBudget(argFrameBudget.getValue());
+	PCProfiler::SetDefaultInterval(argProfile.getValue());
+	Coverage::SetEnabled(argCoverage.isSet());
+	FastBoot::SetEnabled(argFastBoot.isSet());
+	FastBoot::SetSkipList(argFastBootSkip.getValue());
+	ISRStats::SetEnabled(argISRStats.isSet());
+	StepTiming::SetEnabled(argStepTiming.isSet());
+	StackGuard::SetEnabled(argStackGuard.isSet());
+	if (!FirmwareVars::SetDefaults(argFWVar.getValue(), argFWVarRate.getValue()))
+		return 1;
+	IdleSkip::SetEnabled(argIdleSkip.isSet());
+	Watchdog::SetDefaults(argWatchdog.getValue(), argWatchdogRTF.getValue());
+	ParallelReplay::SetDefaults(argReplayParallel.getValue(), argVCD.isSet());
+	GCodeSniffer::SetLatencyStats(argGCodeLatency.getValue());
+	GCodeStreamer::SetDefaultFile(argGCodeStream.getValue());
+	PrintCapture::SetDefaults(argCapture.getValue(), argCaptureMs.getValue());
+	ToolpathWriter::SetDefaultFile(argToolpath.getValue());
+	ToolpathWriter::SetCheck(argToolpathCheck.getValue(), argToolpathTol.getValue());
+	LCDMirror::SetDefaults(argLCDMirror.getValue(), argLCDMirrorRate.getValue());
+	ShmExport::SetDefaults(argShmExport.getValue(), argShmExportUs.getValue());
+	if (argEEPROMProfile.isSet() && argEEPROMProfile.getValue().at(0).compare("?")==0)
+	{
+		EEPROMProfile::PrintHelp();
+		return 0;
+	}
+	if (!EEPROMProfile::Validate(argEEPROMProfile.getValue()))
+		return 1;
+	EEPROMProfile::SetDefaults(argEEPROMProfile.getValue());
+	Boards::Board::SetCheckpoints(argCheckpointMs.getValue(), argCheckpointKeep.getValue());
 
 	TelemetryHost::GetHost()->SetCategories(argVCD.getValue());
+	if (argTraceFmt.getValue().compare("bin")==0)
+		TelemetryHost::GetHost()->SetTraceFormat(TelemetryHost::TraceFormat::Binary);
+	else if (argTraceFmt.getValue().compare("events")==0)
+		TelemetryHost::GetHost()->SetTraceFormat(TelemetryHost::TraceFormat::Events);
+	else if (argTraceChunk.getValue())
+	{
+		fprintf(stderr, "ERROR: --trace-chunk needs --traceformat events or bin, simavr's sampled VCD can't be split.\n");
+		return 1;
+	}
+	TelemetryHost::GetHost()->SetTraceChunks(argTraceChunk.getValue());
+	if (argPerf.isSet())
+		TelemetryHost::GetHost()->SetPerfStats(argPerf.getValue());
+	TelemetryHost::GetHost()->SetFlightRecorder(argFlight.getValue());
+	TelemetryHost::GetHost()->SetStats(argTelStats.getValue());
 
-	ScriptHost::Init();
+	if (uiInstances>1 && bMMUBoard)
+	{
+		fprintf(stderr, "ERROR: --instances does not support MMU printers (unless --mmu-model), the MMU can only be instantiated once.\n");
+		return 1;
+	}
+	if (argForkServer.isSet() && (uiInstances>1 || bMMUBoard || argVCD.isSet() || argSerial.isSet()
+		|| argGDB.isSet() || argGCodeLatency.isSet() || argCapture.isSet() || argToolpath.isSet() || argToolpathCheck.isSet() || argRemote.isSet() || argMetrics.isSet() || argStatsD.isSet() || argShmExport.isSet()))
+	{
+		fprintf(stderr, "ERROR: --fork-server needs a single printer without an MMU board (--mmu-model is fine) and can't be used with -t, -s, --gdb, --gcode-latency, --capture, --toolpath(-check), --remote, --metrics, --statsd or --shm-export, their threads don't survive a fork. For the same reason it opens no serial PTYs.\n");
+		return 1;
+	}
+	if (argScriptBatch.isSet() && (uiInstances>1 || bMMUBoard || argScript.isSet() || argForkServer.isSet() || argRecordInputs.isSet() || argReplayInputs.isSet() || argFastBoot.isSet()))
+	{
+		fprintf(stderr, "ERROR: --script-batch needs a single printer without an MMU board (--mmu-model is fine), takes its scripts from the list rather than --script, and can't be used with --fork-server, --record/replay-inputs or --fastboot (its boot skips only apply to the first script).\n");
+		return 1;
+	}
+	if ((argRecordInputs.isSet() || argReplayInputs.isSet()) && (uiInstances>1 || argForkServer.isSet() || (argRecordInputs.isSet() && argReplayInputs.isSet())))
+	{
+		fprintf(stderr, "ERROR: --record-inputs/--replay-inputs take one printer, one of them at a time, and can't be used with --instances or --fork-server.\n");
+		return 1;
+	}
+	if (argReplayParallel.getValue() && (!argReplayInputs.isSet() || argCheckpointMs.getValue()==0 || uiInstances>1 || bMMUBoard || argSerial.isSet() || argGDB.isSet()
+		|| argGCodeLatency.isSet() || argCapture.isSet() || argToolpath.isSet() || argToolpathCheck.isSet() || argRemote.isSet() || argMetrics.isSet() || argStatsD.isSet()
+		|| argShmExport.isSet() || argWatchdog.getValue()))
+	{
+		fprintf(stderr, "ERROR: --replay-parallel needs --replay-inputs and --checkpoint-ms, a single printer without an MMU board (--mmu-model is fine), and can't be used with -s, --gdb, --gcode-latency, --capture, --toolpath(-check), --remote, --metrics, --statsd, --shm-export or --watchdog, their threads don't survive a fork. For the same reason it opens no serial PTYs.\n");
+		return 1;
+	}
+	unique_ptr<ResultCache> pResultCache;
+	if (argResultCache.isSet())
+	{
+		if (!argScript.isSet() || !bHeadless || argForkServer.isSet() || argWait.isSet() || argSerial.isSet() || argGDB.isSet() || argRemote.isSet())
+			printf("NOTE: --result-cache only applies to --script runs that are --headless, without -s, -w, --gdb, --remote or --fork-server, whose input is all known up front. Running without it.\n");
+		else
+		{
+			pResultCache.reset(new ResultCache(argResultCache.getValue()));
+			pResultCache->AddString(version::VERSION_STRING);
+			pResultCache->AddArgs(argc, argv);
+			for (auto &strIn : {argFW.getValue(), argScript.getValue(), argSD.getValue(), argGCodeStream.getValue(), argReplayInputs.getValue(), argToolpathCheck.getValue()})
+				pResultCache->AddInput(strIn);
+			for (auto &strOut : {argLogFile.getValue(), argToolpath.getValue(), argRecordInputs.getValue(), argCapture.getValue(), argLCDMirror.getValue() == "-" ? "" : argLCDMirror.getValue()})
+				pResultCache->AddOutput(strOut);
+			int iCached = 0;
+			if (pResultCache->Replay(iCached))
+				return iCached;
+			if (!pResultCache->Record())
+				pResultCache.reset();
+		}
+	}
+
+	if (argRecordInputs.isSet() && !InputLog::StartRecording(argRecordInputs.getValue()))
+		return 1;
+	if (argReplayInputs.isSet() && !InputLog::StartReplay(argReplayInputs.getValue()))
+		return 1;
+	if (InputLog::IsRecording() && argRemote.isSet())
+		printf("NOTE: Commands from --remote are not recorded, replay them the same way or script them instead.\n");
+	if (argDebug.getValue()>0)
+		Log::Configure(argDebug.getValue()>1 ? "trace" : "debug");
+	if (argLog.isSet() && !Log::Configure(argLog.getValue()))
+		return 1;
+	if (argLogFile.isSet() && !Log::SetFile(argLogFile.getValue(), argLogBinary.isSet()))
+		return 1;
+	Log::Start();
+	atexit(Log::Stop); // So nothing queued is lost, whichever way we leave.
+
+	if (argMetrics.isSet() && !MetricsExporter::Get().StartPrometheus(argMetrics.getValue()))
+		return 1;
+	if (argStatsD.isSet() && !MetricsExporter::Get().StartStatsD(argStatsD.getValue()))
+		return 1;
 
 	std::string strFW;
 	if (!argLoad.isSet() && !argFW.isSet())
@@ -309,13 +683,48 @@ int main(int argc, char *argv[])
 	else
 		strFW = argFW.getValue();
 
-	void *pRawPrinter = PrinterFactory::CreatePrinter(argModel.getValue(),pBoard,printer,argBootloader.isSet(),argNoHacks.isSet(),argSerial.isSet(), argSD.getValue() ,
-		strFW,argSpam.getValue(), argGDB.isSet(), argVCDRate.getValue()); // this line is the CreateBoard() args.
-
-	pBoard->SetPrimary(true); // This is the primary board, responsible for scripting/dispatch. Blocks contention from sub-boards, e.g. MMU.
+	vector<void*> vRawPrinters;
+	vector<Boards::Board*> vBoards;
+	vector<ScriptHost*> vScriptHosts;
+	vector<TelemetryHost*> vTelHosts;
+	for (unsigned int i=0; i<uiInstances; i++)
+	{
+		// Each instance gets its own hosts, selected while it is created so its parts register with them.
+		// The first uses the defaults, which is what everything else (e.g. GLUT) talks to.
+		if (i>0)
+		{
+			ScriptHost::Select(ScriptHost::Create());
+			TelemetryHost::SetHost(TelemetryHost::CreateHost());
+		}
+		MetricsExporter::SelectInstance(i);
+		ScriptHost::Init();
+		vScriptHosts.push_back(ScriptHost::Get());
+		vTelHosts.push_back(TelemetryHost::GetHost());
+
+		Boards::Board *pNewBoard = nullptr;
+		Printer *pNewPrinter = nullptr;
+		StartupTimeline::Phase phase(uiInstances>1 ? "create printer " + std::to_string(i) : "create printer");
+		void *pRawPrinter = PrinterFactory::CreatePrinter(argModel.getValue(),pNewBoard,pNewPrinter,argBootloader.isSet(),argNoHacks.isSet(),argSerial.isSet(), argSD.getValue(), i,
+			strFW,argSpam.getValue(), argGDB.isSet(), argVCDRate.getValue()); // this line is the CreateBoard() args.
+
+		pNewBoard->SetPrimary(true); // This is the primary board, responsible for scripting/dispatch. Blocks contention from sub-boards, e.g. MMU.
+		pNewBoard->SetHeadless(bNoGraphics); // No GLUT, so no menus to dispatch.
+		pNewBoard->SetBatchSize(argBatch.getValue());
+		pNewBoard->SetSpeedFactor(argSpeed.getValue());
+
+		vRawPrinters.push_back(pRawPrinter);
+		vBoards.push_back(pNewBoard);
+		vPrinters.push_back(pNewPrinter);
+	}
+	ScriptHost::Select(nullptr);
+	TelemetryHost::SetHost(nullptr);
+	MetricsExporter::SelectInstance(0);
+	pBoard = vBoards.front();
+	printer = vPrinters.front();
 
 	if (!bNoGraphics)
 	{
+		StartupTimeline::Phase phase("GL setup");
 		glutInit(&argc, argv);		/* initialize GLUT system */
 
 		std::pair<int,int> winSize = printer->GetWindowSize();
@@ -351,11 +760,31 @@ int main(int argc, char *argv[])
 		glEnable(GL_DEBUG_OUTPUT);
 #endif
 		initGL(iWinW, iWinH);
+		mtrFrameMs.Register("mk404_gl_frame_time_milliseconds", "Time taken to draw the last frame.");
 
 		if (argGfx.isSet())
 			printer->SetVisualType(argGfx.getValue());
 
 
+	}
+	else if (bFarm)
+	{
+		StartupTimeline::Phase phase("GL setup");
+		glutInit(&argc, argv);
+		glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+		auto fcnKey = [](unsigned char c)
+		{
+			for (auto p : vPrinters)
+				p->OnKeyPress(c,0,0);
+		};
+		auto fcnDone = [&vBoards]()
+		{
+			for (auto p : vBoards)
+				if (!p->GetQuitFlag())
+					return false;
+			return true;
+		};
+		FarmView::Get().Open("MK404 farm (" + std::to_string(uiInstances) + " printers)", fcnKey, fcnDone);
 	}
 	if (argVCD.isSet() && argVCD.getValue().at(0).compare("?")==0)
 	{
@@ -369,13 +798,22 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (argScript.isSet())
+	for (unsigned int i=0; i<uiInstances; i++)
 	{
-		if (!ScriptHost::Setup(argScript.getValue(),pBoard->GetAVR()->frequency))
-			return 1; // validate will have printed error info.
+		StartupTimeline::Phase phase("script setup");
+		ScriptHost::Select(vScriptHosts[i]);
+		if (argScript.isSet())
+		{
+			if (!ScriptHost::Setup(argScript.getValue(),vBoards[i]->GetAVR()->frequency))
+				return 1; // validate will have printed error info.
+		}
+		else
+			ScriptHost::Setup("",vBoards[i]->GetAVR()->frequency);
 	}
-	else
-		ScriptHost::Setup("",pBoard->GetAVR()->frequency);
+	ScriptHost::Select(nullptr);
+
+	// Every board is wired up, none has started yet.
+	IRQArena::CompactAll();
 
 	if (!bNoGraphics)
 		ScriptHost::CreateRootMenu(window);
@@ -392,19 +830,112 @@ int main(int argc, char *argv[])
 		getchar();
 	}
 
-	pBoard->StartAVR();
+	if (argForkServer.isSet())
+	{
+		ForkServer server(pBoard, argForkServer.getValue());
+		int iRet = static_cast<int>(ScriptHost::State::Error);
+		if (server.Boot(argScript.isSet()))
+		{
+			iRet = server.Serve();
+			pBoard->SetQuitFlag();
+			pBoard->StartAVR(); // From where it was suspended, only to shut down and save.
+			pBoard->WaitForFinish();
+		}
+		for (auto p : vRawPrinters)
+			PrinterFactory::DestroyPrinterByName(argModel.getValue(), p);
+		return iRet;
+	}
 
-	if (!bNoGraphics)
-		glutMainLoop();
+	if (argScriptBatch.isSet())
+	{
+		ScriptBatch batch(pBoard, argScriptBatchReport.getValue());
+		int iRet = batch.Run(argScriptBatch.getValue());
+		pBoard->SetQuitFlag();
+		pBoard->StartAVR(); // Only to shut down, nothing is saved.
+		pBoard->WaitForFinish();
+		for (auto p : vTelHosts)
+			p->Shutdown();
+		for (auto p : vRawPrinters)
+			PrinterFactory::DestroyPrinterByName(argModel.getValue(), p);
+		return iRet;
+	}
 
-	printf("Waiting for board to finish...\n");
-	pBoard->SetQuitFlag();
-	pBoard->WaitForFinish();
+	unique_ptr<RemoteControl> pRemote;
+	if (argRemote.isSet())
+	{
+		pRemote.reset(new RemoteControl(argRemote.getValue()));
+		if (!pRemote->Start(pBoard->GetAVR()))
+			return 1;
+		pBoard->SetRemoteControl(pRemote.get());
+	}
 
-	PrinterFactory::DestroyPrinterByName(argModel.getValue(), pRawPrinter);
+	StartupTimeline::OnRun();
+	for (auto p : vBoards)
+		p->StartAVR();
+
+	Watchdog watchdog;
+	if (Watchdog::IsEnabled())
+	{
+		for (size_t i=0; i<vBoards.size(); i++)
+		{
+			std::string strName = vBoards.size()>1 ? "printer " + std::to_string(i) : "printer";
+			watchdog.Add(vBoards[i], strName);
+			if (vPrinters[i]->GetMMUBoard())
+				watchdog.Add(vPrinters[i]->GetMMUBoard(), strName + " MMU"); // Only watched while it runs on its own thread.
+		}
+		watchdog.Start();
+	}
+
+	if (!bNoGraphics)
+	{
+		glutMainLoop();
+		printf("Waiting for board to finish...\n");
+		pBoard->SetQuitFlag();
+	}
+	else if (bFarm)
+	{
+		glutMainLoop();
+		printf("Waiting for %u board(s) to finish...\n", uiInstances);
+		for (auto p : vBoards)
+			p->SetQuitFlag();
+	}
+	else
+		printf("Running headless, waiting for %u board(s) to finish...\n", uiInstances);
+
+	for (auto p : vBoards)
+		p->WaitForFinish();
+	int iSegments = ParallelReplay::Finish();
+	watchdog.Stop();
+	InputLog::Stop();
+	if (pRemote)
+		pRemote->Stop();
+	MetricsExporter::Get().Stop();
+	IRQBinding::PrintStats(); // Debug builds only.
+	for (auto p : vTelHosts)
+		p->Shutdown(); // Flushes any binary trace still in flight.
+
+	for (auto p : vRawPrinters)
+		PrinterFactory::DestroyPrinterByName(argModel.getValue(), p);
 
 	printf("Done\n");
+	int iRet = 0;
 	if (argScript.isSet())
-		return static_cast<int>(ScriptHost::GetState());
-
+	{
+		// Report the first instance that didn't finish cleanly, if any.
+		for (auto p : vScriptHosts)
+		{
+			ScriptHost::Select(p);
+			if (ScriptHost::GetState() != ScriptHost::State::Finished)
+			{
+				iRet = static_cast<int>(ScriptHost::GetState());
+				break;
+			}
+		}
+	}
+	if (iRet == 0)
+		iRet = iSegments;
+	if (pResultCache)
+		pResultCache->Store(iRet);
+	StartupTimeline::Write(); // Again, for anything after "start" (or if it never came).
+	return iRet;
 }
@@ -0,0 +1,344 @@
+/*
+	MK404_bench.cpp - Runs MK404 through a fixed set of headless scenarios and
+	reports the simulation throughput (cycles/s, real-time factor) and peak RSS
+	of each, as JSON, so performance can be tracked from commit to commit.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>                    // for errno, EEXIST
+#include <fcntl.h>                    // for open, O_CREAT, O_TRUNC, O_WRONLY
+#include <limits.h>                   // for PATH_MAX
+#include <stdio.h>                    // for fprintf, printf, perror, FILE
+#include <stdlib.h>                   // for mkdtemp, realpath
+#include <string.h>                   // for strncmp, strstr
+#include <sys/resource.h>             // for rusage
+#include <sys/stat.h>                 // for mkdir
+#include <sys/wait.h>                 // for wait4, WEXITSTATUS, WIFEXITED
+#include <tclap/CmdLine.h>            // for CmdLine
+#include <unistd.h>                   // for fork, execv, pipe, dup2, chdir
+#include <algorithm>                  // for sort, find
+#include <chrono>                     // for steady_clock, duration
+#include <fstream>                    // for ofstream
+#include <string>                     // for string, to_string
+#include <vector>                     // for vector
+#include "tclap/MultiArg.h"           // for MultiArg
+#include "tclap/SwitchArg.h"          // for SwitchArg
+#include "tclap/ValueArg.h"           // for ValueArg
+
+using namespace std;
+
+// One repeatable workload: boot the printer cold, run the script, dump the perf counters, quit.
+typedef struct Scenario_t
+{
+	string strName, strDesc;
+	string strPrinter;
+	vector<string> vScript;  // Runs after the firmware has printed "start".
+	vector<string> vGCodeFile; // Written to the SD card as BENCH.GCO if not empty.
+} Scenario_t;
+
+typedef struct Result_t
+{
+	bool bOK = false;
+	int iExit = -1;
+	double dWall = 0, dSimWall = 0, dCyclesPerS = 0, dRealtime = 0, dPeakRSS = 0;
+	unsigned long long uiCycles = 0;
+} Result_t;
+
+static constexpr unsigned int MOVE_COUNT = 200;	// Per unit of --scale.
+static constexpr unsigned int SD_LINES = 1000;
+static constexpr unsigned int TOOL_CHANGES = 10;
+
+// Short zig-zag travel moves, so a few hundred of them take under a minute of printer time.
+static string MoveLine(unsigned int i)
+{
+	char szLine[64];
+	snprintf(szLine, sizeof(szLine), "G1 X%u Y%.1f Z%.1f F6000", (i & 1) ? 110 : 100, 20 + 0.2f*(i % 500), 0.2f + 0.1f*((i/10) % 50));
+	return szLine;
+}
+
+static vector<Scenario_t> GetScenarios(unsigned int uiScale)
+{
+	vector<Scenario_t> vOut;
+	vOut.push_back({"boot", "Cold boot until the firmware prints \"start\"", "Prusa_MK3S", {}, {}});
+
+	vOut.push_back({"idle_heated", "Hotend and bed heating and holding for 60s", "Prusa_MK3S",
+		{"Serial0::SendGCode(M104 S215)", "Serial0::WaitForLine(ok)", "Serial0::SendGCode(M140 S60)", "Serial0::WaitForLine(ok)", "Board::WaitMs(60000)"}, {}});
+
+	Scenario_t scMoves = {"moves", "Homing and a stream of XYZ moves over serial", "Prusa_MK3S", {"Serial0::SendGCode(G28 W)", "Serial0::WaitForLine(ok)"}, {}};
+	for (unsigned int i=0; i<MOVE_COUNT*uiScale; i++)
+	{
+		scMoves.vScript.push_back("Serial0::SendGCode(" + MoveLine(i) + ")");
+		scMoves.vScript.push_back("Serial0::WaitForLine(ok)");
+	}
+	scMoves.vScript.push_back("Serial0::SendGCode(M400)");
+	scMoves.vScript.push_back("Serial0::WaitForLine(ok)");
+	vOut.push_back(scMoves);
+
+	Scenario_t scSD = {"sd_print", "Printing a large file of travel moves from the SD card", "Prusa_MK3S",
+		{"Serial0::SendGCode(M23 bench.gco)", "Serial0::WaitForLine(ok)", "Serial0::SendGCode(M24)", "Serial0::WaitForLineContains(Done printing file)"}, {"G28 W"}};
+	for (unsigned int i=0; i<SD_LINES*uiScale; i++)
+		scSD.vGCodeFile.push_back(MoveLine(i));
+	scSD.vGCodeFile.push_back("M400");
+	vOut.push_back(scSD);
+
+	Scenario_t scMMU = {"mmu_toolchange", "MMU2 tool changes, round robin over the five slots", "Prusa_MK3SMMU2", {}, {}};
+	for (unsigned int i=0; i<TOOL_CHANGES*uiScale; i++)
+	{
+		scMMU.vScript.push_back("Serial0::SendGCode(T" + to_string(i%5) + ")");
+		scMMU.vScript.push_back("Serial0::WaitForLine(ok)");
+	}
+	vOut.push_back(scMMU);
+	return vOut;
+}
+
+// Pulls "key":<number> out of a single-line JSON object, good enough for what PrintPerfJSON emits.
+static bool GetJSONNumber(const string &strJSON, const string &strKey, double &dOut)
+{
+	size_t uiPos = strJSON.find("\"" + strKey + "\":");
+	if (uiPos == string::npos)
+		return false;
+	return sscanf(strJSON.c_str() + uiPos + strKey.size() + 3, "%lf", &dOut) == 1;
+}
+
+static bool WriteLines(const string &strFile, const vector<string> &vLines)
+{
+	ofstream fOut(strFile);
+	for (auto &strLine : vLines)
+		fOut << strLine << '\n';
+	return fOut.good();
+}
+
+static Result_t RunScenario(const Scenario_t &sc, const string &strMK404, const string &strFWDir, const string &strDir, unsigned int uiTimeoutMs)
+{
+	Result_t res;
+	if (mkdir(strDir.c_str(), 0755) && errno != EEXIST)
+	{
+		perror(strDir.c_str());
+		return res;
+	}
+	// A fresh directory every run so the flash/EEPROM/SD state can't carry over between runs.
+	for (const char *pFW : {"MK3S.afx", "MM-control-01.hex", "stk500boot_v2_mega2560.hex"})
+		if (symlink((strFWDir + "/" + pFW).c_str(), (strDir + "/" + pFW).c_str()) && errno != EEXIST)
+			perror(pFW);
+
+	vector<string> vScript = {"ScriptHost::SetQuitOnTimeout(1)", "ScriptHost::SetTimeoutMs(" + to_string(uiTimeoutMs) + ")", "Serial0::WaitForLine(start)"};
+	vScript.insert(vScript.end(), sc.vScript.begin(), sc.vScript.end());
+	vScript.push_back("TelHost::PrintPerfJSON()");
+	vScript.push_back("Board::Quit()");
+	vector<string> vArgs = {strMK404, sc.strPrinter, "--headless", "--perfstats", "0", "-f", "MK3S.afx", "--script", "bench.txt"};
+	if (!WriteLines(strDir + "/bench.txt", vScript))
+		return res;
+	if (!sc.vGCodeFile.empty())
+	{
+		mkdir((strDir + "/sd").c_str(), 0755);
+		if (!WriteLines(strDir + "/sd/BENCH.GCO", sc.vGCodeFile))
+			return res;
+		vArgs.push_back("--sdimage");
+		vArgs.push_back("sd");
+	}
+
+	int fdPipe[2];
+	if (pipe(fdPipe))
+	{
+		perror("pipe");
+		return res;
+	}
+	auto tpStart = chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		if (chdir(strDir.c_str()))
+			_exit(127);
+		int fdLog = open("MK404.err", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dup2(fdPipe[1], STDOUT_FILENO);
+		if (fdLog >= 0)
+			dup2(fdLog, STDERR_FILENO);
+		close(fdPipe[0]);
+		vector<char*> vArgv;
+		for (auto &strArg : vArgs)
+			vArgv.push_back(const_cast<char*>(strArg.c_str()));
+		vArgv.push_back(nullptr);
+		execv(vArgv[0], vArgv.data());
+		perror(vArgv[0]);
+		_exit(127);
+	}
+	close(fdPipe[1]);
+	if (pid < 0)
+	{
+		perror("fork");
+		close(fdPipe[0]);
+		return res;
+	}
+
+	// Keep the output for post-mortems, and the last perf line the script printed.
+	string strPerf;
+	FILE *pIn = fdopen(fdPipe[0], "r");
+	FILE *pLog = fopen((strDir + "/MK404.out").c_str(), "w");
+	char *pLine = nullptr;
+	size_t uiLen = 0;
+	while (getline(&pLine, &uiLen, pIn) > 0)
+	{
+		if (pLog)
+			fputs(pLine, pLog);
+		if (!strncmp(pLine, "{\"wall_s\"", 9))
+			strPerf = pLine;
+	}
+	free(pLine);
+	fclose(pIn);
+	if (pLog)
+		fclose(pLog);
+
+	int iStatus = 0;
+	struct rusage ru = {};
+	wait4(pid, &iStatus, 0, &ru);
+	res.dWall = chrono::duration<double>(chrono::steady_clock::now() - tpStart).count();
+	res.dPeakRSS = ru.ru_maxrss/1024.0; // KiB on Linux.
+	res.iExit = WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : -1;
+
+	double dCycles = 0;
+	res.bOK = res.iExit == 0 && !strPerf.empty() &&
+		GetJSONNumber(strPerf, "wall_s", res.dSimWall) &&
+		GetJSONNumber(strPerf, "cycles", dCycles) &&
+		GetJSONNumber(strPerf, "cycles_per_s", res.dCyclesPerS) &&
+		GetJSONNumber(strPerf, "realtime", res.dRealtime);
+	res.uiCycles = dCycles;
+	return res;
+}
+
+// Median by cycles/s, so one noisy run doesn't move the baseline.
+static Result_t Median(vector<Result_t> vRuns)
+{
+	sort(vRuns.begin(), vRuns.end(), [](const Result_t &a, const Result_t &b) { return a.dCyclesPerS < b.dCyclesPerS; });
+	Result_t res = vRuns[vRuns.size()/2];
+	for (auto &run : vRuns)
+	{
+		res.bOK &= run.bOK;
+		res.dPeakRSS = max(res.dPeakRSS, run.dPeakRSS);
+		if (!run.bOK)
+			res.iExit = run.iExit;
+	}
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace TCLAP;
+	CmdLine cmd("MK404 benchmark suite. Runs each scenario headless from a cold start in a scratch directory and reports simulated cycles/s, "
+		"the real-time factor and peak RSS. Run it from the build directory, next to MK404 and the firmware files.", ' ', "1");
+	SwitchArg argList("","list","List the scenarios and exit.");
+	cmd.add(argList);
+	SwitchArg argKeep("","keep","Keep the scratch directory (scripts, SD files, MK404 output) afterwards.");
+	cmd.add(argKeep);
+	ValueArg<unsigned int> argTimeout("","timeout","Fails a scenario if any step waits longer than this, in simulated ms. (default 600000)",false,600000,"ms");
+	cmd.add(argTimeout);
+	ValueArg<unsigned int> argScale("","scale","Multiplies the length of the move, SD and tool change workloads. (default 1)",false,1,"integer");
+	cmd.add(argScale);
+	ValueArg<unsigned int> argRepeat("","repeat","Runs each scenario this many times and reports the median. (default 1)",false,1,"integer");
+	cmd.add(argRepeat);
+	ValueArg<string> argOut("o","out","Writes the results as JSON to this file instead of stdout.",false,"","filename.json");
+	cmd.add(argOut);
+	ValueArg<string> argFWDir("","fw-dir","Directory holding MK3S.afx and MM-control-01.hex. (default .)",false,".","directory");
+	cmd.add(argFWDir);
+	ValueArg<string> argMK404("","mk404","MK404 binary to benchmark. (default ./MK404)",false,"./MK404","filename");
+	cmd.add(argMK404);
+	MultiArg<string> argScenario("s","scenario","Only runs the named scenario(s). (default all)",false,"name");
+	cmd.add(argScenario);
+	cmd.parse(argc, argv);
+
+	vector<Scenario_t> vScenarios = GetScenarios(max(argScale.getValue(), 1U));
+	if (argList.isSet())
+	{
+		for (auto &sc : vScenarios)
+			printf("%-16s %-16s %s\n", sc.strName.c_str(), sc.strPrinter.c_str(), sc.strDesc.c_str());
+		return 0;
+	}
+
+	char szPath[PATH_MAX];
+	if (!realpath(argMK404.getValue().c_str(), szPath))
+	{
+		perror(argMK404.getValue().c_str());
+		return 1;
+	}
+	string strMK404 = szPath;
+	if (!realpath(argFWDir.getValue().c_str(), szPath))
+	{
+		perror(argFWDir.getValue().c_str());
+		return 1;
+	}
+	string strFWDir = szPath;
+	char szWork[] = "/tmp/MK404_bench.XXXXXX";
+	if (!mkdtemp(szWork))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	const vector<string> &vOnly = argScenario.getValue();
+	vector<pair<const Scenario_t*, Result_t>> vResults;
+	for (auto &sc : vScenarios)
+	{
+		if (!vOnly.empty() && find(vOnly.begin(), vOnly.end(), sc.strName) == vOnly.end())
+			continue;
+		vector<Result_t> vRuns;
+		for (unsigned int i=0; i<max(argRepeat.getValue(), 1U); i++)
+		{
+			fprintf(stderr, "MK404_bench: %s, run %u...\n", sc.strName.c_str(), i+1);
+			string strDir = string(szWork) + "/" + sc.strName + "_" + to_string(i);
+			vRuns.push_back(RunScenario(sc, strMK404, strFWDir, strDir, argTimeout.getValue()));
+			if (!vRuns.back().bOK)
+				fprintf(stderr, "MK404_bench: %s FAILED (exit %d), see %s/MK404.out/.err\n", sc.strName.c_str(), vRuns.back().iExit, strDir.c_str());
+		}
+		vResults.push_back({&sc, Median(vRuns)});
+	}
+
+	FILE *pOut = argOut.isSet() ? fopen(argOut.getValue().c_str(), "w") : stdout;
+	if (!pOut)
+	{
+		perror(argOut.getValue().c_str());
+		return 1;
+	}
+	bool bAllOK = true;
+	fprintf(pOut, "{\"scale\":%u,\"repeat\":%u,\"scenarios\":[", max(argScale.getValue(), 1U), max(argRepeat.getValue(), 1U));
+	fprintf(stderr, "%-16s %6s %10s %10s %14s %9s %10s\n", "Scenario", "OK", "Wall s", "Sim s", "Cycles/s", "Realtime", "Peak MiB");
+	for (size_t i=0; i<vResults.size(); i++)
+	{
+		const Scenario_t &sc = *vResults[i].first;
+		const Result_t &res = vResults[i].second;
+		bAllOK &= res.bOK;
+		double dSimS = res.dRealtime * res.dSimWall;
+		fprintf(pOut, "%s{\"name\":\"%s\",\"printer\":\"%s\",\"ok\":%s,\"exit\":%d,\"wall_s\":%.3f,\"sim_s\":%.3f,\"cycles\":%llu,\"cycles_per_s\":%.0f,\"realtime\":%.3f,\"peak_rss_mib\":%.1f}",
+			i ? "," : "", sc.strName.c_str(), sc.strPrinter.c_str(), res.bOK ? "true" : "false", res.iExit, res.dWall, dSimS,
+			res.uiCycles, res.dCyclesPerS, res.dRealtime, res.dPeakRSS);
+		fprintf(stderr, "%-16s %6s %10.2f %10.2f %14.0f %8.3fx %10.1f\n", sc.strName.c_str(), res.bOK ? "yes" : "NO", res.dWall, dSimS,
+			res.dCyclesPerS, res.dRealtime, res.dPeakRSS);
+	}
+	fprintf(pOut, "]}\n");
+	if (pOut != stdout)
+		fclose(pOut);
+
+	if (!argKeep.isSet())
+	{
+		string strCmd = string("rm -rf ") + szWork;
+		if (system(strCmd.c_str()))
+			fprintf(stderr, "MK404_bench: could not clean up %s\n", szWork);
+	}
+	else
+		fprintf(stderr, "MK404_bench: scratch files kept in %s\n", szWork);
+	return bAllOK ? 0 : 1;
+}
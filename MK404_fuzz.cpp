@@ -0,0 +1,471 @@
+/*
+	MK404_fuzz.cpp - Expands a script template over ranges of fault-injection
+	parameters and seeds, and runs the resulting scenarios as parallel headless
+	MK404 processes, keeping the output and traces of every run that fails.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>                   // for opendir, readdir, closedir
+#include <errno.h>                    // for errno, EEXIST
+#include <fcntl.h>                    // for open, O_CREAT, O_TRUNC, O_WRONLY
+#include <limits.h>                   // for PATH_MAX
+#include <signal.h>                   // for kill, SIGKILL
+#include <stdint.h>                   // for uint32_t, uint64_t, uint8_t
+#include <stdio.h>                    // for fprintf, printf, perror
+#include <stdlib.h>                   // for realpath, system
+#include <sys/stat.h>                 // for mkdir
+#include <sys/wait.h>                 // for waitpid, WEXITSTATUS, WIFEXITED
+#include <tclap/CmdLine.h>            // for CmdLine
+#include <unistd.h>                   // for fork, execv, dup2, chdir, usleep
+#include <algorithm>                  // for max, min
+#include <chrono>                     // for steady_clock, duration
+#include <cstring>                    // for memcmp
+#include <fstream>                    // for ifstream, ofstream
+#include <iterator>                   // for istreambuf_iterator
+#include <map>                        // for map
+#include <random>                     // for mt19937, uniform_int_distribution
+#include <sstream>                    // for istringstream, stringstream
+#include <string>                     // for string, to_string
+#include <thread>                     // for hardware_concurrency
+#include <vector>                     // for vector
+#include "tclap/MultiArg.h"           // for MultiArg
+#include "tclap/SwitchArg.h"          // for SwitchArg
+#include "tclap/ValueArg.h"           // for ValueArg
+
+using namespace std;
+
+// One template parameter: either a list of values ("a,b,c" or an integer range "lo..hi")
+// that the runs iterate over, or "rand:lo:hi", drawn afresh from the run's seed every time.
+typedef struct Param_t
+{
+	string strName;
+	vector<string> vValues;
+	bool bRandom = false, bRandomInt = false;
+	double dLo = 0, dHi = 0;
+} Param_t;
+
+typedef struct Run_t
+{
+	unsigned int uiIndex = 0;
+	unsigned int uiSeed = 0;
+	map<string, string> mValues;
+	string strDir;
+	pid_t pid = -1;
+	chrono::steady_clock::time_point tpStart;
+	int iExit = -1;
+	bool bKilled = false;
+	double dWall = 0;
+} Run_t;
+
+// MK404's exit code is the ScriptHost::State of the script (see MK404.cpp).
+static const char* StateName(int iExit, bool bKilled)
+{
+	static const char *szStates[] = {"Finished", "Idle", "Running", "Timeout", "Error"};
+	if (bKilled)
+		return "Killed";
+	if (iExit >= 0 && iExit < 5)
+		return szStates[iExit];
+	return iExit < 0 ? "Crashed" : "Other";
+}
+
+static bool ParseParam(const string &strArg, Param_t &param)
+{
+	size_t uiEq = strArg.find('=');
+	if (uiEq == string::npos || uiEq == 0)
+		return false;
+	param.strName = strArg.substr(0, uiEq);
+	string strSpec = strArg.substr(uiEq + 1);
+	if (!strSpec.compare(0, 5, "rand:"))
+	{
+		string strLo = strSpec.substr(5, strSpec.find(':', 5) - 5);
+		string strHi = strSpec.substr(strSpec.find(':', 5) + 1);
+		param.bRandom = true;
+		param.bRandomInt = strLo.find('.') == string::npos && strHi.find('.') == string::npos;
+		param.dLo = atof(strLo.c_str());
+		param.dHi = atof(strHi.c_str());
+		return strSpec.find(':', 5) != string::npos && param.dHi >= param.dLo;
+	}
+	size_t uiDots = strSpec.find("..");
+	if (uiDots != string::npos)
+	{
+		long lLo = atol(strSpec.substr(0, uiDots).c_str()), lHi = atol(strSpec.substr(uiDots + 2).c_str());
+		for (long l = lLo; l <= lHi; l++)
+			param.vValues.push_back(to_string(l));
+		return !param.vValues.empty();
+	}
+	istringstream ssSpec(strSpec);
+	string strValue;
+	while (getline(ssSpec, strValue, ','))
+		param.vValues.push_back(strValue);
+	return !param.vValues.empty();
+}
+
+// Replaces every ${name} in the template.
+static string Expand(const string &strTemplate, const map<string, string> &mValues)
+{
+	string strOut = strTemplate;
+	for (auto &it : mValues)
+	{
+		string strKey = "${" + it.first + "}";
+		for (size_t uiPos = strOut.find(strKey); uiPos != string::npos; uiPos = strOut.find(strKey, uiPos + it.second.size()))
+			strOut.replace(uiPos, strKey.size(), it.second);
+	}
+	return strOut;
+}
+
+static bool WriteFile(const string &strFile, const string &strContent)
+{
+	ofstream fOut(strFile);
+	fOut << strContent;
+	return fOut.good();
+}
+
+// The start of a .cov file, ahead of the bitmap (see utility/Coverage.h for the layout).
+typedef struct CovHeader_t
+{
+	char chrMagic[8]; // "MK404COV"
+	uint32_t uiWords; // Little endian
+} CovHeader_t;
+static constexpr size_t uiCovHeader = sizeof(CovHeader_t);
+static_assert(uiCovHeader == 12, "The .cov header is packed");
+
+// ORs the run's --coverage maps into mMaps, by file name.
+// Returns how many flash words no earlier run had reached.
+static uint64_t MergeCoverage(const string &strDir, map<string, string> &mMaps)
+{
+	uint64_t uiNew = 0;
+	DIR *pDir = opendir(strDir.c_str());
+	if (!pDir)
+		return 0;
+	while (dirent *pEntry = readdir(pDir))
+	{
+		string strName = pEntry->d_name;
+		if (strName.size() < 13 || strName.compare(strName.size() - 13, 13, "_coverage.cov") != 0)
+			continue;
+		ifstream fIn(strDir + "/" + strName, ios::binary);
+		string strMap((istreambuf_iterator<char>(fIn)), istreambuf_iterator<char>());
+		if (strMap.size() < uiCovHeader || memcmp(strMap.data(), "MK404COV", sizeof(CovHeader_t::chrMagic)) != 0)
+			continue;
+		string &strAll = mMaps[strName];
+		if (strAll.size() != strMap.size())
+		{
+			if (!strAll.empty())
+				fprintf(stderr, "MK404_fuzz: %s changed size, restarting its coverage\n", strName.c_str());
+			strAll = strMap.substr(0, uiCovHeader) + string(strMap.size() - uiCovHeader, '\0');
+		}
+		for (size_t i=uiCovHeader; i<strMap.size(); i++)
+		{
+			uint8_t uiRun = strMap[i], uiAll = strAll[i];
+			uiNew += __builtin_popcount(uiRun & ~uiAll);
+			strAll[i] = static_cast<char>(uiRun | uiAll);
+		}
+	}
+	closedir(pDir);
+	return uiNew;
+}
+
+static uint64_t WriteCoverage(const string &strOut, const map<string, string> &mMaps)
+{
+	uint64_t uiWords = 0;
+	for (auto &it : mMaps)
+	{
+		WriteFile(strOut + "/" + it.first, it.second);
+		for (size_t i=uiCovHeader; i<it.second.size(); i++)
+			uiWords += __builtin_popcount(static_cast<uint8_t>(it.second[i]));
+	}
+	return uiWords;
+}
+
+static pid_t StartRun(Run_t &run, const string &strScript, const vector<string> &vArgs, const string &strFWDir, const string &strFW)
+{
+	if (mkdir(run.strDir.c_str(), 0755) && errno != EEXIST)
+	{
+		perror(run.strDir.c_str());
+		return -1;
+	}
+	// A fresh directory every run so the flash/EEPROM state can't carry over between runs.
+	for (const string &strFile : {strFW, string("MM-control-01.hex"), string("stk500boot_v2_mega2560.hex")})
+		if (symlink((strFWDir + "/" + strFile).c_str(), (run.strDir + "/" + strFile).c_str()) && errno != EEXIST)
+			perror(strFile.c_str());
+	if (!WriteFile(run.strDir + "/fuzz.txt", strScript))
+		return -1;
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		if (chdir(run.strDir.c_str()))
+			_exit(127);
+		int fdOut = open("MK404.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int fdErr = open("MK404.err", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fdOut >= 0)
+			dup2(fdOut, STDOUT_FILENO);
+		if (fdErr >= 0)
+			dup2(fdErr, STDERR_FILENO);
+		vector<char*> vArgv;
+		for (auto &strArg : vArgs)
+			vArgv.push_back(const_cast<char*>(strArg.c_str()));
+		vArgv.push_back(nullptr);
+		execv(vArgv[0], vArgv.data());
+		perror(vArgv[0]);
+		_exit(127);
+	}
+	if (pid < 0)
+		perror("fork");
+	run.tpStart = chrono::steady_clock::now();
+	return pid;
+}
+
+static string JSONEscape(const string &str)
+{
+	string strOut;
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			strOut += '\\';
+		if (static_cast<unsigned char>(c) >= 0x20)
+			strOut += c;
+	}
+	return strOut;
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace TCLAP;
+	CmdLine cmd("MK404 fault-injection runner. Expands a script template over the given parameters and seeds and runs every "
+		"resulting scenario as its own headless MK404, several at once, each in a scratch directory under --out. "
+		"${name} in the template is replaced by the parameter's value, ${run} and ${seed} by the run's. "
+		"Runs whose script doesn't finish (timeout, error, crash) keep their directory with the script, output and "
+		"any traces; the others are removed. Every run is listed in <out>/results.jsonl.", ' ', "1");
+	ValueArg<string> argTemplate("","template","Script template, in the usual --script syntax. Board::Quit() is appended.",true,"","filename.txt");
+	cmd.add(argTemplate);
+	MultiArg<string> argParam("p","param","A template parameter: name=a,b,c (each value), name=lo..hi (each integer) or name=rand:lo:hi "
+		"(drawn per run from its seed, an integer unless lo or hi has a decimal point). Lists multiply into every combination.",false,"name=values");
+	cmd.add(argParam);
+	ValueArg<unsigned int> argSeeds("","seeds","Runs every combination with this many seeds. (default 1)",false,1,"integer");
+	cmd.add(argSeeds);
+	ValueArg<unsigned int> argSamples("","samples","Instead of every combination, runs this many random ones (each with its own seed). 0 runs them all. (default 0)",false,0,"integer");
+	cmd.add(argSamples);
+	ValueArg<unsigned int> argSeed("","seed","First seed, run N gets seed+N. (default 1)",false,1,"integer");
+	cmd.add(argSeed);
+	ValueArg<unsigned int> argJobs("j","jobs","Number of simulators to run at once. (default: one per core)",false,0,"integer");
+	cmd.add(argJobs);
+	ValueArg<string> argPrinter("","printer","Printer model to run. (default Prusa_MK3S)",false,"Prusa_MK3S","model");
+	cmd.add(argPrinter);
+	ValueArg<unsigned int> argTimeout("","timeout","Fails a run if any script step waits longer than this, in simulated ms. (default 600000)",false,600000,"ms");
+	cmd.add(argTimeout);
+	ValueArg<unsigned int> argWallTimeout("","wall-timeout","Kills a run that is still going after this many seconds of real time. 0 never does. (default 3600)",false,3600,"seconds");
+	cmd.add(argWallTimeout);
+	ValueArg<string> argOut("o","out","Directory for the run directories and results.jsonl. (default fuzz_out)",false,"fuzz_out","directory");
+	cmd.add(argOut);
+	SwitchArg argKeepAll("","keep-all","Keep the directories of the runs that passed too.");
+	cmd.add(argKeepAll);
+	SwitchArg argCoverage("","coverage","Runs MK404 with --coverage, records the flash words each run reached that no earlier one had "
+		"(\"cov_new\" in results.jsonl) and keeps the union of all runs in <out>/<board>_coverage.cov.");
+	cmd.add(argCoverage);
+	ValueArg<string> argArgs("","mk404-args","Extra MK404 arguments for every run, e.g. \"--idle-skip -t Stepper --traceformat bin\".",false,"","string");
+	cmd.add(argArgs);
+	ValueArg<string> argFW("f","firmware","Firmware file in --fw-dir. (default MK3S.afx)",false,"MK3S.afx","filename");
+	cmd.add(argFW);
+	ValueArg<string> argFWDir("","fw-dir","Directory holding the firmware, and MM-control-01.hex for MMU printers. (default .)",false,".","directory");
+	cmd.add(argFWDir);
+	ValueArg<string> argMK404("","mk404","MK404 binary to run. (default ./MK404)",false,"./MK404","filename");
+	cmd.add(argMK404);
+	cmd.parse(argc, argv);
+
+	ifstream fTemplate(argTemplate.getValue());
+	if (!fTemplate.good())
+	{
+		perror(argTemplate.getValue().c_str());
+		return 1;
+	}
+	stringstream ssTemplate;
+	ssTemplate << fTemplate.rdbuf();
+	string strTemplate = ssTemplate.str();
+
+	vector<Param_t> vParams;
+	unsigned long long uiCombos = 1;
+	for (auto &strArg : argParam.getValue())
+	{
+		Param_t param;
+		if (!ParseParam(strArg, param))
+		{
+			fprintf(stderr, "MK404_fuzz: can't parse parameter \"%s\"\n", strArg.c_str());
+			return 1;
+		}
+		if (!param.bRandom)
+			uiCombos *= param.vValues.size();
+		vParams.push_back(param);
+	}
+
+	char szPath[PATH_MAX];
+	string strMK404, strFWDir;
+	if (!realpath(argMK404.getValue().c_str(), szPath))
+	{
+		perror(argMK404.getValue().c_str());
+		return 1;
+	}
+	strMK404 = szPath;
+	if (!realpath(argFWDir.getValue().c_str(), szPath))
+	{
+		perror(argFWDir.getValue().c_str());
+		return 1;
+	}
+	strFWDir = szPath;
+	if (mkdir(argOut.getValue().c_str(), 0755) && errno != EEXIST)
+	{
+		perror(argOut.getValue().c_str());
+		return 1;
+	}
+	realpath(argOut.getValue().c_str(), szPath);
+	string strOut = szPath;
+
+	vector<string> vArgs = {strMK404, argPrinter.getValue(), "--headless", "-f", argFW.getValue(), "--script", "fuzz.txt"};
+	istringstream ssArgs(argArgs.getValue());
+	string strArg;
+	while (ssArgs >> strArg)
+		vArgs.push_back(strArg);
+	if (argCoverage.isSet())
+		vArgs.push_back("--coverage");
+	map<string, string> mCoverage;
+
+	string strPrefix = "ScriptHost::SetQuitOnTimeout(1)\nScriptHost::SetTimeoutMs(" + to_string(argTimeout.getValue()) + ")\n";
+	unsigned int uiSeeds = max(argSeeds.getValue(), 1U);
+	unsigned long long uiRuns = argSamples.getValue() ? argSamples.getValue() : uiCombos*uiSeeds;
+	unsigned int uiJobs = argJobs.getValue() ? argJobs.getValue() : max(thread::hardware_concurrency(), 1U);
+	fprintf(stderr, "MK404_fuzz: %llu runs (%llu combinations), %u at a time, results in %s\n", uiRuns, uiCombos, uiJobs, strOut.c_str());
+
+	FILE *pResults = fopen((strOut + "/results.jsonl").c_str(), "w");
+	if (!pResults)
+	{
+		perror("results.jsonl");
+		return 1;
+	}
+
+	map<string, unsigned int> mStates;
+	vector<Run_t> vActive;
+	unsigned long long uiNext = 0, uiDone = 0, uiFailed = 0;
+	while (uiNext < uiRuns || !vActive.empty())
+	{
+		while (uiNext < uiRuns && vActive.size() < uiJobs)
+		{
+			Run_t run;
+			run.uiIndex = uiNext;
+			run.uiSeed = argSeed.getValue() + uiNext;
+			mt19937 rng(run.uiSeed);
+			// Every combination in turn (each uiSeeds times), or random ones.
+			unsigned long long uiCombo = argSamples.getValue() ? uniform_int_distribution<unsigned long long>(0, uiCombos - 1)(rng) : uiNext / uiSeeds;
+			for (auto &param : vParams)
+			{
+				if (param.bRandom)
+				{
+					char szValue[32];
+					if (param.bRandomInt)
+						snprintf(szValue, sizeof(szValue), "%lld", uniform_int_distribution<long long>(param.dLo, param.dHi)(rng));
+					else
+						snprintf(szValue, sizeof(szValue), "%.3f", uniform_real_distribution<double>(param.dLo, param.dHi)(rng));
+					run.mValues[param.strName] = szValue;
+					continue;
+				}
+				run.mValues[param.strName] = param.vValues[uiCombo % param.vValues.size()];
+				uiCombo /= param.vValues.size();
+			}
+			run.mValues["run"] = to_string(run.uiIndex);
+			run.mValues["seed"] = to_string(run.uiSeed);
+			char szDir[32];
+			snprintf(szDir, sizeof(szDir), "/run%06llu", uiNext);
+			run.strDir = strOut + szDir;
+			run.pid = StartRun(run, strPrefix + Expand(strTemplate, run.mValues) + "\nBoard::Quit()\n", vArgs, strFWDir, argFW.getValue());
+			uiNext++;
+			if (run.pid < 0)
+			{
+				uiFailed++;
+				uiDone++;
+				continue;
+			}
+			vActive.push_back(run);
+		}
+
+		int iStatus = 0;
+		pid_t pid = waitpid(-1, &iStatus, WNOHANG);
+		if (pid <= 0)
+		{
+			// Nothing finished, check on the ones that are taking too long.
+			for (auto &run : vActive)
+				if (!run.bKilled && argWallTimeout.getValue() && chrono::steady_clock::now() - run.tpStart > chrono::seconds(argWallTimeout.getValue()))
+				{
+					fprintf(stderr, "MK404_fuzz: run %u exceeded the wall timeout, killing it\n", run.uiIndex);
+					kill(run.pid, SIGKILL);
+					run.bKilled = true;
+				}
+			usleep(20000);
+			continue;
+		}
+		auto it = find_if(vActive.begin(), vActive.end(), [pid](const Run_t &run) { return run.pid == pid; });
+		if (it == vActive.end())
+			continue;
+		Run_t run = *it;
+		vActive.erase(it);
+		run.dWall = chrono::duration<double>(chrono::steady_clock::now() - run.tpStart).count();
+		run.iExit = WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : -1;
+		bool bOK = run.iExit == 0 && !run.bKilled;
+		const char *szState = StateName(run.iExit, run.bKilled);
+		mStates[szState]++;
+		uiDone++;
+
+		fprintf(pResults, "{\"run\":%u,\"seed\":%u,\"ok\":%s,\"exit\":%d,\"state\":\"%s\",\"wall_s\":%.3f,\"params\":{", run.uiIndex, run.uiSeed,
+			bOK ? "true" : "false", run.iExit, szState, run.dWall);
+		bool bFirst = true;
+		for (auto &param : vParams)
+		{
+			fprintf(pResults, "%s\"%s\":\"%s\"", bFirst ? "" : ",", JSONEscape(param.strName).c_str(), JSONEscape(run.mValues[param.strName]).c_str());
+			bFirst = false;
+		}
+		fprintf(pResults, "}");
+		if (argCoverage.isSet())
+			fprintf(pResults, ",\"cov_new\":%llu", static_cast<unsigned long long>(MergeCoverage(run.strDir, mCoverage)));
+		fprintf(pResults, "%s%s%s}\n", bOK ? "" : ",\"dir\":\"", bOK ? "" : JSONEscape(run.strDir).c_str(), bOK ? "" : "\"");
+		fflush(pResults);
+
+		if (!bOK)
+		{
+			uiFailed++;
+			fprintf(stderr, "MK404_fuzz: run %u FAILED (%s), kept in %s\n", run.uiIndex, szState, run.strDir.c_str());
+		}
+		else if (!argKeepAll.isSet())
+		{
+			string strCmd = "rm -rf '" + run.strDir + "'";
+			if (system(strCmd.c_str()))
+				fprintf(stderr, "MK404_fuzz: could not clean up %s\n", run.strDir.c_str());
+		}
+		if (uiDone % 100 == 0)
+		{
+			fprintf(stderr, "MK404_fuzz: %llu/%llu done, %llu failed\n", uiDone, uiRuns, uiFailed);
+			WriteCoverage(strOut, mCoverage); // So far, in case this gets killed.
+		}
+	}
+	fclose(pResults);
+	if (argCoverage.isSet())
+		fprintf(stderr, "MK404_fuzz: %llu flash words reached over all runs, see %s/*_coverage.cov\n", static_cast<unsigned long long>(WriteCoverage(strOut, mCoverage)), strOut.c_str());
+
+	fprintf(stderr, "MK404_fuzz: %llu runs, %llu failed:", uiDone, uiFailed);
+	for (auto &it : mStates)
+		fprintf(stderr, " %s %u", it.first.c_str(), it.second);
+	fprintf(stderr, "\n");
+	return uiFailed ? 1 : 0;
+}
@@ -0,0 +1,406 @@
+/*
+	MK404_microbench.cpp - Drives single peripherals through their IRQs on a bare
+	(firmware-less) simulated MCU and reports ns/op and heap allocations/op for
+	their hot handlers, so regressions show up before they do in full runs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>                // for open, O_RDONLY, O_NONBLOCK
+#include <stdint.h>               // for uint64_t, uint8_t, uint32_t
+#include <stdio.h>                // for printf, fprintf, perror
+#include <stdlib.h>               // for malloc, free, mkstemp
+#include <tclap/CmdLine.h>        // for CmdLine
+#include <unistd.h>               // for close, ftruncate, read, unlink
+#include <algorithm>              // for find
+#include <atomic>                 // for atomic_bool
+#include <chrono>                 // for steady_clock, duration
+#include <memory>                 // for unique_ptr
+#include <new>                    // for bad_alloc
+#include <string>                 // for string
+#include <thread>                 // for thread
+#include <vector>                 // for vector
+#include "GLPrint.h"              // for GLPrint
+#include "HD44780.h"              // for HD44780
+#include "SDCard.h"               // for SDCard
+#include "TMC2130.h"              // for TMC2130, TMC2130::TMC2130_cfg_t
+#include "Thermistor.h"           // for Thermistor
+#include "avr_adc.h"              // for avr_adc_mux_t, ADC_MUX_SINGLE
+#include "sim_avr.h"              // for avr_t, avr_init, avr_make_mcu_by_name
+#include "sim_cycle_timers.h"     // for avr_cycle_timer_process
+#include "sim_irq.h"              // for avr_raise_irq
+#include "sim_time.h"             // for avr_usec_to_cycles
+#include "tclap/MultiArg.h"       // for MultiArg
+#include "tclap/SwitchArg.h"      // for SwitchArg
+#include "tclap/ValueArg.h"       // for ValueArg
+#include "thermistortables.h"     // for temptable_5, OVERSAMPLENR
+#include "uart_pty.h"             // for uart_pty
+
+using namespace std;
+
+// Counts the heap allocations made by the benchmarking thread, for allocs/op.
+// Other threads (I/O reactor, ribbon builder) don't show up here.
+static thread_local uint64_t g_uiAllocs = 0;
+
+void* operator new(size_t uiSize)
+{
+	g_uiAllocs++;
+	if (void *p = malloc(uiSize ? uiSize : 1))
+		return p;
+	throw bad_alloc();
+}
+void* operator new[](size_t uiSize) { return operator new(uiSize); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+
+// One handler under test. Setup() wires it to a fresh MCU, Op() is what gets timed.
+class MicroBench
+{
+	public:
+		MicroBench(const string &strName, const string &strDesc):m_strName(strName),m_strDesc(strDesc){};
+		virtual ~MicroBench() = default;
+
+		virtual void Setup(avr_t *avr) = 0;
+		virtual void Op() = 0;
+
+		const string m_strName, m_strDesc;
+
+	protected:
+		// Moves simulated time on and runs whatever timers came due.
+		inline void Tick(avr_cycle_count_t uiCycles)
+		{
+			m_pAVR->cycle += uiCycles;
+			avr_cycle_timer_process(m_pAVR);
+		}
+
+		avr_t *m_pAVR = nullptr;
+};
+
+// One full step pulse (rise and fall) with the driver enabled, travelling back and forth.
+class TMCStepBench: public MicroBench
+{
+	public:
+		TMCStepBench():MicroBench("tmc2130_step", "TMC2130 STEP_IN pulse (OnStepIn)"){};
+		void Setup(avr_t *avr) override
+		{
+			m_pAVR = avr;
+			m_tmc.SetConfig(TMC2130::TMC2130_cfg_t());
+			m_tmc.Init(avr);
+			avr_raise_irq(m_tmc.GetIRQ(TMC2130::ENABLE_IN), 0);
+		}
+		void Op() override
+		{
+			// Stays clear of the end stops: with the default config it starts at step 1000 of 20000.
+			if (++m_uiSteps % 10000 == 0)
+				avr_raise_irq(m_tmc.GetIRQ(TMC2130::DIR_IN), (m_uiSteps / 10000) & 1);
+			avr_raise_irq(m_tmc.GetIRQ(TMC2130::STEP_IN), 1);
+			Tick(40);
+			avr_raise_irq(m_tmc.GetIRQ(TMC2130::STEP_IN), 0);
+			Tick(40);
+		}
+	private:
+		TMC2130 m_tmc {'X'};
+		uint64_t m_uiSteps = 0;
+};
+
+// An ADC conversion on the thermistor's channel at a steady temperature.
+class ThermistorBench: public MicroBench
+{
+	public:
+		ThermistorBench():MicroBench("thermistor_adc", "Thermistor ADC trigger on its own mux (published value)"){};
+		void Setup(avr_t *avr) override
+		{
+			m_pAVR = avr;
+			m_therm.Init(avr, 0);
+			m_therm.SetTable((short*)temptable_5, sizeof(temptable_5) / sizeof(short) / 2, OVERSAMPLENR);
+			m_therm.Set(215);
+			union {
+				avr_adc_mux_t v;
+				uint32_t l;
+			} u = {};
+			u.v.kind = ADC_MUX_SINGLE;
+			u.v.src = 0;
+			m_uiMux = u.l;
+		}
+		void Op() override
+		{
+			avr_raise_irq(m_therm.GetIRQ(Thermistor::ADC_TRIGGER_IN), m_uiMux);
+			Tick(1664); // ~104us, one conversion at the firmware's ADC clock.
+		}
+	private:
+		Thermistor m_therm;
+		uint32_t m_uiMux = 0;
+};
+
+// One character written in 4-bit mode over the individual pin IRQs, as the Einsy fallback wiring does.
+class LCDCharBench: public MicroBench
+{
+	public:
+		LCDCharBench():MicroBench("hd44780_char", "HD44780 4-bit DDRAM write over pin IRQs (OnPinChanged)"){};
+		void Setup(avr_t *avr) override
+		{
+			m_pAVR = avr;
+			m_lcd.Init(avr);
+			m_uiBusy = avr_usec_to_cycles(avr, 40);
+			WriteNibble(false, 0x2); // Function set, 8-bit form: switch to 4-bit.
+			WriteByte(false, 0x28);  // 4-bit, 2 lines.
+			WriteByte(false, 0x0C);  // Display on.
+			WriteByte(false, 0x06);  // Entry mode, increment.
+		}
+		void Op() override
+		{
+			WriteByte(true, 'A' + (m_uiChar++ % 26));
+		}
+	private:
+		void WriteNibble(bool bRS, uint8_t uiNibble)
+		{
+			avr_raise_irq(m_lcd.GetIRQ(HD44780::RS), bRS);
+			for (int i=0; i<4; i++)
+				avr_raise_irq(m_lcd.GetIRQ(HD44780::D4 + i), (uiNibble >> i) & 1);
+			avr_raise_irq(m_lcd.GetIRQ(HD44780::E), 1);
+			Tick(2);
+			avr_raise_irq(m_lcd.GetIRQ(HD44780::E), 0);
+			Tick(2);
+		}
+		void WriteByte(bool bRS, uint8_t uiByte)
+		{
+			WriteNibble(bRS, uiByte >> 4);
+			WriteNibble(bRS, uiByte & 0xF);
+			Tick(m_uiBusy);
+		}
+
+		HD44780 m_lcd;
+		avr_cycle_count_t m_uiBusy = 0;
+		uint32_t m_uiChar = 0;
+};
+
+// A CMD17 single block read clocked byte by byte over SPI, from a sparse scratch image.
+class SDReadBench: public MicroBench
+{
+	public:
+		SDReadBench():MicroBench("sdcard_block", "SDCard CMD17 512-byte block read over SPI (OnSPIIn)"){};
+		~SDReadBench()
+		{
+			m_sd.Unmount();
+			if (!m_strImage.empty())
+				unlink(m_strImage.c_str());
+		}
+		void Setup(avr_t *avr) override
+		{
+			m_pAVR = avr;
+			m_sd.Init(avr);
+			char szImage[] = "/tmp/MK404_microbench.XXXXXX";
+			int fd = mkstemp(szImage);
+			if (fd < 0 || ftruncate(fd, m_uiBlocks * 512))
+				perror(szImage);
+			if (fd >= 0)
+				close(fd);
+			m_strImage = szImage;
+			if (m_sd.Mount(m_strImage, m_uiBlocks * 512, false))
+				fprintf(stderr, "sdcard_block: could not mount %s\n", szImage);
+			avr_raise_irq(m_sd.GetIRQ(SDCard::SPI_CSEL), 0);
+		}
+		void Op() override
+		{
+			uint32_t uiBlock = m_uiBlock++ % m_uiBlocks;
+			const uint8_t uiCmd[6] = {0x40 | 17, uint8_t(uiBlock >> 24), uint8_t(uiBlock >> 16), uint8_t(uiBlock >> 8), uint8_t(uiBlock), 0xFF};
+			for (auto uiByte : uiCmd)
+				avr_raise_irq(m_sd.GetIRQ(SDCard::SPI_BYTE_IN), uiByte);
+			// R1, data token, 512 data bytes and the CRC.
+			for (int i=0; i<1+1+512+2; i++)
+				avr_raise_irq(m_sd.GetIRQ(SDCard::SPI_BYTE_IN), 0xFF);
+			Tick(522*16); // SPI at F_CPU/2.
+		}
+	private:
+		static constexpr uint32_t m_uiBlocks = 8192; // 4 MiB
+		SDCard m_sd;
+		string m_strImage;
+		uint32_t m_uiBlock = 0;
+};
+
+// Zig-zag extrusion moves stacked into layers. The print is cleared now and then so memory stays bounded,
+// that cost is amortised into the figure.
+class GLPrintBench: public MicroBench
+{
+	public:
+		GLPrintBench():MicroBench("glprint_coord", "GLPrint extruding NewCoord"){};
+		void Setup(avr_t *avr) override { m_pAVR = avr; }
+		void Op() override
+		{
+			uint32_t i = m_uiCoord++ % 200000;
+			if (i == 0)
+			{
+				m_print.Clear();
+				m_fE = 0;
+			}
+			m_fE += 0.00002f;
+			float fX = 0.02f + 0.0005f*(i % 400), fY = 0.02f + ((i/400) & 1 ? 0.1f : 0);
+			m_print.NewCoord(fX, fY, 0.0002f*(1 + i/4000), m_fE);
+		}
+	private:
+		GLPrint m_print {0.8f, 0.3f, 0.1f};
+		uint32_t m_uiCoord = 0;
+		float m_fE = 0;
+};
+
+// A byte from the AVR UART queued for the pty, with the far end drained by a reader thread.
+class PtyByteBench: public MicroBench
+{
+	public:
+		PtyByteBench():MicroBench("uart_pty_byte", "uart_pty byte from the AVR (OnByteIn)"){};
+		~PtyByteBench()
+		{
+			m_bStop = true;
+			if (m_thDrain.joinable())
+				m_thDrain.join();
+			if (m_fdSlave >= 0)
+				close(m_fdSlave);
+		}
+		void Setup(avr_t *avr) override
+		{
+			m_pAVR = avr;
+			m_pty.reset(new uart_pty());
+			m_pty->Init(avr);
+			m_fdSlave = open(m_pty->GetSlaveName().c_str(), O_RDONLY | O_NONBLOCK);
+			if (m_fdSlave < 0)
+			{
+				perror(m_pty->GetSlaveName().c_str());
+				return;
+			}
+			m_thDrain = thread([this]() {
+				uint8_t uiBuff[4096];
+				while (!m_bStop)
+					if (read(m_fdSlave, uiBuff, sizeof(uiBuff)) <= 0)
+						this_thread::sleep_for(chrono::microseconds(100));
+			});
+		}
+		void Op() override
+		{
+			avr_raise_irq(m_pty->GetIRQ(uart_pty::BYTE_IN), "G1 X10 Y10\n"[m_uiByte++ % 11]);
+			Tick(1600); // 115200 baud.
+		}
+	private:
+		unique_ptr<uart_pty> m_pty;
+		int m_fdSlave = -1;
+		thread m_thDrain;
+		atomic_bool m_bStop {false};
+		uint32_t m_uiByte = 0;
+};
+
+typedef struct Result_t
+{
+	uint64_t uiOps;
+	double dNsPerOp, dAllocsPerOp;
+} Result_t;
+
+// Doubles the batch until one takes at least dMinS, and reports that batch.
+static Result_t Run(MicroBench &bench, double dMinS)
+{
+	for (int i=0; i<1000; i++)
+		bench.Op(); // Warm up caches, lazily grown buffers and the like.
+	Result_t res = {};
+	for (uint64_t uiOps = 1000;; uiOps *= 2)
+	{
+		uint64_t uiAllocs = g_uiAllocs;
+		auto tpStart = chrono::steady_clock::now();
+		for (uint64_t i=0; i<uiOps; i++)
+			bench.Op();
+		double dSec = chrono::duration<double>(chrono::steady_clock::now() - tpStart).count();
+		res = {uiOps, dSec*1e9/uiOps, static_cast<double>(g_uiAllocs - uiAllocs)/uiOps};
+		if (dSec >= dMinS)
+			return res;
+	}
+}
+
+static vector<unique_ptr<MicroBench>> GetBenches()
+{
+	vector<unique_ptr<MicroBench>> vOut;
+	vOut.emplace_back(new TMCStepBench());
+	vOut.emplace_back(new ThermistorBench());
+	vOut.emplace_back(new LCDCharBench());
+	vOut.emplace_back(new SDReadBench());
+	vOut.emplace_back(new GLPrintBench());
+	vOut.emplace_back(new PtyByteBench());
+	return vOut;
+}
+
+int main(int argc, char *argv[])
+{
+	using namespace TCLAP;
+	CmdLine cmd("MK404 peripheral microbenchmarks. Each peripheral gets its own bare ATmega2560 (no firmware) and is driven "
+		"through its IRQs. Reports ns/op and heap allocations/op made on the benchmarking thread.", ' ', "1");
+	SwitchArg argList("","list","List the benchmarks and exit.");
+	cmd.add(argList);
+	ValueArg<string> argJSON("","json","Also writes the results as JSON to this file.",false,"","filename.json");
+	cmd.add(argJSON);
+	ValueArg<unsigned int> argMinMs("","min-ms","Minimum wall time of the measured batch, per benchmark. (default 500)",false,500,"ms");
+	cmd.add(argMinMs);
+	MultiArg<string> argBench("b","bench","Only runs the named benchmark(s). (default all)",false,"name");
+	cmd.add(argBench);
+	cmd.parse(argc, argv);
+
+	vector<unique_ptr<MicroBench>> vBenches = GetBenches();
+	if (argList.isSet())
+	{
+		for (auto &pBench : vBenches)
+			printf("%-16s %s\n", pBench->m_strName.c_str(), pBench->m_strDesc.c_str());
+		return 0;
+	}
+
+	const vector<string> &vOnly = argBench.getValue();
+	vector<pair<string, Result_t>> vResults;
+	for (auto &pBench : vBenches)
+	{
+		if (!vOnly.empty() && find(vOnly.begin(), vOnly.end(), pBench->m_strName) == vOnly.end())
+			continue;
+		avr_t *pAVR = avr_make_mcu_by_name("atmega2560");
+		if (!pAVR || avr_init(pAVR))
+		{
+			fprintf(stderr, "Could not create an atmega2560 core\n");
+			return 1;
+		}
+		pAVR->frequency = 16000000;
+		pBench->Setup(pAVR);
+		Result_t res = Run(*pBench, argMinMs.getValue()/1000.0);
+		vResults.push_back({pBench->m_strName, res});
+		// As in the simulator proper, the AVR is left alive until exit.
+	}
+
+	printf("%-16s %12s %12s %14s\n", "Benchmark", "ns/op", "allocs/op", "ops");
+	for (auto &r : vResults)
+		printf("%-16s %12.1f %12.3f %14llu\n", r.first.c_str(), r.second.dNsPerOp, r.second.dAllocsPerOp,
+			static_cast<unsigned long long>(r.second.uiOps));
+
+	if (argJSON.isSet())
+	{
+		FILE *pOut = fopen(argJSON.getValue().c_str(), "w");
+		if (!pOut)
+		{
+			perror(argJSON.getValue().c_str());
+			return 1;
+		}
+		fprintf(pOut, "{\"benchmarks\":[");
+		for (size_t i=0; i<vResults.size(); i++)
+			fprintf(pOut, "%s{\"name\":\"%s\",\"ns_per_op\":%.2f,\"allocs_per_op\":%.4f,\"ops\":%llu}", i ? "," : "",
+				vResults[i].first.c_str(), vResults[i].second.dNsPerOp, vResults[i].second.dAllocsPerOp,
+				static_cast<unsigned long long>(vResults[i].second.uiOps));
+		fprintf(pOut, "]}\n");
+		fclose(pOut);
+	}
+	return 0;
+}
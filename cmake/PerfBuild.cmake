@@ -0,0 +1,98 @@
+# Performance build variant (-DPERF_BUILD=ON), for long unattended runs.
+#
+# - simavr is compiled straight into MK404 instead of linked as libsimavr.a, so the core,
+#   its peripherals and ours are optimized as one LTO unit.
+# - The simavr core table only registers the MCUs our Wiring/PinSpec classes use
+#   (PERF_MCU_CORES), so the decoder, the mcu lookup and the peripheral init only ever
+#   see those and LTO can drop the rest.
+# - PGO=GENERATE builds an instrumented binary, "make PGO_Train" runs the MK404_bench
+#   scenarios with it, and PGO=USE rebuilds with that profile.
+#
+#   cmake -DPERF_BUILD=ON -DPGO=GENERATE -DCMAKE_BUILD_TYPE=Release .. && make && make PGO_Train
+#   cmake -DPGO=USE .. && make
+#
+# The debug/default build is unaffected when PERF_BUILD is off.
+
+set(PERF_MCU_CORES mega2560 mega32u4 CACHE STRING "simavr cores (cores/sim_<name>.c) built into the perf variant")
+set(PGO "OFF" CACHE STRING "Profile guided optimization for the perf build: OFF, GENERATE or USE")
+set_property(CACHE PGO PROPERTY STRINGS OFF GENERATE USE)
+set(PGO_DIR "${PROJECT_BINARY_DIR}/pgo" CACHE PATH "Where PGO profiles are written/read")
+
+set(SIMAVR_SRC_DIR "${PROJECT_SOURCE_DIR}/3rdParty/simavr/simavr")
+set(SIMAVR_GEN_DIR "${PROJECT_BINARY_DIR}/simavr_perf")
+
+file(GLOB SIMAVR_SOURCES "${SIMAVR_SRC_DIR}/sim/*.c")
+list(REMOVE_ITEM SIMAVR_SOURCES "${SIMAVR_SRC_DIR}/sim/run_avr.c")
+
+# Stands in for the sim_core_config.h/sim_core_decl.h the simavr Makefile generates for every core.
+set(CORE_CONFIG "// Generated by cmake/PerfBuild.cmake\n#pragma once\n")
+set(CORE_DECL "// Generated by cmake/PerfBuild.cmake\n#pragma once\n#include \"sim_core_config.h\"\n")
+set(CORE_TABLE "")
+foreach(CORE ${PERF_MCU_CORES})
+	if (NOT EXISTS "${SIMAVR_SRC_DIR}/cores/sim_${CORE}.c")
+		message(FATAL_ERROR "PERF_MCU_CORES: no simavr core ${SIMAVR_SRC_DIR}/cores/sim_${CORE}.c")
+	endif()
+	list(APPEND SIMAVR_CORE_SOURCES "${SIMAVR_SRC_DIR}/cores/sim_${CORE}.c")
+	string(TOUPPER ${CORE} CORE_UPPER)
+	set(CORE_CONFIG "${CORE_CONFIG}#define CONFIG_${CORE_UPPER} 1\n")
+	set(CORE_DECL "${CORE_DECL}extern avr_kind_t ${CORE};\n")
+	set(CORE_TABLE "${CORE_TABLE}\t&${CORE},\n")
+endforeach()
+set(CORE_DECL "${CORE_DECL}extern avr_kind_t * avr_kind[];\n#ifdef AVR_KIND_DECL\navr_kind_t * avr_kind[] = {\n${CORE_TABLE}\tNULL\n};\n#endif\n")
+file(WRITE "${SIMAVR_GEN_DIR}/sim_core_config.h" "${CORE_CONFIG}")
+file(WRITE "${SIMAVR_GEN_DIR}/sim_core_decl.h" "${CORE_DECL}")
+
+# The cores pull their register layout from avr-libc's io headers. -idirafter so they can't shadow the host's libc.
+find_path(AVR_LIBC_INCLUDE avr/iom2560.h PATHS /usr/lib/avr/include /usr/avr/include /usr/local/avr/include /opt/local/avr/include)
+if (NOT AVR_LIBC_INCLUDE)
+	message(FATAL_ERROR "PERF_BUILD needs the avr-libc headers (avr/iom2560.h) to build the simavr cores")
+endif()
+
+list(APPEND SIMAVR_SOURCES ${SIMAVR_CORE_SOURCES})
+set_source_files_properties(${SIMAVR_SOURCES} PROPERTIES COMPILE_FLAGS "-std=gnu99 -w -I${SIMAVR_GEN_DIR} -idirafter ${AVR_LIBC_INCLUDE}")
+set_source_files_properties(${SIMAVR_CORE_SOURCES} PROPERTIES COMPILE_FLAGS "-std=gnu99 -w -I${SIMAVR_GEN_DIR} -I${SIMAVR_SRC_DIR}/sim -idirafter ${AVR_LIBC_INCLUDE}")
+
+include(CheckIPOSupported)
+check_ipo_supported(RESULT PERF_IPO OUTPUT PERF_IPO_ERR LANGUAGES C CXX)
+if (NOT PERF_IPO)
+	message(WARNING "PERF_BUILD: LTO is not supported by this toolchain (${PERF_IPO_ERR}), building without it")
+endif()
+
+if (CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+	set(PGO_GENERATE_FLAGS "-fprofile-instr-generate=${PGO_DIR}/mk404-%p.profraw")
+	set(PGO_USE_FLAGS "-fprofile-instr-use=${PGO_DIR}/mk404.profdata" -Wno-profile-instr-unprofiled -Wno-profile-instr-out-of-date)
+else()
+	# The AVR and GL threads share counters, hence atomic updates and correction on use.
+	set(PGO_GENERATE_FLAGS "-fprofile-generate=${PGO_DIR}" -fprofile-update=atomic)
+	set(PGO_USE_FLAGS "-fprofile-use=${PGO_DIR}" -fprofile-correction -Wno-missing-profile)
+endif()
+
+# Applies the perf options to a target built from ${SIMAVR_SOURCES} as well as our own.
+function(perf_build_target TARGET)
+	target_compile_options(${TARGET} PRIVATE -O3)
+	if (PERF_IPO)
+		set_property(TARGET ${TARGET} PROPERTY INTERPROCEDURAL_OPTIMIZATION TRUE)
+	endif()
+	if (PGO STREQUAL "GENERATE")
+		target_compile_options(${TARGET} PRIVATE ${PGO_GENERATE_FLAGS})
+		target_link_libraries(${TARGET} ${PGO_GENERATE_FLAGS})
+	elseif (PGO STREQUAL "USE")
+		target_compile_options(${TARGET} PRIVATE ${PGO_USE_FLAGS})
+		target_link_libraries(${TARGET} ${PGO_USE_FLAGS})
+	endif()
+endfunction()
+
+# Training run: the end to end bench scenarios, against the instrumented MK404.
+if (PGO STREQUAL "GENERATE")
+	if (CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+		find_program(LLVM_PROFDATA NAMES llvm-profdata)
+		set(PGO_MERGE COMMAND ${LLVM_PROFDATA} merge -o ${PGO_DIR}/mk404.profdata ${PGO_DIR})
+	endif()
+	add_custom_target(PGO_Train
+		COMMAND ${CMAKE_COMMAND} -E remove_directory ${PGO_DIR}
+		COMMAND ${CMAKE_COMMAND} -E make_directory ${PGO_DIR}
+		COMMAND ./MK404_bench --out pgo_train.json
+		${PGO_MERGE}
+		COMMAND ${CMAKE_COMMAND} -E echo "Profile written to ${PGO_DIR}, now reconfigure with -DPGO=USE and rebuild."
+		WORKING_DIRECTORY ${PROJECT_BINARY_DIR})
+endif()
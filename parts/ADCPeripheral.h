@@ -23,6 +23,7 @@
 
 #include "BasePeripheral.h"
 #include <avr_adc.h>
+#include <atomic>
 
 class ADCPeripheral: public BasePeripheral
 {
@@ -30,9 +31,14 @@ class ADCPeripheral: public BasePeripheral
         // Returns the current mux number for this peripheral
         uint8_t GetMuxNumber() { return m_uiMux; }
 
-        // Override this with your own ADC implementation. You don't need to worry abouy
-        // verifying you are the current ADC channel.
-        virtual uint32_t OnADCRead(struct avr_irq_t * irq, uint32_t value) = 0;
+        // Publishes the reading (mV). Call whenever it changes, from any thread; a conversion on
+        // our channel then just picks up the latest, rather than calling out to work it out.
+        inline void SetADCValue(uint32_t uiMV) { m_uiADCValue.store(uiMV, std::memory_order_relaxed); }
+
+        // For sources that work their reading out lazily: while set, OnADCRefresh() is called
+        // ahead of each conversion on our channel, to SetADCValue() if it has changed.
+        inline void SetRefresh(bool bRefresh) { m_bRefresh.store(bRefresh, std::memory_order_relaxed); }
+        virtual void OnADCRefresh() {};
 
         // Sets up the IRQs on "avr" for this class. Optional name override IRQNAMES.
         template<class C>
@@ -62,7 +68,9 @@ class ADCPeripheral: public BasePeripheral
 
             if (v.src != m_uiMux)
                 return;
-            uint32_t uiVal = OnADCRead(irq,value);
+            if (m_bRefresh.load(std::memory_order_relaxed))
+                OnADCRefresh();
+            uint32_t uiVal = m_uiADCValue.load(std::memory_order_relaxed);
             if (uiVal == m_uiLast)
                 return;
             RaiseIRQ(C::ADC_VALUE_OUT,uiVal);
@@ -83,5 +91,7 @@ class ADCPeripheral: public BasePeripheral
 
         uint8_t m_uiMux = 0;
 
-        uint32_t m_uiLast = 0;
+        std::atomic_uint32_t m_uiADCValue {0}; // As published
+        std::atomic_bool m_bRefresh {false};
+        uint32_t m_uiLast = 0; // As last raised to the ADC
 };
@@ -22,19 +22,22 @@
 
 #include <sim_avr.h>
 #include <sim_irq.h>
+#include <atomic>       // for atomic, memory_order_relaxed
+#include <typeinfo>     // for typeid
+#include "sim_time.h"   // for avr_usec_to_cycles
+#include "IRQArena.h"   // for IRQArena
+#include "IRQBinding.h" // for Notify, Timer
+#include "TimerWheel.h" // for TimerWheel
 
 #pragma once
 
-// Use lambdas to expose something that can be called from C, but returns to our C++ object
-// TODO: find a way to ditch the macro. I tried and failed, see the template blocks below...
-
-// Generates a lambda function inline that can be called from SimAVR's C IRQ code.
+// Binds a member function so it can be called from SimAVR's C IRQ code, with the object as the param.
 #define MAKE_C_CALLBACK(class, function) \
-   [](struct avr_irq_t *irq, uint32_t value, void* param) {class *p = (class*) param; p->function(irq,value); }
+   (&IRQBinding::Notify<class, decltype(&class::function), &class::function>)
 
-// Generates an inline lambda for use with aver_cycle_timer
+// Same, for use with avr_cycle_timer/RegisterTimer.
 #define MAKE_C_TIMER_CALLBACK(class, function) \
-   [](avr_t * avr, avr_cycle_count_t when, void* param) {class *p = (class*) param; return p->function(avr,when); }
+   (&IRQBinding::Timer<class, decltype(&class::function), &class::function>)
 
 
 class BasePeripheral
@@ -51,78 +54,52 @@ class BasePeripheral
         // Connects external IRQ to internal one.
         inline void ConnectFrom(avr_irq_t *irqSrc, unsigned int eDest) {avr_connect_irq(irqSrc, m_pIrq + eDest);}
 
+        // An AVR port bit, e.g. {'F',5}.
+        typedef struct PortPin_t { char cPort; uint8_t uiBit; } PortPin_t;
+
+        // Running total of cycle timer registrations made by all peripherals, for the TelemetryHost perf counters.
+        static inline uint64_t GetTimerCount() { return _TimerCount().load(std::memory_order_relaxed); }
+
     protected:
 
         // Sets up the IRQs on "avr" for this class. Optional name override IRQNAMES.
         template<class C>
         void _Init(avr_t *avr, C *p, const char** IRQNAMES = nullptr) {
             m_pAVR = avr;
-            if (IRQNAMES)
-                m_pIrq = avr_alloc_irq(&avr->irq_pool,0,p->COUNT,IRQNAMES);
-            else
-                m_pIrq = avr_alloc_irq(&avr->irq_pool,0,p->COUNT,p->_IRQNAMES);
+            m_pWheel = &TimerWheel::Get(avr);
+            // From the AVR's arena rather than avr_alloc_irq, so same-type parts share blocks.
+            m_pIrq = IRQArena::Get(avr).Alloc(typeid(C), p->COUNT, IRQNAMES ? IRQNAMES : p->_IRQNAMES);
          };
 
         // Raises your own IRQ
         void inline RaiseIRQ(unsigned int eDest, uint32_t value) { avr_raise_irq(m_pIrq + eDest, value);}
         void inline RaiseIRQFloat(unsigned int eDest, uint32_t value) { avr_raise_irq_float(m_pIrq + eDest, value,m_pIrq->flags | IRQ_FLAG_FLOATING);}
 
-        // Registers an IRQ notification function. Use MAKE_C_CALLBACK to make a lambda function.
+        // Registers an IRQ notification function. Use MAKE_C_CALLBACK to bind a member function.
         template <class C>
         void inline RegisterNotify(unsigned int eSrc, avr_irq_notify_t func, C* pObj) { avr_irq_register_notify(m_pIrq + eSrc, func, pObj); };
 
         // Cancels a registered cycle timer.
         template <class C>
-        void inline CancelTimer(avr_cycle_timer_t func, C* pObj) { avr_cycle_timer_cancel(m_pAVR, func, pObj); };
+        void inline CancelTimer(avr_cycle_timer_t func, C* pObj) { Wheel().Cancel(func, pObj); };
 
         // Registers a callback for a cycle timer, in usec
         template <class C>
-        void inline RegisterTimerUsec(avr_cycle_timer_t func, uint32_t uiUsec, C* pObj) { avr_cycle_timer_register_usec(m_pAVR, uiUsec, func, pObj); };
+        void inline RegisterTimerUsec(avr_cycle_timer_t func, uint32_t uiUsec, C* pObj) { _TimerCount().fetch_add(1, std::memory_order_relaxed); Wheel().Register(func, pObj, m_pAVR->cycle + avr_usec_to_cycles(m_pAVR, uiUsec)); };
 
         // Registers a callback for a cycle timer, in cycles.
         template <class C>
-        void inline RegisterTimer(avr_cycle_timer_t func, uint32_t uiCycles, C* pObj) { avr_cycle_timer_register(m_pAVR, uiCycles, func, pObj); };
-
-        // Template to easily register and deal with C-ifying a member function.
-        //typedef void (BasePeripheral::*BasePeripheralFcn)(avr_irq_t * irq, uint32_t value);
-
-        // template<class C>
-        // void RegisterNotify(unsigned int eDest, void (C::*CFcn)(avr_irq_t *irq, uint32_t value)){
-        //     avr_irq_notify_t fCB = [&CFcn](avr_irq_t *irq, unsigned int value, void *param) {
-        //         C *p = (C*) param;
-        //         (p->*CFcn)(irq,value);
-        //         };
-        //     avr_irq_register_notify(m_pIrq + eDest,fCB, this);
-        //     };
-
-/*         template<typename T, typename R>
-        void* void_cast(R(T::*f)())
-        {
-            union
-            {
-                R(T::*pf)();
-                void* p[2];
-            };
-            pf = f;
-            return p;
-        }
+        void inline RegisterTimer(avr_cycle_timer_t func, uint32_t uiCycles, C* pObj) { _TimerCount().fetch_add(1, std::memory_order_relaxed); Wheel().Register(func, pObj, m_pAVR->cycle + uiCycles); };
 
-
-        template<class C>
-             void RegisterNotify(unsigned int eDest, void (C::*CFcn)(avr_irq_t *irq, uint32_t value), C* pSrc){
-                typedef struct sH_t{
-                    void (C::*pFcn)(avr_irq_t *irq, uint32_t value);
-                    C *pClass;
-                }sH_t;
-                sH_t sO {pFcn:CFcn, pClass:pSrc};
-                auto fCB = [](avr_irq_t *irq, unsigned int value, void *param) {
-                    sH_t *p = (sH_t*)param;
-                    (p->pClass->*p->pFcn)(irq,value);
-                 };
-             avr_irq_register_notify(m_pIrq + eDest,fCB, &sO);
-             }; */
         avr_irq_t * m_pIrq = nullptr;
         struct avr_t *m_pAVR = nullptr;
     private:
+        // Peripheral timers go on the AVR's TimerWheel rather than straight into simavr's list.
+        inline TimerWheel& Wheel() { if (!m_pWheel) m_pWheel = &TimerWheel::Get(m_pAVR); return *m_pWheel; }
+        TimerWheel *m_pWheel = nullptr;
+
+        // Header-only home for the counter so we don't need a .cpp just for that.
+        // Atomic, peripherals on the MMU's thread register timers too; it's only a count, so relaxed.
+        static inline std::atomic<uint64_t>& _TimerCount() { static std::atomic<uint64_t> uiCount {0}; return uiCount; }
 
 };
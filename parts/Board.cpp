@@ -22,21 +22,33 @@
 
 #include <Board.h>
 #include <fcntl.h>    // for open, O_CREAT, O_RDWR, SEEK_SET
-#include "sim_elf.h"  // for avr_load_firmware, elf_firmware_t, elf_read_fir...
-#include "sim_gdb.h"  // for avr_gdb_init
-#include "sim_hex.h"  // for read_ihex_file
-#include <stdlib.h>   // for exit, free
-#include <unistd.h>   // for close, ftruncate, lseek, read, write, ssize_t
-#include <cstring>    // for memcpy, NULL
+#include <sys/mman.h> // for mmap, munmap
+#include "FirmwareCache.h" // for FirmwareCache
+#include "sim_elf.h"  // for avr_load_firmware, elf_firmware_t
+#include <stdlib.h>   // for exit, malloc
+#include <unistd.h>   // for close, fsync, ftruncate, pwrite, read, unlink
+#include <algorithm>  // for min
+#include <cstring>    // for memcmp, memcpy, memset
+#include <fstream>    // IWYU pragma: keep for ifstream
+#include <iterator>   // for istreambuf_iterator
 #include "sim_io.h"         // for avr_io_getirq
 #include "avr_uart.h"
+#include "StartupTimeline.h"  // for StartupTimeline, StartupTimeline::Phase
 #include "TelemetryHost.h"
+#include "ThreadPolicy.h"     // for ThreadPolicy
+#include "TimerWheel.h"       // for TimerWheel
 
 using namespace std;
 using namespace Boards;
 
+Log::Module Board::m_log("Board");
+uint32_t Board::m_uiCheckpointMs = 0;
+uint32_t Board::m_uiCheckpointKeep = 0;
+constexpr uint32_t Board::m_uiFlashPage;
+
 void Board::CreateAVR()
 {
+	StartupTimeline::Phase phase("CreateAVR");
 	m_pAVR = avr_make_mcu_by_name(m_wiring.GetMCUName().c_str());
 
 	if (!m_pAVR)
@@ -48,14 +60,24 @@ void Board::CreateAVR()
 	m_pAVR->custom.deinit = [](avr_t *p, void *param){Board *board = (Board*)param; board->_OnAVRDeinit();};
 	m_pAVR->custom.data = this;
 	avr_init(m_pAVR);
+	// Board code and scripts poke pins at runtime, don't make them look up the port IRQ every time.
+	for (unsigned int i=0; i<PinNames::PIN_COUNT; i++)
+		if (m_wiring.IsPin(static_cast<PinNames::Pin>(i)))
+			m_pPinIRQs[i] = m_wiring.DIRQLU(m_pAVR, static_cast<PinNames::Pin>(i));
+	StartupTimeline::Phase phaseEEPROM("EEPROM load");
 	m_EEPROM.Load(m_pAVR,GetStorageFileName("eeprom").c_str());
 }
 
 void Board::CreateBoard(string strFW, uint8_t uiV,  bool bGDB, uint32_t uiVCDRate, string strBoot)
 {
 	CreateAVR();
+	if (PCProfiler::IsEnabled())
+		m_profiler.Init(m_pAVR);
+	m_strFW = strFW;
+	m_strBoot = strBoot;
 	if (!strFW.empty())
 	{
+		StartupTimeline::Phase phase("firmware load");
 		m_FWBase = LoadFirmware(strFW);
 		m_pAVR->pc = m_FWBase;
 	}
@@ -64,9 +86,15 @@ void Board::CreateBoard(string strFW, uint8_t uiV,  bool bGDB, uint32_t uiVCDRat
 
 	if (!strBoot.empty())
 	{
+		StartupTimeline::Phase phase("bootloader load");
 		m_bootBase = LoadFirmware(strBoot);
 		m_pAVR->reset_pc = m_bootBase;
 	}
+	// Boards running the same firmware share its flash pages until they write to them.
+	{
+		StartupTimeline::Phase phase("flash map");
+		m_uiFlashMap = FirmwareCache::Map(m_pAVR, m_vFirmware);
+	}
 	string strVCD = GetStorageFileName("VCD");
 	strVCD.replace(strVCD.end()-3,strVCD.end(), "vcd");
 	printf("Initialized VCD file %s\n",strVCD.c_str());
@@ -77,18 +105,44 @@ void Board::CreateBoard(string strFW, uint8_t uiV,  bool bGDB, uint32_t uiVCDRat
 	m_pAVR->avcc = 5000;
 	m_pAVR->log = 1 + uiV;
 
-	TelemetryHost::GetHost()->Init(m_pAVR, strVCD,uiVCDRate);
+	{
+		StartupTimeline::Phase phase("TelemetryHost init");
+		TelemetryHost::GetHost()->Init(m_pAVR, strVCD,uiVCDRate);
+	}
+	if (ISRStats::IsEnabled())
+		m_isrStats.Init(m_pAVR, m_strBoard + "_" + m_wiring.GetMCUName());
+	if (StackGuard::IsEnabled())
+		m_stackGuard.Init(m_pAVR, m_strBoard + "_" + m_wiring.GetMCUName());
+	if (FirmwareVars::IsEnabled())
+		m_fwVars.Init(m_pAVR, m_strBoard + "_" + m_wiring.GetMCUName());
+	if (IdleSkip::IsEnabled())
+		m_idleSkip.Init(m_pAVR, m_strBoard + "_" + m_wiring.GetMCUName());
+	if (ShmExport::IsEnabled())
+		m_shmExport.Init(m_pAVR, ShmExport::GetName() + "_" + m_strBoard + "_" + m_wiring.GetMCUName() + (m_uiInstance ? "_" + std::to_string(m_uiInstance) : ""));
+
+	MetricLabels vBoard {{"board", m_strBoard}};
+	m_mtrCycles.Register("mk404_avr_cycles_total", "AVR cycles run.", vBoard);
+	m_mtrCycles.RegisterRate("mk404_avr_cycle_rate_hertz", "AVR cycles run per wall-clock second.", vBoard);
+	m_mtrCycles.RegisterRate("mk404_real_time_factor", "Simulated seconds per wall-clock second.", vBoard, 1.0/m_uiFreq);
 
-	// even if not setup at startup, activate gdb if crashing
-	m_pAVR->gdb_port = 1234;
+	if (m_uiCheckpointMs)
+		m_pCheckpoints.reset(new CheckpointRing(m_uiCheckpointKeep));
 
-	// Enable full GDB support
+	// Enable full GDB support. Our own stub, simavr's costs a socket poll per instruction.
 	if (bGDB)
 	{
-		m_pAVR->state = cpu_Stopped;
-		avr_gdb_init(m_pAVR);
+		m_pGDB.reset(new GDBStub(m_pAVR));
+		if (!m_pGDB->Start())
+			m_pGDB.reset();
 	}
+	// Otherwise simavr's comes up if it crashes. Ours halts (and reports) the crash itself.
+	m_pAVR->gdb_port = m_pGDB ? 0 : 1234;
+	if (Coverage::IsEnabled())
+		m_coverage.Init(m_pAVR); // After the GDB stub, it wraps whichever run function is in place.
+	if (FastBoot::IsEnabled())
+		m_fastBoot.Init(m_pAVR); // Last, it unwraps itself once booted.
 
+	StartupTimeline::Phase phase("SetupHardware");
 	SetupHardware();
 };
 
@@ -106,31 +160,257 @@ void Board::AddUARTTrace(const char chrUART)
 		pTH->AddTrace(xoff, string("UART")+chrUART, {TC::Serial});
 }
 
+void Board::SetColocated(Board *pGuest, uint32_t uiSliceUs)
+{
+	if (m_thread!=0 || pGuest->m_thread!=0 || pGuest == this)
+	{
+		fprintf(stderr, "Cannot co-locate %s with %s once running.\n", pGuest->m_wiring.GetMCUName().c_str(), m_wiring.GetMCUName().c_str());
+		return;
+	}
+	m_pGuest = pGuest;
+	pGuest->m_pHost = this;
+	m_uiSliceCycles = std::max<uint64_t>(1, ((uint64_t)m_uiFreq*uiSliceUs)/1000000U);
+	pGuest->m_uiSliceCycles = std::max<uint64_t>(1, ((uint64_t)pGuest->m_uiFreq*uiSliceUs)/1000000U);
+	printf("%s runs on the %s thread, %u us at a time.\n", pGuest->m_wiring.GetMCUName().c_str(), m_wiring.GetMCUName().c_str(), uiSliceUs);
+}
+
+void Board::RunSlice()
+{
+	if (!m_bColocatedRun || m_iColocatedState == cpu_Done || m_iColocatedState == cpu_Crashed)
+		return;
+	SelectThreadState();
+	if (!m_bColocatedInit)
+	{
+		m_bColocatedInit = true;
+		m_uiSliceEnd = m_pAVR->cycle;
+		printf("Starting %s execution...\n", m_wiring.GetMCUName().c_str());
+	}
+	m_uiSliceEnd += m_uiSliceCycles;
+	if (m_uiSliceEnd <= m_pAVR->cycle || m_uiSliceEnd > m_pAVR->cycle + m_uiSliceCycles) // e.g. a checkpoint restore
+		m_uiSliceEnd = m_pAVR->cycle + m_uiSliceCycles;
+	int &state = m_iColocatedState;
+	// As RunAVR(), less what the host already does for both (pacing, remote, scripts, lockstep).
+	while (m_pAVR->cycle < m_uiSliceEnd && (state == cpu_Running || state == cpu_Sleeping) && !m_bQuit)
+	{
+		CheckMCUSR();
+		OnAVRCycle();
+		for (auto pPty : m_vPtys)
+			pPty->Poll(); // Host data only flows from here or on an XON, which an idle guest never raises.
+		CheckReset();
+		state = avr_run(m_pAVR);
+		for (uint32_t uiRun = 1; uiRun<m_uiBatchSize && (state == cpu_Running || state == cpu_Sleeping) && m_pAVR->cycle < m_uiSliceEnd; uiRun++)
+			state = avr_run(m_pAVR);
+		m_mtrCycles.Set(m_pAVR->cycle);
+		if (IdleSkip::IsEnabled() && state == cpu_Running && !m_pGDB)
+			m_idleSkip.Check(m_uiSliceEnd);
+	}
+	if (state == cpu_Crashed)
+		TelemetryHost::GetHost()->DumpFlightRecorder(m_wiring.GetMCUName() + " crashed");
+}
+
+void Board::EndColocated()
+{
+	if (!m_bColocatedInit)
+		return;
+	SelectThreadState();
+	avr_terminate(m_pAVR);
+	printf("%s finished.\n",m_wiring.GetMCUName().c_str());
+	m_bColocatedInit = false;
+}
+
 void Board::StartAVR()
 {
-	if (m_thread!=0)
+	if (m_thread!=0 || m_bColocatedRun)
 	{
 		printf("Attempted to start an already running %s\n", m_wiring.GetMCUName().c_str());
 		return;
 	}
-	auto fRunCB =[](void * param) { Board* p = (Board*)param; return p->RunAVR();};
+	if (m_pHost) // The host's thread runs it from here on.
+	{
+		m_bColocatedRun = true;
+		return;
+	}
+	auto fRunCB =[](void * param) { Board* p = (Board*)param; ThreadPolicy::Apply(ThreadPolicy::Role::AVR, "avr-" + p->m_strBoard); return p->RunAVR();};
 	pthread_create(&m_thread, NULL, fRunCB, this);
 }
 
-void Board::StopAVR()
+void Board::SuspendAVR()
 {
-	printf("Stopping %s_%s...\n", m_strBoard.c_str(), m_wiring.GetMCUName().c_str());
 	if (m_thread==0)
 		return;
-	m_bQuit = true;
+	m_bSuspend = true;
 	pthread_join(m_thread,NULL);
 	m_thread = 0;
+}
+
+void Board::DetachStorage()
+{
+	if (m_fdFlash>0)
+		close(m_fdFlash); // SaveFlash() does nothing without it.
+	m_fdFlash = 0;
+	m_EEPROM.Detach();
+}
+
+void Board::RestoreBaseline(const Snapshot &snap)
+{
+	OnDiscardStorage(); // First, remounting raises pins the snapshot then puts back.
+	LoadSnapshot(snap);
+	m_bQuit = false;
+	m_bReset = false;
+	m_bPaused = false;
+}
+
+void Board::StopAVR()
+{
+	printf("Stopping %s_%s...\n", m_strBoard.c_str(), m_wiring.GetMCUName().c_str());
+	if (m_pHost && m_bColocatedRun)
+	{
+		m_bQuit = true; // Only takes effect if the host is still running, stop that first.
+		m_bColocatedRun = false;
+	}
+	else if (m_thread==0)
+		return;
+	else
+	{
+		m_bQuit = true;
+		pthread_join(m_thread,NULL);
+		m_thread = 0;
+	}
+	if (ShmExport::IsEnabled())
+		m_shmExport.Publish(); // The final state, for anyone still mapping it.
+	if (ISRStats::IsEnabled())
+		m_isrStats.Print();
+	if (StackGuard::IsEnabled())
+		m_stackGuard.Print();
+	if (IdleSkip::IsEnabled())
+		m_idleSkip.Print();
+	if (PCProfiler::IsEnabled())
+	{
+		string strProfile = GetStorageFileName("profile");
+		m_profiler.Report(strProfile.substr(0, strProfile.size()-4), m_strBoard + "_" + m_wiring.GetMCUName());
+	}
+	if (Coverage::IsEnabled())
+	{
+		string strCoverage = GetStorageFileName("coverage");
+		m_coverage.Report(strCoverage.substr(0, strCoverage.size()-4), m_strBoard + "_" + m_wiring.GetMCUName());
+	}
 	printf("Done\n");
 }
 
+void Board::ThrottleAVR()
+{
+	static constexpr uint32_t uiSliceMs = 10; // How often (in AVR time) to check the host clock.
+	auto tpNow = chrono::steady_clock::now();
+	// (Re)base the reference on first run, after a pause, or if the cycle count went backwards.
+	if (m_uiThrottleEnd == 0 || m_pAVR->cycle < m_uiThrottleRef)
+	{
+		m_uiThrottleRef = m_pAVR->cycle;
+		m_tpThrottleRef = tpNow;
+	}
+	else
+	{
+		double dSimSec = (double)(m_pAVR->cycle - m_uiThrottleRef)/((double)m_uiFreq*m_fSpeed);
+		auto tpTarget = m_tpThrottleRef + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(dSimSec));
+		if (tpTarget > tpNow)
+			usleep(chrono::duration_cast<chrono::microseconds>(tpTarget - tpNow).count());
+		else if (tpNow - tpTarget > chrono::seconds(1))
+		{
+			// The host can't keep up; don't try to make up for it with a burst later on.
+			m_uiThrottleRef = m_pAVR->cycle;
+			m_tpThrottleRef = tpNow;
+		}
+	}
+	m_uiThrottleEnd = m_pAVR->cycle + (m_uiFreq/1000)*uiSliceMs;
+}
+
+void Board::SaveSnapshot(Snapshot &snap)
+{
+	snap.Put("AVR/cycle", m_pAVR->cycle);
+	snap.Put("AVR/pc", m_pAVR->pc);
+	snap.Put("AVR/state", m_pAVR->state);
+	snap.Put("AVR/sreg", m_pAVR->sreg);
+	snap.Put("AVR/interrupt_state", m_pAVR->interrupt_state);
+	snap.Put("AVR/run_cycle_count", m_pAVR->run_cycle_count);
+	snap.Put("AVR/run_cycle_limit", m_pAVR->run_cycle_limit);
+	snap.Put("AVR/data", m_pAVR->data, m_pAVR->ramend + 1); // Registers, I/O and SRAM
+	snap.Put("AVR/flash", m_pAVR->flash, m_pAVR->flashend + 1);
+	snap.Put("AVR/cycle_timers", m_pAVR->cycle_timers);
+	TimerWheel::Get(m_pAVR).SaveState(snap);
+	snap.Put("AVR/interrupts", m_pAVR->interrupts);
+	// The pending bits live in the vectors themselves.
+	vector<uint8_t> vPending;
+	for (unsigned i=0; i<m_pAVR->interrupts.vector_count; i++)
+		vPending.push_back(m_pAVR->interrupts.vector[i]->pending);
+	snap.Put("AVR/vector_pending", vPending.data(), vPending.size());
+	snap.Put("Board/last_mcusr", m_uiLastMCUSR);
+	m_EEPROM.SaveState(snap);
+	OnSaveState(snap);
+}
+
+void Board::LoadSnapshot(const Snapshot &snap)
+{
+	snap.Get("AVR/cycle", m_pAVR->cycle);
+	snap.Get("AVR/pc", m_pAVR->pc);
+	snap.Get("AVR/state", m_pAVR->state);
+	snap.Get("AVR/sreg", m_pAVR->sreg);
+	snap.Get("AVR/interrupt_state", m_pAVR->interrupt_state);
+	snap.Get("AVR/run_cycle_count", m_pAVR->run_cycle_count);
+	snap.Get("AVR/run_cycle_limit", m_pAVR->run_cycle_limit);
+	snap.Get("AVR/data", m_pAVR->data, m_pAVR->ramend + 1);
+	// Flash is usually unchanged, don't dirty shared (copy-on-write) pages needlessly.
+	vector<uint8_t> vFlash(m_pAVR->flashend + 1);
+	if (snap.Get("AVR/flash", vFlash.data(), vFlash.size()) && memcmp(vFlash.data(), m_pAVR->flash, vFlash.size())!=0)
+		memcpy(m_pAVR->flash, vFlash.data(), vFlash.size());
+	snap.Get("AVR/cycle_timers", m_pAVR->cycle_timers);
+	TimerWheel::Get(m_pAVR).LoadState(snap); // After the simavr list, it re-registers itself there.
+	snap.Get("AVR/interrupts", m_pAVR->interrupts);
+	vector<uint8_t> vPending(m_pAVR->interrupts.vector_count);
+	if (snap.Get("AVR/vector_pending", vPending.data(), vPending.size()))
+		for (unsigned i=0; i<vPending.size(); i++)
+			m_pAVR->interrupts.vector[i]->pending = vPending[i];
+	snap.Get("Board/last_mcusr", m_uiLastMCUSR);
+	m_uiThrottleEnd = 0; // Cycle count moved, rebase the pacing.
+	m_EEPROM.LoadState(snap);
+	OnLoadState(snap);
+}
+
+void Board::TakeCheckpoint()
+{
+	Snapshot snap;
+	SaveSnapshot(snap);
+	m_pCheckpoints->Add(m_pAVR->cycle, snap);
+	m_uiNextCheckpoint = m_pAVR->cycle + (avr_cycle_count_t)(m_uiFreq/1000)*m_uiCheckpointMs;
+	if (ParallelReplay::IsEnabled())
+		ParallelReplay::OnCheckpoint(this, snap); // Forks a segment from here, or ends one.
+}
+
+bool Board::StartRewind(avr_cycle_count_t uiTarget)
+{
+	if (uiTarget > m_pAVR->cycle)
+	{
+		fprintf(stderr, "Rewind: cycle %llu hasn't happened yet.\n", (unsigned long long)uiTarget);
+		return false;
+	}
+	Snapshot snap;
+	avr_cycle_count_t uiFound;
+	if (!m_pCheckpoints->Find(uiTarget, snap, uiFound))
+	{
+		fprintf(stderr, "Rewind: cycle %llu is before the oldest checkpoint.\n", (unsigned long long)uiTarget);
+		return false;
+	}
+	LoadSnapshot(snap);
+	m_pCheckpoints->DropAfter(uiFound); // The replay makes those again, from what happens this time.
+	m_uiNextCheckpoint = uiFound + (avr_cycle_count_t)(m_uiFreq/1000)*m_uiCheckpointMs;
+	m_uiRewindTarget = uiTarget;
+	m_bRewinding = true;
+	printf("Rewinding to cycle %llu from the checkpoint at %llu\n", (unsigned long long)uiTarget, (unsigned long long)uiFound);
+	return true;
+}
+
 void Board::_OnAVRInit()
 {
 	std::string strFlash = GetStorageFileName("flash");
+	m_strFlashJournal = strFlash + ".journal";
 
 	m_fdFlash = open(strFlash.c_str(), O_RDWR|O_CREAT, 0644);
 	if (m_fdFlash < 0) {
@@ -144,6 +424,7 @@ void Board::_OnAVRInit()
 			perror(strFlash.c_str());
 			exit(1);
 		}
+		ReplayFlashJournal();
 		ssize_t r = read(m_fdFlash, m_pAVR->flash, m_pAVR->flashend + 1);
 		if (r != m_pAVR->flashend + 1) {
 			fprintf(stderr, "unable to load flash memory\n");
@@ -157,49 +438,214 @@ void Board::_OnAVRInit()
 
 void Board::_OnAVRDeinit()
 {
-	if (m_fdFlash>0)
+	SaveFlash();
+	if (m_uiFlashMap)
 	{
-		lseek(m_fdFlash, SEEK_SET, 0);
-		ssize_t r = write(m_fdFlash, m_pAVR->flash, m_pAVR->flashend + 1);
-		if (r != m_pAVR->flashend + 1) {
-			fprintf(stderr, "unable to write %s flash memory\n",m_strBoard.c_str());
-		}
-		close(m_fdFlash);
-		m_fdFlash = 0;
+		munmap(m_pAVR->flash, m_uiFlashMap);
+		m_pAVR->flash = nullptr; // Not ours to free any more.
+		m_uiFlashMap = 0;
 	}
 	m_EEPROM.Save();
 	OnAVRDeinit();
 }
 
-avr_flashaddr_t Board::LoadFirmware(string strFW)
+static constexpr char szJournalMagic[] = "MK404JNL";
+
+void Board::SaveFlash()
+{
+	if (m_fdFlash<=0)
+		return;
+	uint32_t uiFlash = m_pAVR->flashend + 1;
+	// Compare against the file as it is on disk (already in the page cache from the initial read).
+	vector<uint32_t> vDirty;
+	void *pDisk = mmap(nullptr, uiFlash, PROT_READ, MAP_SHARED, m_fdFlash, 0);
+	for (uint32_t uiPos = 0; uiPos < uiFlash; uiPos += m_uiFlashPage)
+	{
+		uint32_t uiLen = min(m_uiFlashPage, uiFlash - uiPos);
+		if (pDisk == MAP_FAILED || memcmp(static_cast<uint8_t*>(pDisk) + uiPos, m_pAVR->flash + uiPos, uiLen)!=0)
+			vDirty.push_back(uiPos);
+	}
+	if (pDisk != MAP_FAILED)
+		munmap(pDisk, uiFlash);
+
+	if (!vDirty.empty())
+	{
+		// Journal: magic, page size, count, {offset, page}..., count again as the commit marker.
+		vector<uint8_t> vJournal(szJournalMagic, szJournalMagic + 8);
+		auto fcnPut = [&vJournal](const void *pData, size_t uiLen)
+		{
+			const uint8_t *p = static_cast<const uint8_t*>(pData);
+			vJournal.insert(vJournal.end(), p, p + uiLen);
+		};
+		uint32_t uiCount = vDirty.size();
+		fcnPut(&m_uiFlashPage, sizeof(m_uiFlashPage));
+		fcnPut(&uiCount, sizeof(uiCount));
+		for (auto uiPos : vDirty)
+		{
+			fcnPut(&uiPos, sizeof(uiPos));
+			fcnPut(m_pAVR->flash + uiPos, min(m_uiFlashPage, uiFlash - uiPos));
+		}
+		fcnPut(&uiCount, sizeof(uiCount));
+
+		int fdJournal = open(m_strFlashJournal.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		bool bJournal = fdJournal >= 0 &&
+			write(fdJournal, vJournal.data(), vJournal.size()) == static_cast<ssize_t>(vJournal.size()) &&
+			fsync(fdJournal) == 0;
+		if (fdJournal >= 0)
+			close(fdJournal);
+		if (!bJournal)
+		{
+			perror(m_strFlashJournal.c_str());
+			fprintf(stderr, "WARN: Could not write flash journal, writing %s flash without it.\n", m_strBoard.c_str());
+			unlink(m_strFlashJournal.c_str());
+		}
+
+		bool bOK = true;
+		for (auto uiPos : vDirty)
+		{
+			ssize_t uiLen = min(m_uiFlashPage, uiFlash - uiPos);
+			bOK &= pwrite(m_fdFlash, m_pAVR->flash + uiPos, uiLen, uiPos) == uiLen;
+		}
+		if (!bOK || fsync(m_fdFlash)<0)
+			fprintf(stderr, "unable to write %s flash memory\n",m_strBoard.c_str());
+		else
+		{
+			printf("Wrote %u modified flash pages for %s\n", uiCount, m_strBoard.c_str());
+			if (bJournal)
+				unlink(m_strFlashJournal.c_str());
+		}
+	}
+	close(m_fdFlash);
+	m_fdFlash = 0;
+}
+
+void Board::ReplayFlashJournal()
 {
-	uint8_t *puiBytes = nullptr;
-	uint32_t uiFWSize = 0, uiFWStart = 0;
-	if (strFW.size()>4)
+	ifstream fIn(m_strFlashJournal, ios::binary);
+	if (!fIn.is_open())
+		return;
+	vector<uint8_t> vIn((istreambuf_iterator<char>(fIn)), istreambuf_iterator<char>());
+	fIn.close();
+
+	uint32_t uiPage = 0, uiCount = 0, uiCommit = 0;
+	bool bOK = vIn.size() >= 20 && memcmp(vIn.data(), szJournalMagic, 8) == 0;
+	if (bOK)
+	{
+		memcpy(&uiPage, vIn.data() + 8, sizeof(uiPage));
+		memcpy(&uiCount, vIn.data() + 12, sizeof(uiCount));
+		memcpy(&uiCommit, vIn.data() + vIn.size() - 4, sizeof(uiCommit));
+		// Only the last page can be short, so the size is exact unless that one is.
+		uint64_t uiBody = vIn.size() - 20;
+		uint64_t uiEntry = uiPage + 4;
+		bOK = uiPage == m_uiFlashPage && uiCount > 0 && uiCommit == uiCount &&
+			uiBody <= uiCount * uiEntry && uiBody > (uiCount - 1) * uiEntry;
+	}
+	if (bOK)
 	{
-		if (0==strFW.compare(strFW.size()-4, 4, ".hex"))
+		uint32_t uiFlash = m_pAVR->flashend + 1;
+		size_t uiPos = 16;
+		for (uint32_t i=0; i<uiCount && bOK; i++)
 		{
-			puiBytes = read_ihex_file(strFW.c_str(),&uiFWSize, &uiFWStart);
-			if (!puiBytes)
-				printf("WARN: Could not load %s. MCU will execute existing flash.\n", strFW.c_str());
-			else
+			uint32_t uiAddr = 0;
+			memcpy(&uiAddr, vIn.data() + uiPos, sizeof(uiAddr));
+			uiPos += sizeof(uiAddr);
+			if (uiAddr >= uiFlash)
 			{
-				printf("Loaded %u bytes from HEX file: %s\n",uiFWSize, strFW.c_str());
-				memcpy(m_pAVR->flash + uiFWStart, puiBytes, uiFWSize);
-				free(puiBytes);
+				bOK = false;
+				break;
 			}
-			m_pAVR->codeend = m_pAVR->flashend;
-			return uiFWStart;
+			ssize_t uiLen = min(m_uiFlashPage, uiFlash - uiAddr);
+			bOK = pwrite(m_fdFlash, vIn.data() + uiPos, uiLen, uiAddr) == uiLen;
+			uiPos += uiLen;
 		}
-		else if(0==strFW.compare(strFW.size()-4, 4, ".afx") ||
-				0==strFW.compare(strFW.size()-4, 4, ".elf"))
+		bOK &= fsync(m_fdFlash) == 0;
+		if (bOK)
+			printf("Recovered %u flash pages for %s from an interrupted save.\n", uiCount, m_strBoard.c_str());
+		else
+			fprintf(stderr, "ERROR: Could not replay %s, %s flash may be inconsistent.\n", m_strFlashJournal.c_str(), m_strBoard.c_str());
+	}
+	else // Incomplete, so the flash file itself was never touched.
+		fprintf(stderr, "WARN: Discarding incomplete flash journal %s\n", m_strFlashJournal.c_str());
+	unlink(m_strFlashJournal.c_str());
+}
+
+bool Board::ReloadFirmware(const string &strFW)
+{
+	string strFile = strFW.empty() ? m_strFW : strFW;
+	if (strFile.empty())
+	{
+		fprintf(stderr, "ERROR: %s was started without firmware, give the file to load.\n", m_strBoard.c_str());
+		return false;
+	}
+	const FirmwareCache::Firmware_t *pFW = FirmwareCache::Load(strFile);
+	if (!pFW)
+	{
+		fprintf(stderr, "ERROR: Could not load %s, %s keeps running the old firmware.\n", strFile.c_str(), m_strBoard.c_str());
+		return false;
+	}
+	// Map() copies the flash outside the images from the current one and then frees it, so that must be on the heap.
+	if (m_uiFlashMap)
+	{
+		uint8_t *pFlash = static_cast<uint8_t*>(malloc(m_uiFlashMap));
+		memcpy(pFlash, m_pAVR->flash, m_uiFlashMap);
+		munmap(m_pAVR->flash, m_uiFlashMap);
+		m_pAVR->flash = pFlash;
+		m_uiFlashMap = 0;
+	}
+	// As a programmer would, erase what the old application covered so none of it outlives a shorter build.
+	uint32_t uiFlash = m_pAVR->flashend + 1;
+	if (!m_vFirmware.empty() && m_vFirmware.front()->uiBase + m_vFirmware.front()->vFlash.size() <= uiFlash)
+		memset(m_pAVR->flash + m_vFirmware.front()->uiBase, 0xFF, m_vFirmware.front()->vFlash.size());
+	m_vFirmware.clear();
+	m_FWBase = LoadFirmware(strFile, false);
+	if (!m_strBoot.empty())
+		LoadFirmware(m_strBoot, false); // Over it, as at startup.
+	m_uiFlashMap = FirmwareCache::Map(m_pAVR, m_vFirmware);
+	m_strFW = strFile;
+	if (pFW->bELF && (PCProfiler::IsEnabled() || StackGuard::IsEnabled() || Coverage::IsEnabled() || FastBoot::IsEnabled() || FirmwareVars::IsEnabled()))
+		printf("NOTE: --profile, --stack-guard, --coverage, --fast-boot and --fw-var keep the symbols of the firmware %s started with.\n", m_strBoard.c_str());
+	m_idleSkip.OnAVRReset(); // The loops it found are in the old code.
+	SetResetFlag();
+	return true;
+}
+
+avr_flashaddr_t Board::LoadFirmware(string strFW, bool bSymbols)
+{
+	const FirmwareCache::Firmware_t *pFW = FirmwareCache::Load(strFW);
+	if (!pFW)
+	{
+		printf("WARN: Could not load %s. MCU will execute existing flash.\n", strFW.c_str());
+		if (strFW.size()>4 && 0==strFW.compare(strFW.size()-4, 4, ".hex"))
+			m_pAVR->codeend = m_pAVR->flashend;
+		return 0;
+	}
+	// The flash contents are mapped in later by FirmwareCache::Map.
+	m_vFirmware.push_back(pFW);
+	if (pFW->bELF)
+	{
+		if (bSymbols)
 		{
-			elf_firmware_t fw;
-			elf_read_firmware(strFW.c_str(), &fw);
-			avr_load_firmware(m_pAVR, &fw);
-			printf("Loaded %u bytes from ELF file: %s\n",fw.flashsize, strFW.c_str());
-			return fw.flashbase;
+			if (PCProfiler::IsEnabled())
+				m_profiler.AddSymbols(strFW);
+			if (StackGuard::IsEnabled())
+				m_stackGuard.AddSymbols(strFW);
+			if (FirmwareVars::IsEnabled())
+				m_fwVars.AddSymbols(strFW);
+			if (Coverage::IsEnabled())
+				m_coverage.AddSymbols(strFW);
+			if (FastBoot::IsEnabled())
+				m_fastBoot.AddSymbols(strFW);
 		}
+		elf_firmware_t fw = pFW->elf; // Everything but the flash.
+		fw.flashsize = 0;
+		avr_load_firmware(m_pAVR, &fw);
+		m_pAVR->codeend = pFW->elf.flashsize + pFW->elf.flashbase - pFW->elf.datasize;
+		printf("Loaded %u bytes from ELF file: %s\n",pFW->elf.flashsize, strFW.c_str());
+	}
+	else
+	{
+		printf("Loaded %zu bytes from HEX file: %s\n",pFW->vFlash.size(), strFW.c_str());
+		m_pAVR->codeend = m_pAVR->flashend;
 	}
-	return 0;
+	return pFW->uiBase;
 }
@@ -30,15 +30,38 @@
 #include <stdio.h>          // for printf, fprintf, NULL, stderr
 #include <uart_pty.h>       // for uart_pty
 #include <unistd.h>         // for usleep
+#include <map>              // for map
+#include <memory>           // for unique_ptr
 #include <string>           // for string, basic_string, stoi
 #include <vector>           // for vector
 #include <atomic>
+#include <chrono>           // for steady_clock
+#include "BasePeripheral.h" // for BasePeripheral::PortPin_t
+#include "CheckpointRing.h" // for CheckpointRing
+#include "Coverage.h"       // for Coverage
 #include "EEPROM.h"         // for EEPROM
+#include "FastBoot.h"       // for FastBoot
+#include "FirmwareCache.h"  // for FirmwareCache
+#include "FirmwareVars.h"   // for FirmwareVars
+#include "GDBStub.h"        // for GDBStub
+#include "IdleSkip.h"       // for IdleSkip
+#include "ISRStats.h"       // for ISRStats
 #include "IScriptable.h"    // for ArgType, IScriptable::LineStatus, IScript...
+#include "InputLog.h"       // for InputLog
+#include "Lockstep.h"       // for Lockstep
+#include "Log.h"            // for LOG, Log
+#include "Metrics.h"        // for Metric
+#include "PCProfiler.h"     // for PCProfiler
+#include "ParallelReplay.h" // for ParallelReplay
 #include "PinNames.h"       // for Pin
+#include "RemoteControl.h"  // for RemoteControl
+#include "ShmExport.h"      // for ShmExport
+#include "Snapshot.h"       // for Snapshot
+#include "StackGuard.h"     // for StackGuard
+#include "TelemetryHost.h"  // for TelemetryHost
 #include "Wiring.h"         // for Wiring
 #include "sim_avr.h"        // for avr_t, avr_flashaddr_t, avr_reset, avr_run
-#include "sim_avr_types.h"  // for avr_regbit_t
+#include "sim_avr_types.h"  // for avr_regbit_t, avr_cycle_count_t
 #include "sim_irq.h"        // for avr_connect_irq, avr_irq_t, avr_raise_irq
 #include "sim_regbit.h"     // for avr_regbit_get, avr_regbit_set
 
@@ -57,11 +80,23 @@ namespace Boards
 			// Creates a new board with the given pinspec, firmware file, frequency, and (optional) bootloader hex
 			Board(const Wiring &wiring,uint32_t uiFreqHz):Scriptable("Board"),m_wiring(wiring),m_uiFreq(uiFreqHz)
 			{
+				// Remember which hosts we were created under, the AVR thread selects them again.
+				m_pScriptHost = ScriptHost::Get();
+				m_pTelHost = TelemetryHost::GetHost();
 				RegisterActionAndMenu("Quit", "Sends the quit signal to the AVR",ScriptAction::Quit);
 				RegisterActionAndMenu("Reset","Resets the board by resetting the AVR.", ScriptAction::Reset);
 				RegisterActionAndMenu("Pause","Pauses the simulated AVR execution.", ScriptAction::Pause);
 				RegisterActionAndMenu("Resume","Resumes simulated AVR execution.", ScriptAction::Unpause);
 				RegisterAction("WaitMs","Waits the specified number of milliseconds (in AVR-clock time)", ScriptAction::Wait,{ArgType::Int});
+				RegisterAction("SaveState","Checkpoints the MCU and hardware state under the given name, for LoadState. Checkpoints are kept in memory for this run only.", ScriptAction::SaveState,{ArgType::String});
+				RegisterAction("LoadState","Restores a checkpoint made with SaveState.", ScriptAction::LoadState,{ArgType::String});
+				RegisterAction("RewindTo","Goes back to the given time (ms of AVR-clock time since start) from the nearest periodic checkpoint before it, replaying up to it. Needs --checkpoint-ms.", ScriptAction::RewindTo,{ArgType::Int});
+				RegisterAction("Rewind","As RewindTo, but the given number of ms back from now.", ScriptAction::Rewind,{ArgType::Int});
+				RegisterAction("ListCheckpoints","Prints the range of time the periodic checkpoints cover. Needs --checkpoint-ms.", ScriptAction::ListCheckpoints);
+				RegisterActionAndMenu("ReloadFirmware","Loads the firmware file again (e.g. after a rebuild) and resets, without restarting MK404.", ScriptAction::ReloadFW);
+				RegisterAction("LoadFirmware","Loads the given .hex/.afx/.elf in place of the running firmware and resets. ReloadFirmware loads it again from then on.", ScriptAction::LoadFW,{ArgType::String});
+				RegisterAction("PrintISRStats","Prints the per-interrupt-vector cycle budget so far. Needs --isr-stats.", ScriptAction::PrintISRStats);
+				RegisterAction("ClearISRStats","Restarts the interrupt vector cycle accounting from now. Needs --isr-stats.", ScriptAction::ClearISRStats);
 			};
 
 			virtual ~Board(){ if (m_thread) fprintf(stderr, "PROGRAMMING ERROR: %s THREAD NOT STOPPED BEFORE DESTRUCTION.\n",m_strBoard.c_str());};
@@ -69,6 +104,29 @@ namespace Boards
 			void CreateBoard(string strFW, uint8_t uiVerbose, bool bGDB, uint32_t uiVCDRate, string strBoot = "stk500boot_v2_mega2560.hex");
 			void StartAVR();
 			void StopAVR();
+			// Stops the AVR thread where it is without terminating the AVR, so a later StartAVR()
+			// (e.g. in a forked copy of this process, see ForkServer) carries on from the same state.
+			void SuspendAVR();
+
+			// Keeps the flash and EEPROM in memory only from here on, their files are left alone.
+			// For forked copies whose runs shouldn't end up in the parent's storage.
+			void DetachStorage();
+
+			// For running several scripts from one boot (see ScriptBatch): the state to go back to
+			// before each, and whether a quit or crash stops the thread like SuspendAVR() does rather
+			// than terminating the AVR. RestoreBaseline() must be called with the thread stopped.
+			inline void SaveBaseline(Snapshot &snap) { SaveSnapshot(snap); }
+			void RestoreBaseline(const Snapshot &snap);
+			inline void SetKeepOnQuit(bool bVal) { m_bKeepOnQuit = bVal; }
+
+			// Checkpoints every board every uiIntervalMs of AVR-clock time, keeping the last uiKeep
+			// for RewindTo/Rewind. 0 disables. Must be set before CreateBoard(). The SD card image
+			// isn't part of a checkpoint, so writes to it since then stay after a rewind.
+			static void SetCheckpoints(uint32_t uiIntervalMs, uint32_t uiKeep) { m_uiCheckpointMs = uiIntervalMs; m_uiCheckpointKeep = uiKeep; }
+
+			// Loads strFW (or the firmware it was started with, e.g. rebuilt since) in place of the
+			// running one and resets, keeping the rest of the printer as it is. On the AVR thread.
+			bool ReloadFirmware(const string &strFW = "");
 
 			// Returns the AVR core.
 			inline avr_t * GetAVR(){return m_pAVR;}
@@ -78,7 +136,7 @@ namespace Boards
 			{
 				if (m_wiring.IsPin(ePin))
 				{
-					hw.ConnectFrom(m_wiring.DIRQLU(m_pAVR,ePin),eDest);
+					hw.ConnectFrom(m_pPinIRQs[ePin],eDest);
 					return true;
 				}
 				else
@@ -90,7 +148,7 @@ namespace Boards
 			{
 				if (m_wiring.IsPin(ePin))
 				{
-					hw.ConnectTo(eDest,m_wiring.DIRQLU(m_pAVR,ePin));
+					hw.ConnectTo(eDest,m_pPinIRQs[ePin]);
 					return true;
 				}
 				else
@@ -101,14 +159,20 @@ namespace Boards
 			{
 				if (m_wiring.IsPin(ePin))
 				{
-					avr_connect_irq(src, m_wiring.DIRQLU(m_pAVR,ePin));
+					avr_connect_irq(src, m_pPinIRQs[ePin]);
 					return true;
 				}
 				return _PinNotConnectedMsg(ePin);
 			}
 
 			// Start the bootloader first boot instead of jumping right into the main FW.
-			inline void SetStartBootloader() {m_pAVR->pc = m_pAVR->reset_pc;}
+			inline void SetStartBootloader()
+			{
+				if (FastBoot::IsEnabled())
+					printf("Fast boot, not starting the bootloader.\n");
+				else
+					m_pAVR->pc = m_pAVR->reset_pc;
+			}
 
 			inline void WaitForFinish() {pthread_join(m_thread,NULL);}
 
@@ -125,12 +189,47 @@ namespace Boards
 			inline bool IsStopped(){ return m_pAVR->state == cpu_Stopped;}
 			inline bool IsPaused(){ return m_bPaused;}
 
+			// For watching from other threads: the cycle count as of the last batch, whether the thread
+			// is running (started and not yet finished), and the board's script host.
+			inline uint64_t GetProgress() { return static_cast<uint64_t>(m_mtrCycles.Get()); }
+			inline bool IsRunning() { return !m_bColocatedRun && m_thread!=0 && !m_bQuit && m_pAVR->state != cpu_Done && m_pAVR->state != cpu_Crashed; }
+			inline ScriptHost* GetScriptHost() { return m_pScriptHost; }
+
 			inline void SetPrimary(bool bVal) { m_bIsPrimary = bVal;}
 
+			// Sets the instance number when running several printers in one process.
+			// Nonzero instances get their own flash/EEPROM/SD/trace files. Must be set before CreateBoard()
+			inline void SetInstance(unsigned int uiVal) { m_uiInstance = uiVal;}
+			inline unsigned int GetInstance() { return m_uiInstance;}
+
+			// Headless boards have no GLUT context, so skip the menu dispatch and let the AVR run flat out.
+			inline void SetHeadless(bool bVal) { m_bHeadless = bVal;}
+			inline bool IsHeadless() { return m_bHeadless;}
+
+			// Sets the number of instructions run between each round of host-side bookkeeping
+			// (scripting, menus, key input, resets). 1 is the original per-instruction behaviour.
+			inline void SetBatchSize(uint32_t uiVal) { m_uiBatchSize = uiVal>0 ? uiVal : 1;}
+
+			// Paces the AVR at the given multiple of real time. 0 (the default) runs as fast as possible.
+			inline void SetSpeedFactor(float fVal) { m_fSpeed = fVal>0 ? fVal : 0;}
+
+			// Runs this board in step with the others in the group (see Lockstep). Must be set before StartAVR()
+			inline void SetLockstep(Lockstep *pGroup) { m_pLockstep = pGroup;}
+
+			// Runs the commands that come in over the socket between batches. Must be set before StartAVR()
+			inline void SetRemoteControl(RemoteControl *pRemote) { m_pRemote = pRemote;}
+
+			// Runs pGuest on this board's AVR thread rather than its own, taking turns with this one every
+			// uiSliceUs of simulated time (each running as many cycles as its clock does in that).
+			// The guest's StartAVR() then just lets it run; stop this board first. Set before either starts.
+			void SetColocated(Board *pGuest, uint32_t uiSliceUs);
+
 		protected:
 			// Define this method and use it to initialize/attach your hardware to the MCU.
 			virtual void SetupHardware() = 0;
 
+			inline EEPROM& GetEEPROM() { return m_EEPROM; }
+
 			// Overload this if you wish to have custom initialization code.
 			// The Board class takes care of persisting flash and EEPROM for you.
 			virtual void OnAVRInit(){};
@@ -141,6 +240,13 @@ namespace Boards
 			// Called when the AVR is reset or powered up (i.e. MCUSR set)
 			virtual void OnAVRReset(){};
 
+			// Overload these to checkpoint/restore your hardware's state along with the MCU.
+			virtual void OnSaveState(Snapshot &snap){};
+			virtual void OnLoadState(const Snapshot &snap){};
+
+			// Overload to drop what a run wrote to storage snapshots don't hold (e.g. SD card overlays).
+			virtual void OnDiscardStorage(){};
+
 			// Helper called every cycle - use it to process keys, mouse, etc.
 			// within the context of the AVR run thread.
 			virtual void OnAVRCycle(){};
@@ -156,17 +262,8 @@ namespace Boards
 						SetResetFlag();
 						return LineStatus::Finished;
 					case Wait:
-						if (m_uiWtCycleCount >0)
-							if (--m_uiWtCycleCount==0)
-								return LineStatus::Finished;
-							else
-								return LineStatus::Waiting;
-						else
-						{
-							m_uiWtCycleCount = (m_uiFreq/1000)*stoi(vArgs.at(0));
-							return LineStatus::Waiting;
-						}
-						break;
+						// Kept by the script host, per track, which sleeps the line until it's over.
+						return ScriptHost::WaitCycles(static_cast<uint64_t>(m_uiFreq/1000)*stoi(vArgs.at(0)));
 					case Pause:
 						printf("Pause\n");
 						m_bPaused.store(true);
@@ -174,52 +271,218 @@ namespace Boards
 					case Unpause:
 						m_bPaused.store(false);
 						return LineStatus::Finished;
+					case SaveState:
+						SaveSnapshot(m_mSnapshots[vArgs.at(0)]);
+						printf("Saved state %s (%zu bytes)\n",vArgs.at(0).c_str(), m_mSnapshots[vArgs.at(0)].GetSize());
+						return LineStatus::Finished;
+					case LoadState:
+						if (!m_mSnapshots.count(vArgs.at(0)))
+							return IssueLineError(string("No saved state named ") + vArgs.at(0));
+						LoadSnapshot(m_mSnapshots.at(vArgs.at(0)));
+						printf("Restored state %s\n",vArgs.at(0).c_str());
+						return LineStatus::Finished;
+					case RewindTo:
+					case Rewind:
+						if (!m_pCheckpoints)
+							return IssueLineError("Checkpoints are not enabled, run with --checkpoint-ms");
+						if (!m_bRewinding)
+						{
+							avr_cycle_count_t uiCycles = (avr_cycle_count_t)(m_uiFreq/1000)*stoi(vArgs.at(0));
+							if (ID == Rewind)
+								uiCycles = m_pAVR->cycle > uiCycles ? m_pAVR->cycle - uiCycles : 0;
+							if (!StartRewind(uiCycles))
+								return IssueLineError("Can't rewind there");
+						}
+						if (m_pAVR->cycle < m_uiRewindTarget)
+							return LineStatus::Waiting;
+						m_bRewinding = false;
+						printf("Rewound to cycle %llu\n", (unsigned long long)m_pAVR->cycle);
+						return LineStatus::Finished;
+					case ListCheckpoints:
+						if (!m_pCheckpoints)
+							return IssueLineError("Checkpoints are not enabled, run with --checkpoint-ms");
+						if (m_pCheckpoints->IsEmpty())
+							printf("No checkpoints yet\n");
+						else
+							printf("%zu checkpoints from %llu to %llu ms (%zu bytes)\n", m_pCheckpoints->GetCount(),
+								(unsigned long long)m_pCheckpoints->GetFirst()/(m_uiFreq/1000), (unsigned long long)m_pCheckpoints->GetLast()/(m_uiFreq/1000), m_pCheckpoints->GetBytes());
+						return LineStatus::Finished;
+					case ReloadFW:
+					case LoadFW:
+						if (!ReloadFirmware(ID == LoadFW ? vArgs.at(0) : ""))
+							return IssueLineError("Could not load the firmware");
+						return LineStatus::Finished;
+					case PrintISRStats:
+					case ClearISRStats:
+						if (!ISRStats::IsEnabled())
+							return IssueLineError("ISR stats are not enabled, run with --isr-stats");
+						if (ID == PrintISRStats)
+							m_isrStats.Print();
+						else
+							m_isrStats.ClearStats();
+						return LineStatus::Finished;
 				}
 				return LineStatus::Unhandled;
 			}
 
 			virtual void* RunAVR()
 			{
-				avr_regbit_t MCUSR = m_pAVR->reset_flags.porf;
-				MCUSR.mask =0xFF;
-				MCUSR.bit = 0;
+				SelectThreadState();
 				printf("Starting %s execution...\n", m_wiring.GetMCUName().c_str());
 				int state = cpu_Running;
-				while ((state != cpu_Done) && (state != cpu_Crashed) && !m_bQuit){
+				avr_cycle_count_t uiLastCycle = m_pAVR->cycle;
+				avr_cycle_count_t uiQuantum = 0;
+				if (m_pGuest)
+					m_uiSliceEnd = m_pAVR->cycle + m_uiSliceCycles;
+				if (m_pLockstep)
+				{
+					uiQuantum = ((uint64_t)m_uiFreq*m_pLockstep->GetQuantumUs())/1000000U;
+					m_pLockstep->Join();
+					m_uiLockstepEnd = m_pAVR->cycle + uiQuantum;
+				}
+				while ((state != cpu_Done) && (state != cpu_Crashed) && !m_bQuit && !m_bSuspend){
 							// Re init the special workarounds we need after a reset.
-					if (m_bIsPrimary) // Only one board should be scripting.
+					if (m_bIsPrimary && (!m_bHeadless || InputLog::IsReplaying())) // Only one board should be scripting.
 						ScriptHost::DispatchMenuCB();
+					if (m_pRemote)
+						m_pRemote->OnAVRCycle();
 					if (m_bPaused)
 					{
 						usleep(100000);
+						m_uiThrottleEnd = 0; // Restart pacing from here on resume.
 						continue;
 					}
-					int8_t uiMCUSR = avr_regbit_get(m_pAVR,MCUSR);
-					if (uiMCUSR != m_uiLastMCUSR)
-					{
-						printf("MCUSR: %02x\n",m_uiLastMCUSR = uiMCUSR);
-						if (uiMCUSR) // only run on change and not changed to 0
-							OnAVRReset();
-					}
+					CheckMCUSR();
 					OnAVRCycle();
+					for (auto pPty : m_vPtys)
+						pPty->Poll();
 
 					if (m_bIsPrimary && ScriptHost::IsInitialized())
-						ScriptHost::OnAVRCycle();
+						ScriptHost::OnAVRCycle(m_pAVR->cycle > uiLastCycle ? m_pAVR->cycle - uiLastCycle : 0); // Not if a state load took it back.
+					uiLastCycle = m_pAVR->cycle;
 
+					if (m_pCheckpoints && m_pAVR->cycle >= m_uiNextCheckpoint)
+						TakeCheckpoint();
 
-					if (m_bReset)
+
+					CheckReset();
+					state = avr_run(m_pAVR);
+					// Batched mode, run the rest of the batch before coming back for the host-side work.
+					uint32_t uiRun = 1;
+					// A rewind's replay stops on the first instruction at or past its target.
+					for (; uiRun<m_uiBatchSize && (state == cpu_Running || state == cpu_Sleeping) && (!m_bRewinding || m_pAVR->cycle < m_uiRewindTarget); uiRun++)
+						state = avr_run(m_pAVR);
+					if (m_bIsPrimary)
+						TelemetryHost::GetHost()->AddInstructions(uiRun);
+					m_mtrCycles.Set(m_pAVR->cycle);
+					if (IdleSkip::IsEnabled() && state == cpu_Running && !m_pGDB) // Would step over breakpoints
 					{
-						m_bReset = 0;
-						avr_reset(m_pAVR);
-						avr_regbit_set(m_pAVR, m_pAVR->reset_flags.extrf);
+						// Never jump past a pacing or lockstep point, nor more than 1ms without the host side getting a look in.
+						avr_cycle_count_t uiLimit = m_pAVR->cycle + m_uiFreq/1000;
+						if (m_fSpeed>0 && m_uiThrottleEnd>m_pAVR->cycle && m_uiThrottleEnd<uiLimit)
+							uiLimit = m_uiThrottleEnd;
+						if (m_pLockstep && m_uiLockstepEnd<uiLimit)
+							uiLimit = m_uiLockstepEnd;
+						if (m_pGuest && m_uiSliceEnd<uiLimit) // Nor keep the guest waiting.
+							uiLimit = m_uiSliceEnd;
+						uint64_t uiToWake = m_bIsPrimary ? ScriptHost::GetCyclesToWake() : UINT64_MAX; // Nor past a script line's wakeup.
+						if (uiToWake < m_uiFreq/1000 && m_pAVR->cycle + uiToWake < uiLimit)
+							uiLimit = m_pAVR->cycle + uiToWake;
+						m_idleSkip.Check(uiLimit);
 					}
-					state = avr_run(m_pAVR);
+					if (m_fSpeed>0 && m_pAVR->cycle>=m_uiThrottleEnd)
+						ThrottleAVR();
+					if (m_pLockstep)
+					{
+						if (m_pAVR->cycle + uiQuantum < m_uiLockstepEnd) // Cycle count went backwards (e.g. state restore)
+							m_uiLockstepEnd = m_pAVR->cycle + uiQuantum;
+						else if (m_pAVR->cycle>=m_uiLockstepEnd)
+						{
+							m_pLockstep->Arrive();
+							m_uiLockstepEnd += uiQuantum;
+						}
+					}
+					if (m_pGuest && m_pAVR->cycle>=m_uiSliceEnd)
+					{
+						m_pGuest->RunSlice();
+						SelectThreadState();
+						m_uiSliceEnd += m_uiSliceCycles;
+						if (m_uiSliceEnd <= m_pAVR->cycle || m_uiSliceEnd > m_pAVR->cycle + m_uiSliceCycles) // e.g. a checkpoint restore
+							m_uiSliceEnd = m_pAVR->cycle + m_uiSliceCycles;
+					}
+				}
+				if (m_pLockstep)
+					m_pLockstep->Leave();
+				if (m_pGuest && !m_bSuspend) // A suspended host takes the guest along with it.
+					m_pGuest->EndColocated();
+				SelectThreadState();
+				if (state == cpu_Crashed)
+					TelemetryHost::GetHost()->DumpFlightRecorder(m_wiring.GetMCUName() + " crashed");
+				if (m_bSuspend || m_bKeepOnQuit)
+				{
+					m_bSuspend = false;
+					printf("%s suspended.\n",m_wiring.GetMCUName().c_str());
+					return nullptr;
+				}
+				if (ParallelReplay::IsEnabled())
+				{
+					Snapshot snap;
+					SaveSnapshot(snap);
+					ParallelReplay::OnFinish(snap); // Doesn't return in a segment.
 				}
 				avr_terminate(m_pAVR);
 				printf("%s finished.\n",m_wiring.GetMCUName().c_str());
 				return nullptr;
 			};
 
+			// Points the per-thread hooks (scripting, telemetry, logging, ...) at this board.
+			inline void SelectThreadState()
+			{
+				ScriptHost::Select(m_pScriptHost);
+				TelemetryHost::SetHost(m_pTelHost);
+				Log::SetAVR(m_pAVR);
+				InputLog::SetAVR(m_pAVR);
+				GDBStub::Select(m_pGDB.get());
+				Coverage::Select(&m_coverage);
+				FastBoot::Select(&m_fastBoot);
+			}
+
+			// Runs the reset hooks when the firmware's MCUSR changes to a new nonzero value.
+			inline void CheckMCUSR()
+			{
+				avr_regbit_t MCUSR = m_pAVR->reset_flags.porf;
+				MCUSR.mask =0xFF;
+				MCUSR.bit = 0;
+				int8_t uiMCUSR = avr_regbit_get(m_pAVR,MCUSR);
+				if (uiMCUSR != m_uiLastMCUSR)
+				{
+					LOG(m_log, Info, "MCUSR: %02x",m_uiLastMCUSR = uiMCUSR);
+					if (uiMCUSR) // only run on change and not changed to 0
+					{
+						m_profiler.Rearm();
+						m_isrStats.OnAVRReset();
+						if (StackGuard::IsEnabled())
+							m_stackGuard.OnAVRReset();
+						if (IdleSkip::IsEnabled())
+							m_idleSkip.OnAVRReset();
+						if (FirmwareVars::IsEnabled())
+							m_fwVars.OnAVRReset();
+						TelemetryHost::GetHost()->OnAVRReset(m_pAVR);
+						OnAVRReset();
+					}
+				}
+			}
+
+			inline void CheckReset()
+			{
+				if (m_bReset)
+				{
+					m_bReset = 0;
+					avr_reset(m_pAVR);
+					avr_regbit_set(m_pAVR, m_pAVR->reset_flags.extrf);
+				}
+			}
+
 
 
 
@@ -233,7 +496,7 @@ namespace Boards
 
 			inline void AddSerialPty(uart_pty &UART, const char chrNum)
 			{
-				UART.Init(m_pAVR);
+				AddHardware(UART);
 				UART.Connect(chrNum);
 			}
 
@@ -241,19 +504,20 @@ namespace Boards
 
 			inline void SetPin(PinNames::Pin ePin, uint32_t value)
 			{
-				avr_raise_irq(m_wiring.DIRQLU(m_pAVR,ePin),value);
+				if (m_pPinIRQs[ePin])
+					avr_raise_irq(m_pPinIRQs[ePin],value);
+				else
+					_PinNotConnectedMsg(ePin);
 			}
 
-			inline avr_irq_t* GetDIRQ(PinNames::Pin ePin)
-			{
-				if (m_wiring.IsPin(ePin))
-					return m_wiring.DIRQLU(m_pAVR,ePin);
-				return nullptr;
-			}
+			// Resolved once in CreateAVR, nullptr if the board doesn't have the pin.
+			inline avr_irq_t* GetDIRQ(PinNames::Pin ePin) { return m_pPinIRQs[ePin]; }
 
 			inline std::string GetStorageFileName(std::string strType)
 			{
 				std::string strFN = m_strBoard;
+				if (m_uiInstance>0)
+					strFN.append("_").append(std::to_string(m_uiInstance));
 				strFN.append("_").append(m_wiring.GetMCUName()).append("_").append(strType).append(".bin");
 				return strFN;
 			}
@@ -265,6 +529,17 @@ namespace Boards
 				return -1;
 			}
 
+			// Port letter and bit of a pin, e.g. 'F',5. False if the board doesn't have it.
+			inline bool GetPortPin(PinNames::Pin ePin, BasePeripheral::PortPin_t &port)
+			{
+				if (!m_wiring.IsPin(ePin))
+					return false;
+				MCUPin pin = m_wiring.GetPin(ePin);
+				port.cPort = m_wiring.GetPinSpec().PORT(pin);
+				port.uiBit = m_wiring.GetPinSpec().PIN(pin);
+				return true;
+			}
+
 			inline avr_irq_t* GetPWMIRQ(PinNames::Pin ePin)
 			{
 				if (m_wiring.IsPin(ePin))
@@ -278,9 +553,17 @@ namespace Boards
 				hw.Init(m_pAVR, args... );
 			}
 
+			// PTYs are polled between batches for what the host sends, see uart_pty::Poll().
+			inline void AddHardware(uart_pty &UART)
+			{
+				UART.Init(m_pAVR);
+				m_vPtys.push_back(&UART);
+			}
+
 			inline void SetBoardName(std::string strName){m_strBoard = strName;}
 
 			struct avr_t* m_pAVR = nullptr;
+			avr_irq_t* m_pPinIRQs[PinNames::PIN_COUNT] = {}; // Digital IRQ per wired pin.
 
 			atomic_uint8_t m_bPaused = {false};
 
@@ -291,18 +574,46 @@ namespace Boards
 
 			void _OnAVRDeinit();
 
+			// Sleeps off any lead the AVR has over the host clock at the requested speed factor.
+			void ThrottleAVR();
+
+			// Checkpoints the AVR core, memories and pending timers/interrupts, then the hardware via OnSaveState.
+			// The timers and interrupts refer to live objects, so a snapshot is only valid within this run.
+			void SaveSnapshot(Snapshot &snap);
+			void LoadSnapshot(const Snapshot &snap);
+
+			void TakeCheckpoint();
+			// Restores the latest checkpoint at or before uiTarget and arms the replay up to it.
+			bool StartRewind(avr_cycle_count_t uiTarget);
+
 			inline bool _PinNotConnectedMsg(Pin ePin)
 			{
 				printf("Requested connection w/ Digital pin %d on %s, but it is not defined!\n",ePin,m_strBoard.c_str());
 				return false;
 			}
 
-			avr_flashaddr_t LoadFirmware(std::string strFW);
+			// Without bSymbols, the profiler etc. aren't given the ELF's symbols.
+			avr_flashaddr_t LoadFirmware(std::string strFW, bool bSymbols = true);
 
-			int m_fdFlash = 0;
+			// Writes back only the flash pages that differ from the file, through an fsync'd journal
+			// so an interrupted write can be completed (or discarded) on the next start.
+			void SaveFlash();
+			void ReplayFlashJournal();
 
-			atomic_bool m_bQuit = {false}, m_bReset = {false};
-			bool m_bIsPrimary = false;
+			int m_fdFlash = 0;
+			std::string m_strFlashJournal;
+			static constexpr uint32_t m_uiFlashPage = 256; // SPM page size of the 2560
+			size_t m_uiFlashMap = 0; // Size of the shared flash mapping, if any.
+			vector<const FirmwareCache::Firmware_t*> m_vFirmware; // Loaded files, in load order.
+			std::string m_strFW, m_strBoot; // As given to CreateBoard, for ReloadFirmware
+			vector<uart_pty*> m_vPtys;
+
+			atomic_bool m_bQuit = {false}, m_bReset = {false}, m_bSuspend = {false};
+			bool m_bIsPrimary = false, m_bKeepOnQuit = false;
+			unsigned int m_uiInstance = 0;
+			ScriptHost *m_pScriptHost = nullptr;
+			TelemetryHost *m_pTelHost = nullptr;
+			bool m_bHeadless = false;
 			bool m_bNoHacks = false;
 			pthread_t m_thread = 0;
 			const Wiring &m_wiring;
@@ -314,7 +625,38 @@ namespace Boards
 
 			uint8_t m_uiLastMCUSR = 0;
 
-			unsigned int m_uiWtCycleCount = 0;
+
+			uint32_t m_uiBatchSize = 1;
+
+			float m_fSpeed = 0;
+			avr_cycle_count_t m_uiThrottleRef = 0, m_uiThrottleEnd = 0;
+			chrono::steady_clock::time_point m_tpThrottleRef;
+
+			Lockstep *m_pLockstep = nullptr;
+			RemoteControl *m_pRemote = nullptr;
+			avr_cycle_count_t m_uiLockstepEnd = 0;
+
+			// Colocated boards (see SetColocated), the host steps the guest from its RunAVR().
+			// Runs the guest for one slice, on the host's thread.
+			void RunSlice();
+			// Finishes a guest off once its host has stopped.
+			void EndColocated();
+			Board *m_pGuest = nullptr, *m_pHost = nullptr;
+			avr_cycle_count_t m_uiSliceCycles = 0, m_uiSliceEnd = 0;
+			atomic_bool m_bColocatedRun = {false}; // Guest started, i.e. StartAVR() was called.
+			bool m_bColocatedInit = false; // Guest has had its first slice.
+			int m_iColocatedState = cpu_Running;
+
+			PCProfiler m_profiler;
+			Coverage m_coverage;
+			FastBoot m_fastBoot;
+			ISRStats m_isrStats;
+			StackGuard m_stackGuard;
+			FirmwareVars m_fwVars;
+			IdleSkip m_idleSkip;
+			ShmExport m_shmExport;
+			Metric m_mtrCycles {Metric::Kind::Counter};
+			static Log::Module m_log;
 
 			avr_flashaddr_t m_bootBase, m_FWBase;
 
@@ -325,9 +667,26 @@ namespace Boards
 				Reset,
 				Wait,
 				Pause,
-				Unpause
+				Unpause,
+				SaveState,
+				LoadState,
+				PrintISRStats,
+				ClearISRStats,
+				RewindTo,
+				Rewind,
+				ListCheckpoints,
+				ReloadFW,
+				LoadFW
 			};
 
+			map<string, Snapshot> m_mSnapshots;
+
+			static uint32_t m_uiCheckpointMs, m_uiCheckpointKeep;
+			unique_ptr<CheckpointRing> m_pCheckpoints;
+			unique_ptr<GDBStub> m_pGDB; // Only with --gdb
+			avr_cycle_count_t m_uiNextCheckpoint = 0, m_uiRewindTarget = 0;
+			bool m_bRewinding = false;
+
 			EEPROM m_EEPROM;
 	};
 };// Boards
@@ -27,6 +27,7 @@
 
 #include <stdint.h>            // for uint8_t, uint32_t, int32_t, uint16_t
 #include "BasePeripheral.h"
+#include "PortWatch.h"         // for PortWatch, MAKE_C_PORT_CALLBACK
 #include <avr_twi.h>
 
 class I2CPeripheral: public BasePeripheral
@@ -40,8 +41,8 @@ class I2CPeripheral: public BasePeripheral
         void _Init(avr_t *avr, C *p, const char** IRQNAMES = nullptr) {
             BasePeripheral::_Init(avr,p, IRQNAMES);
 
-			fprintf(stderr,"WARNING: UNIMPLEMENTED FEATURE - HARDWARE I2C\n");
-            RegisterNotify(C::TX_IN, MAKE_C_CALLBACK(I2CPeripheral,_OnI2CTx<C>), this);
+            m_uiTWIReply = C::TX_REPLY;
+            RegisterNotify(C::TX_IN, MAKE_C_CALLBACK(I2CPeripheral,_OnTWIMsg), this);
             ConnectFrom(avr_io_getirq(avr,AVR_IOCTL_TWI_GETIRQ(0),TWI_IRQ_OUTPUT), C::TX_IN);
             ConnectTo(C::TX_REPLY,avr_io_getirq(avr,AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
         }
@@ -57,6 +58,35 @@ class I2CPeripheral: public BasePeripheral
 			avr_irq_register_notify(irqSDA, MAKE_C_CALLBACK(I2CPeripheral,_OnSDA),this);
 		}
 
+		// Bit-banged too, but decoded straight off the AVR's PORTx writes for SCL/SDA a byte at a
+		// time instead of reacting to every edge through the pin IRQs. irqSDA is still used to drive
+		// ACKs and read data back to the AVR. Falls back to the IRQ path if a port can't be found.
+		template<class C>
+		void _Init(avr_t *avr, avr_irq_t *irqSDA, avr_irq_t *irqSCL, const PortPin_t &portSDA, const PortPin_t &portSCL, C *p, const char** IRQNAMES = nullptr) {
+			PortWatch &watch = PortWatch::Get(avr);
+			if (!watch.HasPort(portSDA.cPort) || !watch.HasPort(portSCL.cPort))
+			{
+				fprintf(stderr, "I2C: no PORT%c/PORT%c on this MCU, using pin IRQs instead.\n", portSDA.cPort, portSCL.cPort);
+				_Init(avr, irqSDA, irqSCL, p, IRQNAMES);
+				return;
+			}
+			BasePeripheral::_Init(avr,p, IRQNAMES);
+			m_pSDA = irqSDA;
+			m_cSDAPort = portSDA.cPort;
+			m_cSCLPort = portSCL.cPort;
+			m_uiSDABit = portSDA.uiBit;
+			m_uiSCLBit = portSCL.uiBit;
+			m_bSDA = (watch.GetValue(m_cSDAPort)>>m_uiSDABit) & 1U;
+			m_bSCL = (watch.GetValue(m_cSCLPort)>>m_uiSCLBit) & 1U;
+			if (m_cSCLPort == m_cSDAPort)
+				watch.Watch(m_cSDAPort, (1U<<m_uiSDABit) | (1U<<m_uiSCLBit), MAKE_C_PORT_CALLBACK(I2CPeripheral,_OnBusWrite), this);
+			else
+			{
+				watch.Watch(m_cSDAPort, 1U<<m_uiSDABit, MAKE_C_PORT_CALLBACK(I2CPeripheral,_OnBusWrite), this);
+				watch.Watch(m_cSCLPort, 1U<<m_uiSCLBit, MAKE_C_PORT_CALLBACK(I2CPeripheral,_OnBusWrite), this);
+			}
+		}
+
 		// Override these for read and write operations on your device's registers.
 		virtual uint8_t GetRegVal(uint8_t uiAddr){return 0;};
 		// Return T if success, F if failure. F results in NACK.
@@ -77,11 +107,116 @@ class I2CPeripheral: public BasePeripheral
 			};
 		} I2CMsg_t;
 
-		// I2C transaction handler.
-		template<class C>
-		void _OnI2CTx(avr_irq_t *irq, I2CMsg_t msg)
+		// Hardware TWI: simavr's master hands us one condition/byte per message and expects ACKs/data back.
+		void _OnTWIMsg(avr_irq_t *irq, uint32_t value)
+		{
+			avr_twi_msg_irq_t msg;
+			msg.u.v = value;
+			if (msg.u.twi.msg & TWI_COND_STOP)
+				m_bTWISelected = false;
+			if (msg.u.twi.msg & TWI_COND_START)
+			{
+				m_state = State::AddrIn;
+				m_bTWISelected = ProcessByte(msg.u.twi.addr);
+				if (m_bTWISelected)
+					RaiseIRQ(m_uiTWIReply, avr_twi_irq_msg(TWI_COND_ACK, msg.u.twi.addr, 1).u.v);
+			}
+			if (!m_bTWISelected)
+				return;
+			if (msg.u.twi.msg & TWI_COND_WRITE)
+			{
+				bool bAck = ProcessByte(msg.u.twi.data);
+				RaiseIRQ(m_uiTWIReply, avr_twi_irq_msg(TWI_COND_ACK, msg.u.twi.addr, bAck).u.v);
+			}
+			if (msg.u.twi.msg & TWI_COND_READ)
+				RaiseIRQ(m_uiTWIReply, avr_twi_irq_msg(TWI_COND_READ, msg.u.twi.addr, GetRegVal(msgIn.writeRegAddr++)).u.v);
+		}
+
+		// Port-register decoder for bit-banged buses. Only the master's (AVR's) levels are seen here,
+		// the device answers by pulling the SDA pin through m_pSDA while SCL is high.
+		void _OnBusWrite(char cPort, const PortWatch::Write_t &write)
+		{
+			bool bSCLOld = m_bSCL, bSDAOld = m_bSDA;
+			if (cPort == m_cSCLPort)
+				m_bSCL = (write.uiNew>>m_uiSCLBit) & 1U;
+			if (cPort == m_cSDAPort)
+				m_bSDA = (write.uiNew>>m_uiSDABit) & 1U;
+			if (m_bSCL && bSCLOld && m_bSDA != bSDAOld)
+			{
+				// START (SDA falls) or STOP (SDA rises) while the clock is high.
+				_ReleaseSDA();
+				m_bus = m_bSDA ? Bus::Idle : Bus::Receive;
+				m_state = State::AddrIn;
+				m_uiByte = m_uiBitCt = 0;
+				return;
+			}
+			if (m_bSCL == bSCLOld || m_bus == Bus::Idle)
+				return;
+			if (m_bus == Bus::Receive)
+			{
+				if (m_bSCL)
+				{
+					if (m_uiBitCt < 8)
+					{
+						m_uiByte = (m_uiByte<<1) | m_bSDA;
+						if (++m_uiBitCt == 8)
+						{
+							bool bAddr = m_state == State::AddrIn;
+							m_bAck = ProcessByte(m_uiByte);
+							if (bAddr && !m_bAck)
+								m_bus = Bus::Idle; // Someone else's address.
+						}
+					}
+					else
+					{
+						m_uiBitCt = 9;
+						if (m_bAck)
+							_DriveSDA(0);
+					}
+				}
+				else if (m_uiBitCt == 9)
+				{
+					_ReleaseSDA();
+					if (m_state == State::AddrIn && msgIn.isAddrRead)
+						m_bus = Bus::Transmit;
+					m_uiByte = m_uiBitCt = 0;
+				}
+			}
+			else // Transmit
+			{
+				if (m_bSCL)
+				{
+					if (m_uiBitCt < 8)
+					{
+						if (m_uiBitCt == 0)
+							m_uiByte = GetRegVal(msgIn.writeRegAddr++);
+						_DriveSDA((m_uiByte >> (7 - m_uiBitCt++)) & 1U);
+					}
+					else
+					{
+						m_uiBitCt = 9;
+						if (m_bSDA) // NACK from the master, it's done reading.
+							m_bus = Bus::Idle;
+					}
+				}
+				else if (m_uiBitCt == 8)
+					_ReleaseSDA(); // Master's turn to ACK.
+				else if (m_uiBitCt == 9)
+					m_uiBitCt = 0;
+			}
+		}
+
+		inline void _DriveSDA(uint8_t uiVal)
+		{
+			m_bDriving = !uiVal;
+			avr_raise_irq(m_pSDA, uiVal);
+		}
+
+		inline void _ReleaseSDA()
 		{
-			// TODO - I don't have any real "hardware" i2c items to simulate at the moment.
+			if (m_bDriving)
+				avr_raise_irq(m_pSDA, 1);
+			m_bDriving = false;
 		}
 
 		// Called on a read request of uiReg. You don't need to worry about tracking/incrementing the address on multi-reads.
@@ -244,6 +379,23 @@ class I2CPeripheral: public BasePeripheral
 			WaitForACK
 		};
 
+		// Port decoder state.
+		enum class Bus
+		{
+			Idle,
+			Receive,	// Master to us: address, register, data.
+			Transmit	// Us to master.
+		};
+
+		char m_cSCLPort = 0, m_cSDAPort = 0;
+		uint8_t m_uiSCLBit = 0, m_uiSDABit = 0;
+		bool m_bSCL = true, m_bSDA = true;
+		bool m_bAck = false, m_bDriving = false;
+		Bus m_bus = Bus::Idle;
+
+		bool m_bTWISelected = false;
+		unsigned int m_uiTWIReply = 0;
+
 		SCLS m_SCLState = SCLS::Idle;
 		State m_state = State::Idle;
 
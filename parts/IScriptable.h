@@ -29,9 +29,11 @@
 using namespace std;
 
 #include <stdlib.h>
+#include <algorithm>
 #include <string>
 #include <map>
 #include <vector>
+#include "Intern.h"
 class Scriptable;
 class ScriptHost;
 class TelemetryHost;
@@ -77,12 +79,20 @@ class IScriptable
 			return IssueLineError(" Has registered actions but does not have an action handler!");
 		}
 
+		// Called once per line as the script is validated (before the AVR runs), after the argument types have
+		// been checked. Override to reject bad values up front, or to prepare anything costly (e.g. compile a regex).
+		// Lines from outside the script skip this, so ProcessAction must still cope on its own.
+		virtual bool ValidateAction(unsigned int iAction, const vector<string> &args, string &strError)
+		{
+			return true;
+		}
+
 		// Processes the menu callback. By default, will try the script handler for no-arg actions.
 		// If this is NOT what you want, overload this in your class.
 		virtual void ProcessMenu(unsigned iAction)
 		{
-			//printf("m_Act: %u\n", (unsigned)m_ActionArgs.count(iAction));
-			if (m_ActionArgs.count(iAction)==0 || m_ActionArgs.at(iAction).size()==0) // If no args needed or it wasn't registered, try the script handler.
+			const Action_t *pAct = FindAction(iAction);
+			if (pAct == nullptr || pAct->pArgs->empty()) // If no args needed or it wasn't registered, try the script handler.
 			{
 				auto LSResult = ProcessAction(iAction,{});
 				if (LSResult != LineStatus::Error || LSResult != LineStatus::Unhandled)
@@ -106,56 +116,79 @@ class IScriptable
 		void PrintRegisteredActions(bool bMarkdown = false)
 		{
 			printf("%s%s::\n",bMarkdown?"### ":"\t", m_strName.c_str());
-			for (auto it=m_ActionIDs.begin();it!=m_ActionIDs.end();it++)
+			for (auto &act : m_vActions)
 			{
-				unsigned int ID = it->second;
-				string strArgFmt = it->first;
+				string strArgFmt = *act.pName;
 				strArgFmt.push_back('(');
-				if (m_ActionArgs[ID].size()>0)
+				if (act.pArgs->size()>0)
 				{
-					for (size_t i=0; i<m_ActionArgs[ID].size(); i++)
-						strArgFmt += m_ArgToString.at(m_ActionArgs.at(ID).at(i)) + ", ";
+					for (size_t i=0; i<act.pArgs->size(); i++)
+						strArgFmt += m_ArgToString.at(act.pArgs->at(i)) + ", ";
 					strArgFmt[strArgFmt.size()-2] = ')';
 				}
 				else
 					strArgFmt.push_back(')');
 				if (bMarkdown)
-					printf(" - `%-30s` - `%s`\n",strArgFmt.c_str(), m_mHelp.at(ID).c_str());
+					printf(" - `%-30s` - `%s`\n",strArgFmt.c_str(), act.pHelp);
 				else
-					printf("\t\t%-30s%s\n",strArgFmt.c_str(), m_mHelp.at(ID).c_str());
+					printf("\t\t%-30s%s\n",strArgFmt.c_str(), act.pHelp);
 			}
 		}
 		// Registers a new no-argument Scriptable action with the given function, description, and an ID that will be
 		// provided in ProcessAction. This lets you set up an internal enum and switch() on actions
 		// instead of needing to make a string-comparison if-else conditional.
-		inline virtual bool RegisterAction(const string &strAct, const string& strDesc, unsigned int ID)
+		// The description is a string literal, it is kept as is and only read by PrintRegisteredActions.
+		inline virtual bool RegisterAction(const string &strAct, const char *pDesc, unsigned int ID)
 		{
-			if (m_ActionIDs.count(strAct)>0)
+			auto it = lower_bound(m_vActions.begin(), m_vActions.end(), strAct, [](const Action_t &act, const string &strName) { return *act.pName < strName; });
+			if (it != m_vActions.end() && *it->pName == strAct)
 			{
 				fprintf(stderr,"ERROR: Attempted to register duplicate action handler %s::%s\n",m_strName.c_str(),strAct.c_str());
 				return false;
 			}
-			m_ActionIDs[strAct] = ID;
-			m_mHelp[ID] = strDesc;
-			m_ActionArgs[ID].clear();
+			m_vActions.insert(it, {Intern(strAct), ID, Intern(vector<ArgType>()), pDesc});
 			return true;
 		}
 
-		// Registers a scriptable action Name::strAct(), help description strDesc, internal ID, and a vector of argument types.
+		// Registers a scriptable action Name::strAct(), help description pDesc (a literal), internal ID, and a vector of argument types.
 		// The types are (currently) for display only but the count is used to sanity-check lines before passing them to you in ProcessAction.
-		inline void RegisterAction(const string &strAct, const string& strDesc, unsigned int ID, const vector<ArgType>& vTypes)
+		inline void RegisterAction(const string &strAct, const char *pDesc, unsigned int ID, const vector<ArgType>& vTypes)
 		{
-			if (!RegisterAction(strAct,strDesc, ID))
+			if (!RegisterAction(strAct,pDesc, ID))
 				return;
-			m_ActionArgs[ID] = vTypes;
+			for (auto &act : m_vActions)
+				if (act.ID == ID && *act.pName == strAct)
+					act.pArgs = Intern(vTypes);
+		}
+
+		// The registered actions. Every instance of a part registers the same ones, so the
+		// strings and argument lists are shared between them (see Intern).
+		typedef struct Action_t
+		{
+			const string *pName;
+			unsigned int ID;
+			const vector<ArgType> *pArgs;
+			const char *pHelp;
+		} Action_t;
+
+		// By name or ID, nullptr if there is no such action.
+		inline const Action_t* FindAction(const string &strAct) const
+		{
+			auto it = lower_bound(m_vActions.begin(), m_vActions.end(), strAct, [](const Action_t &act, const string &strName) { return *act.pName < strName; });
+			return it != m_vActions.end() && *it->pName == strAct ? &*it : nullptr;
+		}
+		inline const Action_t* FindAction(unsigned int ID) const
+		{
+			for (auto &act : m_vActions)
+				if (act.ID == ID)
+					return &act;
+			return nullptr;
 		}
 
     private:
 		string m_strName;
 		bool m_bRegistered = false;
-		map<unsigned int, vector<ArgType>> m_ActionArgs;
-		map<string, unsigned int> m_ActionIDs;
-		map<unsigned int,string> m_mHelp;
+		vector<Action_t> m_vActions; // Sorted by name
 		static const map<ArgType,string> m_ArgToString;
 
 };
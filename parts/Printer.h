@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <utility>
 
+namespace Boards { class Board; }
+
 class Printer
 {
 	public:
@@ -51,6 +53,9 @@ class Printer
 
 		virtual std::pair<int,int> GetWindowSize() = 0;
 
+		// The MMU's board, if the printer runs one besides its own. For watching it too.
+		virtual Boards::Board* GetMMUBoard() { return nullptr; }
+
 		string GetVisualType() { return m_visType; }
 		void SetVisualType(string visType) {m_visType = visType; OnVisualTypeSet(visType);}
 
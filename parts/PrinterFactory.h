@@ -41,13 +41,15 @@ class PrinterFactory
 {
 	public:
 
+		// uiInstance is the printer's index when running several in one process, see Board::SetInstance()
 		template<typename ...Args>
-		static void* CreatePrinter(string strPrinter, Boards::Board *&pBoard, Printer *&pPrinter, bool bBL, bool bNoHacks, bool bSerial, string strSD, Args...args)
+		static void* CreatePrinter(string strPrinter, Boards::Board *&pBoard, Printer *&pPrinter, bool bBL, bool bNoHacks, bool bSerial, string strSD, unsigned int uiInstance, Args...args)
 		{
 				void* p = (GetPrinterByName(strPrinter,pBoard,pPrinter));
 				if(p != nullptr)
 				{
 					if (!strSD.empty()) pBoard->SetSDCardFile(strSD);
+					pBoard->SetInstance(uiInstance);
 					pBoard->SetDisableWorkarounds(bNoHacks);
 					pPrinter->SetConnectSerial(bSerial);
 					pBoard->CreateBoard(args...);
@@ -28,55 +28,139 @@
 
 #include "BasePeripheral.h"
 #include <avr_spi.h>
+#include <stddef.h>  // for size_t
+#include <map>       // for map
+#include <memory>    // for unique_ptr
+#include <vector>    // for vector
 
 class SPIPeripheral: public BasePeripheral
 {
     protected:
 
-        // SPI input helper. Overload this in your SPI class.
+        // SPI input helper. Overload this in your SPI class (unless it is transactional).
         // If you want to send a reply, return the value and call SetSendReplyFlag()
-        virtual uint8_t OnSPIIn(struct avr_irq_t * irq, uint32_t value) = 0;
+        virtual uint8_t OnSPIIn(struct avr_irq_t * irq, uint32_t value) { return 0; };
 
         // SPI CSEL helper. You can overload this if you want, but you don't need to for
         // basic 8-bit SPI objects as it already guards OnSPIIn.
         virtual void OnCSELIn(struct avr_irq_t * irq, uint32_t value) = 0;
 
+        // Transaction level alternative to OnSPIIn, see SetTransactional. Called when CSEL
+        // goes high (before OnCSELIn) with everything clocked in while it was low.
+        virtual void OnSPITransfer(const uint8_t *pData, size_t uiLen) {};
+
         // Sets the flag that you have and want to send a reply.
         void SetSendReplyFlag(){m_bSendReply = true;}
 
+        // Collects each CSEL-framed transfer (up to uiMaxLen bytes, the rest are dropped) into
+        // a preallocated buffer for OnSPITransfer instead of calling OnSPIIn per byte.
+        // Replies are clocked out of the SetReplyStream buffer, 0 once it runs out.
+        void SetTransactional(size_t uiMaxLen) { m_vRx.resize(uiMaxLen); m_bTransactional = true; }
+
+        // Bytes to clock out for the next transfer, typically set when CSEL falls. Byte level devices
+        // may also set one from OnSPIIn, the bytes after that are answered straight from the stream
+        // (without calling OnSPIIn) until it runs out. The buffer must stay valid until CSEL rises.
+        void SetReplyStream(const uint8_t *pReply, size_t uiLen) { m_pReply = pReply; m_uiReplyLen = uiLen; m_uiReplyPos = 0; }
+
         // Sets up the IRQs on "avr" for this class. Optional name override IRQNAMES.
         template<class C>
         void _Init(avr_t *avr, C *p, const char** IRQNAMES = nullptr) {
             BasePeripheral::_Init(avr,p, IRQNAMES);
+            m_uiByteIn = C::SPI_BYTE_IN;
+            m_uiByteOut = C::SPI_BYTE_OUT;
+            m_pBus = GetBus(avr);
 
-            RegisterNotify(C::SPI_BYTE_IN, MAKE_C_CALLBACK(SPIPeripheral,_OnSPIIn<C>), this);
+            RegisterNotify(C::SPI_BYTE_IN, MAKE_C_CALLBACK(SPIPeripheral,_OnSPIIn), this);
 
-            ConnectFrom(avr_io_getirq(avr,AVR_IOCTL_SPI_GETIRQ(0),SPI_IRQ_OUTPUT), C::SPI_BYTE_IN);
             ConnectTo(C::SPI_BYTE_OUT,avr_io_getirq(avr,AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT));
 
             RegisterNotify(C::SPI_CSEL, MAKE_C_CALLBACK(SPIPeripheral,_OnCSELIn), this);
         }
 
     private:
+        // The devices on an AVR's SPI share one hook on its output, which hands each byte
+        // (via the device's SPI_BYTE_IN, so traces still see it) to the selected ones only.
+        typedef struct SPIBus_t
+        {
+            std::vector<SPIPeripheral*> vSelected;
+        } SPIBus_t;
+
+        // Boards are wired up on the main thread and their AVRs live until exit.
+        static SPIBus_t* GetBus(avr_t *avr)
+        {
+            static std::map<avr_t*, std::unique_ptr<SPIBus_t>> mBuses;
+            std::unique_ptr<SPIBus_t> &pBus = mBuses[avr];
+            if (!pBus)
+            {
+                pBus.reset(new SPIBus_t());
+                avr_irq_register_notify(avr_io_getirq(avr,AVR_IOCTL_SPI_GETIRQ(0),SPI_IRQ_OUTPUT), OnBusByte, pBus.get());
+            }
+            return pBus.get();
+        }
+
+        static void OnBusByte(struct avr_irq_t * irq, uint32_t value, void *param)
+        {
+            SPIBus_t *pBus = static_cast<SPIBus_t*>(param);
+            for (size_t i=0; i<pBus->vSelected.size(); i++)
+                pBus->vSelected[i]->RaiseIRQ(pBus->vSelected[i]->m_uiByteIn, value);
+        }
+
         bool m_bCSel = true; // Chipselect, active low.
         bool m_bSendReply = false;
+        unsigned int m_uiByteIn = 0, m_uiByteOut = 0;
+        SPIBus_t *m_pBus = nullptr;
+
+        bool m_bTransactional = false;
+        std::vector<uint8_t> m_vRx;
+        size_t m_uiRxLen = 0;
+        const uint8_t *m_pReply = nullptr;
+        size_t m_uiReplyLen = 0, m_uiReplyPos = 0;
 
         void _OnCSELIn(struct avr_irq_t * irq, uint32_t value)
         {
+            bool bWasSel = !m_bCSel;
             m_bCSel = value;
+            if (!m_bCSel && !bWasSel)
+                m_pBus->vSelected.push_back(this);
+            else if (m_bCSel && bWasSel)
+            {
+                for (auto it = m_pBus->vSelected.begin(); it != m_pBus->vSelected.end(); it++)
+                    if (*it == this)
+                    {
+                        m_pBus->vSelected.erase(it);
+                        break;
+                    }
+            }
+            if (value)
+            {
+                if (m_bTransactional)
+                    OnSPITransfer(m_vRx.data(), m_uiRxLen);
+                m_uiRxLen = 0;
+                m_pReply = nullptr;
+                m_uiReplyLen = m_uiReplyPos = 0;
+            }
             OnCSELIn(irq,value);
         };
 
-
-        template<class C>
         void _OnSPIIn(struct avr_irq_t * irq, uint32_t value)
         {
-            if (!m_bCSel)
+            if (m_bCSel)
+                return;
+            if (m_bTransactional)
+            {
+                if (m_uiRxLen < m_vRx.size())
+                    m_vRx[m_uiRxLen++] = value;
+                RaiseIRQ(m_uiByteOut, m_uiReplyPos < m_uiReplyLen ? m_pReply[m_uiReplyPos++] : 0);
+                return;
+            }
+            if (m_uiReplyPos < m_uiReplyLen)
             {
-                m_bSendReply = false;
-                uint8_t uiByteOut = OnSPIIn(irq, value);
-                if (m_bSendReply)
-                    RaiseIRQ(C::SPI_BYTE_OUT,uiByteOut);
+                RaiseIRQ(m_uiByteOut, m_pReply[m_uiReplyPos++]);
+                return;
             }
+            m_bSendReply = false;
+            uint8_t uiByteOut = OnSPIIn(irq, value);
+            if (m_bSendReply)
+                RaiseIRQ(m_uiByteOut,uiByteOut);
         }
 };
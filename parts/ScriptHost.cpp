@@ -23,32 +23,32 @@
  */
 
 #include <ScriptHost.h>
+#include <algorithm>    // for min
 #include <exception>    // for exception
 #include <fstream>      // IWYU pragma: keep for basic_istream, char_traits, ifstream, istring...
 #include <sstream>		// IWYU pragma: keep
 #include <type_traits>  // for __decay_and_strip<>::__type
 #include <utility>      // for make_pair, pair
+#include "TelemetryHost.h" // for TelemetryHost
 #include <GL/freeglut_std.h> // glut menus
 #include <assert.h> // assert.
 
-map<string, IScriptable*> ScriptHost::m_clients;
+thread_local ScriptHost* ScriptHost::m_pCurrent = nullptr;
+vector<unique_ptr<ScriptHost>> ScriptHost::m_vHosts;
 
-vector<string> ScriptHost::m_script;
-unsigned int ScriptHost::m_iLine, ScriptHost::m_uiAVRFreq;
-map<string, int> ScriptHost::m_mMenuIDs;
-map<unsigned,IScriptable*> ScriptHost::m_mMenuBase2Client;
-map<string, unsigned> ScriptHost::m_mClient2MenuBase;
-map<string, vector<pair<string,int>>> ScriptHost::m_mClientEntries;
-ScriptHost::linestate_t ScriptHost::m_lnState = linestate_t();
-shared_ptr<ScriptHost> ScriptHost::g_pHost;
-ScriptHost::State ScriptHost::m_state = ScriptHost::State::Idle;
-int ScriptHost::m_iTimeoutCycles = -1, ScriptHost::m_iTimeoutCount = 0;
-bool ScriptHost::m_bQuitOnTimeout = false;
-bool ScriptHost::m_bMenuCreated = false;
+ScriptHost* ScriptHost::GetDefault()
+{
+	static ScriptHost host;
+	return &host;
+}
 
-atomic_uint ScriptHost::m_uiQueuedMenu {0};
+ScriptHost* ScriptHost::Create()
+{
+	m_vHosts.emplace_back(new ScriptHost());
+	return m_vHosts.back().get();
+}
 
-void ScriptHost::PrintScriptHelp(bool bMarkdown)
+void ScriptHost::_PrintScriptHelp(bool bMarkdown)
 {
 	if (bMarkdown)
 	{
@@ -75,10 +75,23 @@ void ScriptHost::LoadScript(const string &strFile)
 		if (strLn.empty() || strLn[0]=='#')
 			continue;
 
+		if (strLn[0]=='[' && strLn.back()==']') // [name] starts a track that runs alongside the others.
+		{
+			m_vTracks.emplace_back();
+			m_vTracks.back().strName = strLn.substr(1, strLn.size()-2);
+			continue;
+		}
+		if (m_vTracks.empty())
+		{
+			m_vTracks.emplace_back();
+			m_vTracks.back().strName = "main";
+		}
+		m_vTracks.back().vLines.push_back(m_script.size());
 		m_script.push_back(strLn);
 	}
-	m_iLine = 0;
 	printf("ScriptHost: Loaded %zu lines from %s\n", m_script.size(), strFile.c_str());
+	if (m_vTracks.size()>1)
+		printf("ScriptHost: %zu tracks will run side by side\n", m_vTracks.size());
 }
 
 // Parse line in the format Context::Action(arg1, arg2,...)
@@ -106,10 +119,11 @@ IScriptable::LineStatus ScriptHost::ProcessAction(unsigned int ID, const vector<
 	{
 		case ActSetTimeoutMs:
 		{
+			// Per track, so one waiting a long time doesn't need to loosen the others.
+			Track_t &track = CurrentTrack();
 			int iTime = stoi(vArgs.at(0));
-			m_iTimeoutCycles = iTime *(m_uiAVRFreq/1000);
-			printf("ScriptHost::SetTimeoutMs changed to %d (%d cycles)\n",iTime,m_iTimeoutCycles);
-			m_iTimeoutCount = 0;
+			track.iTimeoutCycles = iTime *(m_uiAVRFreq/1000);
+			printf("ScriptHost::SetTimeoutMs changed to %d (%d cycles)\n",iTime,track.iTimeoutCycles);
 			break;
 		}
 		case ActSetQuitOnTimeout:
@@ -117,6 +131,15 @@ IScriptable::LineStatus ScriptHost::ProcessAction(unsigned int ID, const vector<
 			m_bQuitOnTimeout = stoi(vArgs.at(0))!=0;
 			break;
 		}
+		case ActSignal:
+			m_sSignals.insert(vArgs.at(0));
+			Notify();
+			break;
+		case ActWaitForSignal:
+			if (m_sSignals.count(vArgs.at(0)))
+				break;
+			_WakeOnNotify();
+			return LineStatus::Waiting;
 	}
 	return LineStatus::Finished;
 }
@@ -127,7 +150,7 @@ bool ScriptHost::ValidateScript()
 	string strCtxt, strAct;
 	printf("Validating script...\n");
 	bool bClean = true;
-	auto fcnErr = [](const string &sMsg, const int iLine) { printf("ScriptHost: Validation failed: %s on line %d : %s\n",sMsg.c_str(), iLine, m_script.at(iLine).c_str());};
+	auto fcnErr = [this](const string &sMsg, const int iLine) { printf("ScriptHost: Validation failed: %s on line %d : %s\n",sMsg.c_str(), iLine, m_script.at(iLine).c_str());};
 	for (size_t i=0; i<m_script.size(); i++)
 	{
 		vArgs.clear();
@@ -150,7 +173,8 @@ bool ScriptHost::ValidateScript()
 			printf("%s\n",strCtxts.c_str());
 			continue;
 		}
-		if (m_clients.at(strCtxt)->m_ActionIDs.count(strAct)==0)
+		const IScriptable::Action_t *pAct = m_clients.at(strCtxt)->FindAction(strAct);
+		if (pAct == nullptr)
 		{
 			bClean = false;
 			fcnErr("Unknown action " + strCtxt + "::" + strAct,i);
@@ -158,8 +182,8 @@ bool ScriptHost::ValidateScript()
 			m_clients.at(strCtxt)->PrintRegisteredActions();
 			continue;
 		}
-		int ID = m_clients.at(strCtxt)->m_ActionIDs.at(strAct);
-		const vector<ArgType> vArgTypes = m_clients.at(strCtxt)->m_ActionArgs.at(ID);
+		int ID = pAct->ID;
+		const vector<ArgType> &vArgTypes = *pAct->pArgs;
 		if (vArgTypes.size()!=vArgs.size())
 		{
 			bClean = false;
@@ -167,31 +191,88 @@ bool ScriptHost::ValidateScript()
 						m_clients.at(strCtxt)->PrintRegisteredActions();
 			continue;
 		}
+		bool bArgsOK = true;
 		for (size_t j=0; j<vArgTypes.size(); j++)
 		{
 			if (!CheckArg(vArgTypes.at(j),vArgs.at(j)))
 			{
-				bClean = false;
+				bClean = bArgsOK = false;
 				fcnErr("Conversion error, expected \"" + m_ArgToString.at(vArgTypes.at(j)) + "\" but could not convert \"" + vArgs.at(j) + "\"",i);
 				continue;
 			}
 		}
+		string strError;
+		if (bArgsOK && !m_clients.at(strCtxt)->ValidateAction(ID, vArgs, strError))
+		{
+			bClean = false;
+			fcnErr(strError, i);
+		}
 
 	}
 	printf("Script validation finished.\n");
+	if (bClean)
+	{
+		m_vCompiled.resize(m_script.size());
+		for (size_t i=0; i<m_script.size(); i++)
+			CompileLine(i);
+		m_uiTracksLeft = 0;
+		for (auto &track : m_vTracks)
+			m_uiTracksLeft += !track.vLines.empty();
+		if (m_uiTracksLeft)
+			m_uiNextWake = 0;
+	}
 	return bClean;
 }
 
-// Called from the execution context to process the menu action.
-void ScriptHost::DispatchMenuCB()
+bool ScriptHost::_CompileCommand(const string &strLine, Command_t &cmd, string &strError)
 {
-	if (m_uiQueuedMenu !=0)
+	string strCtxt, strAct;
+	if (!GetLineParts(strLine, strCtxt, strAct, cmd.vArgs))
 	{
-		unsigned iID = m_uiQueuedMenu;
-		m_uiQueuedMenu.store(0);
-		IScriptable *pClient = m_mMenuBase2Client[(iID - iID%100)];
-		pClient->ProcessMenu(iID%100);
+		strError = "Line is not of the form Context::Action([arg1,arg2,...])";
+		return false;
+	}
+	if (m_clients.count(strCtxt)==0)
+	{
+		strError = "Unknown context " + strCtxt;
+		return false;
+	}
+	cmd.pClient = m_clients.at(strCtxt);
+	const IScriptable::Action_t *pAct = cmd.pClient->FindAction(strAct);
+	if (pAct == nullptr)
+	{
+		strError = "Unknown action " + strCtxt + "::" + strAct;
+		return false;
+	}
+	cmd.iActID = pAct->ID;
+	const vector<ArgType> &vArgTypes = *pAct->pArgs;
+	if (vArgTypes.size()!=cmd.vArgs.size())
+	{
+		strError = "Argument count mismatch, expected " + to_string(vArgTypes.size());
+		return false;
+	}
+	for (size_t i=0; i<vArgTypes.size(); i++)
+		if (!CheckArg(vArgTypes.at(i),cmd.vArgs.at(i)))
+		{
+			strError = "Conversion error, expected \"" + m_ArgToString.at(vArgTypes.at(i)) + "\" but could not convert \"" + cmd.vArgs.at(i) + "\"";
+			return false;
+		}
+	return true; // Not ValidateAction(), that may change the scriptable under the AVR thread.
+}
 
+// Called from the execution context to process the menu action.
+void ScriptHost::_DispatchMenuCB()
+{
+	unsigned iID = m_chMenu.Poll(m_uiQueuedMenu.exchange(0));
+	if (iID !=0)
+	{
+		auto it = m_mMenuBase2Client.find(iID - iID%100);
+		if (it == m_mMenuBase2Client.end()) // An edited or mismatched replay.
+		{
+			fprintf(stderr, "ScriptHost: No menu with ID %u\n", iID);
+			return;
+		}
+		it->second->ProcessMenu(iID%100);
 	}
 }
 
@@ -199,10 +280,10 @@ void ScriptHost::DispatchMenuCB()
 void ScriptHost::MenuCB(int iID)
 {
 	//printf("Menu CB %d\n",iID);
-	m_uiQueuedMenu.store(iID);
+	Get()->m_uiQueuedMenu.store(iID);
 }
 
-void ScriptHost::CreateRootMenu(int iWinID)
+void ScriptHost::_CreateRootMenu(int iWinID)
 {
 	m_bMenuCreated = true;
 	if (m_mMenuIDs.count("ScriptHost")!=0)
@@ -269,31 +350,32 @@ bool ScriptHost::CheckArg(const ArgType &type, const string &val)
 
 }
 
-void ScriptHost::ParseLine(unsigned int iLine)
+void ScriptHost::CompileLine(unsigned int iLine)
 {
 	string strCtxt, strAct;
-	m_lnState.isValid = false;
-	//m_lnState.vArgs.clear();
-	if (!ScriptHost::GetLineParts(m_script.at(iLine),strCtxt,strAct,m_lnState.vArgs))
+	linestate_t &lnState = m_vCompiled.at(iLine);
+	lnState.isValid = false;
+	if (!ScriptHost::GetLineParts(m_script.at(iLine),strCtxt,strAct,lnState.vArgs))
 		return;
 
-	m_lnState.iLine = iLine;
+	lnState.iLine = iLine;
 	if(!m_clients.count(strCtxt) || m_clients.at(strCtxt)==nullptr)
 		return;
 
-	m_lnState.strCtxt = strCtxt;
+	lnState.strCtxt = strCtxt;
 
-	IScriptable *pClient = m_lnState.pClient = m_clients.at(strCtxt);
+	IScriptable *pClient = lnState.pClient = m_clients.at(strCtxt);
 
-	if (!m_lnState.pClient->m_ActionIDs.count(strAct))
+	const IScriptable::Action_t *pAct = pClient->FindAction(strAct);
+	if (pAct == nullptr)
 		return;
 
-	int iID = m_lnState.iActID = pClient->m_ActionIDs[strAct];
+	lnState.iActID = pAct->ID;
 
-	if (m_lnState.vArgs.size()!=pClient->m_ActionArgs.at(iID).size())
+	if (lnState.vArgs.size()!=pAct->pArgs->size())
 		return;
 
-	m_lnState.isValid = true;
+	lnState.isValid = true;
 }
 
 void ScriptHost::AddSubmenu(IScriptable *src)
@@ -311,7 +393,7 @@ void ScriptHost::AddSubmenu(IScriptable *src)
 	}
 }
 
-void ScriptHost::AddMenuEntry(const string &strName, unsigned uiID, IScriptable* src)
+void ScriptHost::_AddMenuEntry(const string &strName, unsigned uiID, IScriptable* src)
 {
 	assert(uiID<100);
 	auto strClient = src->GetName();
@@ -321,7 +403,7 @@ void ScriptHost::AddMenuEntry(const string &strName, unsigned uiID, IScriptable*
 }
 
 
-void ScriptHost::AddScriptable(string strName, IScriptable* src)
+void ScriptHost::_AddScriptable(string strName, IScriptable* src)
 {
 	if (m_clients.count(strName)==0)
 	{
@@ -352,69 +434,157 @@ void ScriptHost::AddScriptable(string strName, IScriptable* src)
 	}
 }
 
-using LS = IScriptable::LineStatus;
-void ScriptHost::OnAVRCycle()
+void ScriptHost::RunTracks()
 {
-	if (m_iLine>=m_script.size())
-		return; // Done.
+	bool bNotified = m_bNotified.exchange(false, std::memory_order_relaxed);
+	uint64_t uiNext = UINT64_MAX;
+	for (auto &track : m_vTracks)
+	{
+		if (track.iPos >= track.vLines.size())
+			continue;
+		if (track.wake == Wake::Poll || m_uiNow >= track.uiWakeAt || (bNotified && track.wake == Wake::Event))
+			RunTrack(track);
+		if (track.iPos < track.vLines.size())
+			uiNext = min(uiNext, track.wake == Wake::Poll ? 0 : track.uiWakeAt);
+	}
+	m_uiNextWake = uiNext;
+}
 
-	if (m_lnState.iLine != m_iLine || m_state == State::Idle)
+using LS = IScriptable::LineStatus;
+void ScriptHost::RunTrack(Track_t &track)
+{
+	unsigned int iLine = track.vLines[track.iPos];
+	bool bFirst = !track.bStarted;
+	if (bFirst)
 	{
 		m_state = State::Running;
-		printf("ScriptHost: Executing line %s\n",m_script.at(m_iLine).c_str());
-		ParseLine(m_iLine);
+		track.bStarted = true;
+		track.uiLineStart = m_uiNow;
+		m_iActiveLine.store(iLine, std::memory_order_relaxed);
+		printf("ScriptHost: %sExecuting line %s\n",TrackPrefix(track).c_str(),m_script.at(iLine).c_str());
 	}
 
-	if (m_lnState.isValid)
+	const linestate_t &lnState = m_vCompiled[iLine];
+	if (!lnState.isValid)
 	{
-		LS lsResult = m_lnState.pClient->ProcessAction(m_lnState.iActID,m_lnState.vArgs);
-		switch (lsResult)
-		{
-			case LS::Finished:
-				m_iLine++; // This line is done, mobe on.
-				m_iTimeoutCount = 0;
+		printf("ScriptHost: ERROR: Invalid line/unrecognized command:%d %s\n",iLine,m_script.at(iLine).c_str());
+		EndScript(State::Error);
+		return;
+	}
+	m_pTrack = &track;
+	m_bFirstCall = bFirst;
+	track.wake = Wake::Poll; // Unless the action asks otherwise.
+	LS lsResult = lnState.pClient->ProcessAction(lnState.iActID,lnState.vArgs);
+	m_pTrack = nullptr;
+	m_bFirstCall = false;
+	switch (lsResult)
+	{
+		case LS::Finished:
+			NextLine(track); // This line is done, move on.
+			break;
+		case LS::Unhandled:
+			printf("ScriptHost: Unhandled action, considering this an error.\n");
+			/* FALLTHRU */
+		case LS::Error:
+			printf("ScriptHost: %sScript FAILED on line %d\n",TrackPrefix(track).c_str(),iLine);
+			EndScript(State::Error);
+			return;
+		case LS::Waiting:
+			if (track.iTimeoutCycles<0)
 				break;
-			case LS::Unhandled:
-				printf("ScriptHost: Unhandled action, considering this an error.\n");
-				/* FALLTHRU */
-			case LS::Error:
-				printf("ScriptHost: Script FAILED on line %d\n",m_iLine);
-				m_iLine = m_script.size(); // Error, end scripting.
-				m_state = State::Error;
-				return;
-			case LS::Waiting:
-				if(m_iTimeoutCycles>=0 && ++m_iTimeoutCount>m_iTimeoutCycles)
+			if (m_uiNow - track.uiLineStart > static_cast<uint64_t>(track.iTimeoutCycles))
+			{
+				if (m_bQuitOnTimeout)
 				{
-					m_state = State::Timeout;
-					if (m_bQuitOnTimeout)
-					{
-						printf("ScriptHost: Script TIMED OUT on %s. Quitting...\n",m_script.at(m_iLine).c_str());
-						int ID = m_clients.at("Board")->m_ActionIDs.at("Quit");
-						m_clients.at("Board")->ProcessAction(ID,{});
-						m_iLine = m_script.size();
-						return;
-					}
-					printf("ScriptHost: Script TIMED OUT on %s\n",m_script.at(m_iLine).c_str());
-					m_iLine++;
-					m_iTimeoutCount = 0;
+					printf("ScriptHost: %sScript TIMED OUT on %s. Quitting...\n",TrackPrefix(track).c_str(),m_script.at(iLine).c_str());
+					EndScript(State::Timeout);
+					return;
 				}
-				break;
-			default:
-				break;
+				printf("ScriptHost: %sScript TIMED OUT on %s\n",TrackPrefix(track).c_str(),m_script.at(iLine).c_str());
+				TelemetryHost::GetHost()->DumpFlightRecorder("Script timed out on " + m_script.at(iLine));
+				NextLine(track);
+				m_state = State::Timeout;
+			}
+			else if (track.wake != Wake::Poll) // Sleeping, but not past the timeout.
+				track.uiWakeAt = min(track.uiWakeAt, track.uiLineStart + track.iTimeoutCycles + 1U);
+			break;
+		default:
+			break;
+	}
+}
 
-		}
-		if (m_iLine==m_script.size())
-		{
-			printf("ScriptHost: Script FINISHED\n");
-			m_state = State::Finished;
-		}
+void ScriptHost::NextLine(Track_t &track)
+{
+	track.iPos++;
+	track.bStarted = false;
+	track.bWaiting = false;
+	track.wake = Wake::Poll;
+	if (track.iPos < track.vLines.size())
+		return;
+	if (m_vTracks.size()>1)
+		printf("ScriptHost: [%s] Track finished\n", track.strName.c_str());
+	if (--m_uiTracksLeft == 0)
+	{
+		printf("ScriptHost: Script FINISHED\n");
+		m_state = State::Finished;
+		m_iActiveLine.store(-1, std::memory_order_relaxed);
 	}
-	else
+}
+
+void ScriptHost::EndScript(State state)
+{
+	for (auto &track : m_vTracks)
+		track.iPos = track.vLines.size();
+	m_uiTracksLeft = 0;
+	m_uiNextWake = UINT64_MAX;
+	m_state = state;
+	m_iActiveLine.store(-1, std::memory_order_relaxed);
+	TelemetryHost::GetHost()->DumpFlightRecorder(state == State::Timeout ? "Script timed out" : "Script failed");
+	if (m_bQuitOnTimeout)
+	{
+		const IScriptable::Action_t *pAct = m_clients.at("Board")->FindAction("Quit");
+		if (pAct)
+			m_clients.at("Board")->ProcessAction(pAct->ID,{});
+	}
+}
+
+void ScriptHost::_Fail(const string &strWhy)
+{
+	if (m_script.empty() || m_state == State::Error)
+		return;
+	printf("ScriptHost: Script FAILED: %s\n",strWhy.c_str());
+	EndScript(State::Error);
+}
+
+void ScriptHost::_WakeIn(uint64_t uiCycles)
+{
+	Track_t &track = CurrentTrack();
+	track.wake = Wake::At;
+	track.uiWakeAt = m_uiNow + uiCycles;
+}
+
+void ScriptHost::_WakeOnNotify()
+{
+	Track_t &track = CurrentTrack();
+	track.wake = Wake::Event;
+	track.uiWakeAt = UINT64_MAX;
+}
+
+IScriptable::LineStatus ScriptHost::_WaitCycles(uint64_t uiCycles)
+{
+	Track_t &track = CurrentTrack();
+	if (!track.bWaiting)
+	{
+		track.bWaiting = true;
+		track.uiWaitEnd = m_uiNow + uiCycles;
+	}
+	else if (m_uiNow >= track.uiWaitEnd)
 	{
-		printf("ScriptHost: ERROR: Invalid line/unrecognized command:%d %s\n",m_iLine,m_script.at(m_iLine).c_str());
-		m_state = State::Error;
-		m_iLine = m_script.size();
+		track.bWaiting = false;
+		return LineStatus::Finished;
 	}
+	_WakeIn(track.uiWaitEnd - m_uiNow);
+	return LineStatus::Waiting;
 }
 
 const map<ArgType,string> IScriptable::m_ArgToString = {
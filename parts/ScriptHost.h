@@ -24,66 +24,131 @@
 #pragma once
 
 
+#include <stdint.h>       // for uint64_t, UINT64_MAX
 #include <stdio.h>        // for fprintf, stderr
-#include <atomic>         // for atomic_uint
+#include <atomic>         // for atomic_uint, atomic_bool, atomic_int
 #include <map>            // for map
-#include <memory>         // for operator!=, shared_ptr
+#include <memory>         // for unique_ptr
+#include <set>            // for set
 #include <string>         // for string
 #include <utility>        // for pair
 #include <vector>         // for vector
 #include "IScriptable.h"  // for ArgType, ArgType::Bool, ArgType::Int, IScri...
+#include "InputLog.h"     // for InputLog
 
 using namespace std;
 
 class ScriptHost: public IScriptable
 {
     public:
-		static shared_ptr<ScriptHost> Get()
+		// Returns the host selected for the calling thread, or the default one if none was.
+		static ScriptHost* Get()
 		{
-			return g_pHost;
+			if (m_pCurrent)
+				return m_pCurrent;
+			return GetDefault();
 		}
 
+		// Creates an additional host for another printer instance in the same process.
+		// Select() it before creating that printer so its scriptables register with it.
+		static ScriptHost* Create();
+
+		// Selects the host used by the calling thread. nullptr reverts to the default host.
+		static inline void Select(ScriptHost *pHost) { m_pCurrent = pHost; }
+
 		inline static bool IsInitialized()
 		{
-			return g_pHost!=nullptr;
+			return Get()->m_bInitialized;
 		}
 		static bool Init()
 		{
-			if (g_pHost!=nullptr)
+			ScriptHost *pHost = Get();
+			if (pHost->m_bInitialized)
 			{
 				fprintf(stderr,"ERROR: Duplicate initialization attempt for scripthost!\n");
 				return false;
 			}
-			g_pHost.reset(new ScriptHost());
+			pHost->m_bInitialized = true;
 			return true;
 		}
 
 		static bool Setup(const string &strScript,unsigned uiFreq)
 		{
-			m_uiAVRFreq = uiFreq;
+			ScriptHost *pHost = Get();
+			pHost->m_uiAVRFreq = uiFreq;
 			if (!strScript.empty())
-				LoadScript(strScript);
-			return ValidateScript();
+				pHost->LoadScript(strScript);
+			return pHost->ValidateScript();
+		}
+
+		// Swaps in a new script from its first line, e.g. after a warm-up script has finished.
+		// Keeps the registered scriptables. Only while the AVR isn't running.
+		static bool Restart(const string &strScript)
+		{
+			ScriptHost *pHost = Get();
+			pHost->m_script.clear();
+			pHost->m_vCompiled.clear();
+			pHost->m_vTracks.clear();
+			pHost->m_sSignals.clear();
+			pHost->m_uiTracksLeft = 0;
+			pHost->m_uiNextWake = UINT64_MAX;
+			pHost->m_bQuitOnTimeout = false;
+			pHost->m_state = State::Idle;
+			pHost->m_iActiveLine = -1;
+			return Setup(strScript, pHost->m_uiAVRFreq);
 		}
 
-		static void AddScriptable(string strName, IScriptable* src);
+		static inline void AddScriptable(string strName, IScriptable* src) { Get()->_AddScriptable(strName, src); }
 
-		static void AddMenuEntry(const string &strName, unsigned uiID, IScriptable* src);
+		static inline void AddMenuEntry(const string &strName, unsigned uiID, IScriptable* src) { Get()->_AddMenuEntry(strName, uiID, src); }
 
 		static inline bool IsRegistered(string strName)
 		{
-			return m_clients.count(strName)!=0;
+			return Get()->m_clients.count(strName)!=0;
 		}
 
-		static void CreateRootMenu(int iWinID);
+		static inline void CreateRootMenu(int iWinID) { Get()->_CreateRootMenu(iWinID); }
 
-		static void DispatchMenuCB();
+		static inline void DispatchMenuCB() { Get()->_DispatchMenuCB(); }
 
 		static void MenuCB(int iID);
 
-		static void PrintScriptHelp(bool bMarkdown);
+		static inline void PrintScriptHelp(bool bMarkdown) { Get()->_PrintScriptHelp(bMarkdown); }
+
+		// Runs the script lines that are due. uiCycles is the number of AVR cycles elapsed since the last call.
+		// Nothing is done while every track sleeps until a later cycle or a Notify().
+		static inline void OnAVRCycle(unsigned int uiCycles = 1)
+		{
+			ScriptHost *pHost = Get();
+			pHost->m_uiNow += uiCycles;
+			if (pHost->m_uiNow >= pHost->m_uiNextWake || pHost->m_bNotified.load(std::memory_order_relaxed))
+				pHost->RunTracks();
+		}
+
+		// AVR cycles until a sleeping track is due, e.g. so idle skipping doesn't jump past it. UINT64_MAX if none is.
+		static inline uint64_t GetCyclesToWake()
+		{
+			ScriptHost *pHost = Get();
+			return pHost->m_uiNextWake > pHost->m_uiNow ? pHost->m_uiNextWake - pHost->m_uiNow : 0;
+		}
+
+		// For actions returning Waiting: instead of being polled every cycle, the line sleeps until
+		// uiCycles from now (WakeIn) or until something calls Notify() (WakeOnNotify), whichever
+		// comes first along with its timeout. Lines that call neither are polled as before.
+		static inline void WakeIn(uint64_t uiCycles) { Get()->_WakeIn(uiCycles); }
+		static inline void WakeOnNotify() { Get()->_WakeOnNotify(); }
 
-		static void OnAVRCycle();
+		// Wakes the lines sleeping in WakeOnNotify() so they can look again. Cheap, and safe from any thread.
+		static inline void Notify() { Get()->m_bNotified.store(true, std::memory_order_relaxed); }
+
+		// Whether the calling line is on its first go, so any wait state left from an earlier line is stale.
+		static inline bool IsFirstCall() { return Get()->m_bFirstCall; }
+
+		// A whole wait of uiCycles for the calling line, kept per track so tracks can wait side by side.
+		static inline IScriptable::LineStatus WaitCycles(uint64_t uiCycles) { return Get()->_WaitCycles(uiCycles); }
+
+		// Fails the running script from outside it, e.g. a monitor spotting a firmware fault. Call on the AVR thread.
+		static inline void Fail(const string &strWhy) { Get()->_Fail(strWhy); }
 
 		enum class State
 		{
@@ -94,38 +159,117 @@ class ScriptHost: public IScriptable
 			Error
 		};
 
-		static inline State GetState(){ return m_state;}
+		static inline State GetState(){ return Get()->m_state;}
+
+		// The script line most recently started, on any track, with its number. Empty if there is none.
+		// For reports from other threads (see Watchdog), it may be just finishing.
+		string GetActiveLine() const
+		{
+			int iLine = m_iActiveLine.load(std::memory_order_relaxed);
+			if (iLine < 0 || static_cast<size_t>(iLine) >= m_script.size())
+				return "";
+			return std::to_string(iLine) + ": " + m_script[iLine];
+		}
+
+		// A line run from outside the script (e.g. by RemoteControl). Resolved up front
+		// with CompileCommand, then RunCommand on the AVR thread until it stops waiting.
+		typedef struct Command_t
+		{
+			IScriptable *pClient = nullptr;
+			unsigned int iActID = 0;
+			vector<string> vArgs;
+		} Command_t;
+
+		// Checks a Context::Action(args) line as ValidateScript would. Only reads the
+		// registrations, so any thread may call it once the printer is set up.
+		static inline bool CompileCommand(const string &strLine, Command_t &cmd, string &strError) { return Get()->_CompileCommand(strLine, cmd, strError); }
+
+		static inline IScriptable::LineStatus RunCommand(const Command_t &cmd) { return cmd.pClient->ProcessAction(cmd.iActID, cmd.vArgs); }
 
     private:
-		static bool ValidateScript();
-		static void LoadScript(const string &strScript);
-		static void ParseLine(unsigned int iLine);
+		// Instance implementations of the static interface above.
+		void _AddScriptable(string strName, IScriptable* src);
+		void _AddMenuEntry(const string &strName, unsigned uiID, IScriptable* src);
+		void _CreateRootMenu(int iWinID);
+		void _DispatchMenuCB();
+		void _PrintScriptHelp(bool bMarkdown);
+		void _Fail(const string &strWhy);
+		void _WakeIn(uint64_t uiCycles);
+		void _WakeOnNotify();
+		LineStatus _WaitCycles(uint64_t uiCycles);
+		bool _CompileCommand(const string &strLine, Command_t &cmd, string &strError);
+
+		bool ValidateScript();
+		void LoadScript(const string &strScript);
+		// Resolves a line into its client, action ID and args, so nothing needs to be looked up by name at runtime.
+		void CompileLine(unsigned int iLine);
 		static bool GetLineParts(const string &strLine, string &strCtxt, string& strAct, vector<string>&vArgs);
 		static bool CheckArg(const ArgType &type, const string &val);
 
-		static void AddSubmenu(IScriptable *src);
+		void AddSubmenu(IScriptable *src);
+
+		// How a waiting line wants to be looked at again.
+		enum class Wake
+		{
+			Poll, // Next call, the default.
+			At, // Once the clock reaches uiWakeAt.
+			Event // On a Notify(), or at uiWakeAt for its timeout.
+		};
+
+		// One sequence of lines. Tracks run side by side, each one line at a time.
+		typedef struct Track_t
+		{
+			string strName;
+			vector<unsigned int> vLines; // Indices into m_script
+			unsigned int iPos = 0; // Into vLines
+			bool bStarted = false; // Whether vLines[iPos] has been announced
+			uint64_t uiLineStart = 0; // m_uiNow when it was
+			int iTimeoutCycles = -1;
+			Wake wake = Wake::Poll;
+			uint64_t uiWakeAt = 0;
+			bool bWaiting = false; // For WaitCycles
+			uint64_t uiWaitEnd = 0;
+		} Track_t;
+
+		void RunTracks();
+		void RunTrack(Track_t &track);
+		void NextLine(Track_t &track);
+		// Stops all tracks, quitting if SetQuitOnTimeout asked for it.
+		void EndScript(State state);
+		inline Track_t& CurrentTrack() { return m_pTrack ? *m_pTrack : m_remote; }
+		inline string TrackPrefix(const Track_t &track) { return m_vTracks.size()>1 ? "[" + track.strName + "] " : ""; }
 
 		//We can't register ourselves as a scriptable so just fake it with a processing func.
 		LineStatus ProcessAction(unsigned int ID, const vector<string> &vArgs) override;
 
 		ScriptHost():IScriptable("ScriptHost"){
 			RegisterAction("SetTimeoutMs","Sets a timeout for actions that wait for an event",ActSetTimeoutMs,{ArgType::Int});
-			RegisterAction("SetQuitOnTimeout","If 1, quits when a timeout occurs. Exit code will be non-zero.",ActSetQuitOnTimeout,{ArgType::Bool});
+			RegisterAction("SetQuitOnTimeout","If 1, quits when a timeout occurs or the script fails. Exit code will be non-zero.",ActSetQuitOnTimeout,{ArgType::Bool});
+			RegisterAction("Signal","Raises the named signal for ScriptHost::WaitForSignal on other tracks. It stays raised.",ActSignal,{ArgType::String});
+			RegisterAction("WaitForSignal","Waits until another track raises the named signal.",ActWaitForSignal,{ArgType::String});
 			m_clients[m_strName] = this;
 		}
-		static shared_ptr<ScriptHost> g_pHost;
-		static map<string, IScriptable*> m_clients;
-		static map<string, int> m_mMenuIDs;
-		static map<string, unsigned> m_mClient2MenuBase;
-		static map<unsigned, IScriptable*> m_mMenuBase2Client;
-		static map<string, vector<pair<string,int>>> m_mClientEntries; // Stores client entries for when GLUT is ready.
-		static vector<string> m_script;
-		static unsigned int m_iLine, m_uiAVRFreq;
-		static ScriptHost::State m_state;
-		static bool m_bQuitOnTimeout;
-		static bool m_bMenuCreated;
+		// Constructed on first use, scriptables may register during static initialization.
+		static ScriptHost* GetDefault();
 
-		static atomic_uint m_uiQueuedMenu;
+		static thread_local ScriptHost *m_pCurrent;
+		static vector<unique_ptr<ScriptHost>> m_vHosts; // Hosts made with Create()
+
+		bool m_bInitialized = false;
+		map<string, IScriptable*> m_clients;
+		map<string, int> m_mMenuIDs;
+		map<string, unsigned> m_mClient2MenuBase;
+		map<unsigned, IScriptable*> m_mMenuBase2Client;
+		map<string, vector<pair<string,int>>> m_mClientEntries; // Stores client entries for when GLUT is ready.
+		vector<string> m_script;
+		unsigned int m_uiAVRFreq = 0;
+		ScriptHost::State m_state = State::Idle;
+		atomic_int m_iActiveLine {-1};
+		bool m_bQuitOnTimeout = false;
+		bool m_bMenuCreated = false;
+
+		atomic_uint m_uiQueuedMenu {0};
+		InputLog::Channel m_chMenu {"Menu"};
 
 
 
@@ -142,13 +286,22 @@ class ScriptHost: public IScriptable
 		enum Actions
 		{
 			ActSetTimeoutMs,
-			ActSetQuitOnTimeout
+			ActSetQuitOnTimeout,
+			ActSignal,
+			ActWaitForSignal
 		};
 
+		vector<linestate_t> m_vCompiled; // One entry per m_script line, built by ValidateScript.
 
+		vector<Track_t> m_vTracks;
+		unsigned int m_uiTracksLeft = 0;
+		Track_t *m_pTrack = nullptr; // The one whose line is running
+		bool m_bFirstCall = false;
+		Track_t m_remote; // Stands in for a track for RunCommand lines.
+		set<string> m_sSignals;
 
-		static int m_iTimeoutCycles, m_iTimeoutCount;
-
-		static linestate_t m_lnState;
+		uint64_t m_uiNow = 0; // Script clock, AVR cycles run while scripting
+		uint64_t m_uiNextWake = UINT64_MAX; // Earliest uiWakeAt of the tracks, 0 if one polls
+		atomic_bool m_bNotified {false};
 
 };
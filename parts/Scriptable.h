@@ -39,9 +39,9 @@ class Scriptable: public IScriptable
 		// Registers a new no-argument Scriptable action with the given function, description, and an ID that will be
 		// provided in ProcessAction. This lets you set up an internal enum and switch() on actions
 		// instead of needing to make a string-comparison if-else conditional.
-		inline bool RegisterAction(const string &strAct, const string& strDesc, unsigned int ID) override
+		inline bool RegisterAction(const string &strAct, const char *pDesc, unsigned int ID) override
 		{
-			if (IScriptable::RegisterAction(strAct,strDesc,ID))
+			if (IScriptable::RegisterAction(strAct,pDesc,ID))
 			{
 				ScriptHost::AddScriptable(m_strName,this);
 				m_bRegistered = true;
@@ -52,9 +52,9 @@ class Scriptable: public IScriptable
 		}
 
 		// Convenience wrapper that also adds the action as a context menu entry.
-		inline bool RegisterActionAndMenu(const string &strAct, const string& strDesc, unsigned int ID)
+		inline bool RegisterActionAndMenu(const string &strAct, const char *pDesc, unsigned int ID)
 		{
-			if (RegisterAction(strAct, strDesc, ID))
+			if (RegisterAction(strAct, pDesc, ID))
 			{
 				RegisterMenu(strAct, ID);
 				return true;
@@ -68,8 +68,8 @@ class Scriptable: public IScriptable
 		}
 
 		//Forwarder:
-		inline void RegisterAction(const string &strAct, const string& strDesc, unsigned int ID, const vector<ArgType>& vTypes)
+		inline void RegisterAction(const string &strAct, const char *pDesc, unsigned int ID, const vector<ArgType>& vTypes)
 		{
-			IScriptable::RegisterAction(strAct,strDesc,ID, vTypes);
+			IScriptable::RegisterAction(strAct,pDesc,ID, vTypes);
 		}
 };
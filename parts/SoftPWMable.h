@@ -21,7 +21,9 @@
 
 #pragma once
 
-#include "BasePeripheral.h"
+#include <stdint.h>          // for uint16_t, uint32_t, uint64_t
+#include "BasePeripheral.h"   // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "sim_time.h"         // for avr_usec_to_cycles
 
 class SoftPWMable : public BasePeripheral
 {
@@ -52,13 +54,24 @@ class SoftPWMable : public BasePeripheral
 				OnDigitalChange(irq,value);
 				return;
 			}
-			if (value) // Was off, start at full, we'll update rate later.
+			// The timeout is armed once per burst of edges and pushes itself back, see OnSoftPWMChangeTimeout.
+			m_cntLastEdge = m_pAVR->cycle;
+			if (!m_bTimeoutArmed)
 			{
+				m_bTimeoutArmed = true;
 				RegisterTimerUsec(m_fcnSoftTimeout,m_uiSoftTimeoutUs,this);
+			}
+			if (value) // Was off, start at full, we'll update rate later.
+			{
 				if (m_cntTOn>m_cntSoftPWM)
 				{
-					uint32_t uiTTotal = m_pAVR->cycle - m_cntSoftPWM;
-					OnWaveformChange(m_cntTOn-m_cntSoftPWM,uiTTotal);
+					uint32_t uiTOn = m_cntTOn-m_cntSoftPWM, uiTTotal = m_pAVR->cycle - m_cntSoftPWM;
+					if (IsBeyond(uiTOn, m_uiLastTOn) || IsBeyond(uiTTotal, m_uiLastTTotal))
+					{
+						m_uiLastTOn = uiTOn;
+						m_uiLastTTotal = uiTTotal;
+						OnWaveformChange(uiTOn,uiTTotal);
+					}
 				}
 				m_cntSoftPWM = m_pAVR->cycle;
 			}
@@ -67,9 +80,13 @@ class SoftPWMable : public BasePeripheral
 				uint64_t uiCycleDelta = m_pAVR->cycle - m_cntSoftPWM;
 				//TRACE(printf("New soft PWM delta: %d\n",uiCycleDelta/1000));
 				uint16_t uiSoftPWM = ((uiCycleDelta/m_uiPrescale)-1); //62.5 Hz means full on is ~256k cycles.
-				OnPWMChange(irq,uiSoftPWM);
+				if (!m_bPWMValid || (uiSoftPWM > m_uiLastPWM ? uiSoftPWM - m_uiLastPWM : m_uiLastPWM - uiSoftPWM) > m_uiPWMThreshold)
+				{
+					m_bPWMValid = true;
+					m_uiLastPWM = uiSoftPWM;
+					OnPWMChange(irq,uiSoftPWM);
+				}
 				m_cntTOn = m_pAVR->cycle;
-				RegisterTimerUsec(m_fcnSoftTimeout,m_uiSoftTimeoutUs,this);
 			}
 		}
 
@@ -77,21 +94,40 @@ class SoftPWMable : public BasePeripheral
 		template<class C>
 		avr_cycle_count_t OnSoftPWMChangeTimeout(avr_t *avr, avr_cycle_count_t when)
 		{
+			avr_cycle_count_t uiTimeout = avr_usec_to_cycles(avr, m_uiSoftTimeoutUs);
+			if (when - m_cntLastEdge < uiTimeout)
+				return m_cntLastEdge + uiTimeout; // Still toggling.
 			//printf("Timeout\n");
+			m_bTimeoutArmed = false;
+			m_bPWMValid = false;
+			m_uiLastTOn = m_uiLastTTotal = 0;
 			OnPWMChange(GetIRQ(C::DIGITAL_IN), (GetIRQ(C::DIGITAL_IN)->value)*255);
 			OnWaveformChange(0,0);
 			m_cntTOn = 0;
 			return 0;
 		}
 
+		// Soft PWM values within this many counts of the last one reported are not passed on.
+		inline void SetSoftPWMThreshold(uint16_t uiCounts) { m_uiPWMThreshold = uiCounts; }
+
 	private:
 
+		// Waveform timings are only passed on when they move more than 1/64th.
+		static inline bool IsBeyond(uint32_t uiNew, uint32_t uiOld)
+		{
+			uint32_t uiDiff = uiNew > uiOld ? uiNew - uiOld : uiOld - uiNew;
+			return (static_cast<uint64_t>(uiDiff)<<6) > uiOld;
+		}
+
 		uint32_t m_uiSoftTimeoutUs = 17 *1000; // 62.5 Hz = 16ms period max...
 
 		bool m_bIsSoftPWM = false;
 
 		uint16_t m_uiPrescale = 1000;
-		avr_cycle_count_t m_cntSoftPWM = 0, m_cntTOn = 0;
+		avr_cycle_count_t m_cntSoftPWM = 0, m_cntTOn = 0, m_cntLastEdge = 0;
 		avr_cycle_timer_t m_fcnSoftTimeout;
+		bool m_bTimeoutArmed = false, m_bPWMValid = false;
+		uint16_t m_uiLastPWM = 0, m_uiPWMThreshold = 1;
+		uint32_t m_uiLastTOn = 0, m_uiLastTTotal = 0;
 
 };
@@ -21,13 +21,79 @@
 
 #include "TelemetryHost.h"
 #include <algorithm>       // for find
+#include <utility>         // for move
+#include "Log.h"           // for LOG, Log
+#include "ScriptHost.h"    // for ScriptHost
+#include "sim_time.h"      // for avr_usec_to_cycles
 #include "sim_vcd_file.h"  // for avr_vcd_add_signal
 
 
+// Ahead of m_pHost, it is made (and may look these up) during static initialization too.
+const map<string,TelemetryHost::WaitOp> TelemetryHost::m_mStr2Op = {
+	make_pair("==",WaitOp::Equal),
+	make_pair("!=",WaitOp::NotEqual),
+	make_pair(">",WaitOp::Greater),
+	make_pair("<",WaitOp::Less),
+	make_pair(">=",WaitOp::GreaterEq),
+	make_pair("<=",WaitOp::LessEq),
+	make_pair("&",WaitOp::AnyBits),
+};
+
+#define _TC(x,y) make_pair(y,TC::x)
+const map<string,TC> TelemetryHost::m_mStr2Cat = {
+	TCENTRIES
+};
+#undef _TC
+#define _TC(x,y) make_pair(TC::x,y)
+const map<TC,string> TelemetryHost::m_mCat2Str = {
+	TCENTRIES
+};
+#undef _TC
+
 TelemetryHost* TelemetryHost::m_pHost = new TelemetryHost();
+thread_local TelemetryHost* TelemetryHost::m_pCurrent = nullptr;
+vector<unique_ptr<TelemetryHost>> TelemetryHost::m_vHosts;
+
+static Log::Module logTelemetry("Telemetry");
+
+TelemetryHost* TelemetryHost::CreateHost()
+{
+	TelemetryHost *pNew = new TelemetryHost();
+	pNew->m_VLoglst = m_pHost->m_VLoglst;
+	pNew->m_vsNames = m_pHost->m_vsNames;
+	pNew->m_eFormat = m_pHost->m_eFormat;
+	pNew->m_uiChunkSeconds = m_pHost->m_uiChunkSeconds;
+	pNew->m_bPerf = m_pHost->m_bPerf;
+	pNew->m_uiPerfIntervalMs = m_pHost->m_uiPerfIntervalMs;
+	pNew->m_uiFlightSeconds = m_pHost->m_uiFlightSeconds;
+	pNew->m_vsStatNames = m_pHost->m_vsStatNames;
+	m_vHosts.emplace_back(pNew);
+	return pNew;
+}
+
+#ifndef MK404_NO_TELEMETRY
+#define _TC(x,y) TC::x
+static constexpr TelCategory TelAllCats[] = {TCENTRIES};
+#undef _TC
+// Packed four bits each, 0 for none, so there's only room for 15.
+static_assert(sizeof(TelAllCats)/sizeof(TelAllCats[0]) <= 15, "Too many TelCategory entries to pack in 4 bits");
+
+static uint64_t PackCats(TelCats vCats)
+{
+	uint64_t uiCats = 0;
+	for (unsigned int i=0; i<vCats.size() && i<16; i++)
+		uiCats |= (static_cast<uint64_t>(vCats[i]) + 1U) << (4U*i);
+	return uiCats;
+}
 
 void TelemetryHost::AddTrace(avr_irq_t *pIRQ, string strName, TelCats vCats, uint8_t uiBits)
 {
+	// Nothing asked for, which is most runs: just note it down.
+	if (m_VLoglst.empty() && m_vsNames.empty() && m_vsStatNames.empty() && !m_uiFlightSeconds && !m_bPerf)
+	{
+		m_vPending.push_back({pIRQ, std::move(strName), PackCats(vCats), false});
+		return;
+	}
 	bool bShouldAdd = false;
 	// Check categories.
 	for (auto it = vCats.begin(); it!=vCats.end(); it++)
@@ -37,8 +103,13 @@ void TelemetryHost::AddTrace(avr_irq_t *pIRQ, string strName, TelCats vCats, uin
 			break;
 		}
 
-	strName+= "_";
-	strName.append(pIRQ->name);
+	// The full name is only needed now if something is traced.
+	bool bFullName = bShouldAdd || !m_vsNames.empty() || !m_vsStatNames.empty() || m_uiFlightSeconds || m_bPerf;
+	if (bFullName)
+	{
+		strName+= "_";
+		strName.append(pIRQ->name);
+	}
 	// Check explicit names
 	for (auto it = m_vsNames.begin(); it!=m_vsNames.end(); it++)
 		if (strName.rfind(it[0],0)==0)
@@ -50,22 +121,150 @@ void TelemetryHost::AddTrace(avr_irq_t *pIRQ, string strName, TelCats vCats, uin
 
 	if (bShouldAdd)
 	{
-		printf("Telemetry: Added trace %s\n",strName.c_str());
-		avr_vcd_add_signal(&m_trace, pIRQ, uiBits, strName.c_str());
+		LOG(logTelemetry, Info, "Telemetry: Added trace %s",strName.c_str());
+		if (m_eFormat != TraceFormat::Sampled)
+			m_binTrace.AddSignal(pIRQ, uiBits, strName);
+		else
+			avr_vcd_add_signal(&m_trace, pIRQ, uiBits, strName.c_str());
+	}
+	for (auto &strStat : m_vsStatNames)
+		if (strName.rfind(strStat,0)==0)
+		{
+			AddStat(pIRQ, strName);
+			break;
+		}
+	if (!m_uiFlightSeconds && !m_bPerf)
+	{
+		m_vPending.push_back({pIRQ, std::move(strName), PackCats(vCats), bFullName});
+		return;
 	}
-	if (!m_mIRQs.count(strName))
+	auto itNew = m_mIRQs.emplace(strName, pIRQ);
+	if (itNew.second)
 	{
-		m_mIRQs[strName] = pIRQ;
-		m_mCatsByName[strName] = vCats;
+		const string *pName = &itNew.first->first;
+		m_mCatsByName[pName] = vCats;
 		for(auto it = vCats.begin(); it!=vCats.end(); it++)
-			m_mNamesByCat[*it].push_back(strName);
+			m_mNamesByCat[*it].push_back(pName);
+		if (m_uiFlightSeconds) // Everything, whatever the categories.
+			m_flight.AddSignal(pIRQ, uiBits, strName);
+		if (m_bPerf) // Map nodes don't move, so the counter itself can be the param.
+			avr_irq_register_notify(pIRQ, [](avr_irq_t *irq, uint32_t value, void *param){ (*static_cast<uint64_t*>(param))++; }, &m_mIRQCounts[strName]);
 	}
 	else
 		fprintf(stderr, "ERROR: Trying to add the same IRQ (%s) to a VCD trace multiple times!\n",strName.c_str());
 }
 
+void TelemetryHost::AddStat(avr_irq_t *pIRQ, const string &strName)
+{
+	if (m_mStats.count(strName))
+		return; // The same IRQ again, which is reported below.
+	Stat_t &stat = m_mStats[strName];
+	stat.pAVR = m_pAVR;
+	stat.uiValue = stat.uiMin = stat.uiMax = pIRQ->value;
+	stat.uiStart = stat.uiLast = m_pAVR ? m_pAVR->cycle : 0;
+	MetricLabels vLabels {{"signal", strName}};
+	stat.mtrMin.Register("mk404_signal_min", "Lowest raw value of a --tel-stats signal.", vLabels);
+	stat.mtrMax.Register("mk404_signal_max", "Highest raw value of a --tel-stats signal.", vLabels);
+	stat.mtrMean.Register("mk404_signal_mean", "Time-weighted mean raw value of a --tel-stats signal.", vLabels);
+	stat.mtrNonzero.Register("mk404_signal_nonzero_ratio", "Fraction of AVR time a --tel-stats signal was nonzero.", vLabels);
+	stat.mtrChanges.Register("mk404_signal_changes_total", "Value changes of a --tel-stats signal.", vLabels);
+	auto fcnNotify = [](avr_irq_t *irq, uint32_t value, void *param)
+	{
+		Stat_t *p = static_cast<Stat_t*>(param);
+		if (value == p->uiValue)
+			return;
+		std::lock_guard<std::mutex> lock(p->lock);
+		p->Fold(p->pAVR->cycle);
+		p->uiChanges++;
+		if (p->uiValue == 0)
+			p->uiRises++;
+		p->uiValue = value;
+		if (value < p->uiMin)
+			p->uiMin = value;
+		if (value > p->uiMax)
+			p->uiMax = value;
+	};
+	avr_irq_register_notify(pIRQ, fcnNotify, &stat);
+	LOG(logTelemetry, Info, "Telemetry: Keeping statistics of %s",strName.c_str());
+}
+
+void TelemetryHost::IndexTraces()
+{
+	lock_guard<mutex> lock(m_lockIndex);
+	for (auto &trace : m_vPending)
+	{
+		if (!trace.bFullName)
+		{
+			trace.strName+= "_";
+			trace.strName.append(trace.pIRQ->name);
+		}
+		auto itNew = m_mIRQs.emplace(std::move(trace.strName), trace.pIRQ);
+		if (!itNew.second)
+		{
+			fprintf(stderr, "ERROR: Trying to add the same IRQ (%s) to a VCD trace multiple times!\n",itNew.first->first.c_str());
+			continue;
+		}
+		const string *pName = &itNew.first->first;
+		vector<TC> &vCats = m_mCatsByName[pName];
+		for (uint64_t uiCats = trace.uiCats; uiCats; uiCats >>= 4U)
+		{
+			vCats.push_back(static_cast<TC>((uiCats & 0xFU) - 1U));
+			m_mNamesByCat[vCats.back()].push_back(pName);
+		}
+	}
+	m_vPending.clear();
+}
+#else
+void TelemetryHost::IndexTraces()
+{
+}
+#endif
+
+TelemetryHost::Waiter_t* TelemetryHost::ArmWaiter(const string &strName, WaitOp eOp, uint32_t uiVal, uint32_t uiMask)
+{
+	IndexTraces();
+	auto itIRQ = m_mIRQs.find(strName);
+	if (itIRQ == m_mIRQs.end())
+		return nullptr;
+	avr_irq_t *pIRQ = itIRQ->second;
+	Waiter_t *pWaiter = nullptr;
+	// Reuse an idle waiter on the same IRQ, its notify hook is already in place.
+	for (auto &p : m_vWaiters)
+		if (!p->bArmed && p->pIRQ == pIRQ)
+		{
+			pWaiter = p.get();
+			break;
+		}
+	if (pWaiter == nullptr)
+	{
+		pWaiter = new Waiter_t();
+		pWaiter->pIRQ = pIRQ;
+		m_vWaiters.emplace_back(pWaiter);
+		auto fcnNotify = [](avr_irq_t *irq, uint32_t value, void *param)
+		{
+			Waiter_t *p = static_cast<Waiter_t*>(param);
+			if (p->bArmed && p->Test(value))
+			{
+				p->bMatched = true;
+				ScriptHost::Notify();
+			}
+		};
+		avr_irq_register_notify(pIRQ, fcnNotify, pWaiter);
+	}
+	pWaiter->eOp = eOp;
+	pWaiter->uiVal = uiVal;
+	pWaiter->uiMask = uiMask;
+	pWaiter->bMatched = pWaiter->Test(pIRQ->value); // It may already be satisfied.
+	pWaiter->bArmed = true;
+	return pWaiter;
+}
+
 void TelemetryHost::SetCategories(const vector<string> &vsCats)
 {
+#ifdef MK404_NO_TELEMETRY
+	if (!vsCats.empty())
+		fprintf(stderr, "WARNING: This build has no telemetry (TELEMETRY=OFF), -t/--trace records nothing.\n");
+#endif
 	for (auto it = vsCats.begin(); it!=vsCats.end(); it++)
 	{
 		if (!m_mStr2Cat.count(it[0]))
@@ -75,29 +274,56 @@ void TelemetryHost::SetCategories(const vector<string> &vsCats)
 	}
 }
 
+void TelemetryHost::SetStats(const vector<string> &vsNames)
+{
+#ifdef MK404_NO_TELEMETRY
+	if (!vsNames.empty())
+		fprintf(stderr, "WARNING: This build has no telemetry (TELEMETRY=OFF), --tel-stats records nothing.\n");
+#endif
+	m_vsStatNames = vsNames;
+}
+
 Scriptable::LineStatus TelemetryHost::ProcessAction(unsigned int iAct, const vector<string> &vArgs)
 {
 	switch (iAct)
 	{
 		case ActWaitFor:
+		case ActWaitForCmp:
+		case ActWaitForMask:
 		{
-			if (m_pCurrentIRQ == nullptr)
+			if (m_pWaiter != nullptr && m_vWaitArgs != vArgs) // Stale, e.g. from a timed out line.
 			{
-				if (!m_mIRQs.count(vArgs.at(0)))
-					return IssueLineError("Asked to wait for telemetry " + vArgs.at(0) + " but it was not found");
-				else
+				ReleaseWaiter(m_pWaiter);
+				m_pWaiter = nullptr;
+			}
+			if (m_pWaiter == nullptr)
+			{
+				WaitOp eOp = WaitOp::Equal;
+				uint32_t uiVal = stoul(vArgs.back()), uiMask = 0xFFFFFFFF;
+				if (iAct == ActWaitForCmp)
 				{
-					m_pCurrentIRQ = m_mIRQs[vArgs.at(0)];
-					m_uiMatchVal = stoul(vArgs.at(1));
+					if (!m_mStr2Op.count(vArgs.at(1)))
+						return IssueLineError("Unknown comparison operator " + vArgs.at(1));
+					eOp = m_mStr2Op.at(vArgs.at(1));
 				}
+				else if (iAct == ActWaitForMask)
+				{
+					eOp = WaitOp::Mask;
+					uiMask = stoul(vArgs.at(1));
+				}
+				m_pWaiter = ArmWaiter(vArgs.at(0), eOp, uiVal, uiMask);
+				if (m_pWaiter == nullptr)
+					return IssueLineError("Asked to wait for telemetry " + vArgs.at(0) + " but it was not found");
+				m_vWaitArgs = vArgs;
 			}
-			if (m_pCurrentIRQ->value == m_uiMatchVal)
+			if (m_pWaiter->bMatched)
 			{
-				m_pCurrentIRQ = nullptr;
+				ReleaseWaiter(m_pWaiter);
+				m_pWaiter = nullptr;
 				return LineStatus::Finished;
 			}
-			else
-				return LineStatus::Waiting;
+			ScriptHost::WakeOnNotify();
+			return LineStatus::Waiting;
 		}
 		case ActStartTrace:
 		{
@@ -107,14 +333,46 @@ Scriptable::LineStatus TelemetryHost::ProcessAction(unsigned int iAct, const vec
 		case ActStopTrace:
 			StopTrace();
 			return LineStatus::Finished;
+		case ActPrintPerf:
+			PrintPerf(stdout, m_pfStart, GetPerfFrame(), false);
+			return LineStatus::Finished;
+		case ActPrintPerfJSON:
+			PrintPerf(stdout, m_pfStart, GetPerfFrame(), true);
+			fflush(stdout);
+			return LineStatus::Finished;
+		case ActDumpFlight:
+			if (!m_flight.IsEnabled())
+				return IssueLineError("The flight recorder is off, enable it with --flight-recorder");
+			DumpFlightRecorder("TelHost::DumpFlightRecorder");
+			return LineStatus::Finished;
+		case ActPrintStats:
+		case ActPrintStatsJSON:
+			if (m_mStats.empty())
+				return IssueLineError("No signal statistics are being kept, select some with --tel-stats");
+			PrintStats(stdout, iAct == ActPrintStatsJSON);
+			fflush(stdout);
+			return LineStatus::Finished;
+		case ActResetStats:
+			ResetStats();
+			return LineStatus::Finished;
 		default:
 			return LineStatus::Unhandled;
 	}
 }
 
 
+void TelemetryHost::DumpFlightRecorder(const string &strWhy)
+{
+	if (!m_flight.IsEnabled())
+		return;
+	string strFile = m_strFlightFile;
+	strFile.replace(strFile.rfind('.'), string::npos, "_flight" + to_string(++m_uiFlightDumps) + ".vcd");
+	m_flight.Dump(strFile, strWhy);
+}
+
 void TelemetryHost::PrintTelemetry(bool bMarkdown)
 {
+	IndexTraces();
 	printf("%sAvaliable telemetry streams:\n",bMarkdown?"## ":"");
 	if (bMarkdown)
 	{
@@ -134,15 +392,133 @@ void TelemetryHost::PrintTelemetry(bool bMarkdown)
 			strCats += " `" + m_mCat2Str.at(*it2) + "`";
 
 		if (bMarkdown)
-			printf("%s%s\n",it->first.c_str(),strCats.c_str());
+			printf("%s%s\n",it->first->c_str(),strCats.c_str());
 		else
-			printf("\t%-40s%s\n",it->first.c_str(),strCats.c_str());
+			printf("\t%-40s%s\n",it->first->c_str(),strCats.c_str());
 	}
 	printf("%sBy category\n",bMarkdown?"### ":"\t");
 	for (auto it = m_mNamesByCat.begin(); it!=m_mNamesByCat.end(); it++)
 	{
 		printf("%s%s\n",bMarkdown?"#### ":"\t\t",m_mCat2Str.at(it->first).c_str());
 		for (auto it2 = it->second.begin(); it2!=it->second.end(); it2++)
-			printf("%s%s\n", bMarkdown?" - ":"\t\t\t",it2->c_str());
+			printf("%s%s\n", bMarkdown?" - ":"\t\t\t",(*it2)->c_str());
+	}
+}
+
+TelemetryHost::PerfFrame_t TelemetryHost::GetPerfFrame()
+{
+	PerfFrame_t frame;
+	frame.tp = chrono::steady_clock::now();
+	frame.uiCycle = m_pAVR ? m_pAVR->cycle : 0;
+	frame.uiInstr = m_uiInstrCount;
+	frame.uiTimers = BasePeripheral::GetTimerCount();
+	frame.mIRQs = m_mIRQCounts;
+	return frame;
+}
+
+avr_cycle_count_t TelemetryHost::OnPerfTimer(avr_t *pAVR, avr_cycle_count_t when)
+{
+	if (chrono::steady_clock::now() - m_pfLast.tp >= chrono::milliseconds(m_uiPerfIntervalMs))
+	{
+		PerfFrame_t pfNow = GetPerfFrame();
+		PrintPerf(stderr, m_pfLast, pfNow, true);
+		m_pfLast = pfNow;
+	}
+	return when + avr_usec_to_cycles(pAVR, 10000);
+}
+
+void TelemetryHost::PrintPerf(FILE *pOut, const PerfFrame_t &from, const PerfFrame_t &to, bool bJSON)
+{
+	double dSec = chrono::duration<double>(to.tp - from.tp).count();
+	if (dSec <= 0)
+		return;
+	double dCycles = (to.uiCycle - from.uiCycle)/dSec;
+	double dInstr = (to.uiInstr - from.uiInstr)/dSec;
+	double dTimers = (to.uiTimers - from.uiTimers)/dSec;
+	double dRT = m_pAVR ? dCycles/m_pAVR->frequency : 0;
+	if (bJSON)
+		fprintf(pOut, "{\"wall_s\":%.3f,\"cycles\":%llu,\"cycles_per_s\":%.0f,\"instr_per_s\":%.0f,\"realtime\":%.3f,\"timers_per_s\":%.0f,\"irqs_per_s\":{",
+			dSec, static_cast<unsigned long long>(to.uiCycle - from.uiCycle), dCycles, dInstr, dRT, dTimers);
+	else
+		fprintf(pOut, "Perf over %.1fs: %.0f cycles/s, %.0f instr/s, %.3fx realtime, %.0f timer registrations/s\n",
+			dSec, dCycles, dInstr, dRT, dTimers);
+	bool bFirst = true;
+	for (auto it = to.mIRQs.begin(); it!=to.mIRQs.end(); it++)
+	{
+		uint64_t uiPrev = from.mIRQs.count(it->first) ? from.mIRQs.at(it->first) : 0;
+		if (it->second == uiPrev)
+			continue; // Skip the quiet ones.
+		double dRate = (it->second - uiPrev)/dSec;
+		if (bJSON)
+			fprintf(pOut, "%s\"%s\":%.0f", bFirst?"":",", it->first.c_str(), dRate);
+		else
+			fprintf(pOut, "\t%-40s%.0f/s\n", it->first.c_str(), dRate);
+		bFirst = false;
+	}
+	if (bJSON)
+		fprintf(pOut, "}}\n");
+}
+
+void TelemetryHost::ArmStats(avr_t *pAVR)
+{
+	if (pAVR && !m_vsStatNames.empty() && !avr_cycle_timer_status(pAVR, m_fcnStats, this))
+		avr_cycle_timer_register_usec(pAVR, 100000, m_fcnStats, this);
+}
+
+avr_cycle_count_t TelemetryHost::OnStatsTimer(avr_t *pAVR, avr_cycle_count_t when)
+{
+	for (auto &it : m_mStats)
+	{
+		Stat_t &stat = it.second;
+		if (stat.pAVR != pAVR)
+			continue; // Another board's, its own timer does those.
+		std::lock_guard<std::mutex> lock(stat.lock);
+		stat.Fold(pAVR->cycle);
+		stat.mtrMin.Set(stat.uiMin);
+		stat.mtrMax.Set(stat.uiMax);
+		stat.mtrMean.Set(stat.GetMean());
+		stat.mtrNonzero.Set(stat.GetNonzero());
+		stat.mtrChanges.Set(stat.uiChanges);
+	}
+	return when + avr_usec_to_cycles(pAVR, 100000);
+}
+
+void TelemetryHost::ResetStats()
+{
+	for (auto &it : m_mStats)
+	{
+		Stat_t &stat = it.second;
+		std::lock_guard<std::mutex> lock(stat.lock);
+		avr_cycle_count_t uiNow = stat.pAVR ? stat.pAVR->cycle : 0;
+		stat.uiMin = stat.uiMax = stat.uiValue;
+		stat.uiChanges = stat.uiRises = stat.uiNonzero = 0;
+		stat.uiStart = stat.uiLast = uiNow;
+		stat.dSum = 0;
+	}
+}
+
+void TelemetryHost::PrintStats(FILE *pOut, bool bJSON)
+{
+	if (bJSON)
+		fprintf(pOut, "{\"stats\":{");
+	else
+		fprintf(pOut, "Signal statistics (raw values):\n\t%-40s%10s%10s%10s%12s%10s%10s%9s\n", "", "seconds", "min", "max", "mean", "changes", "rises", "nonzero");
+	bool bFirst = true;
+	for (auto &it : m_mStats)
+	{
+		Stat_t &stat = it.second;
+		std::lock_guard<std::mutex> lock(stat.lock);
+		stat.Fold(stat.pAVR ? stat.pAVR->cycle : stat.uiLast);
+		double dSec = (stat.uiLast - stat.uiStart)/(stat.pAVR && stat.pAVR->frequency ? stat.pAVR->frequency : 1.0);
+		if (bJSON)
+			fprintf(pOut, "%s\"%s\":{\"seconds\":%.3f,\"min\":%u,\"max\":%u,\"mean\":%.3f,\"changes\":%llu,\"rises\":%llu,\"nonzero\":%.4f}",
+				bFirst?"":",", it.first.c_str(), dSec, stat.uiMin, stat.uiMax, stat.GetMean(),
+				static_cast<unsigned long long>(stat.uiChanges), static_cast<unsigned long long>(stat.uiRises), stat.GetNonzero());
+		else
+			fprintf(pOut, "\t%-40s%10.3f%10u%10u%12.3f%10llu%10llu%8.2f%%\n", it.first.c_str(), dSec, stat.uiMin, stat.uiMax, stat.GetMean(),
+				static_cast<unsigned long long>(stat.uiChanges), static_cast<unsigned long long>(stat.uiRises), 100.0*stat.GetNonzero());
+		bFirst = false;
 	}
+	if (bJSON)
+		fprintf(pOut, "}}\n");
 }
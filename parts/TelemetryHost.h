@@ -21,19 +21,29 @@
 
 #pragma once
 
-#include <stdint.h>          // for uint32_t, uint8_t
+#include <stdint.h>          // for uint32_t, uint8_t, uint64_t
 #include <stdio.h>           // for fprintf, printf, stderr
 #include <stdlib.h>          // for exit
 #include <string.h>          // for memset
+#include <chrono>            // for steady_clock
+#include <initializer_list>  // for initializer_list
+#include <atomic>            // for atomic_bool
 #include <map>               // for map
+#include <memory>            // for unique_ptr
+#include <mutex>             // for mutex, lock_guard
 #include <string>            // for string
 #include <type_traits>       // for __decay_and_strip<>::__type
 #include <utility>           // for make_pair, pair
 #include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
+#include "FlightRecorder.h"  // for FlightRecorder
 #include "IScriptable.h"     // for ArgType, ArgType::Int, ArgType::String
+#include "Metrics.h"         // for Metric
 #include "Scriptable.h"      // for Scriptable
+#include "TraceWriter.h"     // for TraceWriter
 #include "sim_avr.h"         // for avr_t
+#include "sim_avr_types.h"   // for avr_cycle_count_t
+#include "sim_cycle_timers.h" // for avr_cycle_timer_t
 #include "sim_irq.h"         // for avr_irq_t
 #include "sim_vcd_file.h"    // for avr_vcd_init, avr_vcd_start, avr_vcd_stop
 
@@ -84,8 +94,11 @@ class TelemetryHost: public BasePeripheral, public Scriptable
 		const char *_IRQNAMES[IRQ::COUNT] = {
 		};
 
+		// Returns the host selected for the calling thread, or the default one if none was.
 		inline static TelemetryHost* GetHost()
 		{
+			if (m_pCurrent)
+				return m_pCurrent;
 			if (m_pHost == nullptr)
 			{
 				printf("TelemetryHost::Init\n");
@@ -93,27 +106,119 @@ class TelemetryHost: public BasePeripheral, public Scriptable
 			return m_pHost;
 		}
 
+		// Creates an additional host for another printer instance, with the same
+		// categories, trace format and perf settings as the default one.
+		// Its scriptable actions are registered with the current ScriptHost.
+		static TelemetryHost* CreateHost();
+
+		// Selects the host used by the calling thread. nullptr reverts to the default host.
+		inline static void SetHost(TelemetryHost *pHost) { m_pCurrent = pHost; }
+
 		// Inits the VCD file at the specified rate (in us)
 		void Init(avr_t *pAVR, const string &strVCDFile, uint32_t uiRateUs = 100)
 		{
+			if (m_pAVR && m_bPerf) // Re-init by a later board, move the perf timer over.
+				CancelTimer(m_fcnPerf,this);
 			_Init(pAVR, this);
-			avr_vcd_init(m_pAVR,strVCDFile.c_str(),&m_trace,uiRateUs);
+			if (m_uiFlightSeconds)
+			{
+				m_flight.Init(m_pAVR, m_uiFlightSeconds);
+				if (m_strFlightFile.empty()) // Named after the first board's.
+					m_strFlightFile = strVCDFile;
+			}
+			m_binTrace.SetChunkSeconds(m_uiChunkSeconds);
+			if (m_eFormat == TraceFormat::Binary)
+			{
+				string strFile = strVCDFile;
+				strFile.replace(strFile.rfind('.'), string::npos, ".trace");
+				m_binTrace.Init(m_pAVR, strFile);
+			}
+			else if (m_eFormat == TraceFormat::Events)
+				m_binTrace.Init(m_pAVR, strVCDFile, true);
+			else
+				avr_vcd_init(m_pAVR,strVCDFile.c_str(),&m_trace,uiRateUs);
+			if (m_bPerf)
+			{
+				m_pfStart = m_pfLast = GetPerfFrame();
+				if (m_uiPerfIntervalMs)
+					RegisterTimerUsec(m_fcnPerf,10000,this);
+			}
+			ArmStats(m_pAVR); // Each board's own, the earlier ones keep theirs.
 		}
 
+		// A reset drops the AVR's cycle timers, puts the statistics timer back on it. On its thread.
+		inline void OnAVRReset(avr_t *pAVR) { ArmStats(pAVR); }
+
+		// Enables the performance counters, including per-IRQ raise counts for all registered telemetry.
+		// Must be called before any AddTrace() calls. If uiIntervalMs is nonzero the counters
+		// are dumped to stderr as JSON at that (wall-clock) interval.
+		inline void SetPerfStats(uint32_t uiIntervalMs)
+		{
+			m_bPerf = true;
+			m_uiPerfIntervalMs = uiIntervalMs;
+		}
+
+		// Keeps the last uiSeconds (AVR time) of every registered trace in memory, see FlightRecorder.
+		// Must be called before Init() and any AddTrace() calls.
+		inline void SetFlightRecorder(uint32_t uiSeconds) { m_uiFlightSeconds = uiSeconds; }
+
+		// Writes the flight recorder out (if enabled) to a new <trace name>_flight<N>.vcd. strWhy goes in the file.
+		void DumpFlightRecorder(const string &strWhy);
+
+		// Keeps running statistics (min, max, time-weighted mean, changes, rises and time spent nonzero)
+		// of every trace whose name starts with one of vsNames, without a trace file. They are printed
+		// at Shutdown() and exported as mk404_signal_* metrics. Must be set before any AddTrace() calls.
+		void SetStats(const vector<string> &vsNames);
+
+		// Prints the statistics since they were attached (or last reset), human readable or as a single line of JSON.
+		void PrintStats(FILE *pOut, bool bJSON);
+
+		// Called by the primary board with the number of instructions it just ran.
+		inline void AddInstructions(uint32_t uiCount) { m_uiInstrCount += uiCount; }
+
 		inline void StartTrace()
 		{
-			avr_vcd_start(&m_trace);
+			if (m_eFormat != TraceFormat::Sampled)
+				m_binTrace.Start();
+			else
+				avr_vcd_start(&m_trace);
 		}
 
 		inline void StopTrace()
 		{
-			avr_vcd_stop(&m_trace);
+			if (m_eFormat != TraceFormat::Sampled)
+				m_binTrace.Stop();
+			else
+				avr_vcd_stop(&m_trace);
 		}
 
+		enum class TraceFormat
+		{
+			Sampled,	// SimAVR's VCD, flushed at the trace rate.
+			Events,		// VCD, every change logged at its exact cycle.
+			Binary		// Every change at its exact cycle, compact binary. See TraceWriter.
+		};
+
+		// Selects the trace format. Must be set before Init()
+		// Use TraceWriter::ConvertToVCD (--convert-trace) to view binary traces.
+		inline void SetTraceFormat(TraceFormat eFmt) { m_eFormat = eFmt; }
+
+		// Cuts Events/Binary traces into gzipped chunks of uiSeconds (AVR time) with an index, see TraceWriter.
+		// Must be set before Init()
+		inline void SetTraceChunks(uint32_t uiSeconds) { m_uiChunkSeconds = uiSeconds; }
+
 		void PrintTelemetry(bool bMarkdown = false);
 
 		void SetCategories(const vector<string> &vsCats);
 
+#ifdef MK404_NO_TELEMETRY
+		// Built with -DTELEMETRY=OFF: nothing is registered, so there is nothing to trace, wait on or count.
+		// The braced category lists bind to the initializer_list, so the calls compile down to nothing.
+		template<class C>
+		inline void AddTrace(C*, unsigned int, initializer_list<TC>, uint8_t = 1) {}
+		template<class N>
+		inline void AddTrace(avr_irq_t*, const N&, initializer_list<TC>, uint8_t = 1) {}
+#else
 		// Convenience wrapper for scriptable BasePeripherals
 		template<class C>
 		inline void AddTrace(C* p, unsigned int eIRQ, TelCats vCats, uint8_t uiBits = 1)
@@ -121,65 +226,213 @@ class TelemetryHost: public BasePeripheral, public Scriptable
 			AddTrace(p->GetIRQ(eIRQ),p->GetName(), vCats, uiBits);
 		}
 
+		void AddTrace(avr_irq_t *pIRQ, string strName, TelCats vCats, uint8_t uiBits = 1);
+#endif
+
 		LineStatus ProcessAction(unsigned int iAct, const vector<string> &vArgs) override;
 
-		void AddTrace(avr_irq_t *pIRQ, string strName, TelCats vCats, uint8_t uiBits = 1);
+		enum class WaitOp
+		{
+			Equal,
+			NotEqual,
+			Greater,
+			Less,
+			GreaterEq,
+			LessEq,
+			AnyBits,	// value & arg != 0
+			Mask		// value & mask == arg
+		};
+
+		// A waiter latches as soon as its IRQ sees a matching value, so pulses
+		// shorter than a script poll are not missed.
+		typedef struct Waiter_t
+		{
+			avr_irq_t *pIRQ = nullptr;
+			WaitOp eOp = WaitOp::Equal;
+			uint32_t uiVal = 0, uiMask = 0xFFFFFFFF;
+			bool bArmed = false;
+			atomic_bool bMatched {false};
+
+			inline bool Test(uint32_t uiIn) const
+			{
+				switch (eOp)
+				{
+					case WaitOp::Equal: 	return uiIn == uiVal;
+					case WaitOp::NotEqual: 	return uiIn != uiVal;
+					case WaitOp::Greater: 	return uiIn > uiVal;
+					case WaitOp::Less:		return uiIn < uiVal;
+					case WaitOp::GreaterEq: return uiIn >= uiVal;
+					case WaitOp::LessEq:	return uiIn <= uiVal;
+					case WaitOp::AnyBits:	return (uiIn & uiVal) != 0;
+					case WaitOp::Mask:		return (uiIn & uiMask) == uiVal;
+				}
+				return false;
+			}
+		} Waiter_t;
+
+		// Arms a notify-driven waiter on the named telemetry. Any number may be armed at once.
+		// Returns nullptr if the name is not found. Poll Waiter_t::bMatched, then release it.
+		Waiter_t* ArmWaiter(const string &strName, WaitOp eOp, uint32_t uiVal, uint32_t uiMask = 0xFFFFFFFF);
+
+		inline void ReleaseWaiter(Waiter_t *pWaiter) { pWaiter->bArmed = false; }
+
+		// Everything registered with AddTrace, by name. Fixed once the printer is set up.
+		inline const map<string, avr_irq_t*>& GetTraces() { IndexTraces(); return m_mIRQs; }
 
 		void Shutdown()
 		{
 			StopTrace();
+			if (!m_mStats.empty())
+				PrintStats(stdout, false);
 		}
 
 	private:
 		TelemetryHost():Scriptable("TelHost")
 		{
-			if (m_pHost !=nullptr)
-			{
-				fprintf(stderr, "ERROR - duplicate initialization of telemetry host!\n");
-				exit(1);
-			}
 			memset(&m_trace, 0, sizeof(m_trace));
 #ifdef __CYGWIN__
             printf("Cygwin detected - skipping TelHost action registration...\n");
 #else
             // Sorry, this segfaults on win32 for some reason...
 			RegisterAction("WaitFor","Waits for a specified telemetry value to occur",ActWaitFor, {ArgType::String,ArgType::Int});
+			RegisterAction("WaitForCmp","Waits for a telemetry value to satisfy a comparison. Operators: == != > < >= <= & (any of the bits set)",ActWaitForCmp, {ArgType::String,ArgType::String,ArgType::Int});
+			RegisterAction("WaitForMask","Waits for (telemetry value & mask) to equal the given value. Args: name, mask, value",ActWaitForMask, {ArgType::String,ArgType::Int,ArgType::Int});
 			RegisterActionAndMenu("StartTrace", "Starts the telemetry trace. You must have set a category or set of items with the -t option",ActStartTrace);
 			RegisterActionAndMenu("StopTrace", "Stops a running telemetry trace.",ActStopTrace);
+			RegisterActionAndMenu("PrintPerf", "Prints the performance counters averaged since startup. Per-IRQ rates need --perfstats.",ActPrintPerf);
+			RegisterAction("PrintPerfJSON", "As PrintPerf, but as a single line of JSON on stdout (see MK404_bench). Needs --perfstats.",ActPrintPerfJSON);
+			RegisterActionAndMenu("DumpFlightRecorder", "Writes the recent telemetry history out as VCD. Needs --flight-recorder.",ActDumpFlight);
+			RegisterActionAndMenu("PrintStats", "Prints the --tel-stats signal statistics so far.",ActPrintStats);
+			RegisterAction("PrintStatsJSON", "As PrintStats, but as a single line of JSON on stdout.",ActPrintStatsJSON);
+			RegisterAction("ResetStats", "Restarts the --tel-stats signal statistics from the current values.",ActResetStats);
 #endif
 		}
 
 		enum Actions
 		{
 			ActWaitFor,
+			ActWaitForCmp,
+			ActWaitForMask,
 			ActStartTrace,
-			ActStopTrace
+			ActStopTrace,
+			ActPrintPerf,
+			ActPrintPerfJSON,
+			ActDumpFlight,
+			ActPrintStats,
+			ActPrintStatsJSON,
+			ActResetStats
 		};
 
+		// A snapshot of the perf counters at a point in time.
+		typedef struct PerfFrame_t
+		{
+			chrono::steady_clock::time_point tp;
+			avr_cycle_count_t uiCycle = 0;
+			uint64_t uiInstr = 0, uiTimers = 0;
+			map<string, uint64_t> mIRQs;
+		} PerfFrame_t;
+
+		PerfFrame_t GetPerfFrame();
+
+		// Prints the rates between two frames, either human readable or as a single line of JSON.
+		void PrintPerf(FILE *pOut, const PerfFrame_t &from, const PerfFrame_t &to, bool bJSON);
+
+		avr_cycle_count_t OnPerfTimer(avr_t *pAVR, avr_cycle_count_t when);
+
+		avr_cycle_timer_t m_fcnPerf = MAKE_C_TIMER_CALLBACK(TelemetryHost,OnPerfTimer);
+
+		bool m_bPerf = false;
+		uint32_t m_uiPerfIntervalMs = 0;
+		uint64_t m_uiInstrCount = 0;
+		map<string, uint64_t> m_mIRQCounts;
+		PerfFrame_t m_pfStart, m_pfLast;
+
+		// Running statistics of one signal, in raw IRQ values, kept up to date by its notify hook.
+		// Boards share the host, so each is timed by the AVR it was added on, and locked for the
+		// readers on other threads (printing, resetting) while that board runs.
+		typedef struct Stat_t
+		{
+			avr_t *pAVR = nullptr;
+			std::mutex lock;
+			uint32_t uiValue = 0, uiMin = 0, uiMax = 0;
+			uint64_t uiChanges = 0, uiRises = 0; // Rises are from zero to nonzero
+			avr_cycle_count_t uiStart = 0, uiLast = 0; // Since when, and up to when the sums below go
+			avr_cycle_count_t uiNonzero = 0; // Cycles
+			double dSum = 0; // Of value * cycles
+			Metric mtrMin, mtrMax, mtrMean, mtrNonzero, mtrChanges {Metric::Kind::Counter};
+
+			// Brings the sums up to uiNow at the current value.
+			inline void Fold(avr_cycle_count_t uiNow)
+			{
+				dSum += static_cast<double>(uiValue) * (uiNow - uiLast);
+				if (uiValue)
+					uiNonzero += uiNow - uiLast;
+				uiLast = uiNow;
+			}
+			inline double GetMean() const { return uiLast > uiStart ? dSum/(uiLast - uiStart) : uiValue; }
+			inline double GetNonzero() const { return uiLast > uiStart ? static_cast<double>(uiNonzero)/(uiLast - uiStart) : (uiValue ? 1 : 0); }
+		} Stat_t;
+
+		void AddStat(avr_irq_t *pIRQ, const string &strName);
+		void ResetStats();
+
+		// Refreshes the metrics of pAVR's signals, the hooks only do the counting.
+		avr_cycle_count_t OnStatsTimer(avr_t *pAVR, avr_cycle_count_t when);
+		void ArmStats(avr_t *pAVR);
+
+		avr_cycle_timer_t m_fcnStats = MAKE_C_TIMER_CALLBACK(TelemetryHost,OnStatsTimer);
+
+		vector<string> m_vsStatNames;
+		map<string, Stat_t> m_mStats; // Nodes don't move, so each is its own hook's param.
+
 		avr_vcd_t m_trace;
+		TraceWriter m_binTrace;
+		TraceFormat m_eFormat = TraceFormat::Sampled;
+		uint32_t m_uiChunkSeconds = 0;
+
+		FlightRecorder m_flight;
+		uint32_t m_uiFlightSeconds = 0;
+		string m_strFlightFile;
+		unsigned int m_uiFlightDumps = 0;
 
 		vector<TelCategory> m_VLoglst;
 		vector<string> m_vsNames;
 
 		static TelemetryHost *m_pHost;
+		static thread_local TelemetryHost *m_pCurrent;
+		static vector<unique_ptr<TelemetryHost>> m_vHosts; // Hosts made with CreateHost()
 
+		// Traces not yet in the maps below. Most runs never look a name up, so the names are
+		// only built (and the maps filled) on the first lookup: -t ?, WaitFor or the remote API.
+		typedef struct Pending_t
+		{
+			avr_irq_t *pIRQ;
+			string strName; // Part name, or the full name once built
+			uint64_t uiCats; // One nibble per category, TC+1, in the order given. Saves a vector per trace.
+			bool bFullName;
+		} Pending_t;
+		vector<Pending_t> m_vPending;
+		mutex m_lockIndex;
+
+		// Moves the pending traces into the name maps.
+		void IndexTraces();
+
+		// The names are the keys of m_mIRQs, the other two point at those.
+		typedef struct NameLess_t
+		{
+			bool operator()(const string *pA, const string *pB) const { return *pA < *pB; }
+		} NameLess_t;
 		map<string, avr_irq_t*>m_mIRQs;
-		map<string, vector<TC>>m_mCatsByName;
-		map<TC,vector<string>>m_mNamesByCat;
+		map<const string*, vector<TC>, NameLess_t>m_mCatsByName;
+		map<TC,vector<const string*>>m_mNamesByCat;
 
-		avr_irq_t* m_pCurrentIRQ = nullptr;
-		uint32_t m_uiMatchVal = 0;
+		Waiter_t *m_pWaiter = nullptr; // Waiter for the current script line.
+		vector<string> m_vWaitArgs;
+		vector<unique_ptr<Waiter_t>> m_vWaiters;
 
-
-		#define _TC(x,y) make_pair(y,TC::x)
-		const map<string,TC> m_mStr2Cat = {
-			TCENTRIES
-		};
-		#undef _TC
-		#define _TC(x,y) make_pair(TC::x,y)
-		const map<TC,string> m_mCat2Str = {
-			TCENTRIES
-		};
-		#undef _TC
+		// The same for every host.
+		static const map<string,WaitOp> m_mStr2Op;
+		static const map<string,TC> m_mStr2Cat;
+		static const map<TC,string> m_mCat2Str;
 
 };
@@ -22,7 +22,7 @@
 
 #pragma once
 
-#include <map>
+#include <stddef.h>  // for size_t
 #include "avr_ioport.h"
 #include "avr_timer.h"
 #include <PinSpec.h>
@@ -38,8 +38,15 @@ namespace Wirings
 			// down the road if we need more values than this can provide.
 			typedef signed char MCUPin;
 
+			// One entry of a wiring table. An MCUPin of -1 removes a pin a base table defined.
+			typedef struct PinDef_t { Pin ePin; MCUPin pin; } PinDef_t;
+
 			// Creates a new board with the given pinspec.
-			Wiring(const PinSpec &pSpec):m_pinSpec(pSpec){};
+			Wiring(const PinSpec &pSpec):m_pinSpec(pSpec)
+			{
+				for (unsigned int i=0; i<PIN_COUNT; i++)
+					m_pins[i] = -1;
+			};
 
 			// Passthrough to retrieve the MCU name
 			std::string GetMCUName() const { return m_pinSpec.GetMCUName(); }
@@ -56,24 +63,33 @@ namespace Wirings
 
 			// Looks up a digital IRQ based on the arduino convenience pin number.
 			//inline struct avr_irq_t* DIRQLU(struct avr_t* avr, unsigned int n){ return IOIRQ(avr,m_pinSpec.PORT(n),m_pinSpec.PIN(n)); }
-			inline struct avr_irq_t* DIRQLU(struct avr_t* avr, Pin ePin) const { return IOIRQ(avr,m_pinSpec.PORT(m_mPins.at(ePin)),m_pinSpec.PIN(m_mPins.at(ePin))); }
+			// Boards resolve these once when the AVR is created, see Board::GetDIRQ.
+			inline struct avr_irq_t* DIRQLU(struct avr_t* avr, Pin ePin) const { return IOIRQ(avr,m_pinSpec.PORT(m_pins[ePin]),m_pinSpec.PIN(m_pins[ePin])); }
 
 			// Looks up a PWM IRQ based on the arduino convenience pin number.
 			//inline struct avr_irq_t* DPWMLU(struct avr_t* avr, unsigned int n) { return TIMERIRQ(avr, m_pinSpec.TIMER_CHAR(n), m_pinSpec.TIMER_IDX(n)); }
-			inline struct avr_irq_t* DPWMLU(struct avr_t* avr, Pin ePin)  const { return TIMERIRQ(avr, m_pinSpec.TIMER_CHAR(m_mPins.at(ePin)), m_pinSpec.TIMER_IDX(m_mPins.at(ePin))); }
+			inline struct avr_irq_t* DPWMLU(struct avr_t* avr, Pin ePin)  const { return TIMERIRQ(avr, m_pinSpec.TIMER_CHAR(m_pins[ePin]), m_pinSpec.TIMER_IDX(m_pins[ePin])); }
 
 			// Returns T/F whether a pin is defined.
-			inline bool IsPin(PinNames::Pin pin) const { return m_mPins.count(pin)>0;}
+			inline bool IsPin(PinNames::Pin pin) const { return m_pins[pin]>=0;}
 
-			inline MCUPin GetPin(PinNames::Pin ePin) const { return m_mPins.at(ePin);}
+			// -1 if the pin isn't defined.
+			inline MCUPin GetPin(PinNames::Pin ePin) const { return m_pins[ePin];}
 
 		protected:
-			virtual std::map<Pin,MCUPin> GetPinMap() = 0;
+			// Applies a (constexpr) wiring table on top of what is already there. Derived
+			// wirings call this from their constructor, after the one they're based on.
+			template<size_t N>
+			inline void LoadPins(const PinDef_t (&table)[N])
+			{
+				for (size_t i=0; i<N; i++)
+					m_pins[table[i].ePin] = table[i].pin;
+			}
 
 			// Gets the PWM id for a given timer number.
 			inline unsigned int _TimerPWMID(uint8_t number) const { return TIMER_IRQ_OUT_PWM0 + number; }
 
-			std::map<Pin,MCUPin> m_mPins;
+			MCUPin m_pins[PIN_COUNT]; // Indexed by Pin, flat so lookups don't need a search.
 
 		private:
 			const PinSpec &m_pinSpec;
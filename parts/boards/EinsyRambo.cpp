@@ -20,6 +20,7 @@
 
 #include "EinsyRambo.h"
 #include <stdio.h>             // for fprintf, printf, stderr
+#include <stdlib.h>            // for exit
 #include "thermistortables.h"  // for OVERSAMPLENR, temptable_1, temptable_2000
 #include "Einsy_1_1a.h"        // for Einsy_1_1a
 #include "HD44780.h"           // for HD44780
@@ -41,10 +42,19 @@ namespace Boards
 	{
 		DisableInterruptLevelPoll(8);
 
-		AddSerialPty(UART2,'2');
+		m_eepromProfile.Init(&GetEEPROM());
+		if (!EEPROMProfile::GetDefaults().empty() && !m_eepromProfile.Apply(EEPROMProfile::GetDefaults()))
+			exit(1); // Already checked, but the EEPROM may not be an MK3's.
+
+		if (m_bUART2Pty)
+			AddSerialPty(UART2,'2');
 		AddHardware(UART0);
 
 		AddHardware(m_Mon0,'0');
+		if (GCodeSniffer::IsLatencyStatsOn())
+			AddHardware(m_hostSniffer,'0',false);
+		if (GCodeStreamer::IsEnabled())
+			AddHardware(m_hostStreamer,'0');
 
 		// SD card
 		string strSD = GetSDCardFile();
@@ -89,29 +99,52 @@ namespace Boards
 
 		AddHardware(fExtruder, GetDIRQ(TACH_0), GetDIRQ(E0_FAN), GetPWMIRQ(E0_FAN));
 		AddHardware(fPrint, GetDIRQ(TACH_1), GetDIRQ(FAN_PIN), GetPWMIRQ(FAN_PIN));
+		// The firmware polls one tach and takes INT7 on the other, each is only worked out as it's needed.
+		BasePeripheral::PortPin_t tachPort;
+		if (GetPortPin(TACH_0, tachPort))
+			fExtruder.AttachTachPin(tachPort);
+		if (GetPortPin(TACH_1, tachPort))
+			fPrint.AttachTachPin(tachPort);
 
 		AddHardware(hBed, nullptr, GetDIRQ(HEATER_BED_PIN));
 		hBed.ConnectTo(Heater::TEMP_OUT, tBed.GetIRQ(Thermistor::TEMP_IN));
+		tBed.SetOnRead([this]() { hBed.Update(); });
 
 		AddHardware(hExtruder, nullptr, GetDIRQ(HEATER_0_PIN));
 		hExtruder.ConnectTo(Heater::TEMP_OUT, tExtruder.GetIRQ(Thermistor::TEMP_IN));
+		tExtruder.SetOnRead([this]() { hExtruder.Update(); });
+		// The part cooling fan takes away up to ~25% of the heater's capacity at printing temps.
+		hExtruder.SetFanCooling(5000, 0.002f);
+		fPrint.ConnectTo(Fan::SPEED_OUT, hExtruder.GetIRQ(Heater::FAN_IN));
 
 		AddHardware(m_buzzer);
 		m_buzzer.ConnectFrom(GetDIRQ(BEEPER),Beeper::DIGITAL_IN);
 
 		AddHardware(lcd);
+		// RS, E, D4-D7. Decoded straight off the port registers if possible, rather than per-pin IRQs.
+		PinNames::Pin eLCDPins[6] = {LCD_PINS_RS,LCD_PINS_ENABLE,LCD_PINS_D4,LCD_PINS_D5,LCD_PINS_D6,LCD_PINS_D7};
+		HD44780::PortPin_t lcdPorts[6];
+		bool bDecoder = true;
+		for (int i = 0; i < 6; i++)
+			bDecoder &= GetPortPin(eLCDPins[i], lcdPorts[i]);
+		bDecoder = bDecoder && lcd.AttachPortDecoder(lcdPorts);
 		// D4-D7,
 		PinNames::Pin ePins[4] = {LCD_PINS_D4,LCD_PINS_D5,LCD_PINS_D6,LCD_PINS_D7};
 		for (int i = 0; i < 4; i++) {
-			TryConnect(ePins[i],lcd, HD44780::D4+i);
+			if (!bDecoder)
+				TryConnect(ePins[i],lcd, HD44780::D4+i);
 			TryConnect(lcd, HD44780::D4+i,ePins[i]);
 		}
-		TryConnect(LCD_PINS_RS,lcd, HD44780::RS);
-		TryConnect(LCD_PINS_ENABLE, lcd,HD44780::E);
+		if (!bDecoder)
+		{
+			TryConnect(LCD_PINS_RS,lcd, HD44780::RS);
+			TryConnect(LCD_PINS_ENABLE, lcd,HD44780::E);
+		}
 		TryConnect(LCD_BL_PIN, lcd, HD44780::BRIGHTNESS_IN);
 		lcd.ConnectFrom(GetPWMIRQ(LCD_BL_PIN), HD44780::BRIGHTNESS_PWM_IN);
 
 		AddHardware(encoder);
+		encoder.SetDisplay(&lcd);
 		TryConnect(encoder, RotaryEncoder::OUT_A, BTN_EN2);
 		TryConnect(encoder, RotaryEncoder::OUT_B, BTN_EN1);
 		TryConnect(encoder, RotaryEncoder::OUT_BUTTON, BTN_ENC);
@@ -162,7 +195,8 @@ namespace Boards
 		TryConnect(E0_ENABLE_PIN,	E, TMC2130::ENABLE_IN);
 		TryConnect(E, TMC2130::DIAG_OUT, E0_TMC2130_DIAG);
 
-		AddHardware(pinda, X.GetIRQ(TMC2130::POSITION_OUT),  Y.GetIRQ(TMC2130::POSITION_OUT),  Z.GetIRQ(TMC2130::POSITION_OUT));
+		AddHardware(pinda, &X.GetMotion(), &Y.GetMotion(), &Z.GetMotion());
+		m_hostSniffer.WatchMotion({&X.GetMotion(), &Y.GetMotion(), &Z.GetMotion(), &E.GetMotion()});
 		TryConnect(pinda, PINDA::TRIGGER_OUT ,Z_MIN_PIN);
 		AddHardware(lPINDA);
 		lPINDA.ConnectFrom(pinda.GetIRQ(PINDA::TRIGGER_OUT), LED::LED_IN);
@@ -202,6 +236,39 @@ namespace Boards
 		sd_card.Unmount();
 	}
 
+	void EinsyRambo::OnSaveState(Snapshot &snap)
+	{
+		X.SaveState(snap);
+		Y.SaveState(snap);
+		Z.SaveState(snap);
+		E.SaveState(snap);
+		hExtruder.SaveState(snap);
+		hBed.SaveState(snap);
+		lcd.SaveState(snap);
+		sd_card.SaveState(snap);
+	}
+
+	void EinsyRambo::OnLoadState(const Snapshot &snap)
+	{
+		X.LoadState(snap);
+		Y.LoadState(snap);
+		Z.LoadState(snap);
+		E.LoadState(snap);
+		hExtruder.LoadState(snap);
+		hBed.LoadState(snap);
+		lcd.LoadState(snap);
+		sd_card.LoadState(snap);
+	}
+
+	void EinsyRambo::OnDiscardStorage()
+	{
+		if (sd_card.IsMounted())
+		{
+			sd_card.Unmount(); // Overlay writes go with it.
+			sd_card.Mount();
+		}
+	}
+
 	void EinsyRambo::OnAVRReset()
 	{
 		printf("RESET\n");
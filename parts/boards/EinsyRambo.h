@@ -23,9 +23,12 @@
 #include <stdint.h>                              // for uint32_t
 #include <string>                                // for string
 #include "Beeper.h"                              // for Beeper
+#include "EEPROMProfile.h"                       // for EEPROMProfile
 #include "Board.h"                               // for Board
 #include "Button.h"                              // for Button
 #include "Fan.h"                                 // for Fan
+#include "GCodeSniffer.h"                        // for GCodeSniffer
+#include "GCodeStreamer.h"                       // for GCodeStreamer
 #include "HD44780GL.h"                           // for HD44780GL
 #include "Heater.h"                              // for Heater
 #include "LED.h"                                 // for LED
@@ -64,28 +67,40 @@ namespace Boards
 
 			void OnAVRDeinit() override;
 
+			void OnSaveState(Snapshot &snap) override;
+
+			void OnLoadState(const Snapshot &snap) override;
+
+			void OnDiscardStorage() override;
+
 			static constexpr float fScale24v = 1.0f/26.097f; // Based on rSense voltage divider outputting 5v
 
 			bool m_bFactoryReset = false;
 
+			// Cleared by printers that wire UART2 straight to another board instead of a PTY.
+			bool m_bUART2Pty = true;
+
 			HD44780GL lcd;
 			RotaryEncoder encoder;
 			Button PowerPanic = Button("Power Panic");
 			Beeper m_buzzer;
 			uart_pty UART0, UART2;
 			SerialLineMonitor m_Mon0 = SerialLineMonitor("Serial0");
+			GCodeSniffer m_hostSniffer {0}; // Only attached for --gcode-latency
+			GCodeStreamer m_hostStreamer; // Only attached for --gcode-stream
 			Thermistor tExtruder, tBed, tPinda, tAmbient;
 			Fan fExtruder = {3300,'E'}, fPrint = {5000,'P',true};
 			Heater hExtruder = {1.5,25.0,false,'H',30,250},
 				hBed = {0.25, 25, true,'B',30,100};
 			w25x20cl spiFlash;
-			SDCard sd_card = SDCard();
+			EEPROMProfile m_eepromProfile;
+			SDCard sd_card;
 			TMC2130 X = {'X'},
 				Y = {'Y'},
 				Z = {'Z'},
 				E = {'E'};
-			VoltageSrc vMain = VoltageSrc(fScale24v, 24.f),
-				vBed = VoltageSrc(fScale24v,23.9);
+			VoltageSrc vMain = {fScale24v, 24.f},
+				vBed = {fScale24v,23.9f};
 			PINDA pinda {(float) X_PROBE_OFFSET_FROM_EXTRUDER, (float)Y_PROBE_OFFSET_FROM_EXTRUDER};
 			//MMU2 *mmu = nullptr;
 			LED lPINDA = {0xFF0000FF,'P',true},
@@ -28,7 +28,8 @@ namespace Boards
 	{
 		DisableInterruptLevelPoll(5);
 
-		AddSerialPty(m_UART,'1');
+		if (m_bUARTPty)
+			AddSerialPty(m_UART,'1');
 
 		AddUARTTrace('1');
 
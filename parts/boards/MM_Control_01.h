@@ -47,6 +47,7 @@ namespace Boards
 		//	void CustomAVRDeinit() override;
 
 			uart_pty m_UART;
+			bool m_bUARTPty = true; // False when the UART is linked directly to the printer.
 			HC595 m_shift;
 			TMC2130 m_Sel = {'S'},
 					m_Idl = {'I'},
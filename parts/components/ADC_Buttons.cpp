@@ -22,7 +22,7 @@
 #include "ADC_Buttons.h"
 #include "IScriptable.h"
 
-uint32_t ADC_Buttons::OnADCRead(struct avr_irq_t * irq, uint32_t value)
+void ADC_Buttons::Publish()
 {
     //if (raw < 50) return Btn::right;
 	//if (raw > 80 && raw < 100) return Btn::middle;
@@ -36,7 +36,7 @@ uint32_t ADC_Buttons::OnADCRead(struct avr_irq_t * irq, uint32_t value)
     else if (m_uiCurBtn ==3)
         iVOut = 25*5000/1023;
 
-    return iVOut;
+    SetADCValue(iVOut);
 }
 
 Scriptable::LineStatus ADC_Buttons::ProcessAction(unsigned int uiAct, const vector<string> &vArgs)
@@ -74,5 +74,6 @@ void ADC_Buttons::Push(uint8_t uiBtn)
 {
 	printf("Pressing button %u\n",uiBtn);
 	m_uiCurBtn = uiBtn;
+	Publish();
 	RegisterTimerUsec(m_fcnRelease,2500000, this);
 }
@@ -47,6 +47,7 @@ class ADC_Buttons:public ADCPeripheral, public Scriptable
 			RegisterMenu("Push Left",ActBtnLeft);
 			RegisterMenu("Push Middle",ActBtnMiddle);
 			RegisterMenu("Push Right",ActBtnRight);
+			Publish();
 		};
 
 
@@ -64,12 +65,14 @@ class ADC_Buttons:public ADCPeripheral, public Scriptable
 		{
 			printf("%s button release\n", GetName().c_str());
 			m_uiCurBtn = 0;
+			Publish();
 			return 0;
 		};
 
 		avr_cycle_timer_t m_fcnRelease = MAKE_C_TIMER_CALLBACK(ADC_Buttons,AutoRelease);
 
-		uint32_t OnADCRead(struct avr_irq_t * irq, uint32_t value) override;
+		// Sets the ADC reading for the button that's down, when that changes.
+		void Publish();
 
 		std::atomic_uint8_t m_uiCurBtn = {0};
 
@@ -31,13 +31,31 @@
 #include <SDL_error.h>        // for SDL_GetError
 #include <SDL_stdinc.h>       // for Sint16
 #include <stdio.h>            // for fprintf, printf, stderr
+#include <algorithm>          // for max
 #include "BasePeripheral.h"   // for MAKE_C_CALLBACK
+#include "Log.h"              // for LOG, Log
+#include "RedrawFlag.h"       // for RedrawFlag
 #include "TelemetryHost.h"
+#include "ThreadPolicy.h"     // for ThreadPolicy
+
+static Log::Module logBeeper("Beeper");
 
 Beeper::Beeper():SoftPWMable(true,this, 1, 100), Scriptable("Beeper")
 {
+	RegisterActionAndMenu("Mute","Mutes the beeper", ActMute);
+	RegisterActionAndMenu("Unmute","Unmutes the beeper", ActUnmute);
+	RegisterActionAndMenu("ToggleMute","Toggles the beeper mute", ActToggle);
+}
+
+// Opening the device is slow (and pointless when muted or headless), so it waits for the first tone.
+void Beeper::OpenAudio()
+{
+	m_bAudioTried = true;
 	if (SDL_Init(SDL_INIT_AUDIO)!=0)
+	{
 		fprintf(stderr,"Failed to init SDL_Audio\n");
+		return;
+	}
 
     m_specWant.freq = m_uiSampleRate; // number of samples per second
     m_specWant.format = AUDIO_S16SYS; // sample type (here: signed short i.e. 16 bit)
@@ -46,22 +64,22 @@ Beeper::Beeper():SoftPWMable(true,this, 1, 100), Scriptable("Beeper")
     m_specWant.callback = m_fcnSDL; // function SDL calls periodically to refill the buffer
     m_specWant.userdata = this; // counter, keeping track of current sample number
 
-	RegisterActionAndMenu("Mute","Mutes the beeper", ActMute);
-	RegisterActionAndMenu("Unmute","Unmutes the beeper", ActUnmute);
-	RegisterActionAndMenu("ToggleMute","Toggles the beeper mute", ActToggle);
-
     if(SDL_OpenAudio(&m_specWant, &m_specHave) != 0)
 	{
 		fprintf(stderr, "Failed to open audio: %s\n", SDL_GetError());
 		return;
 	}
+	m_bAudioOpen = true;
     if(m_specWant.format != m_specHave.format)
 	{
 		printf("Failed to get the desired AudioSpec\n");
 		return;
 	}
+	m_uiStepFP = (static_cast<uint64_t>(m_pAVR->frequency)<<16U)/m_specHave.freq;
+	m_uiLatency = (static_cast<uint64_t>(m_pAVR->frequency)*m_specHave.samples)/m_specHave.freq;
 	m_bAudioAvail = true;
-
+	// The device runs from here on, playing silence between tones. Nothing on the AVR thread touches it again.
+	SDL_PauseAudio(0);
 }
 
 Scriptable::LineStatus Beeper::ProcessAction(unsigned int iAct, const vector<string> &vArgs)
@@ -71,9 +89,11 @@ Scriptable::LineStatus Beeper::ProcessAction(unsigned int iAct, const vector<str
 		case ActMute:
 		case ActUnmute:
 			m_bMuted = iAct==ActMute;
+			RedrawFlag::Set();
 			return LineStatus::Finished;
 		case ActToggle:
 			ToggleMute();
+			RedrawFlag::Set();
 			return LineStatus::Finished;
 	}
 	return LineStatus::Unhandled;
@@ -81,48 +101,96 @@ Scriptable::LineStatus Beeper::ProcessAction(unsigned int iAct, const vector<str
 
 Beeper::~Beeper()
 {
-	SDL_CloseAudio();
+	if (m_bAudioOpen)
+		SDL_CloseAudio();
+}
+
+void Beeper::PushTone(uint32_t uiOn, uint32_t uiTotal)
+{
+	size_t uiHead = m_uiHead.load(std::memory_order_relaxed);
+	if (uiHead - m_uiTail.load(std::memory_order_acquire) >= m_uiQueueSize)
+	{
+		LOG(logBeeper, Debug, "Tone queue full, dropped a change");
+		return;
+	}
+	m_tones[uiHead & (m_uiQueueSize-1)] = {m_pAVR->cycle, uiOn, uiTotal};
+	m_uiLastCycle.store(m_pAVR->cycle, std::memory_order_relaxed);
+	m_uiHead.store(uiHead + 1, std::memory_order_release);
 }
 
 void Beeper::SDL_FillBuffer(uint8_t *raw_buffer, int bytes)
 {
-    Sint16 *buffer = (Sint16*)raw_buffer;
-    for(int i = 0; i < bytes/2; i++, m_uiCounter--)
-    {
-		if (m_uiCounter==0)
+	static thread_local bool bNamed = false; // SDL makes the thread, this is the first we see of it.
+	if (!bNamed)
+	{
+		ThreadPolicy::Apply(ThreadPolicy::Role::Audio, "audio");
+		bNamed = true;
+	}
+	Sint16 *buffer = reinterpret_cast<Sint16*>(raw_buffer);
+	size_t uiTail = m_uiTail.load(std::memory_order_relaxed);
+	size_t uiHead = m_uiHead.load(std::memory_order_acquire);
+	// Silence isn't timed, the clock jumps to the next change. Faster than real time a tone can
+	// fall behind; a little and it plays at double speed (an octave up) to catch up, a lot (a
+	// quarter second) and it skips ahead to the newest change.
+	uint64_t uiStep = m_uiStepFP;
+	if (uiTail != uiHead)
+	{
+		uint64_t uiNow = m_uiClockFP>>16U, uiNewest = m_uiLastCycle.load(std::memory_order_relaxed);
+		if (!m_uiTotal)
+			m_uiClockFP = std::max(m_uiClockFP, m_tones[uiTail & (m_uiQueueSize-1)].uiCycle<<16U);
+		else if (uiNewest > uiNow + m_pAVR->frequency/4U)
+			m_uiClockFP = (uiNewest - m_uiLatency)<<16U;
+		else if (uiNewest > uiNow + 2U*m_uiLatency)
+			uiStep *= 2U;
+	}
+	for(int i = 0; i < bytes/2; i++)
+	{
+		while (uiTail != uiHead && (m_tones[uiTail & (m_uiQueueSize-1)].uiCycle<<16U) <= m_uiClockFP)
 		{
-			m_bState ^=1;
-			m_uiCounter = m_uiSampleRate/ (m_bState? m_uiCtOn : m_uiCtOff );
+			const Tone_t &tone = m_tones[uiTail & (m_uiQueueSize-1)];
+			m_uiOn = tone.uiOn;
+			m_uiTotal = tone.uiTotal;
+			m_uiPhaseFP = 0;
+			m_uiTail.store(++uiTail, std::memory_order_release);
 		}
-        buffer[i] = m_bState? 12000 : -12000;
-    }
+		if (!m_uiTotal || m_bMuted)
+		{
+			buffer[i] = 0;
+			if (uiTail == uiHead)
+				continue; // Nothing to time until the next change comes in.
+		}
+		else
+		{
+			buffer[i] = (m_uiPhaseFP>>16U) < m_uiOn ? 12000 : -12000;
+			m_uiPhaseFP += uiStep;
+			while ((m_uiPhaseFP>>16U) >= m_uiTotal)
+				m_uiPhaseFP -= static_cast<uint64_t>(m_uiTotal)<<16U;
+		}
+		m_uiClockFP += uiStep;
+	}
 }
 
 void Beeper::OnWaveformChange(uint32_t uiTOn,uint32_t uiTTotal)
 {
-	if (m_bMuted)
+	if (m_bMuted && uiTOn) // Stops still go through, or the tone would resume on unmute.
 		return;
-	//printf("Beeper debug: %u on, %u total\n", uiTOn,uiTTotal);
+	LOG(logBeeper, Trace, "%u on, %u total", uiTOn,uiTTotal);
 	if (uiTOn == 0)
 	{
-		if (m_bAudioAvail) SDL_PauseAudio(1);
+		if (m_bAudioAvail) PushTone(0,0);
 		m_bPlaying = false;
+		RedrawFlag::Set();
 	}
 	else
 	{
-		m_uiCtOn = m_pAVR->frequency/uiTOn;
-		m_uiCtOff = m_pAVR->frequency/(uiTTotal-uiTOn);
-		//printf("Beep @ %u Hz, duty cycle %u %\n",m_pAVR->frequency/uiTTotal, (100*uiTOn)/uiTTotal);
-		if (m_uiCtOn == 0)
+		if (uiTOn >= uiTTotal || uiTOn > m_pAVR->frequency)
 			return;
-		{
-			if (m_bPlaying && m_bAudioAvail)
-				SDL_PauseAudio(1);
-			m_uiCounter = m_uiSampleRate/m_uiCtOn;
-			m_bPlaying = true;
-			if (m_bAudioAvail) SDL_PauseAudio(0);
-		}
-
+		LOG(logBeeper, Debug, "Beep @ %u Hz, duty cycle %u%%",m_pAVR->frequency/uiTTotal, (100*uiTOn)/uiTTotal);
+		if (!m_bAudioTried)
+			OpenAudio();
+		if (m_bAudioAvail) PushTone(uiTOn, uiTTotal);
+		m_bPlaying = true;
+		RedrawFlag::Set();
 	}
 };
 
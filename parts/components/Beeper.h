@@ -22,14 +22,16 @@
 #pragma once
 
 #include <SDL_audio.h>      // for SDL_AudioSpec
+#include <stddef.h>         // for size_t
 #include <stdint.h>         // for uint16_t, uint8_t, uint32_t
 #include <string>           // for string
 #include <vector>           // for vector
-#include <atomic>
+#include <atomic>           // for atomic, atomic_bool, atomic_size_t
 #include "IScriptable.h"    // for IScriptable::LineStatus
 #include "Scriptable.h"     // for Scriptable
 #include "SoftPWMable.h"    // for SoftPWMable
 #include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t
 
 class Beeper:public SoftPWMable, public Scriptable
 {
@@ -60,8 +62,18 @@ class Beeper:public SoftPWMable, public Scriptable
 		Scriptable::LineStatus ProcessAction(unsigned int iAct, const vector<string> &vArgs) override;
 
 	private:
+		// A tone change as the AVR saw it, times in cycles. uiTotal == 0 is silence.
+		typedef struct Tone_t
+		{
+			avr_cycle_count_t uiCycle;
+			uint32_t uiOn, uiTotal;
+		} Tone_t;
+
 		void StartTone();
+		void OpenAudio();
 		void SDL_FillBuffer(uint8_t *raw_buffer, int bytes);
+		// Queues a tone change for the audio thread, dropped if it is that far behind.
+		void PushTone(uint32_t uiOn, uint32_t uiTotal);
 
 		void(*m_fcnSDL)(void* p, uint8_t*, int) = [](void *p, uint8_t *raw_buffer, int bytes){Beeper *self = static_cast<Beeper*>(p); self->SDL_FillBuffer(raw_buffer,bytes);};
 
@@ -69,11 +81,22 @@ class Beeper:public SoftPWMable, public Scriptable
 
 		SDL_AudioSpec m_specWant, m_specHave;
 
-		atomic_uint16_t m_uiCtOn = {0}, m_uiCtOff = {0};
-		atomic_uint16_t m_uiCounter {0};
+		// Single producer (AVR thread), single consumer (SDL callback).
+		static constexpr size_t m_uiQueueSize = 256; // Power of two
+		Tone_t m_tones[m_uiQueueSize];
+		atomic_size_t m_uiHead {0}, m_uiTail {0};
+		atomic<avr_cycle_count_t> m_uiLastCycle {0}; // Of the newest queued change
+
+		// The SDL callback's own state. The audio clock runs in AVR cycles (16.16 fixed point),
+		// so tones keep their simulated length and spacing.
+		uint64_t m_uiClockFP = 0, m_uiPhaseFP = 0;
+		uint64_t m_uiStepFP = 0; // Cycles per sample
+		uint64_t m_uiLatency = 0; // One buffer, in cycles
+		uint32_t m_uiOn = 0, m_uiTotal = 0;
+
 		static constexpr uint16_t m_uiSampleRate = 44100;
-		bool m_bState = false;
 		bool m_bAudioAvail = false;
+		bool m_bAudioTried = false, m_bAudioOpen = false;
 		enum Actions
 		{
 			ActMute,
@@ -23,14 +23,29 @@
 #include <avr_eeprom.h>  // for avr_eeprom_desc_t, AVR_IOCTL_EEPROM_GET, AVR...
 #include <fcntl.h>       // for open, O_CREAT, O_RDWR, SEEK_SET
 #include <stdlib.h>      // for malloc, exit, free, size_t
+#include <sys/mman.h>    // for mmap, msync, munmap, MAP_FAILED, MAP_SHARED
 #include <sys/types.h>   // for ssize_t
+#include <algorithm>     // for min
+#include <cstring>       // for memcmp, memcpy
+#include "ThreadPolicy.h" // for ThreadPolicy
 #include "assert.h"      // for assert
 #include "sim_avr.h"     // for avr_t
 #include "sim_io.h"      // for avr_ioctl
 #include "stdio.h"       // for perror, printf, fprintf, stderr
-#include "unistd.h"      // for close, ftruncate, lseek, read, write
+#include "unistd.h"      // for close, ftruncate, getpid, lseek, read, write, usleep
 
 
+constexpr unsigned int EEPROM::m_uiPage;
+
+EEPROM::~EEPROM()
+{
+	if (m_thread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, NULL);
+	}
+}
+
 void EEPROM::Load(struct avr_t *avr, const string &strFile)
 {
 	m_pAVR = avr;
@@ -43,18 +58,31 @@ void EEPROM::Load(struct avr_t *avr, const string &strFile)
 		exit(1);
 	}
 	printf("Loading %u bytes of EEPROM\n", m_uiSize);
-	avr_eeprom_desc_t io {.ee= (uint8_t*)malloc(m_uiSize), .offset = 0, .size = m_uiSize};
 
 	if (ftruncate(m_fdEEPROM, m_uiSize) < 0) {
 		perror(m_strFile.c_str());
 		exit(1);
 	}
-	ssize_t r = read(m_fdEEPROM, io.ee, m_uiSize);
-	printf("Read %d bytes\n",(int)r);
-	if (r !=  io.size) {
-		fprintf(stderr, "unable to load EEPROM\n");
-		perror(m_strFile.c_str());
-		exit(1);
+
+	void *pMap = mmap(nullptr, m_uiSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fdEEPROM, 0);
+	if (pMap != MAP_FAILED)
+		m_pMap = static_cast<uint8_t*>(pMap);
+	else
+		perror("EEPROM: mmap failed, changes will only be saved on exit");
+
+	avr_eeprom_desc_t io {.ee = m_pMap, .offset = 0, .size = m_uiSize};
+	vector<uint8_t> vData;
+	if (!m_pMap)
+	{
+		vData.resize(m_uiSize);
+		io.ee = vData.data();
+		ssize_t r = read(m_fdEEPROM, io.ee, m_uiSize);
+		printf("Read %d bytes\n",(int)r);
+		if (r !=  io.size) {
+			fprintf(stderr, "unable to load EEPROM\n");
+			perror(m_strFile.c_str());
+			exit(1);
+		}
 	}
 	uint8_t bEmpty = 1;
 	for (size_t i=0; i<io.size; i++)
@@ -64,11 +92,91 @@ void EEPROM::Load(struct avr_t *avr, const string &strFile)
 	if (!bEmpty) // If the file was newly created (all null) this leaves the internal eeprom as full of 0xFFs.
 		avr_ioctl(m_pAVR, AVR_IOCTL_EEPROM_SET,&io);
 
-    free(io.ee);
+	if (!m_pMap)
+		return;
+
+	// A null ee gets us a pointer to the internal buffer rather than a copy.
+	avr_eeprom_desc_t desc {.ee = nullptr, .offset = 0, .size = m_uiSize};
+	avr_ioctl(m_pAVR, AVR_IOCTL_EEPROM_GET, &desc);
+	m_pData = desc.ee;
+	if (!m_pData)
+	{
+		fprintf(stderr, "EEPROM: Could not access the AVR's EEPROM, changes will only be saved on exit.\n");
+		return;
+	}
+	Flush(false); // Picks up the 0xFFs for a new file.
+	m_bQuit = false;
+	m_pidThread = getpid();
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "eeprom"); EEPROM *p = static_cast<EEPROM*>(param); return p->Run(); };
+	pthread_create(&m_thread, NULL, fcnRun, this);
+}
+
+void* EEPROM::Run()
+{
+	while (!m_bQuit)
+	{
+		usleep(m_uiFlushMs*1000);
+		Flush(false);
+	}
+	return nullptr;
+}
+
+// The AVR thread may be writing while we compare; a torn page just gets picked up next time around.
+void EEPROM::Flush(bool bSync)
+{
+	for (unsigned int uiPos = 0; uiPos < m_uiSize; uiPos += m_uiPage)
+	{
+		unsigned int uiLen = min<unsigned int>(m_uiPage, m_uiSize - uiPos);
+		if (memcmp(m_pMap + uiPos, m_pData + uiPos, uiLen) == 0)
+			continue;
+		memcpy(m_pMap + uiPos, m_pData + uiPos, uiLen);
+	}
+	// The kernel only writes back the pages we actually touched.
+	msync(m_pMap, m_uiSize, bSync ? MS_SYNC : MS_ASYNC);
+}
+
+void EEPROM::Detach()
+{
+	if (m_thread && getpid() == m_pidThread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, NULL);
+	}
+	m_thread = 0; // A forked child doesn't have the thread, only its handle.
+	if (m_pMap)
+		munmap(m_pMap, m_uiSize);
+	m_pMap = nullptr;
+	m_pData = nullptr;
+	if (m_fdEEPROM>0)
+		close(m_fdEEPROM);
+	m_fdEEPROM = -1;
 }
 
 void EEPROM::Save()
 {
+	if (m_fdEEPROM < 0)
+		return; // Detached.
+	if (m_pMap)
+	{
+		if (m_thread)
+		{
+			m_bQuit = true;
+			pthread_join(m_thread, NULL);
+			m_thread = 0;
+		}
+		if (m_pData)
+		{
+			Flush(true);
+			printf("Synced EEPROM to %s\n", m_strFile.c_str());
+			munmap(m_pMap, m_uiSize);
+			m_pMap = nullptr;
+			m_pData = nullptr;
+			close(m_fdEEPROM);
+			return;
+		}
+		munmap(m_pMap, m_uiSize);
+		m_pMap = nullptr;
+	}
 	// Write out the EEPROM contents:
 	lseek(m_fdEEPROM, SEEK_SET, 0);
 
@@ -119,3 +227,32 @@ uint8_t EEPROM::Peek(uint16_t address)
 	avr_ioctl(m_pAVR,AVR_IOCTL_EEPROM_GET,&io);
 	return uiRet;
 }
+
+vector<uint8_t> EEPROM::GetContents()
+{
+	vector<uint8_t> vData(m_uiSize);
+	avr_eeprom_desc_t io {.ee = vData.data(), .offset = 0, .size = m_uiSize};
+	avr_ioctl(m_pAVR,AVR_IOCTL_EEPROM_GET,&io);
+	return vData;
+}
+
+void EEPROM::SetContents(const vector<uint8_t> &vData)
+{
+	assert(vData.size()==m_uiSize);
+	avr_eeprom_desc_t io {.ee = const_cast<uint8_t*>(vData.data()), .offset = 0, .size = m_uiSize};
+	avr_ioctl(m_pAVR,AVR_IOCTL_EEPROM_SET,&io);
+}
+
+void EEPROM::SaveState(Snapshot &snap)
+{
+	vector<uint8_t> vData = GetContents();
+	snap.Put(GetName() + "/data", vData.data(), vData.size());
+}
+
+void EEPROM::LoadState(const Snapshot &snap)
+{
+	vector<uint8_t> vData(m_uiSize);
+	if (!snap.Get(GetName() + "/data", vData.data(), vData.size()))
+		return;
+	SetContents(vData);
+}
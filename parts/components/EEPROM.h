@@ -22,12 +22,16 @@
 
 #pragma once
 
+#include <pthread.h>         // for pthread_t
 #include <stdint.h>          // for uint16_t, uint8_t
+#include <sys/types.h>       // for pid_t
+#include <atomic>            // for atomic_bool
 #include <string>            // for string
 #include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
 #include "IScriptable.h"     // for ArgType, ArgType::Int, IScriptable::Line...
 #include "Scriptable.h"      // for Scriptable
+#include "Snapshot.h"        // for Snapshot
 
 using namespace std;
 
@@ -45,9 +49,16 @@ class EEPROM: public BasePeripheral, public Scriptable {
 		Load(avr, strFile);
 	};
 
+	~EEPROM();
+
+	// Maps the file and keeps it in sync with the AVR's EEPROM from a background
+	// thread, falling back to a plain read if it can't be mapped.
 	void Load(struct avr_t * avr, const string &strFile);
-	// Saves EEPROM to the file
+	// Flushes any outstanding changes and closes the file
 	void Save();
+	// Stops syncing to the file (without a final flush), the contents stay with the AVR.
+	// Also safe in a forked child, which has the flush thread's handle but not the thread.
+	void Detach();
 
 	// Pokes something into the EEPROM.
 	void Poke(uint16_t address,	uint8_t value);
@@ -55,14 +66,34 @@ class EEPROM: public BasePeripheral, public Scriptable {
 	// Peeks at a value in the EEPROM.
 	uint8_t Peek(uint16_t address);
 
+	// The whole EEPROM, and back in one ioctl (e.g. for EEPROMProfile).
+	vector<uint8_t> GetContents();
+	void SetContents(const vector<uint8_t> &vData);
+
+	// Checkpoints/restores the EEPROM contents, see Board::SaveState
+	void SaveState(Snapshot &snap);
+	void LoadState(const Snapshot &snap);
+
 	protected:
 		LineStatus ProcessAction(unsigned int uiAct, const vector<string> &vArgs) override;
 
 
 	private:
+		// Copies pages that differ from the mapped file and schedules them for write-back.
+		void Flush(bool bSync);
+		void* Run();
+
 		std::string m_strFile;
 		int m_fdEEPROM = 0;
 		uint16_t m_uiSize = 4096;
+
+		uint8_t *m_pMap = nullptr; // Shared mapping of the file
+		uint8_t *m_pData = nullptr; // SimAVR's own EEPROM buffer
+		pthread_t m_thread = 0;
+		pid_t m_pidThread = 0; // Process that started m_thread
+		std::atomic_bool m_bQuit {false};
+		static constexpr unsigned int m_uiFlushMs = 250;
+		static constexpr unsigned int m_uiPage = 64; // Granularity of the dirty check
 		enum Actions {
 			ActPoke
 		};
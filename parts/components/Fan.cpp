@@ -25,7 +25,11 @@
 #else
 # include <GL/gl.h>           // for glVertex2f, glTranslatef, glBegin, glCo..
 #endif
+#include <cstring>            // for strcmp
+#include "RedrawFlag.h"       // for RedrawFlag
 #include "TelemetryHost.h"    // for TC, TelCategory, TelemetryHost
+#include "avr_extint.h"       // for avr_extint_t
+#include "avr_ioport.h"       // for avr_ioport_t, AVR_IOCTL_IOPORT_GETIRQ
 //#define TRACE(_w)_w
 #ifndef TRACE
 #define TRACE(_w)
@@ -37,11 +41,95 @@ Fan::Fan(uint16_t iMaxRPM, char chrSym, bool bIsSoftPWM):SoftPWMable(bIsSoftPWM,
 	RegisterActionAndMenu("Resume","Resumes fan from a stall condition",Actions::Resume);
 }
 
+bool Fan::GetTachLevel(avr_cycle_count_t uiCycle)
+{
+	if (uiCycle < m_uiPhase) // Rewound to a checkpoint, carry on from here.
+		m_uiPhase = uiCycle;
+	if (!m_uiHalfCycles)
+		return m_bPhaseLevel;
+	return m_bPhaseLevel ^ (((uiCycle - m_uiPhase)/m_uiHalfCycles) & 1U);
+}
+
+void Fan::UpdateTach()
+{
+	bool bLevel = GetTachLevel(m_pAVR->cycle);
+	if (bLevel != m_bPulseState)
+		RaiseIRQ(TACH_OUT, m_bPulseState = bLevel);
+}
+
+bool Fan::NeedsEdges()
+{
+	if (!m_bPinAttached)
+		return true;
+	if (m_pTachVector && avr_regbit_get(m_pAVR, m_pTachVector->enable))
+		return true;
+	return m_pPCIntPort && avr_regbit_get(m_pAVR, m_pPCIntPort->pcint.enable) && (m_pAVR->data[m_pPCIntPort->r_pcint] & (1U << m_uiTachBit));
+}
+
+void Fan::ScheduleTach()
+{
+	CancelTimer(m_fcnTachChange,this);
+	CancelTimer(m_fcnTachWatch,this);
+	if (!m_uiHalfCycles)
+		return;
+	if (NeedsEdges())
+		RegisterTimer(m_fcnTachChange, m_uiHalfCycles - (m_pAVR->cycle - m_uiPhase) % m_uiHalfCycles, this);
+	else
+		RegisterTimerUsec(m_fcnTachWatch, m_uiWatchUs, this);
+}
+
 avr_cycle_count_t Fan::OnTachChange(avr_t * avr, avr_cycle_count_t when)
 {
-    RaiseIRQ(TACH_OUT, m_bPulseState^=1);
-    RegisterTimerUsec(m_fcnTachChange,m_uiUsecPulse,this);
-    return 0;
+	UpdateTach();
+	if (!NeedsEdges())
+	{
+		RegisterTimerUsec(m_fcnTachWatch, m_uiWatchUs, this);
+		return 0;
+	}
+	return when + m_uiHalfCycles - (when - m_uiPhase) % m_uiHalfCycles;
+}
+
+avr_cycle_count_t Fan::OnTachWatch(avr_t *avr, avr_cycle_count_t when)
+{
+	if (!NeedsEdges())
+		return when + avr_usec_to_cycles(avr, m_uiWatchUs);
+	UpdateTach();
+	ScheduleTach();
+	return 0;
+}
+
+uint8_t Fan::OnTachPinRead(avr_t *avr, avr_io_addr_t addr, void *param)
+{
+	Fan *p = static_cast<Fan*>(param);
+	p->UpdateTach(); // Lands in the PIN register before the port returns it.
+	return p->m_fcnPinRead ? p->m_fcnPinRead(avr, addr, p->m_pPinReadParam) : avr->data[addr];
+}
+
+void Fan::AttachTachPin(const PortPin_t &pin)
+{
+	avr_ioport_t *pPort = nullptr;
+	for (avr_io_t *pIO = m_pAVR->io_port; pIO; pIO = pIO->next)
+	{
+		if (!strcmp(pIO->kind, "port") && reinterpret_cast<avr_ioport_t*>(pIO)->name == pin.cPort)
+			pPort = reinterpret_cast<avr_ioport_t*>(pIO); // io is its first member.
+		else if (!strcmp(pIO->kind, "extint"))
+			for (auto &eint : reinterpret_cast<avr_extint_t*>(pIO)->eint)
+				if (eint.port_ioctl == static_cast<uint32_t>(AVR_IOCTL_IOPORT_GETIRQ(pin.cPort)) && eint.port_pin == pin.uiBit)
+					m_pTachVector = &eint.vector;
+	}
+	if (!pPort || !pPort->r_pin)
+		return; // Stays on a timer per edge.
+	if (pPort->r_pcint)
+		m_pPCIntPort = pPort;
+	m_uiTachBit = pin.uiBit;
+	// The read slot only takes one handler, so chain to whoever had it (the port).
+	auto &io = m_pAVR->io[AVR_DATA_TO_IO(pPort->r_pin)];
+	m_fcnPinRead = io.r.c;
+	m_pPinReadParam = io.r.param;
+	io.r.c = OnTachPinRead;
+	io.r.param = this;
+	m_bPinAttached = true;
+	ScheduleTach();
 }
 
 void Fan::Draw()
@@ -60,7 +148,10 @@ void Fan::Draw()
         glTranslatef(9,5,-1);
         glScalef(0.10,-0.05,1);
 		if (bOn)
+		{
 			m_uiRot = (m_uiRot + (2*(m_uiPWM)/10))%360;
+			RedrawFlag::Set(); // Keep spinning.
+		}
 		glRotatef(m_uiRot,0,0,-1);
 		glTranslatef(-50,-50,0);
 		glPushAttrib(GL_LINE_BIT);
@@ -88,6 +179,7 @@ Scriptable::LineStatus Fan::ProcessAction(unsigned int ID, const vector<string>
 void Fan::OnPWMChange(struct avr_irq_t * irq, uint32_t value)
 {
     m_uiPWM = value;
+    RedrawFlag::Set();
     if (m_bAuto) // Only update RPM if auto (pwm-controlled). Else user supplied RPM.
         m_uiCurrentRPM = ((m_uiMaxRPM)*value)/255;
 
@@ -97,14 +189,15 @@ void Fan::OnPWMChange(struct avr_irq_t * irq, uint32_t value)
     float fuSPerRev = 1000000*fSecPerRev;
     m_uiUsecPulse = fuSPerRev/4; // 4 pulses per rev.
     TRACE(printf("New PWM(%u)/RPM/cyc: %u / %u / %u\n", m_uiMaxRPM, m_uiPWM, m_uiCurrentRPM, m_uiUsecPulse));
-    if (m_uiCurrentRPM>0)
-    {
-        RegisterTimerUsec(m_fcnTachChange,m_uiUsecPulse,this);
-    }
-    else
-    {
-        CancelTimer(m_fcnTachChange,this);
-    }
+    avr_cycle_count_t uiHalfCycles = m_uiCurrentRPM>0 ? avr_usec_to_cycles(m_pAVR, m_uiUsecPulse) : 0;
+    if (uiHalfCycles == m_uiHalfCycles)
+        return;
+    // Finish the old speed's edges, then start the new one from here.
+    UpdateTach();
+    m_uiPhase = m_pAVR->cycle;
+    m_bPhaseLevel = m_bPulseState;
+    m_uiHalfCycles = uiHalfCycles;
+    ScheduleTach();
 }
 
 // Just a dummy wrapper to handle non-PWM control (digitalWrite)
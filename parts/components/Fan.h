@@ -28,9 +28,12 @@
 #include "IScriptable.h"       // for IScriptable::LineStatus
 #include "Scriptable.h"        // for Scriptable
 #include "SoftPWMable.h"       // for SoftPWMable
+#include "avr_ioport.h"        // for avr_ioport_t
 #include "sim_avr.h"           // for avr_t
-#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t, avr_io_addr_t
 #include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_interrupts.h"    // for avr_int_vector_t
+#include "sim_io.h"            // for avr_io_read_t
 #include "sim_irq.h"           // for avr_irq_t
 
 class Fan:public SoftPWMable, public Scriptable
@@ -55,6 +58,10 @@ public:
 	// Initializes the fan with avr, and connects to irqTach (out), irqDigital (in), and irqPWM (pwm control value)
 	void Init(struct avr_t* avr, avr_irq_t *irqTach, avr_irq_t *irqDigital, avr_irq_t *irqPWM);
 
+	// The MCU pin irqTach is, so the tach can follow the firmware: while it has no interrupt on the
+	// pin, the level is only worked out when the port is read, instead of a timer for every edge.
+	void AttachTachPin(const PortPin_t &pin);
+
 	// Flags the fan as stalled/jammed. or not.
 	void SetStall(bool bStall);
 
@@ -77,6 +84,17 @@ public:
 	private:
 		// Callback for tach pulse update.
 		avr_cycle_count_t OnTachChange(avr_t *avr, avr_cycle_count_t when);
+		// While sampled, checks now and then whether the firmware has started taking interrupts on the pin.
+		avr_cycle_count_t OnTachWatch(avr_t *avr, avr_cycle_count_t when);
+		static uint8_t OnTachPinRead(avr_t *avr, avr_io_addr_t addr, void *param);
+
+		// The level the tach has at uiCycle.
+		bool GetTachLevel(avr_cycle_count_t uiCycle);
+		// Raises TACH_OUT if the level has moved on since it was last raised.
+		void UpdateTach();
+		// Arms the edge timer or the watch, whichever the firmware needs now.
+		void ScheduleTach();
+		bool NeedsEdges();
 
 
 		bool m_bAuto = true;
@@ -87,11 +105,23 @@ public:
 		uint16_t m_uiMaxRPM = 2000;
 		uint16_t m_uiCurrentRPM = 0;
 		uint16_t m_uiUsecPulse = 0;
+		// The tach toggles every m_uiHalfCycles from m_uiPhase on (never when 0), m_bPhaseLevel being the level at m_uiPhase.
+		avr_cycle_count_t m_uiPhase = 0, m_uiHalfCycles = 0;
+		bool m_bPhaseLevel = false;
+		// The attached pin: an INTn vector, or the pin-change port, that needs real edges when enabled.
+		bool m_bPinAttached = false;
+		avr_int_vector_t *m_pTachVector = nullptr;
+		avr_ioport_t *m_pPCIntPort = nullptr;
+		uint8_t m_uiTachBit = 0;
+		avr_io_read_t m_fcnPinRead = nullptr; // The port's own PIN read, and whoever else hooked it first.
+		void *m_pPinReadParam = nullptr;
+		static constexpr uint32_t m_uiWatchUs = 50000;
 		uint16_t m_uiRot = 0;
 
 		char m_chrSym = ' ';
 
 		avr_cycle_timer_t m_fcnTachChange = MAKE_C_TIMER_CALLBACK(Fan,OnTachChange);
+		avr_cycle_timer_t m_fcnTachWatch = MAKE_C_TIMER_CALLBACK(Fan,OnTachWatch);
 
 
 		enum Actions
@@ -22,15 +22,36 @@
 
 #include "GCodeSniffer.h"
 #include <stdio.h>     // for printf
-#include "avr_uart.h"  // for ::UART_IRQ_OUTPUT, AVR_IOCTL_UART_GETIRQ
+#include <string.h>    // for memcpy, strncmp
+#include <unistd.h>    // for usleep
+#include "Log.h"       // for LOG, Log
+#include "ThreadPolicy.h" // for ThreadPolicy
+#include "avr_uart.h"  // for ::UART_IRQ_OUTPUT, ::UART_IRQ_INPUT, AVR_IOCTL_UART_GETIRQ
 #include "sim_io.h"    // for avr_io_getirq
 
+constexpr uint8_t GCodeSniffer::m_uiMaxLine;
+
+static Log::Module logSniffer("GCodeSniffer");
+
+GCodeSniffer::~GCodeSniffer()
+{
+	if (!m_thread)
+		return;
+	m_bQuit = true;
+	pthread_join(m_thread, nullptr);
+	PrintStats();
+}
+
 void GCodeSniffer::OnByteIn(struct avr_irq_t * irq, uint32_t value)
 {
     unsigned char c = value&0xFF;
+	if (m_thread)
+		OnLineByte(m_lineTX, true, c);
 	if (m_bNewLine && c==m_chrCode)
 	{
 		m_bCapture = true;
+		m_uiCode = 0;
+		m_bHaveDigit = false;
 		return;
 	}
 
@@ -41,20 +62,211 @@ void GCodeSniffer::OnByteIn(struct avr_irq_t * irq, uint32_t value)
 		if (c == ' ' || m_bNewLine)
 		{
 			m_bCapture = false;
-			printf("Captured code %s\n", m_strLine.c_str());
-			uint32_t uiOut = stoi(m_strLine);
-			RaiseIRQ(CODEVAL_OUT,uiOut);
-			m_strLine.clear();
+			if (m_bHaveDigit)
+			{
+				LOG(logSniffer, Debug, "UART%c: captured %c%u", m_chrUART, m_chrCode, m_uiCode);
+				RaiseIRQ(CODEVAL_OUT,m_uiCode);
+			}
+		}
+		else if (c>='0' && c<='9')
+		{
+			m_uiCode = (m_uiCode*10) + (c-'0');
+			m_bHaveDigit = true;
 		}
+	}
+}
+
+void GCodeSniffer::OnRXIn(struct avr_irq_t * irq, uint32_t value)
+{
+	OnLineByte(m_lineRX, false, value&0xFF);
+}
+
+void GCodeSniffer::OnLineByte(Assembler_t &line, bool bTX, unsigned char c)
+{
+	if (c == '\r')
+		return;
+	if (c != '\n')
+	{
+		if (line.uiLen < m_uiMaxLine)
+			line.chrBuf[line.uiLen++] = c;
+		return;
+	}
+	Line_t *pOut = NewRecord(bTX, false, m_pAVR->cycle);
+	if (pOut)
+	{
+		pOut->uiLen = line.uiLen;
+		memcpy(pOut->chrText, line.chrBuf, line.uiLen);
+		m_lines.CommitWrite(1);
+	}
+	line.uiLen = 0;
+	if (!bTX && !m_vAxes.empty())
+		ArmStepWatch(true);
+}
+
+GCodeSniffer::Line_t* GCodeSniffer::NewRecord(bool bTX, bool bStep, avr_cycle_count_t uiCycle)
+{
+	Line_t *pOut;
+	if (m_lines.GetWriteSpan(pOut) == 0)
+	{
+		m_uiDropped++;
+		return nullptr;
+	}
+	pOut->uiCycle = uiCycle;
+	pOut->bTX = bTX;
+	pOut->bStep = bStep;
+	pOut->uiLen = 0;
+	pOut->uiLastStep = 0;
+	for (auto pAxis : m_vAxes)
+		pOut->uiLastStep = max(pOut->uiLastStep, pAxis->Get().uiCycle);
+	return pOut;
+}
+
+void GCodeSniffer::WatchMotion(const std::vector<MotionChannel*> &vAxes)
+{
+	if (!m_thread)
+		return;
+	m_vAxes = vAxes;
+	for (auto pAxis : m_vAxes)
+		m_vWatch.push_back(pAxis->Watch([this](const MotionChannel::MotionSample_t &s) { OnStep(s); }, 1.f, 0.f));
+}
+
+void GCodeSniffer::ArmStepWatch(bool bOn)
+{
+	if (m_bStepArmed == bOn)
+		return;
+	m_bStepArmed = bOn;
+	for (size_t i=0; i<m_vAxes.size(); i++)
+		m_vAxes[i]->SetWindow(m_vWatch[i], bOn ? -1e9f : 1.f, bOn ? 1e9f : 0.f);
+}
+
+void GCodeSniffer::OnStep(const MotionChannel::MotionSample_t &sample)
+{
+	ArmStepWatch(false);
+	// The sample is already updated, so uiLastStep is this step.
+	Line_t *pOut = NewRecord(false, true, sample.uiCycle);
+	if (pOut)
+		m_lines.CommitWrite(1);
+}
+
+void* GCodeSniffer::Run()
+{
+	Line_t line;
+	while (true)
+	{
+		if (m_lines.Pop(line))
+			Consume(line);
+		else if (m_bQuit)
+			break;
 		else
-			m_strLine.push_back(c);
+			usleep(m_uiPollMs*1000);
+	}
+	return nullptr;
+}
+
+void GCodeSniffer::Consume(const Line_t &line)
+{
+	if (line.bStep)
+	{
+		ConsumeMotion(line, "");
+		return;
+	}
+	const char *pText = line.chrText, *pEnd = line.chrText + line.uiLen;
+	if (line.bTX != m_bCmdsOnTX)
+	{
+		if (line.uiLen >= 2 && strncmp(pText, "ok", 2) == 0 && !m_pending.empty())
+		{
+			Stat_t &stat = m_stats[m_pending.front().second];
+			uint64_t uiLatency = line.uiCycle - m_pending.front().first;
+			m_pending.pop_front();
+			stat.uiCount++;
+			stat.uiSum += uiLatency;
+			stat.uiMin = min(stat.uiMin, uiLatency);
+			stat.uiMax = max(stat.uiMax, uiLatency);
+		}
+		return;
+	}
+	// The command is the first word that isn't a line number, e.g. "N12 G1 X5*71" is G1.
+	while (pText<pEnd)
+	{
+		while (pText<pEnd && *pText==' ')
+			pText++;
+		const char *pWord = pText;
+		while (pText<pEnd && *pText!=' ' && *pText!='*')
+			pText++;
+		if (pText>pWord && *pWord!='N' && *pWord!=';')
+		{
+			string strCode(pWord, pText);
+			if (!m_vAxes.empty())
+				ConsumeMotion(line, strCode);
+			m_pending.emplace_back(line.uiCycle, strCode);
+			break;
+		}
+		if (pText<pEnd && *pText=='*')
+			break;
 	}
 }
 
-void GCodeSniffer::Init(struct avr_t * avr, char chrUART)
+void GCodeSniffer::ConsumeMotion(const Line_t &line, const string &strCode)
+{
+	if (line.bStep)
+	{
+		// The oldest command that came in to idle steppers gets the credit; the rest just queued up.
+		if (!m_toMotion.empty() && m_toMotion.front().first <= line.uiCycle)
+			m_motionLatency[m_toMotion.front().second].Add(line.uiCycle - m_toMotion.front().first);
+		m_toMotion.clear();
+		return;
+	}
+	if (strCode.empty() || strCode[0]!='G')
+		return;
+	bool bIdle = line.uiCycle - line.uiLastStep > (m_uiFreq*m_uiIdleUs)/1000000U;
+	if (bIdle)
+	{
+		m_uiQueued = 0;
+		m_toMotion.emplace_back(line.uiCycle, strCode);
+	}
+	else
+		m_uiQueued++;
+	m_queueDepth.Add(m_uiQueued);
+}
+
+void GCodeSniffer::PrintStats()
+{
+	double dUs = 1000000.0/static_cast<double>(m_uiFreq);
+	if (!m_motionLatency.empty())
+	{
+		printf("GCode to first step, UART%c (commands arriving to idle steppers, us of simulated time):\n", m_chrUART);
+		printf("  %-8s %8s %10s %10s %10s %10s %10s\n", "Code", "Count", "Min", "p50", "p90", "p99", "Max");
+		for (auto &it : m_motionLatency)
+		{
+			const Histogram &h = it.second;
+			printf("  %-8s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", it.first.c_str(), static_cast<unsigned long long>(h.GetCount()),
+				dUs*h.GetMin(), dUs*h.GetPercentile(50), dUs*h.GetPercentile(90), dUs*h.GetPercentile(99), dUs*h.GetMax());
+		}
+		printf("  Motion commands queued behind moving steppers: p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+			static_cast<unsigned long long>(m_queueDepth.GetPercentile(50)), static_cast<unsigned long long>(m_queueDepth.GetPercentile(90)),
+			static_cast<unsigned long long>(m_queueDepth.GetPercentile(99)), static_cast<unsigned long long>(m_queueDepth.GetMax()));
+	}
+	if (m_stats.empty())
+		return;
+	double dMs = 1000.0/static_cast<double>(m_uiFreq);
+	printf("GCode latency, UART%c (command -> ok, ms of simulated time):\n", m_chrUART);
+	printf("  %-8s %8s %10s %10s %10s\n", "Code", "Count", "Avg", "Min", "Max");
+	for (auto &it : m_stats)
+	{
+		const Stat_t &s = it.second;
+		printf("  %-8s %8u %10.3f %10.3f %10.3f\n", it.first.c_str(), s.uiCount,
+			dMs*static_cast<double>(s.uiSum)/static_cast<double>(s.uiCount), dMs*static_cast<double>(s.uiMin), dMs*static_cast<double>(s.uiMax));
+	}
+	if (m_uiDropped)
+		printf("  (%u lines dropped, the stats thread fell behind)\n", m_uiDropped.load());
+}
+
+void GCodeSniffer::Init(struct avr_t * avr, char chrUART, bool bCmdsOnTX)
 {
 	_Init(avr, this);
 	m_chrUART = chrUART;
+	m_bCmdsOnTX = bCmdsOnTX;
+	m_uiFreq = avr->frequency;
 	RegisterNotify(BYTE_IN, MAKE_C_CALLBACK(GCodeSniffer, OnByteIn),this);
 		// disable the stdio dump, as we're pritning in hex.
 
@@ -62,6 +274,18 @@ void GCodeSniffer::Init(struct avr_t * avr, char chrUART)
 	if (src)
 		ConnectFrom(src, BYTE_IN);
 
-    printf("UART %c is now being monitored for %c codes\n",m_chrUART,m_chrCode);
+	if (IsLatencyStatsOn())
+	{
+		avr_irq_t * dst = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_INPUT);
+		if (dst)
+			ConnectFrom(dst, RX_IN);
+		RegisterNotify(RX_IN, MAKE_C_CALLBACK(GCodeSniffer, OnRXIn),this);
+		auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "gcode-sniffer"); GCodeSniffer *p = static_cast<GCodeSniffer*>(param); return p->Run(); };
+		pthread_create(&m_thread, nullptr, fcnRun, this);
+		LOG(logSniffer, Info, "UART %c: collecting G-code latency stats", m_chrUART);
+	}
+
+	if (m_chrCode)
+		LOG(logSniffer, Info, "UART %c is now being monitored for %c codes",m_chrUART,m_chrCode);
 
 }
@@ -22,10 +22,19 @@
 
 #pragma once
 
-#include <stdint.h>          // for uint32_t
+#include <pthread.h>         // for pthread_t
+#include <stdint.h>          // for uint32_t, uint8_t, uint64_t
+#include <atomic>            // for atomic_bool, atomic_uint
+#include <deque>             // for deque
+#include <map>               // for map
 #include <string>            // for string
+#include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
+#include "Histogram.h"       // for Histogram
+#include "MotionChannel.h"   // for MotionChannel, MotionChannel::MotionSample_t
+#include "SPSCRing.h"        // for SPSCRing
 #include "sim_avr.h"         // for avr_t
+#include "sim_avr_types.h"   // for avr_cycle_count_t
 #include "sim_irq.h"         // for avr_irq_t
 
 using namespace std;
@@ -33,25 +42,94 @@ using namespace std;
 class GCodeSniffer : public BasePeripheral
 {
 	public:
-		#define IRQPAIRS _IRQ(BYTE_IN,"8<logger.in") _IRQ(CODEVAL_OUT, "8>val_out")
+		#define IRQPAIRS _IRQ(BYTE_IN,"8<logger.in") _IRQ(RX_IN,"8<logger.rx_in") _IRQ(CODEVAL_OUT, "8>val_out")
 		#include "IRQHelper.h"
 
-		// Creates a logger that sniffs for
+		// Creates a logger that sniffs for chrSniff codes (0 for none, e.g. just latency stats)
 		GCodeSniffer(unsigned char chrSniff):m_chrCode(chrSniff){};
 
-		// Shuts down the logger/closes file.
-		~GCodeSniffer(){};
+		// Stops the stats thread and prints the latency summary, if enabled.
+		~GCodeSniffer();
 
-		// Registers with SimAVR.
-		void Init(avr_t *avr, char chrUART);
+		// Registers with SimAVR. bCmdsOnTX says which way the commands go: true if the AVR sends
+		// them (e.g. to the MMU), false if it receives them (e.g. from the host on UART0).
+		void Init(avr_t *avr, char chrUART, bool bCmdsOnTX = true);
+
+		// Collects per-command latency (command line -> "ok") in the sniffers created after this.
+		static void SetLatencyStats(bool bOn) { GetStatsOn() = bOn; }
+
+		// Also profiles each command received to the first step pulse after it (when it arrives to idle
+		// steppers), plus how many motion commands were queued behind moving ones. Call after Init.
+		void WatchMotion(const std::vector<MotionChannel*> &vAxes);
+		static bool IsLatencyStatsOn() { return GetStatsOn(); }
+
+		static constexpr uint8_t m_uiMaxLine = 95;
+
+		typedef struct Line_t
+		{
+			avr_cycle_count_t uiCycle; // At the newline, or of the step
+			avr_cycle_count_t uiLastStep; // Latest step on any watched axis before this line
+			bool bTX, bStep;
+			uint8_t uiLen;
+			char chrText[m_uiMaxLine];
+		} Line_t;
 
 	private:
 
 		void OnByteIn(avr_irq_t *irq, uint32_t value);
+		void OnRXIn(avr_irq_t *irq, uint32_t value);
+
+		// Line assembly for one direction, no allocation.
+		typedef struct Assembler_t
+		{
+			uint8_t uiLen = 0;
+			char chrBuf[m_uiMaxLine];
+		} Assembler_t;
+		void OnLineByte(Assembler_t &line, bool bTX, unsigned char c);
+
+		// Stats thread.
+		void* Run();
+		void Consume(const Line_t &line);
+		void ConsumeMotion(const Line_t &line, const string &strCode);
+		void OnStep(const MotionChannel::MotionSample_t &sample);
+		void ArmStepWatch(bool bOn);
+		Line_t* NewRecord(bool bTX, bool bStep, avr_cycle_count_t uiCycle);
+		void PrintStats();
+
+		static bool& GetStatsOn() { static bool bOn = false; return bOn; }
 
 		unsigned char m_chrCode;
-		string m_strLine;
-		bool m_bNewLine = false, m_bCapture = false;
+		uint32_t m_uiCode = 0;
+		bool m_bNewLine = false, m_bCapture = false, m_bHaveDigit = false;
 		char m_chrUART = '0';
+		bool m_bCmdsOnTX = true;
+
+		Assembler_t m_lineTX, m_lineRX;
+		SPSCRing<Line_t> m_lines {256};
+		atomic_uint m_uiDropped {0};
+		pthread_t m_thread = 0;
+		atomic_bool m_bQuit {false};
+		uint64_t m_uiFreq = 16000000;
+
+		// Consumer thread only.
+		typedef struct Stat_t
+		{
+			uint32_t uiCount = 0;
+			uint64_t uiSum = 0, uiMin = UINT64_MAX, uiMax = 0; // cycles
+		} Stat_t;
+		deque<pair<avr_cycle_count_t,string>> m_pending; // Commands waiting for their ok
+		map<string,Stat_t> m_stats;
+
+		// Motion profiling. The step watch is only open between a received line and the next step.
+		vector<MotionChannel*> m_vAxes;
+		vector<size_t> m_vWatch;
+		bool m_bStepArmed = false;
+		// Consumer thread only.
+		deque<pair<avr_cycle_count_t,string>> m_toMotion; // Received to idle steppers, waiting on a step
+		uint32_t m_uiQueued = 0; // Motion commands received since the steppers were last idle
+		map<string,Histogram> m_motionLatency;
+		Histogram m_queueDepth;
+		static constexpr uint32_t m_uiIdleUs = 2000; // No steps for this long counts as idle
+		static constexpr uint32_t m_uiPollMs = 5;
 
 };
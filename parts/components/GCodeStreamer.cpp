@@ -0,0 +1,209 @@
+/*
+	GCodeStreamer.cpp - Prints a G-code file over a UART, as a host would.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GCodeStreamer.h"
+#include <stdio.h>       // for printf, fprintf, stderr
+#include <stdlib.h>      // for strtoul
+#include <cstring>       // for memchr, strcmp, strncmp
+#include <fstream>       // IWYU pragma: keep for ifstream
+#include <iterator>      // for istreambuf_iterator
+#include "ScriptHost.h"  // for ScriptHost
+#include "avr_uart.h"    // for AVR_IOCTL_UART_GETIRQ, ::UART_IRQ_INPUT, ::UAR...
+#include "sim_io.h"      // for avr_io_getirq
+#include "sim_time.h"    // for avr_hz_to_cycles
+
+GCodeStreamer::GCodeStreamer():Scriptable("GCodeStream")
+{
+	RegisterAction("WaitForFinish","Waits for the --gcode-stream file to have been sent and acknowledged in full.",ActWaitForFinish);
+}
+
+void GCodeStreamer::Init(avr_t *avr, char chrUART)
+{
+	_Init(avr, this);
+	m_strFile = GetDefaultFile();
+	std::ifstream fIn(m_strFile, std::ios::binary);
+	if (!fIn.good())
+	{
+		fprintf(stderr, "GCodeStreamer: could not open %s, nothing to send.\n", m_strFile.c_str());
+		m_bDone = true;
+		return;
+	}
+	m_strData.assign(std::istreambuf_iterator<char>(fIn), std::istreambuf_iterator<char>());
+	// One pass over the file for where the commands are, lines are only made up as they go out.
+	const char *pData = m_strData.data(), *pEnd = pData + m_strData.size();
+	for (const char *pLine = pData; pLine < pEnd;)
+	{
+		const char *pEOL = static_cast<const char*>(memchr(pLine, '\n', pEnd - pLine));
+		if (!pEOL)
+			pEOL = pEnd;
+		const char *pCmdEnd = static_cast<const char*>(memchr(pLine, ';', pEOL - pLine));
+		if (!pCmdEnd)
+			pCmdEnd = pEOL;
+		while (pLine < pCmdEnd && (*pLine == ' ' || *pLine == '\t'))
+			pLine++;
+		while (pCmdEnd > pLine && (pCmdEnd[-1] == ' ' || pCmdEnd[-1] == '\t' || pCmdEnd[-1] == '\r'))
+			pCmdEnd--;
+		if (pCmdEnd > pLine)
+			m_vCmds.push_back({static_cast<uint32_t>(pLine - pData), static_cast<uint32_t>(pCmdEnd - pLine)});
+		pLine = pEOL + 1;
+	}
+	printf("GCodeStreamer: %zu commands from %s, sending once the firmware starts.\n", m_vCmds.size(), m_strFile.c_str());
+
+	RegisterNotify(BYTE_IN, MAKE_C_CALLBACK(GCodeStreamer, OnByteIn),this);
+	avr_irq_t * src = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XOFF);
+	if (src && dst) {
+		ConnectFrom(src, BYTE_IN);
+		ConnectTo(BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, MAKE_C_CALLBACK(GCodeStreamer,OnXOnIn), this);
+	if (xoff)
+		avr_irq_register_notify(xoff, MAKE_C_CALLBACK(GCodeStreamer,OnXOffIn),this);
+}
+
+void GCodeStreamer::OnByteIn(avr_irq_t *irq, uint32_t value)
+{
+	uint8_t c = value & 0xFFU;
+	if (c == '\n')
+	{
+		OnLine();
+		m_uiLineLen = 0;
+	}
+	else if (m_uiLineLen < LINE_BUFFER - 1U)
+		m_chLine[m_uiLineLen++] = c;
+}
+
+void GCodeStreamer::OnLine()
+{
+	if (m_bDone)
+		return;
+	m_chLine[m_uiLineLen] = '\0';
+	if (m_uiLineLen && m_chLine[m_uiLineLen-1] == '\r')
+		m_chLine[--m_uiLineLen] = '\0';
+	if (strcmp(m_chLine, "start") == 0)
+	{
+		if (m_bStarted && !m_bDone)
+		{
+			fprintf(stderr, "GCodeStreamer: the printer restarted at line %u, stopping.\n", m_uiNext);
+			m_bDone = true;
+			ScriptHost::Notify();
+		}
+		else if (!m_bStarted)
+		{
+			m_bStarted = true;
+			m_uiStartCycle = m_pAVR->cycle;
+			SendNext();
+		}
+		return;
+	}
+	if (!m_bStarted)
+		return;
+	if (strncmp(m_chLine, "Resend:", 7) == 0 || strncmp(m_chLine, "rs ", 3) == 0)
+	{
+		// The "ok" that follows sends it.
+		uint32_t uiLine = strtoul(m_chLine + (m_chLine[0] == 'R' ? 7 : 3), nullptr, 10);
+		m_uiNext = uiLine > 0 && uiLine <= m_vCmds.size() ? uiLine : 1;
+		m_uiResends++;
+	}
+	else if (strncmp(m_chLine, "ok", 2) == 0 && m_uiOutPos == m_strOut.size()) // Not halfway through a line, there'd be no ok for it yet.
+		SendNext();
+	else if (strncmp(m_chLine, "Error:", 6) == 0)
+		printf("GCodeStreamer: at line %u the firmware said: %s\n", m_uiNext - 1, m_chLine);
+}
+
+void GCodeStreamer::SendNext()
+{
+	if (m_uiNext > m_vCmds.size())
+	{
+		double dSec = static_cast<double>(m_pAVR->cycle - m_uiStartCycle)/m_pAVR->frequency;
+		printf("GCodeStreamer: %s done, %zu lines (%llu bytes) in %.3f s simulated, %u resends.\n", m_strFile.c_str(), m_vCmds.size(),
+			static_cast<unsigned long long>(m_uiBytes), dSec, m_uiResends);
+		m_bDone = true;
+		ScriptHost::Notify();
+		return;
+	}
+	if (m_uiNext == 0)
+		m_strOut = "M110 N0";
+	else
+	{
+		const Cmd_t &cmd = m_vCmds[m_uiNext-1];
+		m_strOut = "N" + std::to_string(m_uiNext) + " ";
+		m_strOut.append(m_strData, cmd.uiOffset, cmd.uiLen);
+		uint8_t uiSum = 0;
+		for (char c : m_strOut)
+			uiSum ^= static_cast<uint8_t>(c);
+		m_strOut += "*" + std::to_string(uiSum);
+	}
+	m_strOut += '\n';
+	m_uiOutPos = 0;
+	m_uiNext++;
+	FlushData();
+	if (m_bXOn && m_uiOutPos < m_strOut.size())
+		RegisterTimer(m_fcnFlush,avr_hz_to_cycles(m_pAVR, 1000),this);
+}
+
+// XOFF may come synchronously from any RaiseIRQ.
+void GCodeStreamer::FlushData()
+{
+	while (m_bXOn && m_uiOutPos < m_strOut.size())
+	{
+		m_uiBytes++;
+		RaiseIRQ(BYTE_OUT, static_cast<uint8_t>(m_strOut[m_uiOutPos++]));
+	}
+}
+
+avr_cycle_count_t GCodeStreamer::OnFlushTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	FlushData();
+	return m_bXOn && m_uiOutPos < m_strOut.size() ? when + avr_hz_to_cycles(m_pAVR, 1000) : 0;
+}
+
+void GCodeStreamer::OnXOnIn(avr_irq_t *irq, uint32_t value)
+{
+	m_bXOn = true;
+	FlushData();
+	if (m_bXOn && m_uiOutPos < m_strOut.size())
+		RegisterTimer(m_fcnFlush,avr_hz_to_cycles(m_pAVR, 1000),this);
+}
+
+void GCodeStreamer::OnXOffIn(avr_irq_t *irq, uint32_t value)
+{
+	m_bXOn = false;
+	CancelTimer(m_fcnFlush,this);
+}
+
+Scriptable::LineStatus GCodeStreamer::ProcessAction(unsigned int ID, const vector<string> &args)
+{
+	switch (ID)
+	{
+		case ActWaitForFinish:
+			if (!m_pAVR)
+				return IssueLineError("No --gcode-stream file is being sent.");
+			if (m_bDone)
+				return LineStatus::Finished;
+			ScriptHost::WakeOnNotify();
+			return LineStatus::Waiting;
+	}
+	return LineStatus::Unhandled;
+}
@@ -0,0 +1,96 @@
+/*
+	GCodeStreamer.h - Prints a G-code file over a UART, as a host would.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint8_t
+#include <string>              // for string
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "IScriptable.h"       // for IScriptable::LineStatus
+#include "Scriptable.h"        // for Scriptable
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+// Streams a G-code file into the UART from the AVR thread, one line per "ok" the way host
+// software does, with line numbers and checksums, and going back on "Resend: N". Bytes go
+// into the UART's FIFO while it has room, so the firmware receives them at the line rate.
+// Sending starts once the firmware prints "start". Leave the PTY on the same UART alone meanwhile.
+class GCodeStreamer: public BasePeripheral, public Scriptable
+{
+	public:
+		#define IRQPAIRS _IRQ(BYTE_IN,"8<gcode_stream.in") _IRQ(BYTE_OUT,"8>gcode_stream.out")
+		#include "IRQHelper.h"
+
+		GCodeStreamer();
+
+		// Set from the command line before the printers are created.
+		static void SetDefaultFile(const std::string &strFile) { GetDefaultFile() = strFile; }
+		static inline bool IsEnabled() { return !GetDefaultFile().empty(); }
+
+		// Loads the file and attaches to the UART.
+		void Init(avr_t *avr, char chrUART);
+
+	protected:
+		LineStatus ProcessAction(unsigned int ID, const vector<string> &args) override;
+
+	private:
+		static std::string& GetDefaultFile() { static std::string strFile; return strFile; }
+
+		void OnByteIn(avr_irq_t *irq, uint32_t value);
+		void OnXOnIn(avr_irq_t *irq, uint32_t value);
+		void OnXOffIn(avr_irq_t *irq, uint32_t value);
+		avr_cycle_count_t OnFlushTimer(avr_t *avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnFlush = MAKE_C_TIMER_CALLBACK(GCodeStreamer,OnFlushTimer);
+
+		void OnLine();
+		// Queues the next line to go out, numbered and checksummed.
+		void SendNext();
+		void FlushData();
+
+		// The commands, in the file: offset and length, comments and whitespace trimmed.
+		typedef struct Cmd_t
+		{
+			uint32_t uiOffset, uiLen;
+		} Cmd_t;
+
+		std::string m_strFile, m_strData;
+		std::vector<Cmd_t> m_vCmds;
+
+		// Line N (from 1) is m_vCmds[N-1], N0 is the M110 that sets the numbering.
+		uint32_t m_uiNext = 0, m_uiResends = 0;
+		bool m_bStarted = false, m_bDone = false, m_bXOn = false;
+		avr_cycle_count_t m_uiStartCycle = 0;
+		uint64_t m_uiBytes = 0;
+
+		std::string m_strOut; // Going out
+		size_t m_uiOutPos = 0;
+		static constexpr unsigned int LINE_BUFFER = 96;
+		char m_chLine[LINE_BUFFER]; // Coming in
+		unsigned int m_uiLineLen = 0;
+
+		enum Actions
+		{
+			ActWaitForFinish
+		};
+};
@@ -52,15 +52,27 @@ void HC595::OnLatchIn(struct avr_irq_t * irq, uint32_t value)
 {
 	if (!irq->value && value) {	// rising edge
 		uint32_t uiChanged = m_uiLatch ^ m_uiValue; // Grab the bits that have changed since last latch.
+		if (!uiChanged)
+			return; // Refresh with the same pattern, nothing downstream needs to hear about it.
 		m_uiLatch = m_uiValue;
 		RaiseIRQ(OUT, m_uiLatch);
-		for (int i=0; i<32; i++)
-			if (uiChanged & (1U<<i))
-				RaiseIRQ(BIT0+i,(m_uiLatch>>i) & 1);
-
+		if ((uiChanged >> m_uiPackShift) & m_uiPackMask)
+			RaiseIRQ(OUT_PACKED, (m_uiLatch >> m_uiPackShift) & m_uiPackMask);
+		while (uiChanged)
+		{
+			int i = __builtin_ctz(uiChanged);
+			uiChanged &= uiChanged - 1;
+			RaiseIRQ(BIT0+i,(m_uiLatch>>i) & 1);
+		}
 	}
 }
 
+void HC595::SetPackedOutput(uint8_t uiShift, uint8_t uiWidth)
+{
+	m_uiPackShift = uiShift;
+	m_uiPackMask = uiWidth >= 32 ? ~0U : (1U<<uiWidth) - 1U;
+}
+
 /*
  * called when a RESET signal is sent
  */
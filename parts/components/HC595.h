@@ -49,6 +49,7 @@ class HC595: public BasePeripheral
 			_IRQ(IN_CLOCK,"<hc959.clock_in") \
 			_IRQ(IN_DATA,"<hc959.data_in") \
 			_IRQ(OUT,"32>hc959.out") \
+			_IRQ(OUT_PACKED,"32>hc959.packed_out") \
 			_IRQ(BIT0	,">bit0") \
 			_IRQ(BIT1	,">bit1") \
 			_IRQ(BIT2	,">bit2") \
@@ -88,6 +89,10 @@ class HC595: public BasePeripheral
 
 		std::string GetName(){return "HC595";}
 
+		// Also publishes latch bits [uiShift, uiShift+uiWidth) as one value on OUT_PACKED,
+		// raised only when one of them changes. Defaults to the whole latch.
+		void SetPackedOutput(uint8_t uiShift, uint8_t uiWidth);
+
 	private:
 		// IRQ handlers.
 		void OnLatchIn(avr_irq_t *irq, uint32_t value);
@@ -99,6 +104,8 @@ class HC595: public BasePeripheral
 		uint32_t	m_uiLatch = 0;		// value "on the pins"
 		uint32_t 	m_uiValue = 0;		// value shifted in
 		uint8_t		m_uiCurBit =0;
+		uint8_t		m_uiPackShift = 0;
+		uint32_t	m_uiPackMask = ~0U;
 		//uint8_t		m_uiCurByte = 0;
 
 };
@@ -24,7 +24,9 @@
 #include <sim_time.h>        // for avr_usec_to_cycles
 #include <stdio.h>           // for printf
 #include <string.h>          // for memset
+#include <algorithm>         // for search
 #include <scoped_allocator>  // for allocator_traits<>::value_type
+#include "ScriptHost.h"      // for ScriptHost
 #include "Scriptable.h"      // for Scriptable
 #include "TelemetryHost.h"
 
@@ -45,13 +47,12 @@ void HD44780::ResetCursor()
 void HD44780::ClearScreen()
 {
 	{
-		std::lock_guard<std::mutex> lock(m_lock);
+		std::lock_guard<CountedMutex> lock(m_lock);
     	memset(m_vRam, ' ', sizeof(m_vRam));
 	}
+	BumpVersion();
 	SetFlag(HD44780_FLAG_DIRTY, 1);
 	RaiseIRQ(ADDR, m_uiCursor);
-	for (int i=0; i<m_uiHeight; i++)
-		m_vLines[i].assign(" ",m_uiWidth);
 }
 
 /*
@@ -66,6 +67,22 @@ avr_cycle_count_t HD44780::OnBusyTimeout(struct avr_t * avr,avr_cycle_count_t wh
 	return 0;
 }
 
+bool HD44780::ValidateAction(unsigned int iAction, const vector<string> &vArgs, string &strError)
+{
+	if (iAction != ActWaitForRegex || m_mRegex.count(vArgs.at(0)))
+		return true;
+	try
+	{
+		m_mRegex.emplace(vArgs.at(0), regex(vArgs.at(0))); // Compiled once, here, rather than when the line runs.
+	}
+	catch (const regex_error &e)
+	{
+		strError = string("Invalid regular expression: ") + e.what();
+		return false;
+	}
+	return true;
+}
+
 Scriptable::LineStatus HD44780::ProcessAction(unsigned int iAction, const vector<string> &vArgs)
 {
 	switch (iAction)
@@ -74,25 +91,53 @@ Scriptable::LineStatus HD44780::ProcessAction(unsigned int iAction, const vector
 			ToggleFlag(HD44780_FLAG_LOWNIBBLE);
 			return LineStatus::Finished;
 		case ActWaitForText:
+		case ActWaitForRegex:
+		{
 			int iLine = stoi(vArgs.at(1));
-			uint8_t uiLnChk = iLine<0 ? 0xFF : 1<<iLine;
-			if (!(uiLnChk & m_uiLineChg)) // NO changes to check against.
-				return LineStatus::Waiting;
-
 			if (iLine>=m_uiHeight || iLine<-1)
 				return IssueLineError(string("Line index ") + to_string(iLine) + " is out of range [-1," + to_string (m_uiHeight) + "]");
 
-			bool bResult = false;
-			if (iLine<0)
-				for (int i=0; i<m_uiHeight; i++)
+			// A new wait always gets a first look, after that only once the display has been written to.
+			string strKey = to_string(iAction) + ":" + vArgs.at(1) + ":" + vArgs.at(0);
+			uint32_t uiVersion = GetVersion();
+			if (strKey == m_strWaitKey && uiVersion == m_uiWaitVersion)
+			{
+				ScriptHost::WakeOnNotify();
+				return LineStatus::Waiting;
+			}
+			m_strWaitKey = strKey;
+			m_uiWaitVersion = uiVersion;
+
+			const regex *pRegex = nullptr;
+			if (iAction == ActWaitForRegex)
+			{
+				auto it = m_mRegex.find(vArgs.at(0));
+				if (it == m_mRegex.end())
 				{
-					bResult |= m_vLines.at(i).find(vArgs.at(0))!=string::npos;
-					if (bResult) break;
+					try
+					{
+						it = m_mRegex.emplace(vArgs.at(0), regex(vArgs.at(0))).first;
+					}
+					catch (const regex_error &e)
+					{
+						m_strWaitKey.clear();
+						return IssueLineError(string("Invalid regular expression: ") + e.what());
+					}
 				}
-			else
-				bResult = m_vLines.at(iLine).find(vArgs.at(0))!=string::npos;
-			m_uiLineChg^= iLine<0 ? 0xFF : 1<<iLine; // Reset line change tracking.
-			return bResult ? LineStatus::Finished : LineStatus::Waiting;
+				pRegex = &it->second;
+			}
+
+			const string &strText = vArgs.at(0);
+			int iFirst = iLine<0 ? 0 : iLine, iLast = iLine<0 ? m_uiHeight-1 : iLine;
+			for (int i=iFirst; i<=iLast; i++)
+			{
+				const char *pBegin = GetRow(i), *pEnd = pBegin + m_uiWidth;
+				if (pRegex ? regex_search(pBegin, pEnd, *pRegex) : search(pBegin, pEnd, strText.begin(), strText.end()) != pEnd)
+					return LineStatus::Finished;
+			}
+			ScriptHost::WakeOnNotify(); // Until the display is written to.
+			return LineStatus::Waiting;
+		}
 	}
 	return LineStatus::Unhandled;
 }
@@ -148,26 +193,19 @@ uint32_t HD44780::OnDataReady()
 	uint32_t delay = 37; // uS
 	if (m_bInCGRAM)
 	{
-		std::lock_guard<std::mutex> lock(m_lock);
+		std::lock_guard<CountedMutex> lock(m_lock);
 		m_cgRam[m_uiCGCursor] = m_uiDataPins;
+		BumpVersion();
 		TRACE(printf("hd44780_write_data %02x to CGRAM %02x\n",m_uiDataPins,m_uiCGCursor));
 		IncrementCGRAMCursor();
 	}
 	else
 	{
 		{
-			std::lock_guard<std::mutex> lock(m_lock);
+			std::lock_guard<CountedMutex> lock(m_lock);
 			m_vRam[m_uiCursor] = m_uiDataPins;
 		}
-
-		for (int i=0; i<m_uiHeight; i++) // Flag line change for search performance.
-			if (m_uiCursor>= m_lineOffsets[i] && m_uiCursor< (m_lineOffsets[i] + m_uiWidth))
-			{
-				int iPos =m_uiCursor - m_lineOffsets[i];
-				string &line = m_vLines[i];
-				line[iPos] = m_uiDataPins;
-				m_uiLineChg |= 1<<i;
-			}
+		BumpVersion();
 
 		TRACE(printf("hd44780_write_data %02x (%c) to %02x\n", m_uiDataPins, m_uiDataPins, m_uiCursor));
 		if (GetFlag(HD44780_FLAG_S_C)) {	// display shift ?
@@ -305,7 +343,7 @@ uint32_t HD44780::ProcessRead()
 		if (m_uiPinState & (1 << RS)) {	// read data
 			delay = 37;
 			{
-				std::lock_guard<std::mutex> lock(m_lock);
+				std::lock_guard<CountedMutex> lock(m_lock);
 				m_uiReadPins = m_vRam[m_uiCursor];
 			}
 			IncrementCursor();
@@ -395,7 +433,7 @@ void HD44780::Init(avr_t *avr)
 {
     _Init(avr,this);
 	{
-		std::lock_guard<std::mutex> lock(m_lock);
+		std::lock_guard<CountedMutex> lock(m_lock);
 		memset(m_cgRam, 0, sizeof(m_cgRam));
 		memset(m_vRam, 0, sizeof(m_vRam));
 	}
@@ -422,3 +460,91 @@ void HD44780::Init(avr_t *avr)
 	pTH->AddTrace(this, BRIGHTNESS_IN, {TC::Display, TC::OutputPin});
 	pTH->AddTrace(this, BRIGHTNESS_PWM_IN, {TC::Display, TC::PWM});
 }
+
+bool HD44780::AttachPortDecoder(const PortPin_t (&pins)[6])
+{
+	static const uint8_t uiPins[6] = {RS, E, D4, D5, D6, D7};
+	PortWatch &watch = PortWatch::Get(m_pAVR);
+	for (int i=0; i<6; i++)
+	{
+		if (!watch.HasPort(pins[i].cPort))
+		{
+			fprintf(stderr, "LCD: No PORT%c on this MCU, using pin IRQs instead.\n", pins[i].cPort);
+			return false;
+		}
+		m_decoder[i] = {pins[i].cPort, pins[i].uiBit, uiPins[i]};
+	}
+	for (int i=0; i<6; i++)
+	{
+		bool bSeen = false;
+		uint8_t uiMask = 0;
+		for (int j=0; j<6; j++)
+		{
+			bSeen |= j<i && m_decoder[j].cPort == m_decoder[i].cPort;
+			if (m_decoder[j].cPort == m_decoder[i].cPort)
+				uiMask |= 1U<<m_decoder[j].uiBit;
+		}
+		if (!bSeen)
+			watch.Watch(m_decoder[i].cPort, uiMask, MAKE_C_PORT_CALLBACK(HD44780,OnPortWrite), this);
+		// Pick up whatever is on the pins already, without acting on it.
+		uint16_t uiPinMask = 1U<<m_decoder[i].uiPin;
+		m_uiPinState = (m_uiPinState & ~uiPinMask) | (((watch.GetValue(m_decoder[i].cPort)>>m_decoder[i].uiBit) & 1U) ? uiPinMask : 0);
+	}
+	m_uiPinState &= ~(1U<<RW);
+	printf("LCD: Decoding from the port registers\n");
+	return true;
+}
+
+// One call per write however many of the lines it changed, new and old come with it.
+void HD44780::OnPortWrite(char cPort, const PortWatch::Write_t &write)
+{
+	uint16_t uiOld = m_uiPinState, uiNew = uiOld;
+	for (auto &dec : m_decoder)
+		if (dec.cPort == cPort)
+			uiNew = (uiNew & ~(1U<<dec.uiPin)) | (((write.uiNew>>dec.uiBit) & 1U)<<dec.uiPin);
+	if (uiNew == uiOld)
+		return;
+	m_uiPinState = uiNew;
+	// RS and the nibble are set up before E goes high, so the transfer can be taken on the spot.
+	if (!(uiOld & (1U<<E)) && (uiNew & (1U<<E)))
+		OnEPinChanged(m_pAVR, m_pAVR->cycle);
+}
+
+void HD44780::SaveState(Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		snap.Put(strPfx + "ddram", m_vRam);
+		snap.Put(strPfx + "cgram", m_cgRam);
+	}
+	snap.Put(strPfx + "cursor", m_uiCursor);
+	snap.Put(strPfx + "cgcursor", m_uiCGCursor);
+	snap.Put(strPfx + "incgram", m_bInCGRAM);
+	snap.Put(strPfx + "pinstate", m_uiPinState);
+	snap.Put(strPfx + "datapins", m_uiDataPins);
+	snap.Put(strPfx + "readpins", m_uiReadPins);
+	uint16_t uiFlags = m_flags;
+	snap.Put(strPfx + "flags", uiFlags);
+}
+
+void HD44780::LoadState(const Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		snap.Get(strPfx + "ddram", m_vRam);
+		snap.Get(strPfx + "cgram", m_cgRam);
+	}
+	snap.Get(strPfx + "cursor", m_uiCursor);
+	snap.Get(strPfx + "cgcursor", m_uiCGCursor);
+	snap.Get(strPfx + "incgram", m_bInCGRAM);
+	snap.Get(strPfx + "pinstate", m_uiPinState);
+	snap.Get(strPfx + "datapins", m_uiDataPins);
+	snap.Get(strPfx + "readpins", m_uiReadPins);
+	uint16_t uiFlags = m_flags;
+	snap.Get(strPfx + "flags", uiFlags);
+	m_flags = uiFlags;
+	BumpVersion();
+	SetFlag(HD44780_FLAG_DIRTY, 1);
+}
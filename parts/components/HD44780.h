@@ -49,14 +49,20 @@
 
 #pragma once
 
+#include "RedrawFlag.h"        // for RedrawFlag
 #include "Scriptable.h"        // for Scriptable
+#include "Snapshot.h"          // for Snapshot
 #include <stdint.h>            // for uint8_t, uint16_t, uint32_t
+#include <map>                 // for map
+#include <regex>               // for regex
 #include <string>              // for string
 #include <vector>              // for vector
 #include <atomic>
 #include <mutex>
 #include "BasePeripheral.h"    // for MAKE_C_TIMER_CALLBACK, BasePeripheral
+#include "CountedMutex.h"      // for CountedMutex
 #include "IScriptable.h"       // for ArgType, ArgType::Int, ArgType::String
+#include "PortWatch.h"         // for PortWatch, MAKE_C_PORT_CALLBACK
 #include "sim_avr.h"           // for avr_t
 #include "sim_avr_types.h"     // for avr_cycle_count_t
 #include "sim_cycle_timers.h"  // for avr_cycle_timer_t
@@ -90,22 +96,37 @@ class HD44780:public BasePeripheral, public Scriptable
 		{
 			m_lineOffsets[2] += width;
 			m_lineOffsets[3] += width;
-			string strBlnk;
-			strBlnk.assign(width,' ');
-			for (int i=0; i<height; i++)
-				m_vLines.push_back(strBlnk);
 
 			RegisterActionAndMenu("Desync","Simulates data corruption by desyncing the 4-bit mode",ActDesync);
 			RegisterAction("WaitForText","Waits for a given string to appear anywhere on the specified line. A line value of -1 means any line.",ActWaitForText,{ArgType::String,ArgType::Int});
+			RegisterAction("WaitForRegex","Waits for the specified line to match a regular expression (ECMAScript syntax, searched within the line). A line value of -1 means any line.",ActWaitForRegex,{ArgType::String,ArgType::Int});
 		};
 
 		// Registers IRQs with SimAVR.
 		void Init(avr_t *avr);
 
+		// Decodes RS, E and D4-D7 (in that order) straight off the PORTx register writes, a whole
+		// transfer per E strobe, instead of going through per-pin IRQs. RW is taken as low (write-only).
+		// Call after Init. Returns false if a port can't be found; connect the pin IRQs instead.
+		bool AttachPortDecoder(const PortPin_t (&pins)[6]);
+
 		// Returns height and width.
         uint8_t GetWidth() { return m_uiWidth;}
         uint8_t GetHeight() { return m_uiHeight;}
 
+		// Bumped on every DDRAM/CGRAM write, clear and state restore. Unchanged means nothing new to look at.
+		inline uint32_t GetVersion() const { return m_uiVersion.load(std::memory_order_acquire); }
+
+		// A row's text straight out of DDRAM: GetWidth() characters, not NUL-terminated.
+		// Only stable on the AVR thread (scripts run there); the GL side still takes m_lock.
+		inline const char* GetRow(uint8_t uiRow) const { return reinterpret_cast<const char*>(m_vRam + m_lineOffsets[uiRow]); }
+		// The 8 custom characters, 8 rows of 5 pixels each (bit 4 leftmost). AVR thread likewise.
+		inline const uint8_t* GetCGRam() const { return m_cgRam; }
+
+		// Checkpoints/restores the display RAM and controller state, see Board::SaveState
+		void SaveState(Snapshot &snap);
+		void LoadState(const Snapshot &snap);
+
     protected:
     // The GL draw accesses these:
 		atomic_uint8_t m_uiHeight = {4};				// width and height of the LCD
@@ -114,6 +135,7 @@ class HD44780:public BasePeripheral, public Scriptable
         uint8_t  m_cgRam[64];
 
 		virtual LineStatus ProcessAction(unsigned int iAction, const vector<string> &args) override;
+		bool ValidateAction(unsigned int iAction, const vector<string> &args, string &strError) override;
 
 		inline void ToggleFlag(uint16_t bit)
 		{
@@ -124,6 +146,8 @@ class HD44780:public BasePeripheral, public Scriptable
 		{
 			int old = m_flags &  (1 << bit);
 			m_flags = (m_flags & ~(1 << bit)) | (uiVal ? (1 << bit) : 0);
+			if (bit == HD44780_FLAG_DIRTY && uiVal)
+				RedrawFlag::Set();
 			return old != 0;
 		}
 
@@ -157,15 +181,22 @@ class HD44780:public BasePeripheral, public Scriptable
 
 		uint8_t m_lineOffsets[4] = {0, 0x40, 0, 0x40};
 
-		mutex m_lock; // Needed for GL thread access to v/cgRAM
+		CountedMutex m_lock {"HD44780"}; // Needed for GL thread access to v/cgRAM
 
 	private:
 		enum Actions
 		{
 			ActDesync,
-			ActWaitForText
+			ActWaitForText,
+			ActWaitForRegex
 		};
 
+		inline void BumpVersion()
+		{
+			m_uiVersion.fetch_add(1, std::memory_order_release);
+			ScriptHost::Notify(); // For the WaitFor lines.
+		}
+
         void ResetCursor();
         void ClearScreen();
 
@@ -185,6 +216,11 @@ class HD44780:public BasePeripheral, public Scriptable
 
         avr_cycle_count_t OnBusyTimeout(avr_t *avr, avr_cycle_count_t when);
 
+		void OnPortWrite(char cPort, const PortWatch::Write_t &write);
+
+		typedef struct Decoder_t { char cPort; uint8_t uiBit, uiPin; } Decoder_t;
+		Decoder_t m_decoder[6] = {}; // Port and bit feeding each of RS, E, D4-D7.
+
 		avr_cycle_timer_t m_fcnBusy = MAKE_C_TIMER_CALLBACK(HD44780,OnBusyTimeout);
 
         uint16_t m_uiCursor = 0, m_uiCGCursor = 0;			// offset in vram
@@ -195,10 +231,11 @@ class HD44780:public BasePeripheral, public Scriptable
         uint8_t  m_uiReadPins = 0;
         volatile uint16_t m_flags = 0;				// LCD flags ( HD44780_FLAG_*)
 
-		vector<string> m_vLines;
-
-		uint8_t m_uiLineChg = 0;
-
+		atomic_uint32_t m_uiVersion {0};
 
+		// What the current wait last looked at, so it is only re-evaluated after a write.
+		uint32_t m_uiWaitVersion = 0;
+		string m_strWaitKey;
 
+		map<string, regex> m_mRegex; // Compiled WaitForRegex patterns.
 };
@@ -28,6 +28,8 @@
  */
 
 #include "HD44780GL.h"
+#include <GL/freeglut_std.h>  // for glutGetWindow
+#include <string.h>           // for memcmp, memcpy
 #include <mutex>
 #include "BasePeripheral.h"   // for MAKE_C_CALLBACK
 #include "Util.h"             // for hexColor_t, hexColor_t::(anonymous)
@@ -98,67 +100,81 @@ void HD44780GL::OnBrightnessDigital(struct avr_irq_t * irq,	uint32_t value)
 
 }
 
-void HD44780GL::GLPutChar(char c, uint32_t character, uint32_t text, uint32_t shadow, bool bMaterial)
+void HD44780GL::RasterGlyph(std::vector<uint8_t> &vImage, unsigned int uiSlot, unsigned int uiRowBase, const uint8_t *pRows, int iRows)
 {
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glColorHelper(character,bMaterial);
-	glBegin(GL_QUADS);
-		glVertex3i(5, 8, -1);
-		glVertex3i(5, 0, -1);
-		glVertex3i(0, 0, -1);
-		glVertex3i(0, 8, -1);
-	glEnd();
-	uint8_t *uiData;
-	uint8_t iCols=8;
-	if (c<16)
-		uiData = &m_cgRam[(c & 7) <<3];
-	else
-	{
-		uiData = (uint8_t*)&hd44780_ROM_AOO.data[c*hd44780_ROM_AOO.h];
-		iCols = 7;
-	}
-
-	for (int i=0; i < iCols; i++)
-	{
-		 TRACE(printf("%u%u%u%u%u\n",
-		 	(uiData[i] & 1)==1,
-		 	(uiData[i] & 2)>1,
-		 	(uiData[i] & 4)>1,
-		 	(uiData[i] & 8)>1,
-			(uiData[i] & 16)>1));
-		for (int j=0; j<5; j++)
+	unsigned int uiGlyphW = m_uiCharW*m_uiTexelsPerDot, uiGlyphH = m_uiCharH*m_uiTexelsPerDot;
+	unsigned int uiStride = 2*m_uiGlyphCols*uiGlyphW;
+	unsigned int uiX0 = (uiSlot % m_uiGlyphCols)*uiGlyphW, uiY0 = (uiSlot/m_uiGlyphCols - uiRowBase)*uiGlyphH;
+	for (int i=0; i < iRows; i++)
+		for (int j=0; j<m_uiCharW; j++)
 		{
-
-			if (uiData[i] & (16>>j))
-			{
-				float x = (float)j;
-				float y = (float)i;
-				float inset = 0.85;
-				if (shadow)
+			bool bOn = pRows[i] & (16>>j);
+			for (unsigned int y=0; y<m_uiTexelsPerDot; y++)
+				for (unsigned int x=0; x<m_uiTexelsPerDot; x++)
 				{
-					glPushMatrix();
-						glColorHelper(shadow, bMaterial);
-						glBegin(GL_QUADS);
-							glVertex3f(x,y,		-2);
-							glVertex3f(x,y+1,	-2);
-							glVertex3f(x+1,y+1,	-2);
-							glVertex3f(x+1,y,	-2);
-						glEnd();
-					glPopMatrix();
+					size_t uiPos = (uiY0 + i*m_uiTexelsPerDot + y)*uiStride + uiX0 + j*m_uiTexelsPerDot + x;
+					vImage[uiPos] = bOn ? 0xFF : 0; // Full
+					vImage[uiPos + m_uiGlyphCols*uiGlyphW] = (bOn && x<m_uiTexelsPerDot-1 && y<m_uiTexelsPerDot-1) ? 0xFF : 0; // Inset
 				}
-				glColorHelper(text, bMaterial);
-				glBegin(GL_QUADS);
-					glVertex3f(x,y,				-3);
-					glVertex3f(x,y+inset,		-3);
-					glVertex3f(x+inset,y+inset,	-3);
-					glVertex3f(x+inset,y,		-3);
-				glEnd();
-			}
 		}
+}
+
+HD44780GL::Atlas_t& HD44780GL::GetAtlas()
+{
+	unsigned int uiGlyphH = m_uiCharH*m_uiTexelsPerDot;
+	unsigned int uiW = 2*m_uiGlyphCols*m_uiCharW*m_uiTexelsPerDot;
+	unsigned int uiCGRow = m_uiCGSlot/m_uiGlyphCols;
+	int iWindow = glutGetWindow();
+	for (auto &atlas : m_vAtlas)
+	{
+		if (atlas.iWindow != iWindow)
+			continue;
+		if (memcmp(atlas.cgRam, m_cgRam, sizeof(m_cgRam)))
+		{
+			// Only the CGRAM row changes.
+			std::vector<uint8_t> vImage(uiW*uiGlyphH, 0);
+			for (unsigned int i=0; i<8; i++)
+				RasterGlyph(vImage, m_uiCGSlot + i, uiCGRow, &m_cgRam[i<<3], 8);
+			glBindTexture(GL_TEXTURE_2D, atlas.uiTex);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, uiCGRow*uiGlyphH, uiW, uiGlyphH, GL_ALPHA, GL_UNSIGNED_BYTE, vImage.data());
+			memcpy(atlas.cgRam, m_cgRam, sizeof(m_cgRam));
+		}
+		return atlas;
 	}
+
+	unsigned int uiH = (uiCGRow + 1)*uiGlyphH;
+	std::vector<uint8_t> vImage(uiW*uiH, 0);
+	for (unsigned int c=0; c<m_uiCGSlot; c++)
+		RasterGlyph(vImage, c, 0, &hd44780_ROM_AOO.data[c*hd44780_ROM_AOO.h], hd44780_ROM_AOO.h);
+	for (unsigned int i=0; i<8; i++)
+		RasterGlyph(vImage, m_uiCGSlot + i, 0, &m_cgRam[i<<3], 8);
+	Atlas_t atlas {iWindow, 0, {}};
+	memcpy(atlas.cgRam, m_cgRam, sizeof(m_cgRam));
+	glGenTextures(1, &atlas.uiTex);
+	glBindTexture(GL_TEXTURE_2D, atlas.uiTex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // Crisp dots when zoomed in
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, uiW, uiH, 0, GL_ALPHA, GL_UNSIGNED_BYTE, vImage.data());
+	m_vAtlas.push_back(atlas);
+	return m_vAtlas.back();
 }
 
+void HD44780GL::AddGlyph(Batch_t &batch, float fX, float fY, unsigned int uiSlot, bool bInset)
+{
+	float fGlyphW = 1.f/(2*m_uiGlyphCols);
+	float fGlyphH = 1.f/(m_uiCGSlot/m_uiGlyphCols + 1);
+	float fS = (uiSlot % m_uiGlyphCols + (bInset ? m_uiGlyphCols : 0))*fGlyphW;
+	float fT = (uiSlot/m_uiGlyphCols)*fGlyphH;
+	float fZ = bInset ? -3 : -2;
+	const float fVerts[] = {fX, fY, fZ, fX, fY + m_uiCharH, fZ, fX + m_uiCharW, fY + m_uiCharH, fZ, fX + m_uiCharW, fY, fZ};
+	const float fTex[] = {fS, fT, fS, fT + fGlyphH, fS + fGlyphW, fT + fGlyphH, fS + fGlyphW, fT};
+	batch.vVerts.insert(batch.vVerts.end(), fVerts, fVerts + 12);
+	batch.vTex.insert(batch.vTex.end(), fTex, fTex + 8);
+}
 
 void HD44780GL::Draw(
 		uint32_t background,
@@ -193,15 +209,56 @@ void HD44780GL::Draw(
 		glVertex3f(iCols * m_uiCharW + (iCols - 1) + border, iRows * m_uiCharH
 				+ (iRows - 1) + border, 0);
 	glEnd();
-	for (int v = 0 ; v < m_uiHeight; v++) {
-		glPushMatrix();
-		for (int i = 0; i < m_uiWidth; i++) {
-			std::lock_guard<std::mutex> lock(m_lock);
-			GLPutChar(m_vRam[m_lineOffsets[v] + i], character, text, shadow, bMaterial);
-			glTranslatef(6, 0, 0);
-		}
-		glPopMatrix();
-		glTranslatef(0, 9, 0);
+	// One batch each for the cell backgrounds, the shadows and the text.
+	for (auto pBatch : {&m_cells, &m_shadows, &m_text})
+	{
+		pBatch->vVerts.clear();
+		pBatch->vTex.clear();
+	}
+	glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_COLOR_BUFFER_BIT);
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		Atlas_t &atlas = GetAtlas();
+		for (int v = 0 ; v < m_uiHeight; v++)
+			for (int i = 0; i < m_uiWidth; i++)
+			{
+				float fX = 6*i, fY = 9*v;
+				const float fCell[] = {fX + m_uiCharW, fY + m_uiCharH, -1, fX + m_uiCharW, fY, -1, fX, fY, -1, fX, fY + m_uiCharH, -1};
+				m_cells.vVerts.insert(m_cells.vVerts.end(), fCell, fCell + 12);
+				char c = m_vRam[m_lineOffsets[v] + i];
+				unsigned int uiSlot = c<16 ? m_uiCGSlot + (c & 7) : static_cast<uint8_t>(c);
+				AddGlyph(m_text, fX, fY, uiSlot, true);
+				if (shadow)
+					AddGlyph(m_shadows, fX, fY, uiSlot, false);
+			}
+		glBindTexture(GL_TEXTURE_2D, atlas.uiTex);
+	}
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glDisable(GL_TEXTURE_2D);
+	glColorHelper(character, bMaterial);
+	glVertexPointer(3, GL_FLOAT, 0, m_cells.vVerts.data());
+	glDrawArrays(GL_QUADS, 0, m_cells.vVerts.size()/3);
+
+	// The glyphs tint the white atlas, alpha is coverage.
+	glEnable(GL_TEXTURE_2D);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	if (shadow)
+	{
+		glColorHelper(shadow, bMaterial);
+		glVertexPointer(3, GL_FLOAT, 0, m_shadows.vVerts.data());
+		glTexCoordPointer(2, GL_FLOAT, 0, m_shadows.vTex.data());
+		glDrawArrays(GL_QUADS, 0, m_shadows.vVerts.size()/3);
 	}
+	glColorHelper(text, bMaterial);
+	glVertexPointer(3, GL_FLOAT, 0, m_text.vVerts.data());
+	glTexCoordPointer(2, GL_FLOAT, 0, m_text.vTex.data());
+	glDrawArrays(GL_QUADS, 0, m_text.vVerts.size()/3);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glPopClientAttrib();
+	glPopAttrib();
 	//SetFlag(HD44780_FLAG_DIRTY, 0);
 }
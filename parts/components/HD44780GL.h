@@ -31,6 +31,7 @@
 
 #include <stdint.h>   // for uint32_t, uint8_t
 #include <atomic>
+#include <vector>     // for vector
 #include "HD44780.h"  // for HD44780
 #include "sim_avr.h"  // for avr_t
 #include "sim_irq.h"  // for avr_irq_t
@@ -49,14 +50,39 @@ class HD44780GL:public HD44780
 			bool bMaterial = false);
 
 	private:
-		// Char draw helper.
-		void GLPutChar(char c, uint32_t character, uint32_t text, uint32_t shadow, bool bMaterial = false);
+		// Glyph atlas: every ROM glyph plus the 8 CGRAM ones, each drawn twice, with full
+		// pixels (for the shadow) and inset pixels (for the text).
+		typedef struct Atlas_t
+		{
+			int iWindow; // Textures aren't shared between the GLUT windows.
+			unsigned int uiTex;
+			uint8_t cgRam[64];
+		} Atlas_t;
+
+		// Returns the atlas for the current window, creating it or re-uploading CGRAM as needed. Call with m_lock held.
+		Atlas_t& GetAtlas();
+		// Rasterizes one glyph (both variants) into an atlas image at the given glyph slot.
+		void RasterGlyph(std::vector<uint8_t> &vImage, unsigned int uiSlot, unsigned int uiRowBase, const uint8_t *pRows, int iRows);
+		typedef struct Batch_t
+		{
+			std::vector<float> vVerts, vTex;
+		} Batch_t;
+
+		// Appends a textured quad covering a character cell for the given glyph slot and variant.
+		void AddGlyph(Batch_t &batch, float fX, float fY, unsigned int uiSlot, bool bInset);
 
 		void OnBrightnessPWM(avr_irq_t *irq, uint32_t value);
 		void OnBrightnessDigital(avr_irq_t *irq, uint32_t value);
 
 
 		uint8_t m_uiCharW = 5, m_uiCharH = 8;
+
+		std::vector<Atlas_t> m_vAtlas;
+		Batch_t m_cells, m_shadows, m_text; // Rebuilt every frame, kept to avoid reallocating.
+
+		static constexpr unsigned int m_uiTexelsPerDot = 7;  // Inset text dots are 6/7 of a dot.
+		static constexpr unsigned int m_uiGlyphCols = 16;    // Glyphs per atlas row
+		static constexpr unsigned int m_uiCGSlot = 256;      // First CGRAM glyph slot, after the ROM.
 		std::atomic_uint8_t m_uiBrightness = {255};
 		std::atomic_uint8_t m_uiPWM = {255};
 };
@@ -28,8 +28,10 @@
 #else
 # include <GL/gl.h>           // for glVertex2f, glBegin, glColor3f, glColor3fv
 #endif
-#include <math.h>             // for pow
+#include <math.h>             // for exp
+#include <algorithm>          // for min, max
 #include "sim_regbit.h"       // for avr_regbit_get, AVR_IO_REGBIT
+#include "RedrawFlag.h"       // for RedrawFlag
 #include "TelemetryHost.h"
 
 #define TRACE(_w)
@@ -39,46 +41,74 @@
 #endif
 
 
-avr_cycle_count_t Heater::OnTempTick(avr_t * avr, avr_cycle_count_t when)
+// Between drive changes the heater is a first-order system, dT/dt = rate*PWM - k*(T - ambient).
+// rate is the thermal mass (C/s at full on); k is the natural cooling when off plus any fan loss.
+// The time scale stretches t rather than the constants, so both terms speed up alike.
+float Heater::TempAt(avr_cycle_count_t uiCycle)
 {
-	if (m_bStopTicking)
-		return 0;
-
-    if (m_uiPWM>0)
-    {
-        float fDelta = (m_fThermalMass*((float)(m_uiPWM)/255.0f))*0.3;
-        m_fCurrentTemp += fDelta;
-    }
-    else // Cooling - do a little exponential decay
-    {
-        float dT = (m_fCurrentTemp - m_fAmbientTemp)*pow(2.7183,-0.005*0.3);
-        m_fCurrentTemp -= m_fCurrentTemp - (m_fAmbientTemp + dT);
-    }
-	m_iDrawTemp = m_fCurrentTemp;
+	double dSecs = GetTimeScale()*static_cast<double>(uiCycle - m_uiSegStart)/static_cast<double>(m_pAVR->frequency);
+	double dRate = m_fThermalMass*(static_cast<double>(m_uiPWM)/255.0);
+	double dK = (m_uiPWM>0 ? 0.0 : m_fCoolRate) + m_fFanLoss;
+	if (dK <= 0)
+		return m_fSegTemp + (dRate*dSecs);
+	double dEq = m_fAmbientTemp + (dRate/dK);
+	return dEq + ((m_fSegTemp - dEq)*exp(-dK*dSecs));
+}
 
-    TRACE(printf("New temp value: %.02f\n",m_fCurrentTemp));
-    RaiseIRQ(TEMP_OUT,(int)m_fCurrentTemp*256);
+void Heater::Rebase()
+{
+	if (!m_bStopTicking)
+		m_fSegTemp = TempAt(m_pAVR->cycle);
+	m_uiSegStart = m_pAVR->cycle;
+	m_fCurrentTemp = m_fSegTemp;
+}
 
-    if (m_uiPWM>0 || m_fCurrentTemp>m_fAmbientTemp+0.3)
-        RegisterTimerUsec(m_fcnTempTick,300000,this);
-    else
-    {
-        m_fCurrentTemp = m_fAmbientTemp;
-        RaiseIRQ(TEMP_OUT,(int)m_fCurrentTemp*256);
-    }
-    return 0;
+void Heater::Update()
+{
+	if (m_bStopTicking)
+	{
+		Rebase(); // Frozen, as if the thermistor came loose.
+		return;
+	}
+	m_fCurrentTemp = TempAt(m_pAVR->cycle);
+	RaiseTemp();
 }
 
+void Heater::RaiseTemp()
+{
+	int16_t iTemp = static_cast<int16_t>(m_fCurrentTemp);
+	m_mtrTemp.Set(m_fCurrentTemp);
+	if (m_iDrawTemp.exchange(iTemp) != iTemp)
+		RedrawFlag::Set();
+	TRACE(printf("New temp value: %.02f\n",m_fCurrentTemp));
+	// The thermistor only ever saw whole degrees, so there is nothing to tell it until one changes.
+	if ((m_pIrq + TEMP_OUT)->value != static_cast<uint32_t>(iTemp*256))
+		RaiseIRQ(TEMP_OUT,iTemp*256);
+}
 
 void Heater::OnPWMChanged(struct avr_irq_t * irq,uint32_t value)
 {
+	Rebase();
     if (m_bAuto) // Only update if auto (pwm-controlled). Else user supplied RPM.
         m_uiPWM = value;
 
-    if (m_uiPWM > 0)
-        RegisterTimerUsec(m_fcnTempTick, 100000, this);
     if ((m_pIrq + ON_OUT)->value != (m_uiPWM>0))
+    {
         RaiseIRQ(ON_OUT,m_uiPWM>0);
+        RedrawFlag::Set();
+    }
+}
+
+void Heater::OnFanChanged(struct avr_irq_t * irq,uint32_t value)
+{
+	Rebase();
+	m_fFanLoss = m_fFanLossMax*std::min(1.f, static_cast<float>(value)/static_cast<float>(m_uiFanFullRPM));
+}
+
+void Heater::SetFanCooling(uint32_t uiFullRPM, float fLossPerSec)
+{
+	m_uiFanFullRPM = std::max(1U, uiFullRPM);
+	m_fFanLossMax = fLossPerSec;
 }
 
 //TCCR0A  _SFR_IO8(0x24)
@@ -106,6 +136,7 @@ Heater::Heater(float fThermalMass, float fAmbientTemp, bool bIsBed,
                                             m_fThermalMass(fThermalMass),
                                             m_fAmbientTemp(fAmbientTemp),
                                             m_fCurrentTemp(fAmbientTemp),
+                                            m_fSegTemp(fAmbientTemp),
                                             m_bIsBed(bIsBed),
                                             m_chrLabel(chrLabel),
                                             m_fColdTemp(fColdTemp),
@@ -130,6 +161,7 @@ Scriptable::LineStatus Heater::ProcessAction(unsigned int iAct, const vector<str
 			Resume_Auto();
 			return LineStatus::Finished;
 		case ActStopHeating:
+			Rebase();
 			m_bStopTicking = true;
 			return LineStatus::Finished;
 
@@ -145,17 +177,22 @@ void Heater::Init(struct avr_t * avr, avr_irq_t *irqPWM, avr_irq_t *irqDigital)
 
     RegisterNotify(PWM_IN, MAKE_C_CALLBACK(Heater,OnPWMChanged),this);
     RegisterNotify(DIGITAL_IN, MAKE_C_CALLBACK(Heater,OnDigitalChanged),this);
+    RegisterNotify(FAN_IN, MAKE_C_CALLBACK(Heater,OnFanChanged),this);
 
 
 	auto pTH = TelemetryHost::GetHost();
 	pTH->AddTrace(this, PWM_IN, {TC::Heater,TC::PWM},8);
 	pTH->AddTrace(this, DIGITAL_IN, {TC::Heater});
 	pTH->AddTrace(this, ON_OUT, {TC::Heater,TC::Misc});
+
+	m_mtrTemp.Set(m_fCurrentTemp);
+	m_mtrTemp.Register("mk404_heater_temperature_celsius", "Modelled heater temperature.", {{"heater", GetName()}});
 }
 
 void Heater::Set(uint8_t uiPWM)
 {
     m_bAuto = false;
+    Rebase();
     m_uiPWM = uiPWM;
     RaiseIRQ(PWM_IN,0XFF);
 }
@@ -163,6 +200,7 @@ void Heater::Set(uint8_t uiPWM)
 void Heater::Resume_Auto()
 {
     m_bAuto = true;
+	Rebase(); // Picks up from the frozen temperature.
 	m_bStopTicking = false;
 }
 
@@ -195,3 +233,28 @@ void Heater::Draw()
 		glPopAttrib();
     glPopMatrix();
 }
+
+void Heater::SaveState(Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	Rebase();
+	snap.Put(strPfx + "temp", m_fCurrentTemp);
+	snap.Put(strPfx + "pwm", m_uiPWM.load());
+	snap.Put(strPfx + "auto", m_bAuto);
+	snap.Put(strPfx + "stop", m_bStopTicking);
+}
+
+void Heater::LoadState(const Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	uint16_t uiPWM = m_uiPWM;
+	snap.Get(strPfx + "temp", m_fCurrentTemp);
+	snap.Get(strPfx + "pwm", uiPWM);
+	snap.Get(strPfx + "auto", m_bAuto);
+	snap.Get(strPfx + "stop", m_bStopTicking);
+	m_uiPWM = uiPWM;
+	m_fSegTemp = m_fCurrentTemp;
+	m_uiSegStart = m_pAVR->cycle;
+	RaiseTemp();
+	RaiseIRQ(ON_OUT,m_uiPWM>0);
+}
@@ -28,19 +28,20 @@
 #include <string>              // for string
 #include <vector>              // for vector
 #include <atomic>
-#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "BasePeripheral.h"    // for BasePeripheral
 #include "Color.h"             // for Color3fv
 #include "IScriptable.h"       // for IScriptable::LineStatus
+#include "Metrics.h"           // for Metric
 #include "Scriptable.h"        // for Scriptable
+#include "Snapshot.h"          // for Snapshot
 #include "sim_avr.h"           // for avr_t
 #include "sim_avr_types.h"     // for avr_cycle_count_t
-#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
 #include "sim_irq.h"           // for avr_irq_t
 
 class Heater : public BasePeripheral, public Scriptable
 {
 public:
-    #define IRQPAIRS _IRQ(PWM_IN,"<heater.pwm_in") _IRQ(DIGITAL_IN,"<heater.digital_in") _IRQ(TEMP_OUT,">heater.temp_out") _IRQ(ON_OUT,">heater.on")
+    #define IRQPAIRS _IRQ(PWM_IN,"<heater.pwm_in") _IRQ(DIGITAL_IN,"<heater.digital_in") _IRQ(TEMP_OUT,">heater.temp_out") _IRQ(ON_OUT,">heater.on") _IRQ(FAN_IN,"<heater.fan_in")
     #include "IRQHelper.h"
 
 
@@ -58,9 +59,25 @@ public:
     // Returns to automatic control after having used Set()
     void Resume_Auto();
 
+    // Brings the temperature up to date and raises TEMP_OUT if it changed. Call before it is
+    // read (e.g. the thermistor's ADC read); there is no periodic tick.
+    void Update();
+
+    // A fan RPM on FAN_IN adds up to fLossPerSec (1/s, times the degrees over ambient) of cooling.
+    void SetFanCooling(uint32_t uiFullRPM, float fLossPerSec);
+
+	// Runs every heater's thermal time fScale times faster than the MCU's: heating, cooling and fan
+	// loss all scale together, so the curve has the same shape and just takes 1/fScale as long.
+	// Set from the command line before the boards are created.
+	static inline void SetTimeScale(float fScale) { GetTimeScale() = fScale > 0 ? fScale : 1.f; }
+
 	// Draws the heater status
 	void Draw();
 
+	// Checkpoints/restores the temperature and drive state, see Board::SaveState
+	void SaveState(Snapshot &snap);
+	void LoadState(const Snapshot &snap);
+
 	protected:
 		Scriptable::LineStatus ProcessAction (unsigned int iAct, const vector<string> &vArgs) override;
 
@@ -80,15 +97,28 @@ public:
         // Hook for digital full on/off
         void OnDigitalChanged(avr_irq_t *irq, uint32_t value);
 
-        // Function for a temperature "tick" to add or remove heat
-        avr_cycle_count_t OnTempTick(avr_t * avr, avr_cycle_count_t when);
+        // Hook for the cooling fan's RPM
+        void OnFanChanged(avr_irq_t *irq, uint32_t value);
+
+        // Analytic temperature at a cycle for the current drive, see Heater.cpp
+        float TempAt(avr_cycle_count_t uiCycle);
+
+        // Starts a new segment from now, call before changing the PWM, fan or stop flag.
+        void Rebase();
+
+        void RaiseTemp();
 
-        avr_cycle_timer_t m_fcnTempTick = MAKE_C_TIMER_CALLBACK(Heater,OnTempTick);
+        static float& GetTimeScale() { static float fScale = 1.f; return fScale; }
 
         bool m_bAuto = true;
         float m_fThermalMass = 1.0;
         float m_fAmbientTemp = 25.0;
         float m_fCurrentTemp {25.0};
+        float m_fSegTemp {25.0}; // Temperature at m_uiSegStart
+        avr_cycle_count_t m_uiSegStart = 0;
+        float m_fFanLoss = 0, m_fFanLossMax = 0;
+        uint32_t m_uiFanFullRPM = 1;
+        static constexpr float m_fCoolRate = 0.005f; // 1/s with the heater off
 		atomic_int16_t m_iDrawTemp = {0};
         bool m_bIsBed = false;
         char m_chrLabel;
@@ -96,6 +126,7 @@ public:
         float m_fHotTemp;
         atomic_uint16_t m_uiPWM = {0};
 		bool m_bStopTicking = false;
+		Metric m_mtrTemp;
 	    static constexpr Color3fv m_colColdTemp = {0, 1, 1};
 	    static constexpr Color3fv m_colHotTemp = {1, 0, 0};
 };
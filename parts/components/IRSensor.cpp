@@ -22,26 +22,28 @@
 #include "IRSensor.h"
 #include <stdio.h>  // for printf
 
-// ADC read trigger.
-uint32_t IRSensor::OnADCRead(struct avr_irq_t * irq, uint32_t value)
+// Fixed states are published as they're set. Auto follows an input that may come from another
+// board's thread, so that one is picked up as the ADC reads.
+void IRSensor::Publish()
 {
-    float fVal;
-    if (m_eCurrent != IR_AUTO)
-        fVal = m_mIRVals[m_eCurrent];
-    else if (m_bExternal)
-        fVal = m_mIRVals[IR_v4_FILAMENT_PRESENT];
-    else
-	{
-        fVal = m_mIRVals[IR_v4_NO_FILAMENT];
-	}
-
-	uint32_t iVOut =  (fVal)*1000;
+	IRState_t eState = m_eCurrent;
+	SetRefresh(eState == IR_AUTO);
+	if (eState == IR_AUTO)
+		OnADCRefresh();
+	else
+		SetADCValue(m_mIRVals[eState]*1000);
+}
 
-	return iVOut;
+void IRSensor::OnADCRefresh()
+{
+	SetADCValue(m_bExternal ? m_uiAutoMV[1] : m_uiAutoMV[0]);
 }
 
 IRSensor::IRSensor():VoltageSrc(),Scriptable("IRSensor")
 {
+	m_uiAutoMV[0] = m_mIRVals[IR_v4_NO_FILAMENT]*1000;
+	m_uiAutoMV[1] = m_mIRVals[IR_v4_FILAMENT_PRESENT]*1000;
+	Publish();
 	RegisterActionAndMenu("Toggle","Toggles the IR sensor state",ActToggle);
 	RegisterAction("Set","Sets the sensor state to a specific enum entry. (int value)",ActSet,{ArgType::Int});
 	RegisterMenu("v0.4 Set Filament", ActSetV4Filament);
@@ -104,11 +106,13 @@ void IRSensor::Toggle()
 		printf("IRSensor: No filament present!\n");
 		m_eCurrent = IR_v4_NO_FILAMENT;
 	}
+	Publish();
 }
 
 void IRSensor::Set(IRState val)
 {
 	m_eCurrent = val;
+	Publish();
 }
 
 void IRSensor::Auto_Input(uint32_t val)
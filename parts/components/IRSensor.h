@@ -82,8 +82,8 @@ private:
 		ActSetAuto
 	};
 
-	// ADC read trigger
- 	uint32_t OnADCRead(avr_irq_t *pIRQ, uint32_t value) override;
+	void Publish() override;
+	void OnADCRefresh() override;
 
 	// LUT for states to voltage readouts.
 	map<IRState_t,float> m_mIRVals =
@@ -97,6 +97,7 @@ private:
 		make_pair(IR_NOT_CONNECTED, 4.9)
 	};
 
+	uint32_t m_uiAutoMV[2] = {0,0}; // No filament, filament present
 	atomic_bool m_bExternal {false};
 	IRState_t m_eCurrent = IR_v4_NO_FILAMENT;
 };
@@ -21,6 +21,7 @@
 
 
 #include "LED.h"
+#include "RedrawFlag.h"       // for RedrawFlag
 #include <GL/freeglut_std.h>          // for glutStrokeCharacter, GLUT_STROKE_MONO_R...
 #if defined(__APPLE__)
 # include <OpenGL/gl.h>       // for glVertex2f, glBegin, glColor3f, glEnd
@@ -38,6 +39,7 @@ LED::LED(uint32_t uiHexColor, char chrLabel, bool bInvert):m_chrLabel(chrLabel),
 void LED::OnValueChanged(struct avr_irq_t *irq, uint32_t value)
 {
 	m_uiBrightness = (value^m_bInvert)*255;
+	RedrawFlag::Set();
 }
 
 void LED::OnPWMChanged(struct avr_irq_t *irq, uint32_t value)
@@ -46,6 +48,7 @@ void LED::OnPWMChanged(struct avr_irq_t *irq, uint32_t value)
 		m_uiBrightness = 255-((uint8_t)value);
 	else
 		m_uiBrightness = ((uint8_t)value);
+	RedrawFlag::Set();
 }
 
 void LED::Draw()
@@ -41,8 +41,9 @@
 MMU2 *MMU2::g_pMMU = nullptr;
 using namespace Boards;
 
-MMU2::MMU2():MM_Control_01()
+MMU2::MMU2(bool bSerialPty):MM_Control_01()
 {
+	m_bUARTPty = bSerialPty;
 	if (g_pMMU)
 	{
 		fprintf(stderr,"Error: Cannot have multiple MMU instances due to freeglut limitations\n");
@@ -125,7 +126,8 @@ void MMU2::SetupHardware()
 	m_Sel.ConnectTo(TMC2130::POSITION_OUT,GetIRQ(SELECTOR_OUT));
 	m_Idl.ConnectTo(TMC2130::POSITION_OUT,GetIRQ(IDLER_OUT));
 	m_Extr.ConnectTo(TMC2130::POSITION_OUT,GetIRQ(PULLEY_IN));
-	avr_irq_register_notify(m_shift.GetIRQ(HC595::OUT), MAKE_C_CALLBACK(MMU2,LEDHandler),this);
+	m_shift.SetPackedOutput(6, 10); // Just the LEDs.
+	m_shift.ConnectTo(HC595::OUT_PACKED, GetIRQ(LEDS_OUT));
 }
 
 
@@ -162,11 +164,3 @@ void MMU2::OnPulleyFeedIn(struct avr_irq_t * irq,uint32_t value)
 	}
 
 }
-
-void MMU2::LEDHandler(avr_irq_t *irq, uint32_t value)
-{
-	uint32_t valOut = 0;
-	valOut = (value >>6) & 0b1111111111; // Just the LEDs.
-	if (GetIRQ(LEDS_OUT)->value != valOut)
-		RaiseIRQ(LEDS_OUT,valOut);
-}
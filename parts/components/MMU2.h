@@ -41,7 +41,8 @@ class MMU2: public BasePeripheral, public Boards::MM_Control_01
         #include "IRQHelper.h"
 
         // Creates a new MMU2. Does all of the setup and firmware load.
-        MMU2();
+        // Without bSerialPty the UART is left for the caller to connect (see UARTLink)
+        explicit MMU2(bool bSerialPty = true);
 
 		~MMU2(){StopAVR();}
 
@@ -66,8 +67,6 @@ class MMU2: public BasePeripheral, public Boards::MM_Control_01
 
         void OnPulleyFeedIn(avr_irq_t *irq, uint32_t value);
 
-        void LEDHandler(avr_irq_t *irq, uint32_t value);
-
         atomic_bool m_bAutoFINDA = {true};
 		atomic_bool m_bFINDAManual = {false};
         atomic_bool m_bStarted = {false};
@@ -0,0 +1,394 @@
+/*
+	MMU2Model.cpp - A behavioural stand-in for the MMU2, without its MCU.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MMU2Model.h"
+#include <GL/freeglut_std.h>  // for glutStrokeCharacter, GLUT_STROKE_MONO_ROMAN
+#if defined(__APPLE__)
+# include <OpenGL/gl.h>       // for glTranslatef, glVertex3f, glColor3f
+#else
+# include <GL/gl.h>           // for glTranslatef, glVertex3f, glColor3f
+#endif
+#include <stdio.h>            // for printf, snprintf
+#include <stdlib.h>           // for atoi
+#include "Log.h"              // for LOG, Log
+#include "avr_uart.h"         // for AVR_IOCTL_UART_GETIRQ, ::AVR_...
+#include "sim_io.h"           // for avr_io_getirq, avr_ioctl
+#include "sim_time.h"         // for avr_usec_to_cycles
+
+static Log::Module logMMUModel("MMU2Model");
+
+void MMU2Model::Init(avr_t *avr, char chrUART)
+{
+	_Init(avr, this);
+
+	RegisterNotify(RESET, MAKE_C_CALLBACK(MMU2Model,OnResetIn), this);
+	RegisterNotify(BYTE_IN, MAKE_C_CALLBACK(MMU2Model,OnByteIn), this);
+
+	// The protocol is binary-clean ASCII, but keep it off the console like UARTLink does.
+	uint32_t f = 0;
+	avr_ioctl(m_pAVR, AVR_IOCTL_UART_GET_FLAGS(chrUART), &f);
+	f &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(m_pAVR, AVR_IOCTL_UART_SET_FLAGS(chrUART), &f);
+
+	avr_irq_t * src = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XOFF);
+	if (src && dst) {
+		ConnectFrom(src, BYTE_IN);
+		ConnectTo(BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, MAKE_C_CALLBACK(MMU2Model,OnXOnIn), this);
+	if (xoff)
+		avr_irq_register_notify(xoff, MAKE_C_CALLBACK(MMU2Model,OnXOffIn), this);
+
+	RegisterTimerUsec(m_fcnTick, m_uiTickUsec, this);
+	printf("MMU2: using the behavioural model, MM-control-01 is not simulated.\n");
+}
+
+// Like MMU2, the first low starts it and a falling edge resets it.
+void MMU2Model::OnResetIn(avr_irq_t *irq, uint32_t value)
+{
+	if (!value && (!m_bStarted || irq->value))
+	{
+		m_bStarted = true;
+		Reboot();
+	}
+}
+
+void MMU2Model::Reboot()
+{
+	m_dSteps.clear();
+	m_dCmds.clear();
+	m_strLine.clear();
+	m_strOut.clear();
+	for (int i=0; i<AxisCount; i++)
+		m_fPlan[i] = m_fPos[i];
+	m_bBooting = true;
+	m_bLoaded = m_fPos[Pulley] > m_fFINDA; // The firmware asks FINDA on boot.
+	// Homing, then the printer is told it's up.
+	Move(Selector, m_fSelPark, m_fSelSpeed);
+	Move(Selector, m_uiActive*m_fSelSlot, m_fSelSpeed);
+	Move(Idler, 0, m_fIdlSpeed);
+	Park();
+	Reply("start\n");
+}
+
+void MMU2Model::OnByteIn(avr_irq_t *irq, uint32_t value)
+{
+	if (value == '\n')
+	{
+		if (!m_strLine.empty())
+			HandleCommand(m_strLine);
+		m_strLine.clear();
+	}
+	else if (value != '\r' && m_strLine.size() < 32)
+		m_strLine.push_back(static_cast<char>(value));
+}
+
+void MMU2Model::HandleCommand(const std::string &strCmd)
+{
+	if (m_bBooting)
+		return; // The firmware doesn't listen until it has sent "start".
+	if (!m_dSteps.empty())
+	{
+		m_dCmds.push_back(strCmd); // It reads the next command when the current one is done.
+		return;
+	}
+	LOG(logMMUModel, Debug, "Command %s", strCmd.c_str());
+	int iArg = atoi(strCmd.c_str()+1);
+	uint8_t uiSlot = static_cast<uint8_t>(iArg);
+	if ((strCmd[0]=='T' || strCmd[0]=='L' || strCmd[0]=='E' || strCmd[0]=='K') && (iArg < 0 || iArg > 4))
+		return;
+	switch (strCmd[0])
+	{
+		case 'S':
+			if (iArg == 0)
+				Send("ok\n");
+			else if (iArg == 1)
+				Send("106ok\n"); // FW version
+			else if (iArg == 2)
+				Send("372ok\n"); // Build number
+			else if (iArg == 3)
+				Send("0ok\n"); // Drive errors
+			break;
+		case 'P':
+			Send(m_bFINDA ? "1ok\n" : "0ok\n");
+			break;
+		case 'T':
+			if (m_bLoaded && uiSlot == m_uiActive)
+			{
+				Send("ok\n");
+				break;
+			}
+			if (m_bLoaded)
+				Unload();
+			Select(uiSlot);
+			Engage(uiSlot);
+			Move(Pulley, m_fFINDA + 6.f, m_fFeedSlow);
+			Move(Pulley, m_fBowden, m_fFeedFast);
+			Reply("ok\n"); // The idler stays engaged for C0.
+			m_bLoaded = true;
+			break;
+		case 'L': // Into the MMU only: to FINDA and back to the selector.
+			if (m_bLoaded)
+			{
+				Send("ok\n");
+				break;
+			}
+			Select(uiSlot);
+			Engage(uiSlot);
+			Move(Pulley, m_fFINDA + 6.f, m_fFeedSlow);
+			Move(Pulley, 0, m_fFeedSlow);
+			Park();
+			Reply("ok\n");
+			break;
+		case 'U':
+			if (m_bLoaded)
+				Unload();
+			Reply("ok\n");
+			break;
+		case 'C': // Pushes on into the extruder gears.
+			if (m_bLoaded)
+			{
+				Engage(m_uiActive);
+				Move(Pulley, m_fPlan[Pulley] + 30.f, m_fFeedSlow);
+				Park();
+			}
+			Reply("ok\n");
+			break;
+		case 'E': // Out the front, the idler stays engaged until R0.
+			if (m_bLoaded)
+				Unload();
+			Park();
+			Move(Selector, m_fSelPark, m_fSelSpeed);
+			Engage(uiSlot);
+			Move(Pulley, -50.f, m_fFeedFast);
+			Reply("ok\n");
+			break;
+		case 'R':
+			Park();
+			Move(Pulley, 0, m_fFeedFast);
+			Move(Selector, m_uiActive*m_fSelSlot, m_fSelSpeed);
+			Reply("ok\n");
+			break;
+		case 'K': // Cut: feed a little, sweep the selector over it, retract.
+			Select(uiSlot);
+			Engage(uiSlot);
+			Move(Pulley, m_fFINDA + 8.f, m_fFeedSlow);
+			Move(Selector, m_fSelPark, m_fSelSpeed);
+			Move(Pulley, 0, m_fFeedSlow);
+			Select(uiSlot);
+			Reply("ok\n");
+			break;
+		case 'F': // Filament type
+		case 'M': // Stealth/normal mode
+		case 'W': // Wait for the user (the buttons), which is never needed here.
+			Send("ok\n");
+			break;
+		case 'X':
+			Reboot();
+			break;
+		default:
+			LOG(logMMUModel, Warning, "Ignoring unknown command %s", strCmd.c_str());
+	}
+	UpdateLEDs();
+}
+
+void MMU2Model::Move(Axis_t eAxis, float fTarget, float fSpeed)
+{
+	m_dSteps.push_back({eAxis, fTarget, fSpeed, ""});
+	m_fPlan[eAxis] = fTarget;
+}
+
+void MMU2Model::Reply(const std::string &strReply)
+{
+	m_dSteps.push_back({AxisCount, 0, 0, strReply});
+}
+
+// Parks the idler off the current slot first, so the selector moves freely.
+void MMU2Model::Select(uint8_t uiSlot)
+{
+	Park();
+	Move(Selector, uiSlot*m_fSelSlot, m_fSelSpeed);
+	m_uiActive = uiSlot;
+}
+
+void MMU2Model::Engage(uint8_t uiSlot)
+{
+	Move(Idler, m_fIdlSlot0 + uiSlot*m_fIdlSlot, m_fIdlSpeed);
+}
+
+void MMU2Model::Park()
+{
+	Move(Idler, m_fIdlSlot0 + m_uiActive*m_fIdlSlot + m_fIdlPark, m_fIdlSpeed);
+}
+
+void MMU2Model::Unload()
+{
+	Engage(m_uiActive);
+	Move(Pulley, m_fFINDA + 16.f, m_fFeedFast);
+	Move(Pulley, 0, m_fFeedSlow);
+	Park();
+	m_bLoaded = false;
+}
+
+avr_cycle_count_t MMU2Model::OnTick(avr_t *avr, avr_cycle_count_t when)
+{
+	float fTime = m_uiTickUsec/1e6f;
+	bool bMoved[AxisCount] = {false, false, false};
+	while (!m_dSteps.empty() && fTime > 0)
+	{
+		Step_t &step = m_dSteps.front();
+		if (step.eAxis == AxisCount)
+		{
+			m_bBooting = false;
+			Send(step.strReply);
+			m_dSteps.pop_front();
+			continue;
+		}
+		float &fPos = m_fPos[step.eAxis];
+		float fDist = step.fTarget - fPos, fMax = step.fSpeed*fTime;
+		bMoved[step.eAxis] = bMoved[step.eAxis] || fDist != 0;
+		if (fDist > fMax || -fDist > fMax)
+		{
+			fPos += fDist > 0 ? fMax : -fMax;
+			break;
+		}
+		fPos = step.fTarget;
+		fTime -= (fDist > 0 ? fDist : -fDist)/step.fSpeed;
+		m_dSteps.pop_front();
+	}
+	if (bMoved[Selector])
+		RaiseIRQ(SELECTOR_OUT, *reinterpret_cast<uint32_t*>(&m_fPos[Selector]));
+	if (bMoved[Idler])
+		RaiseIRQ(IDLER_OUT, *reinterpret_cast<uint32_t*>(&m_fPos[Idler]));
+	if (bMoved[Pulley])
+		RaiseIRQ(FEED_DISTANCE, *reinterpret_cast<uint32_t*>(&m_fPos[Pulley]));
+	UpdateFINDA();
+	while (m_dSteps.empty() && !m_dCmds.empty())
+	{
+		std::string strCmd = m_dCmds.front();
+		m_dCmds.pop_front();
+		HandleCommand(strCmd);
+	}
+	UpdateLEDs();
+	return when + avr_usec_to_cycles(m_pAVR, m_uiTickUsec);
+}
+
+void MMU2Model::UpdateFINDA()
+{
+	bool bFINDA = m_bAutoFINDA ? m_fPos[Pulley] > m_fFINDA : m_bFINDAManual.load();
+	if (bFINDA != m_bFINDA)
+	{
+		m_bFINDA = bFINDA;
+		RaiseIRQ(FINDA_OUT, bFINDA);
+	}
+}
+
+// Green on the active slot, blinking while busy. Packed as MMU2's LEDS_OUT: G0 R0 G4 R4 G3 R3 ... G1 R1.
+void MMU2Model::UpdateLEDs()
+{
+	bool bBusy = m_bBooting || !m_dSteps.empty();
+	uint32_t uiLEDs = 0;
+	if ((m_bLoaded || bBusy) && (!bBusy || (m_pAVR->cycle / avr_usec_to_cycles(m_pAVR, 250000U)) & 1U))
+		uiLEDs = 1U << (m_uiActive ? 2U*(5U-m_uiActive) : 0U);
+	if (uiLEDs != m_uiLEDs)
+	{
+		m_uiLEDs = uiLEDs;
+		RaiseIRQ(LEDS_OUT, uiLEDs);
+	}
+	m_uiStatus = m_uiActive | (m_bLoaded ? 8U : 0U) | (bBusy ? 16U : 0U);
+}
+
+void MMU2Model::ToggleFINDA()
+{
+	m_bFINDAManual = !m_bFINDAManual;
+	printf("FINDA (manual) toggled: %u\n",m_bFINDAManual?1U:0U);
+	// Picked up on the next tick, on the AVR thread.
+}
+
+void MMU2Model::Send(const std::string &strOut)
+{
+	LOG(logMMUModel, Debug, "Reply %s", strOut.c_str());
+	m_strOut += strOut;
+	FlushData();
+}
+
+void MMU2Model::FlushData()
+{
+	size_t uiSent = 0;
+	// XOFF arrives synchronously from within RaiseIRQ once the UART FIFO fills.
+	while (m_bXOn && uiSent < m_strOut.size())
+		RaiseIRQ(BYTE_OUT, static_cast<uint8_t>(m_strOut[uiSent++]));
+	m_strOut.erase(0, uiSent);
+}
+
+avr_cycle_count_t MMU2Model::OnFlushTimer(avr_t * avr, avr_cycle_count_t when)
+{
+	FlushData();
+	return m_bXOn ? when + avr_usec_to_cycles(m_pAVR, m_uiFlushUsec) : 0;
+}
+
+// Called repeatedly while the UART has room, XOFF only once it is full.
+void MMU2Model::OnXOnIn(avr_irq_t * irq, uint32_t value)
+{
+	m_bXOn = true;
+	FlushData();
+	if (m_bXOn)
+		RegisterTimerUsec(m_fcnFlush, m_uiFlushUsec, this);
+}
+
+void MMU2Model::OnXOffIn(avr_irq_t * irq, uint32_t value)
+{
+	m_bXOn = false;
+	CancelTimer(m_fcnFlush, this);
+}
+
+void MMU2Model::Draw(float fY)
+{
+	uint32_t uiStatus = m_uiStatus;
+	char chrStatus[64];
+	snprintf(chrStatus, sizeof(chrStatus), "Model: slot %u %s%s, FINDA %u", uiStatus & 7U, (uiStatus & 8U) ? "loaded" : "empty",
+		(uiStatus & 16U) ? ", busy" : "", m_bFINDA ? 1U : 0U);
+	glPushMatrix();
+		glColor3f(0,0,0);
+		glTranslatef(0,fY-50,0);
+		glBegin(GL_QUADS);
+			glVertex3f(0,0,0);
+			glVertex3f(350,0,0);
+			glVertex3f(350,50,0);
+			glVertex3f(0,50,0);
+		glEnd();
+		glTranslatef(20,7,0);
+		glColor3f(1,1,1);
+		glPushMatrix();
+			glScalef(0.09,-0.05,0);
+			for (const char *p = "Missing Material Unit 2"; *p; p++)
+				glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN,*p);
+		glPopMatrix();
+		glTranslatef(0,20,0);
+		glScalef(0.09,-0.05,0);
+		for (const char *p = chrStatus; *p; p++)
+			glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN,*p);
+	glPopMatrix();
+}
@@ -0,0 +1,128 @@
+/*
+	MMU2Model.h - A behavioural stand-in for the MMU2, without its MCU.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint8_t
+#include <atomic>              // for atomic_bool, atomic_uint
+#include <deque>               // for deque
+#include <string>              // for string
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+// Answers the printer's MMU serial protocol (S, P, T, L, U, C, E, R, K, F, M, W, X; FW 1.0.6)
+// on the printer's own UART and AVR thread, moving the selector, idler and pulley at about the
+// real speeds, so FINDA, the IR sensor and the visuals see the same sequence as with MM-control-01.
+// It never fails a load, so the error/button recovery paths need the real board.
+// The IRQs are those of MMU2, in the same order, so code can wire up either.
+class MMU2Model: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(FEED_DISTANCE,"<mmu.feed_distance") _IRQ(RESET,"<mmu.reset") _IRQ(PULLEY_IN,"<mmu.pulley_in") \
+						_IRQ(SELECTOR_OUT,">sel_pos.out") _IRQ(IDLER_OUT,">idler_pos.out") _IRQ(LEDS_OUT,">leds.out") _IRQ(FINDA_OUT,">finda.out") \
+						_IRQ(BYTE_IN,"8<mmu_model.in") _IRQ(BYTE_OUT,"8>mmu_model.out")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the printers are created.
+		static void SetEnabled(bool bEnabled) { GetEnabled() = bEnabled; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		// Attaches to the given UART (e.g. '2') of the printer.
+		void Init(avr_t *avr, char chrUART);
+
+		void Draw(float fY);
+
+		inline void SetFINDAAuto(bool bVal) { m_bAutoFINDA = bVal;}
+		void ToggleFINDA();
+
+	private:
+		typedef enum Axis_t
+		{
+			Selector,
+			Idler,
+			Pulley,
+			AxisCount
+		} Axis_t;
+
+		// One step of an operation: a move, or a reply once the moves before it are done.
+		typedef struct Step_t
+		{
+			Axis_t eAxis;
+			float fTarget, fSpeed; // mm (the idler in degrees), per second
+			std::string strReply;
+		} Step_t;
+
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		void OnResetIn(avr_irq_t *irq, uint32_t value);
+		void OnByteIn(avr_irq_t *irq, uint32_t value);
+		void OnXOnIn(avr_irq_t *irq, uint32_t value);
+		void OnXOffIn(avr_irq_t *irq, uint32_t value);
+
+		avr_cycle_count_t OnTick(avr_t *avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnTick = MAKE_C_TIMER_CALLBACK(MMU2Model,OnTick);
+		avr_cycle_count_t OnFlushTimer(avr_t *avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnFlush = MAKE_C_TIMER_CALLBACK(MMU2Model,OnFlushTimer);
+
+		// Takes a command line from the printer, once any operation in progress is done.
+		void HandleCommand(const std::string &strCmd);
+		void Reboot();
+
+		// Step builders for the operations.
+		void Move(Axis_t eAxis, float fTarget, float fSpeed);
+		void Reply(const std::string &strReply);
+		void Select(uint8_t uiSlot);
+		void Engage(uint8_t uiSlot);
+		void Park();
+		void Unload();
+
+		void Send(const std::string &strOut);
+		void FlushData();
+		void UpdateFINDA();
+		void UpdateLEDs();
+
+		std::deque<Step_t> m_dSteps;
+		std::deque<std::string> m_dCmds; // Received while busy
+		std::string m_strLine, m_strOut;
+		bool m_bXOn = false;
+
+		float m_fPos[AxisCount] = {0,0,0};
+		float m_fPlan[AxisCount] = {0,0,0}; // Where the queued steps leave each axis
+		uint8_t m_uiActive = 0; // As of the end of the queued steps, as is m_bLoaded.
+		bool m_bLoaded = false, m_bBooting = false, m_bStarted = false;
+
+		std::atomic_bool m_bAutoFINDA = {true}, m_bFINDAManual = {false}, m_bFINDA = {false};
+		std::atomic_uint m_uiStatus = {0}; // Slot | loaded<<3 | busy<<4, for Draw
+		uint32_t m_uiLEDs = 0;
+
+		// Positions and speeds, from the MM-control-01 firmware's step counts at the simulated steps/mm.
+		static constexpr float m_fSelSlot = 13.95f, m_fSelPark = 5.f*m_fSelSlot; // mm
+		static constexpr float m_fIdlSlot0 = 16.25f, m_fIdlSlot = 44.375f, m_fIdlPark = 27.125f; // deg
+		static constexpr float m_fFINDA = 24.f; // Pulley travel at which FINDA triggers, as MMU2's auto FINDA.
+		static constexpr float m_fBowden = 430.f; // Far enough to reach the printer's IR sensor (400).
+		static constexpr float m_fSelSpeed = 45.f, m_fIdlSpeed = 200.f, m_fFeedSlow = 20.f, m_fFeedFast = 120.f;
+		static constexpr uint32_t m_uiTickUsec = 10000;
+		// Roughly one byte time at 115200 baud.
+		static constexpr uint32_t m_uiFlushUsec = 80;
+};
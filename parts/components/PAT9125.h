@@ -66,11 +66,14 @@ class PAT9125: public I2CPeripheral, public Scriptable
 		void Init(avr_t *pAVR, avr_irq_t *pSCL, avr_irq_t *pSDA)
 		{
 			_Init(pAVR, pSDA, pSCL, this);
-			printf("\n\n--------- Your attention please! ----------\n");
-			printf("NOTE: PAT9125 is minimally functional. If you encounter issues or need advanced functionality \n feel free to contribute or open an issue.\n");
-			printf("--------- Your attention please! ----------\n\n\n");
-			RegisterNotify(E_IN, MAKE_C_CALLBACK(PAT9125,OnEMotion),this);
-			RegisterNotify(P_IN, MAKE_C_CALLBACK(PAT9125,OnPMotion),this);
+			_InitCommon();
+		}
+
+		// As above, but decodes the bus off the SCL/SDA port registers.
+		void Init(avr_t *pAVR, avr_irq_t *pSCL, avr_irq_t *pSDA, const PortPin_t &portSCL, const PortPin_t &portSDA)
+		{
+			_Init(pAVR, pSDA, pSCL, portSDA, portSCL, this);
+			_InitCommon();
 		}
 
 		inline void Set(FSState eVal)
@@ -115,6 +118,14 @@ class PAT9125: public I2CPeripheral, public Scriptable
 
 
 	protected:
+		void _InitCommon()
+		{
+			printf("\n\n--------- Your attention please! ----------\n");
+			printf("NOTE: PAT9125 is minimally functional. If you encounter issues or need advanced functionality \n feel free to contribute or open an issue.\n");
+			printf("--------- Your attention please! ----------\n\n\n");
+			RegisterNotify(E_IN, MAKE_C_CALLBACK(PAT9125,OnEMotion),this);
+			RegisterNotify(P_IN, MAKE_C_CALLBACK(PAT9125,OnPMotion),this);
+		}
 
 		void UpdateSensorState()
 		{
@@ -21,7 +21,10 @@
 
 #include "PINDA.h"
 #include <stdio.h>  // for printf
-#include <cmath>    // for pow, floor, round, sqrt
+#include <algorithm> // for min, max
+#include <cmath>    // for fabs, floor
+#include <fstream>  // IWYU pragma: keep for ifstream
+#include <sstream>  // IWYU pragma: keep for istringstream
 #include "TelemetryHost.h"
 
 //#define TRACE(_w)_w
@@ -29,32 +32,50 @@
 #define TRACE(_w)
 #endif
 
+constexpr float PINDA::m_fMeshScale[2];
+
+void PINDA::SetTrigger(bool bOn)
+{
+    if ((m_pIrq + TRIGGER_OUT)->value != bOn)
+        RaiseIRQ(TRIGGER_OUT,bOn);
+}
+
+void PINDA::UpdateCalEnvelope()
+{
+    m_fCalBox[0] = m_fCalBox[1] = 1e9f;
+    m_fCalBox[2] = m_fCalBox[3] = -1e9f;
+    for (int i=0; i<4; i++)
+    {
+        m_fCalBox[0] = min(m_fCalBox[0], _bed_calibration_points[2*i] - m_fCalRadius);
+        m_fCalBox[1] = min(m_fCalBox[1], _bed_calibration_points[(2*i)+1] - m_fCalRadius);
+        m_fCalBox[2] = max(m_fCalBox[2], _bed_calibration_points[2*i] + m_fCalRadius);
+        m_fCalBox[3] = max(m_fCalBox[3], _bed_calibration_points[(2*i)+1] + m_fCalRadius);
+    }
+}
+
 // This creates an inverted parabolic trigger zone above the cal point
 void PINDA::CheckTriggerNoSheet()
 {
-    float fEdist = 100;
-    bool bFound = false;
     //printf("PINDA: X: %f Y: %f\n", this->fPos[0], this->fPos[1]);
+    // Nowhere near any of the points - nothing can change.
+    if (m_fPos[0] < m_fCalBox[0] || m_fPos[1] < m_fCalBox[1] || m_fPos[0] > m_fCalBox[2] || m_fPos[1] > m_fCalBox[3])
+        return;
     for (int i=0; i<4; i++)
     {
-        fEdist = sqrt( pow(m_fPos[0] - PINDA::_bed_calibration_points[2*i],2)  +
-            pow(m_fPos[1] - PINDA::_bed_calibration_points[(2*i)+1],2));
-        if (fEdist<10)
+        float fDX = m_fPos[0] - PINDA::_bed_calibration_points[2*i];
+        float fDY = m_fPos[1] - PINDA::_bed_calibration_points[(2*i)+1];
+        if (fabs(fDX) >= m_fCalRadius || fabs(fDY) >= m_fCalRadius)
+            continue;
+        float fDist2 = (fDX*fDX) + (fDY*fDY);
+        if (fDist2 < m_fCalRadius*m_fCalRadius)
         {
-            bFound = true;
-            break;  // Stop as soon as we find a near cal point.
+            // Now calc z trigger height for the given distance from the point center
+            float fTrigZ = (1.0*(1-(fDist2/25.f))) + 3.0 ;
+            //printf("fTZ:%f fZ: %f\n",fTrigZ, this->fPos[2]);
+            SetTrigger(m_fPos[2]<=fTrigZ);
+            return;  // Stop as soon as we find a near cal point.
         }
     }
-    // Now calc z trigger height for the given distance from the point center
-    if (bFound)
-    {
-        float fTrigZ = (1.0*(1-pow(fEdist/5,2))) + 3.0 ;
-        //printf("fTZ:%f fZ: %f\n",fTrigZ, this->fPos[2]);
-        if (m_fPos[2]<=fTrigZ)
-            RaiseIRQ(TRIGGER_OUT,1);
-        else
-            RaiseIRQ(TRIGGER_OUT,0);
-    }
 }
 
 Scriptable::LineStatus PINDA::ProcessAction (unsigned int iAct, const vector<string> &vArgs)
@@ -81,8 +102,19 @@ Scriptable::LineStatus PINDA::ProcessAction (unsigned int iAct, const vector<str
 			float fX = stof(vArgs.at(1)), fY = stof(vArgs.at(2));
 			_bed_calibration_points[2*iVal] = fX;
 			_bed_calibration_points[(2*iVal)+1] = fY;
+			UpdateCalEnvelope();
 			return LineStatus::Finished;
 		}
+		case ActLoadSurface:
+		{
+			string strErr = LoadSurface(vArgs.at(0));
+			if (!strErr.empty())
+				return IssueLineError(strErr);
+			return LineStatus::Finished;
+		}
+		case ActClearSurface:
+			m_vSurface.clear();
+			return LineStatus::Finished;
 	}
 	return LineStatus::Unhandled;
 }
@@ -94,53 +126,121 @@ void PINDA::CheckTrigger()
     if (m_fPos[2]>5)
         return;
 
-    // Just calc the nearest MBL point and report it.
-    uint8_t iX = round(((m_fPos[0] - m_fOffset[0])/255.0)*7);
-    uint8_t iY = floor(((m_fPos[1] - m_fOffset[1])/210.0)*7);
+    float fZTrig;
+    if (!m_vSurface.empty())
+        fZTrig = SurfaceAt(m_fPos[0] - m_fOffset[0], m_fPos[1] - m_fOffset[1]);
+    else
+    {
+        // Just calc the nearest MBL point and report it.
+        int iX = static_cast<int>(((m_fPos[0] - m_fOffset[0])*m_fMeshScale[0]) + 0.5f);
+        int iY = static_cast<int>(floor((m_fPos[1] - m_fOffset[1])*m_fMeshScale[1]));
+        iX = max(0, min(6, iX));
+        iY = max(0, min(6, iY));
 
-    float fZTrig = m_mesh.points[iX+(7*iY)];
+        fZTrig = m_mesh.points[iX+(7*iY)];
+    }
 
     if (m_fPos[2]<=fZTrig)
     {
         //printf("Trig @ %u %u\n",iX,iY);
-        RaiseIRQ(TRIGGER_OUT,1);
+        SetTrigger(true);
     }
     else if (m_fPos[2]<=fZTrig + 0.5) // Just reset to 0 in a small distance above the trigger, to avoid IRQspam.
-        RaiseIRQ(TRIGGER_OUT,0);
+        SetTrigger(false);
 }
 
-void PINDA::OnXChanged(struct avr_irq_t * irq,uint32_t value)
+float PINDA::SurfaceAt(float fX, float fY)
 {
-    float *fVal = (float*) &value; // demangle the pos cast.
-     m_fPos[0] = fVal[0] + m_fOffset[0];
-    // We only need to check triggering on XY motion for selfcal
-    if (!m_bIsSheetPresent)
-        CheckTriggerNoSheet();
+    float fU = max(0.f, min(static_cast<float>(m_uiSurfW - 1), fX*m_fSurfScale[0]));
+    float fV = max(0.f, min(static_cast<float>(m_uiSurfH - 1), fY*m_fSurfScale[1]));
+    unsigned int iU = min(static_cast<unsigned int>(fU), m_uiSurfW - 2);
+    unsigned int iV = min(static_cast<unsigned int>(fV), m_uiSurfH - 2);
+    fU -= iU;
+    fV -= iV;
+    const float *pRow = &m_vSurface[(iV*m_uiSurfW) + iU];
+    float fFront = pRow[0] + ((pRow[1] - pRow[0])*fU);
+    float fBack = pRow[m_uiSurfW] + ((pRow[m_uiSurfW+1] - pRow[m_uiSurfW])*fU);
+    return fFront + ((fBack - fFront)*fV);
+}
 
+string PINDA::LoadSurface(const string &strFile)
+{
+    ifstream fileIn(strFile);
+    if (!fileIn.is_open())
+        return "Could not open height map " + strFile;
+    vector<float> vSurface;
+    unsigned int uiW = 0, uiH = 0;
+    string strLn;
+    while (getline(fileIn, strLn))
+    {
+        if (strLn.empty() || strLn[0]=='#')
+            continue;
+        for (char &c : strLn)
+            if (c==',' || c==';' || c=='\t' || c=='\r')
+                c = ' ';
+        istringstream line(strLn);
+        unsigned int uiCount = 0;
+        float fVal;
+        while (line >> fVal)
+        {
+            vSurface.push_back(fVal);
+            uiCount++;
+        }
+        if (!line.eof())
+            return "Bad value in " + strFile + " row " + to_string(uiH + 1);
+        if (uiCount == 0)
+            continue;
+        if (uiW && uiCount != uiW)
+            return "Row " + to_string(uiH + 1) + " of " + strFile + " has " + to_string(uiCount) + " values, expected " + to_string(uiW);
+        uiW = uiCount;
+        uiH++;
+    }
+    if (uiW<2 || uiH<2)
+        return "Height map " + strFile + " needs at least 2x2 values";
+    m_vSurface.swap(vSurface);
+    m_uiSurfW = uiW;
+    m_uiSurfH = uiH;
+    m_fSurfScale[0] = static_cast<float>(uiW - 1)/255.f;
+    m_fSurfScale[1] = static_cast<float>(uiH - 1)/210.f;
+    printf("PINDA: Loaded a %ux%u height map from %s\n", uiW, uiH, strFile.c_str());
+    return "";
 }
 
-void PINDA::OnYChanged(struct avr_irq_t * irq,uint32_t value)
+void PINDA::OnXYMotion(const MotionChannel::MotionSample_t &)
 {
-    float *fVal = (float*) &value; // demangle the pos cast.
-     m_fPos[1] = fVal[0] + m_fOffset[1];
     // We only need to check triggering on XY motion for selfcal
-    if (!m_bIsSheetPresent)
-        CheckTriggerNoSheet();
-
+    m_fPos[0] = m_pMotion[0]->GetPos() + m_fOffset[0];
+    m_fPos[1] = m_pMotion[1]->GetPos() + m_fOffset[1];
+    CheckTriggerNoSheet();
 }
 
-void PINDA::OnZChanged(avr_irq_t *irq, uint32_t value)
+void PINDA::OnZMotion(const MotionChannel::MotionSample_t &sample)
 {
     // Z is translated so that the bed level heights don't need to account for it, e.g. they are just
     // zero-referenced against this internal "z" value.
-    float *fVal = (float*) &value; // demangle the pos cast.
-    m_fPos[2] = fVal[0] - m_fZTrigHeight;
+    m_fPos[0] = m_pMotion[0]->GetPos() + m_fOffset[0];
+    m_fPos[1] = m_pMotion[1]->GetPos() + m_fOffset[1];
+    m_fPos[2] = sample.fPos - m_fZTrigHeight;
+    bool bInRange = m_fPos[2] <= m_fZRange;
+    if (bInRange != m_bZInRange)
+    {
+        m_bZInRange = bInRange;
+        UpdateXYWatch();
+    }
     if (!m_bIsSheetPresent)
         CheckTriggerNoSheet();
     else
         CheckTrigger();
 }
 
+void PINDA::UpdateXYWatch()
+{
+    if (!m_pMotion[0])
+        return;
+    bool bOpen = m_bZInRange && !m_bIsSheetPresent;
+    for (int i=0; i<2; i++)
+        m_pMotion[i]->SetWindow(m_uiWatch[i], bOpen ? -1e9f : 1.f, bOpen ? 1e9f : 0.f);
+}
 
 void PINDA::SetMBLMap()
 {
@@ -160,28 +260,34 @@ void PINDA::ToggleSheet()
     m_bIsSheetPresent=!m_bIsSheetPresent;
     printf("Steel sheet: %s\n", m_bIsSheetPresent? "INSTALLED" : "REMOVED");
     RaiseIRQ(SHEET_OUT,m_bIsSheetPresent);
+    UpdateXYWatch();
 }
 
 PINDA::PINDA(float fX, float fY):Scriptable("PINDA"),m_fOffset{fX,fY}
 {
     SetMBLMap();
+    UpdateCalEnvelope();
 }
 
-void PINDA::Init(struct avr_t * avr, avr_irq_t *irqX, avr_irq_t *irqY, avr_irq_t *irqZ)
+void PINDA::Init(struct avr_t * avr, MotionChannel *pX, MotionChannel *pY, MotionChannel *pZ)
 {
     _Init(avr, this);
 
 	RegisterActionAndMenu("ToggleSheet","Toggles the presence of the steel sheet",ActToggleSheet);
 	RegisterAction("SetMBLPoint","Sets the given MBL point (0-48) to the given Z value",ActSetMBLPoint,{ArgType::Int,ArgType::Float});
 	RegisterAction("SetXYPoint","Sets the (0-3)rd XY cal point position to x,y. (index, x,y)",ActSetXYCalPont,{ArgType::Int, ArgType::Float,ArgType::Float});
+	RegisterAction("LoadSurface","Loads a bed height map (CSV, rows of X samples from front to back, any resolution) to use instead of the MBL points",ActLoadSurface,{ArgType::String});
+	RegisterAction("ClearSurface","Goes back to the 7x7 MBL points after LoadSurface",ActClearSurface);
 
-    ConnectFrom(irqX, X_POS_IN);
-    ConnectFrom(irqY, Y_POS_IN);
-    ConnectFrom(irqZ, Z_POS_IN);
-
-    RegisterNotify(X_POS_IN, MAKE_C_CALLBACK(PINDA,OnXChanged),this);
-    RegisterNotify(Y_POS_IN, MAKE_C_CALLBACK(PINDA,OnYChanged),this);
-    RegisterNotify(Z_POS_IN, MAKE_C_CALLBACK(PINDA,OnZChanged),this);
+    m_pMotion[0] = pX;
+    m_pMotion[1] = pY;
+    m_pMotion[2] = pZ;
+    auto fcnXY = [this](const MotionChannel::MotionSample_t &s) { OnXYMotion(s); };
+    m_uiWatch[0] = pX->Watch(fcnXY, 1.f, 0.f);
+    m_uiWatch[1] = pY->Watch(fcnXY, 1.f, 0.f);
+    pZ->Watch([this](const MotionChannel::MotionSample_t &s) { OnZMotion(s); }, -1e9f, m_fZRange + m_fZTrigHeight);
+    m_bZInRange = pZ->GetPos() - m_fZTrigHeight <= m_fZRange;
+    UpdateXYWatch();
     RaiseIRQ(TRIGGER_OUT,0);
 
 	auto pTH = TelemetryHost::GetHost();
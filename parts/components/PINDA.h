@@ -26,6 +26,7 @@
 #include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
 #include "IScriptable.h"     // for IScriptable::LineStatus
+#include "MotionChannel.h"   // for MotionChannel, MotionChannel::MotionSample_t
 #include "Scriptable.h"      // for Scriptable
 #include "sim_avr.h"         // for avr_t
 #include "sim_irq.h"         // for avr_irq_t
@@ -33,14 +34,15 @@
 
 class PINDA:public BasePeripheral,public Scriptable{
     public:
-        #define IRQPAIRS _IRQ(X_POS_IN,"<pinda.x_in") _IRQ(Y_POS_IN,"<pinda.y_in") _IRQ(Z_POS_IN,"<pinda.Z_in") _IRQ(TRIGGER_OUT,">pinda.out") _IRQ(SHEET_OUT,">sheet.out")
+        #define IRQPAIRS _IRQ(TRIGGER_OUT,">pinda.out") _IRQ(SHEET_OUT,">sheet.out")
         #include "IRQHelper.h"
 
     // Creates a new PINDA with X/Y nozzle offsets fX and fY
     PINDA(float fX = 0, float fY = 0);
 
-    // Initializes the PINDA on AVR, and connects it to the X/Y/Z position IRQs
-    void Init(avr_t *avr, avr_irq_t *irqX, avr_irq_t *irqY, avr_irq_t *irqZ);
+    // Initializes the PINDA on AVR, and watches the X/Y/Z motion. It is only called back
+    // while Z is low enough to trigger, and only on XY motion when that matters (no sheet).
+    void Init(avr_t *avr, MotionChannel *pX, MotionChannel *pY, MotionChannel *pZ);
 
     // Toggles steel sheet presence. If it is removed, the PINDA will exhibit XY calibration trigger behaviour.
     void ToggleSheet();
@@ -60,16 +62,34 @@ private:
 	{
 		ActToggleSheet,
 		ActSetMBLPoint,
-		ActSetXYCalPont
+		ActSetXYCalPont,
+		ActLoadSurface,
+		ActClearSurface
 	};
 
-    void OnXChanged(avr_irq_t *irq, uint32_t value);
-    void OnYChanged(avr_irq_t *irq, uint32_t value);
-    void OnZChanged(avr_irq_t *irq, uint32_t value);
+    // Loads a bed height map (mm) from a CSV file, one row of X samples per line from front (Y=0)
+    // to back, any number of rows and columns (at least 2x2). Replaces the 7x7 MBL map until cleared.
+    // Returns an error string, empty on success.
+    string LoadSurface(const string &strFile);
+
+    // Bilinear height of the loaded surface at a bed position (mm, mesh coordinates).
+    float SurfaceAt(float fX, float fY);
+
+    void OnXYMotion(const MotionChannel::MotionSample_t &sample);
+    void OnZMotion(const MotionChannel::MotionSample_t &sample);
+
+    // Opens the XY watches while they can change the output, i.e. no sheet and Z in range.
+    void UpdateXYWatch();
 
     // Checks trigger z if no sheet is present.
     void CheckTriggerNoSheet();
 
+    // Raises TRIGGER_OUT only if it changes.
+    void SetTrigger(bool bOn);
+
+    // Recomputes the bounding box around the cal points, call if they change.
+    void UpdateCalEnvelope();
+
     // Checks Z trigger if sheet is present (MBL)
     void CheckTrigger();
 
@@ -78,7 +98,17 @@ private:
 	float m_fZTrigHeight = 1.0; // Trigger height above Z=0, i.e. the "zip tie" adjustment
     float m_fOffset[2] = {0,0}; // pinda X Y offset  from nozzle
     float m_fPos[3] = {10,10,10}; // Current position tracking.
+    MotionChannel *m_pMotion[3] = {nullptr, nullptr, nullptr};
+    size_t m_uiWatch[2] = {0,0}; // X, Y
+    bool m_bZInRange = false;
+    static constexpr float m_fZRange = 5.f; // Above the trigger height; no trigger math matters past this.
     MBLMap_t m_mesh;// MBL map
+    vector<float> m_vSurface; // Loaded height map, row-major from Y=0, empty if none
+    unsigned int m_uiSurfW = 0, m_uiSurfH = 0;
+    float m_fSurfScale[2] = {0,0}; // mm to sample index
+    float m_fCalBox[4] = {0,0,0,0}; // minX, minY, maxX, maxY of the selfcal trigger zones
+    static constexpr float m_fCalRadius = 10.f;
+    static constexpr float m_fMeshScale[2] = {7.f/255.f, 7.f/210.f}; // mm to MBL index
     atomic_bool m_bIsSheetPresent {true}; // Is the steel sheet present? IF yes, PINDA will attempt to simulate the bed sensing point for selfcal instead.
 
     // pulled from mesh_bed_calibration.cpp
@@ -22,14 +22,25 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>          // for abs
+#include <algorithm>         // for search
 
 #include "RotaryEncoder.h"
+#include "HD44780.h"         // for HD44780
+#include "Log.h"             // for LOG, Log
 #include "TelemetryHost.h"
+#include "sim_time.h"        // for avr_usec_to_cycles
 
 static constexpr uint8_t  STATE_COUNT = 4;
 static constexpr uint32_t PULSE_DURATION_US = 10000UL;
 static constexpr uint32_t BUTTON_DURATION_US = 100000UL;
 static constexpr uint32_t BUTTON_DURATION_LONG_US = 3000000UL; // 3s
+static constexpr uint32_t NAV_PHASE_US = 2500UL;
+static constexpr uint32_t NAV_STABLE_US = 30000UL; // Display unchanged this long = redraw done.
+static constexpr uint32_t NAV_SETTLE_MAX_US = 300000UL; // or give up waiting for that after this long.
+static constexpr uint32_t NAV_MAX_CLICKS = 100;
+
+static Log::Module logRotEnc("RotaryEncoder");
 
 static constexpr uint8_t m_States[STATE_COUNT] = {
 	0b00,
@@ -45,51 +56,42 @@ avr_cycle_count_t RotaryEncoder::OnStateChangeTimer(avr_t * avr,avr_cycle_count_
 			// Advance phase forwards
             m_iPhase = (m_iPhase+1)%STATE_COUNT;
 
-			if (m_bVerbose) {
-				printf("ROTENC: CW twist, pins A:%x, B:%x\n",
-					m_States[m_iPhase]>>1,
-					m_States[m_iPhase]&1);
-			}
+			LOG(logRotEnc, Debug, "CW twist, pins A:%x, B:%x",
+				m_States[m_iPhase]>>1,
+				m_States[m_iPhase]&1);
 			break;
 		case CCW_CLICK:
 			// Advance phase backwards
 			 m_iPhase = (m_iPhase+3)%STATE_COUNT;
-			if (m_bVerbose) {
-				printf("ROTENC: CCW twist, pins: A:%x, B:%x\n",
-					m_States[m_iPhase]>>1,
-					m_States[m_iPhase]&1);
-			}
+			LOG(logRotEnc, Debug, "CCW twist, pins: A:%x, B:%x",
+				m_States[m_iPhase]>>1,
+				m_States[m_iPhase]&1);
 			break;
 
 		default:
-			printf("Rotenc: Invalid direction.\n"); // Invalid direction
+			LOG(logRotEnc, Warning, "Invalid direction.");
 			break;
 	}
     RaiseIRQ(OUT_A, m_States[m_iPhase]>>1);
     RaiseIRQ(OUT_B, m_States[m_iPhase]&1);
 
     if(--m_uiPulseCt >0) // Continue ticking the encoder
-		RegisterTimerUsec(m_fcnStateChange,PULSE_DURATION_US,this);
-	else
-		m_bTimerRunning = false;
+		return when + m_uiPhaseCycles;
+	m_bTimerRunning = false;
 	return 0;
 }
 
 avr_cycle_count_t RotaryEncoder::OnButtonReleaseTimer(avr_t * avr, avr_cycle_count_t when)
 {
 	RaiseIRQ(OUT_BUTTON, 1);
-	if (m_bVerbose) {
-		printf("ROTENC: Button release\n");
-	}
+	LOG(logRotEnc, Debug, "Button release");
 	return 0;
 }
 
 void RotaryEncoder::_Push(uint32_t uiDuration)
 {
 	// Press down
-	if (m_bVerbose) {
-		printf("ROTENC: Button press\n");
-	}
+	LOG(logRotEnc, Debug, "Button press");
 	RaiseIRQ(OUT_BUTTON, 0);
 
 	// Pull up later
@@ -121,17 +123,27 @@ void RotaryEncoder::Release()
  */
 void RotaryEncoder::Twist(Direction eDir)
 {
+	TwistN(eDir == CW_CLICK ? 1 : -1);
+}
+
+void RotaryEncoder::TwistN(int iClicks, uint32_t uiPhaseUs)
+{
+	if (!iClicks)
+		return;
+	Direction eDir = iClicks > 0 ? CW_CLICK : CCW_CLICK;
+	uint32_t uiPulses = 4U * abs(iClicks);
 	if (m_eDirection == eDir)
-		m_uiPulseCt+=4; // Just tick it more if the dir is correct.
+		m_uiPulseCt+=uiPulses; // Just tick it more if the dir is correct.
 	else
 	{
 		m_eDirection = eDir;
-		m_uiPulseCt = 4;
+		m_uiPulseCt = uiPulses;
 	}
+	m_uiPhaseCycles = avr_usec_to_cycles(m_pAVR, uiPhaseUs ? uiPhaseUs : PULSE_DURATION_US);
 	if (!m_bTimerRunning) // Don't register if the timer is already ticking.
 	{
 		m_bTimerRunning = true;
-		RegisterTimerUsec(m_fcnStateChange,PULSE_DURATION_US, this);
+		RegisterTimer(m_fcnStateChange,m_uiPhaseCycles, this);
 	}
 }
 
@@ -163,10 +175,90 @@ Scriptable::LineStatus RotaryEncoder::ProcessAction(unsigned int iAct, const vec
 		case ActRelease:
 			Release();
 			break;
+		case ActTwistN:
+			if (!m_bScriptTwist)
+			{
+				m_bScriptTwist = true;
+				TwistN(stoi(vArgs.at(0)), stoul(vArgs.at(1)));
+			}
+			if (m_bTimerRunning)
+				return LineStatus::Running;
+			m_bScriptTwist = false;
+			break;
+		case ActNavigateTo:
+			return Navigate(vArgs.at(0));
 	}
 	return LineStatus::Finished;
 }
 
+Scriptable::LineStatus RotaryEncoder::Navigate(const string &strText)
+{
+	if (!m_pLCD)
+		return IssueLineError("NavigateTo needs a display to read the menu from");
+	avr_cycle_count_t uiNow = m_pAVR->cycle;
+	if (strText != m_strNavText) // New target, start over.
+	{
+		m_strNavText = strText;
+		m_uiNavClicks = m_uiNavFlips = 0;
+		m_bNavScrolled = false;
+		m_bNavDown = true;
+		m_uiNavTwisted = 0;
+	}
+	else
+	{
+		if (m_bTimerRunning)
+			return LineStatus::Waiting;
+		// Let the firmware finish redrawing after the last twist before reading the menu.
+		uint32_t uiVersion = m_pLCD->GetVersion();
+		if (uiVersion != m_uiNavVersion)
+		{
+			m_uiNavVersion = uiVersion;
+			m_uiNavStable = uiNow;
+		}
+		if (uiNow - m_uiNavStable < avr_usec_to_cycles(m_pAVR, NAV_STABLE_US) &&
+			uiNow - m_uiNavTwisted < avr_usec_to_cycles(m_pAVR, NAV_SETTLE_MAX_US))
+			return LineStatus::Waiting;
+	}
+
+	// The selected menu line is marked with a '>' in the first column. CW moves it down.
+	int iTarget = -1, iCursor = -1;
+	string strScreen;
+	for (int i=0; i<m_pLCD->GetHeight(); i++)
+	{
+		const char *pBegin = m_pLCD->GetRow(i), *pEnd = pBegin + m_pLCD->GetWidth();
+		strScreen.append(pBegin, pEnd);
+		if (*pBegin == '>')
+			iCursor = i;
+		if (iTarget<0 && search(pBegin, pEnd, strText.begin(), strText.end()) != pEnd)
+			iTarget = i;
+	}
+	if (iTarget>=0 && iTarget == iCursor)
+	{
+		m_strNavText.clear();
+		return LineStatus::Finished;
+	}
+	if (m_bNavScrolled && strScreen == m_strNavScreen && ++m_uiNavFlips<2)
+		m_bNavDown = !m_bNavDown; // Scrolled, but nothing moved: end of the menu.
+	if (m_uiNavClicks >= NAV_MAX_CLICKS || m_uiNavFlips >= 2)
+	{
+		m_strNavText.clear();
+		return IssueLineError("NavigateTo: \"" + strText + "\" not found in the menu");
+	}
+	m_strNavScreen = strScreen;
+	int iClicks;
+	m_bNavScrolled = iTarget<0 || iCursor<0;
+	if (m_bNavScrolled)
+		iClicks = m_bNavDown ? 1 : -1;
+	else
+		iClicks = iTarget - iCursor;
+	m_uiNavClicks += abs(iClicks);
+	m_uiNavTwisted = uiNow;
+	m_uiNavStable = uiNow;
+	m_uiNavVersion = m_pLCD->GetVersion();
+	TwistN(iClicks, NAV_PHASE_US);
+	return LineStatus::Waiting;
+}
+
 RotaryEncoder::RotaryEncoder():Scriptable("Encoder")
 {
 	RegisterActionAndMenu("Press", "Presses the encoder button",ActPress);
@@ -174,4 +266,6 @@ RotaryEncoder::RotaryEncoder():Scriptable("Encoder")
 	RegisterActionAndMenu("PressAndRelease", "Presses the encoder button",ActPressAndRelease);
 	RegisterActionAndMenu("TwistCW", "Twists the encoder one cycle clockwise",ActTwistCW);
 	RegisterActionAndMenu("TwistCCW", "Twists the encoder once cycle counterclockwise",ActTwistCCW);
+	RegisterAction("TwistN", "Twists the encoder N cycles (negative is counterclockwise), one phase every <rate> us (0 for the normal rate), and waits for it to finish",ActTwistN,{ArgType::Int,ArgType::Int});
+	RegisterAction("NavigateTo", "Twists the encoder until the menu cursor (>) is on the line containing the given text",ActNavigateTo,{ArgType::String});
 }
@@ -34,6 +34,8 @@
 #include "sim_avr_types.h"     // for avr_cycle_count_t
 #include "sim_cycle_timers.h"  // for avr_cycle_timer_t
 
+class HD44780;
+
 class RotaryEncoder:public BasePeripheral,public Scriptable
 {
     public:
@@ -53,6 +55,13 @@ class RotaryEncoder:public BasePeripheral,public Scriptable
         // Twists the encoder in the direction "eDir"
         void Twist(Direction eDir);
 
+        // Twists iClicks detents (negative is CCW) in one go, stepping a phase every uiPhaseUs.
+        // 0 uses the normal rate. Too fast and the firmware will start missing steps.
+        void TwistN(int iClicks, uint32_t uiPhaseUs = 0);
+
+        // Display to read the menu from for NavigateTo.
+        inline void SetDisplay(HD44780 *pLCD) { m_pLCD = pLCD; }
+
         // Pushes and releases the button after a short delay.
         void Push();
 
@@ -67,6 +76,9 @@ class RotaryEncoder:public BasePeripheral,public Scriptable
 	protected:
 		LineStatus ProcessAction(unsigned int action, const vector<string> &vArgs);
 
+		// One pass of NavigateTo: waits for the display to settle, then steps the cursor towards strText.
+		LineStatus Navigate(const string &strText);
+
     private:
 
         void _Push(uint32_t uiDuration);
@@ -84,13 +96,25 @@ class RotaryEncoder:public BasePeripheral,public Scriptable
 			ActTwistCCW,
 			ActPress,
 			ActRelease,
-			ActPressAndRelease
+			ActPressAndRelease,
+			ActTwistN,
+			ActNavigateTo
 		};
 
-        bool m_bVerbose = false;
-        uint8_t m_uiPulseCt = 0;
+        uint32_t m_uiPulseCt = 0;
+        avr_cycle_count_t m_uiPhaseCycles = 0;
         Direction m_eDirection = CCW_CLICK;
         int m_iPhase = 0;			// current position
         bool m_bTimerRunning = false;
 
+        bool m_bScriptTwist = false; // A TwistN line is in progress.
+
+        // NavigateTo state.
+        HD44780 *m_pLCD = nullptr;
+        string m_strNavText, m_strNavScreen;
+        uint32_t m_uiNavVersion = 0, m_uiNavClicks = 0;
+        avr_cycle_count_t m_uiNavStable = 0, m_uiNavTwisted = 0;
+        bool m_bNavScrolled = false, m_bNavDown = true;
+        uint8_t m_uiNavFlips = 0;
+
 };
@@ -23,17 +23,25 @@
 	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "SDCard.h"
-#include <assert.h>    // for assert
-#include <errno.h>     // for errno
-#include <fcntl.h>     // for open, O_CLOEXEC, O_CREAT, O_RDWR
-#include <stdio.h>     // for printf, fprintf, NULL, size_t, stderr
-#include <string.h>    // for memset
-#include <sys/file.h>  // for flock, LOCK_UN, LOCK_EX
-#include <sys/mman.h>  // for mmap, msync, munmap, MAP_FAILED, MAP_SHARED
-#include <sys/stat.h>  // for fstat, stat, S_IRUSR, S_IWUSR
-#include <unistd.h>    // for close, off_t, ftruncate
+#include <assert.h>      // for assert
+#include <errno.h>       // for errno
+#include <fcntl.h>       // for open, O_CLOEXEC, O_CREAT, O_RDWR, O_RDONLY
+#include <stdio.h>       // for printf, fprintf, NULL, size_t, stderr
+#include <string.h>      // for memset
+#include <sys/file.h>    // for flock, LOCK_UN, LOCK_EX, LOCK_SH
+#include <sys/mman.h>    // for mmap, madvise, msync, munmap, MAP_FAILED, MAP_SHARED...
+#include <sys/stat.h>    // for fstat, stat, S_IRUSR, S_IWUSR, S_ISDIR
+#include <unistd.h>      // for close, off_t, ftruncate
+#include <algorithm>     // for min
+#include <array>         // for array
+#include "FatImage.h"    // for FatImage
+#include "ScriptHost.h"  // for ScriptHost
 #include "TelemetryHost.h"
 
+bool SDCard::m_bDefaultOverlay = false;
+bool SDCard::m_bLazyCRC = false;
+const off_t SDCard::PREFETCH_SIZE;
+
 static uint8_t CRC7(const uint8_t data[], size_t count)
 {
 	const uint8_t poly = 0b10001001;
@@ -61,6 +69,12 @@ Scriptable::LineStatus SDCard::ProcessAction(unsigned int iAct, const vector<str
 			return LineStatus::Finished;
 		case ActMountFile:
 			return Mount(vArgs.at(0)) ? LineStatus::Error : LineStatus::Finished; // 0 = success.
+		case ActMountOverlay:
+			return Mount(vArgs.at(0), 0, true) ? LineStatus::Error : LineStatus::Finished;
+		case ActPutFile:
+			if (ScriptHost::IsFirstCall() && !PutFile(vArgs.at(0), vArgs.at(1)))
+				return LineStatus::Error;
+			return m_bEjected ? LineStatus::Running : LineStatus::Finished; // Until it's back in.
 
 	};
 	return LineStatus::Unhandled;
@@ -117,6 +131,51 @@ const uint16_t SDCard::m_crctab[256] = {
 	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
 };
 
+uint16_t SDCard::BlockCRC(const uint8_t *pData, size_t uiLen)
+{
+	// Table k gives the CRC of a byte followed by k zeros, so eight bytes fold in with one lookup each.
+	static const std::array<std::array<uint16_t, 256>, 8> tables = []()
+	{
+		std::array<std::array<uint16_t, 256>, 8> t;
+		for (int b=0; b<256; b++)
+		{
+			t[0][b] = m_crctab[b];
+			for (int k=1; k<8; k++)
+				t[k][b] = m_crctab[t[k-1][b] >> 8] ^ static_cast<uint16_t>(t[k-1][b] << 8);
+		}
+		return t;
+	}();
+	uint16_t uiCRC = 0;
+	size_t i = 0;
+	for (; i + 8 <= uiLen; i += 8)
+	{
+		const uint8_t *p = pData + i;
+		uiCRC = tables[7][p[0] ^ (uiCRC >> 8)] ^ tables[6][p[1] ^ (uiCRC & 0xFF)] ^ tables[5][p[2]] ^ tables[4][p[3]] ^
+			tables[3][p[4]] ^ tables[2][p[5]] ^ tables[1][p[6]] ^ tables[0][p[7]];
+	}
+	for (; i < uiLen; i++)
+		uiCRC = m_crctab[((uiCRC >> 8) ^ pData[i]) & 0xFF] ^ static_cast<uint16_t>(uiCRC << 8);
+	return uiCRC;
+}
+
+uint16_t SDCard::GetReadCRC()
+{
+	if (m_bLazyCRC && !m_bCRCOn)
+		return 0xFFFF;
+	bool bBlock = read_bytes_remaining == BLOCK_SIZE && read_ptr >= m_data && read_ptr < m_data + m_data_length;
+	if (!bBlock) // The CSD
+		return BlockCRC(read_ptr, read_bytes_remaining);
+	off_t addr = read_ptr - m_data;
+	auto it = m_mCRCs.find(addr);
+	if (it != m_mCRCs.end())
+		return it->second;
+	if (m_mCRCs.size() >= MAX_CACHED_CRCS)
+		m_mCRCs.clear();
+	uint16_t uiCRC = BlockCRC(read_ptr, BLOCK_SIZE);
+	m_mCRCs[addr] = uiCRC;
+	return uiCRC;
+}
+
 /* Debug macros. */
 // #define SD_CARD_DEBUG
 #ifdef SD_CARD_DEBUG
@@ -163,6 +222,8 @@ SDCard::State SDCard::ProcessCommand()
 
 			break;
 		case Command::CMD12:
+			/* STOP_TRANSMISSION. The first byte is the stuff byte the host skips. */
+			m_bMultiRead = false;
 			m_command_response.data[0] = 0x01;
 			m_command_response.data[1] = 0x00;
 			m_command_response.length = 2;
@@ -190,19 +251,20 @@ SDCard::State SDCard::ProcessCommand()
 
 			break;
 		}
-		case Command::CMD17: {
+		case Command::CMD17:
+		case Command::CMD18: {
 			off_t addr;
 
-			/* READ_SINGLE_BLOCK. Reads a block of the size selected by the SET_BLOCKLEN command.
+			/* READ_SINGLE_BLOCK/READ_MULTIPLE_BLOCK. Reads a block of the size selected by the SET_BLOCKLEN command.
 			 * Initiate a 512B read (TODO: we ignore SET_BLOCKLEN) from the address provided in the command. */
 			addr = AddressToDataIdx(m_CmdIn.bits.address);
 
-			DEBUG ("Read single block (CMD17) from address %lu.", addr);
+			DEBUG ("Read block (CMD%u) from address %lu.", m_CmdIn.bits.cmd, addr);
 
 			if (!IsBlockAligned(addr)) {
 				/* Address misaligned. */
 				COMMAND_RESPONSE_R1 (R1_ADDRESS_MISALIGN);
-			} else if (addr > m_data_length) {
+			} else if (addr + BLOCK_SIZE > m_data_length) {
 				/* Address out of range. */
 				COMMAND_RESPONSE_R1 (R1_ADDRESS_OUT_OF_RANGE);
 			} else {
@@ -212,23 +274,29 @@ SDCard::State SDCard::ProcessCommand()
 				next_state = State::DATA_READ_TOKEN;
 				read_ptr = m_data + addr;
 				read_bytes_remaining = BLOCK_SIZE;
+				TouchBlock(read_ptr);
+				m_mtrRead.Add(BLOCK_SIZE);
+				m_bMultiRead = m_CmdIn.bits.cmd == Command::CMD18;
+				if (m_bMultiRead)
+					Prefetch(addr);
 			}
 
 			break;
 		}
-		case Command::CMD24: {
+		case Command::CMD24:
+		case Command::CMD25: {
 			off_t addr;
 
-			/* WRITE_BLOCK. Writes a block of the size selected by the SET_BLOCKLEN command.
+			/* WRITE_BLOCK/WRITE_MULTIPLE_BLOCK. Writes a block of the size selected by the SET_BLOCKLEN command.
 			 * TODO: we ignore SET_BLOCKLEN. */
 			addr = AddressToDataIdx(m_CmdIn.bits.address);
 
-			DEBUG ("Write block (CMD24) from address %lu.", addr);
+			DEBUG ("Write block (CMD%u) from address %lu.", m_CmdIn.bits.cmd, addr);
 
 			if (!IsBlockAligned(addr)) {
 				/* Address misaligned. */
 				COMMAND_RESPONSE_R1 (R1_ADDRESS_MISALIGN);
-			} else if (addr > m_data_length) {
+			} else if (addr + BLOCK_SIZE > m_data_length) {
 				/* Address out of range. */
 				COMMAND_RESPONSE_R1 (R1_ADDRESS_OUT_OF_RANGE);
 			} else {
@@ -238,6 +306,10 @@ SDCard::State SDCard::ProcessCommand()
 				next_state = State::DATA_WRITE_TOKEN;
 				write_ptr = m_data + addr;
 				write_bytes_remaining = BLOCK_SIZE;
+				TouchBlock(write_ptr); // So a later fill doesn't clobber what was written.
+				DirtyBlock(write_ptr);
+				m_mtrWritten.Add(BLOCK_SIZE);
+				m_bMultiWrite = m_CmdIn.bits.cmd == Command::CMD25;
 			}
 
 			break;
@@ -254,6 +326,11 @@ SDCard::State SDCard::ProcessCommand()
 			/* READ_OCR. */
 			COMMAND_RESPONSE_R3 (0x00, m_ocr);
 			break;
+		case Command::CMD59:
+			/* CRC_ON_OFF. Only changes what we send, the host's CRCs aren't checked either way. */
+			m_bCRCOn = m_CmdIn.bits.address & 1;
+			COMMAND_RESPONSE_R1 (0x00);
+			break;
 		default:
 			/* Illegal command. */
 			COMMAND_RESPONSE_R1 (R1_ILLEGAL_COMMAND);
@@ -277,15 +354,22 @@ uint8_t SDCard::OnSPIIn(struct avr_irq_t *irq, uint32_t value)
 {
 	DEBUG ("Received byte %x (in state %u).", value, m_state);
 	uint8_t uiReply = 0xFF;
+	/* The host clocks 0xFFs while reading, anything else during a multi-block read is the start of CMD12 (which may come mid-block). */
+	if (m_bMultiRead && value != 0xff && (m_state == State::DATA_READ_TOKEN || m_state == State::DATA_READ || m_state == State::DATA_READ_CRC))
+		m_state = State::IDLE;
 	/* Handle the command. */
 	switch (m_state) {
 		case State::IDLE:
 			if (value == 0xff) {
+				// A multi-block read sends one 0xFF (access time) between blocks, then the next token.
+				if (m_bMultiRead)
+					NextReadBlock();
 				SetSendReplyFlag(); // Sends 0xFF
 				break;
 			} else {
 				m_state = State::COMMAND_REQUEST;
 				m_CmdCount = 0;
+				m_bMultiWrite = false;
 
 				/* Fall through. */
 			}
@@ -331,15 +415,14 @@ uint8_t SDCard::OnSPIIn(struct avr_irq_t *irq, uint32_t value)
 		}
 		case State::DATA_READ_TOKEN:
 			/* Output the data token. */
-			uiReply = 0xfe;
+			uiReply = TOKEN_SINGLE;
 			SetSendReplyFlag();
 			m_state = State::DATA_READ;
-			m_CRC = 0;
+			m_CRC = GetReadCRC();
 			break;
 		case State::DATA_READ:
 			/* Pump out data to the microcontroller. */
 			uiReply = *(read_ptr);
-			CRC_ADD(*(read_ptr));
 			read_ptr++;
 			SetSendReplyFlag();
 			if (--read_bytes_remaining == 0) {
@@ -363,9 +446,12 @@ uint8_t SDCard::OnSPIIn(struct avr_irq_t *irq, uint32_t value)
 		case State::DATA_WRITE_TOKEN:
 			/* Receive the data token. */
 			/* TODO: We don't check the token is valid. */
-			if (value == 0xfe) {
+			if (value == (m_bMultiWrite ? TOKEN_MULTI_WRITE : TOKEN_SINGLE)) {
 				/* Valid write token. */
 				m_state = State::DATA_WRITE;
+			} else if (m_bMultiWrite && value == TOKEN_STOP_TRAN) {
+				m_bMultiWrite = false;
+				m_state = State::IDLE;
 			}
 			/* The microcontroller is waiting for us to be ready. */
 			SetSendReplyFlag(); // Sends 0xFF
@@ -400,6 +486,20 @@ uint8_t SDCard::OnSPIIn(struct avr_irq_t *irq, uint32_t value)
 				/* Have we received both bytes of the CRC and transmitted our response? */
 				m_state = State::IDLE;
 				write_bytes_remaining = 0;
+				if (m_bMultiWrite)
+				{
+					/* write_ptr has moved on to the next block already. */
+					if (write_ptr + BLOCK_SIZE > m_data + m_data_length)
+						m_bMultiWrite = false;
+					else
+					{
+						write_bytes_remaining = BLOCK_SIZE;
+						TouchBlock(write_ptr);
+						DirtyBlock(write_ptr);
+						m_mtrWritten.Add(BLOCK_SIZE);
+						m_state = State::DATA_WRITE_TOKEN;
+					}
+				}
 			}
 			break;
 		default:
@@ -409,6 +509,34 @@ uint8_t SDCard::OnSPIIn(struct avr_irq_t *irq, uint32_t value)
 	return uiReply;
 }
 
+void SDCard::NextReadBlock()
+{
+	/* read_ptr has moved on to the next block already. */
+	off_t addr = read_ptr - m_data;
+	if (addr + BLOCK_SIZE > m_data_length)
+	{
+		DEBUG ("Multi-block read ran off the end at %lu.", addr);
+		m_bMultiRead = false;
+		return;
+	}
+	Prefetch(addr);
+	TouchBlock(read_ptr);
+	m_mtrRead.Add(BLOCK_SIZE);
+	read_bytes_remaining = BLOCK_SIZE;
+	m_state = State::DATA_READ_TOKEN;
+}
+
+void SDCard::Prefetch(off_t addr)
+{
+	if (m_pVirtual)
+		return; // Anonymous memory, nothing to read ahead.
+	if (addr + BLOCK_SIZE <= m_uiPrefetchEnd && addr >= m_uiPrefetchEnd - PREFETCH_SIZE)
+		return;
+	off_t start = addr - (addr % PREFETCH_SIZE); // Page aligned, as madvise needs.
+	madvise(m_data + start, min(PREFETCH_SIZE, m_data_length - start), MADV_WILLNEED);
+	m_uiPrefetchEnd = start + PREFETCH_SIZE;
+}
+
 void SDCard::InitCSD()
 {
 	memset(&m_csd, 0, sizeof(m_csd));
@@ -476,14 +604,24 @@ void SDCard::Init(struct avr_t *avr)
 	pTH->AddTrace(this, SPI_BYTE_OUT,{TC::SPI, TC::Storage},8);
 	pTH->AddTrace(this, SPI_CSEL, {TC::SPI, TC::Storage, TC::OutputPin});
 	pTH->AddTrace(this, CARD_PRESENT, {TC::InputPin, TC::Storage});
+
+	m_mtrRead.Register("mk404_sd_read_bytes_total", "Bytes the firmware has read from the SD card.");
+	m_mtrRead.RegisterRate("mk404_sd_read_rate_bytes", "SD card bytes read per wall-clock second.");
+	m_mtrWritten.Register("mk404_sd_written_bytes_total", "Bytes the firmware has written to the SD card.");
+	m_mtrWritten.RegisterRate("mk404_sd_write_rate_bytes", "SD card bytes written per wall-clock second.");
 }
 
 int SDCard::Mount(const std::string &filename, off_t image_size)
+{
+	return Mount(filename, image_size, m_bDefaultOverlay);
+}
+
+int SDCard::Mount(const std::string &filename, off_t image_size, bool bOverlay)
 {
 	int fd = 0;
 	void *mapped;
 
-	auto OnError  = [fd](int err, bool bLocked = false)
+	auto OnError  = [&fd](int err, bool bLocked = false)
 	{
 		/* Clean up after an error. */
 		if (bLocked) {
@@ -497,14 +635,27 @@ int SDCard::Mount(const std::string &filename, off_t image_size)
 	if (!filename.empty())
 		m_strFile = filename; // New file given.
 
+	if (stat(m_strFile.c_str(), &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode))
+		return MountDirectory();
+
 	/* Open the specified disk image. */
-	fd = open (m_strFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (!bOverlay)
+	{
+		fd = open (m_strFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd == -1 && (errno == EACCES || errno == EROFS))
+		{
+			printf("%s is read-only, mounting it as an overlay.\n", m_strFile.c_str());
+			bOverlay = true;
+		}
+	}
+	if (bOverlay)
+		fd = open (m_strFile.c_str(), O_RDONLY | O_CLOEXEC);
 
 	if (fd == -1)
 		return errno;
 
-	/* Lock it for exclusive access. */
-	if (flock (fd, LOCK_EX) == -1)
+	/* Lock it for exclusive access, or shared if we won't write to it. */
+	if (flock (fd, bOverlay ? LOCK_SH : LOCK_EX) == -1)
 		return OnError(errno);
 
 	/* Check its size. If it's smaller than the requested size, expand it. Otherwise, ignore any excess size. */
@@ -523,12 +674,17 @@ int SDCard::Mount(const std::string &filename, off_t image_size)
 	}
 	else if (stat_buf.st_size < image_size)
 	{
-		if (ftruncate (fd, image_size) == -1)
+		if (bOverlay)
+		{
+			printf("Overlay base %s is smaller than requested, using its size instead.\n", m_strFile.c_str());
+			image_size = stat_buf.st_size;
+		}
+		else if (ftruncate (fd, image_size) == -1) /* Only extends the size, the new space is a hole. */
 			return OnError(errno, true);
 	}
 
-	/* Map it into memory. */
-	mapped = mmap (NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	/* Map it into memory. An overlay gets private copies of the pages it writes and shares the rest. */
+	mapped = mmap (NULL, image_size, PROT_READ | PROT_WRITE, bOverlay ? MAP_PRIVATE : MAP_SHARED, fd, 0);
 
 	if (mapped == MAP_FAILED)
 		return OnError(errno,true);
@@ -537,16 +693,68 @@ int SDCard::Mount(const std::string &filename, off_t image_size)
 	m_data = (uint8_t*)mapped;
 	m_data_length = image_size;
 	m_data_fd = fd;
+	m_bOverlay = bOverlay;
 
 	/* Update the C_SIZE field (number of sectors) in the CSD register. Reference for size calculations: JESD84-A44, Section 8.3, 'C_SIZE'. */
 	SetCSDCSize(image_size);
 
+	m_mCRCs.clear();
 	m_bMounted = true;
 	RaiseIRQ(CARD_PRESENT,0);
 
 	return 0;
 }
 
+int SDCard::MountDirectory()
+{
+	std::unique_ptr<VirtualFat> pVirtual {new VirtualFat()};
+	if (!pVirtual->Build(m_strFile))
+		return -1;
+
+	m_data = pVirtual->GetData();
+	m_data_length = pVirtual->GetSize();
+	m_data_fd = -1;
+	m_bOverlay = true; // Nothing to sync back.
+	m_pVirtual = std::move(pVirtual);
+
+	SetCSDCSize(m_data_length);
+
+	m_mCRCs.clear();
+	m_bMounted = true;
+	RaiseIRQ(CARD_PRESENT,0);
+	return 0;
+}
+
+bool SDCard::PutFile(const std::string &strHost, const std::string &strName)
+{
+	if (!m_bMounted || m_data == nullptr)
+	{
+		fprintf(stderr, "SDCard: No card mounted to put %s on.\n", strName.c_str());
+		return false;
+	}
+	// Written straight into the image (or its overlay/virtual copy). The firmware shouldn't be
+	// writing to the card at the time, its FAT cache would undo the allocation.
+	auto fcnTouch = [this](uint64_t uiAddr, size_t uiLen) { if (m_pVirtual) m_pVirtual->Fill(uiAddr, uiLen); };
+	m_mCRCs.clear(); // Even if it fails, some of it may have been written.
+	if (!FatImage::PutFile(m_data, m_data_length, strHost, strName, fcnTouch))
+		return false;
+
+	// Out for long enough that the firmware's card detect notices, then back in so it rescans.
+	printf("SDCard: Put %s on the card as %s, reinserting it.\n", strHost.c_str(), strName.c_str());
+	m_bEjected = true;
+	RaiseIRQ(CARD_PRESENT,1);
+	RegisterTimerUsec(m_fcnReinsert, 1000000, this);
+	return true;
+}
+
+avr_cycle_count_t SDCard::OnReinsert(avr_t *avr, avr_cycle_count_t uiWhen)
+{
+	m_bEjected = false;
+	if (m_bMounted)
+		RaiseIRQ(CARD_PRESENT,0);
+	return 0;
+}
+
 int SDCard::Unmount()
 {
 	if (m_data == nullptr) {
@@ -555,19 +763,30 @@ int SDCard::Unmount()
 		return 0;
 	}
 
-	/* Synchronise changes. */
-	msync (m_data, m_data_length, MS_SYNC | MS_INVALIDATE);
+	/* Synchronise changes. Overlay writes are discarded. */
+	if (!m_bOverlay)
+		msync (m_data, m_data_length, MS_SYNC | MS_INVALIDATE);
 
-	/* Unlock the file. */
-	flock (m_data_fd, LOCK_UN);
+	if (m_pVirtual)
+		m_pVirtual.reset(); /* Owns the mapping. */
+	else
+	{
+		/* Unlock the file. */
+		flock (m_data_fd, LOCK_UN);
 
-	/* munmap() and close. */
-	munmap (m_data, m_data_length);
-	close (m_data_fd);
+		/* munmap() and close. */
+		munmap (m_data, m_data_length);
+		close (m_data_fd);
+	}
 
 	m_data = nullptr;
 	m_data_length = 0;
 	m_data_fd = -1;
+	m_bOverlay = false;
+	m_bMultiRead = m_bMultiWrite = false;
+	m_uiPrefetchEnd = 0;
+	m_bCRCOn = false;
+	m_mCRCs.clear();
 
 	m_bMounted = false;
 	InitCSD();
@@ -575,3 +794,59 @@ int SDCard::Unmount()
 	RaiseIRQ(CARD_PRESENT,1);
 	return 0;
 }
+
+void SDCard::SaveState(Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	snap.Put(strPfx + "state", m_state);
+	snap.Put(strPfx + "cmdIn", m_CmdIn);
+	snap.Put(strPfx + "cmdCount", m_CmdCount);
+	snap.Put(strPfx + "response", m_command_response);
+	snap.Put(strPfx + "selected", m_bSelected);
+	snap.Put(strPfx + "mounted", m_bMounted);
+	snap.Put(strPfx + "ocr", m_ocr);
+	snap.Put(strPfx + "csd", m_csd);
+	snap.Put(strPfx + "crc", m_CRC);
+	snap.Put(strPfx + "crcOn", m_bCRCOn);
+	// Read and write share the union, store the pointer as an offset into the image.
+	int64_t iOffset = (m_bMounted && read_ptr) ? read_ptr - m_data : -1;
+	snap.Put(strPfx + "offset", iOffset);
+	snap.Put(strPfx + "remaining", read_bytes_remaining);
+	snap.Put(strPfx + "multiRead", m_bMultiRead);
+	snap.Put(strPfx + "multiWrite", m_bMultiWrite);
+}
+
+void SDCard::LoadState(const Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	bool bMounted = false;
+	snap.Get(strPfx + "mounted", bMounted);
+	if (bMounted != m_bMounted)
+	{
+		fprintf(stderr, "SDCard: Mount state differs from the saved state, not restoring it.\n");
+		return;
+	}
+	snap.Get(strPfx + "state", m_state);
+	snap.Get(strPfx + "cmdIn", m_CmdIn);
+	snap.Get(strPfx + "cmdCount", m_CmdCount);
+	snap.Get(strPfx + "response", m_command_response);
+	snap.Get(strPfx + "selected", m_bSelected);
+	snap.Get(strPfx + "ocr", m_ocr);
+	snap.Get(strPfx + "csd", m_csd);
+	snap.Get(strPfx + "crc", m_CRC);
+	snap.Get(strPfx + "crcOn", m_bCRCOn);
+	m_mCRCs.clear(); // The image isn't in the snapshot, it may not be the one the cache was for.
+	int64_t iOffset = -1;
+	snap.Get(strPfx + "offset", iOffset);
+	snap.Get(strPfx + "remaining", read_bytes_remaining);
+	snap.Get(strPfx + "multiRead", m_bMultiRead);
+	snap.Get(strPfx + "multiWrite", m_bMultiWrite);
+	if (iOffset >= 0 && iOffset <= m_data_length)
+		read_ptr = m_data + iOffset;
+	else
+	{
+		read_ptr = nullptr;
+		read_bytes_remaining = 0;
+		m_bMultiRead = m_bMultiWrite = false;
+	}
+}
@@ -25,14 +25,22 @@
 
 #pragma once
 
-#include <stdint.h>         // for uint8_t, uint32_t, uint16_t, uint64_t
-#include <sys/types.h>      // for off_t
-#include <string>           // for string
-#include <vector>           // for vector
-#include "IScriptable.h"    // for ArgType, ArgType::String, IScriptable::Li...
-#include "SPIPeripheral.h"  // for SPIPeripheral
-#include "Scriptable.h"     // for Scriptable
-#include "sim_avr.h"        // for avr_t
+#include <stdint.h>            // for uint8_t, uint32_t, uint16_t, uint64_t
+#include <sys/types.h>         // for off_t
+#include <memory>              // for unique_ptr
+#include <string>              // for string
+#include <unordered_map>       // for unordered_map
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for MAKE_C_TIMER_CALLBACK
+#include "IScriptable.h"       // for ArgType, ArgType::String, IScriptable::Li...
+#include "Metrics.h"           // for Metric
+#include "SPIPeripheral.h"     // for SPIPeripheral
+#include "Scriptable.h"        // for Scriptable
+#include "Snapshot.h"          // for Snapshot
+#include "VirtualFat.h"        // for VirtualFat
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
 
 class SDCard:public SPIPeripheral, public Scriptable
 {
@@ -49,22 +57,46 @@ class SDCard:public SPIPeripheral, public Scriptable
 			RegisterActionAndMenu("Unmount", "Unmounts the currently mounted file, if any.", Actions::ActUnmount);
 			RegisterActionAndMenu("Remount", "Remounts the last mounted file, if any.", Actions::ActMountLast);
 			RegisterAction("Mount", "Mounts the specified file on the SD card.",ActMountFile,{ArgType::String});
+			RegisterAction("MountOverlay", "Mounts the specified file read-only, keeping any writes private to this card until unmounted.",ActMountOverlay,{ArgType::String});
+			RegisterAction("PutFile", "Copies a host file (path, name on the card) into the card's root directory, then ejects and reinserts the card so the firmware rescans.",ActPutFile,{ArgType::String,ArgType::String});
 		};
 
 		void Init(avr_t *avr);
 
 		inline void SetImage(const string &strFile) { m_strFile = strFile;}
 
+		// When set, Mount() keeps the image file read-only and shared (see MountOverlay)
+		// so several cards can use the same base image.
+		static inline void SetDefaultOverlay(bool bOverlay) { m_bDefaultOverlay = bOverlay; }
+
+		// When set, read blocks only carry a real CRC once the firmware turns checking on with CMD59,
+		// like a card in SPI mode would check them. Until then the CRC bytes are sent as 0xFFFF.
+		static inline void SetLazyCRC(bool bLazy) { m_bLazyCRC = bLazy; }
+
 		// Mounts the given image file on the virtual card.
 		// If size=0, autodetect the image size.
 		// If filename is empty, remount the last file.
+		// If the name is a directory, a read-only FAT32 card is synthesized from its contents.
+		// If bOverlay, the file is opened read-only and mapped copy-on-write; writes
+		// only live in memory and are dropped on unmount. Files we can't write to
+		// are always mounted this way.
 		int Mount(const std::string &filename = "", off_t image_size = 0);
+		int Mount(const std::string &filename, off_t image_size, bool bOverlay);
 
 		// Detaches the currently mounted file.
 		int Unmount();
 
 		inline bool IsMounted(){return m_bMounted; }
 
+		// Copies strHost into the mounted card's root as strName (replacing any file already so named),
+		// then takes the card out and puts it back, so the firmware sees it. Call on the AVR thread.
+		bool PutFile(const std::string &strHost, const std::string &strName);
+
+		// Checkpoints/restores the SPI state machine and any transfer in progress, see Board::SaveState
+		// The image itself is not part of the snapshot.
+		void SaveState(Snapshot &snap);
+		void LoadState(const Snapshot &snap);
+
 	protected:
 		virtual uint8_t OnSPIIn(struct avr_irq_t * irq, uint32_t value) override;
 
@@ -78,8 +110,10 @@ class SDCard:public SPIPeripheral, public Scriptable
 		enum Actions
 		{
 			ActMountFile,
+			ActMountOverlay,
 			ActMountLast,
-			ActUnmount
+			ActUnmount,
+			ActPutFile
 		};
 
 		enum class State {
@@ -99,6 +133,27 @@ class SDCard:public SPIPeripheral, public Scriptable
 		void InitCSD();
 		void SetCSDCSize(off_t size);
 
+		// Moves a CMD18 read on to the next block, or ends it at the end of the image.
+		void NextReadBlock();
+		// Pulls in host file contents for a block of a directory-backed card before it is accessed.
+		inline void TouchBlock(const uint8_t *pBlock) { if (m_pVirtual) m_pVirtual->Fill(pBlock - m_data, BLOCK_SIZE); }
+		// Forgets the cached CRC of a block that is about to be written.
+		inline void DirtyBlock(const uint8_t *pBlock) { m_mCRCs.erase(pBlock - m_data); }
+
+		// The CRC of the read that is starting at read_ptr, cached for whole image blocks.
+		uint16_t GetReadCRC();
+		// CRC16-CCITT, eight bytes at a time.
+		static uint16_t BlockCRC(const uint8_t *pData, size_t uiLen);
+
+		int MountDirectory();
+
+		avr_cycle_count_t OnReinsert(avr_t *avr, avr_cycle_count_t uiWhen);
+		avr_cycle_timer_t m_fcnReinsert = MAKE_C_TIMER_CALLBACK(SDCard,OnReinsert);
+		bool m_bEjected = false; // Out for a PutFile rescan
+
+		// Asks the kernel to read ahead of a multi-block read so we don't fault on each page.
+		void Prefetch(off_t addr);
+
 		inline void COMMAND_RESPONSE_R1(uint8_t uiR1Status);
 		inline void COMMAND_RESPONSE_R3(uint8_t uiR3Status, uint32_t payload);
 
@@ -118,8 +173,6 @@ class SDCard:public SPIPeripheral, public Scriptable
 		static const int BLOCK_SIZE = (1<<READ_BL_LEN); // Bytes
 		static inline bool IsBlockAligned(int iBlock){ return ((iBlock % BLOCK_SIZE) == 0);};
 
-		inline void CRC_ADD(const uint8_t data) {m_CRC = m_crctab[(m_CRC >> 8 ^ data) & 0XFF] ^ (m_CRC << 8); }
-
 		/* TODO: See diskio.c */
 		enum Command {
 			CMD0 = 0,
@@ -129,10 +182,13 @@ class SDCard:public SPIPeripheral, public Scriptable
 			CMD13 = 13,
 			CMD16 = 16,
 			CMD17 = 17,
+			CMD18 = 18,
 			CMD24 = 24,
+			CMD25 = 25,
 			CMD41 = 41,
 			CMD55 = 55,
 			CMD58 = 58,
+			CMD59 = 59,
 		};
 
 		static const uint16_t m_crctab[];
@@ -161,6 +217,13 @@ class SDCard:public SPIPeripheral, public Scriptable
 
 		bool m_bSelected = false, m_bMounted = false;
 
+		/* Multi-block transfers keep going from where the last block ended until CMD12/the stop token. */
+		bool m_bMultiRead = false, m_bMultiWrite = false;
+		Metric m_mtrRead {Metric::Kind::Counter}, m_mtrWritten {Metric::Kind::Counter}; // Bytes, a block at a time as each starts
+		off_t m_uiPrefetchEnd = 0;
+		static const off_t PREFETCH_SIZE = 64*1024;
+		static const uint8_t TOKEN_SINGLE = 0xFE, TOKEN_MULTI_WRITE = 0xFC, TOKEN_STOP_TRAN = 0xFD;
+
 		union {
 			/* Ongoing read operations. */
 			struct {
@@ -180,9 +243,16 @@ class SDCard:public SPIPeripheral, public Scriptable
 		uint8_t m_csd[16]; /* card-specific data (CSD) register */
 
 		uint16_t m_CRC;
+		bool m_bCRCOn = false; // Set by CMD59
+		std::unordered_map<off_t, uint16_t> m_mCRCs; // By block offset, cleared on (re)mount and PutFile
+		static const size_t MAX_CACHED_CRCS = 65536; // 32MB worth of blocks, past that it starts over
 
 		/* Card data. */
 		uint8_t *m_data = nullptr; /* mmap()ed data */
 		off_t m_data_length = 0;
 		int m_data_fd = -1;
+		bool m_bOverlay = false; /* Private copy-on-write mapping of a read-only image */
+		std::unique_ptr<VirtualFat> m_pVirtual; /* Set when the card is a host directory */
+
+		static bool m_bDefaultOverlay, m_bLazyCRC;
 };
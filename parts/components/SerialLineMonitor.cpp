@@ -22,19 +22,26 @@
 
 
 #include "SerialLineMonitor.h"
-#include "avr_uart.h"  // for AVR_IOCTL_UART_GETIRQ, ::UART_IRQ_INPUT, ::UAR...
-#include "sim_io.h"    // for avr_io_getirq
+#include <stdio.h>            // for printf
+#include <string.h>           // for strncmp
+#include "ScriptHost.h"       // for ScriptHost
+#include "StartupTimeline.h"  // for StartupTimeline
+#include "avr_uart.h"         // for AVR_IOCTL_UART_GETIRQ, ::UART_IRQ_INPUT, ::UAR...
+#include "sim_io.h"           // for avr_io_getirq
 
 
 void SerialLineMonitor::OnByteIn(struct avr_irq_t * irq, uint32_t value)
 {
-    unsigned char c = value&0xFF;
-	bool bNewLine = (c == 0x0a);
-
-	if (!bNewLine)
-		m_strLine.push_back(c);
-	else
+	uint8_t c = value&0xFF;
+	if (c == 0x0a)
+	{
 		OnNewLine();
+		return;
+	}
+	if (m_uiLineLen < LINE_BUFFER)
+		m_chLine[m_uiLineLen] = c;
+	m_uiLineLen++;
+	Step(c);
 }
 
 void SerialLineMonitor::OnXOnIn(struct avr_irq_t * irq, uint32_t value)
@@ -47,29 +54,63 @@ void SerialLineMonitor::OnXOffIn(struct avr_irq_t * irq, uint32_t value)
 	m_bXOn = false;
 }
 
-
-
-
-Scriptable::LineStatus SerialLineMonitor::ProcessAction(unsigned int ID, const vector<string> &args)
+const regex* SerialLineMonitor::GetRegex(const string &strRegex, string &strError)
 {
-	if (m_type != None && m_strMatch.compare(args.at(0))==0) // already in wait state for same find
+	auto it = m_mRegex.find(strRegex);
+	if (it == m_mRegex.end())
 	{
-		if (!m_bMatched)
-			return LineStatus::Waiting;
-		m_strMatch.clear();
-		m_type = None;
-		m_bMatched = false;
-		return LineStatus::Finished;
+		try
+		{
+			it = m_mRegex.emplace(strRegex, regex(strRegex)).first;
+		}
+		catch (const regex_error &e)
+		{
+			strError = string("Invalid regular expression: ") + e.what();
+			return nullptr;
+		}
 	}
+	return &it->second;
+}
 
+bool SerialLineMonitor::ValidateAction(unsigned int ID, const vector<string> &args, string &strError)
+{
+	if (ID == WaitForRegex)
+		return GetRegex(args.at(0), strError) != nullptr;
+	return true;
+}
+
+Scriptable::LineStatus SerialLineMonitor::ProcessAction(unsigned int ID, const vector<string> &args)
+{
 	switch(ID)
 	{
 		case WaitForLine:
 		case WaitForContains:
-			m_bMatched = false;
-			m_strMatch = args[0];
-			m_type = (ID == WaitForLine) ? Full : Contains;
-			return LineStatus::Waiting;
+		case WaitForAny:
+		case WaitForRegex:
+		{
+			string strKey = to_string(ID) + ":" + args.at(0);
+			auto it = m_mWaits.find(strKey);
+			if (it == m_mWaits.end())
+			{
+				string strError;
+				if (ID == WaitForRegex && !GetRegex(args.at(0), strError)) // Not validated, e.g. a remote command.
+					return IssueLineError(strError);
+				it = m_mWaits.emplace(strKey, Wait_t()).first;
+				Rebuild();
+			}
+			else if (ScriptHost::IsFirstCall()) // Left by an earlier line, e.g. one that timed out.
+				it->second.bMatched = false;
+			if (!it->second.bMatched)
+			{
+				ScriptHost::WakeOnNotify(); // OnNewLine() wakes it on a match.
+				return LineStatus::Waiting;
+			}
+			if (ID == WaitForAny)
+				printf("%s: WaitForAny matched \"%s\"\n", GetName().c_str(), it->second.strHit.c_str());
+			m_mWaits.erase(it);
+			Rebuild();
+			return LineStatus::Finished;
+		}
 		case SendGCode:
 			if (m_strGCode.empty())
 			{
@@ -96,21 +137,127 @@ Scriptable::LineStatus SerialLineMonitor::SendChar()
 	return LineStatus::Unhandled;
 }
 
-void SerialLineMonitor::OnNewLine()
+void SerialLineMonitor::Rebuild()
 {
-	if(!m_type)
-		return; // No match configured.
-	switch (m_type)
+	m_vPatterns.clear();
+	m_bHasRegex = false;
+	for (auto &it : m_mWaits)
 	{
-		case Full:
-			m_bMatched = m_strLine.compare(m_strMatch)==0;
-			break;
-		case Contains:
-			m_bMatched = m_strLine.find(m_strMatch) != string::npos;
-			break;
-		case None:
-			break;
+		size_t uiColon = it.first.find(':');
+		unsigned int ID = stoul(it.first.substr(0, uiColon));
+		string strArg = it.first.substr(uiColon + 1);
+		switch (ID)
+		{
+			case WaitForLine:
+				m_vPatterns.push_back({Full, strArg, nullptr, &it.second});
+				break;
+			case WaitForContains:
+				m_vPatterns.push_back({Contains, strArg, nullptr, &it.second});
+				break;
+			case WaitForAny:
+			{
+				size_t uiStart = 0, uiEnd;
+				do
+				{
+					uiEnd = strArg.find('|', uiStart);
+					m_vPatterns.push_back({Contains, strArg.substr(uiStart, uiEnd - uiStart), nullptr, &it.second});
+					uiStart = uiEnd + 1;
+				} while (uiEnd != string::npos);
+				break;
+			}
+			case WaitForRegex:
+			{
+				string strError;
+				m_vPatterns.push_back({Regex, strArg, GetRegex(strArg, strError), &it.second});
+				m_bHasRegex = true;
+				break;
+			}
+		}
+	}
+
+	// The trie of the literal patterns, 0 being both the root and "no child yet"...
+	m_vNext.assign(1, array<uint32_t, 256>());
+	m_vNext[0].fill(0);
+	m_vOut.assign(1, vector<uint32_t>());
+	for (uint32_t i=0; i<m_vPatterns.size(); i++)
+	{
+		if (m_vPatterns[i].type == Regex)
+			continue;
+		uint32_t uiNode = 0;
+		for (uint8_t c : m_vPatterns[i].strText)
+		{
+			if (!m_vNext[uiNode][c])
+			{
+				m_vNext[uiNode][c] = m_vNext.size();
+				m_vNext.emplace_back();
+				m_vNext.back().fill(0);
+				m_vOut.emplace_back();
+			}
+			uiNode = m_vNext[uiNode][c];
+		}
+		m_vOut[uiNode].push_back(i);
 	}
+	// ... then breadth first, complete every state's transitions from its longest proper suffix's.
+	vector<uint32_t> vFail(m_vNext.size(), 0), vQueue;
+	for (unsigned int c=0; c<256; c++)
+		if (m_vNext[0][c])
+			vQueue.push_back(m_vNext[0][c]);
+	for (size_t i=0; i<vQueue.size(); i++)
+	{
+		uint32_t uiNode = vQueue[i];
+		const vector<uint32_t> &vSuffix = m_vOut[vFail[uiNode]];
+		m_vOut[uiNode].insert(m_vOut[uiNode].end(), vSuffix.begin(), vSuffix.end());
+		for (unsigned int c=0; c<256; c++)
+		{
+			uint32_t uiChild = m_vNext[uiNode][c];
+			if (uiChild)
+			{
+				vFail[uiChild] = m_vNext[vFail[uiNode]][c];
+				vQueue.push_back(uiChild);
+			}
+			else
+				m_vNext[uiNode][c] = m_vNext[vFail[uiNode]][c];
+		}
+	}
+
+	m_vSeen.assign(m_vPatterns.size(), false);
+	m_uiState = 0;
+	if (m_uiLineLen <= LINE_BUFFER)
+		for (unsigned int i=0; i<m_uiLineLen; i++)
+			Step(m_chLine[i]);
+}
+
+void SerialLineMonitor::OnNewLine()
+{
+	if (m_uiLineLen == 5 && strncmp(m_chLine, "start", 5) == 0)
+		StartupTimeline::OnFirmwareStart();
+	bool bAny = false;
+	auto fcnHit = [&bAny](const Pattern_t &pat)
+	{
+		if (!pat.pWait->bMatched)
+		{
+			pat.pWait->bMatched = true;
+			pat.pWait->strHit = pat.strText;
+			bAny = true;
+		}
+	};
+	for (auto uiPat : m_vOut[m_uiState])
+		if (m_vPatterns[uiPat].type == Full && m_vPatterns[uiPat].strText.size() == m_uiLineLen)
+			fcnHit(m_vPatterns[uiPat]);
+	for (uint32_t i=0; i<m_vPatterns.size(); i++)
+		if (m_vSeen[i] || (m_vPatterns[i].type == Contains && m_vPatterns[i].strText.empty()))
+		{
+			fcnHit(m_vPatterns[i]);
+			m_vSeen[i] = false;
+		}
+	if (m_bHasRegex)
+		for (auto &pat : m_vPatterns)
+			if (pat.type == Regex && pat.pRegex && regex_search(m_chLine, m_chLine + (m_uiLineLen < LINE_BUFFER ? m_uiLineLen : LINE_BUFFER), *pat.pRegex))
+				fcnHit(pat);
+	m_uiState = 0;
+	m_uiLineLen = 0;
+	if (bAny)
+		ScriptHost::Notify();
 }
 
 void SerialLineMonitor::Init(struct avr_t * avr, char chrUART)
@@ -21,7 +21,10 @@
 
 #pragma once
 
-#include <stdint.h>          // for uint32_t
+#include <stdint.h>          // for uint32_t, uint8_t
+#include <array>             // for array
+#include <map>               // for map
+#include <regex>             // for regex
 #include <string>            // for string, basic_string
 #include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
@@ -43,8 +46,10 @@ class SerialLineMonitor : public BasePeripheral,public Scriptable
 		{
 			RegisterAction("WaitForLine","Waits for the provided line to appear on the serial output.",WaitForLine, {ArgType::String});
 			RegisterAction("WaitForLineContains","Waits for the serial output to contain a line with the given string.",WaitForContains,{ArgType::String});
+			RegisterAction("WaitForAny","Waits for a line containing any of the |-separated strings, and prints which one it was.",WaitForAny,{ArgType::String});
+			RegisterAction("WaitForRegex","Waits for a line matching the regular expression (ECMAScript syntax, searched within the line).",WaitForRegex,{ArgType::String});
 			RegisterAction("SendGCode","Sends the specified string as G-Code.",SendGCode,{ArgType::String});
-			m_strLine.reserve(100);
+			Rebuild();
 		};
 
 		// Shuts down
@@ -54,37 +59,80 @@ class SerialLineMonitor : public BasePeripheral,public Scriptable
 		void Init(avr_t *avr, char chrUART);
 	protected:
 		LineStatus ProcessAction(unsigned int ID, const vector<string> &args) override;
+		bool ValidateAction(unsigned int ID, const vector<string> &args, string &strError) override;
 
 	private:
 		enum matchType
 		{
 			None = 0,
 			Full,
-			Contains
+			Contains,
+			Regex
 		};
+
+		// A script line waiting, keyed by its action and argument so several can wait at once.
+		typedef struct Wait_t
+		{
+			bool bMatched = false;
+			string strHit; // The pattern that did it
+		} Wait_t;
+
+		typedef struct Pattern_t
+		{
+			matchType type;
+			string strText;
+			const regex *pRegex;
+			Wait_t *pWait;
+		} Pattern_t;
+
 		void OnByteIn(avr_irq_t *irq, uint32_t value);
 		void OnXOnIn(avr_irq_t *irq, uint32_t value);
 		void OnXOffIn(avr_irq_t *irq, uint32_t value);
 		void OnNewLine();
 
-		LineStatus SendChar();
+		// Remakes the patterns and the automaton for the waits, then runs the line so far through it again.
+		void Rebuild();
+		inline void Step(uint8_t c)
+		{
+			m_uiState = m_vNext[m_uiState][c];
+			for (auto uiPat : m_vOut[m_uiState])
+				if (m_vPatterns[uiPat].type == Contains && !m_vSeen[uiPat])
+					m_vSeen[uiPat] = true;
+		}
+		const regex* GetRegex(const string &strRegex, string &strError);
 
-		matchType m_type = None;
+		LineStatus SendChar();
 
+		// Literal patterns (Full and Contains) are matched together, a byte at a time, by an
+		// Aho-Corasick automaton: one table lookup per byte however many are waited on.
+		// A Full match is a Full pattern ending on the newline with the line's length.
+		map<string, Wait_t> m_mWaits;
+		vector<Pattern_t> m_vPatterns;
+		vector<array<uint32_t, 256>> m_vNext; // The transitions, suffix links folded in.
+		vector<vector<uint32_t>> m_vOut; // Patterns ending at each state, suffixes included.
+		vector<bool> m_vSeen; // Contains patterns seen on this line
+		uint32_t m_uiState = 0;
+		bool m_bHasRegex = false;
+		map<string, regex> m_mRegex; // Compiled at validation
+
+		// For the regexes, and to rematch the line when a wait arrives halfway through it.
+		// Longer lines are only searched by a regex, or rematched, this far.
+		static constexpr unsigned int LINE_BUFFER = 256;
+		char m_chLine[LINE_BUFFER];
+		unsigned int m_uiLineLen = 0;
 
-		string m_strLine;
-		string m_strMatch;
 		string m_strGCode;
 
 		std::string::iterator  m_itGCode;
 
 		char m_chrUART = '0';
-		bool m_bMatched = false;
 		bool m_bXOn = false;
 		enum ScriptAction {
 			WaitForLine,
 			WaitForContains,
-			SendGCode
+			SendGCode,
+			WaitForAny,
+			WaitForRegex
 		};
 
 };
@@ -29,19 +29,19 @@
 #include <stdio.h>            // for printf
 #include <string.h>           // for memset
 #include <algorithm>          // for min
+#include "Log.h"              // for LOG, Log
+#include "RedrawFlag.h"       // for RedrawFlag
 #include "TelemetryHost.h"
+#include "sim_time.h"         // for avr_usec_to_cycles
 
-//#define TRACE(_w) _w
-#define TRACE2(_w) if (m_cAxis=='S' || m_cAxis=='I') _w
-#ifndef TRACE
-#define TRACE(_w)
-#endif
+static Log::Module logTMC("TMC2130");
 
 
 void TMC2130::Draw()
 {
         if (!m_bConfigured)
             return; // Motors not ready yet.
+        float fPos = m_fDrawPos.load(std::memory_order_relaxed);
         glColor3f(0,0,0);
 	    glBegin(GL_QUADS);
 			glVertex3f(0,0,0);
@@ -69,7 +69,7 @@ void TMC2130::Draw()
         glPushMatrix();
             glTranslatef(280,7,0);
             glScalef(0.09,-0.05,0);
-            string strPos = to_string(m_fCurPos);
+            string strPos = to_string(fPos);
             for (int i=0; i<min(7,(int)strPos.size()); i++)
                 glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN,strPos[i]);
 
@@ -91,10 +91,10 @@ void TMC2130::Draw()
 			glEnd();
 			glColor3f(0,1,1);
 			glBegin(GL_QUADS);
-				glVertex3f(m_fCurPos-0.5,2,0);
-				glVertex3f(m_fCurPos+0.5,2,0);
-				glVertex3f(m_fCurPos+0.5,8,0);
-				glVertex3f(m_fCurPos-0.5,8,0);
+				glVertex3f(fPos-0.5,2,0);
+				glVertex3f(fPos+0.5,2,0);
+				glVertex3f(fPos+0.5,8,0);
+				glVertex3f(fPos-0.5,8,0);
 			glEnd();
 		glPopMatrix();
 }
@@ -104,6 +104,7 @@ void TMC2130::Draw_Simple()
 {
         if (!m_bConfigured)
             return; // Motors not ready yet.
+        float fPos = m_fDrawPos.load(std::memory_order_relaxed);
         glColor3f(0,0,0);
 	    glBegin(GL_QUADS);
 			glVertex3f(0,0,0);
@@ -131,7 +132,7 @@ void TMC2130::Draw_Simple()
         glPushMatrix();
             glTranslatef(30,7,0);
             glScalef(0.09,-0.05,0);
-			string strPos = to_string(m_fCurPos);
+			string strPos = to_string(fPos);
             for (int i=0; i<min(7,(int)strPos.size()); i++)
                 glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN,strPos[i]);
         glPopMatrix();
@@ -145,7 +146,7 @@ void TMC2130::CreateReply()
         m_cmdOut.bitsOut.data = m_regs.raw[m_cmdProc.bitsIn.address];
         if (m_cmdProc.bitsIn.address == 0x01)
             m_regs.raw[0x01] = 0; // GSTAT is cleared after read.
-        TRACE(printf("Reading out %x (%10lx)", m_cmdProc.bitsIn.address, m_cmdOut.bitsOut.data));
+        LOG(logTMC, Trace, "Reading out %x (%10x)", m_cmdProc.bitsIn.address, m_cmdOut.bitsOut.data);
     }
     else
         m_cmdOut.bitsOut.data = m_cmdProc.bitsOut.data;
@@ -162,7 +163,7 @@ void TMC2130::CreateReply()
 // Called when a full command is ready to process.
 void TMC2130::ProcessCommand()
 {
-    TRACE(printf("tmc2130 %c cmd: w: %x a: %02x  d: %08x\n",m_cAxis, m_cmdProc.bitsIn.RW, m_cmdProc.bitsIn.address, m_cmdProc.bitsIn.data));
+    LOG(logTMC, Trace, "tmc2130 %c cmd: w: %x a: %02x  d: %08x",m_cAxis.load(), m_cmdProc.bitsIn.RW, m_cmdProc.bitsIn.address, m_cmdProc.bitsIn.data);
     if (m_cmdProc.bitsIn.RW)
     {
         m_regs.raw[m_cmdProc.bitsIn.address] = m_cmdProc.bitsIn.data;
@@ -177,26 +178,26 @@ void TMC2130::ProcessCommand()
     }
     else
     {
-        TRACE(printf("Read command on register: %02x\n", m_cmdProc.bitsIn.address));
+        LOG(logTMC, Trace, "Read command on register: %02x", m_cmdProc.bitsIn.address);
     }
     CreateReply();
 
 }
 
 /*
- * called when a SPI byte is received. It's guarded by the SPIPeripheral CSEL check.
+ * Called with the whole datagram when CSEL rises. It's collected by SPIPeripheral,
+ * which also clocks out the reply set up in OnCSELIn.
  */
-uint8_t TMC2130::OnSPIIn(struct avr_irq_t * irq, uint32_t value)
+void TMC2130::OnSPITransfer(const uint8_t *pData, size_t uiLen)
 {
-    m_cmdIn.all<<=8; // Shift bits up
-    m_cmdIn.bytes[0] = value;
-    TRACE(printf("TMC2130 %c: byte received: %02x (%010lx)\n",m_cAxis,value, m_cmdIn.all));
-    // Clock out a reply byte, MSB first
-    uint8_t byte = m_cmdOut.bytes[4];
-    m_cmdOut.all<<=8;
-    TRACE(printf("TMC2130 %c: Clocking (%10lx) out %02x\n",m_cAxis,m_cmdOut.all,byte));
-    SetSendReplyFlag();
-    return byte; // SPIPeripheral takes care of the reply.
+	for (size_t i=0; i<uiLen; i++)
+	{
+		m_cmdIn.all<<=8; // Shift bits up
+		m_cmdIn.bytes[0] = pData[i];
+	}
+	LOG(logTMC, Trace, "TMC2130 %c: %zu bytes received (%010lx)",m_cAxis.load(),uiLen, m_cmdIn.all);
+	m_cmdProc = m_cmdIn;
+	ProcessCommand();
 }
 
 void TMC2130::CheckDiagOut()
@@ -210,12 +211,13 @@ void TMC2130::CheckDiagOut()
 // Called when CSEL changes.
 void TMC2130::OnCSELIn(struct avr_irq_t * irq, uint32_t value)
 {
-	TRACE(printf("TMC2130 %c: CSEL changed to %02x\n",m_cAxis,value));
-    if (value == 1) // Just finished a CSEL
-    {
-        m_cmdProc = m_cmdIn;
-        ProcessCommand();
-    }
+	LOG(logTMC, Trace, "TMC2130 %c: CSEL changed to %02x",m_cAxis.load(),value);
+	if (value == 0) // Starting a datagram, the reply is the previous one's result, MSB first.
+	{
+		for (unsigned int i=0; i<sizeof(m_uiReply); i++)
+			m_uiReply[i] = m_cmdOut.bytes[sizeof(m_uiReply)-1-i];
+		SetReplyStream(m_uiReply, sizeof(m_uiReply));
+	}
 }
 
 // Called when DIR pin changes.
@@ -223,14 +225,43 @@ void TMC2130::OnDirIn(struct avr_irq_t * irq, uint32_t value)
 {
     if (irq->value == value)
         return;
-    TRACE(printf("TMC2130 %c: DIR changed to %02x\n",m_cAxis,value));
+    LOG(logTMC, Trace, "TMC2130 %c: DIR changed to %02x",m_cAxis.load(),value);
+    if (m_bPosPending)
+        RaisePosition(); // Don't lose the turning point.
+    if (m_pTiming)
+        m_pTiming->EndMove();
     m_bDir = value^cfg.bInverted; // XOR
 }
 
 avr_cycle_count_t TMC2130::OnStandStillTimeout(avr_t *avr, avr_cycle_count_t when)
 {
-    m_regs.defs.DRV_STATUS.stst = true;
-    return 0;
+	if (when - m_uiLastStep < m_uiStandstillCycles)
+		return m_uiLastStep + m_uiStandstillCycles; // Stepped since it was armed.
+	m_bStandstillArmed = false;
+	m_regs.defs.DRV_STATUS.stst = true;
+	if (m_bPosPending)
+		RaisePosition();
+	if (m_pTiming)
+		m_pTiming->EndMove();
+	return 0;
+}
+
+avr_cycle_count_t TMC2130::OnPublishTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	m_bPublishArmed = false;
+	if (m_bPosPending)
+		RaisePosition();
+	return 0;
+}
+
+void TMC2130::RaisePosition()
+{
+	m_bPosPending = false;
+	m_uiLastPublish = m_pAVR->cycle;
+	uint32_t* posOut = (uint32_t*)(&m_fCurPos); // both 32 bits, just mangle it for sending over the wire.
+	RaiseIRQ(POSITION_OUT, posOut[0]);
+	m_mtrPos.Set(m_fCurPos);
+	RedrawFlag::Set();
 }
 
 // Called when STEP is triggered.
@@ -247,8 +278,15 @@ void TMC2130::OnStepIn(struct avr_irq_t * irq, uint32_t value)
 		// With DEDGE step on each value change
 		if (value == irq->value) return;
 	}
-    CancelTimer(m_fcnStandstill,this);
-	//TRACE2(printf("TMC2130 %c: STEP changed to %02x\n",m_cAxis,value));
+	m_uiLastStep = m_pAVR->cycle;
+	if (m_pTiming)
+		m_pTiming->OnStep(m_uiLastStep);
+	if (!m_bStandstillArmed)
+	{
+		m_bStandstillArmed = true;
+		RegisterTimer(m_fcnStandstill,m_uiStandstillCycles,this);
+	}
+	//LOG(logTMC, Trace, "TMC2130 %c: STEP changed to %02x",m_cAxis.load(),value);
     if (m_bDir)
         m_iCurStep--;
     else
@@ -269,10 +307,21 @@ void TMC2130::OnStepIn(struct avr_irq_t * irq, uint32_t value)
     }
 
     m_fCurPos = StepToPos(m_iCurStep);
-    uint32_t* posOut = (uint32_t*)(&m_fCurPos); // both 32 bits, just mangle it for sending over the wire.
-    RaiseIRQ(POSITION_OUT, posOut[0]);
-    TRACE(printf("cur pos: %f (%u)\n",m_fCurPos,m_iCurStep));
+    PublishPos();
+    m_motion.Update(m_uiLastStep, m_iCurStep, m_fCurPos);
+    LOG(logTMC, Trace, "cur pos: %f (%u)",m_fCurPos,m_iCurStep);
 	bStall |= m_bStall;
+	if (bStall || m_uiCoalesceCycles == 0 || m_uiLastStep - m_uiLastPublish >= m_uiCoalesceCycles)
+		RaisePosition();
+	else
+	{
+		m_bPosPending = true;
+		if (!m_bPublishArmed)
+		{
+			m_bPublishArmed = true;
+			RegisterTimer(m_fcnPublish, m_uiLastPublish + m_uiCoalesceCycles - m_uiLastStep, this);
+		}
+	}
     if (bStall)
     {
         RaiseIRQ(DIAG_OUT, 1);
@@ -284,20 +333,26 @@ void TMC2130::OnStepIn(struct avr_irq_t * irq, uint32_t value)
           m_regs.defs.DRV_STATUS.SG_RESULT = 250;
     }
     m_regs.defs.DRV_STATUS.stallGuard = bStall;
+    m_mtrStall.Set(bStall);
     m_regs.defs.DRV_STATUS.stst = false;
-    // 2^20 comes from the datasheet.
-    RegisterTimer(m_fcnStandstill,2^20,this);
 }
 
 // Called when DRV_EN is triggered.
 void TMC2130::OnEnableIn(struct avr_irq_t * irq, uint32_t value)
 {
-    if (irq->value == value && m_bEnable == (value==0))
-        return;
-	TRACE2(printf("TMC2130 %c: EN changed to %02x\n",m_cAxis.load(),value));
-    m_bEnable = value==0; // active low, i.e motors off when high.
+	if (irq->value == value && m_bEnable == (value==0))
+	{
+		return;
+	}
+	if (m_cAxis=='S' || m_cAxis=='I')
+	{
+		LOG(logTMC, Debug, "TMC2130 %c: EN changed to %02x",m_cAxis.load(),value);
+	}
+	m_bEnable = value==0; // active low, i.e motors off when high.
 }
 
+uint32_t TMC2130::m_uiDefaultCoalesceUs = 0;
+
 TMC2130::TMC2130(char cAxis):Scriptable(string("") + cAxis),m_cAxis(cAxis)
 {
     memset(&m_regs.raw, 0, sizeof(m_regs.raw));
@@ -307,6 +362,12 @@ TMC2130::TMC2130(char cAxis):Scriptable(string("") + cAxis),m_cAxis(cAxis)
 	RegisterActionAndMenu("ToggleStall","Toggles the stallguard condition on the next step.",ActToggleStall);
 	RegisterActionAndMenu("Stall","Sets the diag flag immediately.",ActSetDiag);
 	RegisterActionAndMenu("Reset","Clears the diag flag immediately",ActResetDiag);
+	if (StepTiming::IsEnabled())
+	{
+		m_pTiming.reset(new StepTiming());
+		RegisterActionAndMenu("PrintStepTiming","Prints the step interval, jitter and acceleration statistics (--step-timing).",ActPrintStepTiming);
+		RegisterActionAndMenu("ClearStepTiming","Clears the step timing statistics.",ActClearStepTiming);
+	}
 }
 
 Scriptable::LineStatus TMC2130::ProcessAction (unsigned int iAct, const vector<string> &vArgs)
@@ -322,6 +383,12 @@ Scriptable::LineStatus TMC2130::ProcessAction (unsigned int iAct, const vector<s
 		case ActResetDiag:
 			RaiseIRQ(DIAG_OUT,0);
 			return LineStatus::Finished;
+		case ActPrintStepTiming:
+			m_pTiming->Print();
+			return LineStatus::Finished;
+		case ActClearStepTiming:
+			m_pTiming->Clear();
+			return LineStatus::Finished;
 	}
 	return LineStatus::Unhandled;
 }
@@ -329,9 +396,12 @@ Scriptable::LineStatus TMC2130::ProcessAction (unsigned int iAct, const vector<s
 void TMC2130::SetConfig(TMC2130_cfg_t cfgIn)
 {
     cfg = cfgIn;
+    UpdateStepScale();
     m_iCurStep = PosToStep(cfg.fStartPos);
     m_iMaxPos = PosToStep(cfg.iMaxMM);
     m_fCurPos = cfg.fStartPos;
+	PublishPos();
+	m_motion.Update(m_pAVR ? m_pAVR->cycle : 0, m_iCurStep, m_fCurPos);
 	m_fEnd = StepToPos(m_iMaxPos);
 	m_bConfigured = true;
 }
@@ -339,6 +409,8 @@ void TMC2130::SetConfig(TMC2130_cfg_t cfgIn)
 void TMC2130::Init(struct avr_t * avr)
 {
     _Init(avr, this);
+    SetTransactional(16); // A datagram is 5 bytes, room to spare for a sloppy firmware.
+    m_uiCoalesceCycles = avr_usec_to_cycles(avr, m_uiDefaultCoalesceUs);
 
     RegisterNotify(DIR_IN,      MAKE_C_CALLBACK(TMC2130,OnDirIn), this);
     RegisterNotify(STEP_IN,     MAKE_C_CALLBACK(TMC2130,OnStepIn), this);
@@ -352,14 +424,63 @@ void TMC2130::Init(struct avr_t * avr)
 	pTH->AddTrace(this, DIR_IN,{TC::OutputPin, TC::Stepper});
 	pTH->AddTrace(this, ENABLE_IN,{TC::OutputPin, TC::Stepper});
 	pTH->AddTrace(this, DIAG_OUT,{TC::InputPin, TC::Stepper});
+
+	std::string strAxis(1, m_cAxis.load());
+	m_mtrPos.Set(m_fCurPos);
+	m_mtrPos.Register("mk404_stepper_position_mm", "Position the driver has stepped to.", {{"axis", strAxis}});
+	m_mtrStall.Register("mk404_stepper_stalled", "1 while stallguard is reporting a stall.", {{"axis", strAxis}});
+	if (m_pTiming)
+	{
+		m_pTiming->Init(avr, strAxis);
+		m_pTiming->SetStepsPerMM(m_fStepsPerMM);
+	}
 }
 
-float TMC2130::StepToPos(int32_t step)
+void TMC2130::UpdateStepScale()
 {
-	return (float)step/16*(float)(1u<<m_regs.defs.CHOPCONF.mres)/(float)cfg.uiStepsPerMM;
+	// Power of two scaling is exact, so this rounds the same as step/16*2^mres/steps did.
+	m_fStepsPerMM = 16.f*(float)cfg.uiStepsPerMM/(float)(1u<<m_regs.defs.CHOPCONF.mres);
+	if (m_pTiming)
+		m_pTiming->SetStepsPerMM(m_fStepsPerMM);
 }
 
 int32_t TMC2130::PosToStep(float pos)
 {
 	return pos*16/(float)(1u<<m_regs.defs.CHOPCONF.mres)*(float)cfg.uiStepsPerMM;
 }
+
+void TMC2130::SaveState(Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	snap.Put(strPfx + "regs", m_regs);
+	snap.Put(strPfx + "cmdIn", m_cmdIn);
+	snap.Put(strPfx + "cmdProc", m_cmdProc);
+	snap.Put(strPfx + "cmdOut", m_cmdOut);
+	snap.Put(strPfx + "curStep", m_iCurStep);
+	snap.Put(strPfx + "dir", m_bDir);
+	snap.Put(strPfx + "enable", m_bEnable.load());
+	snap.Put(strPfx + "stall", m_bStall);
+}
+
+void TMC2130::LoadState(const Snapshot &snap)
+{
+	string strPfx = GetName() + "/";
+	bool bEnable = m_bEnable;
+	snap.Get(strPfx + "regs", m_regs);
+	snap.Get(strPfx + "cmdIn", m_cmdIn);
+	snap.Get(strPfx + "cmdProc", m_cmdProc);
+	snap.Get(strPfx + "cmdOut", m_cmdOut);
+	snap.Get(strPfx + "curStep", m_iCurStep);
+	snap.Get(strPfx + "dir", m_bDir);
+	snap.Get(strPfx + "enable", bEnable);
+	snap.Get(strPfx + "stall", m_bStall);
+	m_bEnable = bEnable;
+	m_bPosPending = false;
+	UpdateStepScale();
+	m_fCurPos = StepToPos(m_iCurStep);
+	PublishPos();
+	m_motion.Update(m_pAVR->cycle, m_iCurStep, m_fCurPos);
+	float fPos = m_fCurPos;
+	RaiseIRQ(POSITION_OUT, *reinterpret_cast<uint32_t*>(&fPos));
+	CheckDiagOut();
+}
@@ -23,13 +23,18 @@
 #pragma once
 
 #include <stdint.h>            // for uint8_t, uint32_t, int32_t, uint16_t
+#include <memory>              // for unique_ptr
 #include <string>              // for string
 #include <vector>              // for vector
 #include <atomic>
 #include "BasePeripheral.h"    // for MAKE_C_TIMER_CALLBACK
 #include "IScriptable.h"       // for IScriptable::LineStatus
+#include "Metrics.h"           // for Metric
+#include "MotionChannel.h"     // for MotionChannel
 #include "SPIPeripheral.h"     // for SPIPeripheral
 #include "Scriptable.h"        // for Scriptable
+#include "Snapshot.h"          // for Snapshot
+#include "StepTiming.h"        // for StepTiming
 #include "sim_avr.h"           // for avr_t
 #include "sim_avr_types.h"     // for avr_cycle_count_t
 #include "sim_cycle_timers.h"  // for avr_cycle_timer_t
@@ -75,6 +80,19 @@ class TMC2130: public SPIPeripheral, public Scriptable
         // Draws the position value as a number, without position ticks.
         void Draw_Simple();
 
+        // Checkpoints/restores the driver registers and motor position, see Board::SaveState
+        void SaveState(Snapshot &snap);
+        void LoadState(const Snapshot &snap);
+
+		// Step-exact motion for consumers that want to pull the position or only watch part of
+		// the travel, rather than take POSITION_OUT on every step.
+		inline MotionChannel& GetMotion() { return m_motion; }
+
+		// Coalesces POSITION_OUT to at most one raise per N us of sim time while stepping, for
+		// drivers created after this. Direction changes, stalls and standstill still publish
+		// straight away. 0 raises on every step.
+		static void SetDefaultCoalesce(uint32_t uiUs) { m_uiDefaultCoalesceUs = uiUs; }
+
 	protected:
 		Scriptable::LineStatus ProcessAction (unsigned int iAct, const vector<string> &vArgs) override;
 
@@ -83,11 +101,13 @@ class TMC2130: public SPIPeripheral, public Scriptable
 		{
 			ActToggleStall,
 			ActSetDiag,
-			ActResetDiag
+			ActResetDiag,
+			ActPrintStepTiming,
+			ActClearStepTiming
 		};
 
         // SPI handlers.
-        uint8_t OnSPIIn(avr_irq_t *irq, uint32_t value) override;
+        void OnSPITransfer(const uint8_t *pData, size_t uiLen) override;
         void OnCSELIn(avr_irq_t *irq, uint32_t value) override;
 
         // Input handlers.
@@ -99,6 +119,13 @@ class TMC2130: public SPIPeripheral, public Scriptable
         avr_cycle_count_t OnStandStillTimeout(avr_t *avr, avr_cycle_count_t when);
         avr_cycle_timer_t m_fcnStandstill = MAKE_C_TIMER_CALLBACK(TMC2130,OnStandStillTimeout);
 
+        // Deferred POSITION_OUT when coalescing.
+        avr_cycle_count_t OnPublishTimer(avr_t *avr, avr_cycle_count_t when);
+        avr_cycle_timer_t m_fcnPublish = MAKE_C_TIMER_CALLBACK(TMC2130,OnPublishTimer);
+
+        // Raises the current position on POSITION_OUT now.
+        void RaisePosition();
+
         // Command processing
         void ProcessCommand();
         void CreateReply();
@@ -203,15 +230,33 @@ class TMC2130: public SPIPeripheral, public Scriptable
 
         int32_t m_iCurStep = 0;
         int32_t m_iMaxPos = 0;
-        atomic<float> m_fCurPos = {0}, m_fEnd = {0}; // Tracks position in float for gl
+        float m_fCurPos = 0; // AVR thread only
+        // Copy of m_fCurPos for the GL thread. A single word doesn't tear, so a relaxed store (a plain mov)
+        // is all the step path pays instead of a fenced seq_cst one.
+        atomic<float> m_fDrawPos = {0}, m_fEnd = {0};
+        inline void PublishPos() { m_fDrawPos.store(m_fCurPos, std::memory_order_relaxed); }
         tmc2130_cmd_t m_cmdIn;
         tmc2130_cmd_t m_cmdProc;
         tmc2130_cmd_t m_cmdOut; // the previous data for output.
+        uint8_t m_uiReply[5]; // m_cmdOut in clocking order, for the transfer in progress.
         tmc2130_registers_t m_regs;
 		atomic_char m_cAxis;
 		bool m_bStall = false;
 
+		MotionChannel m_motion;
+		Metric m_mtrPos, m_mtrStall;
+		std::unique_ptr<StepTiming> m_pTiming; // Only with --step-timing
+
+		// Stepping bookkeeping. The standstill timer is only armed once per run of steps
+		// and pushes itself back to m_uiLastStep + m_uiStandstillCycles when it fires early.
+		avr_cycle_count_t m_uiLastStep = 0, m_uiLastPublish = 0, m_uiCoalesceCycles = 0;
+		bool m_bStandstillArmed = false, m_bPublishArmed = false, m_bPosPending = false;
+		static constexpr avr_cycle_count_t m_uiStandstillCycles = 1u<<20; // From the datasheet.
+		static uint32_t m_uiDefaultCoalesceUs;
+
 		// Position helpers
-		float StepToPos(int32_t step);
+		float m_fStepsPerMM = 1; // In (micro)steps, follows CHOPCONF.mres, see UpdateStepScale()
+		void UpdateStepScale();
+		inline float StepToPos(int32_t step) { return static_cast<float>(step)/m_fStepsPerMM; }
 		int32_t PosToStep(float step);
 };
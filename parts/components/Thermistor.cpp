@@ -23,6 +23,8 @@
 
 #include "Thermistor.h"
 #include <stdio.h>           // for printf, NULL
+#include <algorithm>         // for max
+#include <cmath>             // for floor
 #include "BasePeripheral.h"  // for MAKE_C_CALLBACK
 #include "TelemetryHost.h"
 
@@ -31,6 +33,7 @@ Thermistor::Thermistor(float fStartTemp):Scriptable("Thermistor"),m_fCurrentTemp
 	RegisterActionAndMenu("Disconnect","Disconnects the thermistor as though it has gone open circuit",Actions::OpenCircuit);
 	RegisterActionAndMenu("Short","Short the thermistor out",Actions::Shorted);
 	RegisterActionAndMenu("Reconnct","Restores the normal thermistor state",Actions::Connected);
+	Publish();
 
 }
 
@@ -38,42 +41,64 @@ Thermistor::Thermistor(float fStartTemp):Scriptable("Thermistor"),m_fCurrentTemp
 Scriptable::LineStatus Thermistor::ProcessAction(unsigned int iAction, const vector<string> &args)
 {
 	m_eState = (Actions)iAction;
+	Publish();
 	return LineStatus::Finished;
 }
 
-uint32_t Thermistor::OnADCRead(struct avr_irq_t * irq, uint32_t value)
+void Thermistor::Publish()
 {
 	if (m_eState == Shorted)
-		return 0;
+		SetADCValue(0);
 	else if (m_eState == OpenCircuit)
-		return 5000;
-
-	short *t = m_pTable, *lt = NULL;
-	for (unsigned int ei = 0; ei < m_uiTableEntries; ei++, lt = t, t += 2) {
-		if (t[1] <= m_fCurrentTemp) {
-			short tt = t[0];
-			/* small linear regression between table samples */
-			if (ei > 0 && t[1] < m_fCurrentTemp) {
-				short d_adc = t[0] - lt[0];
-				float d_temp = t[1] - lt[1];
-				float delta = m_fCurrentTemp - t[1];
-				tt = t[0] + (d_adc * (delta / d_temp));
-			}
-			// if (m_adc_mux_number==-1)
-			// 	printf("simAVR ADC out value: %u\n",((tt / m_oversampling) * 5000) / 0x3ff);
-			uint32_t uiVal = (((tt / m_iOversampling) * 5000) / 0x3ff);
-			return uiVal;
-		}
+		SetADCValue(5000);
+	else
+		SetADCValue(m_uiValue);
+	SetRefresh(m_fcnOnRead && m_eState == Connected);
+}
+
+void Thermistor::OnADCRefresh()
+{
+	m_fcnOnRead(); // Publishes through TEMP_IN if the temperature has moved.
+}
+
+void Thermistor::SetOnRead(const std::function<void()> &fcn)
+{
+	m_fcnOnRead = fcn;
+	Publish();
+}
+
+uint32_t Thermistor::Lookup(float fTemp)
+{
+	if (m_vFirstBelow.empty() || fTemp < m_iIndexMin)
+	{
+		printf("%s(%d) temperature out of range (%.2f), we're screwed\n",
+				__func__, GetMuxNumber(), fTemp);
+		return UINT32_MAX;
+	}
+	// Same answer as scanning for the first entry at or below fTemp.
+	int iDeg = static_cast<int>(floor(fTemp)) - m_iIndexMin;
+	unsigned int ei = iDeg < static_cast<int>(m_vFirstBelow.size()) ? m_vFirstBelow[iDeg] : 0;
+	short *t = m_pTable + (2*ei);
+	short tt = t[0];
+	/* small linear regression between table samples */
+	if (ei > 0 && t[1] < fTemp) {
+		short *lt = t - 2;
+		short d_adc = t[0] - lt[0];
+		float d_temp = t[1] - lt[1];
+		float delta = fTemp - t[1];
+		tt = t[0] + (d_adc * (delta / d_temp));
 	}
-	printf("%s(%d) temperature out of range (%.2f), we're screwed\n",
-			__func__, GetMuxNumber(), m_fCurrentTemp);
-	return UINT32_MAX;
+	// if (m_adc_mux_number==-1)
+	// 	printf("simAVR ADC out value: %u\n",((tt / m_oversampling) * 5000) / 0x3ff);
+	return (((tt / m_iOversampling) * 5000) / 0x3ff);
 }
 
 void Thermistor::OnTempIn(struct avr_irq_t * irq, uint32_t value)
 {
 	float fv = ((float)value) / 256;
 	m_fCurrentTemp = fv;
+	m_uiValue = Lookup(fv);
+	Publish();
 
 	RaiseIRQ(TEMP_OUT, value);
 }
@@ -95,12 +120,33 @@ void Thermistor::SetTable(short *pTable, unsigned int uiEntries, int iOversamp)
 	m_iOversampling = iOversamp;
 	m_pTable = pTable;
 	m_uiTableEntries = uiEntries;
+
+	// Table temps are whole degrees, descending. For each degree from the coldest entry up,
+	// note the first entry at or below it so Lookup() doesn't have to scan.
+	m_vFirstBelow.clear();
+	if (uiEntries)
+	{
+		m_iIndexMin = pTable[(2*uiEntries)-1];
+		int iMax = pTable[1];
+		unsigned int ei = uiEntries-1;
+		m_vFirstBelow.resize(max(0, iMax - m_iIndexMin) + 1);
+		for (int iDeg = m_iIndexMin; iDeg <= iMax; iDeg++)
+		{
+			while (ei > 0 && pTable[(2*(ei-1))+1] <= iDeg)
+				ei--;
+			m_vFirstBelow[iDeg - m_iIndexMin] = ei;
+		}
+	}
+	m_uiValue = Lookup(m_fCurrentTemp);
+	Publish();
 }
 
 void Thermistor::Set(float fTempC)
 {
 	uint32_t value = fTempC * 256;
 	m_fCurrentTemp = fTempC;
+	m_uiValue = Lookup(fTempC);
+	Publish();
 
 	RaiseIRQ(TEMP_OUT, value);
 }
@@ -24,7 +24,8 @@
 
 #pragma once
 
-#include <stdint.h>         // for uint32_t, uint8_t
+#include <stdint.h>         // for uint32_t, uint8_t, UINT32_MAX
+#include <functional>       // for function
 #include <string>           // for string
 #include <vector>           // for vector
 #include "ADCPeripheral.h"  // for ADCPeripheral
@@ -52,12 +53,17 @@ class Thermistor: public ADCPeripheral, public Scriptable
 
 		// Set the temperature explicitly.
 		void Set(float fTemp);
+
+		// Called before each ADC read, e.g. so a heater can bring the temperature up to date.
+		void SetOnRead(const std::function<void()> &fcn);
 	protected:
 		LineStatus ProcessAction(unsigned int iAction, const vector<string> &args);
 
 	private:
 
-		uint32_t OnADCRead(avr_irq_t *irq, uint32_t value);
+		// Sets the ADC reading for the temperature and state, when either changes.
+		void Publish();
+		void OnADCRefresh() override;
 
 		enum Actions
 		{
@@ -68,9 +74,16 @@ class Thermistor: public ADCPeripheral, public Scriptable
 
 		void OnTempIn(avr_irq_t *irq, uint32_t value);
 
+		// Works out the ADC reading for a temperature. Done when the temperature changes, not per read.
+		uint32_t Lookup(float fTemp);
+
 		short * m_pTable = nullptr;
 		unsigned int m_uiTableEntries = 0;
+		std::vector<unsigned int> m_vFirstBelow; // Per whole degree from m_iIndexMin, see SetTable
+		int m_iIndexMin = 0;
+		uint32_t m_uiValue = UINT32_MAX; // Current ADC reading
 		int 		m_iOversampling = 16;
 		float	m_fCurrentTemp = 25;
 		Actions m_eState = Connected;
+		std::function<void()> m_fcnOnRead;
 };
@@ -0,0 +1,108 @@
+/*
+	UARTLink.cpp - Connects a UART on one board directly to a UART on another
+	(e.g. the MK3S and the MMU2) without going through host PTYs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "UARTLink.h"
+#include <stdio.h>       // for fprintf, stderr
+#include "avr_uart.h"    // for AVR_IOCTL_UART_GETIRQ, ::AVR_...
+#include "sim_io.h"      // for avr_io_getirq, avr_ioctl
+#include "sim_time.h"    // for avr_usec_to_cycles
+
+void UARTLink::Init(avr_t *avr, char chrUART)
+{
+	_Init(avr, this);
+
+	RegisterNotify(BYTE_IN, MAKE_C_CALLBACK(UARTLink,OnByteIn), this);
+
+	// disable the stdio dump, as we are sending binary there
+	uint32_t f = 0;
+	avr_ioctl(m_pAVR, AVR_IOCTL_UART_GET_FLAGS(chrUART), &f);
+	f &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(m_pAVR, AVR_IOCTL_UART_SET_FLAGS(chrUART), &f);
+
+	avr_irq_t * src = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUTPUT);
+	avr_irq_t * dst = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_INPUT);
+	avr_irq_t * xon = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XON);
+	avr_irq_t * xoff = avr_io_getirq(m_pAVR, AVR_IOCTL_UART_GETIRQ(chrUART), UART_IRQ_OUT_XOFF);
+	if (src && dst) {
+		ConnectFrom(src, BYTE_IN);
+		ConnectTo(BYTE_OUT, dst);
+	}
+	if (xon)
+		avr_irq_register_notify(xon, MAKE_C_CALLBACK(UARTLink,OnXOnIn), this);
+	if (xoff)
+		avr_irq_register_notify(xoff, MAKE_C_CALLBACK(UARTLink,OnXOffIn), this);
+}
+
+void UARTLink::Link(UARTLink &a, UARTLink &b)
+{
+	a.m_pPeer = &b;
+	b.m_pPeer = &a;
+}
+
+void UARTLink::SetLockstep(Lockstep &group)
+{
+	m_bGated = true;
+	// Both boards are held at the boundary, so the ring is not changing under us.
+	group.AddBoundaryHook([this]() { m_uiReady = m_rx.Size(); });
+}
+
+// Runs on the sending board's thread.
+void UARTLink::OnByteIn(avr_irq_t * irq, uint32_t value)
+{
+	if (!m_pPeer)
+		return;
+	if (!m_pPeer->m_rx.Push(value) && (m_uiDropped++ % 1024) == 0)
+		fprintf(stderr, "UARTLink: receiver is not keeping up, dropped %lu bytes\n", static_cast<unsigned long>(m_uiDropped.load()));
+}
+
+void UARTLink::FlushData()
+{
+	uint8_t byte;
+	// XOFF arrives synchronously from within RaiseIRQ once the UART FIFO fills.
+	while (m_bXOn && (!m_bGated || m_uiReady>0) && m_rx.Pop(byte))
+	{
+		if (m_bGated)
+			m_uiReady--;
+		RaiseIRQ(BYTE_OUT, byte);
+	}
+}
+
+avr_cycle_count_t UARTLink::OnFlushTimer(avr_t * avr, avr_cycle_count_t when)
+{
+	FlushData();
+	return m_bXOn ? when + avr_usec_to_cycles(m_pAVR, m_uiFlushUsec) : 0;
+}
+
+// Called repeatedly while the UART has room, XOFF only once it is full.
+void UARTLink::OnXOnIn(avr_irq_t * irq, uint32_t value)
+{
+	m_bXOn = true;
+	FlushData();
+	if (m_bXOn)
+		RegisterTimerUsec(m_fcnFlush, m_uiFlushUsec, this);
+}
+
+void UARTLink::OnXOffIn(avr_irq_t * irq, uint32_t value)
+{
+	m_bXOn = false;
+	CancelTimer(m_fcnFlush, this);
+}
@@ -0,0 +1,83 @@
+/*
+	UARTLink.h - Connects a UART on one board directly to a UART on another
+	(e.g. the MK3S and the MMU2) without going through host PTYs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>            // for size_t
+#include <stdint.h>            // for uint8_t, uint32_t
+#include <atomic>              // for atomic_uint_fast64_t
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "Lockstep.h"          // for Lockstep
+#include "SPSCRing.h"          // for SPSCRing
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+// One end of the link. Each board runs on its own thread, so bytes cross over
+// through a lock-free ring that the sending side fills and the receiving side
+// drains into its UART while the UART signals XON.
+class UARTLink: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(BYTE_IN,"8<uart_link.in") _IRQ(BYTE_OUT,"8>uart_link.out")
+		#include "IRQHelper.h"
+
+		UARTLink(size_t uiBuffer = m_uiDefaultRing):m_rx(uiBuffer){};
+
+		// Hooks up to the given UART (e.g. '2') on avr.
+		void Init(avr_t *avr, char chrUART);
+
+		// Pairs two ends; bytes sent by either UART arrive at the other.
+		// Do this before either board starts running.
+		static void Link(UARTLink &a, UARTLink &b);
+
+		// Only hands over bytes at the group's quantum boundaries, so they arrive
+		// at the same simulated time from run to run. Call for both ends, before they run.
+		void SetLockstep(Lockstep &group);
+
+	private:
+		void OnByteIn(avr_irq_t * irq, uint32_t value);
+		void OnXOnIn(avr_irq_t * irq, uint32_t value);
+		void OnXOffIn(avr_irq_t * irq, uint32_t value);
+		avr_cycle_count_t OnFlushTimer(avr_t * avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnFlush = MAKE_C_TIMER_CALLBACK(UARTLink,OnFlushTimer);
+
+		// Feeds the UART from the ring until it is empty or the UART says XOFF.
+		void FlushData();
+
+		UARTLink *m_pPeer = nullptr;
+
+		// Written by the peer's AVR thread, read by ours.
+		SPSCRing<uint8_t> m_rx;
+
+		bool m_bXOn = false;
+
+		bool m_bGated = false;
+		size_t m_uiReady = 0; // Bytes released at the last boundary, if gated.
+
+		std::atomic_uint_fast64_t m_uiDropped {0};
+
+		static constexpr size_t m_uiDefaultRing = 4096;
+		// Roughly one byte time at 115200 baud.
+		static constexpr uint32_t m_uiFlushUsec = 80;
+};
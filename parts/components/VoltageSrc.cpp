@@ -23,19 +23,21 @@
 #include "BasePeripheral.h"  // for MAKE_C_CALLBACK
 #include "TelemetryHost.h"
 
-uint32_t VoltageSrc::OnADCRead(struct avr_irq_t * irq, uint32_t value)
+void VoltageSrc::Publish()
 {
     uint32_t iVOut =  (m_fCurrentV*m_fVScale)*1000*5;
-	return iVOut;
+	SetADCValue(iVOut);
 }
 
 void VoltageSrc::OnInput(struct avr_irq_t *irq, uint32_t value)
 {
     m_fCurrentV = (float)value / 256.0f;
+	Publish();
 }
 
 VoltageSrc::VoltageSrc(float fVScale,float fStart):m_fCurrentV(fStart), m_fVScale(fVScale)
 {
+	Publish();
 }
 
 void VoltageSrc::Init(struct avr_t * avr , uint8_t uiMux)
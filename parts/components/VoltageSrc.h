@@ -51,8 +51,8 @@ public:
 	virtual inline std::string GetName(){return std::string("VSrc") + std::to_string(GetMuxNumber()) ;}
 
 protected:
-    // ADC read trigger.
-    virtual uint32_t OnADCRead(avr_irq_t *pIRQ, uint32_t value) override;
+    // Works out the reading for the ADC, when the voltage changes.
+    virtual void Publish();
 
     // Input trigger
     void OnInput(avr_irq_t *pIRQ, uint32_t value);
@@ -23,9 +23,7 @@
 
 
 #include "uart_pty.h"
-#include <sys/time.h>                   // IWYU pragma: keep
 #include <errno.h>                      // for errno
-#include <pthread.h>                    // for pthread_create, pthread_join
 #if defined(__APPLE__)
 // utils/Util.h clashes with this system file.
 //#  include <util.h>                     // for openpty
@@ -39,22 +37,20 @@ int
 #endif
 #include <stdio.h>                      // for printf, NULL, fprintf, sprintf
 #include <stdlib.h>                     // for getenv, atoi, system
-#include <string.h>                     // for memset, strerror
-#include <sys/select.h>                 // for select, FD_ISSET, FD_SET, FD_...
+#include <string.h>                     // for memset, strcmp, strerror
 #include <termios.h>                    // for cfmakeraw, tcgetattr, tcsetattr
 #include <unistd.h>                     // for close, read, symlink, unlink
-#include "avr_uart.h"                   // for AVR_IOCTL_UART_GETIRQ, ::AVR_...
+#include "StartupTimeline.h"            // for StartupTimeline, StartupTimeline::Phase
+#include "avr_uart.h"                   // for AVR_IOCTL_UART_GETIRQ, avr_uart_t, ::AVR_...
 #include "sim_io.h"                     // for avr_io_getirq, avr_ioctl
-#include "sim_time.h"                   // for avr_hz_to_cycles
 
 //#define TRACE(_w) _w
 #ifndef TRACE
 #define TRACE(_w)
 #endif
 
-extern "C" {
-DEFINE_FIFO(uint8_t,uart_pty_fifo);
-}
+uint32_t uart_pty::m_uiDefaultTurbo = 0;
+bool uart_pty::m_bNoPtys = false;
 
 /*
  * called when a byte is send via the uart on the AVR
@@ -62,13 +58,29 @@ DEFINE_FIFO(uint8_t,uart_pty_fifo);
 void uart_pty::OnByteIn(struct avr_irq_t * irq, uint32_t value)
 {
 	TRACE(printf("uart_pty_in_hook %02x\n", value);)
-	std::lock_guard<std::mutex> lock(m_lock);
-	uart_pty_fifo_write(&pty.in, value);
+	if (!pty.s)
+		return; // No PTY, nobody to send it to.
+	if (!pty.in.Push(value))
+		m_mtrDropped.Add();
 
 	if (tap.s) {
 		if (tap.crlf && value == '\n')
-			uart_pty_fifo_write(&tap.in, '\r');
-		uart_pty_fifo_write(&tap.in, value);
+			tap.in.Push('\r');
+		tap.in.Push(value);
+	}
+	IOReactor::Get().Notify();
+}
+
+inline void uart_pty::SendByte(uint8_t byte)
+{
+	m_chIn.Record(byte);
+	if (m_chrLast == '\n' && byte == '\n')
+		printf("Swallowing repeated newlines\n");
+	else
+	{
+		if (byte !='\n')
+			m_chrLast = byte;
+		RaiseIRQ(BYTE_OUT, byte);
 	}
 }
 
@@ -76,56 +88,55 @@ void uart_pty::OnByteIn(struct avr_irq_t * irq, uint32_t value)
 // other side is full
 void uart_pty::FlushData()
 {
-	std::lock_guard<std::mutex> lock(m_lock);
-	while (m_bXOn && !uart_pty_fifo_isempty(&pty.out)) {
-		TRACE(int r = p->pty.out.read;)
-		uint8_t byte = uart_pty_fifo_read(&pty.out);
-		TRACE(printf("uart_pty_flush_incoming send r %03d:%02x\n", r, byte);)
-		if (m_chrLast == '\n' && byte == '\n')
-			printf("Swallowing repeated newlines\n");
-		else
-		{
-			if (byte !='\n')
-				m_chrLast = byte;
-			RaiseIRQ(BYTE_OUT, byte);
-
-		}
-
-		if (tap.s) {
-			if (tap.crlf && byte == '\n')
-				uart_pty_fifo_write(&tap.in, '\r');
-			uart_pty_fifo_write(&tap.in, byte);
+	uint8_t *pData;
+	size_t uiLen;
+	if (InputLog::IsReplaying())
+	{
+		// Live input is dropped, it would only make the run differ from the recording.
+		while ((uiLen = pty.out.GetReadSpan(pData))>0)
+			pty.out.CommitRead(uiLen);
+		while (tap.s && (uiLen = tap.out.GetReadSpan(pData))>0)
+			tap.out.CommitRead(uiLen);
+		uint32_t uiByte;
+		while (m_bXOn && m_chIn.Next(uiByte))
+			SendByte(uiByte);
+		return;
+	}
+	// Taken in contiguous runs; XOFF may arrive synchronously from any RaiseIRQ.
+	while (m_bXOn && (uiLen = pty.out.GetReadSpan(pData))>0) {
+		size_t i = 0;
+		for (; i < uiLen && m_bXOn; i++) {
+			uint8_t byte = pData[i];
+			TRACE(printf("uart_pty_flush_incoming send %02x\n", byte);)
+			SendByte(byte);
+
+			if (tap.s) {
+				if (tap.crlf && byte == '\n')
+					tap.in.Push('\r');
+				tap.in.Push(byte);
+			}
 		}
+		pty.out.CommitRead(i);
 	}
 	if (tap.s) {
-		while (m_bXOn && !uart_pty_fifo_isempty(&tap.out)) {
-			uint8_t byte = uart_pty_fifo_read(&tap.out);
-			if (tap.crlf && byte == '\r') {
-				uart_pty_fifo_write(&tap.in, '\n');
-			}
-			if (byte == '\n')
-				continue;
-			uart_pty_fifo_write(&tap.in, byte);
-			if (m_chrLast == '\n' && byte == '\n')
-				printf("2Swallowing repeated newlines\n");
-			else
-			{
-				if (byte !='\n')
-					m_chrLast = byte;
-				RaiseIRQ(BYTE_OUT, byte);
-
-			}
+		while (m_bXOn && (uiLen = tap.out.GetReadSpan(pData))>0) {
+			size_t i = 0;
+			for (; i < uiLen && m_bXOn; i++) {
+				uint8_t byte = pData[i];
+				if (tap.crlf && byte == '\r') {
+					tap.in.Push('\n');
+				}
+				if (byte == '\n')
+					continue;
+				tap.in.Push(byte);
+				SendByte(byte);
 			}
+			tap.out.CommitRead(i);
+		}
+		IOReactor::Get().Notify(); // For the echo.
 	}
 }
 
-avr_cycle_count_t uart_pty::OnFlushTimer(struct avr_t * avr, avr_cycle_count_t when)
-{
-	FlushData();
-	/* always return a cycle NUMBER not a cycle count */
-	return m_bXOn ? when + avr_hz_to_cycles(m_pAVR, 1000) : 0;
-}
-
 /*
  * Called when the uart has room in it's input buffer. This is called repeateadly
  * if necessary, while the xoff is called only when the uart fifo is FULL
@@ -135,11 +146,8 @@ void uart_pty::OnXOnIn(struct avr_irq_t * irq,uint32_t value)
 	TRACE(if (!m_bXOn) printf("uart_pty_xon_hook\n");)
 	m_bXOn = true;
 
+	// Anything that came while it was off. Later data is picked up by Poll().
 	FlushData();
-
-	// if the buffer is not flushed, try to do it later
-	if (m_bXOn)
-			RegisterTimer(m_fcnFlush,avr_hz_to_cycles(m_pAVR, 1000),this);
 }
 
 /*
@@ -149,100 +157,71 @@ void uart_pty::OnXOffIn(struct avr_irq_t * irq, uint32_t value)
 {
 	TRACE(if (m_bXOn) printf("uart_pty_xoff_hook\n");)
 	m_bXOn = false;
-	CancelTimer(m_fcnFlush,this);
 }
 
 uart_pty::uart_pty()
 {
-	memset(&port[0], 0, sizeof(port[0]));
-	memset(&port[1], 0, sizeof(port[1]));
+	size_t uiRing = m_uiDefaultRing;
+	if (getenv("SIMAVR_UART_BUFFER") && atoi(getenv("SIMAVR_UART_BUFFER"))>0)
+		uiRing = atoi(getenv("SIMAVR_UART_BUFFER"));
+	for (auto &p : port)
+	{
+		p.tap = p.crlf = p.hungup = 0;
+		p.in.Resize(uiRing);
+		p.out.Resize(uiRing);
+	}
 }
 
-void* uart_pty::Run()
+IOReactor::Interest_t uart_pty::Service(uart_pty_port_t &p, bool bReadable)
 {
-	while (!m_bQuit) {
-		fd_set read_set, write_set;
-		int max = 0;
-		FD_ZERO(&read_set);
-		FD_ZERO(&write_set);
-
-		for (int ti = 0; ti < 2; ti++) if (port[ti].s) {
-			// read more only if buffer was flushed
-			std::lock_guard<std::mutex> lock(m_lock);
-			if (port[ti].buffer_len == port[ti].buffer_done) {
-				FD_SET(port[ti].s, &read_set);
-				max = port[ti].s > max ? port[ti].s : max;
-			}
-			if (!uart_pty_fifo_isempty(&port[ti].in)) {
-				FD_SET(port[ti].s, &write_set);
-				max = port[ti].s > max ? port[ti].s : max;
-			}
+	uint8_t *pData;
+	// A PTY nobody has open reads as EIO, keep trying it as the reactor comes round.
+	if ((bReadable || p.hungup) && !p.out.IsFull()) {
+		// Straight into the ring, as much as fits in one go.
+		size_t uiLen = p.out.GetWriteSpan(pData);
+		ssize_t r = read(p.s, pData, uiLen);
+		if (r > 0) {
+			p.out.CommitWrite(r);
+			m_bHostData.store(true, std::memory_order_release);
 		}
-
-		// short, but not too short interval
-		struct timeval timo = { 0, 500 };
-		int ret = select(max+1, &read_set, &write_set, NULL, &timo);
-
-		if (ret < 0)
+		p.hungup = r == 0 || (r < 0 && errno != EAGAIN);
+		TRACE(if (!p.tap && r > 0)
+				hdump("pty recv", pData, r);)
+	}
+	while (!p.in.IsEmpty()) {
+		size_t uiLen = p.in.GetReadSpan(pData);
+		ssize_t r = write(p.s, pData, uiLen);
+		if (r <= 0) {
+			if (r < 0 && errno != EAGAIN && !p.hungup)
+				fprintf(stderr,"Failed to write to PTY\n");
 			break;
-
-		for (int ti = 0; ti < 2; ti++) if (port[ti].s) {
-			if (FD_ISSET(port[ti].s, &read_set)) {
-				std::lock_guard<std::mutex> lock(m_lock);
-				ssize_t r = read(port[ti].s, port[ti].buffer,
-									sizeof(port[ti].buffer)-1);
-				port[ti].buffer_len = r;
-				port[ti].buffer_done = 0;
-				TRACE(if (!port[ti].tap)
-						hdump("pty recv", port[ti].buffer, r);)
-			}
-			if (port[ti].buffer_done < port[ti].buffer_len) {
-				// write them in fifo
-				std::lock_guard<std::mutex> lock(m_lock);
-				while (port[ti].buffer_done < port[ti].buffer_len &&
-						!uart_pty_fifo_isfull(&port[ti].out)) {
-					int index = port[ti].buffer_done++;
-					TRACE(int wi = port[ti].out.write;)
-					uart_pty_fifo_write(&port[ti].out,
-							port[ti].buffer[index]);
-					TRACE(printf("w %3d:%02x (%d/%d) %s\n",
-								wi, port[ti].buffer[index],
-								port[ti].out.read,
-								port[ti].out.write,
-								m_bXOn ? "XON" : "XOFF");)
-				}
-			}
-			if (FD_ISSET(port[ti].s, &write_set)) {
-				std::lock_guard<std::mutex> lock(m_lock);
-				uint8_t buffer[512];
-				// write them in fifo
-				uint8_t * dst = buffer;
-				while (!uart_pty_fifo_isempty(&port[ti].in) &&
-						(size_t)(dst - buffer) < sizeof(buffer)) {
-					*dst = uart_pty_fifo_read(&port[ti].in);
-					dst++;
-				}
-				size_t len = dst - buffer;
-				size_t r = write(port[ti].s, buffer, len);
-				if (r!=len)
-					fprintf(stderr,"Failed to write to PTY\n");
-				TRACE(if (!port[ti].tap) hdump("pty send", buffer, r);)
-			}
 		}
-		/* DO NOT call this, this create a concurency issue with the
-		 * FIFO that can't be solved cleanly with a memory barrier
-			uart_pty_flush_incoming(p);
-		  */
+		p.in.CommitRead(r);
+		TRACE(if (!p.tap) hdump("pty send", pData, r);)
+	}
+	if (!p.tap) {
+		m_mtrToHost.Set(p.in.Size());
+		m_mtrFromHost.Set(p.out.Size());
 	}
-	return NULL;
+	if (p.hungup)
+		return {false, false}; // Poll it instead, epoll would report the hangup continuously.
+	// read more only if there is room, otherwise the pty itself holds it back.
+	return {!p.out.IsFull(), !p.in.IsEmpty()};
 }
 
 void uart_pty::Init(struct avr_t * avr)
 {
+	StartupTimeline::Phase phase("PTY");
 	_Init(avr,this);
 
 	RegisterNotify(BYTE_IN, MAKE_C_CALLBACK(uart_pty,OnByteIn), this);
 
+	if (m_bNoPtys)
+	{
+		printf("uart_pty: No host PTY in a mode that forks, serial output is dropped.\n");
+		return;
+	}
+
 	int hastap = (getenv("SIMAVR_UART_TAP") && atoi(getenv("SIMAVR_UART_TAP"))) ||
 			(getenv("SIMAVR_UART_XTERM") && atoi(getenv("SIMAVR_UART_XTERM"))) ;
 
@@ -264,22 +243,21 @@ void uart_pty::Init(struct avr_t * avr)
 				ti == 0 ? "bridge" : "tap", port[ti].slavename);
 	}
 
-	auto fRunCB =[](void * param) { uart_pty* p = (uart_pty*)param; return p->Run();};
-	pthread_create(&m_thread, NULL, fRunCB, this);
+	for (auto &p : port)
+		if (p.s)
+			IOReactor::Get().Add(p.s, [this, &p](bool bReadable) { return Service(p, bReadable); });
 
 }
 
-// Shuts down the thread on destruction.
+// Detaches from the reactor before closing so it never sees a stale fd.
 uart_pty::~uart_pty()
 {
-	if (!m_thread)
-		return;
-	puts(__func__);
-	m_bQuit = true; // Signal thread it's time to quit.
 	for (int ti = 0; ti < 2; ti++)
 		if (port[ti].s)
+		{
+			IOReactor::Get().Remove(port[ti].s);
 			close(port[ti].s);
-	pthread_join(m_thread, NULL);
+		}
 }
 
 void uart_pty::Connect(char uart)
@@ -303,6 +281,21 @@ void uart_pty::Connect(char uart)
 	if (xoff)
 		avr_irq_register_notify(xoff, MAKE_C_CALLBACK(uart_pty,OnXOffIn),this);
 
+	if (m_uiDefaultTurbo)
+	{
+		for (avr_io_t *pIO = m_pAVR->io_port; pIO; pIO = pIO->next)
+			if (!strcmp(pIO->kind, "uart") && reinterpret_cast<avr_uart_t*>(pIO)->name == uart)
+				m_pTurbo = reinterpret_cast<avr_uart_t*>(pIO); // io is its first member.
+		if (m_pTurbo)
+			printf("uart_pty: UART%c in turbo mode, a byte every %u cycles\n", uart, m_uiDefaultTurbo);
+	}
+
+	std::string strUART(1, uart);
+	m_chIn.SetName("UART" + strUART);
+	m_mtrToHost.Register("mk404_uart_queue_bytes", "Bytes waiting in the PTY bridge.", {{"uart", strUART}, {"dir", "to_host"}});
+	m_mtrFromHost.Register("mk404_uart_queue_bytes", "Bytes waiting in the PTY bridge.", {{"uart", strUART}, {"dir", "from_host"}});
+	m_mtrDropped.Register("mk404_uart_dropped_bytes_total", "Bytes from the AVR lost to a full PTY bridge.", {{"uart", strUART}});
+
 	for (int ti = 0; ti < 1; ti++)
 		if (port[ti].s) {
 			char link[128];
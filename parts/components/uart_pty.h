@@ -24,23 +24,19 @@
 
 #pragma once
 
-#include <pthread.h>           // for pthread_t
 #include <stddef.h>            // for size_t
 #include <stdint.h>            // for uint8_t, uint32_t
-#include <mutex>
-#include <atomic>
+#include <atomic>              // for atomic_bool
 #include <string>              // for string
 #include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
-#include "fifo_declare.h"      // for DECLARE_FIFO, DEFINE_FIFO
+#include "IOReactor.h"         // for IOReactor
+#include "InputLog.h"          // for InputLog
+#include "Metrics.h"           // for Metric
+#include "SPSCRing.h"          // for SPSCRing
+#include "avr_uart.h"          // for avr_uart_t
 #include "sim_avr.h"           // for avr_t
-#include "sim_avr_types.h"     // for avr_cycle_count_t
-#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
 #include "sim_irq.h"           // for avr_irq_t
 
-extern "C" {
-    DECLARE_FIFO(uint8_t,uart_pty_fifo, 512);
-}
-
 class uart_pty: public BasePeripheral
 {
 
@@ -48,9 +44,10 @@ class uart_pty: public BasePeripheral
 		#define IRQPAIRS _IRQ(BYTE_IN,"8<uart_pty.in") _IRQ(BYTE_OUT,"8>uart_pty.out")
 		#include "IRQHelper.h"
 
+		// Ring sizes default to m_uiDefaultRing, or SIMAVR_UART_BUFFER (bytes) if set.
 		uart_pty();
 
-		// Destructor. Kills the thread, if it was started.
+		// Destructor. Detaches from the I/O reactor.
 		~uart_pty();
 
 		// Registers with SimAVR
@@ -59,48 +56,72 @@ class uart_pty: public BasePeripheral
 		// Actually connects to the UART.
 		void Connect(char chrUART);
 
+		// Has the UARTs connected after this move a byte every uiCycles AVR cycles in either
+		// direction, whatever baud rate the firmware set. Reception is still paced by the UART's
+		// FIFO and the firmware emptying it. 0 keeps the configured rate.
+		static void SetDefaultTurbo(uint32_t uiCycles) { m_uiDefaultTurbo = uiCycles; }
+
+		// Opens no host PTYs at all, for the modes that fork (--fork-server, --replay-parallel):
+		// the I/O thread servicing them doesn't survive a fork, so a child would lose its serial
+		// I/O without a word. The UARTs are still wired up, what the AVR sends is dropped.
+		static void SetNoPtys(bool bVal) { m_bNoPtys = bVal; }
+
 		// Resets the newline trap after a printer reset.
 		void Reset() { m_chrLast = '\n';}
 
 		// Gets the slave name (file). Used by the pipe thread.
 		const std::string GetSlaveName() { return std::string(pty.slavename); };
 
+		// The board's, between instruction batches: passes on what the host sent since, if the
+		// UART can take it. Otherwise the next XON does. Costs an atomic load when idle.
+		inline void Poll()
+		{
+			if (m_pTurbo && m_pTurbo->cycles_per_byte != m_uiDefaultTurbo)
+				m_pTurbo->cycles_per_byte = m_uiDefaultTurbo; // The firmware sets the baud rate whenever it likes.
+			if (m_bXOn && (InputLog::IsReplaying() || (m_bHostData.load(std::memory_order_relaxed) && m_bHostData.exchange(false))))
+				FlushData();
+		}
+
 	private:
 
-		void* Run();
 		void OnByteIn(avr_irq_t * irq, uint32_t value);
 		void OnXOnIn(avr_irq_t * irq, uint32_t value);
 		void OnXOffIn(avr_irq_t * irq, uint32_t value);
-		avr_cycle_count_t OnFlushTimer(struct avr_t * avr,avr_cycle_count_t when);
-		avr_cycle_timer_t m_fcnFlush = MAKE_C_TIMER_CALLBACK(uart_pty,OnFlushTimer);
-
 		void FlushData();
 
-		pthread_t	m_thread = 0;
+		// Feeds a byte from the host side to the AVR, swallowing repeated newlines.
+		inline void SendByte(uint8_t byte);
+
 		bool		m_bXOn = false;
-		std::atomic_bool m_bQuit = {false};
+		std::atomic_bool m_bHostData {false}; // Set by the I/O thread when either "out" ring gets more.
 
 		unsigned char m_chrLast = '\n';
 
-		std::mutex m_lock;
+		static constexpr size_t m_uiDefaultRing = 16384;
+		static uint32_t m_uiDefaultTurbo;
+		static bool m_bNoPtys;
+		avr_uart_t *m_pTurbo = nullptr; // The UART, if in turbo mode
 
+		// "in" is written by the AVR thread and drained to the fd by the I/O thread,
+		// "out" the other way around, so neither needs a lock.
 		typedef struct uart_pty_port_t {
-			unsigned int	tap : 1, crlf : 1;
-			int 		s;			// socket we chat on
-			char 		slavename[64];
-			uart_pty_fifo_t in;
-			uart_pty_fifo_t out;
-			uint8_t		buffer[512];
-			size_t		buffer_len, buffer_done;
+			unsigned int	tap : 1, crlf : 1, hungup : 1;
+			int 		s = 0;			// socket we chat on
+			char 		slavename[64] = {0};
+			SPSCRing<uint8_t> in;
+			SPSCRing<uint8_t> out;
 		} uart_pty_port_t, *uart_pty_port_p;
 
-		union {
-			struct {
-				uart_pty_port_t		pty;
-				uart_pty_port_t		tap;
-			};
-			uart_pty_port_t port[2];
-		};
+		uart_pty_port_t port[2];
+		uart_pty_port_t &pty = port[0], &tap = port[1];
+
+		// Runs on the IOReactor thread: moves data between a port's fd and its rings.
+		IOReactor::Interest_t Service(uart_pty_port_t &p, bool bReadable);
+
+		// Bridge ring depths, as of the last Service(), and bytes lost to a full "in".
+		Metric m_mtrToHost, m_mtrFromHost, m_mtrDropped {Metric::Kind::Counter};
+
+		InputLog::Channel m_chIn; // Everything that goes to the AVR, named in Connect().
 
 
 };
@@ -24,9 +24,10 @@
 #include "w25x20cl.h"
 #include <fcntl.h>      // for open, O_CREAT, O_RDWR, SEEK_SET
 #include <stdio.h>      // for printf, perror, fprintf, stderr, size_t
-#include <stdlib.h>     // for exit, free, malloc
+#include <stdlib.h>     // for exit
 #include <string.h>     // for memset, memcpy, strncpy
-#include <unistd.h>     // for close, ftruncate, lseek, read, write, ssize_t
+#include <sys/mman.h>   // for mmap, msync, munmap, MAP_FAILED, MAP_SHARED, MS_ASYNC, MS_SYNC
+#include <unistd.h>     // for close, ftruncate, sysconf, _SC_PAGESIZE
 #include "TelemetryHost.h"
 
 //#define TRACE(_w) _w
@@ -61,8 +62,15 @@
 #define _CMD_RD_UID        0x4b
 
 
+constexpr uint32_t w25x20cl::m_uiFlushUs;
+
 w25x20cl::~w25x20cl()
 {
+	if (m_pFlash)
+	{
+		Flush(MS_SYNC);
+		munmap(m_pFlash, W25X20CL_TOTAL_SIZE + 1);
+	}
 	if (m_fdFlash)
 		close(m_fdFlash);
 }
@@ -110,6 +118,12 @@ uint8_t w25x20cl::OnSPIIn(struct avr_irq_t * irq, uint32_t value)
 						}
 						m_address %= W25X20CL_TOTAL_SIZE;
 						m_state = STATE_RUNNING;
+						if (m_command == _CMD_RD_DATA)
+						{
+							// Sequential reads come straight out of the image, up to where the address wraps.
+							SetReplyStream(m_pFlash + m_address, W25X20CL_TOTAL_SIZE - m_address);
+							m_address = 0;
+						}
 					}
 				} break;
 
@@ -124,7 +138,7 @@ uint8_t w25x20cl::OnSPIIn(struct avr_irq_t * irq, uint32_t value)
 							m_address |= m_cmdIn[i + 1];
 						}
 						m_address %= W25X20CL_TOTAL_SIZE;
-						memcpy(m_pageBuffer, m_flash + (m_address / W25X20CL_PAGE_SIZE) * W25X20CL_PAGE_SIZE, W25X20CL_PAGE_SIZE);
+						memcpy(m_pageBuffer, m_pFlash + (m_address / W25X20CL_PAGE_SIZE) * W25X20CL_PAGE_SIZE, W25X20CL_PAGE_SIZE);
 						m_state = STATE_RUNNING;
 					}
 				} break;
@@ -173,7 +187,7 @@ uint8_t w25x20cl::OnSPIIn(struct avr_irq_t * irq, uint32_t value)
 				} break;
 				case _CMD_RD_DATA:
 				{
-					m_cmdOut = m_flash[m_address];
+					m_cmdOut = m_pFlash[m_address];
 					m_address++;
 					m_address %= W25X20CL_TOTAL_SIZE;
 					SetSendReplyFlag();
@@ -244,14 +258,16 @@ void w25x20cl::OnCSELIn(struct avr_irq_t * irq, uint32_t value)
 					m_address /= W25X20CL_PAGE_SIZE;
 					m_address *= W25X20CL_PAGE_SIZE;
 					for (unsigned int i = 0; i < sizeof(m_pageBuffer); i++)
-						m_flash[m_address + i] &= m_pageBuffer[i];
+						m_pFlash[m_address + i] &= m_pageBuffer[i];
+					MarkDirty(m_address, sizeof(m_pageBuffer));
 					m_status_register.bits.WEL = 0;
 				} break;
 				case _CMD_CHIP_ERASE:
 				case _CMD_CHIP_ERASE2:
 				{
 					if(!m_status_register.bits.WEL) break;
-					memset(m_flash, 0xFF, sizeof(m_flash));
+					memset(m_pFlash, 0xFF, W25X20CL_TOTAL_SIZE);
+					MarkDirty(0, W25X20CL_TOTAL_SIZE);
 					m_status_register.bits.WEL = 0;
 				} break;
 				case _CMD_SECTOR_ERASE:
@@ -259,7 +275,8 @@ void w25x20cl::OnCSELIn(struct avr_irq_t * irq, uint32_t value)
 					if(!m_status_register.bits.WEL) break;
 					m_address /= W25X20CL_SECTOR_SIZE;
 					m_address *= W25X20CL_SECTOR_SIZE;
-					memset(m_flash + m_address, 0xFF, W25X20CL_SECTOR_SIZE);
+					memset(m_pFlash + m_address, 0xFF, W25X20CL_SECTOR_SIZE);
+					MarkDirty(m_address, W25X20CL_SECTOR_SIZE);
 					m_status_register.bits.WEL = 0;
 				} break;
 				case _CMD_BLOCK32_ERASE:
@@ -267,7 +284,8 @@ void w25x20cl::OnCSELIn(struct avr_irq_t * irq, uint32_t value)
 					if(!m_status_register.bits.WEL) break;
 					m_address /= W25X20CL_BLOCK32_SIZE;
 					m_address *= W25X20CL_BLOCK32_SIZE;
-					memset(m_flash + m_address, 0xFF, W25X20CL_BLOCK32_SIZE);
+					memset(m_pFlash + m_address, 0xFF, W25X20CL_BLOCK32_SIZE);
+					MarkDirty(m_address, W25X20CL_BLOCK32_SIZE);
 					m_status_register.bits.WEL = 0;
 				} break;
 				case _CMD_BLOCK64_ERASE:
@@ -275,7 +293,8 @@ void w25x20cl::OnCSELIn(struct avr_irq_t * irq, uint32_t value)
 					if(!m_status_register.bits.WEL) break;
 					m_address /= W25X20CL_BLOCK64_SIZE;
 					m_address *= W25X20CL_BLOCK64_SIZE;
-					memset(m_flash + m_address, 0xFF, W25X20CL_BLOCK64_SIZE);
+					memset(m_pFlash + m_address, 0xFF, W25X20CL_BLOCK64_SIZE);
+					MarkDirty(m_address, W25X20CL_BLOCK64_SIZE);
 					m_status_register.bits.WEL = 0;
 				} break;
 			}
@@ -312,32 +331,68 @@ void w25x20cl::Load(const char* path)
 		perror(path);
 		exit(1);
 	}
-	uint8_t *buffer = (uint8_t*)malloc(W25X20CL_TOTAL_SIZE + 1);
-	ssize_t r = read(m_fdFlash, buffer, W25X20CL_TOTAL_SIZE + 1);
-	printf("Read %d bytes\n", (int)r);
-	if (r !=  W25X20CL_TOTAL_SIZE + 1) {
+	void *pMap = mmap(NULL, W25X20CL_TOTAL_SIZE + 1, PROT_READ | PROT_WRITE, MAP_SHARED, m_fdFlash, 0);
+	if (pMap == MAP_FAILED) {
 		fprintf(stderr, "unable to load XFLASH\n");
 		perror(path);
 		exit(1);
 	}
+	m_pFlash = static_cast<uint8_t*>(pMap);
 	uint8_t bEmpty = 1;
 	for (int i = 0; i < W25X20CL_TOTAL_SIZE + 1; i++)
 	{
-		bEmpty &= buffer[i] == 0;
+		bEmpty &= m_pFlash[i] == 0;
+	}
+	if (bEmpty) // A newly created file (all null) starts out erased.
+	{
+		memset(m_pFlash, 0xFF, W25X20CL_TOTAL_SIZE + 1);
+		MarkDirty(0, W25X20CL_TOTAL_SIZE);
+	}
+}
+
+void w25x20cl::MarkDirty(uint32_t uiAddr, uint32_t uiLen)
+{
+	for (uint32_t uiSector = uiAddr / W25X20CL_SECTOR_SIZE; uiSector <= (uiAddr + uiLen - 1) / W25X20CL_SECTOR_SIZE; uiSector++)
+		m_uiDirty |= 1ULL << uiSector;
+	if (!m_bFlushArmed && m_pAVR)
+	{
+		m_bFlushArmed = true;
+		RegisterTimerUsec(m_fcnFlush, m_uiFlushUs, this);
 	}
-	if (!bEmpty) // If the file was newly created (all null) this leaves the internal eeprom as full of 0xFFs.
-		memcpy(m_flash, buffer, W25X20CL_TOTAL_SIZE + 1);
+}
 
-	free(buffer);
+avr_cycle_count_t w25x20cl::OnFlushTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	m_bFlushArmed = false;
+	Flush(MS_ASYNC);
+	return 0;
 }
 
-void w25x20cl::Save()
+void w25x20cl::Flush(int iFlags)
 {
-	// Also write out the xflash contents. Note we don't close it so you can save snapshots anytime you like.
-	lseek(m_fdFlash, SEEK_SET, 0);
-	ssize_t r = write(m_fdFlash, m_flash, W25X20CL_TOTAL_SIZE + 1);
-	if (r != W25X20CL_TOTAL_SIZE + 1) {
-		fprintf(stderr, "unable to write xflash memory\n");
-		perror(m_filepath.c_str());
+	if (!m_pFlash)
+		return;
+	static const uint32_t uiPage = sysconf(_SC_PAGESIZE);
+	uint32_t uiSectors = W25X20CL_TOTAL_SIZE / W25X20CL_SECTOR_SIZE;
+	for (uint32_t uiStart = 0; uiStart < uiSectors; uiStart++)
+	{
+		if (!(m_uiDirty & (1ULL << uiStart)))
+			continue;
+		uint32_t uiEnd = uiStart;
+		while (uiEnd < uiSectors && (m_uiDirty & (1ULL << uiEnd)))
+			uiEnd++;
+		// msync wants a page aligned start, which a sector may not be on hosts with big pages.
+		uint32_t uiFrom = ((uiStart * W25X20CL_SECTOR_SIZE) / uiPage) * uiPage;
+		uint32_t uiTo = uiEnd * W25X20CL_SECTOR_SIZE + (uiEnd == uiSectors ? 1 : 0);
+		if (msync(m_pFlash + uiFrom, uiTo - uiFrom, iFlags) < 0)
+			perror(m_filepath.c_str());
+		uiStart = uiEnd;
 	}
+	m_uiDirty = 0;
+}
+
+void w25x20cl::Save()
+{
+	// Note we don't close it so you can save snapshots anytime you like.
+	Flush(MS_SYNC);
 }
@@ -23,9 +23,13 @@
 
 #pragma once
 
-#include <stdint.h>         // for uint8_t, uint32_t, uint64_t
-#include "SPIPeripheral.h"  // for SPIPeripheral
-#include "sim_irq.h"        // for avr_irq_t
+#include <stdint.h>            // for uint8_t, uint32_t, uint64_t
+#include "BasePeripheral.h"    // for MAKE_C_TIMER_CALLBACK
+#include "SPIPeripheral.h"     // for SPIPeripheral
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
 #include <string>
 
 #define W25X20CL_TOTAL_SIZE 262144
@@ -43,16 +47,17 @@ class w25x20cl:public SPIPeripheral
 		_IRQ(SPI_CSEL,          "1<w25x20cl.cs_in")
 		#include "IRQHelper.h"
 
-	// Destructor. Closes flash file.
+	// Destructor. Writes back and closes the flash file.
 	~w25x20cl();
 
 	// Initializes an SPI flash on "avr" with a CSEL irq "irqCS"
 	void Init(struct avr_t * avr, avr_irq_t *irqCS);
 
-	// Loads the flash contents from file. (creates "path" if it does not exit)
+	// Maps the flash contents from file. (creates "path" if it does not exit)
 	void Load(const char* path);
 
-	// Saves the SPI flash contents back out to file. (Does not close it in case you want to save multiple times)
+	// Writes any modified sectors back out to file and waits for them. (Does not close it in case you want to save multiple times)
+	// Modified sectors are also written back in the background every m_uiFlushUs of simulated time.
 	void Save();
 
 	// Needed for telemetryHost because SPI is not scriptable.
@@ -68,8 +73,19 @@ class w25x20cl:public SPIPeripheral
 		uint8_t OnSPIIn(avr_irq_t *irq, uint32_t value) override;
         void OnCSELIn(avr_irq_t *irq, uint32_t value) override;
 
+		// Marks the sectors covering the range as needing a write-back.
+		void MarkDirty(uint32_t uiAddr, uint32_t uiLen);
+		// Starts (MS_ASYNC) or completes (MS_SYNC) writing back the dirty sectors.
+		void Flush(int iFlags);
+
+		avr_cycle_count_t OnFlushTimer(avr_t *avr, avr_cycle_count_t when);
+
 		int m_fdFlash = 0;
-		uint8_t m_flash[W25X20CL_TOTAL_SIZE+1];
+		uint8_t *m_pFlash = nullptr; // The file, mapped. W25X20CL_TOTAL_SIZE+1 bytes for compatibility with old images.
+		uint64_t m_uiDirty = 0; // One bit per sector.
+		bool m_bFlushArmed = false;
+		avr_cycle_timer_t m_fcnFlush = MAKE_C_TIMER_CALLBACK(w25x20cl,OnFlushTimer);
+		static constexpr uint32_t m_uiFlushUs = 1000000;
 		uint8_t m_pageBuffer[W25X20CL_PAGE_SIZE];
 		uint8_t m_cmdIn[5];
 		uint8_t m_rxCnt;
@@ -34,7 +34,11 @@ class Prusa_MK3: public Prusa_MK3S
 		{
 			avr_raise_irq(GetDIRQ(IR_SENSOR_PIN),1);
 			printf("MK3 - adding laser sensor\n");
-			AddHardware(LaserSensor, GetDIRQ(SWI2C_SCL), GetDIRQ(SWI2C_SDA));
+			BasePeripheral::PortPin_t portSCL, portSDA;
+			if (GetPortPin(SWI2C_SCL, portSCL) && GetPortPin(SWI2C_SDA, portSDA))
+				AddHardware(LaserSensor, GetDIRQ(SWI2C_SCL), GetDIRQ(SWI2C_SDA), portSCL, portSDA);
+			else
+				AddHardware(LaserSensor, GetDIRQ(SWI2C_SCL), GetDIRQ(SWI2C_SDA));
 			lIR.ConnectFrom(LaserSensor.GetIRQ(PAT9125::LED_OUT),LED::LED_IN);
 
 			LaserSensor.ConnectFrom(E.GetIRQ(TMC2130::POSITION_OUT), PAT9125::E_IN);
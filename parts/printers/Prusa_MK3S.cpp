@@ -144,11 +144,46 @@ void Prusa_MK3S::SetupHardware()
 
 	avr_register_io_write(m_pAVR, 0xC0, fcnSerial, this);
 
+	if (PrintCapture::IsEnabled())
+	{
+		m_pCapture.reset(new PrintCapture());
+		AddHardware(*m_pCapture, GetInstance() ? "print_" + std::to_string(GetInstance()) : std::string("print"));
+		m_pCapture->ConnectFrom(X.GetIRQ(TMC2130::POSITION_OUT), PrintCapture::X_IN);
+		m_pCapture->ConnectFrom(Y.GetIRQ(TMC2130::POSITION_OUT), PrintCapture::Y_IN);
+		m_pCapture->ConnectFrom(Z.GetIRQ(TMC2130::POSITION_OUT), PrintCapture::Z_IN);
+		m_pCapture->ConnectFrom(E.GetIRQ(TMC2130::POSITION_OUT), PrintCapture::E_IN);
+	}
+
+	if (ToolpathWriter::IsEnabled())
+	{
+		m_pToolpath.reset(new ToolpathWriter());
+		AddHardware(*m_pToolpath, GetInstance() && !ToolpathWriter::GetFile().empty() ? ToolpathWriter::GetFile() + "_" + std::to_string(GetInstance()) : ToolpathWriter::GetFile());
+		m_pToolpath->ConnectFrom(X.GetIRQ(TMC2130::POSITION_OUT), ToolpathWriter::X_IN);
+		m_pToolpath->ConnectFrom(Y.GetIRQ(TMC2130::POSITION_OUT), ToolpathWriter::Y_IN);
+		m_pToolpath->ConnectFrom(Z.GetIRQ(TMC2130::POSITION_OUT), ToolpathWriter::Z_IN);
+		m_pToolpath->ConnectFrom(E.GetIRQ(TMC2130::POSITION_OUT), ToolpathWriter::E_IN);
+	}
+
+	if (LCDMirror::IsEnabled())
+	{
+		m_pLCDMirror.reset(new LCDMirror());
+		AddHardware(*m_pLCDMirror, &lcd, GetInstance() && LCDMirror::GetFile() != "-" ? LCDMirror::GetFile() + "_" + std::to_string(GetInstance()) : LCDMirror::GetFile());
+	}
+
+	if (FarmView::IsEnabled())
+	{
+		m_pFarmSlot.reset(new FarmView::Slot());
+		AddHardware(*m_pFarmSlot, &lcd);
+		m_pFarmSlot->ConnectFrom(X.GetIRQ(TMC2130::POSITION_OUT), FarmView::Slot::X_IN);
+		m_pFarmSlot->ConnectFrom(Y.GetIRQ(TMC2130::POSITION_OUT), FarmView::Slot::Y_IN);
+		m_pFarmSlot->ConnectFrom(Z.GetIRQ(TMC2130::POSITION_OUT), FarmView::Slot::Z_IN);
+		m_pFarmSlot->ConnectFrom(sd_card.GetIRQ(SDCard::CARD_PRESENT), FarmView::Slot::SD_IN);
+	}
 }
 
 void Prusa_MK3S::OnAVRCycle()
 {
-	int mouseBtn = m_mouseBtn;                  // copy atomic to local
+	int mouseBtn = m_chMouse.Poll(m_mouseBtn.exchange(0)); // Recorded, or the replay's instead
 	if (mouseBtn)
 	{
 		switch (mouseBtn){
@@ -167,9 +202,8 @@ void Prusa_MK3S::OnAVRCycle()
 				if (m_pVis) m_pVis->TwistKnob(false);
 				break;
 		}
-		m_mouseBtn = 0;
 	}
-	int key = m_key;                            // copy atomic to local
+	int key = m_chKey.Poll(m_key.exchange(0));
 	if (key)
 	{
 		switch (key) {
@@ -237,7 +271,6 @@ void Prusa_MK3S::OnAVRCycle()
 				Boards::EinsyRambo::SetQuitFlag();
 				break;
 		}
-		m_key = 0;
 	}
 }
 
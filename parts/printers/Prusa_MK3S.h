@@ -30,7 +30,12 @@
 #include "sim_avr.h"        // for avr_t
 #include "sim_avr_types.h"  // for avr_io_addr_t
 #include "IRSensor.h"
+#include "FarmView.h"
+#include "InputLog.h"
+#include "LCDMirror.h"
 #include "MK3SGL.h"
+#include "PrintCapture.h"
+#include "ToolpathWriter.h"
 
 class Prusa_MK3S : public Boards::EinsyRambo, public Printer
 {
@@ -64,10 +69,16 @@ class Prusa_MK3S : public Boards::EinsyRambo, public Printer
 
 		std::unique_ptr<MK3SGL> m_pVis;
 
+		std::unique_ptr<PrintCapture> m_pCapture; // Only with --capture
+		std::unique_ptr<ToolpathWriter> m_pToolpath; // Only with --toolpath
+		std::unique_ptr<LCDMirror> m_pLCDMirror; // Only with --lcd-mirror
+		std::unique_ptr<FarmView::Slot> m_pFarmSlot; // Only with --farm
+
 	private:
 		void FixSerial(avr_t * avr, avr_io_addr_t addr, uint8_t v);
 
 		std::atomic_int m_key = {0}, m_mouseBtn = {0};
+		InputLog::Channel m_chKey {"Key"}, m_chMouse {"Mouse"};
 
 		unsigned int m_iScheme = 0;
 		uint32_t m_colors[8] = {
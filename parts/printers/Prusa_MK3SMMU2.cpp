@@ -21,6 +21,7 @@
 
 #include "Prusa_MK3SMMU2.h"
 #include <stdio.h>                // for printf
+#include <stdlib.h>               // for getenv, atoi
 #include <memory>                 // for unique_ptr
 #include "BasePeripheral.h"       // for MAKE_C_CALLBACK
 #include "IRSensor.h"             // for IRSensor, IRSensor::IRState::IR_AUTO
@@ -37,15 +38,82 @@ Prusa_MK3SMMU2::~Prusa_MK3SMMU2()
 
 void Prusa_MK3SMMU2::SetupHardware()
 {
+	if (!m_pMMU) // First, the MK3's laser sensor is wired to it in SetupIR().
+		m_MMUModel.Init(GetAVR(), '2');
+
 	Prusa_MK3S::SetupHardware();
-	TryConnect(MMU_HWRESET,m_MMU,MMU2::RESET);
+	if (m_pToolpath)
+	{
+		AttachSniffer();
+		m_pToolpath->ConnectFrom(m_sniffer.GetIRQ(GCodeSniffer::CODEVAL_OUT), ToolpathWriter::TOOL_IN);
+	}
+
 	IR.Set(IRSensor::IR_AUTO);
-	avr_irq_register_notify(m_MMU.GetIRQ(MMU2::FEED_DISTANCE), MAKE_C_CALLBACK(Prusa_MK3SMMU2,OnMMUFeed),this);
+	avr_irq_register_notify(GetMMUIRQ(MMU2::FEED_DISTANCE), MAKE_C_CALLBACK(Prusa_MK3SMMU2,OnMMUFeed),this);
+	if (!m_pMMU)
+	{
+		// Same board and thread, nothing to link or keep in step.
+		TryConnect(MMU_HWRESET,m_MMUModel,MMU2Model::RESET);
+		return;
+	}
+	TryConnect(MMU_HWRESET,*m_pMMU,MMU2::RESET);
+	if (GetSameThreadUs()>0)
+		SetColocated(m_pMMU.get(), GetSameThreadUs());
+	// The boards (usually) run on separate threads so the IRQs can't be connected directly;
+	// the link queues bytes between them and respects each UART's xon/xoff.
+	if (UsePipe())
+	{
+		// Going through the PTYs lets you tap the ports for debugging.
+		m_pipe = new SerialPipe(UART2.GetSlaveName(), m_pMMU->GetSerialPort());
+	}
+	else
+	{
+		m_linkEinsy.Init(GetAVR(),'2');
+		m_linkMMU.Init(m_pMMU->GetAVR(),'1');
+		UARTLink::Link(m_linkEinsy, m_linkMMU);
+	}
+	if (m_lockstep.GetQuantumUs()>0 && GetSameThreadUs()>0)
+		printf("The MMU shares the printer's thread, it is already in step without --lockstep.\n");
+	else if (m_lockstep.GetQuantumUs()>0)
+	{
+		printf("Running the MMU in lockstep with the printer (%u us quanta)\n", m_lockstep.GetQuantumUs());
+		if (!UsePipe())
+		{
+			m_linkEinsy.SetLockstep(m_lockstep);
+			m_linkMMU.SetLockstep(m_lockstep);
+		}
+		SetLockstep(&m_lockstep);
+		m_pMMU->SetLockstep(&m_lockstep);
+	}
+}
 
-	// Note we can't directly connect the MMU or you'll get serial flow issues/lost bytes.
-	// The serial_pipe thread lets us reuse the UART_PTY code and its internal xon/xoff/buffers
-	// rather than having to roll our own internal FIFO. As an added bonus you can tap the ports for debugging.
-	m_pipe = new SerialPipe(UART2.GetSlaveName(), m_MMU.GetSerialPort());
+avr_irq_t* Prusa_MK3SMMU2::GetMMUIRQ(unsigned int eIRQ)
+{
+	// MMU2Model repeats MMU2's IRQs first, in the same order.
+	static_assert(static_cast<unsigned int>(MMU2Model::FEED_DISTANCE) == MMU2::FEED_DISTANCE, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::RESET) == MMU2::RESET, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::PULLEY_IN) == MMU2::PULLEY_IN, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::SELECTOR_OUT) == MMU2::SELECTOR_OUT, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::IDLER_OUT) == MMU2::IDLER_OUT, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::LEDS_OUT) == MMU2::LEDS_OUT, "MMU2Model's IRQs must line up with MMU2's");
+	static_assert(static_cast<unsigned int>(MMU2Model::FINDA_OUT) == MMU2::FINDA_OUT, "MMU2Model's IRQs must line up with MMU2's");
+	return m_pMMU ? m_pMMU->GetIRQ(eIRQ) : m_MMUModel.GetIRQ(eIRQ);
+}
+
+bool Prusa_MK3SMMU2::UsePipe()
+{
+	if (MMU2Model::IsEnabled())
+		return false; // No second UART to tap.
+	return (getenv("SIMAVR_UART_TAP") && atoi(getenv("SIMAVR_UART_TAP"))) ||
+			(getenv("SIMAVR_UART_XTERM") && atoi(getenv("SIMAVR_UART_XTERM")));
+}
+
+void Prusa_MK3SMMU2::AttachSniffer()
+{
+	if (m_bSniffer)
+		return;
+	AddHardware(m_sniffer,'2');
+	m_bSniffer = true;
 }
 
 void Prusa_MK3SMMU2::OnVisualTypeSet(string type)
@@ -55,13 +123,13 @@ void Prusa_MK3SMMU2::OnVisualTypeSet(string type)
 	Prusa_MK3S::OnVisualTypeSet(type);
 	// Wire up the additional MMU stuff.
 
-	AddHardware(m_sniffer,'2');
+	AttachSniffer();
 	m_pVis->ConnectFrom(m_sniffer.GetIRQ(GCodeSniffer::CODEVAL_OUT),MK3SGL::TOOL_IN);
-	m_pVis->ConnectFrom(m_MMU.GetIRQ(MMU2::SELECTOR_OUT), MK3SGL::SEL_IN);
-	m_pVis->ConnectFrom(m_MMU.GetIRQ(MMU2::IDLER_OUT), MK3SGL::IDL_IN);
-	m_pVis->ConnectFrom(m_MMU.GetIRQ(MMU2::LEDS_OUT),MK3SGL::MMU_LEDS_IN);
-	m_pVis->ConnectFrom(m_MMU.GetIRQ(MMU2::FINDA_OUT),MK3SGL::FINDA_IN);
-	m_pVis->ConnectFrom(m_MMU.GetIRQ(MMU2::FEED_DISTANCE), MK3SGL::FEED_IN);
+	m_pVis->ConnectFrom(GetMMUIRQ(MMU2::SELECTOR_OUT), MK3SGL::SEL_IN);
+	m_pVis->ConnectFrom(GetMMUIRQ(MMU2::IDLER_OUT), MK3SGL::IDL_IN);
+	m_pVis->ConnectFrom(GetMMUIRQ(MMU2::LEDS_OUT),MK3SGL::MMU_LEDS_IN);
+	m_pVis->ConnectFrom(GetMMUIRQ(MMU2::FINDA_OUT),MK3SGL::FINDA_IN);
+	m_pVis->ConnectFrom(GetMMUIRQ(MMU2::FEED_DISTANCE), MK3SGL::FEED_IN);
 }
 
 std::pair<int,int> Prusa_MK3SMMU2::GetWindowSize()
@@ -75,7 +143,10 @@ void Prusa_MK3SMMU2::Draw()
 {
 	glPushMatrix();
 		Prusa_MK3S::Draw();
-		m_MMU.Draw((float)GetWindowSize().second);
+		if (m_pMMU)
+			m_pMMU->Draw((float)GetWindowSize().second);
+		else
+			m_MMUModel.Draw((float)GetWindowSize().second);
 	glPopMatrix();
 }
 
@@ -93,21 +164,35 @@ void Prusa_MK3SMMU2::OnKeyPress(unsigned char key, int x, int y)
 		case 'F':
 		{
 			printf("FINDA toggled (in manual control)\n");
-			m_MMU.SetFINDAAuto(false);
-			m_MMU.ToggleFINDA();
+			if (m_pMMU)
+			{
+				m_pMMU->SetFINDAAuto(false);
+				m_pMMU->ToggleFINDA();
+			}
+			else
+			{
+				m_MMUModel.SetFINDAAuto(false);
+				m_MMUModel.ToggleFINDA();
+			}
 		}
 		break;
 		case 'a':
 		{
 			printf("FINDA in Auto control\n");
-			m_MMU.SetFINDAAuto(true);
+			if (m_pMMU)
+				m_pMMU->SetFINDAAuto(true);
+			else
+				m_MMUModel.SetFINDAAuto(true);
 			FSensorResumeAuto(); // Also restore IR auto handling.
 			break;
 		}
 		case '3':
 		case '4':
 		case '5':
-			m_MMU.PushButton(key - '2'); // button numbers are 1/2/3
+			if (m_pMMU)
+				m_pMMU->PushButton(key - '2'); // button numbers are 1/2/3
+			else
+				printf("The MMU model has no buttons, it never needs them.\n");
 			break;
 		default:
 			Prusa_MK3S::OnKeyPress(key,x,y);
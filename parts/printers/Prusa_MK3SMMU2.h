@@ -21,12 +21,16 @@
 #pragma once
 
 #include <stdint.h>        // for uint32_t
+#include <memory>          // for unique_ptr
 #include <string>          // for string
 #include <utility>         // for pair
 #include "GCodeSniffer.h"  // for GCodeSniffer
 #include "IRSensor.h"      // for IRSensor, IRSensor::IRState::IR_AUTO
+#include "Lockstep.h"      // for Lockstep
 #include "MMU2.h"          // for MMU2
+#include "MMU2Model.h"     // for MMU2Model
 #include "Prusa_MK3S.h"    // for Prusa_MK3S
+#include "UARTLink.h"      // for UARTLink
 #include "sim_irq.h"       // for avr_irq_t
 class SerialPipe;
 
@@ -35,9 +39,18 @@ class Prusa_MK3SMMU2 : public Prusa_MK3S
 {
 
 	public:
-		Prusa_MK3SMMU2():Prusa_MK3S(){};
+		Prusa_MK3SMMU2():Prusa_MK3S()
+		{
+			m_bUART2Pty = UsePipe();
+			if (!MMU2Model::IsEnabled())
+				m_pMMU.reset(new MMU2(UsePipe()));
+		};
 		~Prusa_MK3SMMU2();
 
+		// Runs the MMU board on the printer's AVR thread in slices of this many us (0: its own thread).
+		// Set from the command line before the printers are created.
+		static void SetSameThreadUs(uint32_t uiUs) { GetSameThreadUs() = uiUs; }
+
 		void Draw() override;
 		void OnVisualTypeSet(string type) override;
 
@@ -45,6 +58,8 @@ class Prusa_MK3SMMU2 : public Prusa_MK3S
 
 		std::pair<int,int> GetWindowSize() override;
 
+		Boards::Board* GetMMUBoard() override { return m_pMMU.get(); }
+
 		void OnKeyPress(unsigned char key, int x, int y) override;
 
 	protected:
@@ -54,11 +69,23 @@ class Prusa_MK3SMMU2 : public Prusa_MK3S
 
 		void OnMMUFeed(avr_irq_t *irq, uint32_t value);// Helper for MMU IR sensor triggering.
 
-		MMU2 m_MMU;
-		GCodeSniffer m_sniffer = GCodeSniffer('T');
+		// One or the other, see MMU2Model::SetEnabled.
+		std::unique_ptr<MMU2> m_pMMU;
+		MMU2Model m_MMUModel;
+		// The MMU's IRQ, from whichever of the two there is.
+		avr_irq_t* GetMMUIRQ(unsigned int eIRQ);
+		GCodeSniffer m_sniffer {'T'};
+		// The tool changes, for the visuals and/or the toolpath; attached once for either.
+		void AttachSniffer();
+		bool m_bSniffer = false;
 		SerialPipe *m_pipe = nullptr;
+		UARTLink m_linkEinsy, m_linkMMU;
+		Lockstep m_lockstep;
 
 	private:
+		// The PTYs and pipe are only used when asked for taps to debug the MMU traffic,
+		// otherwise the two UARTs are linked directly.
+		static bool UsePipe();
 
-
+		static uint32_t& GetSameThreadUs() { static uint32_t uiUs = 0; return uiUs; }
 };
@@ -29,13 +29,7 @@ namespace Wirings
 		public:
 			Einsy_1_0a():Wiring(m_EinsyPins)
 			{
-				m_mPins = GetPinMap();
-			};
-
-		protected:
-			virtual std::map<Pin,MCUPin> GetPinMap() override
-			{
-				return {
+				static constexpr PinDef_t pins[] = {
 					{BEEPER,84},
 					{BTN_EN1,72},
 					{BTN_EN2,14},
@@ -85,7 +79,9 @@ namespace Wirings
 					{Z_TMC2130_CS,67},
 					{Z_TMC2130_DIAG,68}
 				};
+				LoadPins(pins);
 			};
+
 		private:
 			const PinSpec_2560 m_EinsyPins = PinSpec_2560();
 	};
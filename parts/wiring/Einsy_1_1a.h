@@ -28,25 +28,22 @@ namespace Wirings
 		public:
 			Einsy_1_1a():Einsy_1_0a()
 			{
-				m_mPins = GetPinMap();
-			};
-
-		protected:
-			std::map<Pin, MCUPin> GetPinMap() override {
-				auto baseMap = Einsy_1_0a::GetPinMap();
-				baseMap[IR_SENSOR_PIN] = 62;
-				baseMap.erase(KILL_PIN);
-				baseMap[LCD_BL_PIN] = 5;
-				baseMap[MMU_HWRESET] = 76;
-				baseMap[TACH_0] = 79;
-				baseMap[TACH_1] = 80;
-				baseMap[TEMP_PINDA_PIN] = 3;
-				baseMap[UVLO_PIN] = 2;
-				baseMap[VOLT_BED_PIN] = 9;
-				baseMap[VOLT_IR_PIN] = 8;
-				baseMap[VOLT_PWR_PIN] = 4;
-				baseMap[W25X20CL_PIN_CS] = 32;
-				return baseMap;
+				// Differences from the 1.0a.
+				static constexpr PinDef_t pins[] = {
+					{IR_SENSOR_PIN,62},
+					{KILL_PIN,-1},
+					{LCD_BL_PIN,5},
+					{MMU_HWRESET,76},
+					{TACH_0,79},
+					{TACH_1,80},
+					{TEMP_PINDA_PIN,3},
+					{UVLO_PIN,2},
+					{VOLT_BED_PIN,9},
+					{VOLT_IR_PIN,8},
+					{VOLT_PWR_PIN,4},
+					{W25X20CL_PIN_CS,32},
+				};
+				LoadPins(pins);
 			};
 	};
 };
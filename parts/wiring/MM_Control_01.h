@@ -30,13 +30,7 @@ namespace Wirings
 		public:
 			MM_Control_01():Wiring(m_pSpec)
 			{
-				 m_mPins = GetPinMap();
-			};
-
-		protected:
-			virtual std::map<Pin,MCUPin> GetPinMap() override
-			{
-				return {
+				static constexpr PinDef_t pins[] = {
 					{BTN_ARRAY,2},
 					{FINDA_PIN,19},
 					{I_STEP_PIN,12},
@@ -52,6 +46,7 @@ namespace Wirings
 					{SHIFT_DATA,9},
 					{SHIFT_LATCH,10},
 				};
+				LoadPins(pins);
 			};
 
 		private:
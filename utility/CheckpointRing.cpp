@@ -0,0 +1,175 @@
+/*
+	CheckpointRing.cpp - A bounded, delta-compressed history of Snapshots, for
+	rewinding a running simulation.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CheckpointRing.h"
+#include <stdio.h>    // for fprintf, stderr
+#include <algorithm>  // for find_if
+
+// Encoded values start with a tag:
+//   0: a plain copy follows (no keyframe value of the same size to compare against)
+//   1: XOR against the keyframe as runs of [u16 unchanged][u16 changed][changed bytes]
+static constexpr uint8_t TAG_RAW = 0, TAG_XOR = 1;
+static constexpr size_t MAX_RUN = 0xFFFF;
+
+static inline void PutU16(std::vector<uint8_t> &vOut, size_t uiVal)
+{
+	vOut.push_back(uiVal & 0xFFU);
+	vOut.push_back(uiVal >> 8U);
+}
+
+void CheckpointRing::Encode(const std::vector<uint8_t> &vIn, const std::vector<uint8_t> *pKey, std::vector<uint8_t> &vOut)
+{
+	vOut.clear();
+	if (!pKey || pKey->size() != vIn.size())
+	{
+		vOut.push_back(TAG_RAW);
+		vOut.insert(vOut.end(), vIn.begin(), vIn.end());
+		return;
+	}
+	vOut.push_back(TAG_XOR);
+	const std::vector<uint8_t> &vKey = *pKey;
+	size_t i = 0, uiSize = vIn.size();
+	while (i < uiSize)
+	{
+		size_t uiSame = 0;
+		while (i + uiSame < uiSize && uiSame < MAX_RUN && vIn[i + uiSame] == vKey[i + uiSame])
+			uiSame++;
+		i += uiSame;
+		size_t uiDiff = 0;
+		while (i + uiDiff < uiSize && uiDiff < MAX_RUN && vIn[i + uiDiff] != vKey[i + uiDiff])
+			uiDiff++;
+		PutU16(vOut, uiSame);
+		PutU16(vOut, uiDiff);
+		for (size_t j = i; j < i + uiDiff; j++)
+			vOut.push_back(vIn[j] ^ vKey[j]);
+		i += uiDiff;
+	}
+}
+
+bool CheckpointRing::Decode(const std::vector<uint8_t> &vIn, const std::vector<uint8_t> *pKey, std::vector<uint8_t> &vOut)
+{
+	if (vIn.empty())
+		return false;
+	if (vIn[0] == TAG_RAW)
+	{
+		vOut.assign(vIn.begin() + 1, vIn.end());
+		return true;
+	}
+	if (!pKey)
+		return false;
+	vOut = *pKey;
+	size_t uiPos = 1, uiOut = 0;
+	while (uiPos + 4 <= vIn.size())
+	{
+		size_t uiSame = vIn[uiPos] | (vIn[uiPos+1] << 8U);
+		size_t uiDiff = vIn[uiPos+2] | (vIn[uiPos+3] << 8U);
+		uiPos += 4;
+		uiOut += uiSame;
+		if (uiOut + uiDiff > vOut.size() || uiPos + uiDiff > vIn.size())
+			return false;
+		for (size_t j = 0; j < uiDiff; j++)
+			vOut[uiOut + j] ^= vIn[uiPos + j];
+		uiOut += uiDiff;
+		uiPos += uiDiff;
+	}
+	return uiPos == vIn.size();
+}
+
+void CheckpointRing::Add(avr_cycle_count_t uiCycle, const Snapshot &snap)
+{
+	DropAfter(uiCycle); // Time only runs forwards in here.
+	Entry_t entry {uiCycle, m_dEntries.empty() || m_uiSinceKey + 1 >= m_uiKeyEvery, {}, 0};
+	const Entry_t *pKey = nullptr;
+	if (!entry.bKey)
+	{
+		for (auto it = m_dEntries.rbegin(); it != m_dEntries.rend() && !pKey; it++)
+			if (it->bKey)
+				pKey = &*it;
+	}
+	for (auto &it : snap.GetData())
+	{
+		std::vector<uint8_t> &vOut = entry.mData[it.first];
+		if (entry.bKey)
+			vOut = it.second;
+		else
+		{
+			auto itKey = pKey->mData.find(it.first);
+			Encode(it.second, itKey == pKey->mData.end() ? nullptr : &itKey->second, vOut);
+		}
+		entry.uiBytes += vOut.size();
+	}
+	m_uiSinceKey = entry.bKey ? 0 : m_uiSinceKey + 1;
+	m_uiBytes += entry.uiBytes;
+	m_dEntries.push_back(std::move(entry));
+
+	while (m_dEntries.size() > m_uiKeep)
+	{
+		// The keyframe goes with everything that depends on it, but never the last one.
+		auto itNextKey = std::find_if(m_dEntries.begin() + 1, m_dEntries.end(), [](const Entry_t &e) { return e.bKey; });
+		if (itNextKey == m_dEntries.end())
+			break;
+		for (auto it = m_dEntries.begin(); it != itNextKey; it++)
+			m_uiBytes -= it->uiBytes;
+		m_dEntries.erase(m_dEntries.begin(), itNextKey);
+	}
+}
+
+bool CheckpointRing::Find(avr_cycle_count_t uiCycle, Snapshot &snap, avr_cycle_count_t &uiFound) const
+{
+	auto it = m_dEntries.rbegin();
+	while (it != m_dEntries.rend() && it->uiCycle > uiCycle)
+		it++;
+	if (it == m_dEntries.rend())
+		return false;
+	const Entry_t &entry = *it;
+	const Entry_t *pKey = &entry;
+	for (; !pKey->bKey; pKey = &*(++it));
+	for (auto &val : entry.mData)
+	{
+		if (entry.bKey)
+		{
+			snap.At(val.first) = val.second;
+			continue;
+		}
+		auto itKey = pKey->mData.find(val.first);
+		if (!Decode(val.second, itKey == pKey->mData.end() ? nullptr : &itKey->second, snap.At(val.first)))
+		{
+			fprintf(stderr, "CheckpointRing: %s didn't decode, checkpoint is corrupt.\n", val.first.c_str());
+			return false;
+		}
+	}
+	uiFound = entry.uiCycle;
+	return true;
+}
+
+void CheckpointRing::DropAfter(avr_cycle_count_t uiCycle)
+{
+	while (!m_dEntries.empty() && m_dEntries.back().uiCycle > uiCycle)
+	{
+		m_uiBytes -= m_dEntries.back().uiBytes;
+		m_dEntries.pop_back();
+	}
+	// Count back to the keyframe the next one would be relative to.
+	m_uiSinceKey = 0;
+	for (auto it = m_dEntries.rbegin(); it != m_dEntries.rend() && !it->bKey; it++)
+		m_uiSinceKey++;
+}
@@ -0,0 +1,74 @@
+/*
+	CheckpointRing.h - A bounded, delta-compressed history of Snapshots, for
+	rewinding a running simulation.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>         // for size_t
+#include <stdint.h>         // for uint8_t
+#include <deque>            // for deque
+#include <map>              // for map
+#include <string>           // for string
+#include <vector>           // for vector
+#include "Snapshot.h"       // for Snapshot
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+
+// Every m_uiKeyEvery'th checkpoint is stored whole, the ones in between as the XOR against it,
+// run-length coded. Most of a snapshot (flash, idle peripherals, the bulk of SRAM) doesn't
+// change between checkpoints, so those come to a few bytes a key.
+// The oldest keyframe goes (with its deltas) once there are more than uiKeep checkpoints.
+class CheckpointRing
+{
+	public:
+		explicit CheckpointRing(size_t uiKeep, unsigned int uiKeyEvery = 16):m_uiKeep(uiKeep),m_uiKeyEvery(uiKeyEvery){};
+
+		void Add(avr_cycle_count_t uiCycle, const Snapshot &snap);
+
+		// Decodes the latest checkpoint at or before uiCycle into snap. False if there is none.
+		bool Find(avr_cycle_count_t uiCycle, Snapshot &snap, avr_cycle_count_t &uiFound) const;
+
+		// Forgets everything after uiCycle, e.g. after rewinding there.
+		void DropAfter(avr_cycle_count_t uiCycle);
+
+		inline bool IsEmpty() const { return m_dEntries.empty(); }
+		inline size_t GetCount() const { return m_dEntries.size(); }
+		inline avr_cycle_count_t GetFirst() const { return m_dEntries.front().uiCycle; }
+		inline avr_cycle_count_t GetLast() const { return m_dEntries.back().uiCycle; }
+		inline size_t GetBytes() const { return m_uiBytes; }
+
+	private:
+		typedef struct Entry_t
+		{
+			avr_cycle_count_t uiCycle;
+			bool bKey;
+			std::map<std::string, std::vector<uint8_t>> mData; // Raw for keyframes, encoded otherwise.
+			size_t uiBytes;
+		} Entry_t;
+
+		static void Encode(const std::vector<uint8_t> &vIn, const std::vector<uint8_t> *pKey, std::vector<uint8_t> &vOut);
+		static bool Decode(const std::vector<uint8_t> &vIn, const std::vector<uint8_t> *pKey, std::vector<uint8_t> &vOut);
+
+		size_t m_uiKeep;
+		unsigned int m_uiKeyEvery;
+		unsigned int m_uiSinceKey = 0;
+		std::deque<Entry_t> m_dEntries;
+		size_t m_uiBytes = 0;
+};
@@ -0,0 +1,845 @@
+/*
+	Cluster.cpp - Runs a list of scripted jobs across MK404 workers on other machines.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Cluster.h"
+#include <dirent.h>      // for opendir, readdir, closedir, dirent
+#include <errno.h>       // for errno, EINTR, EEXIST
+#include <fcntl.h>       // for open, O_CREAT, O_TRUNC, O_WRONLY
+#include <limits.h>      // for PATH_MAX
+#include <netdb.h>       // for addrinfo, getaddrinfo, freeaddrinfo, gai_strerror
+#include <poll.h>        // for poll, pollfd, POLLIN
+#include <stdint.h>      // for uint64_t, uint8_t
+#include <stdio.h>       // for printf, fprintf, perror, fopen, fread, fwrite, snprintf
+#include <stdlib.h>      // for realpath
+#include <sys/socket.h>  // for socket, bind, listen, accept, connect, send, recv
+#include <sys/stat.h>    // for mkdir, stat, S_ISDIR, S_ISREG
+#include <sys/wait.h>    // for waitpid, WIFEXITED, WEXITSTATUS, WTERMSIG
+#include <unistd.h>      // for fork, execv, chdir, close, dup2, gethostname, readlink, rmdir, sysconf, unlink, sleep
+#include <algorithm>     // for fill, min
+#include <fstream>       // for ifstream
+#include <sstream>       // for istringstream
+#include <utility>       // for move
+#if defined(__APPLE__)
+#include <mach-o/dyld.h> // for _NSGetExecutablePath
+#endif
+
+std::vector<Cluster::Job_t> Cluster::m_vJobs;
+std::map<std::string, std::string> Cluster::m_mInputs;
+std::map<int, Cluster::Worker_t> Cluster::m_mWorkers;
+std::map<pid_t, Cluster::Run_t> Cluster::m_mRuns;
+std::deque<std::string> Cluster::m_dLines;
+volatile sig_atomic_t Cluster::m_bStop = 0;
+
+// A job is given up on once this many workers have dropped out while running it.
+static constexpr unsigned int uiMaxAttempts = 3;
+
+void Cluster::OnSignal(int)
+{
+	m_bStop = 1;
+}
+
+// FNV-1a, as the result cache, so the same bytes are the same input wherever they came from.
+static bool HashFile(const std::string &strPath, std::string &strHash)
+{
+	FILE *fIn = fopen(strPath.c_str(), "rb");
+	if (!fIn)
+		return false;
+	uint64_t uiHash = 0xcbf29ce484222325ULL;
+	uint8_t uiBuf[65536];
+	size_t uiRead;
+	while ((uiRead = fread(uiBuf, 1, sizeof(uiBuf), fIn)) > 0)
+		for (size_t i=0; i<uiRead; i++)
+			uiHash = (uiHash ^ uiBuf[i]) * 0x100000001b3ULL;
+	fclose(fIn);
+	char szHash[17];
+	snprintf(szHash, sizeof(szHash), "%016llx", static_cast<unsigned long long>(uiHash));
+	strHash = szHash;
+	return true;
+}
+
+static bool SendAll(int fd, const void *pData, size_t uiLen)
+{
+	const char *p = static_cast<const char*>(pData);
+	while (uiLen)
+	{
+		ssize_t iSent = send(fd, p, uiLen, 0);
+		if (iSent < 0 && errno == EINTR)
+			continue;
+		if (iSent <= 0)
+			return false;
+		p += iSent;
+		uiLen -= iSent;
+	}
+	return true;
+}
+
+static bool SendLine(int fd, const std::string &strLine)
+{
+	std::string strOut = strLine + "\n";
+	return SendAll(fd, strOut.data(), strOut.size());
+}
+
+// "<strHead> <size>", then the file's bytes.
+static bool SendFile(int fd, const std::string &strHead, const std::string &strPath)
+{
+	FILE *fIn = fopen(strPath.c_str(), "rb");
+	struct stat st;
+	if (!fIn || fstat(fileno(fIn), &st) < 0)
+	{
+		perror(strPath.c_str());
+		if (fIn)
+			fclose(fIn);
+		return true; // Nothing sent, the connection is still fine.
+	}
+	bool bOK = SendLine(fd, strHead + " " + std::to_string(st.st_size));
+	char szBuf[65536];
+	off_t uiLeft = st.st_size;
+	while (bOK && uiLeft > 0)
+	{
+		size_t uiRead = fread(szBuf, 1, uiLeft < static_cast<off_t>(sizeof(szBuf)) ? uiLeft : sizeof(szBuf), fIn);
+		if (uiRead == 0) // Shrunk under us, pad it out rather than lose the stream.
+		{
+			std::fill(szBuf, szBuf + sizeof(szBuf), 0);
+			uiRead = uiLeft < static_cast<off_t>(sizeof(szBuf)) ? uiLeft : sizeof(szBuf);
+		}
+		bOK = SendAll(fd, szBuf, uiRead);
+		uiLeft -= uiRead;
+	}
+	fclose(fIn);
+	return bOK;
+}
+
+// Messages are short lines, a byte at a time keeps whatever follows in the socket for ReadTo().
+// The worker's way; the coordinator can't block on one worker, it buffers them in OnInput().
+static bool ReadLine(int fd, std::string &strLine)
+{
+	strLine.clear();
+	char chr = 0;
+	while (strLine.size() < 65536)
+	{
+		ssize_t iRead = recv(fd, &chr, 1, 0);
+		if (iRead < 0 && errno == EINTR)
+			continue;
+		if (iRead <= 0)
+			return false;
+		if (chr == '\n')
+			return true;
+		strLine.push_back(chr);
+	}
+	return false;
+}
+
+// Reads uiSize bytes into strPath (made or replaced), or discards them if it's empty or can't be written.
+// False only if the connection failed.
+static bool ReadTo(int fd, unsigned long long uiSize, const std::string &strPath)
+{
+	FILE *fOut = strPath.empty() ? nullptr : fopen(strPath.c_str(), "wb");
+	if (!fOut && !strPath.empty())
+		perror(strPath.c_str());
+	char szBuf[65536];
+	while (uiSize)
+	{
+		ssize_t iRead = recv(fd, szBuf, uiSize < sizeof(szBuf) ? uiSize : sizeof(szBuf), 0);
+		if (iRead < 0 && errno == EINTR)
+			continue;
+		if (iRead <= 0)
+		{
+			if (fOut)
+				fclose(fOut);
+			return false;
+		}
+		if (fOut && fwrite(szBuf, 1, iRead, fOut) != static_cast<size_t>(iRead))
+		{
+			perror(strPath.c_str());
+			fclose(fOut);
+			fOut = nullptr;
+		}
+		uiSize -= iRead;
+	}
+	if (fOut)
+		fclose(fOut);
+	return true;
+}
+
+// mkdir -p
+static bool MakeDirs(const std::string &strPath)
+{
+	for (size_t uiSlash = strPath.find('/', 1); ; uiSlash = strPath.find('/', uiSlash + 1))
+	{
+		std::string strPart = strPath.substr(0, uiSlash);
+		if (!strPart.empty() && mkdir(strPart.c_str(), 0755) < 0 && errno != EEXIST)
+		{
+			perror(strPart.c_str());
+			return false;
+		}
+		if (uiSlash == std::string::npos)
+			return true;
+	}
+}
+
+static bool CopyFile(const std::string &strFrom, const std::string &strTo)
+{
+	FILE *fIn = fopen(strFrom.c_str(), "rb"), *fOut = fopen(strTo.c_str(), "wb");
+	bool bOK = fIn && fOut;
+	char szBuf[65536];
+	size_t uiRead;
+	while (bOK && (uiRead = fread(szBuf, 1, sizeof(szBuf), fIn)) > 0)
+		bOK = fwrite(szBuf, 1, uiRead, fOut) == uiRead;
+	if (!bOK)
+		perror(strTo.c_str());
+	if (fIn)
+		fclose(fIn);
+	if (fOut && fclose(fOut) != 0)
+		bOK = false;
+	return bOK;
+}
+
+// Every regular file under strDir, as paths relative to it. With bRemove, removes the tree instead.
+static void WalkTree(const std::string &strDir, const std::string &strRel, std::vector<std::string> &vOut, bool bRemove = false)
+{
+	DIR *pDir = opendir(strDir.c_str());
+	if (!pDir)
+		return;
+	while (dirent *pEnt = readdir(pDir))
+	{
+		std::string strName = pEnt->d_name;
+		if (strName == "." || strName == "..")
+			continue;
+		std::string strPath = strDir + "/" + strName;
+		struct stat st;
+		if (lstat(strPath.c_str(), &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			WalkTree(strPath, strRel + strName + "/", vOut, bRemove);
+		else if (bRemove)
+			unlink(strPath.c_str());
+		else if (S_ISREG(st.st_mode))
+			vOut.push_back(strRel + strName);
+	}
+	closedir(pDir);
+	if (bRemove)
+		rmdir(strDir.c_str());
+}
+
+static void RemoveTree(const std::string &strDir)
+{
+	std::vector<std::string> vNone;
+	WalkTree(strDir, "", vNone, true);
+}
+
+// Nothing that could climb out of the directory it is meant for.
+static bool IsSafePath(const std::string &strPath)
+{
+	if (strPath.empty() || strPath[0] == '/')
+		return false;
+	std::istringstream pathIn(strPath);
+	std::string strPart;
+	while (getline(pathIn, strPart, '/'))
+		if (strPart.empty() || strPart == "." || strPart == "..")
+			return false;
+	return true;
+}
+
+// Splits [host:]port, as the metrics exporter does.
+static bool Resolve(const std::string &strAddr, bool bListen, addrinfo *&pInfo)
+{
+	std::string strHost, strPort = strAddr;
+	size_t uiColon = strAddr.rfind(':');
+	if (uiColon != std::string::npos)
+	{
+		strHost = strAddr.substr(0, uiColon);
+		strPort = strAddr.substr(uiColon + 1);
+	}
+	addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = bListen && strHost.empty() ? AI_PASSIVE : 0;
+	int iErr = getaddrinfo(strHost.empty() ? (bListen ? nullptr : "localhost") : strHost.c_str(), strPort.c_str(), &hints, &pInfo);
+	if (iErr != 0)
+		fprintf(stderr, "Cluster: Can't resolve %s: %s\n", strAddr.c_str(), gai_strerror(iErr));
+	return iErr == 0;
+}
+
+static void CatchSignals(void (*fcnHandler)(int))
+{
+	struct sigaction sa {};
+	sa.sa_handler = fcnHandler; // No SA_RESTART, so poll() returns for it.
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	signal(SIGPIPE, SIG_IGN); // A peer that went away is noticed by the failed send.
+}
+
+bool Cluster::LoadJobs(const std::string &strJobs)
+{
+	std::ifstream jobsIn(strJobs);
+	if (!jobsIn.good())
+	{
+		perror(strJobs.c_str());
+		return false;
+	}
+	std::set<std::string> sNames;
+	std::string strLine;
+	unsigned int uiLine = 0;
+	while (getline(jobsIn, strLine))
+	{
+		uiLine++;
+		std::istringstream lineIn(strLine);
+		Job_t job;
+		if (!(lineIn >> job.strName) || job.strName[0] == '#')
+			continue;
+		if (!IsSafePath(job.strName) || job.strName.find('/') != std::string::npos || !sNames.insert(job.strName).second)
+		{
+			fprintf(stderr, "Cluster: %s:%u: the job name %s is a path or is used twice\n", strJobs.c_str(), uiLine, job.strName.c_str());
+			return false;
+		}
+		std::set<std::string> sFiles;
+		std::string strArg;
+		while (lineIn >> strArg)
+		{
+			if (strArg.size() > 1 && strArg[0] == '@')
+			{
+				std::string strPath = strArg.substr(1), strHash;
+				struct stat st;
+				if (stat(strPath.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || !HashFile(strPath, strHash))
+				{
+					fprintf(stderr, "Cluster: %s:%u: can't read %s (inputs must be files)\n", strJobs.c_str(), uiLine, strPath.c_str());
+					return false;
+				}
+				std::string strFile = strPath.substr(strPath.rfind('/') + 1);
+				if (!sFiles.insert(strFile).second)
+				{
+					fprintf(stderr, "Cluster: %s:%u: two inputs are named %s\n", strJobs.c_str(), uiLine, strFile.c_str());
+					return false;
+				}
+				m_mInputs[strHash] = strPath;
+				strArg = "@" + strHash + "/" + strFile;
+			}
+			job.vArgs.push_back(std::move(strArg));
+		}
+		m_vJobs.push_back(std::move(job));
+	}
+	return true;
+}
+
+int Cluster::Coordinate(const std::string &strAddr, const std::string &strJobs, const std::string &strResults)
+{
+	if (!LoadJobs(strJobs))
+		return 1;
+	if (m_vJobs.empty())
+	{
+		printf("Cluster: No jobs in %s\n", strJobs.c_str());
+		return 0;
+	}
+	if (!MakeDirs(strResults))
+		return 1;
+	addrinfo *pInfo = nullptr;
+	if (!Resolve(strAddr, true, pInfo))
+		return 1;
+	int fdListen = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+	int iOn = 1;
+	if (fdListen >= 0)
+		setsockopt(fdListen, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+	bool bOK = fdListen >= 0 && bind(fdListen, pInfo->ai_addr, pInfo->ai_addrlen) == 0 && listen(fdListen, 64) == 0;
+	freeaddrinfo(pInfo);
+	if (!bOK)
+	{
+		perror(strAddr.c_str());
+		return 1;
+	}
+	CatchSignals(OnSignal);
+	printf("Cluster: %zu job(s) and %zu input(s), waiting for workers on %s\n", m_vJobs.size(), m_mInputs.size(), strAddr.c_str());
+	fflush(stdout);
+
+	size_t uiDone = 0;
+	while (!m_bStop && uiDone < m_vJobs.size())
+	{
+		std::vector<pollfd> vPoll {{fdListen, POLLIN, 0}};
+		for (auto &it : m_mWorkers)
+			vPoll.push_back({it.first, POLLIN, 0});
+		if (poll(vPoll.data(), vPoll.size(), 1000) > 0)
+		{
+			if (vPoll[0].revents & POLLIN)
+			{
+				int fdWorker = accept(fdListen, nullptr, nullptr);
+				if (fdWorker >= 0)
+					m_mWorkers[fdWorker] = Worker_t(); // No slots until it says HELLO.
+			}
+			for (size_t i=1; i<vPoll.size(); i++)
+			{
+				if (vPoll[i].revents == 0)
+					continue;
+				std::string strLine;
+				if (!ReadLine(vPoll[i].fd, strLine) || !OnMessage(vPoll[i].fd, strLine, strResults))
+					DropWorker(vPoll[i].fd);
+			}
+		}
+		Dispatch();
+		uiDone = 0;
+		for (auto &job : m_vJobs)
+			uiDone += job.bDone;
+	}
+	while (!m_mWorkers.empty())
+	{
+		SendLine(m_mWorkers.begin()->first, "QUIT");
+		CloseWorker(m_mWorkers.begin()->first);
+	}
+	close(fdListen);
+
+	unsigned int uiFailed = 0;
+	for (auto &job : m_vJobs)
+		if (!job.bDone || job.iExit != 0)
+		{
+			if (job.bDone)
+				fprintf(stderr, "Cluster: %s FAILED, exit code %d\n", job.strName.c_str(), job.iExit);
+			else
+				fprintf(stderr, "Cluster: %s did not run\n", job.strName.c_str());
+			uiFailed++;
+		}
+	printf("Cluster: %zu of %zu job(s) passed, results are in %s\n", m_vJobs.size() - uiFailed, m_vJobs.size(), strResults.c_str());
+	return uiFailed ? 1 : 0;
+}
+
+bool Cluster::OnInput(int fd, const std::string &strResults)
+{
+	char szBuf[65536];
+	ssize_t iRead = recv(fd, szBuf, sizeof(szBuf), 0);
+	if (iRead < 0 && errno == EINTR)
+		return true;
+	if (iRead <= 0)
+		return false;
+	Worker_t &worker = m_mWorkers.at(fd);
+	worker.strIn.append(szBuf, iRead);
+	size_t uiUsed = 0;
+	while (uiUsed < worker.strIn.size())
+	{
+		if (worker.uiFileLeft)
+		{
+			size_t uiLen = std::min<unsigned long long>(worker.uiFileLeft, worker.strIn.size() - uiUsed);
+			if (worker.fFile && fwrite(worker.strIn.data() + uiUsed, 1, uiLen, worker.fFile) != uiLen)
+			{
+				perror("Cluster: FILE");
+				fclose(worker.fFile);
+				worker.fFile = nullptr;
+			}
+			uiUsed += uiLen;
+			worker.uiFileLeft -= uiLen;
+			if (!worker.uiFileLeft && worker.fFile)
+			{
+				fclose(worker.fFile);
+				worker.fFile = nullptr;
+			}
+			continue;
+		}
+		size_t uiEnd = worker.strIn.find('\n', uiUsed);
+		if (uiEnd == std::string::npos)
+			break;
+		std::string strLine = worker.strIn.substr(uiUsed, uiEnd - uiUsed);
+		uiUsed = uiEnd + 1;
+		if (!OnMessage(fd, strLine, strResults))
+			return false;
+	}
+	worker.strIn.erase(0, uiUsed);
+	return worker.strIn.size() < 65536; // No line is that long.
+}
+
+bool Cluster::OnMessage(int fd, const std::string &strLine, const std::string &strResults)
+{
+	Worker_t &worker = m_mWorkers.at(fd);
+	std::istringstream lineIn(strLine);
+	std::string strVerb;
+	lineIn >> strVerb;
+	if (strVerb == "HELLO")
+	{
+		lineIn >> worker.uiSlots >> worker.strHost;
+		printf("Cluster: Worker %s joined with %u slot(s)\n", worker.strHost.c_str(), worker.uiSlots);
+		return true;
+	}
+	if (strVerb == "GET")
+	{
+		std::string strHash;
+		lineIn >> strHash;
+		auto itInput = m_mInputs.find(strHash);
+		if (itInput == m_mInputs.end())
+			return SendLine(fd, "ERR " + strHash);
+		return SendFile(fd, "BLOB " + strHash, itInput->second);
+	}
+	size_t uiJob = m_vJobs.size();
+	if (strVerb == "FILE")
+	{
+		std::string strPath;
+		unsigned long long uiSize = 0;
+		if (!(lineIn >> uiJob >> strPath >> uiSize))
+			return false; // Can't know how much follows.
+		bool bOurs = uiJob < m_vJobs.size() && m_vJobs[uiJob].fdWorker == fd && IsSafePath(strPath);
+		std::string strOut;
+		if (bOurs)
+		{
+			strOut = strResults + "/" + m_vJobs[uiJob].strName + "/" + strPath;
+			if (!MakeDirs(strOut.substr(0, strOut.rfind('/'))))
+				strOut.clear();
+		}
+		// Made or replaced now, OnInput() writes the bytes as they arrive.
+		FILE *fOut = strOut.empty() ? nullptr : fopen(strOut.c_str(), "wb");
+		if (!fOut && !strOut.empty())
+			perror(strOut.c_str());
+		if (fOut && uiSize == 0)
+			fclose(fOut);
+		else
+			worker.fFile = fOut;
+		worker.uiFileLeft = uiSize;
+		return true;
+	}
+	if (strVerb == "DONE")
+	{
+		int iExit = 0;
+		lineIn >> uiJob >> iExit;
+		if (uiJob >= m_vJobs.size() || m_vJobs[uiJob].fdWorker != fd)
+			return true; // Stale, it was given to another worker.
+		Job_t &job = m_vJobs[uiJob];
+		job.bDone = true;
+		job.iExit = iExit;
+		job.fdWorker = -1;
+		worker.sJobs.erase(uiJob);
+		printf("Cluster: %s finished on %s with exit code %d\n", job.strName.c_str(), worker.strHost.c_str(), iExit);
+		fflush(stdout);
+		return true;
+	}
+	fprintf(stderr, "Cluster: Unexpected message from %s: %s\n", worker.strHost.c_str(), strLine.c_str());
+	return false;
+}
+
+void Cluster::Dispatch()
+{
+	size_t uiNext = 0;
+	for (auto &it : m_mWorkers)
+	{
+		Worker_t &worker = it.second;
+		while (worker.sJobs.size() < worker.uiSlots)
+		{
+			while (uiNext < m_vJobs.size() && (m_vJobs[uiNext].bDone || m_vJobs[uiNext].fdWorker >= 0))
+				uiNext++;
+			if (uiNext == m_vJobs.size())
+				return;
+			Job_t &job = m_vJobs[uiNext];
+			std::string strLine = "JOB " + std::to_string(uiNext) + " " + job.strName;
+			for (auto &strArg : job.vArgs)
+				strLine += " " + strArg;
+			job.fdWorker = it.first;
+			job.uiAttempts++;
+			worker.sJobs.insert(uiNext);
+			if (!SendLine(it.first, strLine))
+				break; // Its jobs are handed back when the poll sees it has gone.
+			printf("Cluster: %s started on %s\n", job.strName.c_str(), worker.strHost.c_str());
+		}
+	}
+}
+
+void Cluster::DropWorker(int fd)
+{
+	Worker_t &worker = m_mWorkers.at(fd);
+	printf("Cluster: Worker %s left with %zu job(s) running\n", worker.strHost.empty() ? "(no HELLO)" : worker.strHost.c_str(), worker.sJobs.size());
+	for (auto uiJob : worker.sJobs)
+	{
+		Job_t &job = m_vJobs[uiJob];
+		job.fdWorker = -1;
+		if (job.uiAttempts >= uiMaxAttempts)
+		{
+			fprintf(stderr, "Cluster: Giving up on %s, %u workers dropped out while running it\n", job.strName.c_str(), job.uiAttempts);
+			job.bDone = true;
+			job.iExit = 1;
+		}
+	}
+	CloseWorker(fd);
+}
+
+void Cluster::CloseWorker(int fd)
+{
+	Worker_t &worker = m_mWorkers.at(fd);
+	if (worker.fFile) // Cut short, like a job that didn't finish.
+		fclose(worker.fFile);
+	close(fd);
+	m_mWorkers.erase(fd);
+}
+
+// Jobs run this same binary, wherever it was started from.
+static bool GetExePath(std::string &strExe)
+{
+	char szPath[PATH_MAX] = {};
+#if defined(__APPLE__)
+	char szFound[PATH_MAX] = {};
+	uint32_t uiSize = sizeof(szFound);
+	if (_NSGetExecutablePath(szFound, &uiSize) != 0 || !realpath(szFound, szPath))
+	{
+		perror("Cluster: Can't find the MK404 executable");
+		return false;
+	}
+	strExe = szPath;
+#else
+	ssize_t iLen = readlink("/proc/self/exe", szPath, sizeof(szPath) - 1);
+	if (iLen <= 0)
+	{
+		perror("/proc/self/exe");
+		return false;
+	}
+	strExe.assign(szPath, iLen);
+#endif
+	return true;
+}
+
+int Cluster::Work(const std::string &strAddr, const std::string &strDir, unsigned int uiSlots)
+{
+	char szPath[PATH_MAX] = {};
+	if (!MakeDirs(strDir + "/inputs") || !MakeDirs(strDir + "/jobs") || !MakeDirs(strDir + "/results") || !realpath(strDir.c_str(), szPath))
+		return 1;
+	std::string strRoot = szPath, strExe;
+	if (!GetExePath(strExe))
+		return 1;
+	if (uiSlots == 0)
+	{
+		long lCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+		uiSlots = lCPUs > 0 ? lCPUs : 1;
+	}
+	char szHost[256] = {};
+	gethostname(szHost, sizeof(szHost) - 1);
+	CatchSignals(OnSignal);
+
+	bool bWaiting = false;
+	while (!m_bStop)
+	{
+		addrinfo *pInfo = nullptr;
+		if (!Resolve(strAddr, false, pInfo))
+			return 1;
+		int fd = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+		bool bConnected = fd >= 0 && connect(fd, pInfo->ai_addr, pInfo->ai_addrlen) == 0;
+		freeaddrinfo(pInfo);
+		if (!bConnected)
+		{
+			if (fd >= 0)
+				close(fd);
+			if (!bWaiting)
+				printf("Cluster: Waiting for the coordinator at %s...\n", strAddr.c_str());
+			bWaiting = true;
+			sleep(5);
+			continue;
+		}
+		bWaiting = false;
+		printf("Cluster: Connected to %s, running up to %u job(s) at a time\n", strAddr.c_str(), uiSlots);
+		fflush(stdout);
+		bool bQuit = false, bOK = SendLine(fd, "HELLO " + std::to_string(uiSlots) + " " + (szHost[0] ? szHost : "unknown"));
+		while (bOK && !bQuit && !m_bStop)
+		{
+			int iStatus = 0;
+			pid_t pid;
+			while (bOK && (pid = waitpid(-1, &iStatus, WNOHANG)) > 0)
+				bOK = FinishJob(fd, pid, WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : 128 + WTERMSIG(iStatus));
+			std::string strLine;
+			if (m_dLines.empty())
+			{
+				pollfd pfd {fd, POLLIN, 0};
+				if (!bOK || poll(&pfd, 1, 100) <= 0)
+					continue;
+				bOK = ReadLine(fd, strLine);
+			}
+			else
+			{
+				strLine = m_dLines.front();
+				m_dLines.pop_front();
+			}
+			if (!bOK)
+				break;
+			if (strLine == "QUIT")
+				bQuit = true;
+			else if (strLine.compare(0, 4, "JOB ") == 0)
+				bOK = StartJob(fd, strLine, strRoot, strExe);
+			else
+				fprintf(stderr, "Cluster: Unexpected message from the coordinator: %s\n", strLine.c_str());
+		}
+		close(fd);
+		m_dLines.clear();
+		if (!m_mRuns.empty())
+		{
+			// Nowhere to send their results, and the coordinator hands the jobs out again.
+			printf("Cluster: Lost the coordinator, stopping %zu job(s)\n", m_mRuns.size());
+			for (auto &it : m_mRuns)
+				kill(it.first, SIGTERM);
+			for (auto &it : m_mRuns)
+			{
+				waitpid(it.first, nullptr, 0);
+				RemoveTree(it.second.strDir);
+			}
+			m_mRuns.clear();
+		}
+		if (bQuit)
+		{
+			printf("Cluster: The coordinator is done\n");
+			return 0;
+		}
+	}
+	return 0;
+}
+
+bool Cluster::FetchInput(int fd, const std::string &strHash, const std::string &strDir)
+{
+	std::string strPath = strDir + "/inputs/" + strHash;
+	struct stat st;
+	if (stat(strPath.c_str(), &st) == 0)
+		return true;
+	if (!SendLine(fd, "GET " + strHash))
+		return false;
+	std::string strLine;
+	while (ReadLine(fd, strLine))
+	{
+		std::istringstream lineIn(strLine);
+		std::string strVerb, strGot;
+		unsigned long long uiSize = 0;
+		lineIn >> strVerb >> strGot >> uiSize;
+		if (strGot != strHash || (strVerb != "BLOB" && strVerb != "ERR"))
+		{
+			m_dLines.push_back(strLine); // Another JOB, most likely.
+			continue;
+		}
+		if (strVerb == "ERR")
+		{
+			fprintf(stderr, "Cluster: The coordinator has no input %s\n", strHash.c_str());
+			return true;
+		}
+		// Into place only once it is all there and checks out, another job may be about to use it.
+		std::string strTemp = strPath + ".part";
+		if (!ReadTo(fd, uiSize, strTemp))
+			return false;
+		std::string strCheck;
+		if (!HashFile(strTemp, strCheck) || strCheck != strHash || rename(strTemp.c_str(), strPath.c_str()) < 0)
+		{
+			fprintf(stderr, "Cluster: Input %s didn't arrive intact\n", strHash.c_str());
+			unlink(strTemp.c_str());
+		}
+		return true;
+	}
+	return false;
+}
+
+static void RedirectTo(const std::string &strFile, int fdTarget)
+{
+	int fd = open(strFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	dup2(fd, fdTarget);
+	close(fd);
+}
+
+bool Cluster::StartJob(int fd, const std::string &strLine, const std::string &strDir, const std::string &strExe)
+{
+	std::istringstream lineIn(strLine);
+	std::string strVerb, strName, strArg;
+	Run_t run {};
+	lineIn >> strVerb >> run.uiJob >> strName;
+	std::string strDone = "DONE " + std::to_string(run.uiJob) + " ";
+	if (!IsSafePath(strName) || strName.find('/') != std::string::npos)
+		return SendLine(fd, strDone + "1"); // Before anything is removed under that name.
+	run.strDir = strDir + "/jobs/" + std::to_string(run.uiJob) + "_" + strName;
+	RemoveTree(run.strDir); // From an earlier coordinator.
+	if (!MakeDirs(run.strDir))
+		return SendLine(fd, strDone + "1");
+
+	std::vector<std::string> vArgs {strExe};
+	bool bHeadless = false, bCache = false;
+	while (lineIn >> strArg)
+	{
+		if (strArg.size() > 1 && strArg[0] == '@')
+		{
+			size_t uiSlash = strArg.find('/');
+			std::string strHash = strArg.substr(1, uiSlash - 1), strFile = uiSlash == std::string::npos ? "" : strArg.substr(uiSlash + 1);
+			if (!IsSafePath(strFile) || strFile.find('/') != std::string::npos)
+				return SendLine(fd, strDone + "1");
+			if (!FetchInput(fd, strHash, strDir))
+				return false;
+			if (!CopyFile(strDir + "/inputs/" + strHash, run.strDir + "/" + strFile))
+			{
+				RemoveTree(run.strDir);
+				return SendLine(fd, strDone + "1");
+			}
+			run.sInputs.insert(strFile);
+			strArg = strFile;
+		}
+		bHeadless |= strArg == "--headless";
+		bCache |= strArg.compare(0, 14, "--result-cache") == 0;
+		vArgs.push_back(strArg);
+	}
+	if (!bHeadless)
+		vArgs.push_back("--headless");
+	if (!bCache)
+	{
+		vArgs.push_back("--result-cache");
+		vArgs.push_back(strDir + "/results");
+	}
+
+	fflush(nullptr); // Or the child will write out our buffered output again.
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fd);
+		signal(SIGPIPE, SIG_DFL); // Ignored stays ignored across exec.
+		if (chdir(run.strDir.c_str()) < 0)
+			_exit(127);
+		RedirectTo("MK404.out", STDOUT_FILENO);
+		RedirectTo("MK404.err", STDERR_FILENO);
+		std::vector<char*> vArgv;
+		for (auto &str : vArgs)
+			vArgv.push_back(&str[0]);
+		vArgv.push_back(nullptr);
+		execv(strExe.c_str(), vArgv.data());
+		perror(strExe.c_str());
+		_exit(127);
+	}
+	if (pid < 0)
+	{
+		perror("Cluster: fork");
+		RemoveTree(run.strDir);
+		return SendLine(fd, strDone + "1");
+	}
+	printf("Cluster: Running %s\n", strName.c_str());
+	fflush(stdout);
+	m_mRuns[pid] = std::move(run);
+	return true;
+}
+
+bool Cluster::FinishJob(int fd, pid_t pid, int iExit)
+{
+	auto itRun = m_mRuns.find(pid);
+	if (itRun == m_mRuns.end())
+		return true;
+	Run_t run = std::move(itRun->second);
+	m_mRuns.erase(itRun);
+	std::vector<std::string> vFiles;
+	WalkTree(run.strDir, "", vFiles);
+	bool bOK = true;
+	for (auto &strFile : vFiles)
+		if (bOK && !run.sInputs.count(strFile) && strFile.find(' ') == std::string::npos)
+			bOK = SendFile(fd, "FILE " + std::to_string(run.uiJob) + " " + strFile, run.strDir + "/" + strFile);
+	printf("Cluster: Job %zu exited with %d\n", run.uiJob, iExit);
+	fflush(stdout);
+	RemoveTree(run.strDir);
+	return bOK && SendLine(fd, "DONE " + std::to_string(run.uiJob) + " " + std::to_string(iExit));
+}
@@ -0,0 +1,112 @@
+/*
+	Cluster.h - Runs a list of scripted jobs across MK404 workers on other machines.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <signal.h>     // for sig_atomic_t
+#include <stdio.h>      // for FILE
+#include <sys/types.h>  // for pid_t
+#include <deque>        // for deque
+#include <map>          // for map
+#include <set>          // for set
+#include <string>       // for string
+#include <vector>       // for vector
+
+// One text line per message each way over TCP (names and paths without spaces); a line that
+// announces a <size> is followed by exactly that many bytes:
+//   worker -> HELLO <slots> <host>        on connecting, how many jobs it runs at once
+//   coord  -> JOB <id> <name> <args>...   a job, its @<hash>/<file> arguments are input files
+//   worker -> GET <hash>                  an input it doesn't have yet
+//   coord  -> BLOB <hash> <size>          its content, or ERR <hash> if there is no such input
+//   worker -> FILE <id> <path> <size>     a file the job left behind, relative to its directory
+//   worker -> DONE <id> <code>            the job has finished, code as MK404's, or 128+signal
+//   coord  -> QUIT                        there's nothing more to do
+// Inputs are content addressed (FNV-1a of the bytes, as in the result cache), so each worker
+// fetches a firmware or SD image once for however many jobs use it, and keeps it for next time.
+// A job runs as a fresh MK404 process in a directory of its own, with its inputs copied in under
+// their own names, --headless and with the worker's --result-cache, so repeats are replayed for
+// free. Its MK404.out/.err, traces and whatever else it wrote are sent back to <results>/<name>/
+// as soon as it is done. Jobs on a worker that drops out are handed to another.
+class Cluster
+{
+	public:
+		// Reads the jobs, one "<name> <MK404 args>..." per line (# comments), where an @<path>
+		// argument is an input file, and hands them to the workers connecting on [host:]port.
+		// Returns 0 once all have run and exited 0, 1 if any didn't.
+		static int Coordinate(const std::string &strAddr, const std::string &strJobs, const std::string &strResults);
+
+		// Connects to the coordinator at host:port, retrying until it is up, and runs up to
+		// uiSlots (0 is one per CPU) of its jobs at a time under strDir until it says QUIT.
+		static int Work(const std::string &strAddr, const std::string &strDir, unsigned int uiSlots);
+
+	private:
+		typedef struct Job_t
+		{
+			std::string strName;
+			std::vector<std::string> vArgs; // Inputs already as @<hash>/<file>
+			int fdWorker = -1; // Running on, or -1
+			unsigned int uiAttempts = 0;
+			bool bDone = false;
+			int iExit = 0;
+		} Job_t;
+
+		typedef struct Worker_t
+		{
+			std::string strHost;
+			unsigned int uiSlots = 0;
+			std::set<size_t> sJobs; // Running there
+			std::string strIn; // Read, but not a whole line yet
+			FILE *fFile = nullptr; // Where the rest of a FILE goes, or nullptr to discard it
+			unsigned long long uiFileLeft = 0;
+		} Worker_t;
+
+		typedef struct Run_t
+		{
+			size_t uiJob; // The coordinator's id
+			std::string strDir;
+			std::set<std::string> sInputs; // Copied in, not sent back
+		} Run_t;
+
+		// Coordinator side.
+		static bool LoadJobs(const std::string &strJobs);
+		// Reads what the worker has sent and handles the whole lines. False if it has to be dropped.
+		static bool OnInput(int fd, const std::string &strResults);
+		// False if the worker has to be dropped.
+		static bool OnMessage(int fd, const std::string &strLine, const std::string &strResults);
+		static void Dispatch();
+		static void DropWorker(int fd);
+		static void CloseWorker(int fd);
+
+		// Worker side.
+		// False if the connection failed, a job that can't be started is reported as DONE with an error.
+		static bool StartJob(int fd, const std::string &strLine, const std::string &strDir, const std::string &strExe);
+		static bool FetchInput(int fd, const std::string &strHash, const std::string &strDir);
+		static bool FinishJob(int fd, pid_t pid, int iExit);
+
+		static void OnSignal(int iSig);
+
+		static std::vector<Job_t> m_vJobs;
+		static std::map<std::string, std::string> m_mInputs; // Hash to path, on the coordinator
+		static std::map<int, Worker_t> m_mWorkers;
+		static std::map<pid_t, Run_t> m_mRuns; // On the worker
+		static std::deque<std::string> m_dLines; // Read by the worker while fetching an input, to handle after
+		static volatile sig_atomic_t m_bStop;
+};
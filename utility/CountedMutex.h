@@ -0,0 +1,116 @@
+/*
+	CountedMutex.h - A mutex that keeps count of the times it had to wait, for the watchdog.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>   // for uint64_t
+#include <stdio.h>    // for FILE, fprintf
+#include <algorithm>  // for find
+#include <atomic>     // for atomic
+#include <chrono>     // for steady_clock, nanoseconds
+#include <mutex>      // for mutex, lock_guard
+#include <vector>     // for vector
+
+// A drop-in for std::mutex (lock_guard, unique_lock) on the locks the AVR thread shares with
+// the GL and I/O threads. An uncontended lock() is one try_lock, as before; only a wait is
+// counted and timed. Watchdog prints them all when the simulation stalls, and a lock that is
+// held right then, with its wait time climbing, is the likely culprit.
+class CountedMutex
+{
+	public:
+		explicit CountedMutex(const char *szName):m_szName(szName)
+		{
+			std::lock_guard<std::mutex> lock(RegistryLock());
+			Registry().push_back(this);
+		}
+
+		~CountedMutex()
+		{
+			std::lock_guard<std::mutex> lock(RegistryLock());
+			auto &vAll = Registry();
+			vAll.erase(std::find(vAll.begin(), vAll.end(), this));
+		}
+
+		CountedMutex(const CountedMutex&) = delete;
+		CountedMutex& operator=(const CountedMutex&) = delete;
+
+		inline void lock()
+		{
+			if (!m_lock.try_lock())
+			{
+				m_uiWaiting.fetch_add(1, std::memory_order_relaxed);
+				auto tpStart = std::chrono::steady_clock::now();
+				m_lock.lock();
+				uint64_t uiNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tpStart).count();
+				m_uiWaiting.fetch_sub(1, std::memory_order_relaxed);
+				m_uiContended.fetch_add(1, std::memory_order_relaxed);
+				m_uiWaitNs.fetch_add(uiNs, std::memory_order_relaxed);
+				if (uiNs > m_uiMaxWaitNs.load(std::memory_order_relaxed))
+					m_uiMaxWaitNs.store(uiNs, std::memory_order_relaxed);
+			}
+			m_uiLocks.fetch_add(1, std::memory_order_relaxed);
+			m_bHeld.store(true, std::memory_order_relaxed);
+		}
+
+		inline bool try_lock()
+		{
+			if (!m_lock.try_lock())
+				return false;
+			m_uiLocks.fetch_add(1, std::memory_order_relaxed);
+			m_bHeld.store(true, std::memory_order_relaxed);
+			return true;
+		}
+
+		inline void unlock()
+		{
+			m_bHeld.store(false, std::memory_order_relaxed);
+			m_lock.unlock();
+		}
+
+		// One line per lock: locks taken, how many of those waited and for how long, and
+		// whether it is held (with threads queued on it) right now. From any thread.
+		static void PrintAll(FILE *pOut)
+		{
+			std::lock_guard<std::mutex> lock(RegistryLock());
+			fprintf(pOut, "Lock contention:\n");
+			for (auto p : Registry())
+			{
+				uint64_t uiContended = p->m_uiContended.load(std::memory_order_relaxed);
+				fprintf(pOut, "\t%-24s %12llu locks %10llu waited %10.3f ms total %8.3f ms max%s%s\n", p->m_szName,
+					static_cast<unsigned long long>(p->m_uiLocks.load(std::memory_order_relaxed)),
+					static_cast<unsigned long long>(uiContended),
+					p->m_uiWaitNs.load(std::memory_order_relaxed)/1e6,
+					p->m_uiMaxWaitNs.load(std::memory_order_relaxed)/1e6,
+					p->m_bHeld.load(std::memory_order_relaxed) ? "  HELD" : "",
+					p->m_uiWaiting.load(std::memory_order_relaxed) ? ", threads waiting" : "");
+			}
+		}
+
+	private:
+		static std::mutex& RegistryLock() { static std::mutex lock; return lock; }
+		static std::vector<CountedMutex*>& Registry() { static std::vector<CountedMutex*> vAll; return vAll; }
+
+		std::mutex m_lock;
+		const char *m_szName;
+		std::atomic<uint64_t> m_uiLocks {0}, m_uiContended {0}, m_uiWaitNs {0}, m_uiMaxWaitNs {0};
+		std::atomic<uint32_t> m_uiWaiting {0};
+		std::atomic<bool> m_bHeld {false};
+};
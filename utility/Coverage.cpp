@@ -0,0 +1,208 @@
+/*
+	Coverage.cpp - Which flash words the firmware has executed, merged across runs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Coverage.h"
+#include <fcntl.h>      // for open, O_CREAT, O_RDWR
+#include <stdio.h>      // for printf, fprintf, fopen, fclose, perror
+#include <sys/file.h>   // for flock, LOCK_EX, LOCK_UN
+#include <unistd.h>     // for pread, pwrite, ftruncate, close
+#include <algorithm>    // for sort, unique
+#include <cstring>      // for memcmp, memcpy
+#include <map>          // for map
+#include <utility>      // for pair
+
+thread_local Coverage* Coverage::m_pCurrent = nullptr;
+
+static constexpr char COV_MAGIC[8] = {'M','K','4','0','4','C','O','V'};
+static constexpr size_t COV_HEADER = sizeof(COV_MAGIC) + sizeof(uint32_t); // Magic, flash words
+
+void Coverage::Init(avr_t *avr)
+{
+	m_pAVR = avr;
+	uint32_t uiWords = 64;
+	while (uiWords < (avr->flashend + 1U)>>1U)
+		uiWords <<= 1U;
+	m_uiMask = uiWords - 1;
+	m_vBits.assign(uiWords/64, 0);
+	m_fcnRun = avr->run;
+	avr->run = OnRun;
+}
+
+void Coverage::OnRun(avr_t *avr)
+{
+	Coverage *p = m_pCurrent;
+	if (avr->state == cpu_Running) // Asleep or stopped, run() doesn't execute the instruction at pc.
+	{
+		uint32_t uiWord = (avr->pc>>1U) & p->m_uiMask; // A stray PC aliases harmlessly, the core reports the crash.
+		p->m_vBits[uiWord>>6U] |= 1ULL << (uiWord & 63U);
+	}
+	p->m_fcnRun(avr);
+}
+
+void Coverage::AddSymbols(const std::string &strELF)
+{
+	std::vector<ELFSymbols::Symbol_t> vSyms;
+	if (!ELFSymbols::Read(strELF, vSyms))
+		return;
+	for (auto &sym : vSyms)
+		if (sym.bFunc && sym.uiSize && sym.uiAddr < ELFSymbols::m_uiDataOffset)
+			m_vFuncs.push_back(sym);
+	std::sort(m_vFuncs.begin(), m_vFuncs.end(), [](const ELFSymbols::Symbol_t &a, const ELFSymbols::Symbol_t &b) { return a.uiAddr < b.uiAddr; });
+	m_vFuncs.erase(std::unique(m_vFuncs.begin(), m_vFuncs.end(), [](const ELFSymbols::Symbol_t &a, const ELFSymbols::Symbol_t &b) { return a.uiAddr == b.uiAddr; }), m_vFuncs.end());
+	size_t uiLines = m_vLines.size();
+	if (!ELFSymbols::ReadLines(strELF, m_vLines))
+		printf("Coverage: %s has no DWARF line info, reporting by function only.\n", strELF.c_str());
+	printf("Coverage: read %zu functions and %zu line ranges from %s\n", m_vFuncs.size(), m_vLines.size() - uiLines, strELF.c_str());
+}
+
+bool Coverage::IsTwoWord(uint32_t uiWord) const
+{
+	if (2U*uiWord + 1U > m_pAVR->flashend)
+		return false;
+	uint16_t uiOp = m_pAVR->flash[2U*uiWord] | (m_pAVR->flash[2U*uiWord + 1U] << 8U);
+	return (uiOp & 0xFE0EU) == 0x940CU || (uiOp & 0xFE0EU) == 0x940EU // JMP, CALL
+		|| (uiOp & 0xFE0FU) == 0x9000U || (uiOp & 0xFE0FU) == 0x9200U; // LDS, STS
+}
+
+void Coverage::Report(const std::string &strFile, const std::string &strTitle)
+{
+	if (!m_pAVR)
+		return;
+	uint32_t uiWords = m_uiMask + 1U;
+	std::vector<uint8_t> vMap(uiWords/8U), vOld(uiWords/8U, 0);
+	for (size_t i=0; i<vMap.size(); i++)
+		vMap[i] = (m_vBits[i/8U] >> (8U*(i%8U))) & 0xFFU;
+
+	// Merge with what earlier runs left, under a lock for any running alongside.
+	std::string strCov = strFile + ".cov";
+	int fd = open(strCov.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror(strCov.c_str());
+		return;
+	}
+	flock(fd, LOCK_EX);
+	uint8_t uiHeader[COV_HEADER] = {0};
+	ssize_t iRead = pread(fd, uiHeader, COV_HEADER, 0);
+	uint32_t uiFileWords = uiHeader[8] | (uiHeader[9]<<8U) | (uiHeader[10]<<16U) | (static_cast<uint32_t>(uiHeader[11])<<24U);
+	if (iRead == COV_HEADER && memcmp(uiHeader, COV_MAGIC, 8) == 0 && uiFileWords == uiWords)
+	{
+		if (pread(fd, vOld.data(), vOld.size(), COV_HEADER) != static_cast<ssize_t>(vOld.size()))
+			fprintf(stderr, "Coverage: %s is truncated, merging what there is.\n", strCov.c_str());
+	}
+	else if (iRead > 0)
+		fprintf(stderr, "Coverage: %s is not a coverage map of this MCU, replacing it.\n", strCov.c_str());
+	uint64_t uiRun = 0, uiNew = 0, uiAll = 0;
+	for (size_t i=0; i<vMap.size(); i++)
+	{
+		uiRun += __builtin_popcount(vMap[i]);
+		uiNew += __builtin_popcount(vMap[i] & ~vOld[i]);
+		vMap[i] |= vOld[i];
+		uiAll += __builtin_popcount(vMap[i]);
+	}
+	memcpy(uiHeader, COV_MAGIC, 8);
+	for (unsigned int i=0; i<4; i++)
+		uiHeader[8+i] = (uiWords >> (8U*i)) & 0xFFU;
+	if (pwrite(fd, uiHeader, COV_HEADER, 0) != COV_HEADER || pwrite(fd, vMap.data(), vMap.size(), COV_HEADER) != static_cast<ssize_t>(vMap.size())
+		|| ftruncate(fd, COV_HEADER + vMap.size()) != 0)
+		perror(strCov.c_str());
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	// The reports are of everything so far.
+	for (size_t i=0; i<vMap.size(); i++)
+		m_vBits[i/8U] |= static_cast<uint64_t>(vMap[i]) << (8U*(i%8U));
+
+	FILE *fOut = fopen((strFile + ".txt").c_str(), "w");
+	if (!fOut)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	// Count instructions rather than words, the second word of a CALL/JMP/LDS/STS is never "run".
+	auto fcnCount = [this](uint32_t uiStart, uint32_t uiEnd, uint64_t &uiHit, uint64_t &uiTotal)
+	{
+		for (uint32_t uiWord = uiStart>>1U; uiWord < (uiEnd + 1U)>>1U && uiWord <= m_uiMask; uiWord += IsTwoWord(uiWord) ? 2 : 1)
+		{
+			uiTotal++;
+			uiHit += IsHit(uiWord);
+		}
+	};
+	uint64_t uiHit = 0, uiTotal = 0;
+	unsigned int uiEntered = 0;
+	std::vector<std::pair<uint64_t, uint64_t>> vFuncCounts;
+	for (auto &func : m_vFuncs)
+	{
+		uint64_t uiFuncHit = 0, uiFuncTotal = 0;
+		fcnCount(func.uiAddr, func.uiAddr + func.uiSize, uiFuncHit, uiFuncTotal);
+		vFuncCounts.push_back({uiFuncHit, uiFuncTotal});
+		uiHit += uiFuncHit;
+		uiTotal += uiFuncTotal;
+		uiEntered += uiFuncHit > 0;
+	}
+	if (m_vFuncs.empty()) // No symbols, all of the code then.
+		fcnCount(0, m_pAVR->codeend ? m_pAVR->codeend : m_pAVR->flashend + 1U, uiHit, uiTotal);
+	fprintf(fOut, "Coverage of %s: %llu of %llu instructions run (%.2f%%).\n", strTitle.c_str(),
+		static_cast<unsigned long long>(uiHit), static_cast<unsigned long long>(uiTotal), uiTotal ? (100.0*uiHit)/uiTotal : 0.0);
+	if (!m_vFuncs.empty())
+	{
+		fprintf(fOut, "%u of %zu functions entered.\n\n", uiEntered, m_vFuncs.size());
+		fprintf(fOut, "%8s %8s %8s  %-8s %s\n", "Run", "Total", "%", "Address", "Function");
+	}
+	for (size_t i=0; i<m_vFuncs.size(); i++)
+		fprintf(fOut, "%8llu %8llu %7.2f%%  0x%05x  %s\n", static_cast<unsigned long long>(vFuncCounts[i].first), static_cast<unsigned long long>(vFuncCounts[i].second),
+			vFuncCounts[i].second ? (100.0*vFuncCounts[i].first)/vFuncCounts[i].second : 0.0, m_vFuncs[i].uiAddr, m_vFuncs[i].strName.c_str());
+	fclose(fOut);
+
+	if (!m_vLines.empty())
+	{
+		// A line is run if any of its instructions were, its ranges may be spread over the file.
+		std::map<std::string, std::map<uint32_t, bool>> mFiles;
+		for (auto &line : m_vLines)
+		{
+			uint64_t uiLineHit = 0, uiLineTotal = 0;
+			fcnCount(line.uiStart, line.uiEnd, uiLineHit, uiLineTotal);
+			bool &bHit = mFiles[line.strFile][line.uiLine];
+			bHit = bHit || uiLineHit > 0;
+		}
+		fOut = fopen((strFile + ".info").c_str(), "w");
+		if (!fOut)
+		{
+			perror(strFile.c_str());
+			return;
+		}
+		fprintf(fOut, "TN:%s\n", strTitle.c_str());
+		for (auto &file : mFiles)
+		{
+			unsigned int uiLinesHit = 0;
+			fprintf(fOut, "SF:%s\n", file.first.c_str());
+			for (auto &line : file.second)
+			{
+				fprintf(fOut, "DA:%u,%u\n", line.first, line.second ? 1 : 0);
+				uiLinesHit += line.second;
+			}
+			fprintf(fOut, "LF:%zu\nLH:%u\nend_of_record\n", file.second.size(), uiLinesHit);
+		}
+		fclose(fOut);
+	}
+	printf("Coverage of %s: %llu words run, %llu new, %llu in all, in %s.cov/.txt%s\n", strTitle.c_str(), static_cast<unsigned long long>(uiRun),
+		static_cast<unsigned long long>(uiNew), static_cast<unsigned long long>(uiAll), strFile.c_str(), m_vLines.empty() ? "" : "/.info");
+}
@@ -0,0 +1,75 @@
+/*
+	Coverage.h - Which flash words the firmware has executed, merged across runs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint64_t, uint32_t
+#include <string>           // for string
+#include <vector>           // for vector
+#include "ELFSymbols.h"     // for ELFSymbols
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_flashaddr_t
+
+// One bit per flash word, set ahead of every instruction from a wrapper around avr->run.
+// On Report() the bits are OR'd into <file>.cov, so coverage adds up over any number of runs
+// (locked, so parallel runs can share the file), and the total is written out as:
+//   <file>.txt   instructions run per function
+//   <file>.info  lcov lines (genhtml, etc.), when the ELF has DWARF line info
+// The .cov layout: "MK404COV", the flash size in words (u32, little endian), then the bitmap,
+// word N being bit N%8 of byte N/8.
+class Coverage
+{
+	public:
+		// Set from the command line before the boards are created.
+		static void SetEnabled(bool bEnabled) { GetEnabled() = bEnabled; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		// Wraps avr->run, so call after anything else that replaces it (e.g. GDBStub).
+		void Init(avr_t *avr);
+
+		// Selects the collector for the AVR running on this thread. Call on the AVR thread before running.
+		static inline void Select(Coverage *pCoverage) { m_pCurrent = pCoverage; }
+
+		// Reads the function symbols and line table from an ELF/AFX file. HEX files have neither.
+		void AddSymbols(const std::string &strELF);
+
+		// Merges into strFile.cov and writes the reports from the merged map.
+		void Report(const std::string &strFile, const std::string &strTitle);
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		static void OnRun(avr_t *avr);
+
+		inline bool IsHit(uint32_t uiWord) const { return (m_vBits[uiWord>>6U] >> (uiWord & 63U)) & 1U; }
+		// Whether the instruction starting at the word takes two (CALL, JMP, LDS, STS).
+		bool IsTwoWord(uint32_t uiWord) const;
+
+		avr_t *m_pAVR = nullptr;
+		void (*m_fcnRun)(avr_t *avr) = nullptr; // The run function we wrapped
+		uint32_t m_uiMask = 0; // Flash words - 1, flash sizes are powers of two.
+		std::vector<uint64_t> m_vBits;
+
+		std::vector<ELFSymbols::Symbol_t> m_vFuncs; // Sorted by address
+		std::vector<ELFSymbols::Line_t> m_vLines;
+
+		static thread_local Coverage *m_pCurrent;
+};
@@ -0,0 +1,178 @@
+/*
+	Deflate.cpp - Minimal dependency-free deflate (RFC 1951) encoder, fixed Huffman codes only.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Deflate.h"
+#include <stdint.h>   // for SIZE_MAX
+#include <algorithm>  // for min
+#include <utility>    // for move
+
+static const uint16_t uiLenBase[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t uiLenExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const uint16_t uiDistBase[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const uint8_t uiDistExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+void Deflate::Bits_t::Put(uint32_t uiVal, uint32_t uiBits)
+{
+	uiAcc |= uiVal << uiCount;
+	uiCount += uiBits;
+	while (uiCount >= 8)
+	{
+		vOut.push_back(uiAcc & 0xFF);
+		uiAcc >>= 8;
+		uiCount -= 8;
+	}
+}
+
+void Deflate::Bits_t::PutReversed(uint32_t uiCode, uint32_t uiBits)
+{
+	uint32_t uiRev = 0;
+	for (uint32_t i=0; i<uiBits; i++)
+		uiRev |= ((uiCode >> i) & 1) << (uiBits - 1 - i);
+	Put(uiRev, uiBits);
+}
+
+void Deflate::Bits_t::Flush()
+{
+	if (uiCount)
+		vOut.push_back(uiAcc & 0xFF);
+	uiAcc = uiCount = 0;
+}
+
+void Deflate::PutLiteral(Bits_t &bits, uint32_t uiLit)
+{
+	if (uiLit < 144)
+		bits.PutReversed(0x30 + uiLit, 8);
+	else if (uiLit < 256)
+		bits.PutReversed(0x190 + uiLit - 144, 9);
+	else if (uiLit < 280)
+		bits.PutReversed(uiLit - 256, 7);
+	else
+		bits.PutReversed(0xC0 + uiLit - 280, 8);
+}
+
+void Deflate::PutMatch(Bits_t &bits, uint32_t uiLen, uint32_t uiDist)
+{
+	int i = 28;
+	while (uiLenBase[i] > uiLen)
+		i--;
+	PutLiteral(bits, 257 + i);
+	bits.Put(uiLen - uiLenBase[i], uiLenExtra[i]);
+	int j = 29;
+	while (uiDistBase[j] > uiDist)
+		j--;
+	bits.PutReversed(j, 5);
+	bits.Put(uiDist - uiDistBase[j], uiDistExtra[j]);
+}
+
+void Deflate::Compress(const uint8_t *pIn, size_t uiLen, Bits_t &bits)
+{
+	static constexpr size_t uiWindow = 32768, uiHashSize = 1U<<15, uiMaxChain = 32, uiNone = SIZE_MAX;
+	bits.Put(1, 1); // Final block
+	bits.Put(1, 2); // Fixed Huffman
+	// Most recent position per hash of the next 3 bytes, and per position the one before it with the same hash.
+	std::vector<size_t> vHead(uiHashSize, uiNone), vPrev(uiWindow, uiNone);
+	auto fcnHash = [pIn](size_t uiPos) { return ((pIn[uiPos] << 10U) ^ (pIn[uiPos + 1] << 5U) ^ pIn[uiPos + 2]) & (uiHashSize - 1); };
+	auto fcnInsert = [&](size_t uiPos)
+	{
+		if (uiPos + 2 >= uiLen)
+			return;
+		size_t &uiHead = vHead[fcnHash(uiPos)];
+		vPrev[uiPos & (uiWindow - 1)] = uiHead;
+		uiHead = uiPos;
+	};
+	size_t uiPos = 0;
+	while (uiPos < uiLen)
+	{
+		size_t uiBestLen = 0, uiBestDist = 0;
+		if (uiPos + 2 < uiLen)
+		{
+			size_t uiMax = std::min<size_t>(258, uiLen - uiPos);
+			size_t uiCand = vHead[fcnHash(uiPos)];
+			for (size_t uiChain = 0; uiCand != uiNone && uiPos - uiCand <= uiWindow && uiChain < uiMaxChain; uiChain++)
+			{
+				size_t uiMatch = 0;
+				while (uiMatch < uiMax && pIn[uiCand + uiMatch] == pIn[uiPos + uiMatch])
+					uiMatch++;
+				if (uiMatch > uiBestLen)
+				{
+					uiBestLen = uiMatch;
+					uiBestDist = uiPos - uiCand;
+					if (uiMatch == uiMax)
+						break;
+				}
+				size_t uiNext = vPrev[uiCand & (uiWindow - 1)];
+				if (uiNext == uiNone || uiNext >= uiCand) // The slot was reused by a newer position.
+					break;
+				uiCand = uiNext;
+			}
+		}
+		if (uiBestLen >= 3)
+		{
+			PutMatch(bits, uiBestLen, uiBestDist);
+			for (size_t i=0; i<uiBestLen; i++)
+				fcnInsert(uiPos++);
+		}
+		else
+		{
+			PutLiteral(bits, pIn[uiPos]);
+			fcnInsert(uiPos++);
+		}
+	}
+	PutLiteral(bits, 256); // End of block
+	bits.Flush();
+}
+
+static void PutLE32(std::vector<uint8_t> &vOut, uint32_t uiVal)
+{
+	for (int i=0; i<4; i++)
+		vOut.push_back((uiVal >> (8*i)) & 0xFF);
+}
+
+std::vector<uint8_t> Deflate::GZip(const uint8_t *pIn, size_t uiLen)
+{
+	Bits_t bits;
+	bits.vOut = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF}; // Deflate, no flags, no mtime, unknown OS
+	Compress(pIn, uiLen, bits);
+	PutLE32(bits.vOut, CRC(pIn, uiLen));
+	PutLE32(bits.vOut, static_cast<uint32_t>(uiLen)); // Size mod 2^32
+	return std::move(bits.vOut);
+}
+
+uint32_t Deflate::CRC(const uint8_t *pData, size_t uiLen, uint32_t uiCRC)
+{
+	// Built once, thread-safely: the trace chunks are compressed on several threads at a time.
+	static const std::vector<uint32_t> vTable = []()
+	{
+		std::vector<uint32_t> vOut(256);
+		for (uint32_t n=0; n<256; n++)
+		{
+			uint32_t c = n;
+			for (int k=0; k<8; k++)
+				c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+			vOut[n] = c;
+		}
+		return vOut;
+	}();
+	uiCRC = ~uiCRC;
+	for (size_t i=0; i<uiLen; i++)
+		uiCRC = vTable[(uiCRC ^ pData[i]) & 0xFF] ^ (uiCRC >> 8);
+	return ~uiCRC;
+}
@@ -0,0 +1,56 @@
+/*
+	Deflate.h - Minimal dependency-free deflate (RFC 1951) encoder, fixed Huffman codes only.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint32_t, uint8_t
+#include <vector>    // for vector
+
+// The pieces are public for encoders that find their own matches (PNGWriter); Compress()
+// finds them with a hash chain over the 32K window, for anything else.
+class Deflate
+{
+	public:
+		// Bit writer, LSB first as the format wants.
+		typedef struct Bits_t
+		{
+			std::vector<uint8_t> vOut;
+			uint32_t uiAcc = 0, uiCount = 0;
+			void Put(uint32_t uiVal, uint32_t uiBits);
+			void PutReversed(uint32_t uiCode, uint32_t uiBits); // Huffman codes go MSB first.
+			void Flush();
+		} Bits_t;
+
+		// Fixed Huffman table, RFC 1951 3.2.6. uiLit 256 ends the block.
+		static void PutLiteral(Bits_t &bits, uint32_t uiLit);
+		// uiLen 3-258, uiDist 1-32768.
+		static void PutMatch(Bits_t &bits, uint32_t uiLen, uint32_t uiDist);
+
+		// All of pIn as one final fixed-Huffman block, byte aligned after.
+		static void Compress(const uint8_t *pIn, size_t uiLen, Bits_t &bits);
+
+		// pIn as a complete gzip (RFC 1952) member, e.g. for zcat or GTKWave.
+		static std::vector<uint8_t> GZip(const uint8_t *pIn, size_t uiLen);
+
+		// CRC-32 as used by PNG and gzip. Pass the previous result to continue one.
+		static uint32_t CRC(const uint8_t *pData, size_t uiLen, uint32_t uiCRC = 0);
+};
@@ -0,0 +1,280 @@
+/*
+	EEPROMProfile.cpp - Named MK3 EEPROM states and field patches, to skip the first-run setup.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "EEPROMProfile.h"
+#include <stdio.h>        // for printf, fprintf, stderr
+#include <stdint.h>       // for INT16_MAX, INT16_MIN
+#include <string.h>       // for memcpy
+#include <algorithm>      // for fill
+#include <exception>      // for exception
+#include "EEPROM.h"       // for EEPROM
+#include "MK3/eeprom.h"   // for EEPROM_LANG, EEPROM_SHEETS_BASE, ...
+
+// The firmware's Sheet is packed (AVR), the host would pad it, so no sizeof/offsetof here.
+static constexpr uint16_t uiSheetSize = MAX_SHEET_NAME_LENGTH + 2 + 1 + 1;
+static constexpr uint16_t uiSheetZ = MAX_SHEET_NAME_LENGTH, uiSheetBed = uiSheetZ + 2, uiSheetPinda = uiSheetBed + 1;
+static_assert(uiSheetSize*MAX_SHEETS + 1 == EEPROM_SHEETS_SIZEOF, "Sheet layout no longer matches eeprom.h");
+
+EEPROMProfile::EEPROMProfile():Scriptable("EEPROMProfile")
+{
+	RegisterAction("Apply","Applies a named profile (see --eeprom-profile ?) to the EEPROM. The firmware reads most of it at boot, so follow with Board::Reset.",ActApply,{ArgType::String});
+	RegisterAction("Set","Sets one EEPROM field (name, value), e.g. sheet1.z, -250. See --eeprom-profile ?",ActSet,{ArgType::String,ArgType::String});
+}
+
+const std::vector<EEPROMProfile::Field_t>& EEPROMProfile::GetFields()
+{
+	static const std::vector<Field_t> vFields =
+	{
+		{"lang", EEPROM_LANG, Type::U8, 1, "Language: 0 is English, 1+ the installed language packs, 255 asks"},
+		{"wizard", EEPROM_WIZARD_ACTIVE, Type::U8, 1, "1 runs the setup wizard at boot, 255 starts it from the beginning, 0 is done"},
+		{"calibration", EEPROM_CALIBRATION_STATUS, Type::U8, 1, "1 calibrated, 230 needs first layer, 240 Z, 250 XYZ, 255 just assembled"},
+		{"pinda_calibration", EEPROM_CALIBRATION_STATUS_PINDA, Type::U8, 1, "1 if the PINDA temperature calibration has been run"},
+		{"temp_cal", EEPROM_TEMP_CAL_ACTIVE, Type::U8, 1, "1 applies the PINDA temperature compensation"},
+		{"probe_temp_shift", EEPROM_PROBE_TEMP_SHIFT, Type::I16, 5, "PINDA temperature compensation, Z steps relative to 50C"},
+		{"xyz.center_x", EEPROM_BED_CALIBRATION_CENTER, Type::Float, 1, "XYZ calibration: bed offset (mm)"},
+		{"xyz.center_y", EEPROM_BED_CALIBRATION_CENTER + 4, Type::Float, 1, ""},
+		{"xyz.vec_x_x", EEPROM_BED_CALIBRATION_VEC_X, Type::Float, 1, "XYZ calibration: X axis vector, 1,0 when square"},
+		{"xyz.vec_x_y", EEPROM_BED_CALIBRATION_VEC_X + 4, Type::Float, 1, ""},
+		{"xyz.vec_y_x", EEPROM_BED_CALIBRATION_VEC_Y, Type::Float, 1, "XYZ calibration: Y axis vector, 0,1 when square"},
+		{"xyz.vec_y_y", EEPROM_BED_CALIBRATION_VEC_Y + 4, Type::Float, 1, ""},
+		{"xyz.skew", EEPROM_XYZ_CAL_SKEW, Type::Float, 1, "XYZ calibration: skew backup (radians)"},
+		{"z_jitter", EEPROM_BED_CALIBRATION_Z_JITTER, Type::I16, 8, "XYZ calibration: per-point Z jitter"},
+		{"sheet", EEPROM_SHEETS_BASE + uiSheetSize*MAX_SHEETS, Type::U8, 1, "Active sheet, 0-7"},
+		{"silent", EEPROM_SILENT, Type::U8, 1, "Motor mode: 0 normal, 1 silent"},
+		{"sound", EEPROM_SOUND_MODE, Type::U8, 1, "0 loud, 1 once, 2 silent, 3 assist"},
+		{"fsensor", EEPROM_FSENSOR, Type::U8, 1, "Filament sensor: 0 off, 1 on"},
+		{"autoload", EEPROM_FSENS_AUTOLOAD_ENABLED, Type::U8, 1, "Filament autoload: 0 off, 1 on"},
+		{"crash_detect", EEPROM_CRASH_DET, Type::U8, 1, "Crash detection: 0 off, 1 on"},
+	};
+	return vFields;
+}
+
+const std::vector<EEPROMProfile::Profile_t>& EEPROMProfile::GetProfiles()
+{
+	static const std::vector<Profile_t> vProfiles =
+	{
+		{"fresh", "Erased, as from the factory (the firmware sets its defaults and runs the whole wizard)", {"all=255"}},
+		{"english", "Language chosen (English), so boot doesn't stop to ask", {"lang=0"}},
+		{"wizard-done", "english, and the setup wizard finished", {"english", "wizard=0"}},
+		{"calibrated", "wizard-done, with XYZ (square, no skew), Z, first layer (sheet 0, Smooth1, at 0) and PINDA calibration done and temperature compensation off",
+			{"wizard-done", "calibration=1", "pinda_calibration=1", "temp_cal=0", "probe_temp_shift=0",
+			"xyz.center_x=0", "xyz.center_y=0", "xyz.vec_x_x=1", "xyz.vec_x_y=0", "xyz.vec_y_x=0", "xyz.vec_y_y=1", "xyz.skew=0", "z_jitter=0",
+			"sheet0.name=Smooth1", "sheet0.z=0", "sheet0.bed=60", "sheet0.pinda=35", "sheet=0"}},
+	};
+	return vProfiles;
+}
+
+bool EEPROMProfile::FindField(const std::string &strName, Field_t &field)
+{
+	for (auto &f : GetFields())
+		if (f.strName == strName)
+		{
+			field = f;
+			return true;
+		}
+	// sheet<N>.<part>
+	if (strName.size() < 8 || strName.compare(0, 5, "sheet") || strName.at(6) != '.' || strName.at(5) < '0' || strName.at(5) >= '0' + MAX_SHEETS)
+		return false;
+	uint16_t uiBase = EEPROM_SHEETS_BASE + uiSheetSize*(strName.at(5) - '0');
+	std::string strPart = strName.substr(7);
+	field = {strName, uiBase, Type::U8, 1, ""};
+	if (strPart == "name")
+		field.type = Type::Name;
+	else if (strPart == "z")
+	{
+		field.uiAddr += uiSheetZ;
+		field.type = Type::I16;
+	}
+	else if (strPart == "bed")
+		field.uiAddr += uiSheetBed;
+	else if (strPart == "pinda")
+		field.uiAddr += uiSheetPinda;
+	else
+		return false;
+	return true;
+}
+
+bool EEPROMProfile::SetField(std::vector<uint8_t> &vImage, const Field_t &field, const std::string &strValue, std::string &strError)
+{
+	uint8_t uiBytes[4] = {0};
+	size_t uiLen = 0;
+	try
+	{
+		switch (field.type)
+		{
+			case Type::U8:
+			{
+				unsigned long ulVal = std::stoul(strValue, nullptr, 0);
+				if (ulVal > 0xFFU)
+				{
+					strError = field.strName + " must be 0-255";
+					return false;
+				}
+				uiBytes[0] = ulVal;
+				uiLen = 1;
+				break;
+			}
+			case Type::I16:
+			{
+				long lVal = std::stol(strValue, nullptr, 0);
+				if (lVal < INT16_MIN || lVal > INT16_MAX)
+				{
+					strError = field.strName + " must fit in 16 bits";
+					return false;
+				}
+				uiBytes[0] = static_cast<uint16_t>(lVal) & 0xFFU;
+				uiBytes[1] = static_cast<uint16_t>(lVal) >> 8U;
+				uiLen = 2;
+				break;
+			}
+			case Type::Float:
+			{
+				float fVal = std::stof(strValue);
+				memcpy(uiBytes, &fVal, 4); // IEEE little endian, as avr-gcc's.
+				uiLen = 4;
+				break;
+			}
+			case Type::Name:
+				if (strValue.size() > MAX_SHEET_NAME_LENGTH)
+				{
+					strError = field.strName + " is at most " + std::to_string(MAX_SHEET_NAME_LENGTH) + " characters";
+					return false;
+				}
+				for (size_t i=0; i<MAX_SHEET_NAME_LENGTH; i++)
+					vImage.at(field.uiAddr + i) = i < strValue.size() ? strValue[i] : 0;
+				return true;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		strError = "Bad value for " + field.strName + ": " + strValue;
+		return false;
+	}
+	for (unsigned int i=0; i<field.uiCount; i++)
+		memcpy(vImage.data() + field.uiAddr + i*uiLen, uiBytes, uiLen);
+	return true;
+}
+
+bool EEPROMProfile::Patch(std::vector<uint8_t> &vImage, const std::string &strItem, std::string &strError)
+{
+	if (vImage.size() < EEPROM_TOP)
+	{
+		strError = "EEPROM profiles need the MK3's 4K EEPROM";
+		return false;
+	}
+	size_t uiEq = strItem.find('=');
+	if (uiEq == std::string::npos)
+	{
+		for (auto &profile : GetProfiles())
+			if (strItem == profile.szName)
+			{
+				for (auto &strSub : profile.vItems)
+					if (!Patch(vImage, strSub, strError))
+						return false;
+				return true;
+			}
+		strError = "No EEPROM profile named " + strItem;
+		return false;
+	}
+	std::string strField = strItem.substr(0, uiEq), strValue = strItem.substr(uiEq + 1);
+	if (strField == "all")
+	{
+		Field_t all {"all", 0, Type::U8, 1, ""};
+		if (!SetField(vImage, all, strValue, strError))
+			return false;
+		std::fill(vImage.begin(), vImage.end(), vImage[0]);
+		return true;
+	}
+	Field_t field;
+	if (!FindField(strField, field))
+	{
+		strError = "No EEPROM field named " + strField;
+		return false;
+	}
+	return SetField(vImage, field, strValue, strError);
+}
+
+bool EEPROMProfile::Validate(const std::vector<std::string> &vItems)
+{
+	std::vector<uint8_t> vImage(EEPROM_TOP, EEPROM_EMPTY_VALUE);
+	std::string strError;
+	for (auto &strItem : vItems)
+		if (!Patch(vImage, strItem, strError))
+		{
+			fprintf(stderr, "ERROR: --eeprom-profile %s: %s\n", strItem.c_str(), strError.c_str());
+			return false;
+		}
+	return true;
+}
+
+void EEPROMProfile::PrintHelp()
+{
+	printf("EEPROM profiles:\n");
+	for (auto &profile : GetProfiles())
+		printf("\t%-12s %s\n", profile.szName, profile.szHelp);
+	printf("Fields (field=value):\n");
+	printf("\t%-18s %s\n", "all", "Every byte");
+	for (auto &field : GetFields())
+		if (field.szHelp[0])
+			printf("\t%-18s %s\n", field.strName.c_str(), field.szHelp);
+	printf("\t%-18s %s\n", "sheet<0-7>.name", "Sheet name, up to 7 characters");
+	printf("\t%-18s %s\n", "sheet<0-7>.z", "Sheet Z offset (live adjust), in Z microsteps, -1 (65535) when unset");
+	printf("\t%-18s %s\n", "sheet<0-7>.bed", "Bed temperature at the last live adjust");
+	printf("\t%-18s %s\n", "sheet<0-7>.pinda", "PINDA temperature at the last live adjust");
+}
+
+bool EEPROMProfile::Apply(const std::vector<std::string> &vItems)
+{
+	std::vector<uint8_t> vImage = m_pEEPROM->GetContents();
+	std::string strError;
+	for (auto &strItem : vItems)
+	{
+		if (!Patch(vImage, strItem, strError))
+		{
+			fprintf(stderr, "EEPROM profile %s: %s\n", strItem.c_str(), strError.c_str());
+			return false;
+		}
+	}
+	m_pEEPROM->SetContents(vImage);
+	return true;
+}
+
+Scriptable::LineStatus EEPROMProfile::ProcessAction(unsigned int uiAct, const std::vector<std::string> &vArgs)
+{
+	std::string strItem;
+	switch (uiAct)
+	{
+		case ActApply:
+			strItem = vArgs.at(0);
+			break;
+		case ActSet:
+			strItem = vArgs.at(0) + "=" + vArgs.at(1);
+			break;
+		default:
+			return LineStatus::Unhandled;
+	}
+	std::vector<uint8_t> vImage = m_pEEPROM->GetContents();
+	std::string strError;
+	if (!Patch(vImage, strItem, strError))
+		return IssueLineError(strError);
+	m_pEEPROM->SetContents(vImage);
+	return LineStatus::Finished;
+}
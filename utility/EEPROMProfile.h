@@ -0,0 +1,103 @@
+/*
+	EEPROMProfile.h - Named MK3 EEPROM states and field patches, to skip the first-run setup.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>       // for uint16_t, uint8_t
+#include <string>         // for string
+#include <vector>         // for vector
+#include "IScriptable.h"  // for IScriptable::LineStatus
+#include "Scriptable.h"   // for Scriptable
+
+class EEPROM;
+
+// An item is either a profile name (e.g. "calibrated") or field=value (e.g. "sheet1.z=-250").
+// Items patch a copy of the EEPROM, which goes back in one AVR_IOCTL_EEPROM_SET. Addresses come
+// from the firmware's own layout (utility/MK3/eeprom.h). The firmware reads most of this at boot,
+// so at runtime follow up with Board::Reset. Changes persist to the EEPROM file like any other.
+class EEPROMProfile: public Scriptable
+{
+	public:
+		EEPROMProfile();
+
+		// Set from the command line before the boards are created, applied in order once the EEPROM is loaded.
+		static void SetDefaults(const std::vector<std::string> &vItems) { GetDefaultsRef() = vItems; }
+		static inline const std::vector<std::string>& GetDefaults() { return GetDefaultsRef(); }
+
+		// Applies strItem to vImage (the whole 4K EEPROM). On failure says why in strError, and vImage
+		// may be partly patched.
+		static bool Patch(std::vector<uint8_t> &vImage, const std::string &strItem, std::string &strError);
+
+		// Checks the items against a blank image, printing what is wrong. For the command line.
+		static bool Validate(const std::vector<std::string> &vItems);
+
+		// Lists the profiles and fields.
+		static void PrintHelp();
+
+		void Init(EEPROM *pEEPROM) { m_pEEPROM = pEEPROM; }
+
+		// Patches the AVR's EEPROM with all the items, or (printing why) none of them.
+		bool Apply(const std::vector<std::string> &vItems);
+
+	protected:
+		LineStatus ProcessAction(unsigned int uiAct, const std::vector<std::string> &vArgs) override;
+
+	private:
+		static std::vector<std::string>& GetDefaultsRef() { static std::vector<std::string> vItems; return vItems; }
+
+		enum class Type
+		{
+			U8,
+			I16,
+			Float,
+			Name // Sheet name, up to 7 characters
+		};
+
+		typedef struct Field_t
+		{
+			std::string strName;
+			uint16_t uiAddr;
+			Type type;
+			uint8_t uiCount; // Array fields get the one value in every element.
+			const char *szHelp;
+		} Field_t;
+
+		typedef struct Profile_t
+		{
+			const char *szName;
+			const char *szHelp;
+			std::vector<std::string> vItems;
+		} Profile_t;
+
+		static const std::vector<Field_t>& GetFields();
+		static const std::vector<Profile_t>& GetProfiles();
+		// The fixed fields, or sheet<N>.<name|z|bed|pinda>.
+		static bool FindField(const std::string &strName, Field_t &field);
+		static bool SetField(std::vector<uint8_t> &vImage, const Field_t &field, const std::string &strValue, std::string &strError);
+
+		EEPROM *m_pEEPROM = nullptr;
+
+		enum Actions
+		{
+			ActApply,
+			ActSet
+		};
+};
@@ -0,0 +1,298 @@
+/*
+	ELFSymbols.cpp - Reads the symbol table of an AVR firmware ELF/AFX file.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ELFSymbols.h"
+#include <fcntl.h>    // for open, O_RDONLY
+#include <gelf.h>     // for GElf_Sym, GElf_Shdr, gelf_getsym, gelf_getshdr
+#include <libelf.h>   // for elf_begin, elf_nextscn, elf_getdata, elf_strptr
+#include <stdio.h>    // for perror, printf
+#include <unistd.h>   // for close
+#include <algorithm>  // for min
+#include <cstring>    // for strcmp
+
+constexpr uint32_t ELFSymbols::m_uiDataOffset;
+
+bool ELFSymbols::Read(const std::string &strELF, std::vector<Symbol_t> &vOut)
+{
+	int fd = open(strELF.c_str(), O_RDONLY);
+	if (fd<0)
+	{
+		perror(strELF.c_str());
+		return false;
+	}
+	elf_version(EV_CURRENT);
+	Elf *pELF = elf_begin(fd, ELF_C_READ, nullptr);
+	Elf_Scn *pScn = nullptr;
+	while (pELF && (pScn = elf_nextscn(pELF, pScn)) != nullptr)
+	{
+		GElf_Shdr shdr;
+		if (!gelf_getshdr(pScn, &shdr) || shdr.sh_type != SHT_SYMTAB)
+			continue;
+		Elf_Data *pData = elf_getdata(pScn, nullptr);
+		size_t uiCount = shdr.sh_entsize ? shdr.sh_size / shdr.sh_entsize : 0;
+		for (size_t i=0; pData && i<uiCount; i++)
+		{
+			GElf_Sym sym;
+			if (!gelf_getsym(pData, i, &sym) || sym.st_shndx == SHN_UNDEF)
+				continue;
+			const char *pName = elf_strptr(pELF, shdr.sh_link, sym.st_name);
+			if (!pName || !*pName)
+				continue;
+			Symbol_t symOut;
+			symOut.strName = pName;
+			symOut.uiAddr = sym.st_value;
+			symOut.uiSize = sym.st_size;
+			symOut.bFunc = GELF_ST_TYPE(sym.st_info) == STT_FUNC;
+			vOut.push_back(symOut);
+		}
+	}
+	bool bOK = pELF != nullptr;
+	if (pELF)
+		elf_end(pELF);
+	close(fd);
+	return bOK;
+}
+
+// Bounds-checked reads from a section. Running off the end just yields zeroes and stops the caller's loop.
+typedef struct Reader_t
+{
+	const uint8_t *pData;
+	size_t uiPos, uiEnd;
+
+	inline bool AtEnd() const { return uiPos >= uiEnd; }
+	inline uint64_t Fixed(unsigned int uiBytes)
+	{
+		uint64_t uiVal = 0;
+		for (unsigned int i=0; i<uiBytes && uiPos<uiEnd; i++)
+			uiVal |= static_cast<uint64_t>(pData[uiPos++]) << (8U*i); // avr-gcc output is little endian.
+		return uiVal;
+	}
+	inline uint64_t ULEB()
+	{
+		uint64_t uiVal = 0;
+		unsigned int uiShift = 0;
+		while (uiPos<uiEnd)
+		{
+			uint8_t b = pData[uiPos++];
+			uiVal |= static_cast<uint64_t>(b & 0x7FU) << uiShift;
+			uiShift += 7;
+			if (!(b & 0x80U))
+				break;
+		}
+		return uiVal;
+	}
+	inline int64_t SLEB()
+	{
+		int64_t iVal = 0;
+		unsigned int uiShift = 0;
+		uint8_t b = 0;
+		while (uiPos<uiEnd)
+		{
+			b = pData[uiPos++];
+			iVal |= static_cast<int64_t>(b & 0x7FU) << uiShift;
+			uiShift += 7;
+			if (!(b & 0x80U))
+				break;
+		}
+		if (uiShift < 64 && (b & 0x40U))
+			iVal |= -(static_cast<int64_t>(1) << uiShift);
+		return iVal;
+	}
+	inline std::string String()
+	{
+		size_t uiStart = uiPos;
+		while (uiPos<uiEnd && pData[uiPos])
+			uiPos++;
+		std::string str(reinterpret_cast<const char*>(pData) + uiStart, uiPos - uiStart);
+		uiPos++;
+		return str;
+	}
+} Reader_t;
+
+// Runs one unit's line number program (DWARF 2-4, section 6.2), turning consecutive rows into Line_t's.
+static bool ReadLineUnit(Reader_t &in, std::vector<ELFSymbols::Line_t> &vOut)
+{
+	unsigned int uiOffsetSize = 4;
+	uint64_t uiLength = in.Fixed(4);
+	if (uiLength == 0xFFFFFFFFU)
+	{
+		uiOffsetSize = 8;
+		uiLength = in.Fixed(8);
+	}
+	size_t uiUnitEnd = std::min(in.uiPos + uiLength, in.uiEnd);
+	uint16_t uiVersion = in.Fixed(2);
+	if (uiVersion < 2 || uiVersion > 4)
+	{
+		static bool bWarned = false;
+		if (!bWarned)
+			printf("ELFSymbols: DWARF %u line tables aren't supported, those units have no line info.\n", uiVersion);
+		bWarned = true;
+		in.uiPos = uiUnitEnd;
+		return false;
+	}
+	uint64_t uiHeaderLen = in.Fixed(uiOffsetSize);
+	size_t uiProgram = in.uiPos + uiHeaderLen;
+	uint8_t uiMinInst = in.Fixed(1);
+	if (uiVersion >= 4)
+		in.Fixed(1); // maximum_operations_per_instruction, 1 for everything but VLIW.
+	in.Fixed(1); // default_is_stmt, every row counts for coverage.
+	int8_t iLineBase = static_cast<int8_t>(in.Fixed(1));
+	uint8_t uiLineRange = in.Fixed(1);
+	uint8_t uiOpBase = in.Fixed(1);
+	std::vector<uint8_t> vOpLengths;
+	for (unsigned int i=1; i<uiOpBase; i++)
+		vOpLengths.push_back(in.Fixed(1));
+	std::vector<std::string> vDirs;
+	for (std::string strDir = in.String(); !strDir.empty() && !in.AtEnd(); strDir = in.String())
+		vDirs.push_back(strDir);
+	std::vector<std::string> vFiles;
+	for (std::string strFile = in.String(); !strFile.empty() && !in.AtEnd(); strFile = in.String())
+	{
+		uint64_t uiDir = in.ULEB();
+		in.ULEB(); // mtime
+		in.ULEB(); // length
+		vFiles.push_back(uiDir && uiDir <= vDirs.size() && strFile[0] != '/' ? vDirs[uiDir-1] + "/" + strFile : strFile);
+	}
+	if (!uiLineRange)
+	{
+		in.uiPos = uiUnitEnd;
+		return false;
+	}
+
+	in.uiPos = uiProgram;
+	uint64_t uiAddr = 0, uiFile = 1;
+	int64_t iLine = 1;
+	bool bHaveRow = false;
+	ELFSymbols::Line_t row;
+	// A row runs until the next one's address.
+	auto fcnEmit = [&](bool bEnd)
+	{
+		if (bHaveRow && uiAddr > row.uiStart)
+		{
+			row.uiEnd = uiAddr;
+			vOut.push_back(row);
+		}
+		bHaveRow = !bEnd;
+		row.uiStart = uiAddr;
+		row.uiLine = iLine;
+		row.strFile = uiFile && uiFile <= vFiles.size() ? vFiles[uiFile-1] : "?";
+	};
+	Reader_t prog {in.pData, uiProgram, uiUnitEnd};
+	while (!prog.AtEnd())
+	{
+		uint8_t uiOp = prog.Fixed(1);
+		if (uiOp >= uiOpBase)
+		{
+			uint8_t uiAdj = uiOp - uiOpBase;
+			uiAddr += (uiAdj / uiLineRange) * uiMinInst;
+			iLine += iLineBase + (uiAdj % uiLineRange);
+			fcnEmit(false);
+			continue;
+		}
+		switch (uiOp)
+		{
+			case 0: // Extended
+			{
+				uint64_t uiLen = prog.ULEB();
+				size_t uiNext = prog.uiPos + uiLen;
+				uint8_t uiExt = prog.Fixed(1);
+				if (uiExt == 1) // end_sequence
+				{
+					fcnEmit(true);
+					uiAddr = 0;
+					uiFile = 1;
+					iLine = 1;
+				}
+				else if (uiExt == 2) // set_address
+					uiAddr = prog.Fixed(uiLen - 1);
+				else if (uiExt == 3) // define_file
+					vFiles.push_back(prog.String());
+				prog.uiPos = uiNext;
+				break;
+			}
+			case 1: // copy
+				fcnEmit(false);
+				break;
+			case 2: // advance_pc
+				uiAddr += prog.ULEB() * uiMinInst;
+				break;
+			case 3: // advance_line
+				iLine += prog.SLEB();
+				break;
+			case 4: // set_file
+				uiFile = prog.ULEB();
+				break;
+			case 8: // const_add_pc
+				uiAddr += ((255U - uiOpBase) / uiLineRange) * uiMinInst;
+				break;
+			case 9: // fixed_advance_pc
+				uiAddr += prog.Fixed(2);
+				break;
+			default: // Column, stmt, basic block, prologue/epilogue, isa or unknown: operands skipped, no effect on us.
+				for (unsigned int i=0; uiOp<=vOpLengths.size() && i<vOpLengths[uiOp-1]; i++)
+					prog.ULEB();
+		}
+	}
+	in.uiPos = uiUnitEnd;
+	return true;
+}
+
+bool ELFSymbols::ReadLines(const std::string &strELF, std::vector<Line_t> &vOut)
+{
+	int fd = open(strELF.c_str(), O_RDONLY);
+	if (fd<0)
+	{
+		perror(strELF.c_str());
+		return false;
+	}
+	elf_version(EV_CURRENT);
+	Elf *pELF = elf_begin(fd, ELF_C_READ, nullptr);
+	size_t uiStrIndex = 0;
+	bool bFound = false;
+	Elf_Scn *pScn = nullptr;
+	if (pELF && elf_getshdrstrndx(pELF, &uiStrIndex) == 0)
+		while ((pScn = elf_nextscn(pELF, pScn)) != nullptr)
+		{
+			GElf_Shdr shdr;
+			if (!gelf_getshdr(pScn, &shdr))
+				continue;
+			const char *pName = elf_strptr(pELF, uiStrIndex, shdr.sh_name);
+			Elf_Data *pData = pName && strcmp(pName, ".debug_line") == 0 ? elf_getdata(pScn, nullptr) : nullptr;
+			if (!pData || !pData->d_buf)
+				continue;
+			bFound = true;
+			Reader_t in {static_cast<const uint8_t*>(pData->d_buf), 0, pData->d_size};
+			while (!in.AtEnd())
+				ReadLineUnit(in, vOut);
+		}
+	if (pELF)
+		elf_end(pELF);
+	close(fd);
+	return bFound;
+}
+
+const ELFSymbols::Symbol_t* ELFSymbols::Find(const std::vector<Symbol_t> &vSyms, const std::string &strName)
+{
+	for (auto &sym : vSyms)
+		if (sym.strName == strName)
+			return &sym;
+	return nullptr;
+}
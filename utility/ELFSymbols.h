@@ -0,0 +1,57 @@
+/*
+	ELFSymbols.h - Reads the symbol table of an AVR firmware ELF/AFX file.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>  // for uint32_t
+#include <string>    // for string
+#include <vector>    // for vector
+
+class ELFSymbols
+{
+	public:
+		typedef struct Symbol_t
+		{
+			std::string strName;
+			uint32_t uiAddr = 0, uiSize = 0; // Flash symbols are byte addresses, RAM ones are offset by m_uiDataOffset.
+			bool bFunc = false;
+		} Symbol_t;
+
+		// A run of flash (bytes, end exclusive) generated from one source line.
+		typedef struct Line_t
+		{
+			uint32_t uiStart = 0, uiEnd = 0;
+			uint32_t uiLine = 0;
+			std::string strFile;
+		} Line_t;
+
+		// Where avr-gcc places SRAM in the ELF address space.
+		static constexpr uint32_t m_uiDataOffset = 0x800000;
+
+		// Appends the file's defined symbols to vOut. Returns false if it could not be read.
+		static bool Read(const std::string &strELF, std::vector<Symbol_t> &vOut);
+
+		// Appends the DWARF (v2-v4) line table to vOut. False if the file has none or it could not be read.
+		static bool ReadLines(const std::string &strELF, std::vector<Line_t> &vOut);
+
+		// Finds the named symbol, nullptr if there isn't one.
+		static const Symbol_t* Find(const std::vector<Symbol_t> &vSyms, const std::string &strName);
+};
@@ -0,0 +1,283 @@
+/*
+	FarmView.cpp - One window showing every printer of an --instances run.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FarmView.h"
+#include <GL/freeglut_std.h>  // for glutCreateWindow, glutTimerFunc, GLUT_DOWN
+#include <GL/freeglut_ext.h>  // for glutLeaveMainLoop, glutSetOption
+#include <GL/glew.h>          // for glTranslatef, glPushMatrix, glPopMatrix
+#include <algorithm>          // for find, max
+#include <cmath>              // for ceil, sqrt
+#include "HD44780GL.h"        // for HD44780GL
+#include "MK3S_Lite.h"        // for MK3S_Lite
+#include "OBJCollection.h"    // for OBJCollection, OBJCollection::ObjClass
+#include "RedrawFlag.h"       // for RedrawFlag
+
+FarmView::Slot::~Slot()
+{
+	FarmView::Get().Remove(this);
+}
+
+void FarmView::Slot::Init(avr_t *avr, HD44780GL *pLCD)
+{
+	_Init(avr, this);
+	m_pLCD = pLCD;
+	RegisterNotify(X_IN, MAKE_C_CALLBACK(FarmView::Slot,OnXChanged), this);
+	RegisterNotify(Y_IN, MAKE_C_CALLBACK(FarmView::Slot,OnYChanged), this);
+	RegisterNotify(Z_IN, MAKE_C_CALLBACK(FarmView::Slot,OnZChanged), this);
+	RegisterNotify(SD_IN, MAKE_C_CALLBACK(FarmView::Slot,OnSDChanged), this);
+	FarmView::Get().Add(this);
+}
+
+void FarmView::Slot::OnXChanged(avr_irq_t *irq, uint32_t value)
+{
+	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
+	m_fX = fPos[0]/1000.f;
+	RedrawFlag::Set();
+}
+
+void FarmView::Slot::OnYChanged(avr_irq_t *irq, uint32_t value)
+{
+	float* fPos = (float*)(&value);
+	m_fY = fPos[0]/1000.f;
+	RedrawFlag::Set();
+}
+
+void FarmView::Slot::OnZChanged(avr_irq_t *irq, uint32_t value)
+{
+	float* fPos = (float*)(&value);
+	m_fZ = fPos[0]/1000.f;
+	RedrawFlag::Set();
+}
+
+void FarmView::Slot::OnSDChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_bSD = value==0;
+	RedrawFlag::Set();
+}
+
+FarmView& FarmView::Get()
+{
+	static FarmView view;
+	return view;
+}
+
+void FarmView::Add(Slot *pSlot)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_vSlots.push_back(pSlot);
+}
+
+void FarmView::Remove(Slot *pSlot)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto it = std::find(m_vSlots.begin(), m_vSlots.end(), pSlot);
+	if (it != m_vSlots.end())
+		m_vSlots.erase(it);
+}
+
+void FarmView::Open(const std::string &strTitle, std::function<void(unsigned char)> fcnKey, std::function<bool()> fcnDone)
+{
+	m_fcnKey = fcnKey;
+	m_fcnDone = fcnDone;
+	m_pObjs.reset(new MK3S_Lite(false));
+
+	glutSetOption(GLUT_MULTISAMPLE,4);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH | GLUT_MULTISAMPLE);
+	glutInitWindowSize(1000,800);
+	m_iWindow = glutCreateWindow(strTitle.c_str());
+	glewInit();
+
+	glutDisplayFunc([]() { FarmView::Get().Draw();});
+	glutKeyboardFunc([](unsigned char c, int x, int y)
+	{
+		if (c == 'r')
+			FarmView::Get().ResetCamera();
+		else if (FarmView::Get().m_fcnKey)
+			FarmView::Get().m_fcnKey(c);
+		RedrawFlag::Set();
+	});
+	glutMouseFunc([](int button, int state, int x, int y) { FarmView::Get().MouseCB(button,state,x,y);});
+	glutMotionFunc([](int x, int y) { FarmView::Get().MotionCB(x,y);});
+	glutReshapeFunc([](int w, int h) { FarmView::Get().ResizeCB(w,h);});
+	glutTimerFunc(m_iFrameMs, [](int) { FarmView::Get().TimerCB();}, 0);
+
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glEnable(GL_BLEND);
+	glEnable(GL_MULTISAMPLE);
+
+	ResetCamera();
+}
+
+void FarmView::ResetCamera()
+{
+	m_camera = Camera();
+	m_camera.setWindowSize(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+	m_camera.setEye(0,1.2,2.2);
+	m_camera.setCenter(0,0,0);
+}
+
+void FarmView::ResizeCB(int w, int h)
+{
+	m_camera.setWindowSize(w, h);
+	glViewport(0, 0, w, h);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(45.0, (float)w / (float)h, 0.01f, 100.0f);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+}
+
+void FarmView::MouseCB(int button, int action, int x, int y)
+{
+	if (button == GLUT_LEFT_BUTTON)
+	{
+		if (action == GLUT_DOWN)
+			m_camera.beginRotate();
+		else if (action == GLUT_UP)
+			m_camera.endRotate();
+	}
+	if (button == GLUT_RIGHT_BUTTON)
+	{
+		if (action == GLUT_DOWN)
+			m_camera.beginPan();
+		else if (action == GLUT_UP)
+			m_camera.endPan();
+	}
+	if (button == GLUT_MIDDLE_BUTTON)
+	{
+		if (action == GLUT_DOWN)
+			m_camera.beginZoom();
+		else if (action == GLUT_UP)
+			m_camera.endZoom();
+	}
+	if (button==3)
+		m_camera.zoom(0.5f);
+	if (button==4)
+		m_camera.zoom(-0.5f);
+	RedrawFlag::Set();
+}
+
+void FarmView::MotionCB(int x, int y)
+{
+	m_camera.setCurrentMousePos(x, y);
+	RedrawFlag::Set();
+}
+
+void FarmView::TimerCB()
+{
+	if (m_fcnDone && m_fcnDone())
+	{
+		glutLeaveMainLoop();
+		return;
+	}
+	glutTimerFunc(m_iFrameMs, [](int) { FarmView::Get().TimerCB();}, 0);
+	if (RedrawFlag::Take())
+	{
+		glutSetWindow(m_iWindow);
+		glutPostRedisplay();
+	}
+}
+
+void FarmView::DrawLCD(HD44780GL *pLCD)
+{
+	glPushMatrix();
+		m_pObjs->ApplyLCDTransform();
+		glRotatef(-45.f,1,0,0);
+		float fScale = (4.f*0.076f)/500.f; // As MK3SGL: the display is 76mm wide, drawn 500 wide at 4x scale
+		glScalef(fScale,fScale,fScale);
+		glScalef(1.0,-1.0f,-0.1f);
+		pLCD->Draw(0x382200ff, 0x000000ff , 0xFF9900ff, 0x00000055, true);
+	glPopMatrix();
+}
+
+void FarmView::Draw()
+{
+	if (!m_bLoaded)
+	{
+		m_pObjs->Load();
+		m_bLoaded = true;
+	}
+	std::lock_guard<std::mutex> lock(m_lock);
+
+	// Row-major from the back left, centred on the origin.
+	int iCols = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<float>(m_vSlots.size())))));
+	int iRows = std::max<int>(1, (m_vSlots.size() + iCols - 1)/iCols);
+	m_vBase.clear();
+	m_vX.clear();
+	m_vY.clear();
+	m_vZ.clear();
+	m_vMedia.clear();
+	for (size_t i=0; i<m_vSlots.size(); i++)
+	{
+		Slot *pSlot = m_vSlots[i];
+		float fBase[3] = {(static_cast<float>(i%iCols) - (iCols-1)/2.f)*m_fPitchX, 0, (static_cast<float>(i/iCols) - (iRows-1)/2.f)*m_fPitchZ};
+		float fZ = pSlot->m_fZ;
+		m_vBase.insert(m_vBase.end(), fBase, fBase + 3);
+		m_vZ.insert(m_vZ.end(), {fBase[0], fBase[1] + fZ, fBase[2]});
+		m_vX.insert(m_vX.end(), {fBase[0] + pSlot->m_fX, fBase[1] + fZ, fBase[2]});
+		m_vY.insert(m_vY.end(), {fBase[0], fBase[1], fBase[2] + pSlot->m_fY});
+		if (pSlot->m_bSD)
+			m_vMedia.insert(m_vMedia.end(), fBase, fBase + 3);
+	}
+	auto fcnOffsets = [](const std::vector<float> &v) { return reinterpret_cast<const float (*)[3]>(v.data()); };
+
+	glutSetWindow(m_iWindow);
+	glClearColor(0.1f, 0.2f, 0.3f, 1.0f);
+	glClearDepth(1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_BACK);
+	m_pObjs->SetupLighting();
+	glEnable(GL_LIGHT0);
+	glEnable(GL_LIGHTING);
+	glMatrixMode(GL_MODELVIEW);
+	glEnable(GL_NORMALIZE);
+	glLoadIdentity();
+
+	glMultMatrixf(m_camera.getViewMatrix());
+	// The whole grid gets about the room one printer has in MK3SGL.
+	float fExtent = m_pObjs->GetScaleFactor() * static_cast<float>(iCols);
+	glScalef(1.0f / fExtent, 1.0f / fExtent, 1.0f / fExtent);
+	float fTransform[3];
+	m_pObjs->GetBaseCenter(fTransform);
+	glTranslatef (fTransform[0], fTransform[1], fTransform[2]);
+
+	size_t uiCount = m_vSlots.size();
+	m_pObjs->Draw(OBJCollection::ObjClass::Z, fcnOffsets(m_vZ), uiCount);
+	m_pObjs->Draw(OBJCollection::ObjClass::X, fcnOffsets(m_vX), uiCount);
+	m_pObjs->Draw(OBJCollection::ObjClass::Y, fcnOffsets(m_vY), uiCount);
+	m_pObjs->Draw(OBJCollection::ObjClass::PrintSurface, fcnOffsets(m_vY), uiCount);
+	m_pObjs->Draw(OBJCollection::ObjClass::Fixed, fcnOffsets(m_vBase), uiCount);
+	m_pObjs->Draw(OBJCollection::ObjClass::Media, fcnOffsets(m_vMedia), m_vMedia.size()/3);
+	for (size_t i=0; i<uiCount; i++)
+	{
+		glPushMatrix();
+			glTranslatef(m_vBase[3*i], m_vBase[3*i + 1], m_vBase[3*i + 2]);
+			m_pObjs->DrawKnob(0);
+			if (m_vSlots[i]->m_pLCD)
+				DrawLCD(m_vSlots[i]->m_pLCD);
+		glPopMatrix();
+	}
+	glutSwapBuffers();
+}
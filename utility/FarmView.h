@@ -0,0 +1,110 @@
+/*
+	FarmView.h - One window showing every printer of an --instances run.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Camera.hpp>        // for Camera
+#include <stdint.h>          // for uint32_t
+#include <atomic>            // for atomic, atomic_bool
+#include <functional>        // for function
+#include <memory>            // for unique_ptr
+#include <mutex>             // for mutex
+#include <string>            // for string
+#include <vector>            // for vector
+#include "BasePeripheral.h"  // for BasePeripheral
+#include "sim_avr.h"         // for avr_t
+#include "sim_irq.h"         // for avr_irq_t
+
+class HD44780GL;
+class OBJCollection;
+
+// Draws the printers in a grid, all from one set of lite meshes: each object class is drawn
+// for every printer in one pass over its batch (GLObjBatch::Draw with offsets), so the meshes
+// are uploaded once and the visibility/material work doesn't grow with the printer count.
+// Each LCD draws from its own glyph atlas, as their CGRAM differs.
+class FarmView
+{
+	public:
+		// One printer's part of the view, fed from its AVR thread.
+		class Slot: public BasePeripheral
+		{
+			public:
+				#define IRQPAIRS _IRQ(X_IN,"<x.in") _IRQ(Y_IN,"<y.in") _IRQ(Z_IN,"<z.in") _IRQ(SD_IN,"<SD.in")
+				#include "IRQHelper.h"
+
+				~Slot();
+
+				// Registers the IRQs and adds the slot to the view.
+				void Init(avr_t *avr, HD44780GL *pLCD);
+
+			private:
+				friend class FarmView;
+
+				void OnXChanged(avr_irq_t *irq, uint32_t value);
+				void OnYChanged(avr_irq_t *irq, uint32_t value);
+				void OnZChanged(avr_irq_t *irq, uint32_t value);
+				void OnSDChanged(avr_irq_t *irq, uint32_t value);
+
+				HD44780GL *m_pLCD = nullptr;
+				std::atomic<float> m_fX {0.01f}, m_fY {0.01f}, m_fZ {0.01f}; // Metres, as MK3SGL
+				std::atomic_bool m_bSD {true};
+		};
+
+		// Set from the command line (--farm) before the printers are created.
+		static void SetEnabled(bool bVal) { GetEnabled() = bVal; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		static FarmView& Get();
+
+		// Creates the window, after glutInit. fcnKey gets the keys pressed in it, the window closes
+		// itself when fcnDone says the boards have all finished.
+		void Open(const std::string &strTitle, std::function<void(unsigned char)> fcnKey, std::function<bool()> fcnDone);
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		void Add(Slot *pSlot);
+		void Remove(Slot *pSlot);
+
+		void Draw();
+		void DrawLCD(HD44780GL *pLCD);
+		void ResizeCB(int w, int h);
+		void MouseCB(int button, int action, int x, int y);
+		void MotionCB(int x, int y);
+		void TimerCB();
+		void ResetCamera();
+
+		std::mutex m_lock; // Guards m_vSlots, printers can come and go while the GL thread draws.
+		std::vector<Slot*> m_vSlots;
+
+		std::unique_ptr<OBJCollection> m_pObjs;
+		bool m_bLoaded = false;
+		int m_iWindow = 0;
+		Camera m_camera;
+		std::function<void(unsigned char)> m_fcnKey;
+		std::function<bool()> m_fcnDone;
+
+		// Per-class offsets for this frame, in model metres; kept to avoid reallocating.
+		std::vector<float> m_vBase, m_vX, m_vY, m_vZ, m_vMedia;
+
+		static constexpr float m_fPitchX = 0.6f, m_fPitchZ = 0.75f; // Grid cell, model metres
+		static constexpr int m_iFrameMs = 33;
+};
@@ -0,0 +1,133 @@
+/*
+	FastBoot.cpp - Boots the firmware without its boot-time waits.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FastBoot.h"
+#include <stdio.h>          // for printf
+#include "ELFSymbols.h"     // for ELFSymbols, ELFSymbols::Symbol_t
+#include "sim_regbit.h"     // for avr_regbit_t, avr_regbit_set, avr_regbit_setto
+
+thread_local FastBoot* FastBoot::m_pCurrent = nullptr;
+
+// Either the name itself or the mangled name of a C++ function of no arguments, e.g. _Z4loopv.
+static bool IsNamed(const std::string &strSym, const std::string &strName)
+{
+	return strSym == strName || strSym == "_Z" + std::to_string(strName.size()) + strName + "v";
+}
+
+void FastBoot::AddSymbols(const std::string &strELF)
+{
+	std::vector<ELFSymbols::Symbol_t> vSyms;
+	if (!ELFSymbols::Read(strELF, vSyms))
+		return;
+	for (auto &sym : vSyms)
+	{
+		if (!sym.bFunc || sym.uiAddr >= ELFSymbols::m_uiDataOffset)
+			continue;
+		if (IsNamed(sym.strName, "loop"))
+			m_uiLoop = sym.uiAddr;
+		for (auto &strName : GetSkipList())
+			if (IsNamed(sym.strName, strName))
+			{
+				m_vNames.push_back(strName);
+				m_vAddrs.push_back(sym.uiAddr);
+			}
+	}
+	for (auto &strName : GetSkipList())
+	{
+		bool bFound = false;
+		for (auto &strFound : m_vNames)
+			bFound |= strFound == strName;
+		if (!bFound)
+			printf("FastBoot: %s has no function %s, not skipping it.\n", strELF.c_str(), strName.c_str());
+	}
+}
+
+void FastBoot::Init(avr_t *avr)
+{
+	m_pAVR = avr;
+	// What the firmware finds after a power-on, whatever a bootloader would have left.
+	avr_regbit_t MCUSR = avr->reset_flags.porf;
+	MCUSR.mask = 0xFF;
+	MCUSR.bit = 0;
+	avr_regbit_setto(avr, MCUSR, 0);
+	avr_regbit_set(avr, avr->reset_flags.porf);
+	if (m_vAddrs.empty())
+		return;
+	if (m_uiLoop == UINT32_MAX)
+	{
+		printf("FastBoot: the firmware has no loop(), so it can't tell when boot is over. Not skipping anything.\n");
+		return;
+	}
+	m_vAction.assign((avr->flashend + 1U)>>1U, None);
+	for (auto uiAddr : m_vAddrs)
+		if (uiAddr <= avr->flashend)
+			m_vAction[uiAddr>>1U] = Skip;
+	if (m_uiLoop <= avr->flashend)
+		m_vAction[m_uiLoop>>1U] = Booted;
+	m_vCalls.assign(m_vAddrs.size(), 0);
+	m_fcnRun = avr->run;
+	avr->run = OnRun;
+}
+
+void FastBoot::OnRun(avr_t *avr)
+{
+	FastBoot *p = m_pCurrent;
+	if (avr->pc <= avr->flashend) // A stray PC is for the core to report.
+	{
+		switch (p->m_vAction[avr->pc>>1U])
+		{
+			case Skip:
+				for (size_t i=0; i<p->m_vAddrs.size(); i++)
+					p->m_vCalls[i] += p->m_vAddrs[i] == avr->pc;
+				p->Return();
+				break;
+			case Booted:
+				p->Finish();
+				break;
+			default:
+				break;
+		}
+	}
+	p->m_fcnRun(avr);
+}
+
+void FastBoot::Return()
+{
+	uint16_t uiSP = m_pAVR->data[R_SPL] | (m_pAVR->data[R_SPH]<<8U);
+	uint32_t uiPC = 0;
+	for (unsigned int i=0; i<m_pAVR->address_size; i++)
+		uiPC = (uiPC<<8U) | m_pAVR->data[++uiSP];
+	m_pAVR->data[R_SPL] = uiSP & 0xFFU;
+	m_pAVR->data[R_SPH] = uiSP >> 8U;
+	m_pAVR->pc = uiPC<<1U;
+}
+
+void FastBoot::Finish()
+{
+	// Nothing to check from here on, so unwrap if nothing has wrapped us since.
+	if (m_pAVR->run == OnRun)
+		m_pAVR->run = m_fcnRun;
+	m_vAction.assign(m_vAction.size(), None);
+	printf("FastBoot: booted at cycle %llu", static_cast<unsigned long long>(m_pAVR->cycle));
+	for (size_t i=0; i<m_vNames.size(); i++)
+		printf(", skipped %s %u times", m_vNames[i].c_str(), m_vCalls[i]);
+	printf(".\n");
+}
@@ -0,0 +1,78 @@
+/*
+	FastBoot.h - Boots the firmware without its boot-time waits.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint32_t, uint8_t, UINT32_MAX
+#include <string>           // for string
+#include <vector>           // for vector
+#include "sim_avr.h"        // for avr_t
+
+// The board starts at the firmware (never the bootloader) with MCUSR reading as a power-on reset,
+// and, until the firmware first enters loop(), any call to one of the named functions returns
+// at once, e.g. the LCD splash or delay(). Only name functions that return nothing and that boot
+// is fine without, their callers see no difference but the time it didn't take.
+// The skips come from a wrapper around avr->run, which takes itself out again at loop().
+class FastBoot
+{
+	public:
+		// Set from the command line before the boards are created.
+		static void SetEnabled(bool bEnabled) { GetEnabled() = bEnabled; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		// Names (plain or the C++ name of a function without arguments) to skip during boot.
+		static void SetSkipList(const std::vector<std::string> &vNames) { GetSkipList() = vNames; }
+
+		// Finds the skipped functions and loop() in an ELF/AFX file. HEX files have neither.
+		void AddSymbols(const std::string &strELF);
+
+		// Sets up the power-on MCUSR and wraps avr->run, so call after anything else that replaces it (e.g. Coverage).
+		void Init(avr_t *avr);
+
+		// Selects the instance for the AVR running on this thread. Call on the AVR thread before running.
+		static inline void Select(FastBoot *pFastBoot) { m_pCurrent = pFastBoot; }
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+		static std::vector<std::string>& GetSkipList() { static std::vector<std::string> vNames; return vNames; }
+
+		static void OnRun(avr_t *avr);
+		// Does what a RET at the current PC would.
+		void Return();
+		void Finish();
+
+		// Per flash word, what to do on reaching it.
+		enum Action_t : uint8_t
+		{
+			None,
+			Skip,
+			Booted
+		};
+
+		avr_t *m_pAVR = nullptr;
+		void (*m_fcnRun)(avr_t *avr) = nullptr; // The run function we wrapped
+		std::vector<uint8_t> m_vAction;
+		std::vector<std::string> m_vNames; // Of the skipped functions, for the report.
+		std::vector<uint32_t> m_vAddrs, m_vCalls; // Byte addresses, and calls skipped.
+		uint32_t m_uiLoop = UINT32_MAX;
+
+		static thread_local FastBoot *m_pCurrent;
+};
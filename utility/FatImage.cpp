@@ -22,12 +22,18 @@
  */
 
 #include "FatImage.h"
-#include <fcntl.h>      // for open, O_CREAT, O_WRONLY, SEEK_SET
-#include <stdio.h>      // for perror
-#include <stdlib.h>     // for exit
-#include <unistd.h>     // for close, ftruncate, lseek, write
-#include <type_traits>  // for __decay_and_strip<>::__type
-#include <vector>       // for vector
+#include <fcntl.h>        // for open, O_CREAT, O_WRONLY, O_RDONLY
+#include <stdio.h>        // for perror, fprintf, stderr
+#include <stdlib.h>       // for exit
+#include <sys/stat.h>     // for stat, S_ISREG
+#include <time.h>         // for time_t
+#include <unistd.h>       // for close, ftruncate, pwrite, pread
+#include <algorithm>      // for min, transform
+#include <cstring>        // for memcmp, memcpy, memset
+#include <set>            // for set
+#include <type_traits>    // for __decay_and_strip<>::__type
+#include <vector>         // for vector
+#include "VirtualFat.h"   // for VirtualFat
 
 // const map<FatImage::Size, uint32_t>FatImage::SectorsPerFat =
 // {
@@ -70,7 +76,7 @@ const uint8_t FatImage::FSInfo_3[] = {0x55, 0xAA};
 const uint8_t FatImage::DataRegion[] = { 0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x08,0x00,0x00,0x57,0x49,
 											0xCD,0x50,0xCD,0x50,0x00,0x00,0x57,0x49,0xCD,0x50};
 
-bool FatImage::MakeFatImage(string strFile, string strSize)
+bool FatImage::MakeFatImage(string strFile, string strSize, const vector<string> &vFiles)
 {
 	FatImage::Size size = NameToSize.at(strSize);
 	int fd = open(strFile.c_str(), O_WRONLY | O_CREAT, 0644);
@@ -81,7 +87,8 @@ bool FatImage::MakeFatImage(string strFile, string strSize)
 
 	uint32_t uiSize = GetSizeInBytes(size);
 
-	if (ftruncate(fd, uiSize)==-1)
+	// Start from an empty file so everything we don't write is a hole that reads as zero.
+	if (ftruncate(fd, 0)==-1 || ftruncate(fd, uiSize)==-1)
 	{
 		perror(strFile.c_str());
 		exit(1);
@@ -134,11 +141,353 @@ bool FatImage::MakeFatImage(string strFile, string strSize)
 	data.resize(GetDataStartAddr(size));
 	data.insert(data.end(), DataRegion, DataRegion+26);
 
-	lseek(fd,SEEK_SET, 0);
-	size_t s = write(fd,data.data(),data.size());
-	if(s != data.size())
+	if (!vFiles.empty() && !AddFiles(data, size, fd, vFiles))
+	{
+		close(fd);
+		return false;
+	}
+
+	// Most of the FAT area is zero, only write the blocks that aren't so the image stays sparse.
+	static constexpr size_t uiBlock = 4096;
+	static const uint8_t zeros[uiBlock] = {0};
+	bool bOK = true;
+	for (size_t uiPos = 0; uiPos < data.size(); uiPos += uiBlock)
+	{
+		size_t uiLen = min(uiBlock, data.size() - uiPos);
+		if (memcmp(data.data() + uiPos, zeros, uiLen)==0)
+			continue;
+		bOK &= pwrite(fd, data.data() + uiPos, uiLen, uiPos) == static_cast<ssize_t>(uiLen);
+	}
+	if(!bOK)
 		fprintf(stderr,"Failed to write full file to disk.\n");
 
 	close(fd);
 	return true;
 }
+
+bool FatImage::AddFiles(vector<uint8_t> &data, Size imgSize, int fd, const vector<string> &vFiles)
+{
+	typedef struct File_t
+	{
+		string strPath, strName;
+		uint8_t shortName[11];
+		bool bLFN;
+		uint32_t uiSize;
+		time_t tMod;
+	} File_t;
+
+	uint32_t uiClusterBytes = Sector2Bytes(GetSectorsPerCluster(imgSize));
+	uint32_t uiDataStart = GetDataStartAddr(imgSize);
+	uint32_t uiFree = (GetSizeInBytes(imgSize) - uiDataStart)/uiClusterBytes;
+
+	vector<File_t> vToAdd;
+	set<string> used, names;
+	uint32_t uiEntries = 2; // The volume label and the end marker.
+	uint64_t uiNeeded = 0;
+	for (auto &strPath : vFiles)
+	{
+		struct stat st;
+		if (stat(strPath.c_str(), &st) != 0)
+		{
+			perror(strPath.c_str());
+			return false;
+		}
+		if (!S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) > 0xFFFFFFFFULL)
+		{
+			fprintf(stderr, "FatImage: %s is not a file that fits on a FAT card.\n", strPath.c_str());
+			return false;
+		}
+		File_t file;
+		file.strPath = strPath;
+		file.strName = strPath.substr(strPath.rfind('/') + 1); // npos + 1 is the whole string.
+		if (!names.insert(file.strName).second)
+		{
+			fprintf(stderr, "FatImage: %s is in the list twice, they all go in the root directory.\n", file.strName.c_str());
+			return false;
+		}
+		file.bLFN = VirtualFat::MakeShortName(file.strName, used, file.shortName);
+		file.uiSize = st.st_size;
+		file.tMod = st.st_mtime;
+		uiEntries += VirtualFat::EntriesFor(file.strName, file.bLFN);
+		uiNeeded += (file.uiSize + uiClusterBytes - 1)/uiClusterBytes;
+		vToAdd.push_back(file);
+	}
+	uint32_t uiRootClusters = (uiEntries*32 + uiClusterBytes - 1)/uiClusterBytes;
+	if (uiNeeded + uiRootClusters > uiFree)
+	{
+		fprintf(stderr, "FatImage: The files don't fit on the image, pick a larger --image-size.\n");
+		return false;
+	}
+
+	data.resize(uiDataStart + uiRootClusters*uiClusterBytes);
+	auto fcnChain = [&data, imgSize](uint32_t uiFirst, uint32_t uiCount)
+	{
+		ui32_cvt_ui8 cvt;
+		for (uint32_t i = 0; i < uiCount; i++)
+		{
+			cvt.all = (i + 1 == uiCount) ? 0x0FFFFFFF : uiFirst + i + 1;
+			for (int j = 0; j < 4; j++)
+				data[FirstFATAddr + 4*(uiFirst + i) + j] = data[GetSecondFatAddr(imgSize) + 4*(uiFirst + i) + j] = cvt.bytes[j];
+		}
+	};
+	fcnChain(2, uiRootClusters); // The root starts at cluster 2, with the label.
+
+	// Files go one after the other, each written straight to its clusters.
+	uint8_t *pEntry = data.data() + uiDataStart + 32;
+	uint32_t uiNext = 2 + uiRootClusters;
+	vector<uint8_t> vBuf(1U<<16U);
+	for (auto &file : vToAdd)
+	{
+		uint32_t uiCount = (file.uiSize + uiClusterBytes - 1)/uiClusterBytes;
+		uint32_t uiCluster = uiCount ? uiNext : 0;
+		fcnChain(uiCluster, uiCount);
+		if (file.bLFN)
+			pEntry = VirtualFat::WriteLongName(pEntry, file.strName, file.shortName);
+		VirtualFat::WriteEntry(pEntry, file.shortName, VirtualFat::ATTR_ARCHIVE, uiCluster, file.uiSize, file.tMod);
+		pEntry += 32;
+
+		int fdIn = open(file.strPath.c_str(), O_RDONLY);
+		if (fdIn < 0)
+		{
+			perror(file.strPath.c_str());
+			return false;
+		}
+		off_t uiOut = uiDataStart + static_cast<off_t>(uiCluster - 2)*uiClusterBytes;
+		for (uint32_t uiPos = 0; uiPos < file.uiSize;)
+		{
+			ssize_t iRead = pread(fdIn, vBuf.data(), min<size_t>(vBuf.size(), file.uiSize - uiPos), uiPos);
+			if (iRead <= 0 || pwrite(fd, vBuf.data(), iRead, uiOut + uiPos) != iRead)
+			{
+				perror(file.strPath.c_str());
+				close(fdIn);
+				return false;
+			}
+			uiPos += iRead;
+		}
+		close(fdIn);
+		uiNext += uiCount;
+	}
+
+	// FSInfo's next free cluster hint, the free count is left as unknown.
+	ui32_cvt_ui8 cvt;
+	cvt.all = uiNext;
+	for (int i=0; i<4; i++)
+		data[0x3EC+i] = cvt.bytes[i];
+	printf("Added %zu files to the image.\n", vToAdd.size());
+	return true;
+}
+
+bool FatImage::PutFile(uint8_t *pData, uint64_t uiSize, const string &strHost, const string &strName,
+	const function<void(uint64_t, size_t)> &fcnTouch)
+{
+	auto fcnGet16 = [](const uint8_t *p) { return static_cast<uint32_t>(p[0] | (p[1]<<8U)); };
+	auto fcnGet32 = [&fcnGet16](const uint8_t *p) { return fcnGet16(p) | (fcnGet16(p+2)<<16U); };
+	auto fcnLower = [](string str) { transform(str.begin(), str.end(), str.begin(), ::tolower); return str; };
+
+	if (strName.empty() || strName.size() > 255 || strName.find('/') != string::npos)
+	{
+		fprintf(stderr, "FatImage: %s isn't a name for the root directory.\n", strName.c_str());
+		return false;
+	}
+	struct stat st;
+	if (stat(strHost.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) > 0xFFFFFFFFULL)
+	{
+		fprintf(stderr, "FatImage: %s is not a file that fits on a FAT card.\n", strHost.c_str());
+		return false;
+	}
+
+	// The volume's layout, from its boot sector.
+	uint32_t uiSPC = pData[13], uiReserved = fcnGet16(pData + 14), uiFats = pData[16];
+	uint32_t uiFatSectors = fcnGet32(pData + 36), uiRoot = fcnGet32(pData + 44);
+	uint64_t uiFatStart = Sector2Bytes(uiReserved);
+	uint64_t uiDataStart = uiFatStart + static_cast<uint64_t>(Sector2Bytes(uiFatSectors))*uiFats;
+	if (uiSize < 512 || fcnGet16(pData + 11) != 512 || uiSPC == 0 || (uiSPC & (uiSPC - 1)) || !uiFats || fcnGet16(pData + 17) != 0 || !uiFatSectors || uiDataStart >= uiSize)
+	{
+		fprintf(stderr, "FatImage: The card isn't a FAT32 volume.\n");
+		return false;
+	}
+	uint32_t uiClusterBytes = Sector2Bytes(uiSPC);
+	uint64_t uiVolume = min<uint64_t>(uiSize, Sector2Bytes(fcnGet32(pData + 32)));
+	uint32_t uiLast = min<uint64_t>((uiVolume - uiDataStart)/uiClusterBytes, Sector2Bytes(uiFatSectors)/4U - 2U) + 1U;
+
+	auto fcnGetFat = [&](uint32_t uiCl) { return fcnGet32(pData + uiFatStart + 4U*uiCl) & 0x0FFFFFFFU; };
+	auto fcnSetFat = [&](uint32_t uiCl, uint32_t uiVal)
+	{
+		for (uint32_t i = 0; i < uiFats; i++)
+		{
+			uint8_t *p = pData + uiFatStart + static_cast<uint64_t>(Sector2Bytes(uiFatSectors))*i + 4U*uiCl;
+			ui32_cvt_ui8 cvt;
+			cvt.all = (fcnGet32(p) & 0xF0000000U) | uiVal;
+			memcpy(p, cvt.bytes, 4);
+		}
+	};
+	auto fcnCluster = [&](uint32_t uiCl) { return uiDataStart + static_cast<uint64_t>(uiCl - 2U)*uiClusterBytes; };
+	auto fcnValid = [&](uint32_t uiCl) { return uiCl >= 2 && uiCl <= uiLast; };
+	uint32_t uiSearch = 2;
+	auto fcnAlloc = [&]() -> uint32_t
+	{
+		for (; uiSearch <= uiLast; uiSearch++)
+			if (fcnGetFat(uiSearch) == 0)
+				return uiSearch++;
+		return 0;
+	};
+
+	// Walk the root directory: note the short names in use, find any existing file to replace.
+	vector<uint8_t*> vSlots;
+	uint32_t uiTail = 0;
+	for (uint32_t uiCl = uiRoot, uiHops = 0; fcnValid(uiCl) && uiHops <= uiLast; uiCl = fcnGetFat(uiCl), uiHops++)
+	{
+		uiTail = uiCl;
+		for (uint32_t uiOff = 0; uiOff < uiClusterBytes; uiOff += 32)
+			vSlots.push_back(pData + fcnCluster(uiCl) + uiOff);
+	}
+	if (vSlots.empty())
+	{
+		fprintf(stderr, "FatImage: The card's root directory is damaged.\n");
+		return false;
+	}
+	set<string> used;
+	string strLong, strWant = fcnLower(strName);
+	size_t uiLongStart = 0, uiEnd = vSlots.size();
+	for (size_t i = 0; i < vSlots.size(); i++)
+	{
+		uint8_t *pEntry = vSlots[i];
+		if (pEntry[0] == 0)
+		{
+			uiEnd = i;
+			break;
+		}
+		if (pEntry[0] == 0xE5)
+		{
+			strLong.clear();
+			continue;
+		}
+		if (pEntry[11] == VirtualFat::ATTR_LFN)
+		{
+			static const uint8_t offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+			uint32_t uiOrd = pEntry[0] & 0x3FU;
+			if (pEntry[0] & 0x40U)
+			{
+				strLong.assign(13U*uiOrd, '\0');
+				uiLongStart = i;
+			}
+			for (int j = 0; j < 13 && uiOrd && 13U*uiOrd <= strLong.size(); j++)
+				strLong[(uiOrd - 1)*13 + j] = static_cast<char>(fcnGet16(pEntry + offsets[j]) & 0xFFU);
+			continue;
+		}
+		string strShort(reinterpret_cast<char*>(pEntry), 11);
+		used.insert(strShort);
+		strLong = strLong.substr(0, strLong.find('\0'));
+		if (strLong.empty())
+		{
+			string strBase = strShort.substr(0, 8), strExt = strShort.substr(8);
+			strBase.erase(strBase.find_last_not_of(' ') + 1); // npos + 1 = 0, all spaces.
+			strExt.erase(strExt.find_last_not_of(' ') + 1);
+			strLong = strExt.empty() ? strBase : strBase + "." + strExt;
+			uiLongStart = i;
+		}
+		if (!(pEntry[11] & (VirtualFat::ATTR_DIR | 0x08U)) && fcnLower(strLong) == strWant)
+		{
+			// Replace it: free its entries and its clusters.
+			for (size_t j = uiLongStart; j <= i; j++)
+				vSlots[j][0] = 0xE5;
+			used.erase(strShort);
+			uint32_t uiCl = fcnGet16(pEntry + 20)<<16U | fcnGet16(pEntry + 26);
+			for (uint32_t uiHops = 0; fcnValid(uiCl) && uiHops <= uiLast; uiHops++)
+			{
+				uint32_t uiNext = fcnGetFat(uiCl);
+				fcnSetFat(uiCl, 0);
+				uiCl = uiNext;
+			}
+		}
+		strLong.clear();
+	}
+
+	uint8_t shortName[11];
+	bool bLFN = VirtualFat::MakeShortName(strName, used, shortName);
+	size_t uiNeed = VirtualFat::EntriesFor(strName, bLFN);
+
+	// A run of free slots, or the end of the directory, growing it a cluster at a time if need be.
+	size_t uiAt = 0, uiRun = 0;
+	for (size_t i = 0; i < uiEnd && uiRun < uiNeed; i++)
+	{
+		uiRun = vSlots[i][0] == 0xE5 ? uiRun + 1 : 0;
+		uiAt = i + 1 - uiRun;
+	}
+	if (uiRun < uiNeed)
+	{
+		uiAt = uiEnd;
+		while (vSlots.size() < uiAt + uiNeed + 1) // Keep an end marker, it's tidier.
+		{
+			uint32_t uiCl = fcnAlloc();
+			if (!uiCl)
+			{
+				fprintf(stderr, "FatImage: The card is full.\n");
+				return false;
+			}
+			fcnTouch(fcnCluster(uiCl), uiClusterBytes);
+			memset(pData + fcnCluster(uiCl), 0, uiClusterBytes);
+			fcnSetFat(uiTail, uiCl);
+			fcnSetFat(uiCl, 0x0FFFFFFF);
+			uiTail = uiCl;
+			for (uint32_t uiOff = 0; uiOff < uiClusterBytes; uiOff += 32)
+				vSlots.push_back(pData + fcnCluster(uiCl) + uiOff);
+		}
+	}
+
+	// The data, a cluster at a time into whatever is free.
+	int fdIn = open(strHost.c_str(), O_RDONLY);
+	if (fdIn < 0)
+	{
+		perror(strHost.c_str());
+		return false;
+	}
+	uint32_t uiFirst = 0, uiPrev = 0;
+	uint64_t uiPos = 0;
+	for (; uiPos < static_cast<uint64_t>(st.st_size); uiPos += uiClusterBytes)
+	{
+		uint32_t uiCl = fcnAlloc();
+		if (!uiCl)
+		{
+			fprintf(stderr, "FatImage: The card is full.\n");
+			break;
+		}
+		fcnTouch(fcnCluster(uiCl), uiClusterBytes);
+		size_t uiLen = min<uint64_t>(uiClusterBytes, st.st_size - uiPos);
+		if (pread(fdIn, pData + fcnCluster(uiCl), uiLen, uiPos) != static_cast<ssize_t>(uiLen))
+		{
+			perror(strHost.c_str());
+			break;
+		}
+		fcnSetFat(uiCl, 0x0FFFFFFF);
+		if (uiPrev)
+			fcnSetFat(uiPrev, uiCl);
+		else
+			uiFirst = uiCl;
+		uiPrev = uiCl;
+	}
+	close(fdIn);
+	if (uiPos < static_cast<uint64_t>(st.st_size))
+	{
+		// Give back what was taken, the card is as it was less any file replaced.
+		for (uint32_t uiCl = uiFirst, uiHops = 0; fcnValid(uiCl) && uiHops <= uiLast; uiHops++)
+		{
+			uint32_t uiNext = fcnGetFat(uiCl);
+			fcnSetFat(uiCl, 0);
+			uiCl = uiNext;
+		}
+		return false;
+	}
+
+	uint8_t entries[32*21]; // The longest name this takes is 255.
+	uint8_t *pEntry = bLFN ? VirtualFat::WriteLongName(entries, strName, shortName) : entries;
+	VirtualFat::WriteEntry(pEntry, shortName, VirtualFat::ATTR_ARCHIVE, uiFirst, st.st_size, st.st_mtime);
+	for (size_t i = 0; i < uiNeed; i++)
+		memcpy(vSlots[uiAt + i], entries + 32*i, 32);
+
+	// The FSInfo free count is now stale, mark it unknown.
+	uint32_t uiInfo = fcnGet16(pData + 48);
+	if (uiInfo && Sector2Bytes(uiInfo) + 512 <= uiDataStart)
+		memset(pData + Sector2Bytes(uiInfo) + 488, 0xFF, 4);
+	return true;
+}
@@ -23,11 +23,13 @@
 
 #pragma once
 
-#include <stdint.h>  // for uint32_t, uint8_t
-#include <map>       // for _Rb_tree_const_iterator, map
-#include <string>    // for string
-#include <utility>   // for pair
-#include <vector>    // for vector
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint32_t, uint8_t, uint64_t
+#include <functional>  // for function
+#include <map>         // for _Rb_tree_const_iterator, map
+#include <string>      // for string
+#include <utility>     // for pair
+#include <vector>      // for vector
 
 using namespace std;
 
@@ -46,7 +48,13 @@ class FatImage
 			G2 = 2048
 		};
 
-		static bool MakeFatImage(string strFile, string strSize);
+		// Makes a new (sparse) image, with any vFiles copied into its root directory.
+		static bool MakeFatImage(string strFile, string strSize, const vector<string> &vFiles = {});
+
+		// Copies a host file into the root directory of the FAT32 volume at pData (e.g. a mounted card),
+		// replacing any file of the same name. fcnTouch is called on each byte range ahead of writing it.
+		static bool PutFile(uint8_t *pData, uint64_t uiSize, const string &strHost, const string &strName,
+			const function<void(uint64_t, size_t)> &fcnTouch);
 
 		static vector<string> GetSizes()
 		{
@@ -77,6 +85,9 @@ class FatImage
 
 		static uint32_t GetDataStartAddr(Size imgSize) { return FirstFATAddr + (Sector2Bytes(SectorsPerFat(imgSize))<<1); } // <<10 = 2*512, 2*bytespersector.
 
+		// Lays out the files after the root directory (extending it as needed) in data, and writes their contents to fd.
+		static bool AddFiles(vector<uint8_t> &data, Size imgSize, int fd, const vector<string> &vFiles);
+
 		static uint32_t SectorsPerFat(Size size)
 		{
 			switch (size)
@@ -0,0 +1,195 @@
+/*
+	FirmwareCache.cpp - Parses each firmware file once per process and shares
+	the resulting flash image between boards as a copy-on-write mapping.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FirmwareCache.h"
+#include <stdlib.h>    // for free
+#include <sys/mman.h>  // for mmap, MAP_FAILED, MAP_PRIVATE, PROT_READ
+#include <sys/stat.h>  // for stat
+#include <unistd.h>    // for ftruncate, pwrite, sysconf, _SC_PAGESIZE
+#include <algorithm>   // for min, sort
+#include <cstring>     // for memcpy, memcmp
+#include "sim_hex.h"   // for read_ihex_file
+
+map<string, unique_ptr<FirmwareCache::Firmware_t>> FirmwareCache::m_mFirmware;
+map<string, FirmwareCache::Image_t> FirmwareCache::m_mImages;
+map<string, string> FirmwareCache::m_mStamps;
+mutex FirmwareCache::m_lock;
+vector<unique_ptr<FirmwareCache::Firmware_t>> FirmwareCache::m_vRetired;
+
+string FirmwareCache::GetStamp(const string &strFile)
+{
+	struct stat st {};
+	if (stat(strFile.c_str(), &st) < 0)
+		return "";
+#if defined(__APPLE__)
+	const struct timespec &tsMTime = st.st_mtimespec;
+#else
+	const struct timespec &tsMTime = st.st_mtim;
+#endif
+	return to_string(st.st_size) + "@" + to_string(tsMTime.tv_sec) + "." + to_string(tsMTime.tv_nsec);
+}
+
+const FirmwareCache::Firmware_t* FirmwareCache::Load(const string &strFile)
+{
+	lock_guard<mutex> guard(m_lock);
+	string strStamp = GetStamp(strFile);
+	auto it = m_mFirmware.find(strFile);
+	if (it != m_mFirmware.end())
+	{
+		if (m_mStamps[strFile] == strStamp)
+			return it->second.get();
+		if (it->second)
+			m_vRetired.push_back(move(it->second));
+	}
+	m_mStamps[strFile] = strStamp;
+
+	unique_ptr<Firmware_t> pFW {new Firmware_t()};
+	pFW->strFile = strFile;
+	bool bOK = false;
+	if (strFile.size()>4)
+	{
+		if (0==strFile.compare(strFile.size()-4, 4, ".hex"))
+		{
+			uint32_t uiSize = 0, uiStart = 0;
+			uint8_t *puiBytes = read_ihex_file(strFile.c_str(),&uiSize, &uiStart);
+			if (puiBytes)
+			{
+				pFW->vFlash.assign(puiBytes, puiBytes + uiSize);
+				pFW->uiBase = uiStart;
+				free(puiBytes);
+				bOK = true;
+			}
+		}
+		else if(0==strFile.compare(strFile.size()-4, 4, ".afx") ||
+				0==strFile.compare(strFile.size()-4, 4, ".elf"))
+		{
+			pFW->bELF = true;
+			if (elf_read_firmware(strFile.c_str(), &pFW->elf)==0)
+			{
+				pFW->vFlash.assign(pFW->elf.flash, pFW->elf.flash + pFW->elf.flashsize);
+				pFW->uiBase = pFW->elf.flashbase;
+				free(pFW->elf.flash); // We have our own copy now.
+				pFW->elf.flash = nullptr;
+				bOK = true;
+			}
+		}
+	}
+	if (!bOK)
+		pFW.reset(); // Remember the failure too, so it is only reported once per board.
+	return (m_mFirmware[strFile] = move(pFW)).get();
+}
+
+const FirmwareCache::Image_t* FirmwareCache::GetImage(size_t uiFlash, size_t uiMap, const vector<const Firmware_t*> &vFW)
+{
+	string strKey = to_string(uiFlash);
+	for (auto pFW : vFW) // By address, a rebuilt file is a different image. Parsed files are never freed.
+		strKey.append("|").append(to_string(reinterpret_cast<uintptr_t>(pFW)));
+	Image_t &img = m_mImages[strKey];
+	if (img.pFile)
+		return &img;
+
+	vector<uint8_t> vImage(uiMap, 0xFF); // Erased flash.
+	for (auto pFW : vFW)
+	{
+		if (pFW->uiBase + pFW->vFlash.size() > uiFlash)
+		{
+			fprintf(stderr, "ERROR: %s does not fit in flash, skipping it.\n",pFW->strFile.c_str());
+			continue;
+		}
+		memcpy(vImage.data() + pFW->uiBase, pFW->vFlash.data(), pFW->vFlash.size());
+		img.vCovered.push_back({pFW->uiBase, pFW->uiBase + pFW->vFlash.size()});
+	}
+	sort(img.vCovered.begin(), img.vCovered.end());
+	vector<pair<uint32_t, uint32_t>> vMerged;
+	for (auto &range : img.vCovered)
+	{
+		if (!vMerged.empty() && range.first <= vMerged.back().second)
+			vMerged.back().second = max(vMerged.back().second, range.second);
+		else
+			vMerged.push_back(range);
+	}
+	img.vCovered = vMerged;
+
+	FILE *pFile = tmpfile();
+	if (!pFile || ftruncate(fileno(pFile), uiMap)<0 || pwrite(fileno(pFile), vImage.data(), uiMap, 0) != static_cast<ssize_t>(uiMap))
+	{
+		perror("FirmwareCache");
+		if (pFile)
+			fclose(pFile);
+		m_mImages.erase(strKey);
+		return nullptr;
+	}
+	img.pFile = pFile;
+	img.uiSize = uiMap;
+	return &img;
+}
+
+size_t FirmwareCache::Map(avr_t *pAVR, const vector<const Firmware_t*> &vFW)
+{
+	if (vFW.empty())
+		return 0;
+	lock_guard<mutex> guard(m_lock);
+	size_t uiFlash = pAVR->flashend + 1;
+	size_t uiPage = sysconf(_SC_PAGESIZE);
+	size_t uiMap = ((uiFlash + 4 + uiPage - 1)/uiPage)*uiPage; // SimAVR may read a few bytes past flashend when decoding.
+
+	const Image_t *pImg = GetImage(uiFlash, uiMap, vFW);
+	uint8_t *pMap = nullptr;
+	if (pImg)
+	{
+		void *p = mmap(nullptr, pImg->uiSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(pImg->pFile), 0);
+		if (p != MAP_FAILED)
+			pMap = static_cast<uint8_t*>(p);
+	}
+	if (!pMap)
+	{
+		fprintf(stderr, "WARN: Could not map shared flash image, copying firmware instead.\n");
+		for (auto pFW : vFW)
+			if (pFW->uiBase + pFW->vFlash.size() <= uiFlash)
+				memcpy(pAVR->flash + pFW->uiBase, pFW->vFlash.data(), pFW->vFlash.size());
+		return 0;
+	}
+
+	// Outside the firmware the flash keeps what it had (e.g. from the persisted flash file).
+	// Only copy the pages that actually differ so the rest stays shared.
+	uint32_t uiGap = 0;
+	auto fcnCopyGap = [&](uint32_t uiStart, uint32_t uiEnd)
+	{
+		while (uiStart < uiEnd)
+		{
+			uint32_t uiChunk = min<uint32_t>(uiEnd - uiStart, uiPage - (uiStart % uiPage));
+			if (memcmp(pMap + uiStart, pAVR->flash + uiStart, uiChunk)!=0)
+				memcpy(pMap + uiStart, pAVR->flash + uiStart, uiChunk);
+			uiStart += uiChunk;
+		}
+	};
+	for (auto &range : pImg->vCovered)
+	{
+		fcnCopyGap(uiGap, range.first);
+		uiGap = range.second;
+	}
+	fcnCopyGap(uiGap, uiFlash);
+
+	free(pAVR->flash);
+	pAVR->flash = pMap;
+	return pImg->uiSize;
+}
@@ -0,0 +1,81 @@
+/*
+	FirmwareCache.h - Parses each firmware file once per process and shares
+	the resulting flash image between boards as a copy-on-write mapping.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>         // for size_t
+#include <stdint.h>         // for uint8_t, uint32_t
+#include <stdio.h>          // for FILE
+#include <map>              // for map
+#include <memory>           // for unique_ptr
+#include <mutex>            // for mutex, lock_guard
+#include <string>           // for string
+#include <utility>          // for pair
+#include <vector>           // for vector
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_flashaddr_t
+#include "sim_elf.h"        // for elf_firmware_t
+
+using namespace std;
+
+// Boards are created from the main thread, but reload firmware from their own (see Board::ReloadFirmware).
+class FirmwareCache
+{
+	public:
+		typedef struct Firmware_t
+		{
+			string strFile;
+			bool bELF = false;
+			vector<uint8_t> vFlash;
+			avr_flashaddr_t uiBase = 0;
+			elf_firmware_t elf; // The ELF's non-flash contents (EEPROM, fuses...). Only valid if bELF.
+		} Firmware_t;
+
+		// Returns the parsed hex/elf/afx file, or nullptr if it could not be loaded.
+		// A file that changed on disk since it was parsed (e.g. rebuilt) is parsed again,
+		// boards still running the old one keep it.
+		static const Firmware_t* Load(const string &strFile);
+
+		// Replaces the AVR flash with a copy-on-write mapping of the given firmware images,
+		// laid over each other in order. Bytes not covered by any image keep their current values.
+		// Returns the mapping size for munmap(), or 0 if it fell back to copying into the existing flash.
+		static size_t Map(avr_t *pAVR, const vector<const Firmware_t*> &vFW);
+
+	private:
+		typedef struct Image_t
+		{
+			FILE *pFile = nullptr; // Anonymous temp file backing the shared pages.
+			size_t uiSize = 0;
+			vector<pair<uint32_t, uint32_t>> vCovered; // Sorted, merged [start, end) ranges written by the firmware.
+		} Image_t;
+
+		static const Image_t* GetImage(size_t uiFlash, size_t uiMap, const vector<const Firmware_t*> &vFW);
+
+		// Size and modification time, to notice a rebuild.
+		static string GetStamp(const string &strFile);
+
+		static mutex m_lock; // For Load() and Map()
+		static map<string, unique_ptr<Firmware_t>> m_mFirmware;
+		static map<string, string> m_mStamps; // Of each file as it was parsed
+		static vector<unique_ptr<Firmware_t>> m_vRetired; // Replaced by a rebuild, but possibly still mapped
+		static map<string, Image_t> m_mImages;
+};
@@ -0,0 +1,213 @@
+/*
+	FirmwareVars.cpp - Firmware globals, found by name in the ELF, as telemetry.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FirmwareVars.h"
+#include <stdio.h>           // for printf, fprintf, stderr
+#include <stdlib.h>          // for strtoul
+#include <string.h>          // for memcpy
+#include <map>               // for map
+#include <typeinfo>          // for typeid
+#include "ELFSymbols.h"      // for ELFSymbols, ELFSymbols::Symbol_t
+#include "IRQArena.h"        // for IRQArena
+#include "TelemetryHost.h"   // for TelemetryHost, TC
+
+bool FirmwareVars::SetDefaults(const std::vector<std::string> &vsVars, uint32_t uiRateUs)
+{
+	static const std::map<std::string, Type> mTypes = {
+		{"u8", Type::U8}, {"u16", Type::U16}, {"u32", Type::U32},
+		{"i8", Type::I8}, {"i16", Type::I16}, {"i32", Type::I32},
+		{"f", Type::Float},
+	};
+	GetRate() = uiRateUs ? uiRateUs : 1;
+	for (auto &strVar : vsVars)
+	{
+		Spec_t spec {strVar, strVar, 0, Type::Auto};
+		size_t uiColon = strVar.find(':');
+		if (uiColon != std::string::npos)
+		{
+			auto itType = mTypes.find(strVar.substr(uiColon + 1));
+			if (itType == mTypes.end())
+			{
+				fprintf(stderr, "ERROR: Unknown type in --fw-var %s, use one of u8 u16 u32 i8 i16 i32 f\n", strVar.c_str());
+				return false;
+			}
+			spec.eType = itType->second;
+			spec.strSymbol.erase(uiColon);
+		}
+		size_t uiPlus = spec.strSymbol.find('+');
+		if (uiPlus != std::string::npos)
+		{
+			char *pEnd = nullptr;
+			spec.uiOffset = strtoul(spec.strSymbol.c_str() + uiPlus + 1, &pEnd, 0);
+			if (*pEnd != '\0' || uiPlus + 1 == spec.strSymbol.size())
+			{
+				fprintf(stderr, "ERROR: Bad offset in --fw-var %s\n", strVar.c_str());
+				return false;
+			}
+			spec.strSymbol.erase(uiPlus);
+		}
+		if (spec.strSymbol.empty())
+		{
+			fprintf(stderr, "ERROR: No symbol name in --fw-var %s\n", strVar.c_str());
+			return false;
+		}
+		spec.strName = spec.strSymbol + (spec.uiOffset ? "_" + std::to_string(spec.uiOffset) : "");
+		GetSpecs().push_back(spec);
+	}
+	return true;
+}
+
+void FirmwareVars::AddSymbols(const std::string &strELF)
+{
+	std::vector<ELFSymbols::Symbol_t> vSyms;
+	if (!ELFSymbols::Read(strELF, vSyms))
+		return;
+	const std::vector<Spec_t> &vSpecs = GetSpecs();
+	m_vFound.resize(vSpecs.size(), false);
+	for (size_t i=0; i<vSpecs.size(); i++)
+	{
+		const Spec_t &spec = vSpecs[i];
+		const ELFSymbols::Symbol_t *pSym = m_vFound[i] ? nullptr : ELFSymbols::Find(vSyms, spec.strSymbol);
+		if (!pSym)
+			continue;
+		if (pSym->bFunc || pSym->uiAddr < ELFSymbols::m_uiDataOffset)
+		{
+			fprintf(stderr, "WARNING: --fw-var %s is not in SRAM, skipping it.\n", spec.strSymbol.c_str());
+			m_vFound[i] = true; // Don't look again.
+			continue;
+		}
+		uint64_t uiAddr = static_cast<uint64_t>(pSym->uiAddr) - ELFSymbols::m_uiDataOffset + spec.uiOffset;
+		if (uiAddr > UINT16_MAX)
+		{
+			fprintf(stderr, "WARNING: --fw-var %s is past the end of the data space, skipping it.\n", spec.strName.c_str());
+			m_vFound[i] = true;
+			continue;
+		}
+		Var_t var {i, static_cast<uint16_t>(uiAddr), 1, spec.eType, 0};
+		switch (spec.eType)
+		{
+			case Type::Auto:
+			{
+				uint32_t uiLeft = pSym->uiSize > spec.uiOffset ? pSym->uiSize - spec.uiOffset : 1;
+				var.eType = uiLeft >= 4 ? Type::U32 : (uiLeft >= 2 ? Type::U16 : Type::U8);
+				if (uiLeft > 4 || uiLeft == 3)
+					printf("FirmwareVars: %s is %u bytes, only its first %u are traced. Give an offset and type to pick others.\n",
+						spec.strName.c_str(), uiLeft, uiLeft > 4 ? 4U : 2U);
+				var.uiSize = var.eType == Type::U32 ? 4 : (var.eType == Type::U16 ? 2 : 1);
+				break;
+			}
+			case Type::U8:
+			case Type::I8:
+				var.uiSize = 1;
+				break;
+			case Type::U16:
+			case Type::I16:
+				var.uiSize = 2;
+				break;
+			case Type::U32:
+			case Type::I32:
+			case Type::Float:
+				var.uiSize = 4;
+				break;
+		}
+		m_vFound[i] = true;
+		m_vVars.push_back(var);
+	}
+}
+
+void FirmwareVars::Init(avr_t *avr, const std::string &strName)
+{
+	m_pAVR = avr;
+	m_vFound.resize(GetSpecs().size(), false);
+	for (size_t i=0; i<m_vFound.size(); i++)
+		if (!m_vFound[i])
+			printf("FirmwareVars: %s has no %s (not an ELF?)\n", strName.c_str(), GetSpecs()[i].strSymbol.c_str());
+	for (auto it = m_vVars.begin(); it != m_vVars.end();)
+	{
+		if (it->uiAddr + it->uiSize - 1U > m_pAVR->ramend)
+		{
+			fprintf(stderr, "WARNING: --fw-var %s is past the end of SRAM, skipping it.\n", GetSpecs()[it->uiSpec].strName.c_str());
+			it = m_vVars.erase(it);
+		}
+		else
+		{
+			m_vNames.push_back(GetSpecs()[it->uiSpec].strName.c_str());
+			it++;
+		}
+	}
+	if (m_vVars.empty())
+		return;
+	// One IRQ per variable found, which isn't known until now, so not through _Init.
+	m_pIrq = IRQArena::Get(avr).Alloc(typeid(FirmwareVars), m_vVars.size(), m_vNames.data());
+	auto pTH = TelemetryHost::GetHost();
+	for (size_t i=0; i<m_vVars.size(); i++)
+	{
+		Var_t &var = m_vVars[i];
+		var.uiLast = Read(var);
+		GetIRQ(i)->value = var.uiLast;
+		pTH->AddTrace(GetIRQ(i), strName + "_fw", {TC::Misc}, var.uiSize * 8U);
+		printf("FirmwareVars: %s at 0x%04x, %u byte(s)\n", m_vNames[i], var.uiAddr, var.uiSize);
+	}
+	RegisterTimerUsec(m_fcnSample, GetRate(), this);
+}
+
+uint32_t FirmwareVars::Read(const Var_t &var)
+{
+	uint32_t uiVal = 0;
+	for (unsigned int i=0; i<var.uiSize; i++) // AVR is little endian.
+		uiVal |= static_cast<uint32_t>(m_pAVR->data[var.uiAddr + i]) << (8U*i);
+	switch (var.eType)
+	{
+		case Type::I8:
+			return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(uiVal)));
+		case Type::I16:
+			return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int16_t>(uiVal)));
+		case Type::Float:
+		{
+			float fVal;
+			memcpy(&fVal, &uiVal, sizeof(fVal));
+			return static_cast<uint32_t>(static_cast<int32_t>(fVal * 256.f));
+		}
+		default:
+			return uiVal;
+	}
+}
+
+void FirmwareVars::OnAVRReset()
+{
+	if (!m_vVars.empty() && !avr_cycle_timer_status(m_pAVR, m_fcnSample, this))
+		RegisterTimerUsec(m_fcnSample, GetRate(), this);
+}
+
+avr_cycle_count_t FirmwareVars::OnSample(avr_t *avr, avr_cycle_count_t when)
+{
+	for (size_t i=0; i<m_vVars.size(); i++)
+	{
+		Var_t &var = m_vVars[i];
+		uint32_t uiVal = Read(var);
+		if (uiVal != var.uiLast)
+		{
+			var.uiLast = uiVal;
+			RaiseIRQ(i, uiVal);
+		}
+	}
+	return when + avr_usec_to_cycles(avr, GetRate());
+}
@@ -0,0 +1,96 @@
+/*
+	FirmwareVars.h - Firmware globals, found by name in the ELF, as telemetry.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint16_t, uint8_t
+#include <string>              // for string
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+
+// Each variable is a telemetry stream, <board>_fw_<name> in Misc, so -t, WaitFor, --tel-stats and
+// the flight recorder see firmware state without the firmware printing it. A variable is given as
+// name[+offset][:type], type one of u8 u16 u32 i8 i16 i32 f. Without one it is unsigned and the
+// size of the symbol (its first byte, if that is over 4). Floats are raised times 256, like the
+// temperatures, and signed values as their two's complement.
+// SimAVR only hooks writes to the I/O registers, not SRAM, so the values are sampled on a cycle
+// timer and raised when they change; anything that changes and changes back between samples is missed.
+class FirmwareVars: public BasePeripheral
+{
+	public:
+		// Set from the command line before the boards are created. Returns false, having said why, on a bad variable.
+		static bool SetDefaults(const std::vector<std::string> &vsVars, uint32_t uiRateUs);
+		static inline bool IsEnabled() { return !GetSpecs().empty(); }
+
+		// Looks up the variables not found yet in the firmware ELF/AFX.
+		void AddSymbols(const std::string &strELF);
+
+		// Adds the telemetry for those found and starts sampling. Call after the firmware is loaded.
+		void Init(avr_t *avr, const std::string &strName);
+
+		// An AVR reset drops the cycle timers, this picks the sampling back up.
+		void OnAVRReset();
+
+	private:
+		enum class Type
+		{
+			Auto,
+			U8,
+			U16,
+			U32,
+			I8,
+			I16,
+			I32,
+			Float
+		};
+
+		typedef struct Spec_t
+		{
+			std::string strSymbol, strName; // The name is the IRQ's, symbol_offset
+			uint32_t uiOffset;
+			Type eType;
+		} Spec_t;
+
+		typedef struct Var_t
+		{
+			size_t uiSpec; // Into GetSpecs()
+			uint16_t uiAddr; // Data address
+			uint8_t uiSize;
+			Type eType;
+			uint32_t uiLast;
+		} Var_t;
+
+		static std::vector<Spec_t>& GetSpecs() { static std::vector<Spec_t> vSpecs; return vSpecs; }
+		static uint32_t& GetRate() { static uint32_t uiRateUs = 1000; return uiRateUs; }
+
+		uint32_t Read(const Var_t &var);
+
+		avr_cycle_count_t OnSample(avr_t *avr, avr_cycle_count_t when);
+
+		avr_cycle_timer_t m_fcnSample = MAKE_C_TIMER_CALLBACK(FirmwareVars, OnSample);
+
+		std::vector<Var_t> m_vVars; // Those found, in the order of the IRQs.
+		std::vector<bool> m_vFound; // By spec
+		std::vector<const char*> m_vNames;
+};
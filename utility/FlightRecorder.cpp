@@ -0,0 +1,132 @@
+/*
+	FlightRecorder.cpp - Keeps the recent history of the telemetry IRQs in memory,
+	to write out as a VCD when something goes wrong.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "FlightRecorder.h"
+#include <stdio.h>          // for fopen, fprintf, printf, perror
+#include <utility>          // for pair
+#include "TraceWriter.h"    // for TraceWriter
+
+void FlightRecorder::Init(avr_t *pAVR, uint32_t uiSeconds)
+{
+	m_pAVR = pAVR;
+	m_uiSeconds = uiSeconds;
+	if (m_uiSeconds && m_vRing.empty())
+		m_vRing.resize(RING_SIZE);
+}
+
+void FlightRecorder::AddSignal(avr_irq_t *pIRQ, uint8_t uiBits, const std::string &strName)
+{
+	if (m_vSignals.size() > UINT16_MAX)
+		return;
+	Signal_t *pSig = new Signal_t {this, pIRQ, static_cast<uint16_t>(m_vSignals.size()), uiBits, strName};
+	m_vSignals.emplace_back(pSig);
+	auto fcnNotify = [](avr_irq_t *irq, uint32_t value, void *param)
+	{
+		Signal_t *p = static_cast<Signal_t*>(param);
+		p->pOwner->Push(p->uiIndex, value, irq->value); // simavr updates irq->value after the hooks.
+	};
+	avr_irq_register_notify(pIRQ, fcnNotify, pSig);
+}
+
+void FlightRecorder::Push(uint16_t uiSignal, uint32_t uiValue, uint32_t uiPrev)
+{
+	if (!m_pAVR)
+		return;
+	while (m_lock.test_and_set(std::memory_order_acquire)) {};
+	m_vRing[m_uiNext] = {(m_pAVR->cycle << 16U) | uiSignal, uiValue, uiPrev};
+	m_uiNext = (m_uiNext + 1) & (RING_SIZE - 1);
+	m_bWrapped |= m_uiNext == 0;
+	m_lock.clear(std::memory_order_release);
+}
+
+bool FlightRecorder::Dump(const std::string &strFile, const std::string &strWhy)
+{
+	if (!IsEnabled())
+		return false;
+	// Take a copy in order, oldest first, so the boards can carry on.
+	std::vector<Event_t> vEvents;
+	while (m_lock.test_and_set(std::memory_order_acquire)) {};
+	if (m_bWrapped)
+		vEvents.assign(m_vRing.begin() + m_uiNext, m_vRing.end());
+	vEvents.insert(vEvents.end(), m_vRing.begin(), m_vRing.begin() + m_uiNext);
+	m_lock.clear(std::memory_order_release);
+
+	uint64_t uiNow = m_pAVR->cycle, uiWindow = static_cast<uint64_t>(m_pAVR->frequency)*m_uiSeconds;
+	uint64_t uiFrom = uiNow > uiWindow ? uiNow - uiWindow : 0;
+	size_t uiFirst = 0;
+	while (uiFirst < vEvents.size() && (vEvents[uiFirst].uiStamp >> 16U) < uiFrom)
+		uiFirst++;
+	if (m_bWrapped && uiFirst == 0 && !vEvents.empty()) // The ring ran out before the window did.
+		uiFrom = vEvents[0].uiStamp >> 16U;
+
+	FILE *fOut = fopen(strFile.c_str(), "w");
+	if (!fOut)
+	{
+		perror(strFile.c_str());
+		return false;
+	}
+	std::vector<std::pair<uint8_t, std::string>> vSignals;
+	for (auto &pSig : m_vSignals)
+		vSignals.push_back({pSig->uiBits, pSig->strName});
+	fprintf(fOut, "$comment %s $end\n", strWhy.c_str());
+	TraceWriter::PutVCDHeader(fOut, vSignals);
+
+	// Each signal starts at the value before its first change in the window, or where it is now if it had none.
+	std::vector<uint32_t> vStart(m_vSignals.size());
+	std::vector<bool> vSeen(m_vSignals.size(), false);
+	for (size_t i=0; i<m_vSignals.size(); i++)
+		vStart[i] = m_vSignals[i]->pIRQ->value;
+	for (size_t i = uiFirst; i<vEvents.size(); i++)
+	{
+		uint16_t uiSig = vEvents[i].uiStamp & 0xFFFFU;
+		if (!vSeen[uiSig])
+		{
+			vSeen[uiSig] = true;
+			vStart[uiSig] = vEvents[i].uiPrev;
+		}
+	}
+	uint64_t uiLastNs = TraceWriter::CyclesToNs(uiFrom, m_pAVR->frequency), uiLastCycle = uiFrom;
+	std::string strOut = "#" + std::to_string(uiLastNs) + "\n$dumpvars\n";
+	for (size_t i=0; i<vStart.size(); i++)
+		TraceWriter::PutVCDValue(strOut, m_vSignals[i]->uiBits, vStart[i], i);
+	strOut += "$end\n";
+	for (size_t i = uiFirst; i<vEvents.size(); i++)
+	{
+		// Cycle counts can go backwards across a rewind, hold the last time for those.
+		uint64_t uiCycle = vEvents[i].uiStamp >> 16U;
+		if (uiCycle < uiLastCycle)
+			uiCycle = uiLastCycle;
+		uint64_t uiNs = TraceWriter::CyclesToNs(uiLastCycle = uiCycle, m_pAVR->frequency);
+		if (uiNs != uiLastNs)
+			strOut += "#" + std::to_string(uiLastNs = uiNs) + "\n";
+		uint16_t uiSig = vEvents[i].uiStamp & 0xFFFFU;
+		TraceWriter::PutVCDValue(strOut, m_vSignals[uiSig]->uiBits, vEvents[i].uiValue, uiSig);
+	}
+	uint64_t uiEndNs = TraceWriter::CyclesToNs(uiNow > uiLastCycle ? uiNow : uiLastCycle, m_pAVR->frequency);
+	if (uiEndNs != uiLastNs) // So the viewer shows the time since the last change too.
+		strOut += "#" + std::to_string(uiEndNs) + "\n";
+	fwrite(strOut.data(), 1, strOut.size(), fOut);
+	fclose(fOut);
+	printf("FlightRecorder: %s, wrote the last %.3f s (%zu changes) to %s\n", strWhy.c_str(),
+		static_cast<double>(uiNow - uiFrom)/m_pAVR->frequency, vEvents.size() - uiFirst, strFile.c_str());
+	return true;
+}
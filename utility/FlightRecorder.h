@@ -0,0 +1,78 @@
+/*
+	FlightRecorder.h - Keeps the recent history of the telemetry IRQs in memory,
+	to write out as a VCD when something goes wrong.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint32_t, uint64_t, uint8_t, uint16_t
+#include <atomic>       // for atomic_flag
+#include <memory>       // for unique_ptr
+#include <string>       // for string
+#include <vector>       // for vector
+#include "sim_avr.h"    // for avr_t
+#include "sim_irq.h"    // for avr_irq_t
+
+// Every change of the signals is stored, with its cycle and the value before it, in a ring
+// of fixed size that overwrites the oldest. Nothing is written until Dump(), which makes a VCD
+// of the last N seconds (or as much as the ring still holds). So a change costs a few stores,
+// however long the simulation runs.
+class FlightRecorder
+{
+	public:
+		// The ring holds this many changes, 16 bytes each.
+		static constexpr size_t RING_SIZE = 1U<<20;
+
+		void Init(avr_t *pAVR, uint32_t uiSeconds);
+
+		inline bool IsEnabled() const { return m_uiSeconds > 0; }
+
+		void AddSignal(avr_irq_t *pIRQ, uint8_t uiBits, const std::string &strName);
+
+		// Writes the recorded window to strFile as VCD. Call on an AVR thread.
+		bool Dump(const std::string &strFile, const std::string &strWhy);
+
+	private:
+		typedef struct Signal_t
+		{
+			FlightRecorder *pOwner;
+			avr_irq_t *pIRQ;
+			uint16_t uiIndex;
+			uint8_t uiBits;
+			std::string strName;
+		} Signal_t;
+
+		typedef struct Event_t
+		{
+			uint64_t uiStamp; // Cycle << 16 | signal
+			uint32_t uiValue, uiPrev;
+		} Event_t;
+
+		void Push(uint16_t uiSignal, uint32_t uiValue, uint32_t uiPrev);
+
+		avr_t *m_pAVR = nullptr;
+		uint32_t m_uiSeconds = 0;
+		std::vector<std::unique_ptr<Signal_t>> m_vSignals;
+		std::vector<Event_t> m_vRing;
+		size_t m_uiNext = 0;
+		bool m_bWrapped = false;
+		std::atomic_flag m_lock = ATOMIC_FLAG_INIT; // Multiple boards may raise traced IRQs.
+};
@@ -0,0 +1,266 @@
+/*
+	ForkServer.cpp - Boots a printer once and forks a copy-on-write child from
+	that state for every scenario run requested over a Unix socket.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ForkServer.h"
+#include <errno.h>       // for errno, EINTR
+#include <fcntl.h>       // for open, O_CREAT, O_TRUNC, O_WRONLY, O_RDONLY
+#include <poll.h>        // for poll, pollfd, POLLIN
+#include <stdio.h>       // for printf, fprintf, perror, fflush, sscanf
+#include <sys/mman.h>    // for mmap, MAP_FIXED, MAP_PRIVATE, PROT_READ
+#include <sys/socket.h>  // for socket, bind, listen, accept, send, recv
+#include <sys/un.h>      // for sockaddr_un
+#include <sys/wait.h>    // for waitpid, WIFEXITED, WEXITSTATUS, WTERMSIG
+#include <unistd.h>      // for fork, close, dup2, chdir, unlink, usleep, _exit
+#include <cstring>       // for strncpy
+#include <fstream>       // for ifstream
+#include <sstream>       // for istringstream
+#include "Log.h"         // for Log
+#include "ScriptHost.h"  // for ScriptHost
+
+volatile sig_atomic_t ForkServer::m_bStop = 0;
+
+void ForkServer::OnSignal(int)
+{
+	m_bStop = 1;
+}
+
+static void Reply(int fdClient, const std::string &strLine)
+{
+	std::string strOut = strLine + "\n";
+	if (send(fdClient, strOut.data(), strOut.size(), 0) < 0)
+		perror("ForkServer: send");
+}
+
+bool ForkServer::Boot(bool bWarmUp)
+{
+	if (!bWarmUp)
+		return true;
+	printf("ForkServer: Running the warm-up script...\n");
+	m_pBoard->StartAVR();
+	ScriptHost::State state = ScriptHost::GetState();
+	while (!m_pBoard->GetQuitFlag() && (state == ScriptHost::State::Idle || state == ScriptHost::State::Running))
+	{
+		usleep(1000);
+		state = ScriptHost::GetState();
+	}
+	if (state != ScriptHost::State::Finished)
+	{
+		fprintf(stderr, "ForkServer: The warm-up script did not finish (state %d), not serving.\n", static_cast<int>(state));
+		m_pBoard->StopAVR();
+		return false;
+	}
+	m_pBoard->SuspendAVR();
+	return true;
+}
+
+int ForkServer::Serve()
+{
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	if (m_strSocket.size() >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "ForkServer: Socket path %s is too long\n", m_strSocket.c_str());
+		return 1;
+	}
+	strncpy(addr.sun_path, m_strSocket.c_str(), sizeof(addr.sun_path) - 1);
+	m_fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(m_strSocket.c_str()); // Left over from a previous server.
+	if (m_fdListen < 0 || bind(m_fdListen, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(m_fdListen, 16) < 0)
+	{
+		perror(m_strSocket.c_str());
+		return 1;
+	}
+
+	struct sigaction sa {};
+	sa.sa_handler = OnSignal; // No SA_RESTART, so poll() returns for it.
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &m_saInt);
+	sigaction(SIGTERM, &sa, &m_saTerm);
+	signal(SIGPIPE, SIG_IGN); // A client that went away shouldn't take the server with it.
+
+	printf("ForkServer: Ready on %s\n", m_strSocket.c_str());
+	Log::Stop(); // Its thread wouldn't survive the forks, each run starts its own.
+	fflush(stdout);
+	while (!m_bStop)
+	{
+		Reap(false);
+		pollfd pfd {m_fdListen, POLLIN, 0};
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+		int fdClient = accept(m_fdListen, nullptr, nullptr);
+		if (fdClient >= 0)
+			OnConnect(fdClient);
+	}
+	close(m_fdListen);
+	m_fdListen = -1;
+	unlink(m_strSocket.c_str());
+
+	printf("ForkServer: Stopping, waiting for %zu run(s)...\n", m_mRuns.size());
+	Reap(true);
+	sigaction(SIGINT, &m_saInt, nullptr);
+	sigaction(SIGTERM, &m_saTerm, nullptr);
+	Log::Start();
+	return 0;
+}
+
+void ForkServer::OnConnect(int fdClient)
+{
+	// Requests are a single short line, don't let a slow client hold up the others for long.
+	std::string strLine;
+	char chr = 0;
+	pollfd pfd {fdClient, POLLIN, 0};
+	while (strLine.size() < 4096 && poll(&pfd, 1, 1000) > 0 && recv(fdClient, &chr, 1, 0) == 1 && chr != '\n')
+		strLine.push_back(chr);
+
+	std::istringstream lineIn(strLine);
+	std::string strVerb, strScript, strDir;
+	lineIn >> strVerb >> strScript >> strDir;
+	if (strVerb == "QUIT")
+	{
+		m_bStop = 1;
+		Reply(fdClient, "OK");
+		close(fdClient);
+		return;
+	}
+	if (strVerb != "RUN" || strScript.empty())
+	{
+		Reply(fdClient, "ERR expected RUN <script> [<dir>] or QUIT");
+		close(fdClient);
+		return;
+	}
+	if (!std::ifstream(strScript).good())
+	{
+		Reply(fdClient, "ERR cannot read " + strScript);
+		close(fdClient);
+		return;
+	}
+
+	fflush(nullptr); // Or the child will write out our buffered output again.
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fdClient);
+		RunChild(strScript, strDir);
+	}
+	if (pid < 0)
+	{
+		perror("ForkServer: fork");
+		Reply(fdClient, "ERR fork failed");
+		close(fdClient);
+		return;
+	}
+	printf("ForkServer: Started %s as %d\n", strScript.c_str(), pid);
+	Reply(fdClient, "PID " + std::to_string(pid));
+	m_mRuns[pid] = fdClient;
+}
+
+void ForkServer::Reap(bool bAll)
+{
+	while (!m_mRuns.empty())
+	{
+		int iStatus = 0;
+		pid_t pid = waitpid(-1, &iStatus, bAll ? 0 : WNOHANG);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid <= 0)
+			return;
+		auto it = m_mRuns.find(pid);
+		if (it == m_mRuns.end())
+			continue;
+		int iExit = WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : 128 + WTERMSIG(iStatus);
+		printf("ForkServer: Run %d exited with %d\n", pid, iExit);
+		Reply(it->second, "EXIT " + std::to_string(iExit));
+		close(it->second);
+		m_mRuns.erase(it);
+	}
+}
+
+static void RedirectTo(const std::string &strFile, int fdTarget)
+{
+	int fd = open(strFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	dup2(fd, fdTarget);
+	close(fd);
+}
+
+void ForkServer::RunChild(const std::string &strScript, const std::string &strDir)
+{
+	sigaction(SIGINT, &m_saInt, nullptr);
+	sigaction(SIGTERM, &m_saTerm, nullptr);
+	for (auto &run : m_mRuns)
+		close(run.second);
+	m_mRuns.clear();
+
+	if (!strDir.empty())
+	{
+		RedirectTo(strDir + "/MK404.out", STDOUT_FILENO);
+		RedirectTo(strDir + "/MK404.err", STDERR_FILENO);
+	}
+	Log::Start();
+	// Before anything gets the chance to write to them.
+	PrivatizeMappings();
+	m_pBoard->DetachStorage();
+
+	if (!ScriptHost::Restart(strScript)) // Relative to the server's directory, so load it before moving.
+		_exit(static_cast<int>(ScriptHost::State::Error));
+	if (!strDir.empty() && chdir(strDir.c_str()) < 0)
+	{
+		perror(strDir.c_str());
+		_exit(static_cast<int>(ScriptHost::State::Error));
+	}
+
+	m_pBoard->StartAVR();
+	m_pBoard->WaitForFinish();
+	m_pBoard->StopAVR(); // As at a normal exit, this prints the stats.
+	Log::Stop();
+	fflush(nullptr);
+	// Skip the destructors, they'd be tearing down the parent's state (threads, files) that we only have a copy of.
+	_exit(static_cast<int>(ScriptHost::GetState()));
+}
+
+void ForkServer::PrivatizeMappings()
+{
+	std::ifstream mapsIn("/proc/self/maps");
+	std::string strLine;
+	while (getline(mapsIn, strLine))
+	{
+		// start-end perms offset dev inode path
+		unsigned long ulStart = 0, ulEnd = 0, ulOffset = 0;
+		char szPerms[5] = {};
+		int iPath = 0;
+		if (sscanf(strLine.c_str(), "%lx-%lx %4s %lx %*s %*s %n", &ulStart, &ulEnd, szPerms, &ulOffset, &iPath) < 4 || iPath == 0)
+			continue;
+		std::string strPath = strLine.substr(iPath);
+		if (szPerms[1] != 'w' || szPerms[3] != 's' || strPath.empty() || strPath[0] != '/' || strPath.compare(0, 5, "/dev/") == 0)
+			continue;
+		// The shared mapping is the page cache, so a private one of the file starts out identical.
+		int fd = open(strPath.c_str(), O_RDONLY);
+		if (fd < 0 || mmap(reinterpret_cast<void*>(ulStart), ulEnd - ulStart, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, ulOffset) == MAP_FAILED)
+			perror(strPath.c_str());
+		if (fd >= 0)
+			close(fd);
+	}
+}
@@ -0,0 +1,76 @@
+/*
+	ForkServer.h - Boots a printer once and forks a copy-on-write child from
+	that state for every scenario run requested over a Unix socket.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <signal.h>     // for sig_atomic_t, sigaction, signal
+#include <sys/types.h>  // for pid_t
+#include <map>          // for map
+#include <string>       // for string
+#include "Board.h"      // for Board
+
+// The protocol is one text line each way, so socat or nc -U will do as a client:
+//   -> RUN <script> [<dir>]   (paths without spaces, relative to the server's working directory)
+//   <- PID <pid>              the run has started
+//   <- EXIT <code>            it has finished, code as MK404's (the ScriptHost::State), or 128+signal
+//   -> QUIT                   stops the server once the runs in progress are done
+// Problems with a request get "ERR <reason>" instead. A run with a dir writes its
+// MK404.out/.err and any profiles there, otherwise it shares the server's output.
+// Children keep their flash/EEPROM/xflash/SD changes to themselves.
+// The board must be the only one in the process, and nothing may be running
+// other host threads across the fork (traces, G-code latency, capture). So no serial
+// PTYs are opened in this mode (uart_pty::SetNoPtys), their I/O thread wouldn't carry over.
+class ForkServer
+{
+	public:
+		ForkServer(Boards::Board *pBoard, const std::string &strSocket):m_pBoard(pBoard),m_strSocket(strSocket){};
+
+		// Runs the script already set up on the (default) ScriptHost to its end if bWarmUp,
+		// and suspends the board there. Without one the children start from reset.
+		// Returns false if the warm-up didn't finish cleanly (the board is stopped then).
+		bool Boot(bool bWarmUp);
+
+		// Serves requests until SIGINT/SIGTERM or QUIT, then waits for the outstanding runs.
+		// Returns the exit code for the server, children never return from here.
+		int Serve();
+
+		// Remaps every writable shared file mapping (EEPROM, xflash, SD card) as a private copy.
+		// For any forked copy, before it runs.
+		static void PrivatizeMappings();
+
+	private:
+		void OnConnect(int fdClient);
+		// Reaps finished runs and reports them, waiting for all of them if bAll.
+		void Reap(bool bAll);
+
+		[[noreturn]] void RunChild(const std::string &strScript, const std::string &strDir);
+
+		static void OnSignal(int iSig);
+
+		Boards::Board *m_pBoard;
+		std::string m_strSocket;
+		int m_fdListen = -1;
+		std::map<pid_t, int> m_mRuns; // Child to the client waiting on it
+		struct sigaction m_saInt {}, m_saTerm {}; // MK404's own, for the children.
+
+		static volatile sig_atomic_t m_bStop;
+};
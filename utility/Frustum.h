@@ -0,0 +1,77 @@
+/*
+	Frustum.h - View frustum of the current GL matrices, for culling bounding boxes.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <GL/glew.h>  // for glGetFloatv, GL_MODELVIEW_MATRIX, GL_PROJECTION_MATRIX
+
+// The six clip planes of projection * modelview, taken from the matrix rows (Gribb and Hartmann),
+// so they are in the coordinates of whatever is drawn next and a box needs no transforming.
+class Frustum
+{
+	public:
+		// From the matrices in effect now.
+		inline void FromGL()
+		{
+			float fP[16], fMV[16], fM[16];
+			glGetFloatv(GL_PROJECTION_MATRIX, fP);
+			glGetFloatv(GL_MODELVIEW_MATRIX, fMV);
+			// Column-major, fM = fP * fMV.
+			for (int c=0; c<4; c++)
+				for (int r=0; r<4; r++)
+					fM[(c*4)+r] = (fP[r]*fMV[c*4]) + (fP[4+r]*fMV[(c*4)+1]) + (fP[8+r]*fMV[(c*4)+2]) + (fP[12+r]*fMV[(c*4)+3]);
+			for (int i=0; i<3; i++)
+				for (int j=0; j<4; j++)
+				{
+					m_fPlanes[i*2][j] = fM[(j*4)+3] + fM[(j*4)+i];     // Left, bottom, near
+					m_fPlanes[(i*2)+1][j] = fM[(j*4)+3] - fM[(j*4)+i]; // Right, top, far
+				}
+		}
+
+		// True if the box is wholly outside one of the planes, i.e. nothing of it can be on screen.
+		// Conservative: a box off to the side of a corner may still pass.
+		inline bool IsOutside(const float fMin[3], const float fMax[3], const float *pfOffset = nullptr) const
+		{
+			for (auto &fPlane : m_fPlanes)
+				if (Distance(fPlane, fMin, fMax, pfOffset, true) < 0)
+					return true;
+			return false;
+		}
+
+		// True if part of the box is in front of the near plane (the camera may be inside it),
+		// where drawing the box for an occlusion test would come back empty even if it is visible.
+		inline bool CrossesNear(const float fMin[3], const float fMax[3], const float *pfOffset = nullptr) const
+		{
+			return Distance(m_fPlanes[4], fMin, fMax, pfOffset, false) < 0;
+		}
+
+	private:
+		// Signed distance (unnormalised) of the box corner furthest along (bFar) or against the plane's normal.
+		static inline float Distance(const float fPlane[4], const float fMin[3], const float fMax[3], const float *pfOffset, bool bFar)
+		{
+			float fDist = fPlane[3];
+			for (int i=0; i<3; i++)
+				fDist += fPlane[i] * (((fPlane[i] >= 0) == bFar ? fMax[i] : fMin[i]) + (pfOffset ? pfOffset[i] : 0.f));
+			return fDist;
+		}
+
+		float m_fPlanes[6][4] = {};
+};
@@ -0,0 +1,568 @@
+/*
+	GDBStub.cpp - A GDB remote stub that keeps the AVR at full speed while a
+	debugger is attached.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GDBStub.h"
+#include <arpa/inet.h>    // for htonl, htons
+#include <avr_eeprom.h>   // for avr_eeprom_desc_t, AVR_IOCTL_EEPROM_GET, AVR...
+#include <netinet/in.h>   // for sockaddr_in, INADDR_ANY, IPPROTO_TCP
+#include <netinet/tcp.h>  // for TCP_NODELAY
+#include <poll.h>         // for poll, pollfd, POLLIN
+#include <signal.h>       // for signal, SIGPIPE, SIG_IGN
+#include <stdio.h>        // for printf, perror, snprintf, sscanf
+#include <stdlib.h>       // for strtoul
+#include <sys/socket.h>   // for socket, bind, listen, accept, recv, send
+#include <unistd.h>       // for close
+#include <algorithm>      // for copy, fill
+#include <chrono>         // for milliseconds
+#include <cstring>        // for memcmp, memcpy
+#include "ThreadPolicy.h" // for ThreadPolicy
+#include "sim_io.h"       // for avr_ioctl
+
+thread_local GDBStub* GDBStub::m_pCurrent = nullptr;
+
+// avr-gdb's view of the address space.
+static constexpr uint32_t DATA_OFFSET = 0x800000, EEPROM_OFFSET = 0x810000, EEPROM_END = 0x820000;
+// r0-r31, SREG, SP, PC in the 'g' packet, and where 'p' finds each register number.
+static constexpr size_t REG_BYTES = 39, REG_SREG = 32, REG_SP = 33, REG_PC = 35;
+
+static const char HEX[] = "0123456789abcdef";
+
+static inline void AppendHex(std::string &strOut, uint8_t uiByte)
+{
+	strOut += HEX[uiByte >> 4U];
+	strOut += HEX[uiByte & 0xFU];
+}
+
+static bool FromHex(const char *pHex, size_t uiBytes, std::vector<uint8_t> &vOut)
+{
+	vOut.clear();
+	char szByte[3] = {0};
+	for (size_t i=0; i<uiBytes; i++)
+	{
+		if (!pHex[2*i] || !pHex[2*i+1])
+			return false;
+		szByte[0] = pHex[2*i];
+		szByte[1] = pHex[2*i+1];
+		vOut.push_back(static_cast<uint8_t>(strtoul(szByte, nullptr, 16)));
+	}
+	return true;
+}
+
+GDBStub::GDBStub(avr_t *pAVR, uint16_t uiPort):m_pAVR(pAVR),m_uiPort(uiPort)
+{
+	m_vBreak.resize((m_pAVR->flashend >> 1U) + 1, 0);
+}
+
+GDBStub::~GDBStub()
+{
+	if (m_thread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, NULL);
+	}
+	if (m_fdClient >= 0)
+		close(m_fdClient);
+	if (m_fdListen >= 0)
+		close(m_fdListen);
+}
+
+bool GDBStub::Start()
+{
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY); // As simavr's stub did.
+	addr.sin_port = htons(m_uiPort);
+	m_fdListen = socket(AF_INET, SOCK_STREAM, 0);
+	int iOn = 1;
+	if (m_fdListen >= 0)
+		setsockopt(m_fdListen, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+	if (m_fdListen < 0 || bind(m_fdListen, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(m_fdListen, 1) < 0)
+	{
+		perror("GDBStub");
+		return false;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	m_pAVR->run = OnRun;
+	m_pAVR->state = cpu_Stopped;
+	printf("GDBStub: Waiting for a debugger on port %u (target remote :%u)\n", m_uiPort, m_uiPort);
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "gdb"); GDBStub *p = static_cast<GDBStub*>(param); return p->Serve(); };
+	pthread_create(&m_thread, NULL, fcnRun, this);
+	return true;
+}
+
+void GDBStub::OnRun(avr_t *avr)
+{
+	if (m_pCurrent)
+		m_pCurrent->Run();
+	else
+		avr_callback_run_raw(avr);
+}
+
+void GDBStub::Run()
+{
+	if (m_bPending.load(std::memory_order_relaxed))
+		ProcessPackets();
+	if (m_bHalted)
+	{
+		m_pAVR->state = cpu_Stopped; // Ends the board's batch, so it still gets round to its host side work.
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_cvPacket.wait_for(lock, std::chrono::milliseconds(10), [this]{ return m_bPending.load(); });
+		return;
+	}
+	if (m_bSkipBreak)
+		m_bSkipBreak = false;
+	else if (m_uiBreaks && m_pAVR->pc <= m_pAVR->flashend && m_vBreak[m_pAVR->pc >> 1U])
+	{
+		Halt(5);
+		return;
+	}
+	avr_callback_run_raw(m_pAVR);
+	if (m_pAVR->state == cpu_Crashed)
+	{
+		printf("GDBStub: AVR crashed at PC 0x%x, halted for the debugger.\n", m_pAVR->pc);
+		Halt(11);
+	}
+	else if (!m_vWatches.empty() && CheckWatches())
+		Halt(5);
+	else if (m_bStepping)
+		Halt(5);
+}
+
+void GDBStub::ProcessPackets()
+{
+	std::deque<std::string> dPackets;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		dPackets.swap(m_dPackets);
+		m_bPending = false;
+	}
+	if (m_bDisconnected.exchange(false))
+		Detach();
+	if (m_bConnected.exchange(false))
+	{
+		m_bAttached = true;
+		if (!m_bHalted)
+			Halt(5, false); // gdb asks why with '?' first thing.
+	}
+	if (m_bInterrupt.exchange(false) && !m_bHalted)
+		Halt(2);
+	for (auto &strPacket : dPackets)
+		Handle(strPacket);
+}
+
+void GDBStub::Halt(int iSignal, bool bReport)
+{
+	m_iResumeState = m_pAVR->state == cpu_Sleeping ? cpu_Sleeping : cpu_Running;
+	m_pAVR->state = cpu_Stopped;
+	m_bHalted = true;
+	m_bStepping = false;
+	m_iSignal = iSignal;
+	if (bReport)
+		SendStop();
+}
+
+void GDBStub::Resume(bool bStep)
+{
+	m_bHalted = false;
+	m_bStepping = bStep;
+	m_bSkipBreak = m_uiBreaks && m_pAVR->pc <= m_pAVR->flashend && m_vBreak[m_pAVR->pc >> 1U];
+	m_uiWatchHit = 0;
+	for (auto &w : m_vWatches) // Memory may have been written from gdb meanwhile.
+		memcpy(w.vLast.data(), m_pAVR->data + w.uiData, w.uiLen);
+	m_pAVR->state = m_iResumeState;
+}
+
+void GDBStub::Detach()
+{
+	std::fill(m_vBreak.begin(), m_vBreak.end(), 0);
+	m_uiBreaks = 0;
+	m_vWatches.clear();
+	if (m_bHalted)
+		Resume(false);
+	if (m_bAttached) // Once for 'D', again when the socket closes.
+		printf("GDBStub: Debugger detached, running on.\n");
+	m_bAttached = false;
+}
+
+bool GDBStub::CheckWatches()
+{
+	for (auto &w : m_vWatches)
+		if (memcmp(m_pAVR->data + w.uiData, w.vLast.data(), w.uiLen) != 0)
+		{
+			memcpy(w.vLast.data(), m_pAVR->data + w.uiData, w.uiLen);
+			m_uiWatchHit = w.uiAddr;
+			return true;
+		}
+	return false;
+}
+
+std::string GDBStub::ReadRegs()
+{
+	std::string strOut;
+	for (size_t i=0; i<32; i++)
+		AppendHex(strOut, m_pAVR->data[i]);
+	uint8_t uiSREG = 0;
+	for (unsigned i=0; i<8; i++)
+		if (m_pAVR->sreg[i])
+			uiSREG |= 1U << i;
+	AppendHex(strOut, uiSREG);
+	AppendHex(strOut, m_pAVR->data[R_SPL]);
+	AppendHex(strOut, m_pAVR->data[R_SPH]);
+	for (unsigned i=0; i<4; i++)
+		AppendHex(strOut, (m_pAVR->pc >> (8U*i)) & 0xFFU);
+	return strOut;
+}
+
+void GDBStub::SendStop()
+{
+	std::string strRegs = ReadRegs();
+	char szReply[80];
+	int iLen = snprintf(szReply, sizeof(szReply), "T%02x20:%s;21:%s;22:%s;", m_iSignal, strRegs.substr(2*REG_SREG, 2).c_str(),
+		strRegs.substr(2*REG_SP, 4).c_str(), strRegs.substr(2*REG_PC, 8).c_str());
+	if (m_uiWatchHit)
+		snprintf(szReply + iLen, sizeof(szReply) - iLen, "watch:%x;", m_uiWatchHit);
+	Send(szReply);
+}
+
+bool GDBStub::ReadMem(uint32_t uiAddr, uint32_t uiLen, std::string &strOut)
+{
+	if (uiAddr < DATA_OFFSET)
+	{
+		if (uiAddr + uiLen > m_pAVR->flashend + 1)
+			return false;
+		for (uint32_t i=0; i<uiLen; i++)
+			AppendHex(strOut, m_pAVR->flash[uiAddr + i]);
+	}
+	else if (uiAddr < EEPROM_OFFSET)
+	{
+		uiAddr -= DATA_OFFSET;
+		if (uiAddr + uiLen > m_pAVR->ramend + 1U)
+			return false;
+		for (uint32_t i=0; i<uiLen; i++)
+			AppendHex(strOut, m_pAVR->data[uiAddr + i]);
+	}
+	else if (uiAddr < EEPROM_END)
+	{
+		std::vector<uint8_t> vData(uiLen);
+		avr_eeprom_desc_t desc;
+		desc.ee = vData.data();
+		desc.offset = static_cast<uint16_t>(uiAddr - EEPROM_OFFSET);
+		desc.size = uiLen;
+		if (!uiLen || avr_ioctl(m_pAVR, AVR_IOCTL_EEPROM_GET, &desc) < 0)
+			return false;
+		for (auto b : vData)
+			AppendHex(strOut, b);
+	}
+	else
+		return false;
+	return true;
+}
+
+bool GDBStub::WriteMem(uint32_t uiAddr, const std::vector<uint8_t> &vData)
+{
+	if (uiAddr < DATA_OFFSET)
+	{
+		if (uiAddr + vData.size() > m_pAVR->flashend + 1)
+			return false;
+		memcpy(m_pAVR->flash + uiAddr, vData.data(), vData.size());
+	}
+	else if (uiAddr < EEPROM_OFFSET)
+	{
+		uiAddr -= DATA_OFFSET;
+		if (uiAddr + vData.size() > m_pAVR->ramend + 1U)
+			return false;
+		memcpy(m_pAVR->data + uiAddr, vData.data(), vData.size());
+	}
+	else if (uiAddr < EEPROM_END)
+	{
+		std::vector<uint8_t> vCopy(vData);
+		avr_eeprom_desc_t desc;
+		desc.ee = vCopy.data();
+		desc.offset = static_cast<uint16_t>(uiAddr - EEPROM_OFFSET);
+		desc.size = vCopy.size();
+		return !vCopy.empty() && avr_ioctl(m_pAVR, AVR_IOCTL_EEPROM_SET, &desc) >= 0;
+	}
+	else
+		return false;
+	return true;
+}
+
+std::string GDBStub::BreakPoint(const std::string &strPacket, bool bSet)
+{
+	unsigned int uiType, uiAddr, uiKind;
+	if (sscanf(strPacket.c_str() + 1, "%u,%x,%x", &uiType, &uiAddr, &uiKind) != 3)
+		return "E01";
+	switch (uiType)
+	{
+		case 0: // Software and hardware breakpoints are the same thing here.
+		case 1:
+			if (uiAddr > m_pAVR->flashend)
+				return "E01";
+			if (m_vBreak[uiAddr >> 1U] != bSet)
+				m_uiBreaks += bSet ? 1 : -1;
+			m_vBreak[uiAddr >> 1U] = bSet;
+			return "OK";
+		case 2:
+		{
+			if (uiAddr < DATA_OFFSET || uiAddr >= EEPROM_OFFSET || uiAddr - DATA_OFFSET + uiKind > m_pAVR->ramend + 1U || !uiKind)
+				return "E01";
+			for (auto it = m_vWatches.begin(); it != m_vWatches.end(); it++)
+				if (it->uiAddr == uiAddr && it->uiLen == uiKind)
+				{
+					if (!bSet)
+						m_vWatches.erase(it);
+					return "OK";
+				}
+			if (bSet)
+			{
+				Watch_t w {uiAddr, static_cast<uint16_t>(uiAddr - DATA_OFFSET), static_cast<uint16_t>(uiKind), {}};
+				w.vLast.assign(m_pAVR->data + w.uiData, m_pAVR->data + w.uiData + w.uiLen);
+				m_vWatches.push_back(w);
+			}
+			return "OK";
+		}
+		default: // Read/access watchpoints would need a hook on every load.
+			return "";
+	}
+}
+
+void GDBStub::Handle(const std::string &strPacket)
+{
+	if (strPacket.empty())
+		return;
+	std::vector<uint8_t> vData;
+	std::string strOut;
+	unsigned int uiAddr = 0, uiLen = 0;
+	switch (strPacket[0])
+	{
+		case '?':
+			SendStop();
+			break;
+		case 'g':
+			Send(ReadRegs());
+			break;
+		case 'G':
+		case 'P':
+		{
+			// Both go through the 'g' layout, 'P' just replaces one register in it.
+			std::vector<uint8_t> vRegs;
+			FromHex(ReadRegs().c_str(), REG_BYTES, vRegs);
+			if (strPacket[0] == 'G')
+			{
+				if (!FromHex(strPacket.c_str() + 1, REG_BYTES, vRegs))
+				{
+					Send("E01");
+					break;
+				}
+			}
+			else
+			{
+				unsigned int uiReg = strtoul(strPacket.c_str() + 1, nullptr, 16);
+				size_t uiEq = strPacket.find('=');
+				size_t uiOffset = uiReg < 33 ? uiReg : uiReg == 33 ? REG_SP : REG_PC;
+				size_t uiSize = uiReg < 33 ? 1 : uiReg == 33 ? 2 : 4;
+				if (uiReg > 34 || uiEq == std::string::npos || !FromHex(strPacket.c_str() + uiEq + 1, uiSize, vData))
+				{
+					Send("E01");
+					break;
+				}
+				std::copy(vData.begin(), vData.end(), vRegs.begin() + uiOffset);
+			}
+			memcpy(m_pAVR->data, vRegs.data(), 32);
+			for (unsigned i=0; i<8; i++)
+				m_pAVR->sreg[i] = (vRegs[REG_SREG] >> i) & 1U;
+			m_pAVR->data[R_SREG] = vRegs[REG_SREG];
+			m_pAVR->data[R_SPL] = vRegs[REG_SP];
+			m_pAVR->data[R_SPH] = vRegs[REG_SP+1];
+			m_pAVR->pc = vRegs[REG_PC] | (vRegs[REG_PC+1] << 8U) | (vRegs[REG_PC+2] << 16U) | (vRegs[REG_PC+3] << 24U);
+			Send("OK");
+			break;
+		}
+		case 'p':
+		{
+			unsigned int uiReg = strtoul(strPacket.c_str() + 1, nullptr, 16);
+			std::string strRegs = ReadRegs();
+			if (uiReg < 33)
+				Send(strRegs.substr(2*uiReg, 2));
+			else if (uiReg == 33)
+				Send(strRegs.substr(2*REG_SP, 4));
+			else if (uiReg == 34)
+				Send(strRegs.substr(2*REG_PC, 8));
+			else
+				Send("E01");
+			break;
+		}
+		case 'm':
+			if (sscanf(strPacket.c_str() + 1, "%x,%x", &uiAddr, &uiLen) == 2 && ReadMem(uiAddr, uiLen, strOut))
+				Send(strOut);
+			else
+				Send("E01");
+			break;
+		case 'M':
+		{
+			size_t uiColon = strPacket.find(':');
+			if (sscanf(strPacket.c_str() + 1, "%x,%x", &uiAddr, &uiLen) == 2 && uiColon != std::string::npos
+				&& FromHex(strPacket.c_str() + uiColon + 1, uiLen, vData) && WriteMem(uiAddr, vData))
+				Send("OK");
+			else
+				Send("E01");
+			break;
+		}
+		case 'c':
+			Resume(false);
+			break;
+		case 's':
+			Resume(true);
+			break;
+		case 'Z':
+		case 'z':
+			Send(BreakPoint(strPacket, strPacket[0] == 'Z'));
+			break;
+		case 'D':
+			Send("OK");
+			Detach();
+			break;
+		case 'k':
+			Detach();
+			break;
+		case 'H':
+			Send("OK");
+			break;
+		case 'q':
+			if (strPacket.compare(0, 11, "qSupported:") == 0 || strPacket == "qSupported")
+				Send("PacketSize=1000");
+			else if (strPacket == "qAttached")
+				Send("1");
+			else
+				Send("");
+			break;
+		default: // Including X, gdb falls back to M.
+			Send("");
+	}
+}
+
+void GDBStub::Send(const std::string &strPayload)
+{
+	uint8_t uiSum = 0;
+	for (auto c : strPayload)
+		uiSum += c;
+	std::string strPacket = "$" + strPayload + "#";
+	AppendHex(strPacket, uiSum);
+	std::lock_guard<std::mutex> guard(m_lockSend);
+	if (m_fdClient >= 0)
+		send(m_fdClient, strPacket.data(), strPacket.size(), 0);
+}
+
+void GDBStub::Queue(const std::string &strPacket)
+{
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!strPacket.empty())
+			m_dPackets.push_back(strPacket);
+		m_bPending = true;
+	}
+	m_cvPacket.notify_one();
+}
+
+void GDBStub::OnData(const char *pData, size_t uiLen)
+{
+	for (size_t i=0; i<uiLen; i++)
+	{
+		char c = pData[i];
+		if (m_strIn.empty())
+		{
+			if (c == 0x03)
+			{
+				m_bInterrupt = true;
+				Queue("");
+			}
+			else if (c == '$')
+				m_strIn = c;
+			continue; // Acks and anything else between packets.
+		}
+		m_strIn += c;
+		size_t uiSize = m_strIn.size();
+		if (uiSize < 4 || m_strIn[uiSize-3] != '#')
+			continue;
+		std::string strPayload = m_strIn.substr(1, uiSize - 4);
+		uint8_t uiSum = 0;
+		for (auto b : strPayload)
+			uiSum += b;
+		bool bGood = strtoul(m_strIn.c_str() + uiSize - 2, nullptr, 16) == uiSum;
+		m_strIn.clear();
+		{
+			std::lock_guard<std::mutex> guard(m_lockSend);
+			send(m_fdClient, bGood ? "+" : "-", 1, 0);
+		}
+		if (bGood)
+			Queue(strPayload);
+	}
+}
+
+void* GDBStub::Serve()
+{
+	char buf[4096];
+	while (!m_bQuit)
+	{
+		pollfd vPoll[2] = {{m_fdListen, POLLIN, 0}, {m_fdClient, POLLIN, 0}};
+		poll(vPoll, m_fdClient >= 0 ? 2 : 1, 10);
+		if (vPoll[0].revents & POLLIN)
+		{
+			int fd = accept(m_fdListen, nullptr, nullptr);
+			if (fd >= 0 && m_fdClient >= 0)
+			{
+				printf("GDBStub: A debugger is already attached, refusing another.\n");
+				close(fd);
+			}
+			else if (fd >= 0)
+			{
+				int iOn = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn)); // Packets are small and strictly back and forth.
+				{
+					std::lock_guard<std::mutex> guard(m_lockSend);
+					m_fdClient = fd;
+				}
+				m_strIn.clear();
+				printf("GDBStub: Debugger attached.\n");
+				m_bConnected = true;
+				Queue("");
+			}
+		}
+		if (m_fdClient >= 0 && (vPoll[1].revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			ssize_t iRead = recv(m_fdClient, buf, sizeof(buf), 0);
+			if (iRead > 0)
+				OnData(buf, iRead);
+			else
+			{
+				{
+					std::lock_guard<std::mutex> guard(m_lockSend);
+					close(m_fdClient);
+					m_fdClient = -1;
+				}
+				m_bDisconnected = true;
+				Queue("");
+			}
+		}
+	}
+	return nullptr;
+}
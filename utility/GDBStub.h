@@ -0,0 +1,110 @@
+/*
+	GDBStub.h - A GDB remote stub that keeps the AVR at full speed while a
+	debugger is attached.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>           // for pthread_t
+#include <stdint.h>            // for uint8_t, uint16_t, uint32_t
+#include <atomic>              // for atomic_bool
+#include <condition_variable>  // for condition_variable
+#include <deque>               // for deque
+#include <mutex>               // for mutex
+#include <string>              // for string
+#include <vector>              // for vector
+#include "sim_avr.h"           // for avr_t, cpu_Running
+
+// Stands in for simavr's own stub (avr_gdb_init), which polls its socket and walks its breakpoint
+// and watchpoint lists on every instruction (and every RAM write), so a debugger costs far more
+// than the instructions do. Here the socket is served on a thread of its own; the AVR thread
+// only checks an atomic for pending packets, a byte per flash word for breakpoints, and the
+// watched bytes (if any) after each instruction. Packets are handled on the AVR thread, between
+// instructions, so memory and registers are always seen consistently.
+// Supports the usual avr-gdb packets: ?, g/G, p/P, m/M, c, s, D, k, Ctrl-C, Z0/Z1 breakpoints and
+// Z2 write watchpoints (as value changes, which is what gdb's "watch" reports anyway).
+class GDBStub
+{
+	public:
+		explicit GDBStub(avr_t *pAVR, uint16_t uiPort = 1234);
+		~GDBStub();
+
+		// Starts listening and takes over avr->run. The AVR stays halted until a debugger continues it.
+		bool Start();
+
+		// Selects the stub for the AVR running on this thread. Call on the AVR thread before running.
+		static inline void Select(GDBStub *pStub) { m_pCurrent = pStub; }
+
+	private:
+		typedef struct Watch_t
+		{
+			uint32_t uiAddr; // As gdb gave it, i.e. with the 0x800000 data offset.
+			uint16_t uiData, uiLen;
+			std::vector<uint8_t> vLast;
+		} Watch_t;
+
+		// AVR thread side.
+		static void OnRun(avr_t *avr);
+		void Run();
+		void ProcessPackets();
+		void Handle(const std::string &strPacket);
+		void Halt(int iSignal, bool bReport = true);
+		void Resume(bool bStep);
+		void Detach();
+		void SendStop();
+		bool CheckWatches();
+		std::string ReadRegs();
+		bool ReadMem(uint32_t uiAddr, uint32_t uiLen, std::string &strOut);
+		bool WriteMem(uint32_t uiAddr, const std::vector<uint8_t> &vData);
+		std::string BreakPoint(const std::string &strPacket, bool bSet);
+
+		// Network thread side.
+		void* Serve();
+		void OnData(const char *pData, size_t uiLen);
+		void Queue(const std::string &strPacket);
+
+		void Send(const std::string &strPayload);
+
+		avr_t *m_pAVR;
+		uint16_t m_uiPort;
+
+		std::vector<uint8_t> m_vBreak; // One per flash word
+		uint32_t m_uiBreaks = 0;
+		bool m_bSkipBreak = false; // Resuming from a breakpoint, run its instruction first.
+		std::vector<Watch_t> m_vWatches;
+		uint32_t m_uiWatchHit = 0;
+
+		bool m_bHalted = true, m_bStepping = false, m_bAttached = false;
+		int m_iResumeState = cpu_Running, m_iSignal = 5;
+
+		std::mutex m_lock; // For the queue
+		std::condition_variable m_cvPacket;
+		std::deque<std::string> m_dPackets;
+		std::atomic_bool m_bPending {false}, m_bInterrupt {false}, m_bConnected {false}, m_bDisconnected {false};
+		std::mutex m_lockSend; // For the client fd, the network thread closes it.
+		int m_fdClient = -1;
+
+		int m_fdListen = -1;
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+		std::string m_strIn; // Network thread's partial packet
+
+		static thread_local GDBStub *m_pCurrent;
+};
@@ -22,17 +22,27 @@
 
 #include "GLObj.h"
 #include <GL/glew.h>          // for glMaterialfv, GL_FRONT, glBindTexture
+#include <fcntl.h>            // for open, O_RDONLY
+#include <stdio.h>            // for rename, remove
+#include <sys/mman.h>         // for mmap, munmap, MAP_FAILED, MAP_PRIVATE
+#include <sys/stat.h>         // for fstat, stat
+#include <unistd.h>           // for close
 #include <algorithm>          // for max, min
 #include <cassert>            // for assert
 #include <cmath>              // for sqrtf
 #include <cstdio>             // for printf, size_t
-#include <cstring>            // for memcpy
+#include <atomic>             // for atomic_size_t
+#include <condition_variable> // for condition_variable
+#include <cstring>            // for memcpy, memcmp
+#include <fstream>            // for ofstream
 #include <iostream>           // for operator<<, endl, basic_ostream, cerr
 #include <limits>             // for numeric_limits
 #include <map>                // for map, _Rb_tree_iterator
 #include <scoped_allocator>   // for allocator_traits<>::value_type
 #include <string>             // for string, operator<<, char_traits
+#include <thread>             // for thread
 #include <vector>             // for vector
+#include "Frustum.h"          // for Frustum
 #include "tiny_obj_loader.h"  // for attrib_t, index_t, mesh_t, shape_t, Loa...
 
 
@@ -54,9 +64,56 @@ GLObj::GLObj(const std::string &strFile):m_strFile(strFile)
 
 void GLObj::Load()
 {
-	m_bLoaded = LoadObjAndConvert(m_strFile.c_str());
-	if (!m_bLoaded)
-		printf("Failed to load obj\n");
+	Prepare();
+	Upload();
+}
+
+void GLObj::Prepare()
+{
+	string strCache = m_strFile + ".objcache";
+	uint64_t uiKey = GetCacheKey();
+	m_uiMeshKey = uiKey;
+	if (uiKey && ShareMesh())
+	{
+		printf("##### %s ##### (shared, %zu objects)\n", m_strFile.c_str(), m_DrawObjects.size());
+		m_bPrepared = true;
+		return;
+	}
+	m_bPrepared = uiKey && LoadCache(strCache, uiKey);
+	if (!m_bPrepared)
+	{
+		m_bPrepared = LoadObjAndConvert(m_strFile.c_str());
+		if (!m_bPrepared)
+			printf("Failed to load obj\n");
+		else if (uiKey)
+			SaveCache(strCache, uiKey);
+	}
+}
+
+void GLObj::Upload()
+{
+	if (!m_bShared && m_uiMeshKey && ShareMesh())
+		m_vStaged.clear(); // Prepared alongside an identical one that got here first.
+	for (auto &staged : m_vStaged)
+		UploadObject(staged.vOwn.empty() ? staged.pfVB : staged.vOwn.data(), staged.vOwn.empty() ? staged.uiFloats : staged.vOwn.size(), staged.iMat);
+	m_vStaged.clear();
+	if (m_pCacheMap)
+	{
+		munmap(m_pCacheMap, m_uiCacheMapSize);
+		m_pCacheMap = nullptr;
+	}
+	m_bLoaded = m_bPrepared;
+	if (m_bLoaded && !m_bShared && m_uiMeshKey)
+	{
+		lock_guard<mutex> lock(GetMeshLock());
+		Mesh_t &mesh = GetMeshes()[m_uiMeshKey];
+		mesh.vObjs = m_DrawObjects;
+		mesh.vMaterials = m_materials;
+		memcpy(mesh.fMin, m_extMin, sizeof(m_extMin));
+		memcpy(mesh.fMax, m_extMax, sizeof(m_extMax));
+		mesh.uiRefs = 1;
+		m_bShared = true;
+	}
 
 	m_fMaxExtent = 0.5f * (m_extMax[0] - m_extMin[0]);
 	if (m_fMaxExtent < 0.5f * (m_extMax[1] - m_extMin[1])) {
@@ -94,6 +151,56 @@ void GLObj::SetSubobjectMaterial(unsigned iObj, unsigned iMat)
 		printf("GLObj: Tried to set invalid material or object.\n");
 }
 
+GLsizei GLObj::GetStride()
+{
+#if TEX_VCOLOR
+	return (3 + 3 + 3 + 2) * sizeof(float);
+#else
+	return (3 + 3) * sizeof(float);
+#endif
+}
+
+void GLObj::ApplyMaterial(size_t iMat)
+{
+	if (iMat >= m_materials.size())
+		return;
+	const tinyobj::material_t &mat = m_materials[iMat];
+	auto itTex = m_textures.find(mat.diffuse_texname);
+	if (itTex != m_textures.end()) {
+		glBindTexture(GL_TEXTURE_2D, itTex->second);
+	} else {
+		float fCopy[4] = {0,0,0,1.0f};
+		memcpy(fCopy,mat.ambient,3*(sizeof(float)));
+		glMaterialfv(GL_FRONT, GL_AMBIENT,  fCopy);
+		memcpy(fCopy,mat.diffuse,3*(sizeof(float)));
+		glMaterialfv(GL_FRONT, m_matMode, fCopy);
+		memcpy(fCopy,mat.specular,3*(sizeof(float)));
+		glMaterialfv(GL_FRONT, GL_SPECULAR, fCopy);
+		glMaterialf(GL_FRONT, GL_SHININESS, (mat.shininess/1000.f)*128.f);
+		memcpy(fCopy,mat.emission,3*(sizeof(float)));
+		glMaterialfv(GL_FRONT, GL_EMISSION, fCopy);
+	}
+}
+
+void GLObj::BakeTransform(float *pfVB, size_t uiVerts)
+{
+	size_t uiStride = GetStride()/sizeof(float);
+	for (size_t i=0; i<uiVerts; i++, pfVB += uiStride)
+	{
+		if (m_swapMode == SwapMode::YMINUSZ) // glRotatef(-90,1,0,0)
+		{
+			for (int j : {0, 3})
+			{
+				float fY = pfVB[j+1];
+				pfVB[j+1] = pfVB[j+2];
+				pfVB[j+2] = -fY;
+			}
+		}
+		for (int j=0; j<3; j++)
+			pfVB[j] += m_fCorr[j];
+	}
+}
+
 void GLObj::Draw() {
 	if (!m_bLoaded)
 		return;
@@ -101,20 +208,18 @@ void GLObj::Draw() {
 	glPolygonMode(GL_FRONT, GL_FILL);
 	glPolygonMode(GL_BACK, GL_FILL);
 
-#if TEX_VCOLOR
-	GLsizei stride = (3 + 3 + 3 + 2) * sizeof(float);
-#else
-	GLsizei stride = (3 + 3) * sizeof(float);
-#endif
+	GLsizei stride = GetStride();
 	glPushMatrix();
 	glTranslatef(m_fCorr[0],m_fCorr[1],m_fCorr[2]);
 	//glScalef(m_fScale,m_fScale,m_fScale);
 	if (m_swapMode == SwapMode::YMINUSZ)
 		glRotatef(-90,1,0,0);
+	Frustum frustum;
+	frustum.FromGL();
 	lock_guard<mutex> lock(m_lock);
 	for (size_t i = 0; i < m_DrawObjects.size(); i++) {
 		DrawObject o = m_DrawObjects.at(i);
-		if (o.vb < 1 || !o.bDraw) {
+		if (o.vb < 1 || !o.bDraw || frustum.IsOutside(o.fMin, o.fMax)) {
 			continue;
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, o.vb);
@@ -126,24 +231,7 @@ void GLObj::Draw() {
 		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 #endif
 
-		if ((o.material_id < m_materials.size())) {
-			std::string diffuse_texname = m_materials[o.material_id].diffuse_texname;
-			if (m_textures.find(diffuse_texname) != m_textures.end()) {
-				glBindTexture(GL_TEXTURE_2D, m_textures[diffuse_texname]);
-			} else {
-				float fCopy[4] = {0,0,0,1.0f};
-				memcpy(fCopy,m_materials[o.material_id].ambient,3*(sizeof(float)));
-				glMaterialfv(GL_FRONT, GL_AMBIENT,  fCopy);
-				memcpy(fCopy,m_materials[o.material_id].diffuse,3*(sizeof(float)));
-				glMaterialfv(GL_FRONT, m_matMode, fCopy);
-				memcpy(fCopy,m_materials[o.material_id].specular,3*(sizeof(float)));
-				glMaterialfv(GL_FRONT, GL_SPECULAR, fCopy);
-				glMaterialf(GL_FRONT, GL_SHININESS, (m_materials[o.material_id].shininess/1000.f)*128.f);
-				memcpy(fCopy,m_materials[o.material_id].emission,3*(sizeof(float)));
-				glMaterialfv(GL_FRONT, GL_EMISSION, fCopy);
-			}
-
-		}
+		ApplyMaterial(o.material_id);
 		glVertexPointer(3, GL_FLOAT, stride, (const void*)0);
 		glNormalPointer(GL_FLOAT, stride, (const void*)(sizeof(float) * 3));
 #if TEX_VCOLOR
@@ -287,7 +375,7 @@ bool GLObj::LoadObjAndConvert(const char* filename) {
 				if (current_material_id != iMatlId)
 				{
 					printf("Submaterial in shape %s: %u\n",shapes[s].name.c_str(),current_material_id);
-					printf("sub-Object %s: is # %u\n",shapes[s].name.c_str(),(int)m_DrawObjects.size());
+					printf("sub-Object %s: is # %u\n",shapes[s].name.c_str(),(int)m_vStaged.size());
 					AddObject(vb,iMatlId);
 					vb.clear();
 				}
@@ -408,7 +496,7 @@ bool GLObj::LoadObjAndConvert(const char* filename) {
 #endif
 				}
 			}
-			printf("Object %s: is # %u\n",shapes[s].name.c_str(),(int)m_DrawObjects.size());
+			printf("Object %s: is # %u\n",shapes[s].name.c_str(),(int)m_vStaged.size());
 			AddObject(vb, iMatlId);
 			// // OpenGL viewer does not support texturing with per-face material.
 			// if (shapes[s].mesh.material_ids.size() > 0 && shapes[s].mesh.material_ids.size() > s) {
@@ -428,24 +516,324 @@ bool GLObj::LoadObjAndConvert(const char* filename) {
 	return true;
 }
 
+// Cache layout: header, materials, object table, then each object's interleaved buffer.
+typedef struct ObjCacheHeader_t
+{
+	char magic[8];
+	uint32_t uiVersion;
+	uint32_t uiMaterials, uiObjects;
+	uint32_t uiReserved;
+	uint64_t uiKey;
+	float fMin[3], fMax[3];
+} ObjCacheHeader_t;
+
+typedef struct ObjCacheMaterial_t
+{
+	float ambient[3], diffuse[3], specular[3], emission[3];
+	float shininess;
+	char diffuse_texname[64];
+} ObjCacheMaterial_t;
+
+typedef struct ObjCacheObject_t
+{
+	int32_t iMaterial;
+	uint32_t uiFloats;
+	uint64_t uiOffset;
+} ObjCacheObject_t;
+
+static constexpr char g_strCacheMagic[8] = {'M','K','4','0','4','O','B','J'};
+
+// FNV-1a
+static uint64_t HashFile(const string &strFile, uint64_t uiHash, string *pMtlDir = nullptr, vector<string> *pvMtl = nullptr)
+{
+	int fd = open(strFile.c_str(), O_RDONLY);
+	if (fd<0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st)<0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	const char *pData = static_cast<const char*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+	close(fd);
+	if (pData == MAP_FAILED)
+		return 0;
+	for (off_t i=0; i<st.st_size; i++)
+	{
+		uiHash ^= static_cast<uint8_t>(pData[i]);
+		uiHash *= 0x100000001b3ULL;
+	}
+	if (pvMtl)
+	{
+		// Pick up the material libraries too, a change there must invalidate the cache.
+		const char *pEnd = pData + st.st_size;
+		for (const char *p = pData; p < pEnd; p = static_cast<const char*>(memchr(p, '\n', pEnd - p)) + 1)
+		{
+			if (pEnd - p > 7 && memcmp(p, "mtllib ", 7) == 0)
+			{
+				const char *pName = p + 7, *pNameEnd = pName;
+				while (pNameEnd < pEnd && *pNameEnd != '\n' && *pNameEnd != '\r')
+					pNameEnd++;
+				pvMtl->push_back(*pMtlDir + string(pName, pNameEnd));
+			}
+			if (!memchr(p, '\n', pEnd - p))
+				break;
+		}
+	}
+	munmap(const_cast<char*>(pData), st.st_size);
+	return uiHash;
+}
+
+uint64_t GLObj::GetCacheKey()
+{
+	uint64_t uiHash = 0xcbf29ce484222325ULL;
+	float fSettings[3] = {m_fScale, m_bNoNewNormals ? 1.f : 0.f, static_cast<float>(TEX_VCOLOR)};
+	for (size_t i=0; i<sizeof(fSettings); i++)
+	{
+		uiHash ^= reinterpret_cast<uint8_t*>(fSettings)[i];
+		uiHash *= 0x100000001b3ULL;
+	}
+	string strDir = GetBaseDir(m_strFile);
+	if (!strDir.empty())
+		strDir += "/";
+	vector<string> vMtl;
+	uiHash = HashFile(m_strFile, uiHash, &strDir, &vMtl);
+	for (auto &strMtl : vMtl)
+		if (uiHash)
+			uiHash = HashFile(strMtl, uiHash);
+	return uiHash;
+}
+
+bool GLObj::LoadCache(const string &strCache, uint64_t uiKey)
+{
+	int fd = open(strCache.c_str(), O_RDONLY);
+	if (fd<0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st)<0 || static_cast<size_t>(st.st_size) < sizeof(ObjCacheHeader_t))
+	{
+		close(fd);
+		return false;
+	}
+	const uint8_t *pData = static_cast<const uint8_t*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+	close(fd);
+	if (pData == MAP_FAILED)
+		return false;
+	size_t uiSize = st.st_size;
+	const ObjCacheHeader_t *pHdr = reinterpret_cast<const ObjCacheHeader_t*>(pData);
+	size_t uiTables = sizeof(ObjCacheHeader_t) + (pHdr->uiMaterials * sizeof(ObjCacheMaterial_t)) + (pHdr->uiObjects * sizeof(ObjCacheObject_t));
+	if (memcmp(pHdr->magic, g_strCacheMagic, sizeof(g_strCacheMagic)) || pHdr->uiVersion != m_uiCacheVersion || pHdr->uiKey != uiKey || uiTables > uiSize)
+	{
+		munmap(const_cast<uint8_t*>(pData), uiSize);
+		return false;
+	}
+	const ObjCacheMaterial_t *pMat = reinterpret_cast<const ObjCacheMaterial_t*>(pHdr+1);
+	const ObjCacheObject_t *pObj = reinterpret_cast<const ObjCacheObject_t*>(pMat + pHdr->uiMaterials);
+	for (uint32_t i=0; i<pHdr->uiObjects; i++)
+		if (pObj[i].uiOffset + (pObj[i].uiFloats*sizeof(float)) > uiSize)
+		{
+			munmap(const_cast<uint8_t*>(pData), uiSize);
+			return false;
+		}
+	m_materials.clear();
+	for (uint32_t i=0; i<pHdr->uiMaterials; i++)
+	{
+		tinyobj::material_t mat;
+		memcpy(mat.ambient, pMat[i].ambient, sizeof(pMat[i].ambient));
+		memcpy(mat.diffuse, pMat[i].diffuse, sizeof(pMat[i].diffuse));
+		memcpy(mat.specular, pMat[i].specular, sizeof(pMat[i].specular));
+		memcpy(mat.emission, pMat[i].emission, sizeof(pMat[i].emission));
+		mat.shininess = pMat[i].shininess;
+		mat.diffuse_texname = string(pMat[i].diffuse_texname, strnlen(pMat[i].diffuse_texname, sizeof(pMat[i].diffuse_texname)));
+		m_materials.push_back(mat);
+	}
+	for (uint32_t i=0; i<pHdr->uiObjects; i++)
+	{
+		// Uploaded straight from the mapping.
+		const float *pfVB = reinterpret_cast<const float*>(pData + pObj[i].uiOffset);
+		AddObject(pfVB, pObj[i].uiFloats, pObj[i].iMaterial);
+	}
+	memcpy(m_extMin, pHdr->fMin, sizeof(m_extMin));
+	memcpy(m_extMax, pHdr->fMax, sizeof(m_extMax));
+	// Stays mapped until Upload() has handed the buffers to GL.
+	m_pCacheMap = const_cast<uint8_t*>(pData);
+	m_uiCacheMapSize = uiSize;
+	printf("##### %s ##### (cached, %u objects)\n", m_strFile.c_str(), pHdr->uiObjects);
+	return true;
+}
+
+void GLObj::SaveCache(const string &strCache, uint64_t uiKey)
+{
+	ObjCacheHeader_t hdr {};
+	memcpy(hdr.magic, g_strCacheMagic, sizeof(g_strCacheMagic));
+	hdr.uiVersion = m_uiCacheVersion;
+	hdr.uiMaterials = m_materials.size();
+	hdr.uiObjects = m_vStaged.size();
+	hdr.uiKey = uiKey;
+	memcpy(hdr.fMin, m_extMin, sizeof(m_extMin));
+	memcpy(hdr.fMax, m_extMax, sizeof(m_extMax));
+	vector<ObjCacheMaterial_t> vMat(m_materials.size());
+	for (size_t i=0; i<m_materials.size(); i++)
+	{
+		memcpy(vMat[i].ambient, m_materials[i].ambient, sizeof(vMat[i].ambient));
+		memcpy(vMat[i].diffuse, m_materials[i].diffuse, sizeof(vMat[i].diffuse));
+		memcpy(vMat[i].specular, m_materials[i].specular, sizeof(vMat[i].specular));
+		memcpy(vMat[i].emission, m_materials[i].emission, sizeof(vMat[i].emission));
+		vMat[i].shininess = m_materials[i].shininess;
+		strncpy(vMat[i].diffuse_texname, m_materials[i].diffuse_texname.c_str(), sizeof(vMat[i].diffuse_texname)-1);
+	}
+	vector<ObjCacheObject_t> vObj(m_vStaged.size());
+	uint64_t uiOffset = sizeof(hdr) + (vMat.size()*sizeof(ObjCacheMaterial_t)) + (vObj.size()*sizeof(ObjCacheObject_t));
+	for (size_t i=0; i<vObj.size(); i++)
+	{
+		vObj[i].iMaterial = m_vStaged[i].iMat;
+		vObj[i].uiFloats = m_vStaged[i].vOwn.size();
+		vObj[i].uiOffset = uiOffset;
+		uiOffset += m_vStaged[i].vOwn.size()*sizeof(float);
+	}
+	// Write then rename so a concurrent or interrupted run never sees half a file.
+	string strTmp = strCache + ".tmp";
+	ofstream fCache(strTmp, ios::binary | ios::trunc);
+	if (!fCache.is_open())
+		return; // Read-only assets just don't get a cache.
+	fCache.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+	fCache.write(reinterpret_cast<const char*>(vMat.data()), vMat.size()*sizeof(ObjCacheMaterial_t));
+	fCache.write(reinterpret_cast<const char*>(vObj.data()), vObj.size()*sizeof(ObjCacheObject_t));
+	for (auto &staged : m_vStaged)
+		fCache.write(reinterpret_cast<const char*>(staged.vOwn.data()), staged.vOwn.size()*sizeof(float));
+	fCache.close();
+	if (!fCache.good() || rename(strTmp.c_str(), strCache.c_str())<0)
+		remove(strTmp.c_str());
+}
+
+bool GLObj::ShareMesh()
+{
+	lock_guard<mutex> lock(GetMeshLock());
+	auto it = GetMeshes().find(m_uiMeshKey);
+	if (it == GetMeshes().end())
+		return false;
+	Mesh_t &mesh = it->second;
+	mesh.uiRefs++;
+	{
+		lock_guard<mutex> lockObj(m_lock);
+		m_DrawObjects = mesh.vObjs; // Our own visibility and materials, the same buffers.
+	}
+	m_materials = mesh.vMaterials;
+	memcpy(m_extMin, mesh.fMin, sizeof(m_extMin));
+	memcpy(m_extMax, mesh.fMax, sizeof(m_extMax));
+	m_bShared = true;
+	return true;
+}
+
+void GLObj::ReleaseBuffers()
+{
+	lock_guard<mutex> lockObj(m_lock);
+	if (m_bShared)
+	{
+		lock_guard<mutex> lock(GetMeshLock());
+		auto it = GetMeshes().find(m_uiMeshKey);
+		if (it != GetMeshes().end() && --it->second.uiRefs == 0)
+		{
+			for (auto &obj : it->second.vObjs)
+				if (obj.vb)
+					glDeleteBuffers(1, &obj.vb);
+			GetMeshes().erase(it);
+		}
+		m_bShared = false;
+	}
+	else
+	{
+		for (auto &obj : m_DrawObjects)
+			if (obj.vb)
+				glDeleteBuffers(1, &obj.vb);
+	}
+	for (auto &obj : m_DrawObjects)
+		obj.vb = 0;
+}
+
 void GLObj::AddObject(const vector<float> &vb, int iMatlId)
+{
+	m_vStaged.push_back({vb, nullptr, 0, iMatlId});
+}
+
+void GLObj::AddObject(const float *pfVB, size_t uiFloats, int iMatlId)
+{
+	m_vStaged.push_back({{}, pfVB, uiFloats, iMatlId});
+}
+
+void GLObj::UploadObject(const float *pfVB, size_t uiFloats, int iMatlId)
 {
 	DrawObject obj;
 	obj.vb = 0;
 	obj.numTriangles = 0;
-	if (vb.size() > 0) {
+	if (uiFloats > 0) {
 		glGenBuffers(1, &obj.vb);
 		glBindBuffer(GL_ARRAY_BUFFER, obj.vb);
-		glBufferData(GL_ARRAY_BUFFER, vb.size() * sizeof(float), &vb.at(0),
+		glBufferData(GL_ARRAY_BUFFER, uiFloats * sizeof(float), pfVB,
 									GL_STATIC_DRAW);
 #if TEX_VCOLOR
-		obj.numTriangles = vb.size() / ((3 + 3 + 3 + 2) * 3);
+		obj.numTriangles = uiFloats / ((3 + 3 + 3 + 2) * 3);
 #else
-		obj.numTriangles = vb.size() / ((3 + 3) * 3);
+		obj.numTriangles = uiFloats / ((3 + 3) * 3);
 #endif
 		// printf("shape[%d] # of triangles = %d\n", static_cast<int>(s), obj.numTriangles);
 	}
 	obj.bDraw = true;
 	obj.material_id = iMatlId;
+	// For culling. An empty one gets an inverted box, which is outside everything.
+	size_t uiStride = GetStride()/sizeof(float);
+	for (int j=0; j<3; j++)
+	{
+		obj.fMin[j] = std::numeric_limits<float>::max();
+		obj.fMax[j] = -std::numeric_limits<float>::max();
+	}
+	for (size_t i=0; i + 3 <= uiFloats; i += uiStride)
+		for (int j=0; j<3; j++)
+		{
+			obj.fMin[j] = std::min(obj.fMin[j], pfVB[i+j]);
+			obj.fMax[j] = std::max(obj.fMax[j], pfVB[i+j]);
+		}
 	m_DrawObjects.push_back(obj);
 }
+
+void GLObj::LoadAll(const vector<GLObj*> &vObjs)
+{
+	if (vObjs.empty())
+		return;
+	// Parsing and conversion run on the pool, uploads here as each one finishes since GL is bound to this thread.
+	mutex lock;
+	condition_variable cv;
+	vector<GLObj*> vDone;
+	atomic_size_t uiNext {0};
+	auto fcnWork = [&]()
+	{
+		for (size_t i = uiNext++; i<vObjs.size(); i = uiNext++)
+		{
+			vObjs[i]->Prepare();
+			lock_guard<mutex> guard(lock);
+			vDone.push_back(vObjs[i]);
+			cv.notify_one();
+		}
+	};
+	size_t uiThreads = std::min<size_t>(std::max(1U, thread::hardware_concurrency()), vObjs.size());
+	vector<thread> vThreads;
+	for (size_t i=0; i<uiThreads; i++)
+		vThreads.emplace_back(fcnWork);
+	for (size_t uiUploaded = 0; uiUploaded<vObjs.size();)
+	{
+		vector<GLObj*> vReady;
+		{
+			unique_lock<mutex> guard(lock);
+			cv.wait(guard, [&vDone]{ return !vDone.empty(); });
+			vReady.swap(vDone);
+		}
+		for (auto pObj : vReady)
+		{
+			pObj->Upload();
+			printf("Loaded model %zu/%zu: %s\n", ++uiUploaded, vObjs.size(), pObj->m_strFile.c_str());
+		}
+	}
+	for (auto &t : vThreads)
+		t.join();
+}
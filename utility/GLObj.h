@@ -23,6 +23,7 @@
 
 #include <GL/glew.h>          // for GLuint
 #include <stddef.h>           // for size_t
+#include <stdint.h>           // for uint64_t
 #include "tiny_obj_loader.h"  // for material_t
 #include <map>                // for map
 #include <string>             // for string
@@ -46,9 +47,19 @@ class GLObj
 		};
 
         // Loads the file. This allows you to have fixed members but delay load them if needed.
+        // The converted buffers are cached next to the .obj (as .objcache) to skip parsing next time.
         void Load();
 
+		// Load() in two halves: Prepare() parses/converts and may run on any thread,
+		// Upload() creates the GL buffers and must run on the GL thread.
+		void Prepare();
+		void Upload();
+
+		// Loads several objects, preparing them in parallel on a thread pool.
+		static void LoadAll(const vector<GLObj*> &vObjs);
+
         // Draws the .obj within the current GL matrix transformation. Does nothing if !loaded.
+        // Objects merged into a GLObjBatch have handed over their buffers and must be drawn through it.
         void Draw();
 
 		// Swaps axes on load .
@@ -77,12 +88,14 @@ class GLObj
 
 
     private:
+		friend class GLObjBatch;
 
         typedef struct {
             GLuint vb;  // vertex buffer
             int numTriangles;
             size_t material_id; // Atomic to allow for cross thread
             bool bDraw;
+            float fMin[3], fMax[3]; // Bounds of its vertices, before the Draw() offset/axis swap
         } DrawObject;
         float m_fMaxExtent;
         float m_extMin[3], m_extMax[3];
@@ -105,4 +118,53 @@ class GLObj
         bool LoadObjAndConvert(const char* filename);
 
 		void AddObject(const vector<float> &vb, int iMatlId);
+		void AddObject(const float *pfVB, size_t uiFloats, int iMatlId);
+		void UploadObject(const float *pfVB, size_t uiFloats, int iMatlId);
+
+		// Sets up the GL material/texture state for a sub-object material.
+		void ApplyMaterial(size_t iMat);
+		// Applies the Draw() offset/axis swap to converted vertices, for merging into a batch.
+		void BakeTransform(float *pfVB, size_t uiVerts);
+		static GLsizei GetStride();
+
+		// Gives up this object's hold on its GL buffers, e.g. once a batch has copied them.
+		// Shared buffers go when the last object lets go. GL thread only.
+		void ReleaseBuffers();
+
+		// Uploaded meshes, shared by the objects with the same cache key (file contents and
+		// load settings), so a repeated model is parsed and uploaded once. There is one GL context.
+		typedef struct Mesh_t
+		{
+			vector<DrawObject> vObjs;
+			vector<tinyobj::material_t> vMaterials;
+			float fMin[3], fMax[3];
+			unsigned int uiRefs = 0;
+		} Mesh_t;
+		static map<uint64_t, Mesh_t>& GetMeshes() { static map<uint64_t, Mesh_t> mMeshes; return mMeshes; }
+		static mutex& GetMeshLock() { static mutex lock; return lock; }
+		// Takes a reference on an uploaded mesh with our key, if there is one.
+		bool ShareMesh();
+		uint64_t m_uiMeshKey = 0;
+		bool m_bShared = false; // Holding a reference in GetMeshes().
+
+		// Converted buffers waiting for Upload(), either owned or pointing into the cache mapping.
+		typedef struct Staged_t
+		{
+			vector<float> vOwn;
+			const float *pfVB;
+			size_t uiFloats;
+			int iMat;
+		} Staged_t;
+		vector<Staged_t> m_vStaged;
+		bool m_bPrepared = false;
+		void *m_pCacheMap = nullptr;
+		size_t m_uiCacheMapSize = 0;
+
+		// Hash of the .obj and its .mtl files plus the load settings. 0 if the file can't be read.
+		uint64_t GetCacheKey();
+		// Uploads straight from the mapped cache file, if it matches the key.
+		bool LoadCache(const string &strCache, uint64_t uiKey);
+		void SaveCache(const string &strCache, uint64_t uiKey);
+
+		static constexpr uint32_t m_uiCacheVersion = 1;
 };
@@ -0,0 +1,223 @@
+/*
+	GLObjBatch.cpp - Merges the sub-objects of one or more GLObjs that move together
+	into a single static buffer, drawn in material order with as few calls as possible.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "GLObjBatch.h"
+#include <GL/glew.h>  // for glBindBuffer, glBufferSubData, glMultiDrawArrays
+#include <stdint.h>   // for SIZE_MAX
+#include <stdio.h>    // for printf
+#include <algorithm>  // for stable_sort, min, max, copy
+#include <limits>     // for numeric_limits
+#include <mutex>      // for unique_lock
+#include "Frustum.h"  // for Frustum
+#include "GLObj.h"    // for GLObj
+
+void GLObjBatch::Build(const std::vector<GLObj*> &vObjs)
+{
+	size_t uiStride = GLObj::GetStride()/sizeof(float);
+	size_t uiVerts = 0;
+	for (auto pObj : vObjs)
+	{
+		if (!pObj->m_bLoaded)
+			continue;
+		std::vector<size_t> vOrder;
+		for (size_t i=0; i<pObj->m_DrawObjects.size(); i++)
+			if (pObj->m_DrawObjects[i].vb)
+				vOrder.push_back(i);
+		// Same material next to each other so they collapse into one draw.
+		std::stable_sort(vOrder.begin(), vOrder.end(), [pObj](size_t a, size_t b) { return pObj->m_DrawObjects[a].material_id < pObj->m_DrawObjects[b].material_id; });
+		for (auto i : vOrder)
+		{
+			GLsizei iCount = 3 * pObj->m_DrawObjects[i].numTriangles;
+			m_vRanges.push_back({pObj, i, static_cast<GLint>(uiVerts), iCount, {}, {}}); // Bounds once baked
+			uiVerts += iCount;
+		}
+	}
+	if (!uiVerts)
+		return;
+
+	glGenBuffers(1, &m_uiBuffer);
+	// Without GL_COPY_WRITE_BUFFER (GL 3.1) to keep the batch bound beside the sources, it is built in memory.
+	bool bCopyTarget = GLEW_VERSION_3_1 || GLEW_ARB_copy_buffer;
+	std::vector<float> vScratch, vAll;
+	if (bCopyTarget)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_uiBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, uiVerts * GLObj::GetStride(), nullptr, GL_STATIC_DRAW);
+	}
+	else
+		vAll.resize(uiVerts * uiStride);
+	for (int j=0; j<3; j++)
+	{
+		m_fMin[j] = std::numeric_limits<float>::max();
+		m_fMax[j] = -std::numeric_limits<float>::max();
+	}
+	for (auto &range : m_vRanges)
+	{
+		GLuint &uiVB = range.pObj->m_DrawObjects[range.uiSub].vb;
+		vScratch.resize(range.iCount * uiStride);
+		glBindBuffer(GL_ARRAY_BUFFER, uiVB);
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, vScratch.size()*sizeof(float), vScratch.data());
+		range.pObj->BakeTransform(vScratch.data(), range.iCount);
+		for (int j=0; j<3; j++)
+		{
+			range.fMin[j] = std::numeric_limits<float>::max();
+			range.fMax[j] = -std::numeric_limits<float>::max();
+		}
+		for (size_t i=0; i<vScratch.size(); i += uiStride)
+			for (int j=0; j<3; j++)
+			{
+				range.fMin[j] = std::min(range.fMin[j], vScratch[i+j]);
+				range.fMax[j] = std::max(range.fMax[j], vScratch[i+j]);
+			}
+		for (int j=0; j<3; j++)
+		{
+			m_fMin[j] = std::min(m_fMin[j], range.fMin[j]);
+			m_fMax[j] = std::max(m_fMax[j], range.fMax[j]);
+		}
+		if (bCopyTarget)
+			glBufferSubData(GL_COPY_WRITE_BUFFER, range.iFirst * GLObj::GetStride(), vScratch.size()*sizeof(float), vScratch.data());
+		else
+			std::copy(vScratch.begin(), vScratch.end(), vAll.begin() + range.iFirst * uiStride);
+	}
+	for (auto pObj : vObjs)
+		if (pObj->m_bLoaded)
+			pObj->ReleaseBuffers(); // Others may still be drawing the same mesh.
+	if (bCopyTarget)
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, m_uiBuffer);
+		glBufferData(GL_ARRAY_BUFFER, vAll.size()*sizeof(float), vAll.data(), GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	printf("Batched %zu objects (%zu sub-objects, %zu vertices)\n", vObjs.size(), m_vRanges.size(), uiVerts);
+}
+
+// The box's faces for an occlusion query, colour and depth writes are off so winding doesn't matter.
+static void DrawBox(const float fMin[3], const float fMax[3])
+{
+	static constexpr int iFaces[6][4] = {{0,1,3,2}, {4,6,7,5}, {0,4,5,1}, {2,3,7,6}, {0,2,6,4}, {1,5,7,3}};
+	glBegin(GL_QUADS);
+	for (auto &face : iFaces)
+		for (int iCorner : face)
+			glVertex3f(iCorner & 4U ? fMax[0] : fMin[0], iCorner & 2U ? fMax[1] : fMin[1], iCorner & 1U ? fMax[2] : fMin[2]);
+	glEnd();
+}
+
+void GLObjBatch::Draw(const float (*pOffsets)[3], size_t uiInstances)
+{
+	if (!m_uiBuffer || !uiInstances)
+		return;
+
+	Frustum frustum;
+	frustum.FromGL();
+
+	// Work out the runs once, the instances then only differ by the matrix.
+	m_vRuns.clear();
+	m_vFirst.clear();
+	m_vCount.clear();
+	std::vector<std::unique_lock<std::mutex>> vLocks;
+	GLObj *pLastObj = nullptr;
+	size_t uiLastMat = SIZE_MAX;
+	for (auto &range : m_vRanges)
+	{
+		if (range.pObj != pLastObj)
+		{
+			// Materials are per object, so an object boundary always starts a new run.
+			vLocks.emplace_back(range.pObj->m_lock);
+			pLastObj = range.pObj;
+			uiLastMat = SIZE_MAX;
+		}
+		auto &sub = range.pObj->m_DrawObjects[range.uiSub];
+		// Copies are each somewhere else, so only a single draw can cull sub-objects.
+		if (!sub.bDraw || (!pOffsets && frustum.IsOutside(range.fMin, range.fMax)))
+			continue;
+		if (sub.material_id != uiLastMat)
+		{
+			m_vRuns.push_back({range.pObj, sub.material_id, m_vFirst.size(), 0});
+			uiLastMat = sub.material_id;
+		}
+		if (m_vRuns.back().uiCount && m_vFirst.back() + m_vCount.back() == range.iFirst)
+			m_vCount.back() += range.iCount;
+		else
+		{
+			m_vFirst.push_back(range.iFirst);
+			m_vCount.push_back(range.iCount);
+			m_vRuns.back().uiCount++;
+		}
+	}
+	if (m_vRuns.empty())
+		return;
+
+	static const bool bOcclusion = GLEW_VERSION_3_0;
+	if (bOcclusion && m_vQueries.size() < uiInstances)
+	{
+		size_t uiHave = m_vQueries.size();
+		m_vQueries.resize(uiInstances);
+		glGenQueries(uiInstances - uiHave, &m_vQueries[uiHave]);
+	}
+
+	glPolygonMode(GL_FRONT, GL_FILL);
+	glPolygonMode(GL_BACK, GL_FILL);
+	glBindBuffer(GL_ARRAY_BUFFER, m_uiBuffer);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, GLObj::GetStride(), (const void*)0);
+	glNormalPointer(GL_FLOAT, GLObj::GetStride(), (const void*)(sizeof(float) * 3));
+
+	for (size_t i=0; i<uiInstances; i++)
+	{
+		const float *pfOffset = pOffsets ? pOffsets[i] : nullptr;
+		if (frustum.IsOutside(m_fMin, m_fMax, pfOffset))
+			continue;
+		// Not from inside the box (nozzle cam), its faces would be clipped and it would never pass.
+		bool bQuery = bOcclusion && !frustum.CrossesNear(m_fMin, m_fMax, pfOffset);
+		if (pOffsets)
+		{
+			glPushMatrix();
+			glTranslatef(pOffsets[i][0], pOffsets[i][1], pOffsets[i][2]);
+		}
+		if (bQuery)
+		{
+			glPushAttrib(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_ENABLE_BIT);
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			glDepthMask(GL_FALSE);
+			glDisable(GL_CULL_FACE);
+			glBeginQuery(GL_SAMPLES_PASSED, m_vQueries[i]);
+			DrawBox(m_fMin, m_fMax);
+			glEndQuery(GL_SAMPLES_PASSED);
+			glPopAttrib();
+			glBeginConditionalRender(m_vQueries[i], GL_QUERY_NO_WAIT);
+		}
+		for (auto &run : m_vRuns)
+		{
+			run.pObj->ApplyMaterial(run.uiMat);
+			glMultiDrawArrays(GL_TRIANGLES, &m_vFirst[run.uiStart], &m_vCount[run.uiStart], run.uiCount);
+		}
+		if (bQuery)
+			glEndConditionalRender();
+		if (pOffsets)
+			glPopMatrix();
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,75 @@
+/*
+	GLObjBatch.h - Merges the sub-objects of one or more GLObjs that move together
+	into a single static buffer, drawn in material order with as few calls as possible.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <GL/glew.h>  // for GLint, GLsizei, GLuint
+#include <stddef.h>   // for size_t
+#include <vector>     // for vector
+
+class GLObj;
+
+class GLObjBatch
+{
+	public:
+		// Copies the loaded objects' geometry into one buffer with their offsets baked in,
+		// then releases the objects' own buffers. GL thread only.
+		void Build(const std::vector<GLObj*> &vObjs);
+
+		// Draws within the current GL matrix. Sub-object visibility and material changes
+		// made on the source objects are still honoured.
+		// With pOffsets, draws uiInstances copies, each translated by its offset, for the
+		// cost of one visibility/material pass: the bucket is bound and the runs worked out once.
+		// Sub-objects outside the view frustum are skipped (whole copies, with pOffsets), and
+		// on GL 3.0 each copy is drawn conditionally on its bounding box passing the depth test
+		// against what has been drawn so far, without waiting for the result.
+		void Draw(const float (*pOffsets)[3] = nullptr, size_t uiInstances = 1);
+
+		inline bool IsBuilt() const { return m_uiBuffer != 0; }
+
+	private:
+		typedef struct Range_t
+		{
+			GLObj *pObj;
+			size_t uiSub; // Index into the object's sub-objects
+			GLint iFirst;
+			GLsizei iCount;
+			float fMin[3], fMax[3]; // As baked
+		} Range_t;
+
+		// One glMultiDrawArrays, of m_vFirst/m_vCount[uiStart, uiStart + uiCount).
+		typedef struct Run_t
+		{
+			GLObj *pObj;
+			size_t uiMat;
+			size_t uiStart;
+			GLsizei uiCount;
+		} Run_t;
+
+		GLuint m_uiBuffer = 0;
+		float m_fMin[3], m_fMax[3];      // All of it
+		std::vector<GLuint> m_vQueries; // Occlusion, one per instance
+		std::vector<Range_t> m_vRanges; // Grouped by object, then in material order
+		std::vector<Run_t> m_vRuns;     // This frame's draws, reused every frame
+		std::vector<GLint> m_vFirst;
+		std::vector<GLsizei> m_vCount;
+};
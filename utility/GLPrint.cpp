@@ -20,40 +20,297 @@
  */
 
 #include "GLPrint.h"
+#include <stdio.h>     // for printf, fprintf, stderr
 #include <stdlib.h>    // for abs
-#include <algorithm>   // for transform
-#include <functional>  // for minus
-#include <GL/glew.h>   // for glMaterialfv, GL_FRONT_AND_BACK, glDisableClie...
+#include <unistd.h>    // for usleep
+#include <algorithm>   // for copy, fill, min, max
+#include <cmath>       // for sqrt
+#include <string>      // for string
+#include <utility>     // for pair
+#include <GL/glew.h>   // for glMaterialfv, GL_FRONT_AND_BACK, glBufferSubData...
+#include "RedrawFlag.h"  // for RedrawFlag
+#include "RenderQuality.h" // for RenderQuality
+#include "ThreadPolicy.h" // for ThreadPolicy
 
 static constexpr int iPrintRes = 100000; //0.1mm (meters/this)
 
+constexpr float GLPrint::m_fMinHeight, GLPrint::m_fMaxHeight;
+
+// Each line of a strip becomes a six-sided tube, the diameter of the extrusion ending there,
+// lit like the fixed pipeline would with GL_LIGHT0 and the current material.
+static const char *pszTubeVert =
+	"#version 150 compatibility\n"
+	"in float aWidth;\n"
+	"out float vWidth;\n"
+	"void main() { gl_Position = gl_Vertex; vWidth = aWidth; }\n";
+
+static const char *pszTubeGeom =
+	"#version 150 compatibility\n"
+	"layout(lines) in;\n"
+	"layout(triangle_strip, max_vertices = 14) out;\n"
+	"in float vWidth[];\n"
+	"out vec3 gNormal, gEye;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 a = gl_in[0].gl_Position.xyz, b = gl_in[1].gl_Position.xyz, d = b - a;\n"
+	"	if (dot(d, d) < 1e-14) return;\n"
+	"	vec3 s = cross(d, vec3(0, 1, 0));\n"
+	"	s = dot(s, s) < 1e-14 ? vec3(1, 0, 0) : normalize(s);\n" // Straight up, a Z hop.
+	"	vec3 u = normalize(cross(s, d));\n"
+	"	float r = vWidth[1] * 0.5;\n"
+	"	for (int i = 0; i <= 6; i++)\n"
+	"	{\n"
+	"		float t = 1.0471976 * float(i);\n"
+	"		vec3 n = cos(t) * s + sin(t) * u;\n"
+	"		gNormal = gl_NormalMatrix * n;\n"
+	"		vec4 p = vec4(a + n * r, 1);\n"
+	"		gEye = (gl_ModelViewMatrix * p).xyz;\n"
+	"		gl_Position = gl_ModelViewProjectionMatrix * p;\n"
+	"		EmitVertex();\n"
+	"		p = vec4(b + n * r, 1);\n"
+	"		gEye = (gl_ModelViewMatrix * p).xyz;\n"
+	"		gl_Position = gl_ModelViewProjectionMatrix * p;\n"
+	"		EmitVertex();\n"
+	"	}\n"
+	"	EndPrimitive();\n"
+	"}\n";
+
+static const char *pszTubeFrag =
+	"#version 150 compatibility\n"
+	"in vec3 gNormal, gEye;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 n = normalize(gNormal);\n"
+	"	vec4 pos = gl_LightSource[0].position;\n"
+	"	vec3 l = normalize(pos.w == 0.0 ? pos.xyz : pos.xyz - gEye);\n"
+	"	float fDiff = max(dot(n, l), 0.0);\n"
+	"	vec4 c = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient + gl_FrontLightProduct[0].diffuse * fDiff;\n"
+	"	if (fDiff > 0.0)\n"
+	"		c += gl_FrontLightProduct[0].specular * pow(max(dot(n, normalize(l - normalize(gEye))), 0.0), gl_FrontMaterial.shininess);\n"
+	"	gl_FragColor = vec4(c.rgb, 1);\n"
+	"}\n";
+
+unsigned int GLPrint::GetTubeProgram()
+{
+	static unsigned int uiProg = []()
+	{
+		if (!GLEW_VERSION_3_2)
+		{
+			printf("GLPrint: No geometry shaders (GL 3.2), the print is drawn as lines.\n");
+			return 0U;
+		}
+		auto fcnLog = [](const char *pszWhat, unsigned int uiObj, bool bProg)
+		{
+			int iLen = 0;
+			bProg ? glGetProgramiv(uiObj, GL_INFO_LOG_LENGTH, &iLen) : glGetShaderiv(uiObj, GL_INFO_LOG_LENGTH, &iLen);
+			std::string strLog(iLen>0 ? iLen : 1, '\0');
+			bProg ? glGetProgramInfoLog(uiObj, iLen, nullptr, &strLog[0]) : glGetShaderInfoLog(uiObj, iLen, nullptr, &strLog[0]);
+			fprintf(stderr, "GLPrint: The tube %s failed, drawing the print as lines:\n%s\n", pszWhat, strLog.c_str());
+		};
+		unsigned int uiProg = glCreateProgram();
+		const std::array<std::pair<GLenum, const char*>,3> vShaders = {{{GL_VERTEX_SHADER, pszTubeVert}, {GL_GEOMETRY_SHADER, pszTubeGeom}, {GL_FRAGMENT_SHADER, pszTubeFrag}}};
+		for (auto &shader : vShaders)
+		{
+			unsigned int uiShader = glCreateShader(shader.first);
+			glShaderSource(uiShader, 1, &shader.second, nullptr);
+			glCompileShader(uiShader);
+			int iOK = 0;
+			glGetShaderiv(uiShader, GL_COMPILE_STATUS, &iOK);
+			if (!iOK)
+			{
+				fcnLog("shader", uiShader, false);
+				glDeleteShader(uiShader);
+				glDeleteProgram(uiProg);
+				return 0U;
+			}
+			glAttachShader(uiProg, uiShader);
+			glDeleteShader(uiShader); // Goes with the program.
+		}
+		glBindAttribLocation(uiProg, m_uiWidthAttrib, "aWidth");
+		glLinkProgram(uiProg);
+		int iOK = 0;
+		glGetProgramiv(uiProg, GL_LINK_STATUS, &iOK);
+		if (!iOK)
+		{
+			fcnLog("program", uiProg, true);
+			glDeleteProgram(uiProg);
+			return 0U;
+		}
+		return uiProg;
+	}();
+	return uiProg;
+}
+
 GLPrint::GLPrint(float fR, float fG, float fB):m_fColR(fR),m_fColG(fG),m_fColB(fB)
 {
-	Clear();
+	ResetWriter();
+}
+
+GLPrint::~GLPrint()
+{
+	if (m_thMesher)
+	{
+		m_bQuit = true;
+		pthread_join(m_thMesher, nullptr);
+	}
+	Layer_t *pLayer;
+	while (m_layers.Pop(pLayer))
+		delete pLayer;
 }
 
 void GLPrint::Clear()
+{
+	// The geometry belongs to the AVR thread, so it does the actual reset. Nothing is drawn until then.
+	m_uiClearReq++;
+}
+
+void GLPrint::VisitStrips(const function<void(const float*, int)> &fcnStrip)
+{
+	unsigned int uiChunks = m_uiChunks.load(std::memory_order_acquire);
+	for (unsigned int i=0; i<uiChunks; i++)
+	{
+		Chunk_t &chunk = *m_vpChunks[i];
+		unsigned int uiSegs = chunk.uiSegs.load(std::memory_order_acquire);
+		unsigned int uiVerts = chunk.uiVerts.load(std::memory_order_acquire);
+		if (chunk.fPos.empty())
+			continue;
+		for (unsigned int s=0; s<uiSegs; s++)
+			if (chunk.iStart[s] >= 0 && static_cast<unsigned int>(chunk.iStart[s] + chunk.iCount[s]) <= uiVerts)
+				fcnStrip(&chunk.fPos[chunk.iStart[s]*3], chunk.iCount[s]);
+	}
+}
+
+void GLPrint::ResetWriter()
 {
 	m_iExtrStart = m_iExtrEnd = {{0,0,0,0}};
 	m_fExtrStart = m_fExtrEnd = {{0,0,0,0}};
-	m_ivCount.clear();
-	m_ivStart.clear();
-	m_fvDraw.clear();
-	m_fvNorms.clear();
+	for (auto &pChunk : m_vpChunks)
+		if (pChunk)
+		{
+			pChunk->uiVerts = 0;
+			pChunk->uiSegs = 0;
+		}
+	m_uiChunks = 0;
+	m_iOpenStart = -1;
+	for (auto &f : m_fCursor)
+		f = 0;
+	m_bStaged = m_bSegOpen = m_bFull = false;
 	m_bExtruding = false;
 	m_fEMax = -1;
 }
 
+float GLPrint::GetExtrWidth()
+{
+	float fD[3] = {m_fExtrEnd[0]-m_fExtrStart[0], m_fExtrEnd[1]-m_fExtrStart[1], m_fExtrEnd[2]-m_fExtrStart[2]};
+	float fLen = sqrt((fD[0]*fD[0]) + (fD[1]*fD[1]) + (fD[2]*fD[2]));
+	float fE = m_fExtrEnd[3] - m_fExtrStart[3];
+	if (fLen<1e-6f || fE<=0)
+		return m_fExtrWidth;
+	// A round extrusion of the same volume as the filament that went into it.
+	return std::min(std::max(m_fFilament*sqrt(fE/fLen), m_fExtrWidth/4.f), m_fExtrWidth*2.f);
+}
+
+void GLPrint::Stage(const float fPos[3], float fWidth)
+{
+	std::copy(fPos, fPos+3, m_fStagedPos.begin());
+	m_fStagedWidth = fWidth;
+	m_bStaged = true;
+	for (int i=0; i<3; i++)
+		m_fCursor[i].store(fPos[i], std::memory_order_relaxed);
+}
+
+void GLPrint::CommitStaged()
+{
+	if (!m_bStaged || m_bFull)
+		return;
+	m_bStaged = false;
+	unsigned int uiChunks = m_uiChunks.load(std::memory_order_relaxed);
+	Chunk_t *pChunk = uiChunks ? m_vpChunks[uiChunks-1].get() : nullptr;
+	uint32_t uiVerts = pChunk ? pChunk->uiVerts.load(std::memory_order_relaxed) : 0;
+	if (!pChunk || uiVerts == m_uiChunkVerts)
+	{
+		if (uiChunks == m_uiMaxChunks)
+		{
+			fprintf(stderr, "GLPrint: Out of geometry space, no longer drawing the print.\n");
+			m_bFull = true;
+			return;
+		}
+		Chunk_t *pOld = pChunk;
+		if (!m_vpChunks[uiChunks])
+			m_vpChunks[uiChunks].reset(new Chunk_t());
+		pChunk = m_vpChunks[uiChunks].get();
+		if (pChunk->fPos.empty()) // Reused after a Clear(), the GL thread let go of its vertices.
+		{
+			pChunk->fPos.resize(m_uiChunkVerts*3);
+			pChunk->fWidth.resize(m_uiChunkVerts);
+		}
+		pChunk->fZMin = 1e9f;
+		pChunk->fZMax = -1e9f;
+		uiVerts = 0;
+		if (m_bSegOpen && pOld)
+		{
+			// Split the strip across the boundary, repeating the last vertex so it stays joined.
+			uint32_t uiSegs = pOld->uiSegs.load(std::memory_order_relaxed);
+			pOld->iStart[uiSegs] = m_uiSegStart;
+			pOld->iCount[uiSegs] = m_uiChunkVerts - m_uiSegStart;
+			pOld->uiSegs.store(uiSegs+1, std::memory_order_release);
+			std::copy(pOld->fPos.end()-3, pOld->fPos.end(), pChunk->fPos.begin());
+			pChunk->fWidth[0] = pOld->fWidth.back();
+			uiVerts = 1;
+			pChunk->uiVerts.store(uiVerts, std::memory_order_release);
+			m_uiSegStart = 0;
+		}
+		m_iOpenStart.store(m_bSegOpen ? 0 : -1, std::memory_order_relaxed);
+		m_uiChunks.store(uiChunks+1, std::memory_order_release);
+	}
+	if (!m_bSegOpen)
+	{
+		m_bSegOpen = true;
+		m_uiSegStart = uiVerts;
+		m_iOpenStart.store(uiVerts, std::memory_order_release);
+	}
+	if (m_fStagedPos[1] < pChunk->fZMin)
+		pChunk->fZMin.store(m_fStagedPos[1], std::memory_order_relaxed);
+	if (m_fStagedPos[1] > pChunk->fZMax)
+		pChunk->fZMax.store(m_fStagedPos[1], std::memory_order_relaxed);
+	std::copy(m_fStagedPos.begin(), m_fStagedPos.end(), pChunk->fPos.begin() + uiVerts*3);
+	pChunk->fWidth[uiVerts] = m_fStagedWidth;
+	pChunk->uiVerts.store(uiVerts+1, std::memory_order_release);
+}
+
+void GLPrint::EndSegment()
+{
+	if (!m_bSegOpen)
+		return;
+	m_bSegOpen = false;
+	Chunk_t *pChunk = m_vpChunks[m_uiChunks.load(std::memory_order_relaxed)-1].get();
+	uint32_t uiSegs = pChunk->uiSegs.load(std::memory_order_relaxed);
+	pChunk->iStart[uiSegs] = m_uiSegStart;
+	pChunk->iCount[uiSegs] = pChunk->uiVerts.load(std::memory_order_relaxed) - m_uiSegStart;
+	pChunk->uiSegs.store(uiSegs+1, std::memory_order_release);
+	m_iOpenStart.store(-1, std::memory_order_release);
+}
+
 void GLPrint::NewCoord(float fX, float fY, float fZ, float fE)
 {
+	if (m_bRibbons && !m_thMesher)
+	{
+		auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::GL, "mesher"); GLPrint *p = static_cast<GLPrint*>(param); return p->RunMesher(); };
+		pthread_create(&m_thMesher, nullptr, fcnRun, this);
+	}
+	unsigned int uiReq = m_uiClearReq.load(std::memory_order_acquire);
+	// The mesher reads the chunks too, wait for it to let go of them.
+	if (uiReq != m_uiClearAck.load(std::memory_order_relaxed) && (!m_thMesher || m_uiMesherAck.load(std::memory_order_acquire) == uiReq))
+	{
+		ResetWriter();
+		m_uiClearAck.store(uiReq, std::memory_order_release);
+	}
 	if (m_fEMax<0) // First cycle/extrusion.
 	{
-		std::lock_guard<std::mutex> lock(m_lock); // Lock out GL while updating vectors
 		m_fEMax = fE;
 		m_fExtrEnd = m_fExtrStart = {{fX,fZ,fY,fE}};
 	}
 	int iX = fX*iPrintRes,iY = fY*iPrintRes,iZ = fZ*iPrintRes;
-	std::array<float,3> vfPos = {{fX,fZ,fY}};
 	// Test if the new coordinate is still collinear with the existing segment.
 	// Triangle area method. Slopes have risks of zero/inf/nan for very small deltas.
  	//Ax(By - Cy) + Bx(Cy - Ay) + Cx(Ay - By)
@@ -83,85 +340,42 @@ void GLPrint::NewCoord(float fX, float fY, float fZ, float fE)
 		// Extruding condition has changed. Start a new segment.
 		if (bExtruding) // Just started extruding. Update the various pointers.
 		{
-
-			m_ivTStart.push_back(m_fvTri.size()/3);
-			if (fZ>m_fCurZ)
-			{
-				//printf("New Z layer: %.02f\n", fZ);
-				//m_fLastZ = m_fCurZ;
-				//m_fCurZ = fZ;
-			}
 			//printf("New extrusion %u at index %u\n",m_ivStart.size(),m_ivStart.back());
-			// Add a temporary normal vertex
-			float fCross[3], fA[3],fB[3]= {0,-0.002,0};
-			std::transform(vfPos.begin(), vfPos.end(), m_fExtrEnd.data(), fA, std::minus<float>());
-			CrossProduct(fA,fB,fCross);
-			Normalize(fCross);
-			std::lock_guard<std::mutex> lock(m_lock); // Lock out GL while updating vectors
-			for (int i=0; i<4; i++)
-			{
-				m_iExtrStart = m_iExtrEnd;
-				m_fExtrStart = m_fExtrEnd;
-			}
-			m_ivStart.push_back(m_fvDraw.size()/3); // Index of what we're about to add...
-			m_fvDraw.insert(m_fvDraw.end(),m_fExtrEnd.data(), m_fExtrEnd.data()+3);
-			m_fvNorms.insert(m_fvNorms.end(), fCross, fCross+3);
+			m_iExtrStart = m_iExtrEnd;
+			m_fExtrStart = m_fExtrEnd;
+			Stage(m_fExtrEnd.data(), m_fExtrWidth); // Opens a new strip when committed. Nothing ends here, so the width isn't used.
 
 		}
-		// m_fvTri.push_back(m_fExtrEnd[0]);
-		// m_fvTri.push_back(m_fExtrEnd[1]-0.0002);
-		// m_fvTri.push_back(m_fExtrEnd[2]);
-		// m_fvTri.insert(m_fvTri.end(),m_fExtrEnd.data(), m_fExtrEnd.data()+3);
 
 		if (!bExtruding)
 		{
-			std::lock_guard<std::mutex> lock(m_lock);
-			m_ivCount.push_back((m_fvDraw.size()/3) - m_ivStart.back());
-			// m_ivTCount.push_back((m_fvTri.size()/3) - m_ivTStart.back());
+			CommitStaged();
+			EndSegment();
 			//printf("Ended extrusion %u (%u vertices)\n", m_ivCount.size(), m_ivCount.back());
 		}
 		m_bExtruding = bExtruding;
 	}
 	else if (!bColinear)
 	{
-		// First, update the previous normal with the new vertex info.
-		// TODO: fB really should be pointing at the nearest vertex on the layer below, but that's a lot of coordinate
-		// that's going to be disposable once this changes to a geometry or normal shader instead of the current implemetnation
-		// so I'm going to leave it as is for now.
-		float fCross[3], fA[3],fB[3]  = {0,-0.002,0};
-		float *pfPrev = (&m_fvNorms.back()) - 2;
-		std::transform(pfPrev, pfPrev+3, vfPos.data(), fA, std::minus<float>()); // Length from p->curr
-		CrossProduct(fA,fB,fCross);
-		Normalize(fCross);
-		pfPrev[0] +=fCross[0]; pfPrev[1] += fCross[1]; pfPrev[2] += fCross[2];
-		pfPrev[0]/=2.f; pfPrev[1]/=2.f; pfPrev[2]/=2.f;
-		// And then append the new temporary end one.
-		std::transform(vfPos.begin(), vfPos.end(), m_fExtrEnd.data(), fA, std::minus<float>());
-		CrossProduct(fA,fB,fCross);
-		Normalize(fCross);
-				// New segment, push it onto the vertex list and update the segment count
+		// New segment, push it onto the vertex list and update the segment count
 		//printf("New segment: %d\n",m_vCoords.size());
-		{
-			std::lock_guard<std::mutex> lock(m_lock); // Lock out GL while updating vectors
-			m_fvDraw.insert(m_fvDraw.end(),m_fExtrEnd.data(), m_fExtrEnd.data()+3);
-			m_fvNorms.insert(m_fvNorms.end(), fCross, fCross+3);
-			m_iExtrStart = m_iExtrEnd;
-			m_fExtrStart = m_fExtrEnd;
-		}
-		// m_fvTri.push_back(m_fExtrEnd[0]);
-		// m_fvTri.push_back(m_fExtrEnd[1]-0.0002);
-		// m_fvTri.push_back(m_fExtrEnd[2]);.
-		// m_fvTri.insert(m_fvTri.end(),m_fExtrEnd.data(), m_fExtrEnd.data()+3);
+		CommitStaged();
+		Stage(m_fExtrEnd.data(), GetExtrWidth());
+		m_iExtrStart = m_iExtrEnd;
+		m_fExtrStart = m_fExtrEnd;
 
 	}
 	// Update the end we are tracking.
 	m_fExtrEnd[0] = fX;
 	m_fExtrEnd[2] = fY;
 	m_fExtrEnd[1] = fZ;
+	m_fExtrEnd[3] = fE;
 	m_iExtrEnd[0] = iX;
 	m_iExtrEnd[2] = iY;
 	m_iExtrEnd[1] = iZ;
 	//m_iExtrEnd[3] = iE;
+	for (int i=0; i<3; i++)
+		m_fCursor[3+i].store(m_fExtrEnd[i], std::memory_order_relaxed);
 
 }
 
@@ -172,6 +386,20 @@ void GLPrint::Draw()
 	float fY[4] = {1,1,0,1};
 	float fK[4] = {0,0,0,1};
 	float fSpec[4] = {1,1,1,1};
+	unsigned int uiAck = m_uiClearAck.load(std::memory_order_acquire);
+	if (uiAck != m_uiClearReq.load(std::memory_order_relaxed))
+		return; // Waiting on the AVR thread to clear it.
+	if (uiAck != m_uiClearSeen)
+	{
+		// Keep the buffers, everything gets uploaded afresh.
+		std::fill(m_vUploaded.begin(), m_vUploaded.end(), 0);
+		for (auto &layer : m_vLayers)
+			glDeleteBuffers(1, &layer.uiBuffer);
+		m_vLayers.clear();
+		m_uiBlocks = 0;
+		m_uiLineChunk = m_uiLineSeg = 0;
+		m_uiClearSeen = uiAck;
+	}
 	glLineWidth(1.0);
 
 	glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,fSpec);
@@ -181,33 +409,91 @@ void GLPrint::Draw()
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 		glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fK);
-		//glVertexPointer(3, GL_FLOAT, 3*sizeof(float), m_fvTri.data());
-		// glMultiDrawArrays(GL_TRIANGLE_STRIP,m_ivTStart.data(),m_ivTCount.data(), m_ivTCount.size());
 		//glNormal3f(0,1,0);
 		glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fColor);
+		DrawRibbons();
+		// The strips have no normals, they are lit from above as lines, or the tube shader makes its own.
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glNormal3f(0,1,0);
+		unsigned int uiTubes = RenderQuality::DrawPrintWalls() ? GetTubeProgram() : 0;
+		GLboolean bCull = glIsEnabled(GL_CULL_FACE);
+		if (uiTubes)
+		{
+			glUseProgram(uiTubes);
+			glEnableVertexAttribArray(m_uiWidthAttrib);
+			glDisable(GL_CULL_FACE); // The print transform is mirrored, which turns the tubes inside out.
+		}
+		unsigned int uiChunks = m_uiChunks.load(std::memory_order_acquire);
+		if (m_vBuffers.size()<uiChunks)
+		{
+			size_t uiOld = m_vBuffers.size();
+			m_vBuffers.resize(uiChunks);
+			m_vUploaded.resize(uiChunks, 0);
+			glGenBuffers(uiChunks - uiOld, m_vBuffers.data() + uiOld);
+			for (size_t i=uiOld; i<uiChunks; i++)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, m_vBuffers[i]);
+				// Positions, then widths.
+				glBufferData(GL_ARRAY_BUFFER, m_uiChunkVerts*4*sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+			}
+		}
+		for (unsigned int i=0; i<uiChunks; i++)
 		{
-			std::lock_guard<std::mutex> lock(m_lock);
-			glVertexPointer(3, GL_FLOAT, 3*sizeof(float), m_fvDraw.data());
-			glNormalPointer(GL_FLOAT, 3*sizeof(float), m_fvNorms.data());
-			glMultiDrawArrays(GL_LINE_STRIP,m_ivStart.data(),m_ivCount.data(), m_ivCount.size());
-			glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fSpec);
-			if (m_ivCount.size()>0)
-				glDrawArrays(GL_LINE_STRIP,m_ivStart.back(),((m_fvDraw.size()/3)-m_ivStart.back())-1);
-			if (m_bExtruding && m_fvDraw.size() >0)
+			Chunk_t &chunk = *m_vpChunks[i];
+			uint32_t uiVerts = chunk.uiVerts.load(std::memory_order_acquire);
+			uint32_t uiSegs = chunk.uiSegs.load(std::memory_order_acquire);
+			glBindBuffer(GL_ARRAY_BUFFER, m_vBuffers[i]);
+			if (uiVerts > m_vUploaded[i])
 			{
-				glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fY);
-				glBegin(GL_LINES);
-					glVertex3fv((&m_fvDraw.back())-2);
-					glVertex3fv(m_fExtrEnd.data());
-				glEnd();
+				// Only what was added since the last frame.
+				size_t uiOff = m_vUploaded[i];
+				size_t uiLen = (uiVerts - m_vUploaded[i])*sizeof(float);
+				glBufferSubData(GL_ARRAY_BUFFER, uiOff*3*sizeof(float), uiLen*3, chunk.fPos.data() + uiOff*3);
+				glBufferSubData(GL_ARRAY_BUFFER, (m_uiChunkVerts*3 + uiOff)*sizeof(float), uiLen, chunk.fWidth.data() + uiOff);
+				m_vUploaded[i] = uiVerts;
+			}
+			glVertexPointer(3, GL_FLOAT, 3*sizeof(float), nullptr);
+			if (uiTubes)
+				glVertexAttribPointer(m_uiWidthAttrib, 1, GL_FLOAT, GL_FALSE, sizeof(float), reinterpret_cast<void*>(m_uiChunkVerts*3*sizeof(float)));
+			if (!IsVisible(chunk.fZMin.load(std::memory_order_relaxed), chunk.fZMax.load(std::memory_order_relaxed)))
+				continue;
+			if (i>m_uiLineChunk)
+				glMultiDrawArrays(GL_LINE_STRIP,chunk.iStart.data(),chunk.iCount.data(), uiSegs);
+			else if (i==m_uiLineChunk && uiSegs>m_uiLineSeg)
+				glMultiDrawArrays(GL_LINE_STRIP,chunk.iStart.data() + m_uiLineSeg,chunk.iCount.data() + m_uiLineSeg, uiSegs - m_uiLineSeg);
+			if (i+1 == uiChunks)
+			{
+				// Highlight the newest strip, whether still going or just finished.
+				glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fSpec);
+				int iStart = m_iOpenStart.load(std::memory_order_acquire);
+				if (iStart>=0 && static_cast<uint32_t>(iStart)<uiVerts)
+					glDrawArrays(GL_LINE_STRIP, iStart, uiVerts - iStart);
+				else if (iStart<0 && uiSegs>0)
+					glDrawArrays(GL_LINE_STRIP, chunk.iStart[uiSegs-1], chunk.iCount[uiSegs-1]);
 			}
 		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		if (uiTubes)
+		{
+			glDisableVertexAttribArray(m_uiWidthAttrib);
+			glUseProgram(0);
+			if (bCull)
+				glEnable(GL_CULL_FACE);
+		}
+		ReleaseChunks(uiChunks);
+		if (m_bExtruding)
+		{
+			glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fY);
+			glBegin(GL_LINES);
+				glVertex3f(m_fCursor[0], m_fCursor[1], m_fCursor[2]);
+				glVertex3f(m_fCursor[3], m_fCursor[4], m_fCursor[5]);
+			glEnd();
+		}
 		// Uncomment for vertex debugging.
 		 //glMaterialfv(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE,fG);
 		// glPointSize(1.0);
 		// glDrawArrays(GL_POINTS,0,m_fvDraw.size()/3);
 	glDisableClientState(GL_VERTEX_ARRAY);
-	glDisableClientState(GL_NORMAL_ARRAY);
 	// Normal visualization for debugging, draws the last 10.
 	// glBegin(GL_LINES);
 	// 	int iStart = 0;
@@ -223,3 +509,234 @@ void GLPrint::Draw()
 	//glDisable(GL_AUTO_NORMAL);
 	//glDisable(GL_NORMALIZE);
 }
+
+void GLPrint::DrawRibbons()
+{
+	Layer_t *pLayer;
+	while (m_layers.Pop(pLayer))
+	{
+		if (pLayer->uiGen == m_uiClearSeen) // Otherwise it was built before a Clear()
+		{
+			if (!pLayer->fPos.empty())
+			{
+				size_t uiLen = pLayer->fPos.size()*sizeof(float);
+				LayerBuf_t buf {0, static_cast<uint32_t>(pLayer->fPos.size()/3), pLayer->uiTopVerts, pLayer->fZ, pLayer->fZ};
+				glGenBuffers(1, &buf.uiBuffer);
+				glBindBuffer(GL_ARRAY_BUFFER, buf.uiBuffer);
+				glBufferData(GL_ARRAY_BUFFER, 2*uiLen, nullptr, GL_STATIC_DRAW);
+				glBufferSubData(GL_ARRAY_BUFFER, 0, uiLen, pLayer->fPos.data());
+				glBufferSubData(GL_ARRAY_BUFFER, uiLen, uiLen, pLayer->fNorm.data());
+				m_vLayers.push_back(buf);
+			}
+			m_uiLineChunk = pLayer->uiChunk;
+			m_uiLineSeg = pLayer->uiSeg;
+		}
+		delete pLayer;
+	}
+	if (m_vLayers.size() - m_uiBlocks >= m_uiKeepLayers + m_uiBlockLayers)
+		MergeLayers();
+	bool bWalls = RenderQuality::DrawPrintWalls(); // The tops come first, so a shorter draw leaves off the walls.
+	for (auto &layer : m_vLayers)
+	{
+		if (!IsVisible(layer.fZMin - m_fMaxHeight, layer.fZMax))
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, layer.uiBuffer);
+		glVertexPointer(3, GL_FLOAT, 3*sizeof(float), nullptr);
+		glNormalPointer(GL_FLOAT, 3*sizeof(float), reinterpret_cast<void*>(layer.uiVerts*3*sizeof(float)));
+		glDrawArrays(GL_TRIANGLES, 0, bWalls ? layer.uiVerts : layer.uiTopVerts);
+	}
+}
+
+void GLPrint::MergeLayers()
+{
+	// Lower layers are mostly covered by the ones above, so only their tops are kept. Fewer, bigger buffers draw faster too.
+	auto itBegin = m_vLayers.begin() + m_uiBlocks, itEnd = itBegin + m_uiBlockLayers;
+	LayerBuf_t block {0, 0, 0, itBegin->fZMin, itBegin->fZMax};
+	for (auto it = itBegin; it != itEnd; ++it)
+	{
+		block.uiVerts += it->uiTopVerts;
+		block.fZMin = std::min(block.fZMin, it->fZMin);
+		block.fZMax = std::max(block.fZMax, it->fZMax);
+	}
+	block.uiTopVerts = block.uiVerts;
+	size_t uiNormOff = block.uiVerts*3*sizeof(float), uiOff = 0;
+	glGenBuffers(1, &block.uiBuffer);
+	if (GLEW_VERSION_3_1 || GLEW_ARB_copy_buffer)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, block.uiBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, 2*uiNormOff, nullptr, GL_STATIC_DRAW);
+		for (auto it = itBegin; it != itEnd; ++it)
+		{
+			size_t uiLen = it->uiTopVerts*3*sizeof(float);
+			glBindBuffer(GL_COPY_READ_BUFFER, it->uiBuffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, uiOff, uiLen);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, it->uiVerts*3*sizeof(float), uiNormOff + uiOff, uiLen);
+			uiOff += uiLen;
+			glDeleteBuffers(1, &it->uiBuffer);
+		}
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	else
+	{
+		// No buffer to buffer copies (GL 3.1), so through memory: positions, then normals, as above.
+		vector<float> vData(2*block.uiVerts*3);
+		for (auto it = itBegin; it != itEnd; ++it)
+		{
+			size_t uiLen = it->uiTopVerts*3*sizeof(float);
+			glBindBuffer(GL_ARRAY_BUFFER, it->uiBuffer);
+			glGetBufferSubData(GL_ARRAY_BUFFER, 0, uiLen, reinterpret_cast<uint8_t*>(vData.data()) + uiOff);
+			glGetBufferSubData(GL_ARRAY_BUFFER, it->uiVerts*3*sizeof(float), uiLen, reinterpret_cast<uint8_t*>(vData.data()) + uiNormOff + uiOff);
+			uiOff += uiLen;
+			glDeleteBuffers(1, &it->uiBuffer);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, block.uiBuffer);
+		glBufferData(GL_ARRAY_BUFFER, 2*uiNormOff, vData.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	*itBegin = block;
+	m_vLayers.erase(itBegin+1, itEnd);
+	m_uiBlocks++;
+}
+
+void GLPrint::ReleaseChunks(unsigned int uiChunks)
+{
+	unsigned int uiMeshed = m_bRibbons ? m_uiMesherChunk.load(std::memory_order_acquire) : uiChunks;
+	// The writer has moved past all but the last chunk and never goes back to them.
+	for (unsigned int i=0; i+1<uiChunks && i<uiMeshed; i++)
+	{
+		Chunk_t &chunk = *m_vpChunks[i];
+		if (!chunk.fPos.empty() && m_vUploaded[i] == m_uiChunkVerts)
+		{
+			vector<float>().swap(chunk.fPos);
+			vector<float>().swap(chunk.fWidth);
+		}
+	}
+}
+
+void GLPrint::AddRibbon(Layer_t &layer, const float *pfA, const float *pfB, float fHeight)
+{
+	// Coordinates are {X, Z, Y}, so the bed plane is [0] and [2].
+	float fDX = pfB[0] - pfA[0], fDY = pfB[2] - pfA[2];
+	float fLen = sqrt((fDX*fDX) + (fDY*fDY));
+	if (fLen<1e-7f)
+		return;
+	float fS[3] = {-fDY/fLen, 0, fDX/fLen}; // Sideways
+	float fW = m_fExtrWidth/2.f;
+	// Top left/right and bottom left/right corners, at each end.
+	float fC[2][4][3];
+	const float *pfEnd[2] = {pfA, pfB};
+	for (int e=0; e<2; e++)
+		for (int i=0; i<3; i++)
+		{
+			fC[e][0][i] = pfEnd[e][i] + fS[i]*fW;
+			fC[e][1][i] = pfEnd[e][i] - fS[i]*fW;
+			fC[e][2][i] = fC[e][0][i] - (i==1 ? fHeight : 0);
+			fC[e][3][i] = fC[e][1][i] - (i==1 ? fHeight : 0);
+		}
+	auto fcnQuad = [](vector<float> &vPos, vector<float> &vNorm, const float *p0, const float *p1, const float *p2, const float *p3, const float fN[3])
+	{
+		for (const float *p : {p0, p1, p2, p0, p2, p3})
+		{
+			vPos.insert(vPos.end(), p, p+3);
+			vNorm.insert(vNorm.end(), fN, fN+3);
+		}
+	};
+	float fUp[3] = {0,1,0}, fR[3] = {-fS[0], 0, -fS[2]};
+	fcnQuad(layer.fPos, layer.fNorm, fC[0][0], fC[0][1], fC[1][1], fC[1][0], fUp); // Top
+	fcnQuad(layer.fWallPos, layer.fWallNorm, fC[0][0], fC[1][0], fC[1][2], fC[0][2], fS); // Left wall
+	fcnQuad(layer.fWallPos, layer.fWallNorm, fC[0][1], fC[0][3], fC[1][3], fC[1][1], fR); // Right wall
+}
+
+void GLPrint::PublishLayer(Layer_t *pLayer, unsigned int uiChunk, unsigned int uiSeg)
+{
+	pLayer->uiChunk = uiChunk;
+	pLayer->uiSeg = uiSeg;
+	pLayer->uiTopVerts = pLayer->fPos.size()/3;
+	pLayer->fPos.insert(pLayer->fPos.end(), pLayer->fWallPos.begin(), pLayer->fWallPos.end());
+	pLayer->fNorm.insert(pLayer->fNorm.end(), pLayer->fWallNorm.begin(), pLayer->fWallNorm.end());
+	vector<float>().swap(pLayer->fWallPos);
+	vector<float>().swap(pLayer->fWallNorm);
+	while (!m_layers.Push(pLayer))
+	{
+		if (m_bQuit) // GL has stopped drawing.
+		{
+			delete pLayer;
+			return;
+		}
+		usleep(m_uiMesherPollMs*1000);
+	}
+	RedrawFlag::Set();
+}
+
+void* GLPrint::RunMesher()
+{
+	Layer_t *pLayer = nullptr;
+	unsigned int uiChunk = 0, uiSeg = 0, uiIdleMs = 0;
+	float fLayerZ = -1, fLastZ = 0;
+	while (!m_bQuit)
+	{
+		usleep(m_uiMesherPollMs*1000);
+		unsigned int uiGen = m_uiClearReq.load(std::memory_order_acquire);
+		if (uiGen != m_uiMesherAck.load(std::memory_order_relaxed))
+		{
+			delete pLayer;
+			pLayer = nullptr;
+			uiChunk = uiSeg = uiIdleMs = 0;
+			m_uiMesherChunk = 0;
+			fLayerZ = -1;
+			fLastZ = 0;
+			m_uiMesherAck.store(uiGen, std::memory_order_release);
+		}
+		if (m_uiClearAck.load(std::memory_order_acquire) != uiGen)
+			continue; // The AVR thread hasn't reset the geometry yet.
+
+		bool bNew = false;
+		unsigned int uiChunks = m_uiChunks.load(std::memory_order_acquire);
+		while (uiChunk<uiChunks)
+		{
+			Chunk_t &chunk = *m_vpChunks[uiChunk];
+			unsigned int uiSegs = chunk.uiSegs.load(std::memory_order_acquire);
+			for (; uiSeg<uiSegs; uiSeg++)
+			{
+				const float *pfStrip = chunk.fPos.data() + chunk.iStart[uiSeg]*3;
+				if (pfStrip[1] > fLayerZ + m_fLayerEps)
+				{
+					if (pLayer)
+						PublishLayer(pLayer, uiChunk, uiSeg);
+					pLayer = nullptr;
+					fLastZ = fLayerZ<0 ? 0 : fLayerZ;
+					fLayerZ = pfStrip[1];
+				}
+				if (!pLayer)
+				{
+					pLayer = new Layer_t();
+					pLayer->uiGen = uiGen;
+					pLayer->fZ = fLayerZ;
+				}
+				float fHeight = std::min(std::max(fLayerZ - fLastZ, m_fMinHeight), m_fMaxHeight);
+				for (int i=1; i<chunk.iCount[uiSeg]; i++)
+					AddRibbon(*pLayer, pfStrip + (i-1)*3, pfStrip + i*3, fHeight);
+				bNew = true;
+			}
+			// The writer finishes off a chunk before publishing the next, so this one is done.
+			if (uiChunk+1<uiChunks)
+			{
+				uiChunk++;
+				uiSeg = 0;
+				m_uiMesherChunk.store(uiChunk, std::memory_order_release);
+			}
+			else
+				break;
+		}
+		uiIdleMs = bNew ? 0 : uiIdleMs + m_uiMesherPollMs;
+		// Nothing new for a while (e.g. the print is done), show what we have of this layer.
+		if (pLayer && uiIdleMs>=m_uiMesherIdleMs)
+		{
+			PublishLayer(pLayer, uiChunk, uiSeg);
+			pLayer = nullptr;
+		}
+	}
+	delete pLayer;
+	return nullptr;
+}
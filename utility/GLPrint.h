@@ -21,14 +21,21 @@
 
 #pragma once
 
-#include <array>   // for array
-#include <cmath>   // for sqrt
-#include <vector>  // for vector
-#include <mutex>
+#include <pthread.h> // for pthread_t
+#include <stdint.h>  // for uint32_t
+#include <array>    // for array
+#include <memory>   // for unique_ptr
+#include <vector>   // for vector
 #include <atomic>
+#include <functional> // for function
+#include "SPSCRing.h" // for SPSCRing
 
 using namespace std;
 
+// Geometry is built on the AVR thread (NewCoord) and drawn on the GL thread.
+// It is kept in fixed-size chunks that never move once written, each mirrored
+// in its own buffer object, so the two sides share no lock and a frame only
+// uploads what was added since the last one.
 class GLPrint
 {
 	public:
@@ -36,7 +43,16 @@ class GLPrint
 	// Creates a new GLPrint.
 	GLPrint(float fR, float fG, float fB);
 
-	// Clears the current print from the bed. You probably shouldn't call this when mid print.
+	~GLPrint();
+
+	// Draws finished layers as extrusion-width triangle meshes instead of lines. The meshes are built
+	// on a worker thread (started with the first move) so neither the AVR nor the GL thread pays for it.
+	inline void SetRibbons(bool bVal) { m_bRibbons = bVal;}
+
+	// Only draws what lies between these heights (in meters, like the coordinates). May be called from any thread.
+	inline void SetZRange(float fMin, float fMax) { m_fZMin = fMin; m_fZMax = fMax;}
+
+	// Clears the current print from the bed. Call from the GL thread; takes effect on the next NewCoord.
 	void Clear();
 
 	// Draws the print within the current GL matrix context.
@@ -45,41 +61,110 @@ class GLPrint
 	// Function to receive new coordinate updates from your simulated printer's stepper drivers.
 	void NewCoord(float fX, float fY, float fZ, float fE);
 
-	private:
-
-		static inline void CrossProduct(const float fA[3], const float fB[3], float fOut[3])
-		{
-			fOut[0] = (fA[1]*fB[2]) - (fA[2]*fB[1]);
-			fOut[1] = (fA[2]*fB[0]) - (fA[0]*fB[2]);
-			fOut[2] = (fA[0]*fB[1]) - (fA[1]*fB[0]);
-		};
+	// Calls fcnStrip(pfPos, iCount) for each finished extrusion strip, positions as (X, Z, Y) triples like the GL
+	// coordinates. Safe from any thread without stopping the writer, though a Clear() in progress may give a mixed view.
+	// Only for prints that are never drawn: Draw() hands finished chunks to the GPU and drops their CPU copies.
+	void VisitStrips(const function<void(const float*, int)> &fcnStrip);
 
-		static inline void Normalize(float fA[3])
-		{
-			float fNorm = sqrt((fA[0]*fA[0]) + (fA[1]*fA[1]) + (fA[2]*fA[2]));
-			fA[0]/=fNorm;
-			fA[1]/=fNorm;
-			fA[2]/=fNorm;
-		}
+	private:
 
 		//void FindNearest(const float fVec[3]);
 
+		static constexpr uint32_t m_uiChunkVerts = 16384, m_uiMaxChunks = 4096;
+
+		typedef struct Chunk_t
+		{
+			Chunk_t():fPos(m_uiChunkVerts*3),fWidth(m_uiChunkVerts),iStart(m_uiChunkVerts),iCount(m_uiChunkVerts){};
+			vector<float> fPos;
+			vector<float> fWidth; // Of the extrusion ending at each vertex
+			vector<int> iStart, iCount; // Line strips, for glMultiDrawArrays
+			atomic_uint uiVerts {0}, uiSegs {0}; // Published counts, entries below these are final.
+			atomic<float> fZMin {1e9f}, fZMax {-1e9f};
+		} Chunk_t;
+
+		// A finished batch of triangles, handed from the mesher to the GL thread.
+		typedef struct Layer_t
+		{
+			vector<float> fPos, fNorm; // Top faces first, then the walls.
+			vector<float> fWallPos, fWallNorm; // Moved onto the end when published.
+			uint32_t uiTopVerts = 0;
+			float fZ = 0;
+			unsigned int uiChunk = 0, uiSeg = 0; // First strip not included, lines are drawn from there on.
+			unsigned int uiGen = 0; // Clear() generation it was built for.
+		} Layer_t;
+
+		typedef struct LayerBuf_t
+		{
+			unsigned int uiBuffer;
+			uint32_t uiVerts, uiTopVerts;
+			float fZMin, fZMax;
+		} LayerBuf_t;
+
+		// Mesher thread: turns finished strips into ribbons, one Layer_t per Z.
+		void* RunMesher();
+		void AddRibbon(Layer_t &layer, const float *pfA, const float *pfB, float fHeight);
+		void PublishLayer(Layer_t *pLayer, unsigned int uiChunk, unsigned int uiSeg);
+		// GL thread: uploads and draws the finished layers.
+		void DrawRibbons();
+		// GL thread: merges the oldest m_uiBlockLayers layers into one block of only their top faces.
+		void MergeLayers();
+		inline bool IsVisible(float fMin, float fMax) { return fMax >= m_fZMin && fMin <= m_fZMax; }
+		// GL thread: drops the CPU copies of full chunks that are on the GPU (and meshed), keeping the strip lists.
+		void ReleaseChunks(unsigned int uiChunks);
+
+		// AVR thread: resets the geometry. Also used by the constructor.
+		void ResetWriter();
+		// GL thread: the tube shaders, built on first use. 0 if GL can't run them.
+		static unsigned int GetTubeProgram();
+
+		// AVR thread: holds back the newest vertex until the strip is known to go on past it.
+		void Stage(const float fPos[3], float fWidth);
+		// AVR thread: the width of the extrusion from m_fExtrStart to m_fExtrEnd, from the filament it used.
+		float GetExtrWidth();
+		// AVR thread: appends the staged vertex, moving to a new chunk when this one is full.
+		void CommitStaged();
+		void EndSegment();
 
 		array<int,4> m_iExtrEnd, m_iExtrStart;
 		array<float,4> m_fExtrEnd, m_fExtrStart;
-		vector<int> m_ivStart, m_ivTStart;
-		vector<int> m_ivCount, m_ivTCount;
-		vector<float> m_fvDraw, m_fvNorms;
-		vector<float> m_fvTri;
-		// Layer vertex tracking.
-		vector<float*> m_vpfLayer1, m_vpfLayer2;
-		// vector<float*> *m_pCurLayer = &m_vpfLayer1;   // not used
-		// vector<float*> *m_pPrevLayer = &m_vpfLayer2;  // not used
-		float m_fCurZ = -1;
-		// float m_fLastZ = -1;                          // not used
 		float m_fEMax = 0;
 		const float m_fColR, m_fColG, m_fColB;
 		atomic_bool m_bExtruding = {false};
 
-		std::mutex m_lock;
+		array<unique_ptr<Chunk_t>, m_uiMaxChunks> m_vpChunks;
+		atomic_uint m_uiChunks {0}; // Chunks in use, the last one is being appended to.
+		atomic_int m_iOpenStart {-1}; // Start of the segment being extruded, in the last chunk.
+		// Staged vertex and the current nozzle position, for the "live" line. A torn read just draws it slightly off for a frame.
+		array<atomic<float>,6> m_fCursor;
+		atomic_uint m_uiClearReq {0}, m_uiClearAck {0};
+
+		// AVR thread only.
+		array<float,3> m_fStagedPos;
+		float m_fStagedWidth = 0;
+		bool m_bStaged = false, m_bSegOpen = false, m_bFull = false;
+		uint32_t m_uiSegStart = 0;
+
+		bool m_bRibbons = false;
+		pthread_t m_thMesher = 0;
+		atomic_bool m_bQuit {false};
+		atomic_uint m_uiMesherAck {0}; // Last Clear() the mesher has let go of the geometry for.
+		atomic_uint m_uiMesherChunk {0}; // Chunks below this have been fully meshed.
+		atomic<float> m_fZMin {-1e9f}, m_fZMax {1e9f};
+		SPSCRing<Layer_t*> m_layers {64};
+
+		// GL thread only.
+		vector<unsigned int> m_vBuffers;
+		vector<uint32_t> m_vUploaded;
+		unsigned int m_uiClearSeen = 0;
+		vector<LayerBuf_t> m_vLayers; // In Z order, the newest last. Merged blocks are at the front.
+		size_t m_uiBlocks = 0; // How many of m_vLayers are merged blocks.
+		unsigned int m_uiLineChunk = 0, m_uiLineSeg = 0; // Strips before this are drawn as ribbons.
+
+		static constexpr float m_fExtrWidth = 0.00045f, m_fLayerEps = 0.00001f; // In meters, like the coordinates.
+		static constexpr float m_fMinHeight = 0.00005f, m_fMaxHeight = 0.0004f;
+		static constexpr float m_fFilament = 0.00175f; // Diameter
+		static constexpr unsigned int m_uiWidthAttrib = 1; // Vertex attribute index of fWidth in the tube shader
+		static constexpr uint32_t m_uiMesherPollMs = 50, m_uiMesherIdleMs = 2000;
+		// Layers this far below the top keep their walls and their own buffer, older ones get merged.
+		static constexpr uint32_t m_uiKeepLayers = 32, m_uiBlockLayers = 16;
 };
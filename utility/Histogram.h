@@ -0,0 +1,89 @@
+/*
+	Histogram.h - Log-linear (HDR style) histogram for latencies and the like.
+	Fixed memory, O(1) insert, reported values are within ~6% (the bucket width).
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>   // for uint64_t, uint32_t
+#include <algorithm>  // for max, min
+#include <vector>     // for vector
+
+// Not thread safe.
+class Histogram
+{
+	public:
+		Histogram():m_vCounts(Index(UINT64_MAX)+1, 0) {}
+
+		inline void Add(uint64_t uiVal)
+		{
+			m_vCounts[Index(uiVal)]++;
+			m_uiCount++;
+			m_uiMin = std::min(m_uiMin, uiVal);
+			m_uiMax = std::max(m_uiMax, uiVal);
+		}
+
+		inline uint64_t GetCount() const { return m_uiCount; }
+		inline uint64_t GetMin() const { return m_uiCount ? m_uiMin : 0; }
+		inline uint64_t GetMax() const { return m_uiMax; }
+
+		// Value at or below which fPct (0-100) of the samples are, within the bucket width.
+		uint64_t GetPercentile(double fPct) const
+		{
+			if (!m_uiCount)
+				return 0;
+			uint64_t uiTarget = std::max<uint64_t>(1, static_cast<uint64_t>((fPct/100.0)*static_cast<double>(m_uiCount) + 0.5));
+			uint64_t uiSeen = 0;
+			for (uint32_t i=0; i<m_vCounts.size(); i++)
+			{
+				uiSeen += m_vCounts[i];
+				if (uiSeen >= uiTarget)
+					return std::min(m_uiMax, std::max(m_uiMin, Upper(i)));
+			}
+			return m_uiMax;
+		}
+
+	private:
+		static constexpr uint32_t m_uiSubBits = 5;
+
+		static inline uint32_t Msb(uint64_t uiVal) { return 63 - __builtin_clzll(uiVal); }
+
+		// Values below 2^m_uiSubBits get a bucket each, above that each power of two is split into 16.
+		static inline uint32_t Index(uint64_t uiVal)
+		{
+			if (uiVal < (1ULL<<m_uiSubBits))
+				return uiVal;
+			uint32_t uiShift = Msb(uiVal) - m_uiSubBits + 1;
+			return (uiShift << (m_uiSubBits-1)) + static_cast<uint32_t>(uiVal >> uiShift);
+		}
+
+		// Largest value landing in the bucket.
+		static inline uint64_t Upper(uint32_t uiIdx)
+		{
+			if (uiIdx < (1U<<m_uiSubBits))
+				return uiIdx;
+			uint32_t uiShift = (uiIdx >> (m_uiSubBits-1)) - 1;
+			uint64_t uiMant = uiIdx - (uiShift << (m_uiSubBits-1));
+			return ((uiMant+1) << uiShift) - 1;
+		}
+
+		std::vector<uint64_t> m_vCounts;
+		uint64_t m_uiCount = 0, m_uiMin = UINT64_MAX, m_uiMax = 0;
+};
@@ -0,0 +1,190 @@
+/*
+	IOReactor.cpp - One shared I/O thread for all the host-side file descriptors
+	(uart_pty PTYs and taps, SerialPipe), instead of a polling thread each.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IOReactor.h"
+#include <fcntl.h>         // for fcntl, F_GETFL, F_SETFL, O_NONBLOCK
+#include <stdio.h>         // for perror
+#include <unistd.h>        // for close, pipe, read, write
+#include <algorithm>       // for find, find_if
+#if defined(__linux__)
+#include <sys/epoll.h>     // for epoll_event, epoll_ctl, epoll_wait, EPOLLIN
+#else
+#include <poll.h>          // for poll, pollfd, POLLIN, POLLOUT
+#endif
+#include "ThreadPolicy.h"  // for ThreadPolicy
+
+IOReactor& IOReactor::Get()
+{
+	static IOReactor reactor;
+	return reactor;
+}
+
+IOReactor::IOReactor()
+{
+	if (pipe(m_fdWake)<0)
+		perror("IOReactor");
+	for (int fd : m_fdWake)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#if defined(__linux__)
+	m_fdPoll = epoll_create1(EPOLL_CLOEXEC);
+	if (m_fdPoll<0)
+		perror("IOReactor");
+	epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = m_fdWake[0];
+	epoll_ctl(m_fdPoll, EPOLL_CTL_ADD, m_fdWake[0], &ev);
+#endif
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "io"); IOReactor *p = static_cast<IOReactor*>(param); return p->Run(); };
+	pthread_create(&m_thread, NULL, fcnRun, this);
+}
+
+IOReactor::~IOReactor()
+{
+	m_bQuit = true;
+	m_bSleeping = true;
+	Notify();
+	pthread_join(m_thread, NULL);
+	for (int fd : m_fdWake)
+		close(fd);
+	if (m_fdPoll>=0)
+		close(m_fdPoll);
+}
+
+void IOReactor::Add(int fd, ServiceFcn fcnService)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		m_vEntries.push_back({fd, fcnService, {false, false}});
+		UpdateInterest(m_vEntries.back(), {true, false});
+	}
+	m_bSleeping = true; // Make sure it gets picked up promptly.
+	Notify();
+}
+
+void IOReactor::Remove(int fd)
+{
+	std::lock_guard<CountedMutex> lock(m_lock);
+	auto it = std::find_if(m_vEntries.begin(), m_vEntries.end(), [fd](const Entry_t &e) { return e.fd == fd; });
+	if (it == m_vEntries.end())
+		return;
+	UpdateInterest(*it, {false, false});
+	m_vEntries.erase(it);
+}
+
+void IOReactor::Notify()
+{
+	// Pairs with the store to m_bSleeping in Run(): either we see it asleep, or it sees our data.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_bSleeping.load() && m_bSleeping.exchange(false))
+	{
+		char c = 0;
+		if (write(m_fdWake[1], &c, 1)<0) {}; // Full just means a wake is already pending.
+	}
+}
+
+void IOReactor::UpdateInterest(Entry_t &entry, Interest_t interest)
+{
+	if (entry.interest.bRead == interest.bRead && entry.interest.bWrite == interest.bWrite)
+		return;
+	bool bWasOn = entry.interest.bRead || entry.interest.bWrite;
+	bool bOn = interest.bRead || interest.bWrite;
+	entry.interest = interest;
+#if defined(__linux__)
+	// A descriptor with no interest is taken out altogether, so a hung up PTY doesn't keep reporting EPOLLHUP.
+	epoll_event ev {};
+	ev.events = (interest.bRead ? static_cast<uint32_t>(EPOLLIN) : 0U) | (interest.bWrite ? static_cast<uint32_t>(EPOLLOUT) : 0U);
+	ev.data.fd = entry.fd;
+	epoll_ctl(m_fdPoll, !bOn ? EPOLL_CTL_DEL : (bWasOn ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), entry.fd, &ev);
+#endif
+}
+
+bool IOReactor::ServiceAll(const std::vector<int> &vReadable)
+{
+	std::lock_guard<CountedMutex> lock(m_lock);
+	bool bThrottled = false;
+	for (auto &entry : m_vEntries)
+	{
+		bool bReadable = std::find(vReadable.begin(), vReadable.end(), entry.fd) != vReadable.end();
+		Interest_t interest = entry.fcnService(bReadable);
+		UpdateInterest(entry, interest);
+		bThrottled |= !interest.bRead;
+	}
+	return bThrottled;
+}
+
+void IOReactor::Wait(int iTimeoutMs, std::vector<int> &vReadable)
+{
+	bool bWoken = false;
+#if defined(__linux__)
+	epoll_event events[32];
+	int iCount = epoll_wait(m_fdPoll, events, 32, iTimeoutMs);
+	for (int i=0; i<iCount; i++)
+	{
+		if (events[i].data.fd == m_fdWake[0])
+			bWoken = true;
+		else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			vReadable.push_back(events[i].data.fd);
+	}
+#else
+	std::vector<pollfd> vPoll {{m_fdWake[0], POLLIN, 0}};
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		for (auto &entry : m_vEntries)
+			if (entry.interest.bRead || entry.interest.bWrite)
+				vPoll.push_back({entry.fd, static_cast<short>((entry.interest.bRead ? POLLIN : 0) | (entry.interest.bWrite ? POLLOUT : 0)), 0});
+	}
+	if (poll(vPoll.data(), vPoll.size(), iTimeoutMs)>0)
+	{
+		bWoken = vPoll[0].revents != 0;
+		for (size_t i=1; i<vPoll.size(); i++)
+			if (vPoll[i].revents & (POLLIN | POLLHUP | POLLERR))
+				vReadable.push_back(vPoll[i].fd);
+	}
+#endif
+	if (bWoken)
+	{
+		char buf[64];
+		while (read(m_fdWake[0], buf, sizeof(buf))>0) {};
+	}
+}
+
+void* IOReactor::Run()
+{
+	std::vector<int> vReadable;
+	while (!m_bQuit)
+	{
+		bool bThrottled = ServiceAll(vReadable);
+		vReadable.clear();
+		int iTimeout = 1; // Someone is holding off reading, check back on them shortly.
+		if (!bThrottled)
+		{
+			m_bSleeping = true;
+			// Catch anything queued before the flag went up, otherwise sleep until woken.
+			if (!ServiceAll(vReadable))
+				iTimeout = -1;
+		}
+		Wait(iTimeout, vReadable);
+		m_bSleeping = false;
+	}
+	return nullptr;
+}
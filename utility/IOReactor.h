@@ -0,0 +1,84 @@
+/*
+	IOReactor.h - One shared I/O thread for all the host-side file descriptors
+	(uart_pty PTYs and taps, SerialPipe), instead of a polling thread each.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>   // for pthread_t
+#include <atomic>      // for atomic_bool
+#include <functional>  // for function
+#include <mutex>       // for lock_guard
+#include <vector>      // for vector
+#include "CountedMutex.h" // for CountedMutex
+
+class IOReactor
+{
+	public:
+		// What a descriptor wants to be woken for next.
+		typedef struct Interest_t
+		{
+			bool bRead, bWrite;
+		} Interest_t;
+
+		// Called on the reactor thread every time round its loop, with whether the fd
+		// polled readable. It should read what it has room for and write out whatever
+		// it has pending (fds are non-blocking), then say what it is waiting on.
+		typedef std::function<Interest_t(bool bReadable)> ServiceFcn;
+
+		static IOReactor& Get();
+
+		// Starts servicing the fd. Sets it non-blocking.
+		void Add(int fd, ServiceFcn fcnService);
+
+		// Stops servicing the fd. The service function is not running and won't be called again once this returns.
+		void Remove(int fd);
+
+		// Called by producers after queueing data for a fd. Only costs a syscall if the reactor is asleep.
+		void Notify();
+
+	private:
+		IOReactor();
+		~IOReactor();
+
+		void* Run();
+
+		// Services every fd, returns true if any is holding off reading (so we have to come back round soon).
+		bool ServiceAll(const std::vector<int> &vReadable);
+
+		// Waits for readability/writability per the current interests. Appends readable fds.
+		void Wait(int iTimeoutMs, std::vector<int> &vReadable);
+
+		typedef struct Entry_t
+		{
+			int fd;
+			ServiceFcn fcnService;
+			Interest_t interest;
+		} Entry_t;
+
+		void UpdateInterest(Entry_t &entry, Interest_t interest);
+
+		CountedMutex m_lock {"IOReactor"}; // Held while servicing, so Remove() waits out a running callback.
+		std::vector<Entry_t> m_vEntries;
+		int m_fdPoll = -1; // epoll handle (Linux only)
+		int m_fdWake[2] = {-1, -1};
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false}, m_bSleeping {false};
+};
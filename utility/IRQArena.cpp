@@ -0,0 +1,109 @@
+/*
+	IRQArena.cpp - Per-AVR storage for the peripheral IRQs, grouped by peripheral type.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IRQArena.h"
+#include <stdlib.h>    // for malloc, free
+#include <algorithm>   // for max
+#include <mutex>       // for mutex, lock_guard
+#include <set>         // for set
+
+constexpr uint32_t IRQArena::m_uiBlockSize;
+
+static std::mutex lock;
+static std::map<avr_t*, std::unique_ptr<IRQArena>> mArenas;
+
+IRQArena& IRQArena::Get(avr_t *avr)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::unique_ptr<IRQArena> &pArena = mArenas[avr];
+	if (!pArena)
+		pArena.reset(new IRQArena(avr));
+	return *pArena;
+}
+
+void IRQArena::CompactAll()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto &arena : mArenas)
+		arena.second->CompactHooks();
+}
+
+avr_irq_t* IRQArena::Alloc(const std::type_index &kind, uint32_t uiCount, const char **names)
+{
+	auto it = m_mBlocks.find(kind);
+	if (it == m_mBlocks.end())
+	{
+		it = m_mBlocks.emplace(kind, std::vector<Block_t>()).first;
+		m_vOrder.push_back(kind);
+	}
+	std::vector<Block_t> &vBlocks = it->second;
+	if (vBlocks.empty() || vBlocks.back().uiSize - vBlocks.back().uiUsed < uiCount)
+	{
+		uint32_t uiSize = std::max(uiCount, m_uiBlockSize);
+		// Zeroed, avr_init_irq expects that of the memory it is given.
+		vBlocks.push_back({std::unique_ptr<avr_irq_t[]>(new avr_irq_t[uiSize]()), uiSize, 0});
+	}
+	Block_t &block = vBlocks.back();
+	avr_irq_t *pIRQs = block.pIRQs.get() + block.uiUsed;
+	block.uiUsed += uiCount;
+	// Without IRQ_FLAG_ALLOC, so avr_free_irq won't try to free() these.
+	avr_init_irq(&m_pAVR->irq_pool, pIRQs, 0, uiCount, names);
+	return pIRQs;
+}
+
+void IRQArena::CompactHooks()
+{
+	if (m_bCompacted)
+		return;
+	m_bCompacted = true;
+	std::vector<avr_irq_t*> vIRQs;
+	std::set<avr_irq_t*> sOurs;
+	for (auto &kind : m_vOrder)
+		for (auto &block : m_mBlocks.at(kind))
+			for (uint32_t i=0; i<block.uiUsed; i++)
+			{
+				vIRQs.push_back(block.pIRQs.get() + i);
+				sOurs.insert(block.pIRQs.get() + i);
+			}
+	// Then the core's (port pins, timers...), which head most of the chains.
+	for (int i=0; i<m_pAVR->irq_pool.count; i++)
+		if (m_pAVR->irq_pool.irq[i] && !sOurs.count(m_pAVR->irq_pool.irq[i]))
+			vIRQs.push_back(m_pAVR->irq_pool.irq[i]);
+
+	// Allocating them all before freeing any keeps the allocator from handing back the old spots.
+	std::vector<avr_irq_hook_t*> vOld;
+	for (auto irq : vIRQs)
+	{
+		avr_irq_hook_t **ppLink = &irq->hook;
+		while (*ppLink)
+		{
+			avr_irq_hook_t *pNew = static_cast<avr_irq_hook_t*>(malloc(sizeof(avr_irq_hook_t)));
+			if (!pNew)
+				break;
+			*pNew = **ppLink;
+			vOld.push_back(*ppLink);
+			*ppLink = pNew;
+			ppLink = &pNew->next;
+		}
+	}
+	for (auto pHook : vOld)
+		free(pHook);
+}
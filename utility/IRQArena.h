@@ -0,0 +1,71 @@
+/*
+	IRQArena.h - Per-AVR storage for the peripheral IRQs, grouped by peripheral type.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>     // for uint32_t
+#include <map>          // for map
+#include <memory>       // for unique_ptr
+#include <typeindex>    // for type_index
+#include <vector>       // for vector
+#include "sim_avr.h"    // for avr_t
+#include "sim_irq.h"    // for avr_irq_t
+
+// avr_alloc_irq mallocs every peripheral's IRQs on its own, so the four TMC2130s (say) end up
+// wherever the heap had room between all the other setup allocations. Here each peripheral type
+// gets its own blocks, so all of its instances' IRQs sit next to each other. The notify hooks
+// are simavr's to malloc and free, so those can't move into the arena. CompactHooks instead
+// re-allocates them in one go once everything is wired up, in the same order (see CompactAll).
+class IRQArena
+{
+	public:
+		// One arena per AVR. Boards are wired up on the main thread and their AVRs live until exit.
+		static IRQArena& Get(avr_t *avr);
+
+		// uiCount IRQs on the AVR's irq pool (as avr_alloc_irq does) from the blocks for "kind".
+		avr_irq_t* Alloc(const std::type_index &kind, uint32_t uiCount, const char **names);
+
+		// Compacts the hooks of every AVR's arena, once each. On the main thread, after every printer
+		// is wired up and before any board starts: a board started later starts from inside a notify
+		// callback (the MMU's reset), and freeing the hook simavr is walking would pull it out from under it.
+		static void CompactAll();
+
+	private:
+		explicit IRQArena(avr_t *avr):m_pAVR(avr){};
+
+		// Re-allocates the notify hooks of every IRQ on the AVR, ours first in layout order,
+		// all of them before freeing any of the old ones. Does nothing after the first time.
+		void CompactHooks();
+
+		typedef struct Block_t
+		{
+			std::unique_ptr<avr_irq_t[]> pIRQs;
+			uint32_t uiSize, uiUsed;
+		} Block_t;
+
+		// Room for several instances of most parts, a TMC2130 has about 10 IRQs.
+		static constexpr uint32_t m_uiBlockSize = 64;
+
+		avr_t *m_pAVR;
+		std::map<std::type_index, std::vector<Block_t>> m_mBlocks;
+		std::vector<std::type_index> m_vOrder; // Kinds by first allocation, for CompactHooks.
+		bool m_bCompacted = false;
+};
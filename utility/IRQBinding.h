@@ -0,0 +1,119 @@
+/*
+	IRQBinding.h - Compile-time binding of simavr's C callbacks (IRQ notifies,
+	cycle timers) to member functions.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint32_t, uint64_t
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+#include "sim_irq.h"        // for avr_irq_t
+
+#ifdef MK404_BINDING_STATS
+#include <stdio.h>          // for printf
+#include <algorithm>        // for sort
+#include <atomic>           // for atomic
+#include <chrono>           // for steady_clock, nanoseconds
+#include <cstring>          // for strstr, strcspn
+#include <deque>            // for deque
+#include <mutex>            // for mutex, lock_guard
+#include <vector>           // for vector
+#endif
+
+// The member function is a template argument, so every binding is its own plain function
+// that simavr can call and the compiler can inline the member into. Use the
+// MAKE_C_CALLBACK/MAKE_C_TIMER_CALLBACK macros in BasePeripheral.h rather than these directly.
+// Debug builds (MK404_BINDING_STATS) also count the calls and time spent per binding,
+// including whatever the member raises in turn, and print them at exit.
+namespace IRQBinding
+{
+#ifdef MK404_BINDING_STATS
+	typedef struct Stats_t
+	{
+		explicit Stats_t(const char *szSig):szSig(szSig){};
+		const char *szSig; // __PRETTY_FUNCTION__ of the binding, it names the member.
+		std::atomic<uint64_t> uiCalls {0}, uiNs {0};
+	} Stats_t;
+
+	inline std::mutex& RegistryLock() { static std::mutex lock; return lock; }
+	inline std::deque<Stats_t>& Registry() { static std::deque<Stats_t> dStats; return dStats; }
+
+	inline Stats_t& Register(const char *szSig)
+	{
+		std::lock_guard<std::mutex> guard(RegistryLock());
+		Registry().emplace_back(szSig);
+		return Registry().back();
+	}
+
+	class Scope
+	{
+		public:
+			explicit Scope(Stats_t &stats):m_stats(stats),m_tpStart(std::chrono::steady_clock::now()){};
+			~Scope()
+			{
+				m_stats.uiCalls.fetch_add(1, std::memory_order_relaxed);
+				m_stats.uiNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_tpStart).count(), std::memory_order_relaxed);
+			}
+		private:
+			Stats_t &m_stats;
+			std::chrono::steady_clock::time_point m_tpStart;
+	};
+
+	#define IRQBINDING_SCOPE() static Stats_t &stats = Register(__PRETTY_FUNCTION__); Scope scope(stats)
+
+	inline void PrintStats()
+	{
+		std::lock_guard<std::mutex> guard(RegistryLock());
+		std::vector<Stats_t*> vStats;
+		for (auto &stats : Registry())
+			vStats.push_back(&stats);
+		std::sort(vStats.begin(), vStats.end(), [](const Stats_t *a, const Stats_t *b) { return a->uiNs > b->uiNs; });
+		printf("IRQ/timer bindings by time (debug build):\n");
+		for (auto p : vStats)
+		{
+			// "... F = &TMC2130::OnStepIn]" with both GCC and clang.
+			const char *szName = strstr(p->szSig, "F = &");
+			szName = szName ? szName + 5 : p->szSig;
+			uint64_t uiCalls = p->uiCalls, uiNs = p->uiNs;
+			printf("\t%-48.*s %12llu calls %10.3f ms %8.1f ns/call\n", static_cast<int>(strcspn(szName, ";]")), szName,
+				static_cast<unsigned long long>(uiCalls), uiNs/1e6, uiCalls ? static_cast<double>(uiNs)/uiCalls : 0.0);
+		}
+	}
+#else
+	#define IRQBINDING_SCOPE()
+
+	inline void PrintStats(){};
+#endif
+
+	template<class C, typename M, M F>
+	void Notify(avr_irq_t *irq, uint32_t value, void *param)
+	{
+		IRQBINDING_SCOPE();
+		(static_cast<C*>(param)->*F)(irq, value);
+	}
+
+	template<class C, typename M, M F>
+	avr_cycle_count_t Timer(avr_t *avr, avr_cycle_count_t when, void *param)
+	{
+		IRQBINDING_SCOPE();
+		return (static_cast<C*>(param)->*F)(avr, when);
+	}
+}
@@ -0,0 +1,139 @@
+/*
+	ISRStats.cpp - Cycle accounting for the simulated MCU's interrupt vectors:
+	how often each one runs, how long for, how late it started and how deeply
+	they nest.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ISRStats.h"
+#include <stdio.h>            // for printf
+#include <algorithm>          // for max
+#include "TelemetryHost.h"    // for TelemetryHost, TC
+#include "sim_interrupts.h"   // for avr_int_vector_t, AVR_INT_IRQ_PENDING, AVR_INT_IRQ_RUNNING
+
+void ISRStats::Init(avr_t *avr, const std::string &strName)
+{
+	m_pAVR = avr;
+	m_strName = strName;
+	m_vVectors.resize(avr->interrupts.vector_count);
+	for (unsigned int i=0; i<m_vVectors.size(); i++)
+	{
+		avr_int_vector_t *pVec = avr->interrupts.vector[i];
+		m_vVectors[i].pOwner = this;
+		m_vVectors[i].uiVector = pVec->vector;
+		avr_irq_register_notify(pVec->irq + AVR_INT_IRQ_PENDING, OnPending, &m_vVectors[i]);
+		avr_irq_register_notify(pVec->irq + AVR_INT_IRQ_RUNNING, OnRunning, &m_vVectors[i]);
+	}
+	m_vStack.reserve(m_vVectors.size());
+	m_uiStart = avr->cycle;
+
+	auto pTH = TelemetryHost::GetHost();
+	pTH->AddTrace(avr->interrupts.irq + AVR_INT_IRQ_RUNNING, strName + "_ISR_running", {TC::Misc}, 8);
+	pTH->AddTrace(avr->interrupts.irq + AVR_INT_IRQ_PENDING, strName + "_ISR_pending", {TC::Misc}, 8);
+	printf("ISR stats: watching %zu interrupt vectors on %s\n", m_vVectors.size(), strName.c_str());
+}
+
+void ISRStats::OnPending(avr_irq_t *irq, uint32_t value, void *param)
+{
+	Vector_t *pVec = static_cast<Vector_t*>(param);
+	avr_cycle_count_t uiNow = pVec->pOwner->m_pAVR->cycle;
+	if (value)
+		pVec->uiPendingSince = uiNow;
+	else
+	{
+		// Cleared by the core as it vectors (the running edge follows on the same cycle), or by the firmware.
+		pVec->uiServicedAt = uiNow;
+		pVec->uiLatency = uiNow - pVec->uiPendingSince;
+	}
+}
+
+void ISRStats::OnRunning(avr_irq_t *irq, uint32_t value, void *param)
+{
+	Vector_t *pVec = static_cast<Vector_t*>(param);
+	if (value)
+		pVec->pOwner->Enter(*pVec);
+	else
+		pVec->pOwner->Exit(*pVec);
+}
+
+void ISRStats::Enter(Vector_t &vec)
+{
+	avr_cycle_count_t uiNow = m_pAVR->cycle;
+	vec.uiCount++;
+	if (vec.uiServicedAt == uiNow)
+		vec.uiMaxLatency = std::max(vec.uiMaxLatency, vec.uiLatency);
+	m_vStack.push_back({&vec, uiNow, 0});
+	vec.uiMaxDepth = std::max<unsigned int>(vec.uiMaxDepth, m_vStack.size());
+	m_uiMaxDepth = std::max<unsigned int>(m_uiMaxDepth, m_vStack.size());
+}
+
+void ISRStats::Exit(Vector_t &vec)
+{
+	if (m_vStack.empty() || m_vStack.back().pVector != &vec)
+	{
+		m_vStack.clear(); // Lost track (e.g. a state restore), start over from the next entry.
+		return;
+	}
+	Frame_t frame = m_vStack.back();
+	m_vStack.pop_back();
+	avr_cycle_count_t uiTime = m_pAVR->cycle - frame.uiEntry;
+	vec.uiTotal += uiTime;
+	vec.uiSelf += uiTime - frame.uiNested;
+	vec.uiMax = std::max(vec.uiMax, uiTime);
+	if (m_vStack.empty())
+		m_uiBusy += uiTime;
+	else
+		m_vStack.back().uiNested += uiTime;
+}
+
+void ISRStats::OnAVRReset()
+{
+	m_vStack.clear();
+}
+
+void ISRStats::ClearStats()
+{
+	for (auto &vec : m_vVectors)
+	{
+		vec.uiCount = vec.uiTotal = vec.uiSelf = vec.uiMax = vec.uiMaxLatency = 0;
+		vec.uiMaxDepth = 0;
+	}
+	m_uiBusy = 0;
+	m_uiMaxDepth = m_vStack.size();
+	m_uiStart = m_pAVR ? m_pAVR->cycle : 0;
+}
+
+void ISRStats::Print()
+{
+	if (!m_pAVR || m_pAVR->cycle <= m_uiStart)
+		return;
+	double dCycles = m_pAVR->cycle - m_uiStart;
+	double dUsPerCycle = 1e6/m_pAVR->frequency;
+	printf("ISR budget for %s over %.3f s simulated: %.2f%% of cycles in interrupts, nested up to %u deep.\n",
+		m_strName.c_str(), dCycles*dUsPerCycle/1e6, (100.0*m_uiBusy)/dCycles, m_uiMaxDepth);
+	printf("%8s %10s %8s %8s %9s %9s %11s %6s\n", "Vector", "Entries", "Total%", "Self%", "Avg us", "Max us", "Max lat us", "Depth");
+	for (auto &vec : m_vVectors)
+	{
+		if (!vec.uiCount)
+			continue;
+		printf("%8u %10llu %7.2f%% %7.2f%% %9.2f %9.2f %11.2f %6u\n", vec.uiVector, static_cast<unsigned long long>(vec.uiCount),
+			(100.0*vec.uiTotal)/dCycles, (100.0*vec.uiSelf)/dCycles, dUsPerCycle*vec.uiTotal/vec.uiCount,
+			dUsPerCycle*vec.uiMax, dUsPerCycle*vec.uiMaxLatency, vec.uiMaxDepth);
+	}
+}
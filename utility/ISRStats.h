@@ -0,0 +1,83 @@
+/*
+	ISRStats.h - Cycle accounting for the simulated MCU's interrupt vectors:
+	how often each one runs, how long for, how late it started and how deeply
+	they nest.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint64_t, uint8_t
+#include <string>           // for string
+#include <vector>           // for vector
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+#include "sim_irq.h"         // for avr_irq_t
+
+class ISRStats
+{
+	public:
+		// Set from the command line before the boards are created.
+		static void SetEnabled(bool bVal) { GetEnabled() = bVal; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		// Hooks every vector the core registered. Also adds the running/pending vector
+		// numbers to the telemetry as <strName>_ISR_running/_pending.
+		void Init(avr_t *avr, const std::string &strName);
+
+		// The core drops any running interrupts on reset without returning from them.
+		void OnAVRReset();
+
+		// Prints the per-vector budget since startup (or the last ClearStats) to stdout.
+		void Print();
+		void ClearStats();
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		typedef struct Vector_t
+		{
+			ISRStats *pOwner = nullptr;
+			uint8_t uiVector = 0;
+			avr_cycle_count_t uiPendingSince = 0, uiServicedAt = ~0ULL, uiLatency = 0;
+			// Stats
+			uint64_t uiCount = 0, uiTotal = 0, uiSelf = 0; // Self excludes interrupts nested inside this one.
+			avr_cycle_count_t uiMax = 0, uiMaxLatency = 0;
+			unsigned int uiMaxDepth = 0;
+		} Vector_t;
+
+		typedef struct Frame_t
+		{
+			Vector_t *pVector;
+			avr_cycle_count_t uiEntry, uiNested;
+		} Frame_t;
+
+		static void OnPending(avr_irq_t *irq, uint32_t value, void *param);
+		static void OnRunning(avr_irq_t *irq, uint32_t value, void *param);
+
+		void Enter(Vector_t &vec);
+		void Exit(Vector_t &vec);
+
+		avr_t *m_pAVR = nullptr;
+		std::string m_strName;
+		std::vector<Vector_t> m_vVectors; // Not resized after Init, the IRQ hooks point into it.
+		std::vector<Frame_t> m_vStack;
+		avr_cycle_count_t m_uiStart = 0, m_uiBusy = 0; // Busy counts outermost interrupts only.
+		unsigned int m_uiMaxDepth = 0;
+};
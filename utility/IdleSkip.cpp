@@ -0,0 +1,217 @@
+/*
+	IdleSkip.cpp - Spots the simulated MCU spinning in a polling loop that nothing
+	but a timer or interrupt can end, and moves the clock straight on to that.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "IdleSkip.h"
+#include <stdio.h>             // for printf
+#include <string.h>            // for memcmp, memcpy
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_slot_t
+#include "sim_interrupts.h"    // for avr_has_pending_interrupt
+
+constexpr avr_flashaddr_t IdleSkip::m_uiNoLoop;
+constexpr unsigned int IdleSkip::m_uiMaxBytes;
+constexpr avr_cycle_count_t IdleSkip::m_uiCheckCycles;
+
+void IdleSkip::Init(avr_t *avr, const std::string &strName)
+{
+	m_pAVR = avr;
+	m_strName = strName;
+}
+
+bool IdleSkip::IsPure(uint16_t uiOp)
+{
+	switch (uiOp >> 12U)
+	{
+		case 0x0: case 0x1: case 0x2: case 0x3: // Register ALU ops, compares, CPSE, CPI
+		case 0x4: case 0x5: case 0x6: case 0x7: // SBCI, SUBI, ORI, ANDI
+		case 0xC: // RJMP
+		case 0xE: // LDI
+		case 0xF: // Branches, BLD/BST, SBRC/SBRS
+			return true;
+		case 0x8: case 0xA: // LDD, not STD
+			return !(uiOp & 0x0200U);
+		case 0xB: // IN, not OUT
+			return !(uiOp & 0x0800U);
+		case 0x9:
+			switch ((uiOp >> 8U) & 0xFU)
+			{
+				case 0x0: case 0x1: // LDS, LD, LPM, ELPM, but not POP or the reserved ones
+					switch (uiOp & 0xFU)
+					{
+						case 0x3: case 0x8: case 0xB: case 0xF:
+							return false;
+						default:
+							return true;
+					}
+				case 0x4: case 0x5: // One-operand ALU ops, not the SREG/RET/SLEEP/WDR/SPM row, indirect or long jumps and calls
+					return (uiOp & 0xFU) < 0x8U || (uiOp & 0xFU) == 0xAU;
+				case 0x6: case 0x7: // ADIW, SBIW
+				case 0x9: case 0xB: // SBIC, SBIS
+				case 0xC: case 0xD: case 0xE: case 0xF: // MUL
+					return true;
+				default: // Stores, PUSH, CBI, SBI
+					return false;
+			}
+		default: // RCALL
+			return false;
+	}
+}
+
+unsigned int IdleSkip::Size(uint16_t uiOp)
+{
+	bool bLong = (uiOp & 0xFC0FU) == 0x9000U /* LDS/STS */ || (uiOp & 0xFE0CU) == 0x940CU /* JMP/CALL */;
+	return bLong ? 4 : 2;
+}
+
+bool IdleSkip::BranchTarget(uint16_t uiOp, avr_flashaddr_t uiAddr, int32_t &iTarget)
+{
+	int32_t iWords;
+	if ((uiOp & 0xF800U) == 0xF000U) // BRBS/BRBC
+		iWords = (uiOp & 0x0200U) ? static_cast<int32_t>((uiOp >> 3U) & 0x7FU) - 0x80 : (uiOp >> 3U) & 0x7FU;
+	else if ((uiOp & 0xF000U) == 0xC000U) // RJMP
+		iWords = (uiOp & 0x0800U) ? static_cast<int32_t>(uiOp & 0xFFFU) - 0x1000 : uiOp & 0xFFFU;
+	else
+		return false;
+	iTarget = static_cast<int32_t>(uiAddr) + 2 + 2*iWords;
+	return true;
+}
+
+bool IdleSkip::FindLoop(avr_flashaddr_t uiPC, Loop_t &loop)
+{
+	// Look ahead for the branch back to (or before) here...
+	for (avr_flashaddr_t uiAddr = uiPC; uiAddr + 1 <= m_pAVR->flashend && uiAddr - uiPC < m_uiMaxBytes;)
+	{
+		uint16_t uiOp = Opcode(uiAddr);
+		if (!IsPure(uiOp))
+			return false;
+		int32_t iTarget;
+		if (BranchTarget(uiOp, uiAddr, iTarget) && iTarget <= static_cast<int32_t>(uiPC) && iTarget >= 0)
+		{
+			if (uiAddr - iTarget >= m_uiMaxBytes)
+				return false;
+			// ...and check the part of the loop before us as well. It has to line up with uiPC.
+			avr_flashaddr_t uiBody = iTarget;
+			while (uiBody < uiPC)
+			{
+				uint16_t uiBodyOp = Opcode(uiBody);
+				if (!IsPure(uiBodyOp))
+					return false;
+				uiBody += Size(uiBodyOp);
+			}
+			if (uiBody != uiPC)
+				return false;
+			loop.uiHead = iTarget;
+			loop.uiTail = uiAddr;
+			return true;
+		}
+		uiAddr += Size(uiOp);
+	}
+	return false;
+}
+
+const IdleSkip::Loop_t* IdleSkip::Lookup(avr_flashaddr_t uiPC)
+{
+	auto it = m_mHeads.find(uiPC);
+	if (it == m_mHeads.end())
+	{
+		Loop_t loop;
+		avr_flashaddr_t uiHead = m_uiNoLoop;
+		if (FindLoop(uiPC, loop))
+		{
+			uiHead = loop.uiHead;
+			m_mLoops[uiHead] = loop;
+		}
+		it = m_mHeads.insert({uiPC, uiHead}).first;
+	}
+	return it->second == m_uiNoLoop ? nullptr : &m_mLoops.at(it->second);
+}
+
+bool IdleSkip::StepToHead(const Loop_t &loop, bool bAtLeastOne)
+{
+	// Every instruction is at least 2 bytes, so this allows for a partial pass plus a full one.
+	for (unsigned int i=0; i<m_uiMaxBytes; i++)
+	{
+		if (!bAtLeastOne && m_pAVR->pc == loop.uiHead)
+			return true;
+		bAtLeastOne = false;
+		if (m_pAVR->pc < loop.uiHead || m_pAVR->pc > loop.uiTail || avr_run(m_pAVR) != cpu_Running)
+			return false;
+	}
+	return false;
+}
+
+void IdleSkip::SaveState(State_t &state)
+{
+	memcpy(state.uiRegs, m_pAVR->data, sizeof(state.uiRegs));
+	memcpy(state.uiSREG, m_pAVR->sreg, sizeof(state.uiSREG));
+	state.uiSPL = m_pAVR->data[R_SPL];
+	state.uiSPH = m_pAVR->data[R_SPH];
+}
+
+void IdleSkip::Check(avr_cycle_count_t uiLimit)
+{
+	if (m_pAVR->cycle < m_uiNextCheck || m_pAVR->state != cpu_Running || m_pAVR->gdb)
+		return;
+	m_uiNextCheck = m_pAVR->cycle + m_uiCheckCycles;
+	const Loop_t *pLoop = Lookup(m_pAVR->pc);
+	if (!pLoop || !StepToHead(*pLoop, false))
+		return;
+
+	// The code can't change anything, but what it reads may just have (an ISR set the flag it waits on).
+	// Only a pass that ends exactly as it began proves the ones after it will too.
+	State_t stBefore, stAfter;
+	SaveState(stBefore);
+	avr_cycle_count_t uiStart = m_pAVR->cycle;
+	if (!StepToHead(*pLoop, true))
+		return;
+	SaveState(stAfter);
+	if (memcmp(&stBefore, &stAfter, sizeof(State_t)) != 0 || avr_has_pending_interrupt(m_pAVR))
+		return;
+
+	avr_cycle_count_t uiPass = m_pAVR->cycle - uiStart;
+	avr_cycle_count_t uiDeadline = uiLimit;
+	if (m_pAVR->cycle_timers.timer && m_pAVR->cycle_timers.timer->when < uiDeadline)
+		uiDeadline = m_pAVR->cycle_timers.timer->when;
+	if (uiPass == 0 || uiDeadline < m_pAVR->cycle + 2*uiPass)
+		return;
+	// Whole passes, stopping one short so whatever comes due lands at the same point in the loop it would have.
+	avr_cycle_count_t uiSkip = ((uiDeadline - m_pAVR->cycle)/uiPass - 1) * uiPass;
+	m_pAVR->cycle += uiSkip;
+	m_uiSkips++;
+	m_uiSkipped += uiSkip;
+	m_uiNextCheck = m_pAVR->cycle; // Most likely still waiting next time round.
+}
+
+void IdleSkip::OnAVRReset()
+{
+	m_mHeads.clear();
+	m_mLoops.clear();
+	m_uiNextCheck = 0;
+}
+
+void IdleSkip::Print()
+{
+	if (!m_pAVR)
+		return;
+	printf("Idle skip on %s: %llu cycles (%.1f%% of %llu) skipped in %llu jumps, %zu polling loops found\n", m_strName.c_str(),
+		static_cast<unsigned long long>(m_uiSkipped), m_pAVR->cycle ? (100.0*m_uiSkipped)/m_pAVR->cycle : 0.0,
+		static_cast<unsigned long long>(m_pAVR->cycle), static_cast<unsigned long long>(m_uiSkips), m_mLoops.size());
+}
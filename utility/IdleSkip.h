@@ -0,0 +1,100 @@
+/*
+	IdleSkip.h - Spots the simulated MCU spinning in a polling loop that nothing
+	but a timer or interrupt can end, and moves the clock straight on to that.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint16_t, uint64_t, uint8_t
+#include <string>           // for string
+#include <unordered_map>    // for unordered_map
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t, avr_flashaddr_t
+
+// SLEEP is already fast-forwarded by the core. This covers the loops that poll instead,
+// e.g. "while (!flag);" on something an ISR sets, or waiting on a peripheral status bit.
+// A loop qualifies if its code can't write anything (no stores, pushes, calls, OUT/SBI/CBI,
+// WDR, SREG ops...) and a full pass leaves the registers, SREG and SP exactly as they were.
+// Until the next cycle timer or interrupt, every further pass would then do the same.
+class IdleSkip
+{
+	public:
+		// Set from the command line before the boards are created.
+		static void SetEnabled(bool bVal) { GetEnabled() = bVal; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		void Init(avr_t *avr, const std::string &strName);
+
+		// If the MCU is in a qualifying loop, runs one pass to confirm it is idle and then moves
+		// the cycle count on by whole passes to just short of the next timer, a pending interrupt
+		// or uiLimit. Only looks at the code every m_uiCheckCycles, so it is cheap between batches.
+		void Check(avr_cycle_count_t uiLimit);
+
+		// Forgets what it knows about the code, e.g. after a bootloader has rewritten the flash.
+		void OnAVRReset();
+
+		// Prints how much was skipped.
+		void Print();
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		typedef struct Loop_t
+		{
+			avr_flashaddr_t uiHead, uiTail; // Byte addresses of the first instruction and the branch back.
+		} Loop_t;
+
+		inline uint16_t Opcode(avr_flashaddr_t uiAddr) { return m_pAVR->flash[uiAddr] | (m_pAVR->flash[uiAddr+1]<<8U); }
+
+		// Whether the instruction only reads memory/IO and changes registers and flags.
+		static bool IsPure(uint16_t uiOp);
+		// Instruction length in bytes.
+		static unsigned int Size(uint16_t uiOp);
+		// Target of a relative branch or RJMP at uiAddr, false if it isn't one.
+		static bool BranchTarget(uint16_t uiOp, avr_flashaddr_t uiAddr, int32_t &iTarget);
+
+		// Finds a short pure loop around uiPC. The result (either way) is remembered per PC.
+		const Loop_t* Lookup(avr_flashaddr_t uiPC);
+		bool FindLoop(avr_flashaddr_t uiPC, Loop_t &loop);
+
+		// Single-steps until the PC is back at the loop head, false if it leaves the loop
+		// (exit, interrupt) or the core stops.
+		bool StepToHead(const Loop_t &loop, bool bAtLeastOne);
+
+		typedef struct State_t
+		{
+			uint8_t uiRegs[32], uiSREG[8], uiSPL, uiSPH;
+		} State_t;
+		void SaveState(State_t &state);
+
+		avr_t *m_pAVR = nullptr;
+		std::string m_strName;
+
+		static constexpr avr_flashaddr_t m_uiNoLoop = ~0U;
+		std::unordered_map<avr_flashaddr_t, avr_flashaddr_t> m_mHeads; // PC -> head of its loop, or m_uiNoLoop
+		std::unordered_map<avr_flashaddr_t, Loop_t> m_mLoops; // By head
+
+		static constexpr unsigned int m_uiMaxBytes = 32; // Longest loop body considered
+		static constexpr avr_cycle_count_t m_uiCheckCycles = 256;
+		avr_cycle_count_t m_uiNextCheck = 0;
+
+		uint64_t m_uiSkips = 0;
+		avr_cycle_count_t m_uiSkipped = 0;
+};
@@ -0,0 +1,140 @@
+/*
+	InputLog.cpp - Records everything that reaches the simulation from outside
+	(serial bytes, keys, mouse, menus) against the AVR cycle it was taken in,
+	and plays such a recording back in place of the live inputs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "InputLog.h"
+#include <fstream>  // for ifstream
+#include <sstream>  // for istringstream
+
+InputLog::Mode InputLog::m_eMode = InputLog::Mode::Off;
+std::mutex InputLog::m_lock;
+FILE* InputLog::m_fLog = nullptr;
+std::map<std::string, std::deque<InputLog::Event_t>> InputLog::m_mReplay;
+bool InputLog::m_bDiverged = false;
+thread_local avr_t* InputLog::m_pAVR = nullptr;
+
+bool InputLog::StartRecording(const std::string &strFile)
+{
+	m_fLog = fopen(strFile.c_str(), "w");
+	if (!m_fLog)
+	{
+		perror(strFile.c_str());
+		return false;
+	}
+	fprintf(m_fLog, "# MK404 input log: <cycle> <channel> <value>\n");
+	m_eMode = Mode::Record;
+	printf("InputLog: Recording external inputs to %s\n", strFile.c_str());
+	return true;
+}
+
+bool InputLog::StartReplay(const std::string &strFile)
+{
+	std::ifstream in(strFile);
+	if (!in.is_open())
+	{
+		perror(strFile.c_str());
+		return false;
+	}
+	std::string strLine;
+	unsigned int uiLine = 0;
+	size_t uiCount = 0;
+	while (std::getline(in, strLine))
+	{
+		uiLine++;
+		if (strLine.empty() || strLine[0] == '#')
+			continue;
+		std::istringstream line(strLine);
+		unsigned long long uiCycle;
+		std::string strChannel;
+		uint32_t uiValue;
+		if (!(line >> uiCycle >> strChannel >> uiValue))
+		{
+			fprintf(stderr, "InputLog: %s:%u is not \"<cycle> <channel> <value>\"\n", strFile.c_str(), uiLine);
+			return false;
+		}
+		m_mReplay[strChannel].push_back({uiCycle, uiValue});
+		uiCount++;
+	}
+	m_eMode = Mode::Replay;
+	printf("InputLog: Replaying %zu inputs from %s, live ones are ignored\n", uiCount, strFile.c_str());
+	return true;
+}
+
+void InputLog::Stop()
+{
+	if (m_eMode == Mode::Record)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		fclose(m_fLog);
+		m_fLog = nullptr;
+	}
+	else if (m_eMode == Mode::Replay)
+	{
+		for (auto &it : m_mReplay)
+			if (!it.second.empty())
+				printf("InputLog: %zu %s input(s) from cycle %llu on were never reached\n", it.second.size(), it.first.c_str(),
+					static_cast<unsigned long long>(it.second.front().uiCycle));
+	}
+	m_eMode = Mode::Off;
+}
+
+void InputLog::Diverged(const std::string &strChannel, avr_cycle_count_t uiWanted)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	if (m_bDiverged)
+		return;
+	m_bDiverged = true;
+	fprintf(stderr, "InputLog: WARNING: Replay diverged, %s input due at cycle %llu was taken at %llu. It won't be bit-exact from here on.\n",
+		strChannel.c_str(), static_cast<unsigned long long>(uiWanted), static_cast<unsigned long long>(Now()));
+}
+
+void InputLog::Channel::Write(uint32_t uiValue)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	fprintf(m_fLog, "%llu %s %u\n", static_cast<unsigned long long>(Now()), m_strName.c_str(), uiValue);
+}
+
+bool InputLog::Channel::Next(uint32_t &uiValue)
+{
+	if (!m_pEvents)
+		m_pEvents = &m_mReplay[m_strName]; // Named late by some owners, so looked up on first use.
+	if (m_pEvents->empty() || m_pEvents->front().uiCycle > Now())
+		return false;
+	if (m_pEvents->front().uiCycle < Now())
+		Diverged(m_strName, m_pEvents->front().uiCycle);
+	uiValue = m_pEvents->front().uiValue;
+	m_pEvents->pop_front();
+	return true;
+}
+
+uint32_t InputLog::Channel::Poll(uint32_t uiLive)
+{
+	if (m_eMode == Mode::Record && uiLive)
+		Write(uiLive);
+	else if (m_eMode == Mode::Replay)
+	{
+		uint32_t uiValue = 0;
+		Next(uiValue);
+		return uiValue;
+	}
+	return uiLive;
+}
@@ -0,0 +1,101 @@
+/*
+	InputLog.h - Records everything that reaches the simulation from outside
+	(serial bytes, keys, mouse, menus) against the AVR cycle it was taken in,
+	and plays such a recording back in place of the live inputs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint32_t
+#include <stdio.h>          // for FILE
+#include <deque>            // for deque
+#include <map>              // for map
+#include <mutex>            // for mutex
+#include <string>           // for string
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+
+// Inputs are taken at points that are themselves deterministic (between instruction batches, or
+// when a UART raises XON), so a replay hands each one over at exactly the cycle it was recorded
+// at, as long as everything before it matched. The file is text, a
+//   <cycle> <channel> <value>
+// line per input, so a recording can be trimmed or edited by hand.
+class InputLog
+{
+	public:
+		typedef struct Event_t
+		{
+			avr_cycle_count_t uiCycle;
+			uint32_t uiValue;
+		} Event_t;
+
+		// One input source, named uniquely in the printer (e.g. "UART0", "Key").
+		// Used only on the thread of the AVR it feeds.
+		class Channel
+		{
+			public:
+				explicit Channel(const std::string &strName = ""):m_strName(strName){};
+				inline void SetName(const std::string &strName) { m_strName = strName; }
+
+				// For inputs polled with 0 meaning none: records a live one, or when replaying
+				// ignores it and returns the recorded one due now (or 0).
+				uint32_t Poll(uint32_t uiLive);
+				// For streams, as each value is consumed.
+				inline void Record(uint32_t uiValue) { if (m_eMode == Mode::Record) Write(uiValue); }
+				// Replay side of a stream: the next value due by now, if any.
+				bool Next(uint32_t &uiValue);
+
+			private:
+				void Write(uint32_t uiValue);
+				std::string m_strName;
+				std::deque<Event_t> *m_pEvents = nullptr;
+		};
+
+		static bool StartRecording(const std::string &strFile);
+		static bool StartReplay(const std::string &strFile);
+		// Closes the recording, or reports what of the replay was never reached.
+		static void Stop();
+
+		static inline bool IsRecording() { return m_eMode == Mode::Record; }
+		static inline bool IsReplaying() { return m_eMode == Mode::Replay; }
+
+		// Stamps this thread's inputs with the AVR's cycle count. Call on the AVR thread.
+		static inline void SetAVR(avr_t *pAVR) { m_pAVR = pAVR; }
+
+	private:
+		enum class Mode
+		{
+			Off,
+			Record,
+			Replay
+		};
+
+		static inline avr_cycle_count_t Now() { return m_pAVR ? m_pAVR->cycle : 0; }
+		// Warns (once) that the replay is no longer following the recording.
+		static void Diverged(const std::string &strChannel, avr_cycle_count_t uiWanted);
+
+		static Mode m_eMode;
+		static std::mutex m_lock; // For the file, several AVR threads may record at once.
+		static FILE *m_fLog;
+		static std::map<std::string, std::deque<Event_t>> m_mReplay; // Filled before any AVR runs
+		static bool m_bDiverged;
+
+		static thread_local avr_t *m_pAVR;
+};
@@ -0,0 +1,37 @@
+/*
+	Intern.h - One shared copy of each distinct value.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>  // for mutex, lock_guard
+#include <set>    // for set
+
+// For the names and such every instance of a part has the same of: each distinct value is kept
+// once per process, and the pointer to it stays valid for as long as the process runs.
+// Meant for setup time, it takes a lock.
+template<class T>
+const T* Intern(const T &val)
+{
+	static std::mutex lock;
+	static std::set<T> sPool;
+	std::lock_guard<std::mutex> guard(lock);
+	return &*sPool.insert(val).first;
+}
@@ -0,0 +1,188 @@
+/*
+	LCDMirror.cpp - Shows the character LCD on a terminal or in a log, for headless runs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LCDMirror.h"
+#include <stdio.h>    // for fprintf, fopen, fclose, fflush, fputs, perror
+#include <unistd.h>   // for isatty
+#include "HD44780.h"  // for HD44780
+
+void LCDMirror::SetDefaults(const std::string &strFile, uint32_t uiRate)
+{
+	GetFileRef() = strFile;
+	GetRate() = uiRate ? uiRate : 1;
+}
+
+LCDMirror::~LCDMirror()
+{
+	if (!m_fOut)
+		return;
+	if (m_pLCD->GetVersion() != m_uiVersion)
+		Emit();
+	if (m_bANSI)
+		fputs("\x1b" "7\x1b[r\x1b" "8", m_fOut); // Whole-screen scrolling again, staying where the log left off.
+	if (m_fOut == stdout)
+		fflush(m_fOut);
+	else
+		fclose(m_fOut);
+}
+
+void LCDMirror::Init(avr_t *avr, HD44780 *pLCD, const std::string &strFile)
+{
+	_Init(avr, this);
+	m_pLCD = pLCD;
+	if (strFile == "-")
+		m_fOut = stdout;
+	else if (!(m_fOut = fopen(strFile.c_str(), "w")))
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	m_bANSI = isatty(fileno(m_fOut));
+	m_uiVersion = m_pLCD->GetVersion() - 1U; // Show the blank screen too.
+	RegisterTimerUsec(m_fcnPoll, m_uiPollUsec, this);
+}
+
+avr_cycle_count_t LCDMirror::OnPollTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	if (m_pLCD->GetVersion() != m_uiVersion)
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		if (m_vCells.empty() || tNow - m_tLast >= std::chrono::microseconds(1000000U/GetRate()))
+		{
+			m_tLast = tNow;
+			Emit();
+		}
+	}
+	return when + avr_usec_to_cycles(avr, m_uiPollUsec);
+}
+
+std::string LCDMirror::Glyph(uint8_t uiChar) const
+{
+	if (uiChar < 0x10U)
+	{
+		// Braille dots 1-3,7 are the left column top to bottom, 4-6,8 the right. Each dot takes a
+		// 2x2 pixel block; the middle pixel column counts for both sides.
+		static constexpr uint8_t uiDots[2][4] = {{0x01,0x02,0x04,0x40},{0x08,0x10,0x20,0x80}};
+		const uint8_t *pRows = m_pLCD->GetCGRam() + (uiChar & 7U)*8U;
+		uint32_t uiCode = 0x2800;
+		for (unsigned int i=0; i<8; i++)
+		{
+			if (pRows[i] & 0x1CU)
+				uiCode |= uiDots[0][i/2];
+			if (pRows[i] & 0x07U)
+				uiCode |= uiDots[1][i/2];
+		}
+		if (uiCode == 0x2800)
+			return " "; // Blank braille is hard to tell from a space, may as well be one.
+		return {static_cast<char>(0xE0U | (uiCode >> 12U)), static_cast<char>(0x80U | ((uiCode >> 6U) & 0x3FU)), static_cast<char>(0x80U | (uiCode & 0x3FU))};
+	}
+	switch (uiChar)
+	{
+		case 0x5C: return "\xC2\xA5";     // ROM A00 has a yen sign here
+		case 0x7E: return "\xE2\x86\x92"; // Right arrow
+		case 0x7F: return "\xE2\x86\x90"; // Left arrow
+		case 0xA5: return "\xC2\xB7";     // Middle dot
+		case 0xDF: return "\xC2\xB0";     // Degree
+		default:
+			if (uiChar < 0x20U || uiChar > 0x7DU)
+				return "?";
+			return std::string(1, static_cast<char>(uiChar));
+	}
+}
+
+void LCDMirror::Emit()
+{
+	m_uiVersion = m_pLCD->GetVersion();
+	uint8_t uiWidth = m_pLCD->GetWidth(), uiHeight = m_pLCD->GetHeight();
+	if (uiWidth != m_uiWidth || uiHeight != m_uiHeight)
+	{
+		m_uiWidth = uiWidth;
+		m_uiHeight = uiHeight;
+		m_vCells.clear(); // Different layout, start over.
+	}
+	std::vector<std::string> vCells;
+	vCells.reserve(m_uiWidth*m_uiHeight);
+	for (uint8_t uiRow=0; uiRow<m_uiHeight; uiRow++)
+	{
+		const char *pRow = m_pLCD->GetRow(uiRow);
+		for (uint8_t uiCol=0; uiCol<m_uiWidth; uiCol++)
+			vCells.push_back(Glyph(static_cast<uint8_t>(pRow[uiCol])));
+	}
+	if (vCells == m_vCells)
+		return; // e.g. the same text written again
+	if (m_bANSI)
+		EmitDiff(vCells);
+	else
+		EmitText(vCells);
+	fflush(m_fOut);
+	m_vCells.swap(vCells);
+	RaiseIRQ(FRAME_OUT, ++m_uiFrames);
+}
+
+void LCDMirror::EmitDiff(const std::vector<std::string> &vCells)
+{
+	if (m_vCells.empty())
+	{
+		// The frame takes the top rows, everything else scrolls underneath it.
+		std::string strBorder = "+" + std::string(m_uiWidth, '-') + "+";
+		fprintf(m_fOut, "\x1b[2J\x1b[H%s\n", strBorder.c_str());
+		for (uint8_t uiRow=0; uiRow<m_uiHeight; uiRow++)
+		{
+			fputs("|", m_fOut);
+			for (uint8_t uiCol=0; uiCol<m_uiWidth; uiCol++)
+				fputs(vCells[uiRow*m_uiWidth + uiCol].c_str(), m_fOut);
+			fputs("|\n", m_fOut);
+		}
+		fprintf(m_fOut, "%s\n\x1b[%ur\x1b[%u;1H", strBorder.c_str(), m_uiHeight + 3U, m_uiHeight + 3U);
+		return;
+	}
+	fputs("\x1b" "7", m_fOut);
+	for (uint8_t uiRow=0; uiRow<m_uiHeight; uiRow++)
+	{
+		bool bInRun = false; // Consecutive changed cells need only the one cursor move.
+		for (uint8_t uiCol=0; uiCol<m_uiWidth; uiCol++)
+		{
+			const std::string &strCell = vCells[uiRow*m_uiWidth + uiCol];
+			if (strCell == m_vCells[uiRow*m_uiWidth + uiCol])
+			{
+				bInRun = false;
+				continue;
+			}
+			if (!bInRun)
+				fprintf(m_fOut, "\x1b[%u;%uH", uiRow + 2U, uiCol + 2U);
+			fputs(strCell.c_str(), m_fOut);
+			bInRun = true;
+		}
+	}
+	fputs("\x1b" "8", m_fOut);
+}
+
+void LCDMirror::EmitText(const std::vector<std::string> &vCells)
+{
+	fprintf(m_fOut, "LCD @ %.3fs:\n", static_cast<double>(m_pAVR->cycle)/m_pAVR->frequency);
+	for (uint8_t uiRow=0; uiRow<m_uiHeight; uiRow++)
+	{
+		fputs("|", m_fOut);
+		for (uint8_t uiCol=0; uiCol<m_uiWidth; uiCol++)
+			fputs(vCells[uiRow*m_uiWidth + uiCol].c_str(), m_fOut);
+		fputs("|\n", m_fOut);
+	}
+}
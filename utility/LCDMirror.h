@@ -0,0 +1,84 @@
+/*
+	LCDMirror.h - Shows the character LCD on a terminal or in a log, for headless runs.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint8_t
+#include <stdio.h>             // for FILE
+#include <chrono>              // for steady_clock
+#include <string>              // for string
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+class HD44780;
+
+// Polls the LCD's change counter on the AVR thread and, when it moved (at most m_uiRate times
+// a wall-clock second), prints what's on it. On a terminal only the changed cells are written,
+// with ANSI cursor moves, into a frame pinned above a scroll region that the rest of the output
+// keeps using. Anything else (a file, a pipe) gets the whole screen as text per change, for logs.
+// CGRAM characters are drawn as braille (their 5x8 bitmap squeezed into 2x4 dots) and the few
+// ROM characters the firmware uses outside ASCII as their nearest Unicode ones, all UTF-8.
+class LCDMirror: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(FRAME_OUT,">lcd_mirror.frame")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the printers are created. An empty file disables the mirror,
+		// "-" is stdout.
+		static void SetDefaults(const std::string &strFile, uint32_t uiRate);
+		static inline bool IsEnabled() { return !GetFile().empty(); }
+		static inline const std::string& GetFile() { return GetFileRef(); }
+
+		// Prints the last state and hands the terminal's scroll region back.
+		~LCDMirror();
+
+		// strFile as from GetFile(), with any per-instance suffix already added.
+		void Init(avr_t *avr, HD44780 *pLCD, const std::string &strFile);
+
+	private:
+		static std::string& GetFileRef() { static std::string strFile; return strFile; }
+		static uint32_t& GetRate() { static uint32_t uiRate = 10; return uiRate; }
+
+		avr_cycle_count_t OnPollTimer(avr_t *avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnPoll = MAKE_C_TIMER_CALLBACK(LCDMirror,OnPollTimer);
+
+		// What a cell shows, as UTF-8.
+		std::string Glyph(uint8_t uiChar) const;
+
+		void Emit();
+		void EmitDiff(const std::vector<std::string> &vCells);
+		void EmitText(const std::vector<std::string> &vCells);
+
+		HD44780 *m_pLCD = nullptr;
+		FILE *m_fOut = nullptr;
+		bool m_bANSI = false;
+		uint8_t m_uiWidth = 0, m_uiHeight = 0;
+		uint32_t m_uiVersion = 0, m_uiFrames = 0;
+		std::vector<std::string> m_vCells; // As last printed, row-major; empty before the first frame.
+		std::chrono::steady_clock::time_point m_tLast;
+
+		static constexpr uint32_t m_uiPollUsec = 10000;
+};
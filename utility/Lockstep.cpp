@@ -0,0 +1,73 @@
+/*
+	Lockstep.cpp - Keeps several boards (e.g. the MK3S and its MMU2) in step in
+	simulated time. Each board runs on its own thread, but none may start the
+	next quantum until all of them have finished the current one.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Lockstep.h"
+#include <thread>  // for yield
+
+uint32_t Lockstep::m_uiDefaultQuantumUs = 0;
+
+void Lockstep::Join()
+{
+	{
+		std::lock_guard<CountedMutex> lock(m_lock);
+		m_uiMembers++;
+	}
+	Arrive();
+}
+
+void Lockstep::Leave()
+{
+	std::lock_guard<CountedMutex> lock(m_lock);
+	m_uiMembers--;
+	if (m_uiMembers>0 && m_uiArrived >= m_uiMembers)
+		Release();
+}
+
+void Lockstep::Arrive()
+{
+	std::unique_lock<CountedMutex> lock(m_lock);
+	uint64_t uiGen = m_uiGeneration.load();
+	if (++m_uiArrived >= m_uiMembers)
+	{
+		Release();
+		return;
+	}
+	lock.unlock();
+	for (unsigned int i=0; i<m_uiSpin; i++)
+	{
+		if (m_uiGeneration.load(std::memory_order_acquire) != uiGen)
+			return;
+		std::this_thread::yield();
+	}
+	lock.lock();
+	m_cv.wait(lock, [this, uiGen]{ return m_uiGeneration.load() != uiGen; });
+}
+
+void Lockstep::Release()
+{
+	for (auto &fcn : m_vHooks)
+		fcn();
+	m_uiArrived = 0;
+	m_uiGeneration.fetch_add(1, std::memory_order_release);
+	m_cv.notify_all();
+}
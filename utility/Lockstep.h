@@ -0,0 +1,75 @@
+/*
+	Lockstep.h - Keeps several boards (e.g. the MK3S and its MMU2) in step in
+	simulated time. Each board runs on its own thread, but none may start the
+	next quantum until all of them have finished the current one.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint64_t
+#include <atomic>              // for atomic_uint_fast64_t
+#include <condition_variable>  // for condition_variable_any
+#include <functional>          // for function
+#include <vector>              // for vector
+#include "CountedMutex.h"      // for CountedMutex
+
+class Lockstep
+{
+	public:
+		// Run by the last board to reach a quantum boundary, while the others are held there.
+		// Anything crossing between boards released here is seen by all of them at the same simulated time.
+		typedef std::function<void()> BoundaryFcn;
+
+		// Quantum (in microseconds of simulated time) for groups created afterwards. 0 disables lockstep.
+		static void SetDefaultQuantum(uint32_t uiUs) { m_uiDefaultQuantumUs = uiUs; }
+		static uint32_t GetDefaultQuantum() { return m_uiDefaultQuantumUs; }
+
+		inline uint32_t GetQuantumUs() { return m_uiQuantumUs; }
+
+		// Not thread safe, add hooks before any board joins.
+		inline void AddBoundaryHook(BoundaryFcn fcn) { m_vHooks.push_back(fcn); }
+
+		// Called from a board's thread when it starts running. Waits for the next boundary,
+		// so a new board lines up with the ones already running.
+		void Join();
+
+		// Called from a board's thread when it stops, releases anyone waiting on it.
+		void Leave();
+
+		// Called from a board's thread each time it completes a quantum. Returns once all have.
+		void Arrive();
+
+	private:
+		// Lock must be held.
+		void Release();
+
+		CountedMutex m_lock {"Lockstep"};
+		std::condition_variable_any m_cv;
+		std::atomic_uint_fast64_t m_uiGeneration {0};
+		unsigned int m_uiMembers = 0, m_uiArrived = 0;
+		std::vector<BoundaryFcn> m_vHooks;
+
+		uint32_t m_uiQuantumUs = m_uiDefaultQuantumUs;
+
+		// Quanta are short, so the others are usually close behind; spin a little before sleeping.
+		static constexpr unsigned int m_uiSpin = 2000;
+
+		static uint32_t m_uiDefaultQuantumUs;
+};
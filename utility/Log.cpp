@@ -0,0 +1,299 @@
+/*
+	Log.cpp - Leveled, per-module diagnostics, formatted on the calling thread
+	and written out by a background thread.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Log.h"
+#include <ctype.h>    // for tolower
+#include <stdarg.h>   // for va_list, va_start, va_end
+#include <strings.h>  // for strcasecmp
+#include <unistd.h>   // for usleep
+#include <algorithm>  // for min
+#include <atomic>     // for atomic_thread_fence, memory_order_seq_cst
+#include <sstream>    // for istringstream
+#include "ThreadPolicy.h" // for ThreadPolicy
+
+// Binary files start with "MK404LOG" and a version byte (1), then hold two kinds of entry,
+// all in host byte order:
+//   'M' u16 module, u16 length, name        before the first record of that module
+//   'R' u64 cycle (all ones for none), u16 module, u8 level, u16 length, text
+
+thread_local Log::Ring_t* Log::m_pRing = nullptr;
+thread_local avr_t* Log::m_pAVR = nullptr;
+
+Log::Module::Module(const std::string &strName):m_strName(strName)
+{
+	m_uiID = Log::Get().AddModule(this);
+}
+
+void Log::Module::Write(Level eLevel, const char *szFmt, ...)
+{
+	Log &log = Log::Get();
+	bool bRunning = log.m_bRunning.load(std::memory_order_acquire);
+	Record_t recDirect;
+	Record_t *pRec = &recDirect;
+	Ring_t *pRing = nullptr;
+	if (bRunning)
+	{
+		pRing = log.GetRing();
+		if (pRing->records.GetWriteSpan(pRec) == 0)
+		{
+			pRing->uiDropped++;
+			return;
+		}
+	}
+	// Straight into the ring slot, the writer never sees it until it is committed.
+	pRec->uiCycle = m_pAVR ? m_pAVR->cycle : 0;
+	pRec->bHasCycle = m_pAVR != nullptr;
+	pRec->uiModule = m_uiID;
+	pRec->eLevel = eLevel;
+	va_list args;
+	va_start(args, szFmt);
+	int iLen = vsnprintf(pRec->chrText, sizeof(pRec->chrText), szFmt, args);
+	va_end(args);
+	pRec->uiLen = std::min<int>(std::max(iLen, 0), sizeof(pRec->chrText) - 1);
+	// printf habits: the newline is the writer's job.
+	if (pRec->uiLen && pRec->chrText[pRec->uiLen-1] == '\n')
+		pRec->uiLen--;
+	if (pRing)
+	{
+		pRing->records.CommitWrite(1);
+		// Stop() came between the check and the commit, and may have drained before it: stranded otherwise.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!log.m_bRunning.load(std::memory_order_relaxed))
+			log.Drain();
+	}
+	else
+		log.Emit(recDirect);
+}
+
+Log& Log::Get()
+{
+	// Never destroyed, static modules may still log on the way out.
+	static Log *pLog = new Log();
+	return *pLog;
+}
+
+const char* Log::LevelName(Level eLevel)
+{
+	static const char* szNames[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+	return szNames[static_cast<uint8_t>(eLevel)];
+}
+
+bool Log::ParseLevel(const std::string &strLevel, Level &eLevel)
+{
+	static const char* szNames[] = {"error", "warning", "info", "debug", "trace"};
+	for (uint8_t i=0; i<5; i++)
+		if (strcasecmp(strLevel.c_str(), szNames[i]) == 0 || (strLevel.size() == 1 && tolower(strLevel[0]) == szNames[i][0]))
+		{
+			eLevel = static_cast<Level>(i);
+			return true;
+		}
+	return false;
+}
+
+bool Log::Configure(const std::string &strSpec)
+{
+	Log &log = Get();
+	std::istringstream in(strSpec);
+	std::string strItem;
+	std::lock_guard<std::mutex> guard(log.m_lock);
+	while (std::getline(in, strItem, ','))
+	{
+		Level eLevel;
+		size_t uiEq = strItem.find('=');
+		if (!ParseLevel(uiEq == std::string::npos ? strItem : strItem.substr(uiEq + 1), eLevel))
+		{
+			fprintf(stderr, "Log: Unknown level in \"%s\", use error, warning, info, debug or trace.\n", strItem.c_str());
+			return false;
+		}
+		if (uiEq == std::string::npos)
+		{
+			log.m_eDefault = eLevel;
+			for (auto pModule : log.m_vModules)
+				if (!log.m_mLevels.count(pModule->m_strName))
+					pModule->m_uiLevel = static_cast<uint8_t>(eLevel);
+		}
+		else
+		{
+			std::string strName = strItem.substr(0, uiEq);
+			log.m_mLevels[strName] = eLevel;
+			for (auto pModule : log.m_vModules)
+				if (pModule->m_strName == strName)
+					pModule->m_uiLevel = static_cast<uint8_t>(eLevel);
+		}
+	}
+	return true;
+}
+
+bool Log::SetFile(const std::string &strPath, bool bBinary)
+{
+	Log &log = Get();
+	FILE *fOut = fopen(strPath.c_str(), bBinary ? "wb" : "w");
+	if (!fOut)
+	{
+		perror(strPath.c_str());
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(log.m_lockOut);
+	if (log.m_fOut)
+		fclose(log.m_fOut);
+	log.m_fOut = fOut;
+	log.m_bBinary = bBinary;
+	log.m_vNamed.clear();
+	if (bBinary)
+		fwrite("MK404LOG\x01", 9, 1, fOut);
+	return true;
+}
+
+uint16_t Log::AddModule(Module *pModule)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	auto it = m_mLevels.find(pModule->m_strName);
+	pModule->m_uiLevel = static_cast<uint8_t>(it != m_mLevels.end() ? it->second : m_eDefault);
+	m_vModules.push_back(pModule);
+	return m_vModules.size() - 1;
+}
+
+Log::Ring_t* Log::GetRing()
+{
+	if (!m_pRing)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_vRings.emplace_back(new Ring_t());
+		m_pRing = m_vRings.back().get();
+	}
+	return m_pRing;
+}
+
+void Log::Emit(const Record_t &rec)
+{
+	Module *pModule;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		pModule = m_vModules.at(rec.uiModule);
+	}
+	const std::string &strModule = pModule->m_strName;
+	std::lock_guard<std::mutex> guard(m_lockOut);
+	if (m_fOut && m_bBinary)
+	{
+		if (m_vNamed.size() <= rec.uiModule)
+			m_vNamed.resize(rec.uiModule + 1, false);
+		if (!m_vNamed[rec.uiModule])
+		{
+			uint16_t uiLen = strModule.size();
+			fputc('M', m_fOut);
+			fwrite(&rec.uiModule, sizeof(rec.uiModule), 1, m_fOut);
+			fwrite(&uiLen, sizeof(uiLen), 1, m_fOut);
+			fwrite(strModule.data(), uiLen, 1, m_fOut);
+			m_vNamed[rec.uiModule] = true;
+		}
+		uint64_t uiCycle = rec.bHasCycle ? rec.uiCycle : UINT64_MAX;
+		uint8_t uiLevel = static_cast<uint8_t>(rec.eLevel);
+		fputc('R', m_fOut);
+		fwrite(&uiCycle, sizeof(uiCycle), 1, m_fOut);
+		fwrite(&rec.uiModule, sizeof(rec.uiModule), 1, m_fOut);
+		fwrite(&uiLevel, sizeof(uiLevel), 1, m_fOut);
+		fwrite(&rec.uiLen, sizeof(rec.uiLen), 1, m_fOut);
+		fwrite(rec.chrText, rec.uiLen, 1, m_fOut);
+	}
+	else if (m_fOut)
+	{
+		if (rec.bHasCycle)
+			fprintf(m_fOut, "%llu ", static_cast<unsigned long long>(rec.uiCycle));
+		else
+			fputs("- ", m_fOut);
+		fprintf(m_fOut, "%s %s: %.*s\n", LevelName(rec.eLevel), strModule.c_str(), rec.uiLen, rec.chrText);
+	}
+	else if (rec.eLevel > Level::Info)
+	{
+		// Diagnostics get their stamp, the rest reads as it always has on the console.
+		if (rec.bHasCycle)
+			printf("[%llu] ", static_cast<unsigned long long>(rec.uiCycle));
+		printf("%s: %.*s\n", strModule.c_str(), rec.uiLen, rec.chrText);
+	}
+	else
+		fprintf(rec.eLevel == Level::Info ? stdout : stderr, "%.*s\n", rec.uiLen, rec.chrText);
+}
+
+void Log::Start()
+{
+	Log &log = Get();
+	if (log.m_thread)
+		return;
+	log.m_bRunning = true;
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "log"); Log *p = static_cast<Log*>(param); return p->Run(); };
+	pthread_create(&log.m_thread, nullptr, fcnRun, &log);
+}
+
+void Log::Stop()
+{
+	Log &log = Get();
+	if (!log.m_thread)
+		return;
+	log.m_bRunning = false;
+	pthread_join(log.m_thread, nullptr);
+	log.m_thread = 0;
+	std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with Write(), one of us sees a late record.
+	log.Drain(); // Anything queued after the writer's last pass.
+	std::lock_guard<std::mutex> guard(log.m_lockOut);
+	fflush(log.m_fOut ? log.m_fOut : stdout);
+}
+
+bool Log::Drain()
+{
+	std::vector<Ring_t*> vRings;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		for (auto &p : m_vRings)
+			vRings.push_back(p.get());
+	}
+	bool bAny = false;
+	Record_t rec;
+	std::lock_guard<std::mutex> guard(m_lockDrain); // Rings have one reader, but after Stop() that's any writer.
+	for (auto pRing : vRings)
+	{
+		while (pRing->records.Pop(rec))
+		{
+			Emit(rec);
+			bAny = true;
+		}
+		uint64_t uiDropped = pRing->uiDropped.exchange(0);
+		if (uiDropped)
+		{
+			std::lock_guard<std::mutex> guard(m_lockOut);
+			fprintf(m_fOut && !m_bBinary ? m_fOut : stderr, "Log: %llu records dropped, the writer fell behind.\n", static_cast<unsigned long long>(uiDropped));
+		}
+	}
+	return bAny;
+}
+
+void* Log::Run()
+{
+	while (m_bRunning)
+	{
+		if (Drain())
+			fflush(m_fOut ? m_fOut : stdout);
+		else
+			usleep(5000);
+	}
+	Drain();
+	return nullptr;
+}
@@ -0,0 +1,130 @@
+/*
+	Log.h - Leveled, per-module diagnostics, formatted on the calling thread
+	and written out by a background thread.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>        // for pthread_t
+#include <stdint.h>         // for uint8_t, uint16_t, uint64_t
+#include <stdio.h>          // for FILE
+#include <atomic>           // for atomic, atomic_bool, memory_order_relaxed
+#include <map>              // for map
+#include <memory>           // for unique_ptr
+#include <mutex>            // for mutex
+#include <string>           // for string
+#include <vector>           // for vector
+#include "SPSCRing.h"       // for SPSCRing
+#include "sim_avr.h"        // for avr_t
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+
+// Skips the formatting entirely when the level is off, so leaving these in hot handlers is cheap.
+#define LOG(module, level, ...) do { if ((module).IsEnabled(Log::Level::level)) (module).Write(Log::Level::level, __VA_ARGS__); } while (0)
+
+// Records go through a lock-free ring per thread to a writer thread, so a busy AVR thread never
+// waits on the terminal. Until Start() (and after Stop()) they are written out directly instead.
+class Log
+{
+	public:
+		enum class Level : uint8_t
+		{
+			Error,
+			Warning,
+			Info,
+			Debug,
+			Trace
+		};
+
+		// A named source of records, with its own level. Static, one per file or part type: they are never unregistered.
+		class Module
+		{
+			public:
+				explicit Module(const std::string &strName);
+
+				inline bool IsEnabled(Level eLevel) const { return static_cast<uint8_t>(eLevel) <= m_uiLevel.load(std::memory_order_relaxed); }
+				void Write(Level eLevel, const char *szFmt, ...) __attribute__((format(printf, 3, 4)));
+
+			private:
+				friend Log;
+				std::string m_strName;
+				uint16_t m_uiID;
+				std::atomic<uint8_t> m_uiLevel {static_cast<uint8_t>(Level::Info)};
+		};
+
+		// Comma separated: a level on its own sets the default, module=level just that module,
+		// e.g. "warning,TMC2130=trace". False (and a message) for anything it doesn't recognise.
+		static bool Configure(const std::string &strSpec);
+		// Sends the records to a file instead of stdout/stderr, as "<cycle> <level> <module>: <text>"
+		// lines, or binary records if bBinary (see Log.cpp for the layout).
+		static bool SetFile(const std::string &strPath, bool bBinary);
+
+		// Stamps this thread's records with the AVR's cycle count. Call on the AVR thread.
+		static inline void SetAVR(avr_t *pAVR) { m_pAVR = pAVR; }
+
+		static void Start();
+		// Writes out everything still queued and goes back to writing directly.
+		static void Stop();
+
+	private:
+		typedef struct Record_t
+		{
+			avr_cycle_count_t uiCycle;
+			uint16_t uiModule;
+			Level eLevel;
+			bool bHasCycle;
+			uint16_t uiLen;
+			char chrText[242];
+		} Record_t;
+
+		typedef struct Ring_t
+		{
+			SPSCRing<Record_t> records {4096}; // 1MB a thread
+			std::atomic<uint64_t> uiDropped {0};
+		} Ring_t;
+
+		static Log& Get();
+		static const char* LevelName(Level eLevel);
+		static bool ParseLevel(const std::string &strLevel, Level &eLevel);
+
+		uint16_t AddModule(Module *pModule);
+		Ring_t* GetRing();
+		void Emit(const Record_t &rec);
+		void* Run();
+		// Drains every ring once, returns whether there was anything.
+		bool Drain();
+
+		std::mutex m_lock; // For the module and ring lists, only taken to add to them.
+		std::mutex m_lockDrain; // Held while draining, late records after Stop() are drained by their writer.
+		std::vector<Module*> m_vModules;
+		std::map<std::string, Level> m_mLevels; // Configured, for modules registered later.
+		Level m_eDefault = Level::Info;
+		std::vector<std::unique_ptr<Ring_t>> m_vRings; // Never shrinks, threads keep a pointer to theirs.
+
+		std::mutex m_lockOut; // For the output, held by whoever is writing (the writer thread while running).
+		FILE *m_fOut = nullptr; // nullptr for stdout/stderr
+		bool m_bBinary = false;
+		std::vector<bool> m_vNamed; // Modules already described in the binary file.
+
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bRunning {false};
+
+		static thread_local Ring_t *m_pRing;
+		static thread_local avr_t *m_pAVR;
+};
@@ -24,7 +24,9 @@
 #include <GL/freeglut_ext.h>  // for glutSetOption
 #include <GL/glew.h>          // for glTranslatef, glPopMatrix, glPushMatrix
 #include <stdlib.h>           // for exit
+#include <algorithm>          // for max
 #include <cstdio>             // for size_t, fprintf, printf, stderr
+#include <string>             // for stof
 #include <vector>             // for vector
 #include "Camera.hpp"         // for Camera
 #include "GLPrint.h"          // for GLPrint
@@ -34,6 +36,9 @@
 #include "MK3S_Lite.h"        // for MK3S_Lite
 #include "OBJCollection.h"    // for OBJCollection, OBJCollection::ObjClass
 #include "Printer.h"          // for Printer
+#include "RedrawFlag.h"       // for RedrawFlag
+#include "RenderQuality.h"    // for RenderQuality
+#include "StartupTimeline.h"  // for StartupTimeline, StartupTimeline::Phase
 
 MK3SGL* MK3SGL::g_pMK3SGL = nullptr;
 
@@ -52,9 +57,14 @@ MK3SGL::MK3SGL(const string &strModel, bool bMMU, Printer *pParent):Scriptable("
 	else if (strModel.compare("bear")==0)
 		m_Objs = new MK3S_Bear(bMMU);
 
+	// The full models get solid extrusions, lite keeps to lines.
+	for (auto pPrint : m_vPrints)
+		pPrint->SetRibbons(strModel.compare("lite")!=0);
+
 	RegisterActionAndMenu("ClearPrint","Clears rendered print objects",ActClear);
 	RegisterActionAndMenu("ToggleNozzleCam","Toggles between normal and nozzle cam mode.",ActToggleNCam);
 	RegisterActionAndMenu("ResetCamera","Resets camera view to default",ActResetView);
+	RegisterAction("SetZRange","Only draws the print between the given heights (min, max, in mm). Also '[' and ']' step the top down/up a layer and '\\' shows everything.",ActSetZRange,{ArgType::Float,ArgType::Float});
 
 	glewInit();
 
@@ -84,19 +94,25 @@ MK3SGL::MK3SGL(const string &strModel, bool bMMU, Printer *pParent):Scriptable("
 	glEnable(GL_MULTISAMPLE);
 
 	ResetCamera();
-	for(size_t i=0; i<m_vObjLite.size(); i++)
-		m_vObjLite[i]->Load();
+	m_bLite = strModel.compare("lite") == 0;
+}
+
+void MK3SGL::LoadAssets()
+{
+	StartupTimeline::Phase phase("OBJCollection load");
+	vector<GLObj*> vExtra = m_vObjLite;
+	if (m_bMMU)
+		vExtra.insert(vExtra.end(), m_vObjMMU.begin(), m_vObjMMU.end());
+	GLObj::LoadAll(vExtra);
 
 	m_Objs->Load();
 
 	if (m_bMMU)
 	{
-		for(size_t i=0; i<m_vObjMMU.size(); i++)
-			m_vObjMMU[i]->Load();
 		m_MMUIdl.SetSubobjectVisible(1,false); // Screw, high triangle count
 		m_MMUBase.SetSubobjectVisible(1, false);
 
-		if (strModel.compare("lite") == 0)
+		if (m_bLite)
 		{
 			m_MMUIdl.SetAllVisible(false);
 			m_MMUIdl.SetSubobjectVisible(3);
@@ -109,7 +125,10 @@ MK3SGL::MK3SGL(const string &strModel, bool bMMU, Printer *pParent):Scriptable("
 				m_MMUBase.SetSubobjectVisible(i); // LEDs
 		}
 	}
-
+	m_bLoaded = true;
+	// Catch up on LEDs that changed while loading, the IRQ side skips them until m_bLoaded.
+	if (m_bMMU)
+		SetMMULeds(m_uiMMULedsChanged, m_uiMMULeds);
 }
 
 void MK3SGL::ResetCamera()
@@ -122,6 +141,8 @@ void MK3SGL::ResetCamera()
 
 void MK3SGL::ResizeCB(int w, int h)
 {
+	m_iWinW = w;
+	m_iWinH = h;
 	glViewport(0, 0, w, h);
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
@@ -132,6 +153,7 @@ void MK3SGL::ResizeCB(int w, int h)
 
 void MK3SGL::KeyCB(unsigned char c, int x, int y)
 {
+	RedrawFlag::Set();
 	// Decomment this block and use the flDbg variables
 	// as your position translation. Then, you can move the
 	// object into place using the numpad, and just read off
@@ -158,6 +180,21 @@ void MK3SGL::KeyCB(unsigned char c, int x, int y)
 		m_iDbg --;
 		m_MMUBase.SetSubobjectVisible(m_iDbg,true);
 	}
+	else if (c == '[' || c == ']')
+	{
+		static constexpr float fLayer = 0.2f;
+		if (m_fZTop<0)
+			m_fZTop = (m_state.fZPos*1000.f) + fLayer;
+		m_fZTop = std::max(0.f, m_fZTop + (c == '[' ? -fLayer : fLayer));
+		printf("Showing the print up to Z=%.2fmm\n", m_fZTop);
+		SetPrintZRange(-1.f, m_fZTop);
+	}
+	else if (c == '\\')
+	{
+		m_fZTop = -1;
+		printf("Showing the whole print\n");
+		SetPrintZRange(-1e6f, 1e6f);
+	}
 	printf("Int: %d\n",m_iDbg.load());
 	printf("Offsets: %03f, %03f, %03f,\n",m_flDbg.load(),m_flDbg2.load(), m_flDbg3.load());
 	if (m_pParent)
@@ -184,7 +221,7 @@ void MK3SGL::Init(avr_t *avr)
 	RegisterNotify(TOOL_IN,MAKE_C_CALLBACK(MK3SGL,OnToolChanged),this);
 	RegisterNotify(MMU_LEDS_IN,MAKE_C_CALLBACK(MK3SGL,OnMMULedsChanged),this);
 
-	m_bDirty = true;
+	RedrawFlag::Set();
 }
 
 
@@ -201,81 +238,110 @@ Scriptable::LineStatus MK3SGL::ProcessAction(unsigned int iAct, const vector<str
 		case ActClear:
 			ClearPrint();
 			return LineStatus::Finished;
+		case ActSetZRange:
+			SetPrintZRange(stof(vArgs.at(0)), stof(vArgs.at(1)));
+			return LineStatus::Finished;
 		default:
 			return LineStatus::Unhandled;
 
 	}
 }
 
+void MK3SGL::SetPrintZRange(float fMin, float fMax)
+{
+	for (auto pPrint : m_vPrints)
+		pPrint->SetZRange(fMin/1000.f, fMax/1000.f);
+	RedrawFlag::Set();
+}
+
 void MK3SGL::TwistKnob(bool bDir)
 {
 	if (bDir)
 		m_iKnobPos = (m_iKnobPos+18)%360;
 	else
 		m_iKnobPos = (m_iKnobPos + 342)%360;
+	RedrawFlag::Set();
 }
 
 void MK3SGL::OnXChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fXPos =  fPos[0]/1000.f;
-	m_bDirty = true;
+	m_stateAVR.fXPos = fPos[0]/1000.f;
+	StateChanged();
 }
 
 void MK3SGL::OnSelChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fSelPos =  fPos[0]/1000.f;
-	m_bDirty = true;
+	m_stateAVR.fSelPos = fPos[0]/1000.f;
+	StateChanged();
 }
 
 void MK3SGL::OnIdlChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fIdlPos =  fPos[0];
-	m_bDirty = true;
+	m_stateAVR.fIdlPos = fPos[0];
+	StateChanged();
 }
 
 void MK3SGL::OnBedChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bBedOn = value>0;
-	m_bDirty = true;
+	m_stateAVR.bBedOn = value>0;
+	StateChanged();
+}
+
+void MK3SGL::SetMMULeds(uint32_t uiChanged, uint32_t uiValue)
+{
+	static constexpr uint8_t iLedBase[2] = {38, 32}; // G, R
+	static constexpr uint8_t iLedObj[10] = {4,4,0,0,1,1,2,2,3,3};
+	//static constexpr uint8_t iMtlOff[2] = {32, 31};
+	static constexpr uint8_t iMtlOn[2] = {38,37};
+	for (int i=0; i<10; i++)
+	{
+		if ((uiChanged>>i) &1)
+		{
+			if ((uiValue>>i) & 1)
+				m_MMUBase.SetSubobjectMaterial(iLedBase[i%2]+iLedObj[i],iMtlOn[i%2]);
+			else
+				m_MMUBase.SetSubobjectMaterial(iLedBase[i%2]+iLedObj[i],5);//iMtlOff[i%2]);
+		}
+	}
 }
 
 void MK3SGL::OnSheetChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bPrintSurface = value>0;
-	m_bDirty = true;
+	m_stateAVR.bPrintSurface = value>0;
+	StateChanged();
 }
 
 void MK3SGL::OnEFanChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bFanOn = (value>0);
-	m_bDirty = true;
+	m_stateAVR.bFanOn = (value>0);
+	StateChanged();
 }
 
 void MK3SGL::OnPFanChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bPFanOn = (value>0);
-	m_bDirty = true;
+	m_stateAVR.bPFanOn = (value>0);
+	StateChanged();
 }
 
 void MK3SGL::OnSDChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bSDCard = value==0;
-	m_bDirty = true;
+	m_stateAVR.bSDCard = value==0;
+	StateChanged();
 }
 
 void MK3SGL::OnPINDAChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bPINDAOn = value;
-	m_bDirty = true;
+	m_stateAVR.bPINDAOn = value;
+	StateChanged();
 }
 
 void MK3SGL::OnFINDAChanged(avr_irq_t *irq, uint32_t value)
 {
-	m_bFINDAOn = value;
-	m_bDirty = true;
+	m_stateAVR.bFINDAOn = value;
+	StateChanged();
 }
 
 void MK3SGL::OnMMULedsChanged(avr_irq_t *irq, uint32_t value)
@@ -294,53 +360,58 @@ void MK3SGL::OnMMULedsChanged(avr_irq_t *irq, uint32_t value)
 	// m_lRed[2].ConnectFrom(	m_shift.GetIRQ(HC595::BIT13), LED::LED_IN);
 	// m_lGreen[1].ConnectFrom(m_shift.GetIRQ(HC595::BIT14), LED::LED_IN);
 	// m_lRed[1].ConnectFrom(	m_shift.GetIRQ(HC595::BIT15), LED::LED_IN);
-	uint32_t bChanged = irq->value ^ value;
-	static constexpr uint8_t iLedBase[2] = {38, 32}; // G, R
-	static constexpr uint8_t iLedObj[10] = {4,4,0,0,1,1,2,2,3,3};
-	//static constexpr uint8_t iMtlOff[2] = {32, 31};
-	static constexpr uint8_t iMtlOn[2] = {38,37};
-	for (int i=0; i<10; i++)
-	{
-		if ((bChanged>>i) &1)
-		{
-			if ((value>>i) & 1)
-				m_MMUBase.SetSubobjectMaterial(iLedBase[i%2]+iLedObj[i],iMtlOn[i%2]);
-			else
-				m_MMUBase.SetSubobjectMaterial(iLedBase[i%2]+iLedObj[i],5);//iMtlOff[i%2]);
-		}
-	}
+	m_uiMMULeds = value;
+	m_uiMMULedsChanged |= irq->value ^ value;
+	if (m_bLoaded)
+		SetMMULeds(irq->value ^ value, value);
 
-	m_bDirty = true;
+	RedrawFlag::Set();
 }
 
 void MK3SGL::OnYChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fYPos = fPos[0]/1000.f;
-	m_bDirty = true;
+	m_stateAVR.fYPos = fPos[0]/1000.f;
+	StateChanged();
 }
 
 void MK3SGL::OnEChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fEPos = fPos[0]/1000.f;
-	m_vPrints[m_iCurTool]->NewCoord(m_fXPos,m_fYPos,m_fZPos,m_fEPos);
-	m_bDirty = true;
+	m_stateAVR.fEPos = fPos[0]/1000.f;
+	m_vPrints[m_iCurTool]->NewCoord(m_stateAVR.fXPos,m_stateAVR.fYPos,m_stateAVR.fZPos,m_stateAVR.fEPos);
+	StateChanged();
 }
 
 void MK3SGL::OnZChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fZPos =  fPos[0]/1000.f;
-	m_bDirty = true;
+	m_stateAVR.fZPos = fPos[0]/1000.f;
+	StateChanged();
 }
 
 
 void MK3SGL::OnPChanged(avr_irq_t *irq, uint32_t value)
 {
 	float* fPos = (float*)(&value); // both 32 bits, just mangle it for sending over the wire.
-	m_fPPos =  fPos[0]/1000.f;
-	m_bDirty = true;
+	m_stateAVR.fPPos = fPos[0]/1000.f;
+	StateChanged();
+}
+
+void MK3SGL::StateChanged()
+{
+	if (m_bPublishPending)
+		return;
+	m_bPublishPending = true;
+	RegisterTimerUsec(m_fcnPublish, m_uiPublishUs, this);
+}
+
+avr_cycle_count_t MK3SGL::OnPublishTimer(avr_t *avr, avr_cycle_count_t uiWhen)
+{
+	m_visState.Publish(m_stateAVR);
+	m_bPublishPending = false;
+	RedrawFlag::Set();
+	return 0;
 }
 
 void MK3SGL::OnToolChanged(avr_irq_t *irq, uint32_t iIdx)
@@ -353,15 +424,22 @@ static constexpr float fMM2M = 1.f/1000.f;
 
 void MK3SGL::Draw()
 {
-		//if (!m_bDirty)
-		//    return;
+	if (!m_bLoaded)
+		LoadAssets();
 	if (m_bClearPrints) // Needs to be done in the GL loop for thread safety.
 	{
 		for (int i=0; i<5; i++) m_vPrints[i]->Clear();
 		m_bClearPrints = false;
 	}
+	if (m_visState.Update())
+		m_state = m_visState.Get();
 	int iOldWin = glutGetWindow();
 	glutSetWindow(m_iWindow);
+	if (RenderQuality::UseMultisample())
+		glEnable(GL_MULTISAMPLE);
+	else
+		glDisable(GL_MULTISAMPLE);
+	bool bScaled = BeginScaled();
 	glClearColor(0.1f, 0.2f, 0.3f, 1.0f);
 	glClearDepth(1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -413,18 +491,18 @@ void MK3SGL::Draw()
 		{
 				float fLook[3];
 				m_Objs->GetNozzleCamPos(fLook);
-				fLook[0]+=fTransform[0]=m_fXPos;
-				fLook[1]+=m_fZPos;
+				fLook[0]+=fTransform[0]=m_state.fXPos;
+				fLook[1]+=m_state.fZPos;
 				gluLookAt(fLook[0]+.001, fLook[1]+.003 ,fLook[2]+.08, fLook[0],fLook[1],fLook[2] ,0,1,0);
 		}
 		m_Objs->SetNozzleCam(m_bFollowNozzle);
 		glPushMatrix();
-			glTranslatef(0,m_fZPos,0);
+			glTranslatef(0,m_state.fZPos,0);
 			m_Objs->Draw(OBJCollection::ObjClass::Z);
 			glPushMatrix();
-				glTranslatef(m_fXPos,0,0);
+				glTranslatef(m_state.fXPos,0,0);
 				m_Objs->Draw(OBJCollection::ObjClass::X);
-				if (!m_bPINDAOn)
+				if (!m_state.bPINDAOn)
 				{
 					glPushMatrix();
 						m_Objs->ApplyPLEDTransform();
@@ -432,26 +510,32 @@ void MK3SGL::Draw()
 					glPopMatrix();
 				}
 				glPushMatrix();
-					if (m_bPFanOn)
+					if (m_state.bPFanOn)
+					{
 						m_iPFanPos = (m_iPFanPos + 5)%360;
+						RedrawFlag::Set(); // Keep animating.
+					}
 					m_Objs->DrawPFan(m_iPFanPos);
 				glPopMatrix();
 
 				glPushMatrix();
-					if (m_bFanOn)
+					if (m_state.bFanOn)
+					{
 						m_iFanPos = (m_iFanPos + 339)%360;
+						RedrawFlag::Set();
+					}
 					m_Objs->DrawEFan(m_iFanPos);
 				glPopMatrix();
 				glPushMatrix();
-					m_Objs->DrawEVis(m_fEPos);
+					m_Objs->DrawEVis(m_state.fEPos);
 				glPopMatrix();
 			glPopMatrix();
 		glPopMatrix();
 
 		glPushMatrix();
-			glTranslatef(0,0,(m_fYPos));
+			glTranslatef(0,0,(m_state.fYPos));
 			m_Objs->Draw(OBJCollection::ObjClass::Y);
-			if (m_bPrintSurface)
+			if (m_state.bPrintSurface)
 				m_Objs->Draw(OBJCollection::ObjClass::PrintSurface);
 			glPushMatrix();
 				glScalef(1,1,-1);
@@ -459,7 +543,7 @@ void MK3SGL::Draw()
 				for (size_t i=0; i<m_vPrints.size(); i++)
 					m_vPrints[i]->Draw();
 			glPopMatrix();
-			if (m_bBedOn)
+			if (m_state.bBedOn)
 			{
 				glTranslatef(m_flDbg,m_flDbg2,m_flDbg3);
 				m_Objs->ApplyBedLEDTransform();
@@ -486,15 +570,59 @@ void MK3SGL::Draw()
 				glPopMatrix();
 			glPopMatrix();
 		}
-		if (m_bSDCard) //if card present
+		if (m_state.bSDCard) //if card present
 			m_Objs->Draw(OBJCollection::ObjClass::Media); // Draw removable media (SD, USB, etc)
 		if (m_Objs->SupportsMMU() && m_bMMU)
 			DrawMMU();
+		if (bScaled)
+			EndScaled();
 		glutSwapBuffers();
-		m_bDirty = false;
 		glutSetWindow(iOldWin);
 }
 
+bool MK3SGL::BeginScaled()
+{
+	float fScale = RenderQuality::GetScale();
+	if (fScale >= 1.f || !GLEW_VERSION_3_0)
+		return false;
+	int iW = std::max(1, static_cast<int>(m_iWinW * fScale)), iH = std::max(1, static_cast<int>(m_iWinH * fScale));
+	if (!m_uiFBO)
+	{
+		glGenFramebuffers(1, &m_uiFBO);
+		glGenRenderbuffers(1, &m_uiFBOColour);
+		glGenRenderbuffers(1, &m_uiFBODepth);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, m_uiFBO);
+	if (iW != m_iFBOW || iH != m_iFBOH)
+	{
+		glBindRenderbuffer(GL_RENDERBUFFER, m_uiFBOColour);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, iW, iH);
+		glBindRenderbuffer(GL_RENDERBUFFER, m_uiFBODepth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, iW, iH);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_uiFBOColour);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_uiFBODepth);
+		m_iFBOW = iW;
+		m_iFBOH = iH;
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return false;
+	}
+	glViewport(0, 0, iW, iH); // Same aspect, so the projection stands.
+	return true;
+}
+
+void MK3SGL::EndScaled()
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, m_uiFBO);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, m_iFBOW, m_iFBOH, 0, 0, m_iWinW, m_iWinH, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, m_iWinW, m_iWinH);
+}
+
 void MK3SGL::DrawRoundLED()
 {
 	float fLED[4] = {1,0,0,1};
@@ -547,8 +675,8 @@ void MK3SGL::DrawMMU()
 			glPushMatrix();
 				m_MMUSel.GetCenteringTransform(fTransform);
 				glPushMatrix();
-					glTranslatef(m_fSelPos - m_fSelCorr,0.062,0.123);
-					if (m_bFINDAOn)
+					glTranslatef(m_state.fSelPos - m_fSelCorr,0.062,0.123);
+					if (m_state.bFINDAOn)
 					{
 						glPushMatrix();
 							glTranslatef(-0.075,-0.274,-0.222);
@@ -568,7 +696,7 @@ void MK3SGL::DrawMMU()
 					fTransform[1] +=1.5f;
 					glTranslatef (-fTransform[0] , -fTransform[1], -fTransform[2]);
 					glRotatef(90,0,1,0);
-					glRotatef(360.f*(m_fSelPos/0.008f),0,0,1); // 8mm thread pitch, so we need to rotate 360deg for every 8 of travel.
+					glRotatef(360.f*(m_state.fSelPos/0.008f),0,0,1); // 8mm thread pitch, so we need to rotate 360deg for every 8 of travel.
 					glTranslatef (fTransform[0], fTransform[1], fTransform[2]);
 					m_EVis.Draw();
 				glPopMatrix();
@@ -581,7 +709,7 @@ void MK3SGL::DrawMMU()
 				fTransform[2]=-0.0929;
 				glPushMatrix();
 					glTranslatef (-fTransform[0], -fTransform[1], -fTransform[2]);
-					glRotatef(m_fIdlPos + m_fIdlCorr,1,0,0);
+					glRotatef(m_state.fIdlPos + m_fIdlCorr,1,0,0);
 					glRotatef(180,0,1,0);
 					glTranslatef (fTransform[0], fTransform[1], fTransform[2]);
 					m_MMUIdl.Draw();
@@ -593,7 +721,7 @@ void MK3SGL::DrawMMU()
 					fTransform[1] +=1.5f;
 					glTranslatef (-fTransform[0] , -fTransform[1], -fTransform[2]);
 					glRotatef(270,0,1,0);
-					glRotatef(-m_fIdlPos,0,0,1);
+					glRotatef(-m_state.fIdlPos,0,0,1);
 					glTranslatef (fTransform[0], fTransform[1], fTransform[2]);
 					m_EVis.Draw();
 				glPopMatrix();
@@ -608,7 +736,7 @@ void MK3SGL::DrawMMU()
 				fTransform[1] +=1.5f;
 				glTranslatef (-fTransform[0] , -fTransform[1], -fTransform[2]);
 				glRotatef(90,0,1,0);
-				glRotatef((m_fPPos/0.021f)*360.f,0,0,1); // 1 rotation for every 21mm of travel.
+				glRotatef((m_state.fPPos/0.021f)*360.f,0,0,1); // 1 rotation for every 21mm of travel.
 				glTranslatef (fTransform[0], fTransform[1], fTransform[2]);
 				m_EVis.Draw();
 			glPopMatrix();
@@ -644,11 +772,11 @@ void MK3SGL::MouseCB(int button, int action, int x, int y)
 	if (button==4)
 		m_camera.zoom(-0.5f);
 
-	m_bDirty = true;
+	RedrawFlag::Set();
 }
 
 void MK3SGL::MotionCB(int x, int y)
 {
  	m_camera.setCurrentMousePos(x, y);
-	m_bDirty = true;
+	RedrawFlag::Set();
 }
@@ -24,7 +24,7 @@
 #include <GLPrint.h>         // for GLPrint
 #include <stdint.h>          // for uint32_t
 #include <Camera.hpp>        // for Camera
-#include <atomic>            // for atomic, atomic_bool, atomic_int
+#include <atomic>            // for atomic, atomic_bool, atomic_int, atomic_uint32_t
 #include <string>            // for string
 #include <vector>            // for vector
 #include "BasePeripheral.h"  // for BasePeripheral
@@ -32,7 +32,9 @@
 #include "HD44780.h"         // for _IRQ
 #include "IScriptable.h"     // for IScriptable::LineStatus
 #include "Scriptable.h"      // for Scriptable
-#include "sim_avr.h"         // for avr_t
+#include "TripleBuffer.h"    // for TripleBuffer
+#include "sim_avr.h"         // for avr_t, avr_cycle_count_t
+#include "sim_cycle_timers.h" // for avr_cycle_timer_t
 #include "sim_irq.h"         // for avr_irq_t
 
 class HD44780GL;
@@ -119,10 +121,19 @@ class MK3SGL: public BasePeripheral, public Scriptable
 
         atomic_bool m_bFollowNozzle = {false}; // Camera follows nozzle.
 		atomic_bool m_bClearPrints = {false};
+		float m_fZTop = -1; // Top of the visible print in mm (keyboard), <0 shows all.
+
+		// Shows only the printed layers between these heights (mm).
+		void SetPrintZRange(float fMin, float fMax);
 
         // MMU draw subfunction.
         void DrawMMU();
 
+        // Loads the models, on the first frame rather than at startup. GL thread only.
+        void LoadAssets();
+        // Lights the MMU LED subobjects for the changed bits.
+        void SetMMULeds(uint32_t uiChanged, uint32_t uiValue);
+
         // Draws a simple LED at a position.
         void DrawLED(float r, float g, float b);
 		void DrawRoundLED();
@@ -146,30 +157,49 @@ class MK3SGL: public BasePeripheral, public Scriptable
 		void OnToolChanged(avr_irq_t *irq, uint32_t iIdx);
 
 
-        // Correction parameters to get the model at 0,0,0 and aligned with the simulated starting positions.
-        atomic<float> m_fEPos = {0}, m_fXPos = {0.01}, m_fYPos = {0.01}, m_fZPos = {0.01}, m_fPPos = {0.f};
+        // Everything the frame draws from the simulation. The AVR thread edits m_stateAVR as IRQs arrive and
+        // publishes a copy at most once per m_uiPublishUs of sim time; Draw() takes one coherent copy per frame.
+        typedef struct VisState_t
+        {
+            float fEPos = 0, fXPos = 0.01, fYPos = 0.01, fZPos = 0.01, fPPos = 0;
+            float fSelPos = 0;
+            float fIdlPos = 0; // degrees rotation instead of mm
+            bool bFanOn = false, bBedOn = false, bPINDAOn = false, bFINDAOn = false, bPFanOn = false;
+            bool bSDCard = true, bPrintSurface = true;
+        } VisState_t;
+
+        VisState_t m_stateAVR;              // AVR thread only
+        TripleBuffer<VisState_t> m_visState;
+        VisState_t m_state;                 // GL thread's copy for this frame
+        bool m_bPublishPending = false;     // AVR thread only
+
+        // Marks m_stateAVR as changed, publish is deferred to the timer.
+        void StateChanged();
+        avr_cycle_count_t OnPublishTimer(avr_t *avr, avr_cycle_count_t uiWhen);
+        avr_cycle_timer_t m_fcnPublish = MAKE_C_TIMER_CALLBACK(MK3SGL,OnPublishTimer);
+        static constexpr uint32_t m_uiPublishUs = 5000;
 
+        // Correction parameters to get the model at 0,0,0 and aligned with the simulated starting positions.
         float m_fSelCorr = 0.025f;
-		atomic<float> m_fSelPos = {0.0f};
-
-        // This is going to be in degrees rotation instead of mm
         float m_fIdlCorr = 120.00f;
-		atomic<float> m_fIdlPos = {0.0f};
 
         atomic_int m_iKnobPos {0}, m_iFanPos = {0}, m_iPFanPos = {0}, m_iIdlPos = {0};
 
-        atomic_bool m_bDirty = {false},
-			m_bFanOn = {false},
-			m_bMMU = {false},
-			m_bBedOn = {false},
-			m_bPINDAOn = {false},
-			m_bFINDAOn = {false},
-        	m_bPFanOn = {false},
-			m_bSDCard = {true},
-			m_bPrintSurface = {true};
+        atomic_bool m_bMMU = {false};
+        bool m_bLite = false;
+        atomic_bool m_bLoaded = {false};
+        atomic_uint32_t m_uiMMULeds = {0}, m_uiMMULedsChanged = {0}; // LED state (and bits that ever changed), applied on load if it came first.
 
 
         int m_iWindow = 0;
+		int m_iWinW = 800, m_iWinH = 800; // As of the last ResizeCB
+
+		// Below full RenderQuality::GetScale(), the scene is drawn into this and scaled up to the window.
+		GLuint m_uiFBO = 0, m_uiFBOColour = 0, m_uiFBODepth = 0;
+		int m_iFBOW = 0, m_iFBOH = 0;
+		// Binds (and sizes) the offscreen target if the quality calls for one. GL 3.0.
+		bool BeginScaled();
+		void EndScaled();
 
 		// Useful for instant positioning.
 
@@ -182,7 +212,8 @@ class MK3SGL: public BasePeripheral, public Scriptable
 		{
 			ActClear,
 			ActToggleNCam,
-			ActResetView
+			ActResetView,
+			ActSetZRange
 		};
 
 		static MK3SGL *g_pMK3SGL;
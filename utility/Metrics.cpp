@@ -0,0 +1,307 @@
+/*
+	Metrics.cpp - Live values (rates, queue depths, temperatures...) exported
+	for dashboards, by Prometheus scrape and/or StatsD push.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Metrics.h"
+#include <netdb.h>       // for addrinfo, getaddrinfo, freeaddrinfo
+#include <poll.h>        // for poll, pollfd, POLLIN
+#include <signal.h>      // for signal, SIGPIPE, SIG_IGN
+#include <stdio.h>       // for printf, fprintf, snprintf, stderr
+#include <sys/socket.h>  // for socket, bind, listen, accept, connect, send, recv
+#include <unistd.h>      // for close
+#include <algorithm>     // for remove_if, stable_sort
+#include "ThreadPolicy.h" // for ThreadPolicy
+
+thread_local unsigned int MetricsExporter::m_uiInstance = 0;
+
+Metric::~Metric()
+{
+	MetricsExporter::Get().Remove(this);
+}
+
+void Metric::Register(const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels)
+{
+	MetricsExporter::Get().Add(this, strName, strHelp, vLabels, false, 1);
+}
+
+void Metric::RegisterRate(const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels, double dScale)
+{
+	MetricsExporter::Get().Add(this, strName, strHelp, vLabels, true, dScale);
+}
+
+MetricsExporter& MetricsExporter::Get()
+{
+	// Never destroyed: static Metrics (and parts torn down at exit) still unregister from it.
+	static MetricsExporter *pExporter = new MetricsExporter();
+	return *pExporter;
+}
+
+void MetricsExporter::Add(const Metric *pMetric, const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels, bool bRate, double dScale)
+{
+	Entry_t entry {pMetric, strName, strHelp, vLabels, bRate, dScale, pMetric->Get(), 0, std::chrono::steady_clock::now()};
+	entry.vLabels.insert(entry.vLabels.begin(), {"printer", std::to_string(m_uiInstance)});
+	std::lock_guard<std::mutex> guard(m_lock);
+	m_vEntries.push_back(entry);
+}
+
+void MetricsExporter::Remove(const Metric *pMetric)
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	m_vEntries.erase(std::remove_if(m_vEntries.begin(), m_vEntries.end(), [pMetric](const Entry_t &e) { return e.pMetric == pMetric; }), m_vEntries.end());
+}
+
+// Splits [host:]port, the host defaulting to szHost.
+static bool Resolve(const std::string &strAddr, const char *szHost, int iType, addrinfo *&pInfo)
+{
+	std::string strHost = szHost ? szHost : "", strPort = strAddr;
+	size_t uiColon = strAddr.rfind(':');
+	if (uiColon != std::string::npos)
+	{
+		strHost = strAddr.substr(0, uiColon);
+		strPort = strAddr.substr(uiColon + 1);
+	}
+	addrinfo hints {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = iType;
+	hints.ai_flags = strHost.empty() ? AI_PASSIVE : 0;
+	int iErr = getaddrinfo(strHost.empty() ? nullptr : strHost.c_str(), strPort.c_str(), &hints, &pInfo);
+	if (iErr != 0)
+		fprintf(stderr, "Metrics: Can't resolve %s: %s\n", strAddr.c_str(), gai_strerror(iErr));
+	return iErr == 0;
+}
+
+bool MetricsExporter::StartPrometheus(const std::string &strAddr)
+{
+	addrinfo *pInfo = nullptr;
+	if (!Resolve(strAddr, nullptr, SOCK_STREAM, pInfo))
+		return false;
+	m_fdListen = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+	int iOn = 1;
+	if (m_fdListen >= 0)
+		setsockopt(m_fdListen, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+	bool bOK = m_fdListen >= 0 && bind(m_fdListen, pInfo->ai_addr, pInfo->ai_addrlen) == 0 && listen(m_fdListen, 8) == 0;
+	freeaddrinfo(pInfo);
+	if (!bOK)
+	{
+		perror(strAddr.c_str());
+		return false;
+	}
+	printf("Metrics: Serving Prometheus metrics on %s\n", strAddr.c_str());
+	StartThread();
+	return true;
+}
+
+bool MetricsExporter::StartStatsD(const std::string &strAddr)
+{
+	addrinfo *pInfo = nullptr;
+	if (!Resolve(strAddr, "localhost", SOCK_DGRAM, pInfo))
+		return false;
+	m_fdStatsD = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+	bool bOK = m_fdStatsD >= 0 && connect(m_fdStatsD, pInfo->ai_addr, pInfo->ai_addrlen) == 0;
+	freeaddrinfo(pInfo);
+	if (!bOK)
+	{
+		perror(strAddr.c_str());
+		return false;
+	}
+	printf("Metrics: Pushing StatsD metrics to %s\n", strAddr.c_str());
+	StartThread();
+	return true;
+}
+
+void MetricsExporter::StartThread()
+{
+	if (m_thread)
+		return; // Already running for the other one.
+	signal(SIGPIPE, SIG_IGN); // A scraper that hangs up shouldn't take the simulator with it.
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "metrics"); MetricsExporter *p = static_cast<MetricsExporter*>(param); return p->Run(); };
+	pthread_create(&m_thread, nullptr, fcnRun, this);
+}
+
+void MetricsExporter::Stop()
+{
+	if (m_thread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, nullptr);
+		m_thread = 0;
+	}
+	if (m_fdListen >= 0)
+		close(m_fdListen);
+	if (m_fdStatsD >= 0)
+		close(m_fdStatsD);
+	m_fdListen = m_fdStatsD = -1;
+}
+
+void* MetricsExporter::Run()
+{
+	auto tpNextTick = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (!m_bQuit)
+	{
+		auto tpNow = std::chrono::steady_clock::now();
+		if (tpNow >= tpNextTick)
+		{
+			Tick();
+			if (m_fdStatsD >= 0)
+				PushStatsD();
+			tpNextTick += std::chrono::seconds(1);
+			continue;
+		}
+		// Short enough to notice a Stop() promptly.
+		int iWaitMs = std::min<int>(100, std::chrono::duration_cast<std::chrono::milliseconds>(tpNextTick - tpNow).count() + 1);
+		if (m_fdListen < 0)
+		{
+			poll(nullptr, 0, iWaitMs);
+			continue;
+		}
+		pollfd pfd {m_fdListen, POLLIN, 0};
+		if (poll(&pfd, 1, iWaitMs) > 0)
+		{
+			int fd = accept(m_fdListen, nullptr, nullptr);
+			if (fd >= 0)
+				ServeClient(fd);
+		}
+	}
+	return nullptr;
+}
+
+void MetricsExporter::Tick()
+{
+	auto tpNow = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> guard(m_lock);
+	for (auto &entry : m_vEntries)
+	{
+		if (!entry.bRate)
+			continue;
+		double dNow = entry.pMetric->Get();
+		double dSecs = std::chrono::duration<double>(tpNow - entry.tpLast).count();
+		if (dSecs > 0)
+			entry.dRate = (dNow - entry.dLast) / dSecs * entry.dScale;
+		entry.dLast = dNow;
+		entry.tpLast = tpNow;
+	}
+}
+
+// A scrape is one small request, answered and closed, so there's no need to track connections.
+void MetricsExporter::ServeClient(int fd)
+{
+	std::string strReq;
+	char buf[1024];
+	pollfd pfd {fd, POLLIN, 0};
+	while (strReq.find("\r\n\r\n") == std::string::npos && strReq.size() < 8192 && poll(&pfd, 1, 1000) > 0)
+	{
+		ssize_t iRead = recv(fd, buf, sizeof(buf), 0);
+		if (iRead <= 0)
+			break;
+		strReq.append(buf, iRead);
+	}
+	std::string strBody, strStatus = "200 OK";
+	if (strReq.compare(0, 13, "GET /metrics ") == 0 || strReq.compare(0, 6, "GET / ") == 0)
+		strBody = FormatPrometheus();
+	else
+	{
+		strStatus = "404 Not Found";
+		strBody = "Metrics are at /metrics\n";
+	}
+	std::string strOut = "HTTP/1.0 " + strStatus + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(strBody.size()) + "\r\nConnection: close\r\n\r\n" + strBody;
+	size_t uiSent = 0;
+	while (uiSent < strOut.size())
+	{
+		ssize_t iSent = send(fd, strOut.data() + uiSent, strOut.size() - uiSent, 0);
+		if (iSent <= 0)
+			break;
+		uiSent += iSent;
+	}
+	close(fd);
+}
+
+static std::string EscapeLabel(const std::string &strIn)
+{
+	std::string strOut;
+	for (char c : strIn)
+	{
+		if (c == '\\' || c == '"')
+			strOut.push_back('\\');
+		if (c == '\n')
+			strOut += "\\n";
+		else
+			strOut.push_back(c);
+	}
+	return strOut;
+}
+
+std::string MetricsExporter::FormatPrometheus()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
+	// Each name's samples have to be together, under one HELP/TYPE. Keep registration order otherwise.
+	std::vector<const Entry_t*> vSorted;
+	for (auto &entry : m_vEntries)
+		vSorted.push_back(&entry);
+	std::stable_sort(vSorted.begin(), vSorted.end(), [](const Entry_t *a, const Entry_t *b) { return a->strName < b->strName; });
+	std::string strOut, strLastName;
+	char szVal[32];
+	for (auto pEntry : vSorted)
+	{
+		if (pEntry->strName != strLastName)
+		{
+			bool bCounter = !pEntry->bRate && pEntry->pMetric->GetKind() == Metric::Kind::Counter;
+			strOut += "# HELP " + pEntry->strName + " " + pEntry->strHelp + "\n";
+			strOut += "# TYPE " + pEntry->strName + (bCounter ? " counter\n" : " gauge\n");
+			strLastName = pEntry->strName;
+		}
+		strOut += pEntry->strName + "{";
+		for (size_t i=0; i<pEntry->vLabels.size(); i++)
+			strOut += (i ? "," : "") + pEntry->vLabels[i].first + "=\"" + EscapeLabel(pEntry->vLabels[i].second) + "\"";
+		snprintf(szVal, sizeof(szVal), "} %.17g\n", pEntry->bRate ? pEntry->dRate : pEntry->pMetric->Get());
+		strOut += szVal;
+	}
+	return strOut;
+}
+
+void MetricsExporter::PushStatsD()
+{
+	// Totals go out as gauges too, so a lost datagram doesn't skew anything.
+	std::vector<std::string> vLines;
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		char szVal[32];
+		for (auto &entry : m_vEntries)
+		{
+			snprintf(szVal, sizeof(szVal), ":%g|g|#", entry.bRate ? entry.dRate : entry.pMetric->Get());
+			std::string strLine = entry.strName + szVal;
+			for (size_t i=0; i<entry.vLabels.size(); i++)
+				strLine += (i ? "," : "") + entry.vLabels[i].first + ":" + entry.vLabels[i].second;
+			vLines.push_back(strLine);
+		}
+	}
+	// Batched into datagrams that stay under a typical MTU.
+	std::string strPacket;
+	for (size_t i=0; i<=vLines.size(); i++)
+	{
+		if (!strPacket.empty() && (i == vLines.size() || strPacket.size() + vLines[i].size() + 1 > 1400))
+		{
+			send(m_fdStatsD, strPacket.data(), strPacket.size(), 0); // Nobody listening is fine.
+			strPacket.clear();
+		}
+		if (i < vLines.size())
+			strPacket += (strPacket.empty() ? "" : "\n") + vLines[i];
+	}
+}
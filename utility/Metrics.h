@@ -0,0 +1,119 @@
+/*
+	Metrics.h - Live values (rates, queue depths, temperatures...) exported
+	for dashboards, by Prometheus scrape and/or StatsD push.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>   // for pthread_t
+#include <atomic>      // for atomic, memory_order_relaxed
+#include <chrono>      // for steady_clock
+#include <mutex>       // for mutex
+#include <string>      // for string
+#include <utility>     // for pair
+#include <vector>      // for vector
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+// One value, owned by the part it describes. The owner's thread (usually the AVR's) updates it
+// with a plain relaxed store, the exporter thread only ever reads it, so there is no locking
+// or waiting on the hot side. Does nothing more than that until registered.
+class Metric
+{
+	public:
+		enum class Kind
+		{
+			Counter,
+			Gauge
+		};
+
+		explicit Metric(Kind eKind = Kind::Gauge):m_eKind(eKind){};
+		~Metric();
+		Metric(const Metric&) = delete;
+		Metric& operator=(const Metric&) = delete;
+
+		// Exports it as strName, Prometheus style (mk404_<what>_<unit>, counters end in _total).
+		// The printer instance selected on the calling thread is added as a "printer" label.
+		void Register(const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels = {});
+		// Also exports its per-second rate of change times dScale, as a gauge, worked out by the exporter.
+		void RegisterRate(const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels = {}, double dScale = 1);
+
+		inline void Set(double dVal) { m_dVal.store(dVal, std::memory_order_relaxed); }
+		// Single writer, so a load and store does and saves a locked add.
+		inline void Add(double dVal = 1) { m_dVal.store(m_dVal.load(std::memory_order_relaxed) + dVal, std::memory_order_relaxed); }
+		inline double Get() const { return m_dVal.load(std::memory_order_relaxed); }
+
+		inline Kind GetKind() const { return m_eKind; }
+
+	private:
+		Kind m_eKind;
+		std::atomic<double> m_dVal {0};
+};
+
+class MetricsExporter
+{
+	public:
+		static MetricsExporter& Get();
+
+		// Sets the "printer" label for everything registered from this thread from now on.
+		static inline void SelectInstance(unsigned int uiInstance) { m_uiInstance = uiInstance; }
+
+		// Serves the metrics in the Prometheus text format over HTTP on [host:]port (all interfaces without a host).
+		bool StartPrometheus(const std::string &strAddr);
+		// Pushes them every second as StatsD gauges/counters, with DogStatsD-style tags, to host:port over UDP.
+		bool StartStatsD(const std::string &strAddr);
+		void Stop();
+
+	private:
+		friend Metric;
+
+		typedef struct Entry_t
+		{
+			const Metric *pMetric;
+			std::string strName, strHelp;
+			MetricLabels vLabels;
+			bool bRate;
+			double dScale;
+			double dLast, dRate; // For rates, as of the last tick.
+			std::chrono::steady_clock::time_point tpLast;
+		} Entry_t;
+
+		MetricsExporter() = default;
+
+		void Add(const Metric *pMetric, const std::string &strName, const std::string &strHelp, const MetricLabels &vLabels, bool bRate, double dScale);
+		void Remove(const Metric *pMetric);
+
+		void StartThread();
+		void* Run();
+		// Updates the rates, once a second.
+		void Tick();
+		void ServeClient(int fd);
+		std::string FormatPrometheus();
+		void PushStatsD();
+
+		std::mutex m_lock; // For the entries; held by registration and the exporter thread, never the hot side.
+		std::vector<Entry_t> m_vEntries;
+
+		int m_fdListen = -1, m_fdStatsD = -1;
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+
+		static thread_local unsigned int m_uiInstance;
+};
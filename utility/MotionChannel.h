@@ -0,0 +1,96 @@
+/*
+	MotionChannel.h - One stepper axis' motion, read directly by whoever needs it
+	instead of being fanned out through an IRQ to every consumer on every step.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>         // for size_t
+#include <stdint.h>         // for int32_t
+#include <functional>       // for function
+#include <vector>           // for vector
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+
+// AVR thread only. Consumers either pull the latest sample when they need it,
+// or watch a position window and are only called while the axis is inside it.
+class MotionChannel
+{
+	public:
+		typedef struct MotionSample_t
+		{
+			avr_cycle_count_t uiCycle = 0; // Of the last update
+			int32_t iStep = 0;             // Absolute (micro)step count
+			int32_t iDelta = 0;            // Steps moved by the last update
+			float fPos = 0;                // mm
+		} MotionSample_t;
+
+		typedef std::function<void(const MotionSample_t&)> WatchFcn;
+
+		inline const MotionSample_t& Get() const { return m_sample; }
+		inline float GetPos() const { return m_sample.fPos; }
+
+		// Calls fcn on every update landing in [fMin, fMax], and once more on the first one
+		// that leaves it. fMin > fMax closes the window. Returns a handle for SetWindow().
+		size_t Watch(const WatchFcn &fcn, float fMin, float fMax)
+		{
+			m_vWatches.push_back({fcn, 0, 0, false});
+			SetWindow(m_vWatches.size()-1, fMin, fMax);
+			return m_vWatches.size()-1;
+		}
+
+		void SetWindow(size_t uiHandle, float fMin, float fMax)
+		{
+			Watch_t &w = m_vWatches.at(uiHandle);
+			w.fMin = fMin;
+			w.fMax = fMax;
+			w.bInside = IsIn(w, m_sample.fPos);
+		}
+
+		// Producer side.
+		inline void Update(avr_cycle_count_t uiCycle, int32_t iStep, float fPos)
+		{
+			m_sample.iDelta = iStep - m_sample.iStep;
+			m_sample.uiCycle = uiCycle;
+			m_sample.iStep = iStep;
+			m_sample.fPos = fPos;
+			for (auto &w : m_vWatches)
+			{
+				bool bIn = IsIn(w, fPos);
+				if (bIn || w.bInside)
+				{
+					w.bInside = bIn;
+					w.fcn(m_sample);
+				}
+			}
+		}
+
+	private:
+		typedef struct Watch_t
+		{
+			WatchFcn fcn;
+			float fMin, fMax;
+			bool bInside;
+		} Watch_t;
+
+		static inline bool IsIn(const Watch_t &w, float fPos) { return fPos >= w.fMin && fPos <= w.fMax; }
+
+		MotionSample_t m_sample;
+		std::vector<Watch_t> m_vWatches;
+};
@@ -23,6 +23,8 @@
 #pragma once
 
 #include "GLObj.h"
+#include "GLObjBatch.h"
+#include <algorithm> // for find
 #include <string>
 #include <vector>
 #include <map>
@@ -38,9 +40,17 @@ class OBJCollection
 
 		void Load()
 		{
+			vector<GLObj*> vAll;
 			for (auto it = m_mObjs.begin(); it!=m_mObjs.end(); it++)
 				for (auto it2 = it->second.begin(); it2!=it->second.end(); it2++)
-					(*it2)->Load();
+					if (find(vAll.begin(), vAll.end(), *it2) == vAll.end())
+						vAll.push_back(*it2);
+			GLObj::LoadAll(vAll);
+			// Everything drawn per class shares one transform, so it can be one buffer.
+			// Other is drawn object by object by the subclasses.
+			for (auto it = m_mObjs.begin(); it!=m_mObjs.end(); it++)
+				if (it->first != ObjClass::Other)
+					m_mBatches[it->first].Build(it->second);
 			OnLoadComplete();
 		};
 
@@ -62,12 +72,33 @@ class OBJCollection
 
 		inline void Draw(const ObjClass type)
 		{
-			if (m_mObjs.count(type)==0)
+			auto itBatch = m_mBatches.find(type);
+			if (itBatch != m_mBatches.end() && itBatch->second.IsBuilt())
+				return itBatch->second.Draw();
+			auto itObjs = m_mObjs.find(type);
+			if (itObjs == m_mObjs.end())
 				return;
+			for (auto pObj : itObjs->second)
+				pObj->Draw();
+		};
 
-			vector<GLObj*> vObj = m_mObjs.at(type);
-			for (auto it = vObj.begin(); it!=vObj.end(); it++)
-				(*it)->Draw();
+		// Draws the class once per offset (e.g. one per printer in the farm view), sharing the meshes.
+		inline void Draw(const ObjClass type, const float (*pOffsets)[3], size_t uiInstances)
+		{
+			auto itBatch = m_mBatches.find(type);
+			if (itBatch != m_mBatches.end() && itBatch->second.IsBuilt())
+				return itBatch->second.Draw(pOffsets, uiInstances);
+			auto itObjs = m_mObjs.find(type);
+			if (itObjs == m_mObjs.end())
+				return;
+			for (size_t i=0; i<uiInstances; i++)
+			{
+				glPushMatrix();
+					glTranslatef(pOffsets[i][0], pOffsets[i][1], pOffsets[i][2]);
+					for (auto pObj : itObjs->second)
+						pObj->Draw();
+				glPopMatrix();
+			}
 		};
 
 		virtual void GetBaseCenter(float fTrans[3])
@@ -125,5 +156,7 @@ class OBJCollection
 
 		string m_strName; // Collection name.
 
+		map<ObjClass,GLObjBatch> m_mBatches;
+
 
 };
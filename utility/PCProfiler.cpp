@@ -0,0 +1,156 @@
+/*
+	PCProfiler.cpp - Statistical profiler for the simulated MCU. Samples the PC
+	every N cycles on the AVR thread and symbolizes it against the firmware ELF
+	when the run ends.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PCProfiler.h"
+#include <stdio.h>               // for fprintf, printf, fopen, fclose
+#include <algorithm>             // for sort, upper_bound, min
+#include <map>                   // for map
+#include <utility>               // for pair
+#include "ELFSymbols.h"          // for ELFSymbols
+#include "sim_cycle_timers.h"    // for avr_cycle_timer_register, avr_cycle_timer_status
+#include "sim_interrupts.h"      // for avr_int_table_t, avr_int_vector_t
+
+constexpr unsigned int PCProfiler::m_uiMaxDepth;
+
+void PCProfiler::Init(avr_t *avr)
+{
+	m_pAVR = avr;
+	m_uiInterval = GetInterval();
+	m_vSamples.assign((avr->flashend + 1U)>>1U, 0);
+	m_vISRSamples.assign(m_vSamples.size(), 0);
+	Rearm();
+}
+
+void PCProfiler::Rearm()
+{
+	if (m_pAVR && m_uiInterval && !avr_cycle_timer_status(m_pAVR, OnSample, this))
+		avr_cycle_timer_register(m_pAVR, m_uiInterval, OnSample, this);
+}
+
+avr_cycle_count_t PCProfiler::OnSample(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	PCProfiler *p = static_cast<PCProfiler*>(param);
+	uint32_t uiWord = avr->pc>>1U;
+	if (uiWord < p->m_vSamples.size())
+	{
+		p->m_vSamples[uiWord]++;
+		p->m_uiTotal++;
+		uint8_t uiDepth = avr->interrupts.running_ptr;
+		if (uiDepth)
+		{
+			p->m_vISRSamples[uiWord]++;
+			uint64_t uiKey = 0;
+			for (unsigned int i=0; i<std::min<unsigned int>(uiDepth, m_uiMaxDepth); i++)
+				uiKey = (uiKey<<8U) | (avr->interrupts.running[i]->vector + 1U); // +1 so vector 0 still counts as a level.
+			p->m_mISRStacks[(uiKey<<24U) | uiWord]++;
+		}
+	}
+	return when + p->m_uiInterval;
+}
+
+void PCProfiler::AddSymbols(const std::string &strELF)
+{
+	std::vector<ELFSymbols::Symbol_t> vSyms;
+	if (!ELFSymbols::Read(strELF, vSyms))
+		return;
+	size_t uiBefore = m_vSymbols.size();
+	for (auto &sym : vSyms)
+		if (sym.bFunc && sym.uiAddr < ELFSymbols::m_uiDataOffset)
+			m_vSymbols.push_back({sym.uiAddr, sym.uiAddr + sym.uiSize, sym.strName});
+
+	std::sort(m_vSymbols.begin(), m_vSymbols.end(), [](const Symbol_t &a, const Symbol_t &b) { return a.uiStart < b.uiStart; });
+	// Zero-sized symbols (hand written asm) run up to the next one.
+	for (size_t i=0; i<m_vSymbols.size(); i++)
+		if (m_vSymbols[i].uiEnd == m_vSymbols[i].uiStart)
+			m_vSymbols[i].uiEnd = (i+1<m_vSymbols.size()) ? m_vSymbols[i+1].uiStart : m_vSymbols[i].uiStart + 2;
+	printf("Profiler: read %zu function symbols from %s\n", m_vSymbols.size() - uiBefore, strELF.c_str());
+}
+
+std::string PCProfiler::NameOf(uint32_t uiWord)
+{
+	avr_flashaddr_t uiAddr = uiWord<<1U;
+	auto it = std::upper_bound(m_vSymbols.begin(), m_vSymbols.end(), uiAddr, [](avr_flashaddr_t a, const Symbol_t &s) { return a < s.uiStart; });
+	if (it != m_vSymbols.begin() && uiAddr < (it-1)->uiEnd)
+		return (it-1)->strName;
+	char chrName[16];
+	snprintf(chrName, sizeof(chrName), "0x%05x", uiAddr & ~0xFFU);
+	return chrName;
+}
+
+void PCProfiler::Report(const std::string &strFile, const std::string &strTitle)
+{
+	if (!m_uiTotal)
+		return;
+	typedef struct Entry_t
+	{
+		uint64_t uiSelf = 0, uiISR = 0;
+	} Entry_t;
+	std::map<std::string, Entry_t> mFuncs;
+	std::map<std::string, uint64_t> mStacks;
+	uint64_t uiISR = 0;
+	for (uint32_t i=0; i<m_vSamples.size(); i++)
+	{
+		if (!m_vSamples[i])
+			continue;
+		std::string strName = NameOf(i);
+		Entry_t &entry = mFuncs[strName];
+		entry.uiSelf += m_vSamples[i];
+		entry.uiISR += m_vISRSamples[i];
+		uiISR += m_vISRSamples[i];
+		if (m_vSamples[i] > m_vISRSamples[i])
+			mStacks["main;" + strName] += m_vSamples[i] - m_vISRSamples[i];
+	}
+	for (auto &sample : m_mISRStacks)
+	{
+		std::string strStack;
+		for (uint64_t uiChain = sample.first>>24U; uiChain; uiChain >>= 8U)
+			strStack = "__vector_" + std::to_string((uiChain & 0xFFU) - 1U) + ";" + strStack;
+		mStacks[strStack + NameOf(sample.first & 0xFFFFFFU)] += sample.second;
+	}
+
+	std::vector<std::pair<std::string, Entry_t>> vSorted(mFuncs.begin(), mFuncs.end());
+	std::sort(vSorted.begin(), vSorted.end(), [](const std::pair<std::string, Entry_t> &a, const std::pair<std::string, Entry_t> &b) { return a.second.uiSelf > b.second.uiSelf; });
+
+	FILE *fOut = fopen((strFile + ".txt").c_str(), "w");
+	if (!fOut)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	fprintf(fOut, "PC profile of %s: %llu samples, one every %u cycles, %.2f%% in interrupts.\n\n", strTitle.c_str(), static_cast<unsigned long long>(m_uiTotal), m_uiInterval, (100.0*uiISR)/m_uiTotal);
+	fprintf(fOut, "%8s %10s %8s  %s\n", "Self%", "Samples", "In ISR", "Function");
+	for (auto &func : vSorted)
+		fprintf(fOut, "%7.2f%% %10llu %7.2f%%  %s\n", (100.0*func.second.uiSelf)/m_uiTotal, static_cast<unsigned long long>(func.second.uiSelf), (100.0*func.second.uiISR)/func.second.uiSelf, func.first.c_str());
+	fclose(fOut);
+
+	fOut = fopen((strFile + ".folded").c_str(), "w");
+	if (!fOut)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	for (auto &stack : mStacks)
+		fprintf(fOut, "%s %llu\n", stack.first.c_str(), static_cast<unsigned long long>(stack.second));
+	fclose(fOut);
+	printf("Wrote PC profile of %s (%llu samples) to %s.txt/.folded\n", strTitle.c_str(), static_cast<unsigned long long>(m_uiTotal), strFile.c_str());
+}
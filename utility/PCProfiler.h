@@ -0,0 +1,78 @@
+/*
+	PCProfiler.h - Statistical profiler for the simulated MCU. Samples the PC
+	every N cycles on the AVR thread and symbolizes it against the firmware ELF
+	when the run ends.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint64_t
+#include <string>              // for string
+#include <unordered_map>       // for unordered_map
+#include <vector>              // for vector
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t, avr_flashaddr_t
+
+class PCProfiler
+{
+	public:
+		// Set from the command line before the boards are created. 0 disables profiling.
+		static void SetDefaultInterval(uint32_t uiCycles) { GetInterval() = uiCycles; }
+		static inline bool IsEnabled() { return GetInterval()>0; }
+
+		// Starts sampling the default interval.
+		void Init(avr_t *avr);
+
+		// The sample timer is lost when the AVR resets, call after one to pick it up again.
+		void Rearm();
+
+		// Reads the function symbols from an ELF/AFX file. HEX files have none and are reported by address.
+		void AddSymbols(const std::string &strELF);
+
+		// Writes the flat per-function profile to strFile.txt and collapsed stacks
+		// (interrupt vectors;function, for flamegraph.pl) to strFile.folded.
+		void Report(const std::string &strFile, const std::string &strTitle);
+
+	private:
+		static uint32_t& GetInterval() { static uint32_t uiCycles = 0; return uiCycles; }
+
+		static avr_cycle_count_t OnSample(avr_t *avr, avr_cycle_count_t when, void *param);
+
+		typedef struct Symbol_t
+		{
+			avr_flashaddr_t uiStart, uiEnd; // Bytes, end is exclusive.
+			std::string strName;
+		} Symbol_t;
+
+		// Name of the function containing the flash word, or its 256 byte block if unknown.
+		std::string NameOf(uint32_t uiWord);
+
+		avr_t *m_pAVR = nullptr;
+		uint32_t m_uiInterval = 0;
+
+		std::vector<uint32_t> m_vSamples; // Per flash word, any context.
+		std::vector<uint32_t> m_vISRSamples; // Per flash word, while an interrupt was being serviced.
+		std::unordered_map<uint64_t, uint32_t> m_mISRStacks; // Running vectors (outermost first, a byte each) << 24 | word
+		uint64_t m_uiTotal = 0;
+
+		std::vector<Symbol_t> m_vSymbols; // Sorted by start.
+
+		static constexpr unsigned int m_uiMaxDepth = 4; // Nested vectors kept per sample (outermost first), deeper ones are left off.
+};
@@ -0,0 +1,122 @@
+/*
+	PNGWriter.cpp - Minimal dependency-free PNG encoder for RGB snapshots.
+	Compresses with fixed-Huffman deflate and run matches against the
+	previous pixel and row, which suits mostly-flat rendered images.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PNGWriter.h"
+#include <stdio.h>    // for fopen, fwrite, fclose, perror
+#include <algorithm>  // for min
+#include <cstring>    // for memcpy
+
+void PNGWriter::EncodeRows(const std::vector<uint8_t> &vIn, uint32_t uiRowBytes, Deflate::Bits_t &bits)
+{
+	bits.Put(1, 1); // Final block
+	bits.Put(1, 2); // Fixed Huffman
+	// Only two candidate distances: the previous pixel and the previous row. No hash chains needed.
+	const uint32_t uiDists[2] = {3, std::min<uint32_t>(uiRowBytes, 32768)};
+	size_t uiPos = 0;
+	while (uiPos < vIn.size())
+	{
+		uint32_t uiBestLen = 0, uiBestDist = 0;
+		size_t uiMax = std::min<size_t>(258, vIn.size() - uiPos);
+		for (auto uiDist : uiDists)
+		{
+			if (uiDist > uiPos)
+				continue;
+			uint32_t uiLen = 0;
+			while (uiLen < uiMax && vIn[uiPos + uiLen] == vIn[uiPos + uiLen - uiDist])
+				uiLen++;
+			if (uiLen > uiBestLen)
+			{
+				uiBestLen = uiLen;
+				uiBestDist = uiDist;
+			}
+		}
+		if (uiBestLen >= 3)
+		{
+			Deflate::PutMatch(bits, uiBestLen, uiBestDist);
+			uiPos += uiBestLen;
+		}
+		else
+			Deflate::PutLiteral(bits, vIn[uiPos++]);
+	}
+	Deflate::PutLiteral(bits, 256); // End of block
+	bits.Flush();
+}
+
+static void PutBE32(std::vector<uint8_t> &vOut, uint32_t uiVal)
+{
+	for (int i=3; i>=0; i--)
+		vOut.push_back((uiVal >> (8*i)) & 0xFF);
+}
+
+void PNGWriter::PutChunk(std::vector<uint8_t> &vFile, const char *pType, const std::vector<uint8_t> &vData)
+{
+	PutBE32(vFile, vData.size());
+	size_t uiStart = vFile.size();
+	vFile.insert(vFile.end(), pType, pType + 4);
+	vFile.insert(vFile.end(), vData.begin(), vData.end());
+	PutBE32(vFile, Deflate::CRC(&vFile[uiStart], vFile.size() - uiStart));
+}
+
+bool PNGWriter::Write(const std::string &strFile, uint32_t uiW, uint32_t uiH, const std::vector<uint8_t> &vRGB)
+{
+	// Filter type 0 (none) on every row.
+	uint32_t uiRowBytes = 1 + uiW*3;
+	std::vector<uint8_t> vRaw(uiRowBytes * uiH);
+	for (uint32_t y=0; y<uiH; y++)
+	{
+		vRaw[y*uiRowBytes] = 0;
+		memcpy(&vRaw[y*uiRowBytes + 1], &vRGB[y*uiW*3], uiW*3);
+	}
+
+	std::vector<uint8_t> vFile = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	std::vector<uint8_t> vHdr;
+	PutBE32(vHdr, uiW);
+	PutBE32(vHdr, uiH);
+	vHdr.insert(vHdr.end(), {8, 2, 0, 0, 0}); // 8 bit, RGB, deflate, adaptive filtering, no interlace
+	PutChunk(vFile, "IHDR", vHdr);
+
+	Deflate::Bits_t bits;
+	bits.vOut = {0x78, 0x01}; // zlib header, 32K window
+	EncodeRows(vRaw, uiRowBytes, bits);
+	uint32_t uiA = 1, uiB = 0; // Adler-32
+	for (auto c : vRaw)
+	{
+		uiA = (uiA + c) % 65521;
+		uiB = (uiB + uiA) % 65521;
+	}
+	PutBE32(bits.vOut, (uiB << 16) | uiA);
+	PutChunk(vFile, "IDAT", bits.vOut);
+	PutChunk(vFile, "IEND", {});
+
+	FILE *fp = fopen(strFile.c_str(), "wb");
+	if (!fp)
+	{
+		perror(strFile.c_str());
+		return false;
+	}
+	bool bOK = fwrite(vFile.data(), 1, vFile.size(), fp) == vFile.size();
+	bOK &= fclose(fp) == 0;
+	if (!bOK)
+		perror(strFile.c_str());
+	return bOK;
+}
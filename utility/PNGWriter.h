@@ -0,0 +1,41 @@
+/*
+	PNGWriter.h - Minimal dependency-free PNG encoder for RGB snapshots.
+	Compresses with fixed-Huffman deflate and run matches against the
+	previous pixel and row, which suits mostly-flat rendered images.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>   // for uint32_t, uint8_t
+#include <string>     // for string
+#include <vector>     // for vector
+#include "Deflate.h"  // for Deflate, Deflate::Bits_t
+
+class PNGWriter
+{
+	public:
+		// Writes a 24-bit RGB image (rows top to bottom, no padding). Returns false on I/O failure.
+		static bool Write(const std::string &strFile, uint32_t uiW, uint32_t uiH, const std::vector<uint8_t> &vRGB);
+
+	private:
+		// Deflate with only two candidate matches, the previous pixel and the previous row.
+		static void EncodeRows(const std::vector<uint8_t> &vIn, uint32_t uiRowBytes, Deflate::Bits_t &bits);
+		static void PutChunk(std::vector<uint8_t> &vFile, const char *pType, const std::vector<uint8_t> &vData);
+};
@@ -0,0 +1,214 @@
+/*
+	ParallelReplay.cpp - Replays a long run's segments in parallel, from checkpoints of a scouting pass.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ParallelReplay.h"
+#include <errno.h>          // for errno, EINTR, EEXIST
+#include <fcntl.h>          // for open, O_CREAT, O_TRUNC, O_WRONLY
+#include <stdio.h>          // for printf, fprintf, perror, fflush, fopen
+#include <sys/stat.h>       // for mkdir
+#include <sys/wait.h>       // for waitpid, WIFEXITED, WEXITSTATUS, WTERMSIG
+#include <unistd.h>         // for fork, dup2, chdir, close, _exit
+#include <string>           // for string, to_string
+#include "Board.h"          // for Board
+#include "ForkServer.h"     // for ForkServer
+#include "Log.h"            // for Log
+#include "TelemetryHost.h"  // for TelemetryHost
+
+unsigned int ParallelReplay::m_uiJobs = 0;
+bool ParallelReplay::m_bTrace = false;
+bool ParallelReplay::m_bInSegment = false;
+unsigned int ParallelReplay::m_uiSegment = 0;
+std::map<avr_cycle_count_t, uint64_t> ParallelReplay::m_mHashes;
+std::map<pid_t, ParallelReplay::Segment_t> ParallelReplay::m_mRunning;
+std::map<unsigned int, ParallelReplay::Segment_t> ParallelReplay::m_mDone;
+
+static std::string GetSegmentDir(unsigned int uiIndex)
+{
+	return "segment_" + std::to_string(uiIndex);
+}
+
+uint64_t ParallelReplay::Hash(const Snapshot &snap)
+{
+	// FNV-1a, over the keys too so a part that stopped saving something doesn't go unnoticed.
+	uint64_t uiHash = 0xcbf29ce484222325ULL;
+	auto fcnAdd = [&uiHash](const uint8_t *p, size_t uiLen)
+	{
+		for (size_t i=0; i<uiLen; i++)
+			uiHash = (uiHash ^ p[i]) * 0x100000001b3ULL;
+	};
+	for (auto &it : snap.GetData())
+	{
+		fcnAdd(reinterpret_cast<const uint8_t*>(it.first.c_str()), it.first.size() + 1);
+		fcnAdd(it.second.data(), it.second.size());
+	}
+	return uiHash;
+}
+
+void ParallelReplay::OnCheckpoint(Boards::Board *pBoard, const Snapshot &snap)
+{
+	avr_cycle_count_t uiCycle = pBoard->GetAVR()->cycle;
+	if (m_bInSegment)
+		EndSegment(uiCycle, snap);
+	m_mHashes[uiCycle] = Hash(snap);
+	Reap(false);
+	while (m_mRunning.size() >= m_uiJobs)
+		Reap(true);
+	StartSegment(pBoard, uiCycle);
+}
+
+void ParallelReplay::OnFinish(const Snapshot &snap)
+{
+	avr_cycle_count_t uiCycle = 0;
+	snap.Get("AVR/cycle", uiCycle);
+	if (m_bInSegment)
+		EndSegment(uiCycle, snap);
+	m_mHashes[uiCycle] = Hash(snap);
+	printf("ParallelReplay: Scout finished at cycle %llu after %u segment(s)\n", static_cast<unsigned long long>(uiCycle), m_uiSegment);
+}
+
+static void RedirectTo(const std::string &strFile, int fdTarget)
+{
+	int fd = open(strFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(strFile.c_str());
+		return;
+	}
+	dup2(fd, fdTarget);
+	close(fd);
+}
+
+void ParallelReplay::StartSegment(Boards::Board *pBoard, avr_cycle_count_t uiStart)
+{
+	Segment_t segment {m_uiSegment++, uiStart, -1};
+	std::string strDir = GetSegmentDir(segment.uiIndex);
+	if (mkdir(strDir.c_str(), 0755) < 0 && errno != EEXIST)
+	{
+		perror(strDir.c_str());
+		return;
+	}
+	Log::Stop(); // Its thread wouldn't survive the fork.
+	fflush(nullptr); // Or the copy will write out our buffered output again.
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		m_bInSegment = true;
+		m_uiSegment = segment.uiIndex;
+		m_mRunning.clear();
+		RedirectTo(strDir + "/MK404.out", STDOUT_FILENO);
+		RedirectTo(strDir + "/MK404.err", STDERR_FILENO);
+		Log::Start();
+		// Before anything gets the chance to write to them.
+		ForkServer::PrivatizeMappings();
+		pBoard->DetachStorage();
+		if (chdir(strDir.c_str()) < 0)
+		{
+			perror(strDir.c_str());
+			_exit(1);
+		}
+		printf("ParallelReplay: Segment %u, from cycle %llu\n", segment.uiIndex, static_cast<unsigned long long>(uiStart));
+		if (m_bTrace)
+			TelemetryHost::GetHost()->StartTrace(); // Files are opened here, so in the segment's directory.
+		return;
+	}
+	Log::Start();
+	if (pid < 0)
+	{
+		perror("ParallelReplay: fork");
+		m_uiSegment--;
+		return;
+	}
+	m_mRunning[pid] = segment;
+}
+
+void ParallelReplay::EndSegment(avr_cycle_count_t uiCycle, const Snapshot &snap)
+{
+	FILE *fResult = fopen("result", "w");
+	if (fResult)
+	{
+		fprintf(fResult, "%llu %016llx\n", static_cast<unsigned long long>(uiCycle), static_cast<unsigned long long>(Hash(snap)));
+		fclose(fResult);
+	}
+	else
+		perror("result");
+	TelemetryHost::GetHost()->Shutdown();
+	printf("ParallelReplay: Segment %u ended at cycle %llu\n", m_uiSegment, static_cast<unsigned long long>(uiCycle));
+	Log::Stop();
+	fflush(nullptr);
+	// Skip the destructors, they'd be tearing down the scout's state (threads, files) that we only have a copy of.
+	_exit(fResult ? 0 : 1);
+}
+
+void ParallelReplay::Reap(bool bBlock)
+{
+	while (!m_mRunning.empty())
+	{
+		int iStatus = 0;
+		pid_t pid = waitpid(-1, &iStatus, bBlock ? 0 : WNOHANG);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid <= 0)
+			return;
+		auto it = m_mRunning.find(pid);
+		if (it == m_mRunning.end())
+			continue;
+		it->second.iExit = WIFEXITED(iStatus) ? WEXITSTATUS(iStatus) : 128 + WTERMSIG(iStatus);
+		m_mDone[it->second.uiIndex] = it->second;
+		m_mRunning.erase(it);
+		if (bBlock)
+			return; // Only the one slot was wanted.
+	}
+}
+
+int ParallelReplay::Finish()
+{
+	if (!IsEnabled() || m_bInSegment)
+		return 0;
+	printf("ParallelReplay: Waiting for %zu segment(s)...\n", m_mRunning.size());
+	while (!m_mRunning.empty())
+		Reap(true);
+	unsigned int uiBad = 0;
+	for (auto &it : m_mDone)
+	{
+		const Segment_t &segment = it.second;
+		std::string strResult = GetSegmentDir(segment.uiIndex) + "/result";
+		unsigned long long uiCycle = 0, uiHash = 0;
+		FILE *fResult = fopen(strResult.c_str(), "r");
+		bool bRead = fResult && fscanf(fResult, "%llu %llx", &uiCycle, &uiHash) == 2;
+		if (fResult)
+			fclose(fResult);
+		auto itHash = m_mHashes.find(uiCycle);
+		if (segment.iExit != 0 || !bRead)
+			fprintf(stderr, "ParallelReplay: Segment %u (from cycle %llu) FAILED, exit code %d\n", segment.uiIndex,
+				static_cast<unsigned long long>(segment.uiStart), segment.iExit);
+		else if (itHash == m_mHashes.end())
+			fprintf(stderr, "ParallelReplay: Segment %u (from cycle %llu) DIVERGED, it ended at cycle %llu where the scout had no checkpoint\n",
+				segment.uiIndex, static_cast<unsigned long long>(segment.uiStart), uiCycle);
+		else if (itHash->second != uiHash)
+			fprintf(stderr, "ParallelReplay: Segment %u (from cycle %llu) DIVERGED, its state at cycle %llu doesn't match the scout's\n",
+				segment.uiIndex, static_cast<unsigned long long>(segment.uiStart), uiCycle);
+		else
+			continue;
+		uiBad++;
+	}
+	printf("ParallelReplay: %zu of %zu segment(s) matched the scout\n", m_mDone.size() - uiBad, m_mDone.size());
+	return uiBad ? 1 : 0;
+}
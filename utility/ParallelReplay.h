@@ -0,0 +1,81 @@
+/*
+	ParallelReplay.h - Replays a long run's segments in parallel, from checkpoints of a scouting pass.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>         // for uint64_t
+#include <sys/types.h>      // for pid_t
+#include <map>              // for map
+#include "Snapshot.h"       // for Snapshot
+#include "sim_avr_types.h"  // for avr_cycle_count_t
+
+namespace Boards
+{
+	class Board;
+}
+
+// A snapshot holds live pointers (timers, interrupt vectors), so it can't be taken from one
+// process and loaded into another. Instead the board replays without tracing as a scout, and at
+// each --checkpoint-ms checkpoint forks a copy of itself that carries on from there, with the trace
+// running, only as far as the next checkpoint. That copy hashes its state there (or where the run
+// ended) and the scout's own hash of the same checkpoint has to match, or tracing has disturbed
+// the replay. Segment N writes its output, trace and result into segment_<N>/.
+// Up to m_uiJobs copies run at once, the scout waits for one to finish before it forks another.
+// The board must be the only one in the process, with no other host threads (see ForkServer),
+// so it has no serial PTYs either.
+class ParallelReplay
+{
+	public:
+		// uiJobs segments at a time, 0 is off. bTrace starts the -t trace in each one.
+		static void SetDefaults(unsigned int uiJobs, bool bTrace) { m_uiJobs = uiJobs; m_bTrace = bTrace; }
+		static inline bool IsEnabled() { return m_uiJobs != 0; }
+
+		// The board's, on its AVR thread. Forks a segment from the scout, or ends a segment.
+		static void OnCheckpoint(Boards::Board *pBoard, const Snapshot &snap);
+		// The board's, when its run loop ends.
+		static void OnFinish(const Snapshot &snap);
+
+		// Waits for the outstanding segments and checks them all against the scout.
+		// Returns 0 if every one matched, 1 otherwise.
+		static int Finish();
+
+	private:
+		typedef struct Segment_t
+		{
+			unsigned int uiIndex;
+			avr_cycle_count_t uiStart;
+			int iExit;
+		} Segment_t;
+
+		static uint64_t Hash(const Snapshot &snap);
+		// Reaps finished segments, waiting for one if bBlock.
+		static void Reap(bool bBlock);
+		static void StartSegment(Boards::Board *pBoard, avr_cycle_count_t uiStart);
+		[[noreturn]] static void EndSegment(avr_cycle_count_t uiCycle, const Snapshot &snap);
+
+		static unsigned int m_uiJobs;
+		static bool m_bTrace;
+		static bool m_bInSegment; // In a forked copy, as opposed to the scout.
+		static unsigned int m_uiSegment; // Count so far in the scout, this one's in a copy
+		static std::map<avr_cycle_count_t, uint64_t> m_mHashes; // The scout's, at each checkpoint and the end
+		static std::map<pid_t, Segment_t> m_mRunning;
+		static std::map<unsigned int, Segment_t> m_mDone;
+};
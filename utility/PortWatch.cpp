@@ -0,0 +1,101 @@
+/*
+	PortWatch.cpp - Per-AVR hooks on the PORTx registers, one callback per write for all its bits.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PortWatch.h"
+#include <string.h>      // for strcmp
+#include <map>           // for map
+#include <mutex>         // for mutex, lock_guard
+
+PortWatch& PortWatch::Get(avr_t *avr)
+{
+	static std::mutex lock;
+	static std::map<avr_t*, std::unique_ptr<PortWatch>> mWatches;
+	std::lock_guard<std::mutex> guard(lock);
+	std::unique_ptr<PortWatch> &pWatch = mWatches[avr];
+	if (!pWatch)
+		pWatch.reset(new PortWatch(avr));
+	return *pWatch;
+}
+
+avr_ioport_t* PortWatch::FindIOPort(char cPort)
+{
+	for (avr_io_t *pIO = m_pAVR->io_port; pIO; pIO = pIO->next)
+		if (!strcmp(pIO->kind, "port") && reinterpret_cast<avr_ioport_t*>(pIO)->name == cPort)
+			return reinterpret_cast<avr_ioport_t*>(pIO); // io is its first member.
+	return nullptr;
+}
+
+PortWatch::Port_t* PortWatch::FindPort(char cPort)
+{
+	for (auto &pPort : m_vPorts)
+		if (pPort->cPort == cPort)
+			return pPort.get();
+	return nullptr;
+}
+
+bool PortWatch::HasPort(char cPort)
+{
+	return FindIOPort(cPort) != nullptr;
+}
+
+bool PortWatch::Watch(char cPort, uint8_t uiMask, Hook_t fcnHook, void *param)
+{
+	Port_t *pPort = FindPort(cPort);
+	if (!pPort)
+	{
+		avr_ioport_t *pIOPort = FindIOPort(cPort);
+		if (!pIOPort)
+			return false;
+		m_vPorts.emplace_back(new Port_t {cPort, pIOPort->r_port, m_pAVR->data[pIOPort->r_port], {}});
+		pPort = m_vPorts.back().get();
+		// Both share the port's handlers rather than replacing them; a PINx write toggles PORTx.
+		avr_register_io_write(m_pAVR, pIOPort->r_port, OnWrite, pPort);
+		if (pIOPort->r_pin)
+			avr_register_io_write(m_pAVR, pIOPort->r_pin, OnWrite, pPort);
+	}
+	pPort->vWatchers.push_back({uiMask, fcnHook, param});
+	return true;
+}
+
+uint8_t PortWatch::GetValue(char cPort)
+{
+	if (Port_t *pPort = FindPort(cPort))
+		return pPort->uiValue;
+	avr_ioport_t *pIOPort = FindIOPort(cPort);
+	return pIOPort ? m_pAVR->data[pIOPort->r_port] : 0;
+}
+
+void PortWatch::OnWrite(avr_t *avr, avr_io_addr_t addr, uint8_t value, void *param)
+{
+	Port_t *pPort = static_cast<Port_t*>(param);
+	uint8_t uiNew = avr->data[pPort->uiPort];
+	uint8_t uiChanged = uiNew ^ pPort->uiValue;
+	if (!uiChanged)
+		return;
+	Write_t write {pPort->uiValue, uiNew, 0};
+	pPort->uiValue = uiNew;
+	for (auto &watcher : pPort->vWatchers)
+	{
+		write.uiMask = uiChanged & watcher.uiMask;
+		if (write.uiMask)
+			watcher.fcnHook(pPort->cPort, write, watcher.param);
+	}
+}
@@ -0,0 +1,99 @@
+/*
+	PortWatch.h - Per-AVR hooks on the PORTx registers, one callback per write for all its bits.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>        // for uint8_t
+#include <memory>          // for unique_ptr
+#include <vector>          // for vector
+#include "IRQBinding.h"    // for IRQBINDING_SCOPE
+#include "avr_ioport.h"    // for avr_ioport_t
+#include "sim_avr.h"       // for avr_t
+#include "sim_io.h"        // for avr_io_addr_t
+
+// Binds a member void F(char cPort, const PortWatch::Write_t &write) for PortWatch::Watch.
+#define MAKE_C_PORT_CALLBACK(class, function) \
+   (&PortWatch::Bind<class, decltype(&class::function), &class::function>)
+
+// A PORT write that flips several pins goes out as one pin IRQ (and notify chain) per bit. Parts
+// with a bus on a port (an LCD's data lines, bit-banged I2C) can watch the register instead and
+// get the whole write at once. There is a single io write hook per port however many parts watch
+// it, which also catches toggles through PINx. Each watcher gives a mask, and is only called when
+// one of its bits actually changed.
+class PortWatch
+{
+	public:
+		typedef struct Write_t
+		{
+			uint8_t uiOld;  // PORTx after the previous write
+			uint8_t uiNew;
+			uint8_t uiMask; // Changed bits, of those the watcher asked for
+		} Write_t;
+
+		typedef void (*Hook_t)(char cPort, const Write_t &write, void *param);
+
+		// One per AVR. Boards are wired up on the main thread and their AVRs live until exit.
+		static PortWatch& Get(avr_t *avr);
+
+		bool HasPort(char cPort);
+
+		// Calls fcnHook(cPort, write, param) after each PORTx write that changes any of uiMask.
+		// Returns false if the MCU has no PORTx.
+		bool Watch(char cPort, uint8_t uiMask, Hook_t fcnHook, void *param);
+
+		// PORTx as of the last write, for a watcher to start from. 0 if there is no such port.
+		uint8_t GetValue(char cPort);
+
+		template<class C, typename M, M F>
+		static void Bind(char cPort, const Write_t &write, void *param)
+		{
+			using namespace IRQBinding; // For the stats in debug builds.
+			IRQBINDING_SCOPE();
+			(static_cast<C*>(param)->*F)(cPort, write);
+		}
+
+	private:
+		explicit PortWatch(avr_t *avr):m_pAVR(avr){};
+
+		typedef struct Watcher_t
+		{
+			uint8_t uiMask;
+			Hook_t fcnHook;
+			void *param;
+		} Watcher_t;
+
+		typedef struct Port_t
+		{
+			char cPort;
+			avr_io_addr_t uiPort;
+			uint8_t uiValue;
+			std::vector<Watcher_t> vWatchers;
+		} Port_t;
+
+		// Chained after the port's own handler, so PORTx already holds the new value.
+		static void OnWrite(avr_t *avr, avr_io_addr_t addr, uint8_t value, void *param);
+
+		avr_ioport_t* FindIOPort(char cPort);
+		Port_t* FindPort(char cPort); // Only the watched ones
+
+		avr_t *m_pAVR;
+		std::vector<std::unique_ptr<Port_t>> m_vPorts; // The io hooks keep pointers to these.
+};
@@ -0,0 +1,211 @@
+/*
+	PrintCapture.cpp - Writes PNG snapshots of the simulated print (top and front
+	views) without a GL context, so it also works in --headless runs. Snapshots
+	are taken every N ms of simulated time and/or by script action, and are
+	rendered on their own thread from the lock-free GLPrint geometry.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "PrintCapture.h"
+#include <errno.h>       // for errno, EEXIST
+#include <stdio.h>       // for printf, fprintf, snprintf, perror, stderr
+#include <sys/stat.h>    // for mkdir
+#include <unistd.h>      // for usleep
+#include <algorithm>     // for max, fill
+#include <cmath>         // for fabs
+#include "PNGWriter.h"   // for PNGWriter
+#include "ThreadPolicy.h" // for ThreadPolicy
+
+void PrintCapture::SetDefaults(const std::string &strDir, uint32_t uiIntervalMs)
+{
+	GetDir() = strDir;
+	GetInterval() = uiIntervalMs;
+	if (!strDir.empty() && mkdir(strDir.c_str(), 0755) && errno != EEXIST)
+		perror(strDir.c_str());
+}
+
+PrintCapture::PrintCapture():Scriptable("Capture")
+{
+	RegisterActionAndMenu("Capture", "Writes a PNG snapshot of the print to the capture directory", ActCapture);
+	RegisterAction("CaptureAs", "Writes a PNG snapshot of the print with the given name (without .png)", ActCaptureAs, {ArgType::String});
+}
+
+PrintCapture::~PrintCapture()
+{
+	if (!m_thread)
+		return;
+	if (m_bMoved)
+		Request(m_strPrefix + "_final");
+	m_bQuit = true;
+	pthread_join(m_thread, nullptr);
+}
+
+void PrintCapture::Init(avr_t *avr, const std::string &strPrefix)
+{
+	_Init(avr, this);
+	m_strPrefix = strPrefix;
+
+	RegisterNotify(X_IN, MAKE_C_CALLBACK(PrintCapture, OnXChanged), this);
+	RegisterNotify(Y_IN, MAKE_C_CALLBACK(PrintCapture, OnYChanged), this);
+	RegisterNotify(Z_IN, MAKE_C_CALLBACK(PrintCapture, OnZChanged), this);
+	RegisterNotify(E_IN, MAKE_C_CALLBACK(PrintCapture, OnEChanged), this);
+
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "capture"); PrintCapture *p = static_cast<PrintCapture*>(param); return p->Run(); };
+	pthread_create(&m_thread, nullptr, fcnRun, this);
+
+	if (GetInterval())
+		RegisterTimerUsec(m_fcnCapture, GetInterval()*1000U, this);
+	printf("Capturing print snapshots to %s/%s_*.png\n", GetDir().c_str(), m_strPrefix.c_str());
+}
+
+Scriptable::LineStatus PrintCapture::ProcessAction(unsigned int iAct, const vector<string> &vArgs)
+{
+	switch (iAct)
+	{
+		case ActCapture:
+			Request("");
+			return LineStatus::Finished;
+		case ActCaptureAs:
+			Request(vArgs.at(0));
+			return LineStatus::Finished;
+	}
+	return LineStatus::Unhandled;
+}
+
+// Positions come in as floats in mm, mangled into the IRQ value.
+void PrintCapture::OnXChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_fX = reinterpret_cast<float*>(&value)[0]/1000.f;
+}
+
+void PrintCapture::OnYChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_fY = reinterpret_cast<float*>(&value)[0]/1000.f;
+}
+
+void PrintCapture::OnZChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_fZ = reinterpret_cast<float*>(&value)[0]/1000.f;
+}
+
+void PrintCapture::OnEChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_print.NewCoord(m_fX, m_fY, m_fZ, reinterpret_cast<float*>(&value)[0]/1000.f);
+	m_bMoved = true;
+}
+
+avr_cycle_count_t PrintCapture::OnCaptureTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	if (m_bMoved) // Nothing to see before the first extrusion.
+		Request("");
+	RegisterTimerUsec(m_fcnCapture, GetInterval()*1000U, this);
+	return 0;
+}
+
+void PrintCapture::Request(const std::string &strName)
+{
+	std::string strFile = strName;
+	if (strFile.empty())
+	{
+		char chrNum[16];
+		snprintf(chrNum, sizeof(chrNum), "_%05u", ++m_uiCount);
+		strFile = m_strPrefix + chrNum;
+	}
+	if (!m_requests.Push(GetDir() + "/" + strFile + ".png"))
+		fprintf(stderr, "PrintCapture: Renderer is behind, skipped %s\n", strFile.c_str());
+}
+
+void* PrintCapture::Run()
+{
+	std::string strFile;
+	while (true)
+	{
+		if (m_requests.Pop(strFile))
+			Render(strFile);
+		else if (m_bQuit)
+			break;
+		else
+			usleep(m_uiPollMs*1000);
+	}
+	return nullptr;
+}
+
+void PrintCapture::Plot(int iX, int iY, float fDepth, bool bNearerIsLess, const uint8_t col[3])
+{
+	if (iX<0 || iY<0 || static_cast<uint32_t>(iX)>=m_uiW || static_cast<uint32_t>(iY)>=m_uiH)
+		return;
+	float &fOld = m_vDepth[iY*m_uiW + iX];
+	if (bNearerIsLess ? fDepth >= fOld : fDepth <= fOld)
+		return;
+	fOld = fDepth;
+	std::copy(col, col+3, &m_vImage[(iY*m_uiW + iX)*3]);
+}
+
+void PrintCapture::Render(const std::string &strFile)
+{
+	// Left: top view, front of the bed at the bottom. Right: front view, Z up.
+	uint32_t uiPanelW = m_fXMax*m_uiPxPerMm;
+	uint32_t uiTopH = (m_fYMax - m_fYMin)*m_uiPxPerMm, uiFrontH = m_fZMax*m_uiPxPerMm;
+	m_uiW = 2*uiPanelW + m_uiGap;
+	m_uiH = std::max(uiTopH, uiFrontH);
+	m_vImage.assign(m_uiW*m_uiH*3, 40);
+	for (uint32_t y=0; y<uiTopH; y++)
+		std::fill(&m_vImage[y*m_uiW*3], &m_vImage[(y*m_uiW + uiPanelW)*3], 64); // Bed
+	m_vDepth.assign(m_uiW*m_uiH, -1.f); // Top view keeps the highest
+	for (uint32_t y=0; y<m_uiH; y++)
+		std::fill(&m_vDepth[y*m_uiW + uiPanelW], &m_vDepth[(y+1)*m_uiW], 1e9f); // Front view keeps the nearest (smallest Y)
+
+	float fTopZ = 0.001f;
+	m_print.VisitStrips([&fTopZ](const float *pfPos, int iCount)
+	{
+		for (int i=0; i<iCount; i++)
+			fTopZ = std::max(fTopZ, pfPos[i*3 + 1]*1000.f);
+	});
+
+	const float fScale = m_uiPxPerMm;
+	m_print.VisitStrips([&](const float *pfPos, int iCount)
+	{
+		for (int i=1; i<iCount; i++)
+		{
+			const float *pA = &pfPos[(i-1)*3], *pB = &pfPos[i*3];
+			float fZ = pB[1]*1000.f, fY = pB[2]*1000.f;
+			// Shade by height from above and by distance from the front.
+			uint8_t uiTop = 90 + 165*std::min(1.f, fZ/fTopZ);
+			uint8_t uiFront = 255 - 165*std::min(1.f, std::max(0.f, (fY - m_fYMin)/(m_fYMax - m_fYMin)));
+			const uint8_t colTop[3] = {uiTop, static_cast<uint8_t>(uiTop/2), 0}, colFront[3] = {uiFront, static_cast<uint8_t>(uiFront/2), 0};
+			float fDX = (pB[0] - pA[0])*1000.f*fScale, fDY = (pB[2] - pA[2])*1000.f*fScale, fDZ = (pB[1] - pA[1])*1000.f*fScale;
+			int iSteps = std::max(1.f, std::max(fabs(fDX), std::max(fabs(fDY), fabs(fDZ))));
+			for (int s=0; s<=iSteps; s++)
+			{
+				float f = static_cast<float>(s)/iSteps;
+				float fX = (pA[0]*1000.f*fScale) + f*fDX;
+				float fPY = (m_fYMax - pA[2]*1000.f)*fScale - f*fDY;
+				float fPZ = (m_fZMax - pA[1]*1000.f)*fScale - f*fDZ;
+				float fYmm = (pA[2] + f*(pB[2]-pA[2]))*1000.f;
+				if (fX < 0 || fX >= uiPanelW) // Keep off the other panel.
+					continue;
+				Plot(static_cast<int>(fX), static_cast<int>(fPY), fZ, false, colTop);
+				Plot(static_cast<int>(fX) + uiPanelW + m_uiGap, static_cast<int>(fPZ), fYmm, true, colFront);
+			}
+		}
+	});
+
+	if (PNGWriter::Write(strFile, m_uiW, m_uiH, m_vImage))
+		printf("Wrote print snapshot %s\n", strFile.c_str());
+}
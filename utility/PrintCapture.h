@@ -0,0 +1,106 @@
+/*
+	PrintCapture.h - Writes PNG snapshots of the simulated print (top and front
+	views) without a GL context, so it also works in --headless runs. Snapshots
+	are taken every N ms of simulated time and/or by script action, and are
+	rendered on their own thread from the lock-free GLPrint geometry.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>           // for pthread_t
+#include <stdint.h>            // for uint32_t, uint8_t
+#include <atomic>              // for atomic, atomic_bool
+#include <string>              // for string
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "GLPrint.h"           // for GLPrint
+#include "IScriptable.h"       // for IScriptable::LineStatus
+#include "SPSCRing.h"          // for SPSCRing
+#include "Scriptable.h"        // for Scriptable
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+class PrintCapture: public BasePeripheral, public Scriptable
+{
+	public:
+		#define IRQPAIRS _IRQ(X_IN,"<x.in") _IRQ(Y_IN,"<y.in") _IRQ(Z_IN,"<z.in") _IRQ(E_IN,"<e.in")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the printers are created. An empty directory disables capture.
+		static void SetDefaults(const std::string &strDir, uint32_t uiIntervalMs);
+		static bool IsEnabled() { return !GetDir().empty(); }
+
+		PrintCapture();
+		// Writes a last snapshot of the finished print.
+		~PrintCapture();
+
+		// strPrefix names the files, e.g. "print" gives print_00001.png.
+		void Init(avr_t *avr, const std::string &strPrefix);
+
+	protected:
+		LineStatus ProcessAction(unsigned int iAct, const vector<string> &vArgs) override;
+
+	private:
+		void OnXChanged(avr_irq_t *irq, uint32_t value);
+		void OnYChanged(avr_irq_t *irq, uint32_t value);
+		void OnZChanged(avr_irq_t *irq, uint32_t value);
+		void OnEChanged(avr_irq_t *irq, uint32_t value);
+
+		avr_cycle_count_t OnCaptureTimer(avr_t *avr, avr_cycle_count_t when);
+
+		// AVR thread: queues a snapshot, never waits for the renderer.
+		void Request(const std::string &strName);
+
+		void* Run();
+		void Render(const std::string &strFile);
+		void Plot(int iX, int iY, float fDepth, bool bNearerIsLess, const uint8_t col[3]);
+
+		static std::string& GetDir() { static std::string strDir; return strDir; }
+		static uint32_t& GetInterval() { static uint32_t uiMs = 0; return uiMs; }
+
+		enum Actions
+		{
+			ActCapture,
+			ActCaptureAs
+		};
+
+		GLPrint m_print {1.f, 0.5f, 0.f}; // Never drawn, only read back by the renderer.
+		float m_fX = 0, m_fY = 0, m_fZ = 0;
+		bool m_bMoved = false;
+
+		std::string m_strPrefix = "print";
+		uint32_t m_uiCount = 0;
+		SPSCRing<std::string> m_requests {16};
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+
+		// Render thread only.
+		uint32_t m_uiW = 0, m_uiH = 0;
+		std::vector<uint8_t> m_vImage;
+		std::vector<float> m_vDepth;
+
+		avr_cycle_timer_t m_fcnCapture = MAKE_C_TIMER_CALLBACK(PrintCapture, OnCaptureTimer);
+
+		// Bed area shown, in mm, and the image scale.
+		static constexpr float m_fXMax = 255.f, m_fYMin = -5.f, m_fYMax = 215.f, m_fZMax = 210.f;
+		static constexpr uint32_t m_uiPxPerMm = 2, m_uiGap = 10, m_uiPollMs = 20;
+};
@@ -0,0 +1,47 @@
+/*
+	RedrawFlag.h - Process-wide "something on screen changed" flag. Parts set it
+	from whichever thread changes their visible state, and the GUI timer only
+	renders a frame when it was set.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>  // for atomic_bool, memory_order_relaxed
+
+class RedrawFlag
+{
+	public:
+		// Cheap enough for per-step callers: the line is only written when the flag actually flips.
+		static inline void Set()
+		{
+			if (!Flag().load(std::memory_order_relaxed))
+				Flag().store(true, std::memory_order_relaxed);
+		}
+
+		// GUI thread: returns whether a redraw was requested, and clears it.
+		static inline bool Take() { return Flag().exchange(false, std::memory_order_relaxed); }
+
+	private:
+		static std::atomic_bool& Flag()
+		{
+			static std::atomic_bool bFlag {true};
+			return bFlag;
+		}
+};
@@ -0,0 +1,384 @@
+/*
+	RemoteControl.cpp - Drives a running printer over a socket: script lines
+	as commands, and a stream of subscribed telemetry values back.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RemoteControl.h"
+#include <arpa/inet.h>    // for htonl, htons
+#include <errno.h>        // for errno, EAGAIN, EWOULDBLOCK
+#include <fcntl.h>        // for fcntl, F_GETFL, F_SETFL, O_NONBLOCK
+#include <netinet/in.h>   // for sockaddr_in, INADDR_LOOPBACK
+#include <poll.h>         // for poll, pollfd, POLLIN, POLLOUT
+#include <signal.h>       // for signal, SIGPIPE, SIG_IGN
+#include <stdio.h>        // for printf, fprintf, perror, snprintf
+#include <stdlib.h>       // for atoi
+#include <sys/socket.h>   // for socket, bind, listen, accept, recv, send
+#include <sys/un.h>       // for sockaddr_un
+#include <unistd.h>       // for close, unlink
+#include <cstring>        // for memcpy, strncpy
+#include <map>            // for map
+#include <sstream>        // for istringstream
+#include <utility>        // for pair
+#include "ThreadPolicy.h" // for ThreadPolicy
+
+RemoteControl::RemoteControl(const std::string &strAddr):m_strAddr(strAddr),m_pScriptHost(ScriptHost::Get()),m_pTelHost(TelemetryHost::GetHost())
+{
+}
+
+RemoteControl::~RemoteControl()
+{
+	if (m_thread)
+		fprintf(stderr, "PROGRAMMING ERROR: RemoteControl destroyed without Stop()\n");
+}
+
+static bool SetNonBlocking(int fd)
+{
+	int iFlags = fcntl(fd, F_GETFL, 0);
+	return iFlags >= 0 && fcntl(fd, F_SETFL, iFlags | O_NONBLOCK) >= 0;
+}
+
+bool RemoteControl::Start(avr_t *pAVR)
+{
+	m_pAVR = pAVR;
+	bool bTCP = m_strAddr.compare(0, 4, "tcp:") == 0;
+	if (bTCP)
+	{
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Anyone who can reach this can run Board::Quit and friends.
+		addr.sin_port = htons(static_cast<uint16_t>(atoi(m_strAddr.c_str() + 4)));
+		m_fdListen = socket(AF_INET, SOCK_STREAM, 0);
+		int iOn = 1;
+		if (m_fdListen >= 0)
+			setsockopt(m_fdListen, SOL_SOCKET, SO_REUSEADDR, &iOn, sizeof(iOn));
+		if (m_fdListen < 0 || bind(m_fdListen, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+		{
+			perror(m_strAddr.c_str());
+			return false;
+		}
+	}
+	else
+	{
+		sockaddr_un addr {};
+		addr.sun_family = AF_UNIX;
+		if (m_strAddr.size() >= sizeof(addr.sun_path))
+		{
+			fprintf(stderr, "RemoteControl: Socket path %s is too long\n", m_strAddr.c_str());
+			return false;
+		}
+		strncpy(addr.sun_path, m_strAddr.c_str(), sizeof(addr.sun_path) - 1);
+		m_fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(m_strAddr.c_str()); // Left over from a previous run.
+		if (m_fdListen < 0 || bind(m_fdListen, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+		{
+			perror(m_strAddr.c_str());
+			return false;
+		}
+	}
+	if (listen(m_fdListen, 8) < 0 || !SetNonBlocking(m_fdListen))
+	{
+		perror(m_strAddr.c_str());
+		return false;
+	}
+	signal(SIGPIPE, SIG_IGN); // A client that went away shouldn't take the simulator with it.
+	printf("RemoteControl: Listening on %s\n", m_strAddr.c_str());
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "remote"); RemoteControl *p = static_cast<RemoteControl*>(param); return p->Run(); };
+	pthread_create(&m_thread, NULL, fcnRun, this);
+	return true;
+}
+
+void RemoteControl::Stop()
+{
+	if (m_thread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, NULL);
+		m_thread = 0;
+	}
+	for (auto &p : m_vClients)
+		close(p->fd);
+	m_vClients.clear();
+	if (m_fdListen >= 0)
+	{
+		close(m_fdListen);
+		if (m_strAddr.compare(0, 4, "tcp:") != 0)
+			unlink(m_strAddr.c_str());
+		m_fdListen = -1;
+	}
+	// The AVR is done, so nothing is walking the chains any more.
+	uint64_t uiDropped = 0;
+	for (auto &p : m_dSubs)
+	{
+		uiDropped += p->uiDropped;
+		if (p->bHooked)
+			avr_irq_unregister_notify(p->pIRQ, OnSample, p.get());
+	}
+	if (uiDropped)
+		printf("RemoteControl: %llu telemetry samples were dropped for slow clients\n", static_cast<unsigned long long>(uiDropped));
+}
+
+void RemoteControl::OnSample(avr_irq_t *irq, uint32_t value, void *param)
+{
+	Sub_t *pSub = static_cast<Sub_t*>(param);
+	if (pSub->uiClient.load(std::memory_order_relaxed) && !pSub->samples.Push({pSub->pAVR->cycle, value}))
+		pSub->uiDropped++;
+}
+
+void RemoteControl::Dispatch()
+{
+	Sub_t *pHook;
+	while (m_hooks.Pop(pHook))
+		avr_irq_register_notify(pHook->pIRQ, OnSample, pHook);
+	if (!m_bActive)
+		m_bActive = m_requests.Pop(m_active);
+	if (!m_bActive || m_replies.IsFull()) // Come back once the network thread has caught up.
+		return;
+	IScriptable::LineStatus lsResult = ScriptHost::RunCommand(m_active.cmd);
+	if (lsResult == IScriptable::LineStatus::Waiting || lsResult == IScriptable::LineStatus::Running)
+		return;
+	Reply_t reply;
+	reply.uiClient = m_active.uiClient;
+	reply.strText = lsResult == IScriptable::LineStatus::Finished ? "OK" : "ERR action failed";
+	m_replies.Push(reply);
+	m_bActive = false;
+}
+
+void* RemoteControl::Run()
+{
+	ScriptHost::Select(m_pScriptHost);
+	TelemetryHost::SetHost(m_pTelHost);
+	std::vector<pollfd> vPoll;
+	char buf[4096];
+	while (!m_bQuit)
+	{
+		vPoll.clear();
+		vPoll.push_back({m_fdListen, POLLIN, 0});
+		for (auto &p : m_vClients)
+			vPoll.push_back({p->fd, static_cast<short>(POLLIN | (p->strOut.empty() ? 0 : POLLOUT)), 0});
+		poll(vPoll.data(), vPoll.size(), 10); // Also sets the pace of the telemetry stream.
+		if (vPoll[0].revents & POLLIN)
+			Accept();
+		for (size_t i=1; i<vPoll.size(); i++)
+		{
+			if (!(vPoll[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			Client_t &client = *m_vClients[i-1];
+			ssize_t iRead = recv(client.fd, buf, sizeof(buf), 0);
+			if (iRead == 0 || (iRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				client.bClosed = true;
+				continue;
+			}
+			if (iRead < 0)
+				continue;
+			client.strIn.append(buf, iRead);
+			size_t uiEnd;
+			while ((uiEnd = client.strIn.find('\n')) != std::string::npos)
+			{
+				std::string strLine = client.strIn.substr(0, uiEnd);
+				client.strIn.erase(0, uiEnd + 1);
+				if (!strLine.empty() && strLine.back() == '\r')
+					strLine.pop_back();
+				if (!strLine.empty())
+					OnLine(client, strLine);
+			}
+		}
+		Flush();
+		for (auto it = m_vClients.begin(); it != m_vClients.end();)
+		{
+			if ((*it)->bClosed)
+			{
+				Unsubscribe(**it);
+				close((*it)->fd);
+				it = m_vClients.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+	return nullptr;
+}
+
+void RemoteControl::Accept()
+{
+	int fd;
+	while ((fd = accept(m_fdListen, nullptr, nullptr)) >= 0)
+	{
+		SetNonBlocking(fd);
+		std::unique_ptr<Client_t> pClient(new Client_t());
+		pClient->uiID = m_uiNextClient++;
+		pClient->fd = fd;
+		m_vClients.push_back(std::move(pClient));
+	}
+}
+
+RemoteControl::Client_t* RemoteControl::FindClient(uint32_t uiID)
+{
+	for (auto &p : m_vClients)
+		if (p->uiID == uiID)
+			return p->bClosed ? nullptr : p.get();
+	return nullptr;
+}
+
+void RemoteControl::OnLine(Client_t &client, const std::string &strLine)
+{
+	std::istringstream lineIn(strLine);
+	std::string strVerb, strArg;
+	lineIn >> strVerb;
+	if (strVerb == "SUB")
+	{
+		while (lineIn >> strArg)
+			Subscribe(client, strArg);
+	}
+	else if (strVerb == "UNSUB")
+	{
+		Unsubscribe(client);
+		client.strOut += "OK\n";
+	}
+	else if (strVerb == "FORMAT")
+	{
+		lineIn >> strArg;
+		if (strArg == "json" || strArg == "binary")
+		{
+			client.bBinary = strArg == "binary";
+			client.strOut += "OK\n";
+		}
+		else
+			client.strOut += "ERR expected FORMAT json|binary\n";
+	}
+	else if (strVerb == "LIST")
+	{
+		for (auto &trace : m_pTelHost->GetTraces())
+			client.strOut += "TEL " + trace.first + "\n";
+		client.strOut += "OK\n";
+	}
+	else
+	{
+		Request_t req;
+		req.uiClient = client.uiID;
+		std::string strError;
+		if (!ScriptHost::CompileCommand(strLine, req.cmd, strError))
+			client.strOut += "ERR " + strError + "\n";
+		else if (!m_requests.Push(req))
+			client.strOut += "ERR busy, too many commands queued\n";
+	}
+}
+
+void RemoteControl::Subscribe(Client_t &client, const std::string &strName)
+{
+	const std::map<std::string, avr_irq_t*> &mTraces = m_pTelHost->GetTraces();
+	auto it = mTraces.find(strName);
+	if (it == mTraces.end())
+	{
+		client.strOut += "ERR unknown telemetry " + strName + ", see LIST\n";
+		return;
+	}
+	Sub_t *pSub = nullptr;
+	for (auto &p : m_dSubs)
+		if (p->uiClient == 0 && p->pIRQ == it->second)
+		{
+			pSub = p.get();
+			break;
+		}
+	if (pSub == nullptr)
+	{
+		if (m_hooks.IsFull())
+		{
+			client.strOut += "ERR busy, too many subscriptions pending\n";
+			return;
+		}
+		m_dSubs.emplace_back(new Sub_t());
+		pSub = m_dSubs.back().get();
+		pSub->uiID = m_dSubs.size();
+		pSub->strName = strName;
+		pSub->pIRQ = it->second;
+		pSub->pAVR = m_pAVR;
+		m_hooks.Push(pSub);
+		pSub->bHooked = true;
+	}
+	Sample_t sample;
+	while (pSub->samples.Pop(sample)) {}; // Whatever the last subscriber left behind.
+	pSub->uiClient = client.uiID;
+	client.strOut += "SUB " + std::to_string(pSub->uiID) + " " + strName + "\n";
+}
+
+void RemoteControl::Unsubscribe(Client_t &client)
+{
+	for (auto &p : m_dSubs)
+		if (p->uiClient == client.uiID)
+			p->uiClient = 0;
+}
+
+void RemoteControl::Flush()
+{
+	Reply_t reply;
+	while (m_replies.Pop(reply))
+	{
+		Client_t *pClient = FindClient(reply.uiClient);
+		if (pClient)
+			pClient->strOut += reply.strText + "\n";
+	}
+	char szFrame[96];
+	for (auto &pSub : m_dSubs)
+	{
+		uint32_t uiClient = pSub->uiClient;
+		Client_t *pClient = uiClient ? FindClient(uiClient) : nullptr;
+		Sample_t sample;
+		while (pSub->samples.Pop(sample))
+		{
+			if (pClient == nullptr)
+				continue;
+			if (pClient->strOut.size() > m_uiMaxOut)
+			{
+				pSub->uiDropped++;
+				continue;
+			}
+			if (pClient->bBinary)
+			{
+				szFrame[0] = static_cast<char>(0xFF);
+				memcpy(szFrame + 1, &pSub->uiID, 4);
+				memcpy(szFrame + 5, &sample.uiCycle, 8);
+				memcpy(szFrame + 13, &sample.uiValue, 4);
+				pClient->strOut.append(szFrame, 17);
+			}
+			else
+			{
+				int iLen = snprintf(szFrame, sizeof(szFrame), "{\"sub\":%u,\"cycle\":%llu,\"value\":%u}\n", pSub->uiID,
+					static_cast<unsigned long long>(sample.uiCycle), sample.uiValue);
+				pClient->strOut.append(szFrame, iLen);
+			}
+		}
+	}
+	for (auto &p : m_vClients)
+	{
+		while (!p->bClosed && !p->strOut.empty())
+		{
+			ssize_t iSent = send(p->fd, p->strOut.data(), p->strOut.size(), 0);
+			if (iSent > 0)
+				p->strOut.erase(0, iSent);
+			else
+			{
+				if (iSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+					p->bClosed = true;
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,144 @@
+/*
+	RemoteControl.h - Drives a running printer over a socket: script lines
+	as commands, and a stream of subscribed telemetry values back.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>          // for pthread_t
+#include <stdint.h>           // for uint32_t, uint64_t
+#include <atomic>             // for atomic_bool, atomic_uint
+#include <deque>              // for deque
+#include <memory>             // for unique_ptr
+#include <string>             // for string
+#include <vector>             // for vector
+#include "SPSCRing.h"         // for SPSCRing
+#include "ScriptHost.h"       // for ScriptHost
+#include "TelemetryHost.h"    // for TelemetryHost
+#include "sim_avr.h"          // for avr_t
+#include "sim_avr_types.h"    // for avr_cycle_count_t
+#include "sim_irq.h"          // for avr_irq_t
+
+// Line based, any number of clients at once on a Unix socket, or TCP on localhost with "tcp:<port>":
+//   Context::Action(args)  runs like a script line (after the current one, if it is waiting),
+//                          answered with "OK" or "ERR <why>" once it is done
+//   SUB <name>...          streams every change of the named telemetry (see -t ?), answered
+//                          with "SUB <id> <name>" for each
+//   UNSUB                  stops all of this client's subscriptions
+//   FORMAT json|binary     of the stream: {"sub":id,"cycle":n,"value":v} lines, or 17 byte records of
+//                          0xFF, then the id (u32), cycle (u64) and value (u32) in host byte order
+//   LIST                   the telemetry names, one "TEL <name>" line each, then "OK"
+// Commands are handed to the AVR thread through a lock-free queue and run between
+// instruction batches (see Board::RunAVR), as the menu actions are. A waiting command shares
+// its scriptable's state with any running script, so don't wait on the same one from both.
+class RemoteControl
+{
+	public:
+		// Uses the ScriptHost and TelemetryHost selected on the calling thread.
+		explicit RemoteControl(const std::string &strAddr);
+		~RemoteControl();
+
+		// Starts listening. False (with the reason printed) if the socket couldn't be set up.
+		bool Start(avr_t *pAVR);
+		// Only once the AVR has stopped, the subscriptions are unhooked here.
+		void Stop();
+
+		// Called by the board between batches, on the AVR thread.
+		inline void OnAVRCycle()
+		{
+			if (m_bActive || !m_requests.IsEmpty() || !m_hooks.IsEmpty())
+				Dispatch();
+		}
+
+	private:
+		typedef struct Sample_t
+		{
+			avr_cycle_count_t uiCycle;
+			uint32_t uiValue;
+		} Sample_t;
+
+		// One per subscribed IRQ and client. Its hook stays in place once added (simavr's chains
+		// aren't ours to change while it runs), an idle one is reused for the next subscriber.
+		typedef struct Sub_t
+		{
+			uint32_t uiID = 0;
+			std::string strName;
+			avr_irq_t *pIRQ = nullptr;
+			avr_t *pAVR = nullptr;
+			std::atomic_uint uiClient {0}; // 0 when idle
+			bool bHooked = false; // Network thread's view, the hook itself is added on the AVR thread.
+			SPSCRing<Sample_t> samples {4096}; // AVR thread to network thread
+			std::atomic<uint64_t> uiDropped {0};
+		} Sub_t;
+
+		typedef struct Request_t
+		{
+			uint32_t uiClient = 0;
+			ScriptHost::Command_t cmd;
+		} Request_t;
+
+		typedef struct Reply_t
+		{
+			uint32_t uiClient = 0;
+			std::string strText;
+		} Reply_t;
+
+		typedef struct Client_t
+		{
+			uint32_t uiID = 0;
+			int fd = -1;
+			std::string strIn, strOut;
+			bool bBinary = false, bClosed = false;
+		} Client_t;
+
+		// AVR thread side.
+		void Dispatch();
+		static void OnSample(avr_irq_t *irq, uint32_t value, void *param);
+
+		// Network thread side.
+		void* Run();
+		void Accept();
+		void OnLine(Client_t &client, const std::string &strLine);
+		void Subscribe(Client_t &client, const std::string &strName);
+		void Unsubscribe(Client_t &client);
+		// Moves replies and samples into the client buffers and writes out what the sockets will take.
+		void Flush();
+		Client_t* FindClient(uint32_t uiID);
+
+		std::string m_strAddr;
+		ScriptHost *m_pScriptHost;
+		TelemetryHost *m_pTelHost;
+		avr_t *m_pAVR = nullptr;
+
+		int m_fdListen = -1;
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+		uint32_t m_uiNextClient = 1;
+		std::vector<std::unique_ptr<Client_t>> m_vClients;
+		std::deque<std::unique_ptr<Sub_t>> m_dSubs; // Never shrinks, hooks may point at any of them.
+
+		SPSCRing<Request_t> m_requests {256}; // Network thread to AVR thread
+		SPSCRing<Sub_t*> m_hooks {64}; // Subscriptions to hook up, those don't wait for the commands
+		SPSCRing<Reply_t> m_replies {256}; // And back
+		Request_t m_active; // The command the AVR thread is running
+		bool m_bActive = false;
+
+		static constexpr size_t m_uiMaxOut = 4U<<20U; // Per client, past that samples are dropped.
+};
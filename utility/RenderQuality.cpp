@@ -0,0 +1,73 @@
+/*
+	RenderQuality.cpp - Steps render quality down (and back up) to keep frames within a time budget.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RenderQuality.h"
+#include <stdio.h>      // for printf
+#include "RedrawFlag.h" // for RedrawFlag
+
+static const char* const szLevels[] = {"full", "no MSAA", "print tops only, 20 fps", "3/4 resolution, 15 fps", "1/2 resolution, 10 fps"};
+
+const RenderQuality::Level_t& RenderQuality::GetLevel()
+{
+	static const Level_t levels[] =
+	{
+		{true,  1.f,   true,  0},
+		{false, 1.f,   true,  0},
+		{false, 1.f,   false, 50},
+		{false, 0.75f, false, 66},
+		{false, 0.5f,  false, 100},
+	};
+	static_assert(sizeof(levels)/sizeof(levels[0]) == sizeof(szLevels)/sizeof(szLevels[0]), "A name for every level");
+	return levels[GetState().iLevel.load(std::memory_order_relaxed)];
+}
+
+void RenderQuality::SetBudget(float fMs)
+{
+	GetState().fBudget = fMs > 0 ? fMs : 0;
+}
+
+void RenderQuality::OnFrame(float fMs)
+{
+	State_t &state = GetState();
+	if (state.fBudget <= 0)
+		return;
+	// A few frames' worth, so one slow frame (a mesh upload, say) doesn't count for much.
+	state.fAvg = state.fAvg == 0 ? fMs : (0.8f * state.fAvg) + (0.2f * fMs);
+	int iLevel = state.iLevel.load(std::memory_order_relaxed), iNew = iLevel;
+	if (state.fAvg > state.fBudget)
+	{
+		if (++state.uiSinceChange >= m_uiSettleFrames && iLevel + 1 < static_cast<int>(sizeof(szLevels)/sizeof(szLevels[0])))
+			iNew++;
+	}
+	else if (state.fAvg < 0.5f * state.fBudget)
+	{
+		if (++state.uiSinceChange >= m_uiRecoverFrames && iLevel > 0)
+			iNew--;
+	}
+	else
+		state.uiSinceChange = 0;
+	if (iNew == iLevel)
+		return;
+	state.iLevel.store(iNew, std::memory_order_relaxed);
+	state.uiSinceChange = 0;
+	RedrawFlag::Set(); // Show the new level now, and get it timed.
+	printf("Render quality: %s (%.1f ms a frame against %.1f)\n", szLevels[iNew], state.fAvg, state.fBudget);
+}
@@ -0,0 +1,73 @@
+/*
+	RenderQuality.h - Steps render quality down (and back up) to keep frames within a time budget.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>  // for atomic_int
+
+// The GL thread reports each frame's time with OnFrame(). While the running average is over the
+// budget, a level is dropped every m_uiSettleFrames frames; once it has stayed under half the
+// budget for m_uiRecoverFrames frames, one is restored. Each level costs less than the one
+// before, roughly in order of how much it shows:
+//	0  as configured
+//	1  no multisampling (the sample count is fixed when the window is made, this only turns it off)
+//	2  finished print layers drawn as their tops only, without the walls, and the newest strips as
+//	   lines rather than tubes; at most 20 frames/s
+//	3  the 3D view rendered at 3/4 size and scaled up; at most 15 frames/s
+//	4  the 3D view at 1/2 size; at most 10 frames/s
+// With no budget set it stays at 0.
+class RenderQuality
+{
+	public:
+		// In milliseconds of GL thread time per frame, 0 is off.
+		static void SetBudget(float fMs);
+
+		// GL thread, after each frame.
+		static void OnFrame(float fMs);
+
+		static inline bool UseMultisample() { return GetLevel().bMSAA; }
+		// Of the 3D view's resolution, 0-1.
+		static inline float GetScale() { return GetLevel().fScale; }
+		static inline bool DrawPrintWalls() { return GetLevel().bPrintWalls; }
+		static inline int GetMinFrameMs(int iDefault) { return iDefault > GetLevel().iMinFrameMs ? iDefault : GetLevel().iMinFrameMs; }
+
+	private:
+		typedef struct Level_t
+		{
+			bool bMSAA;
+			float fScale;
+			bool bPrintWalls;
+			int iMinFrameMs;
+		} Level_t;
+
+		static constexpr unsigned int m_uiSettleFrames = 10, m_uiRecoverFrames = 60;
+
+		typedef struct State_t
+		{
+			float fBudget = 0;
+			float fAvg = 0;
+			unsigned int uiSinceChange = 0; // Frames at this level (or under half the budget, going up)
+			std::atomic_int iLevel {0};
+		} State_t;
+
+		static State_t& GetState() { static State_t state; return state; }
+		static const Level_t& GetLevel();
+};
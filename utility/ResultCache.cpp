@@ -0,0 +1,392 @@
+/*
+	ResultCache.cpp - Replays a scripted run whose inputs have been seen before, instead of simulating it.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ResultCache.h"
+#include <dirent.h>         // for opendir, readdir, closedir
+#include <errno.h>          // for errno, EEXIST, EINTR, ENOENT, ENOTEMPTY
+#include <fcntl.h>          // for open, O_RDONLY, O_WRONLY, O_CREAT, O_TRUNC
+#include <poll.h>           // for poll, pollfd, POLLIN
+#include <stdio.h>          // for printf, fprintf, fflush, snprintf, perror, remove
+#include <stdlib.h>         // for strtol
+#include <string.h>         // for strncmp, strcmp, strlen
+#include <sys/mman.h>       // for mmap, munmap
+#include <sys/stat.h>       // for stat, mkdir
+#include <unistd.h>         // for read, write, close, dup, dup2, pipe, getpid
+#include <algorithm>        // for sort
+#include <fstream>          // for ifstream, ofstream
+#include "ThreadPolicy.h"   // for ThreadPolicy
+
+// What the boards keep between runs in the working directory (Board::GetStorageFileName).
+static const char* const szStateFiles[] = {"_eeprom.bin", "_flash.bin", "_xflash.bin", "_SDcard.bin"};
+
+static bool EndsWith(const std::string &strName, const char *szEnd)
+{
+	size_t uiLen = strlen(szEnd);
+	return strName.size() >= uiLen && strName.compare(strName.size() - uiLen, uiLen, szEnd)==0;
+}
+
+static std::vector<std::string> ListDir(const std::string &strDir)
+{
+	std::vector<std::string> vNames;
+	DIR *pDir = opendir(strDir.c_str());
+	if (!pDir)
+		return vNames;
+	while (struct dirent *pEnt = readdir(pDir))
+		if (strcmp(pEnt->d_name, ".") && strcmp(pEnt->d_name, ".."))
+			vNames.emplace_back(pEnt->d_name);
+	closedir(pDir);
+	std::sort(vNames.begin(), vNames.end());
+	return vNames;
+}
+
+static bool CopyFile(const std::string &strFrom, const std::string &strTo, int fdTo = -1)
+{
+	int fdIn = open(strFrom.c_str(), O_RDONLY);
+	int fdOut = fdTo >= 0 ? fdTo : open(strTo.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	bool bOK = fdIn >= 0 && fdOut >= 0;
+	char buf[65536];
+	ssize_t iRead;
+	while (bOK && (iRead = read(fdIn, buf, sizeof(buf))) > 0)
+		bOK = write(fdOut, buf, iRead) == iRead;
+	if (!bOK)
+		perror(fdIn < 0 ? strFrom.c_str() : strTo.c_str());
+	if (fdIn >= 0)
+		close(fdIn);
+	if (fdOut >= 0 && fdTo < 0)
+		close(fdOut);
+	return bOK;
+}
+
+static void MakeParents(const std::string &strPath)
+{
+	for (size_t uiSlash = strPath.find('/', 1); uiSlash != std::string::npos; uiSlash = strPath.find('/', uiSlash + 1))
+		mkdir(strPath.substr(0, uiSlash).c_str(), 0755);
+}
+
+static void RemoveTree(const std::string &strPath)
+{
+	for (auto &strName : ListDir(strPath))
+		RemoveTree(strPath + "/" + strName);
+	if (remove(strPath.c_str()) && errno != ENOENT)
+		perror(strPath.c_str());
+}
+
+ResultCache::~ResultCache()
+{
+	StopTee();
+	if (!m_strTemp.empty())
+		RemoveTree(m_strTemp);
+}
+
+// FNV-1a, as the mesh cache.
+void ResultCache::HashBytes(const void *pData, size_t uiLen)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(pData);
+	for (size_t i=0; i<uiLen; i++)
+	{
+		m_uiHash ^= p[i];
+		m_uiHash *= 0x100000001b3ULL;
+	}
+}
+
+void ResultCache::AddString(const std::string &strValue)
+{
+	HashBytes(strValue.c_str(), strValue.size() + 1); // With the terminator, so "ab","c" isn't "a","bc"
+}
+
+void ResultCache::AddArgs(int argc, const char* const argv[])
+{
+	for (int i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--result-cache")==0)
+			i++; // And its value
+		else if (strncmp(argv[i], "--result-cache=", 15))
+			AddString(argv[i]);
+	}
+}
+
+void ResultCache::HashPath(const std::string &strPath)
+{
+	AddString(strPath);
+	struct stat st;
+	if (stat(strPath.c_str(), &st))
+	{
+		AddString("(missing)");
+		return;
+	}
+	if (S_ISDIR(st.st_mode))
+	{
+		for (auto &strName : ListDir(strPath))
+			HashPath(strPath + "/" + strName);
+		return;
+	}
+	HashBytes(&st.st_size, sizeof(st.st_size));
+	int fd = open(strPath.c_str(), O_RDONLY);
+	if (fd < 0 || st.st_size == 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	const void *pData = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pData == MAP_FAILED)
+	{
+		perror(strPath.c_str());
+		AddString("(unreadable)");
+		return;
+	}
+	HashBytes(pData, st.st_size);
+	munmap(const_cast<void*>(pData), st.st_size);
+}
+
+void ResultCache::AddInput(const std::string &strPath)
+{
+	if (!strPath.empty())
+		HashPath(strPath);
+}
+
+void ResultCache::AddOutput(const std::string &strPath)
+{
+	if (!strPath.empty())
+		m_vOutputs.push_back(strPath);
+}
+
+std::string ResultCache::GetKey()
+{
+	if (m_strKey.empty())
+	{
+		for (auto &strName : ListDir("."))
+			for (auto szEnd : szStateFiles)
+				if (EndsWith(strName, szEnd))
+					HashPath(strName);
+		char szKey[17];
+		snprintf(szKey, sizeof(szKey), "%016llx", static_cast<unsigned long long>(m_uiHash));
+		m_strKey = szKey;
+	}
+	return m_strKey;
+}
+
+bool ResultCache::Replay(int &iRet)
+{
+	std::string strEntry = m_strDir + "/" + GetKey();
+	std::ifstream fResult(strEntry + "/result");
+	if (!fResult.is_open())
+		return false;
+	std::vector<std::pair<std::string, std::string>> vItems;
+	bool bExit = false;
+	std::string strLine;
+	while (std::getline(fResult, strLine))
+	{
+		size_t uiTab = strLine.find('\t');
+		if (uiTab == std::string::npos)
+			continue;
+		vItems.emplace_back(strLine.substr(0, uiTab), strLine.substr(uiTab + 1));
+		if (vItems.back().first == "exit")
+		{
+			iRet = static_cast<int>(strtol(vItems.back().second.c_str(), nullptr, 10));
+			bExit = true;
+		}
+	}
+	if (!bExit)
+	{
+		fprintf(stderr, "Result cache: %s is incomplete, running instead.\n", strEntry.c_str());
+		return false;
+	}
+	printf("Result cache: hit %s, replaying the stored run instead of simulating it.\n", m_strKey.c_str());
+	fflush(stdout);
+	unsigned int uiFile = 0;
+	for (auto &item : vItems)
+	{
+		if (item.first == "file")
+		{
+			MakeParents(item.second);
+			CopyFile(strEntry + "/files/" + std::to_string(uiFile++), item.second);
+		}
+		else if (item.first == "remove")
+			remove(item.second.c_str());
+	}
+	CopyFile(strEntry + "/stdout", "", STDOUT_FILENO);
+	CopyFile(strEntry + "/stderr", "", STDERR_FILENO);
+	return true;
+}
+
+void ResultCache::Snapshot(std::map<std::string, Stat_t> &mFiles)
+{
+	mFiles.clear();
+	auto fcnAdd = [&mFiles](const std::string &strPath, const struct stat &st)
+	{
+		Stat_t &entry = mFiles[strPath];
+		entry.iSize = st.st_size;
+#if defined(__APPLE__)
+		const struct timespec &tsMTime = st.st_mtimespec;
+#else
+		const struct timespec &tsMTime = st.st_mtim;
+#endif
+		entry.iMTimeNs = (static_cast<int64_t>(tsMTime.tv_sec) * 1000000000LL) + tsMTime.tv_nsec;
+	};
+	struct stat st;
+	for (auto &strName : ListDir("."))
+		if (stat(strName.c_str(), &st)==0 && S_ISREG(st.st_mode))
+			fcnAdd(strName, st);
+	std::vector<std::string> vPaths = m_vOutputs;
+	while (!vPaths.empty())
+	{
+		std::string strPath = vPaths.back();
+		vPaths.pop_back();
+		if (stat(strPath.c_str(), &st))
+			continue;
+		if (S_ISREG(st.st_mode))
+			fcnAdd(strPath, st);
+		else if (S_ISDIR(st.st_mode))
+			for (auto &strName : ListDir(strPath))
+				vPaths.push_back(strPath + "/" + strName);
+	}
+}
+
+bool ResultCache::Record()
+{
+	if (mkdir(m_strDir.c_str(), 0755) && errno != EEXIST)
+	{
+		perror(m_strDir.c_str());
+		return false;
+	}
+	m_strTemp = m_strDir + "/" + GetKey() + ".tmp" + std::to_string(getpid());
+	if (mkdir(m_strTemp.c_str(), 0755) || mkdir((m_strTemp + "/files").c_str(), 0755))
+	{
+		perror(m_strTemp.c_str());
+		m_strTemp.clear();
+		return false;
+	}
+	Snapshot(m_mBefore);
+	printf("Result cache: no run stored for %s, recording this one.\n", m_strKey.c_str());
+	const char* const szLogs[] = {"/stdout", "/stderr"};
+	fflush(stdout);
+	fflush(stderr);
+	for (int i=0; i<2; i++)
+	{
+		int fdPipe[2];
+		m_fdLog[i] = open((m_strTemp + szLogs[i]).c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (m_fdLog[i] < 0 || pipe(fdPipe))
+		{
+			perror(m_strTemp.c_str());
+			StopTee();
+			return false;
+		}
+		m_fdOrig[i] = dup(STDOUT_FILENO + i);
+		dup2(fdPipe[1], STDOUT_FILENO + i);
+		close(fdPipe[1]);
+		m_fdPipe[i] = fdPipe[0];
+	}
+	auto fcnTee = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "result-tee"); ResultCache *p = static_cast<ResultCache*>(param); return p->RunTee(); };
+	pthread_create(&m_thread, nullptr, fcnTee, this);
+	return true;
+}
+
+void* ResultCache::RunTee()
+{
+	pollfd fds[2] = {{m_fdPipe[0], POLLIN, 0}, {m_fdPipe[1], POLLIN, 0}};
+	char buf[4096];
+	while (fds[0].fd >= 0 || fds[1].fd >= 0)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (int i=0; i<2; i++)
+		{
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+			ssize_t iRead = read(fds[i].fd, buf, sizeof(buf));
+			if (iRead <= 0)
+			{
+				fds[i].fd = -1; // EOF, the write end is back to the terminal
+				continue;
+			}
+			if (write(m_fdOrig[i], buf, iRead) != iRead || write(m_fdLog[i], buf, iRead) != iRead)
+				continue; // Nowhere left to complain to
+		}
+	}
+	return nullptr;
+}
+
+void ResultCache::StopTee()
+{
+	fflush(stdout);
+	fflush(stderr);
+	for (int i=0; i<2; i++)
+		if (m_fdOrig[i] >= 0)
+			dup2(m_fdOrig[i], STDOUT_FILENO + i); // Closes the pipe's write end
+	if (m_thread)
+	{
+		pthread_join(m_thread, nullptr);
+		m_thread = 0;
+	}
+	for (int i=0; i<2; i++)
+	{
+		for (int *pFd : {&m_fdOrig[i], &m_fdPipe[i], &m_fdLog[i]})
+			if (*pFd >= 0)
+			{
+				close(*pFd);
+				*pFd = -1;
+			}
+	}
+}
+
+void ResultCache::Store(int iRet)
+{
+	if (m_strTemp.empty())
+		return;
+	StopTee();
+	std::map<std::string, Stat_t> mAfter;
+	Snapshot(mAfter);
+	std::ofstream fResult(m_strTemp + "/result");
+	unsigned int uiFiles = 0;
+	bool bOK = fResult.is_open();
+	for (auto &file : mAfter)
+	{
+		auto itBefore = m_mBefore.find(file.first);
+		if (itBefore != m_mBefore.end() && itBefore->second.iSize == file.second.iSize && itBefore->second.iMTimeNs == file.second.iMTimeNs)
+			continue;
+		bOK &= CopyFile(file.first, m_strTemp + "/files/" + std::to_string(uiFiles++));
+		fResult << "file\t" << file.first << '\n';
+	}
+	for (auto &file : m_mBefore)
+		if (mAfter.count(file.first)==0)
+			fResult << "remove\t" << file.first << '\n';
+	fResult << "exit\t" << iRet << '\n'; // Last, an entry without it is incomplete.
+	fResult.close();
+	std::string strEntry = m_strDir + "/" + m_strKey;
+	if (!bOK || fResult.fail())
+		fprintf(stderr, "Result cache: failed to store %s\n", strEntry.c_str());
+	else if (rename(m_strTemp.c_str(), strEntry.c_str())==0)
+	{
+		printf("Result cache: stored %s (%u files)\n", strEntry.c_str(), uiFiles);
+		m_strTemp.clear();
+	}
+	else if (errno == EEXIST || errno == ENOTEMPTY)
+		printf("Result cache: %s was stored by another run meanwhile.\n", strEntry.c_str());
+	else
+		perror(strEntry.c_str());
+	// The destructor removes m_strTemp if it wasn't moved into place.
+}
@@ -0,0 +1,84 @@
+/*
+	ResultCache.h - Replays a scripted run whose inputs have been seen before, instead of simulating it.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>  // for pthread_t
+#include <stdint.h>   // for uint64_t, int64_t
+#include <map>        // for map
+#include <string>     // for string
+#include <vector>     // for vector
+
+// The key is an FNV-1a hash of the MK404 version, the command line and the contents of every input:
+// the files named on it (firmware, script, SD image...) and the boards' persistent state in the
+// working directory (*_eeprom.bin, *_flash.bin, *_xflash.bin, *_SDcard.bin). A run with a new key
+// has its stdout and stderr teed to the cache, and at the end, its exit code and every file it
+// created, changed or removed in the working directory or the named outputs are stored under
+// <dir>/<key>. The same key again prints that, puts the files back and exits the same way.
+// Only what the run reads through the command line is hashed; a script that pulls in other
+// files must name them with AddInput (or the cache must not be used for it).
+class ResultCache
+{
+	public:
+		explicit ResultCache(const std::string &strDir):m_strDir(strDir){};
+		// Stops the tee, storing nothing, if the run ended without Store().
+		~ResultCache();
+
+		// The command line, less --result-cache itself.
+		void AddArgs(int argc, const char* const argv[]);
+		void AddString(const std::string &strValue);
+		// A file or directory the run reads. Missing is fine, it hashes as such.
+		void AddInput(const std::string &strPath);
+		// A file or directory outside the working directory the run writes.
+		void AddOutput(const std::string &strPath);
+
+		// Looks up the key. On a hit, replays the stored run and sets iRet to its exit code.
+		bool Replay(int &iRet);
+		// Snapshots the files and starts teeing stdout and stderr, for Store().
+		bool Record();
+		// Stores the run with its exit code. Call after everything has been written and joined.
+		void Store(int iRet);
+
+	private:
+		typedef struct Stat_t
+		{
+			int64_t iSize = 0;
+			int64_t iMTimeNs = 0;
+		} Stat_t;
+
+		void HashBytes(const void *pData, size_t uiLen);
+		void HashPath(const std::string &strPath);
+		std::string GetKey();
+
+		void Snapshot(std::map<std::string, Stat_t> &mFiles);
+		void StopTee();
+		void* RunTee();
+
+		std::string m_strDir;
+		uint64_t m_uiHash = 0xcbf29ce484222325ULL;
+		std::string m_strKey; // Once GetKey() has hashed the state files too
+		std::vector<std::string> m_vOutputs;
+
+		std::map<std::string, Stat_t> m_mBefore;
+		std::string m_strTemp; // The entry being written, renamed into place by Store()
+		int m_fdOrig[2] = {-1, -1}, m_fdPipe[2] = {-1, -1}, m_fdLog[2] = {-1, -1}; // stdout, stderr
+		pthread_t m_thread = 0;
+};
@@ -0,0 +1,104 @@
+/*
+	SPSCRing.h - Lock-free single producer/single consumer ring buffer.
+	One thread may write and one other thread may read without locking.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>  // for size_t
+#include <algorithm> // for min
+#include <atomic>    // for atomic_size_t, memory_order_acquire, memory_o...
+#include <vector>    // for vector
+
+template<class T>
+class SPSCRing
+{
+	public:
+		// Capacity is rounded up to a power of two.
+		explicit SPSCRing(size_t uiCapacity = 512) { Resize(uiCapacity); }
+
+		// Not thread safe, only call while neither side is active.
+		void Resize(size_t uiCapacity)
+		{
+			size_t uiSize = 2;
+			while (uiSize < uiCapacity)
+				uiSize <<= 1;
+			m_vData.assign(uiSize, T());
+			m_uiMask = uiSize - 1;
+			m_uiHead = 0;
+			m_uiTail = 0;
+		}
+
+		inline size_t Capacity() const { return m_uiMask + 1; }
+
+		// Producer side.
+		inline bool IsFull() const { return m_uiHead.load(std::memory_order_relaxed) - m_uiTail.load(std::memory_order_acquire) > m_uiMask; }
+		inline bool Push(const T &val)
+		{
+			size_t uiHead = m_uiHead.load(std::memory_order_relaxed);
+			if (uiHead - m_uiTail.load(std::memory_order_acquire) > m_uiMask)
+				return false;
+			m_vData[uiHead & m_uiMask] = val;
+			m_uiHead.store(uiHead + 1, std::memory_order_release);
+			return true;
+		}
+		// Contiguous free space for direct writes (e.g. read() into the ring), follow with CommitWrite.
+		inline size_t GetWriteSpan(T *&pOut)
+		{
+			size_t uiHead = m_uiHead.load(std::memory_order_relaxed);
+			size_t uiFree = Capacity() - (uiHead - m_uiTail.load(std::memory_order_acquire));
+			pOut = &m_vData[uiHead & m_uiMask];
+			return std::min(uiFree, Capacity() - (uiHead & m_uiMask));
+		}
+		inline void CommitWrite(size_t uiCount) { m_uiHead.store(m_uiHead.load(std::memory_order_relaxed) + uiCount, std::memory_order_release); }
+
+		// Either side, exact only while the other is not running.
+		inline size_t Size() const { return m_uiHead.load(std::memory_order_acquire) - m_uiTail.load(std::memory_order_acquire); }
+
+		// Consumer side.
+		inline bool IsEmpty() const { return m_uiTail.load(std::memory_order_relaxed) == m_uiHead.load(std::memory_order_acquire); }
+		inline bool Pop(T &val)
+		{
+			size_t uiTail = m_uiTail.load(std::memory_order_relaxed);
+			if (uiTail == m_uiHead.load(std::memory_order_acquire))
+				return false;
+			val = m_vData[uiTail & m_uiMask];
+			m_uiTail.store(uiTail + 1, std::memory_order_release);
+			return true;
+		}
+		// Contiguous readable data (e.g. to write() straight out), follow with CommitRead.
+		inline size_t GetReadSpan(T *&pOut)
+		{
+			size_t uiTail = m_uiTail.load(std::memory_order_relaxed);
+			size_t uiUsed = m_uiHead.load(std::memory_order_acquire) - uiTail;
+			pOut = &m_vData[uiTail & m_uiMask];
+			return std::min(uiUsed, Capacity() - (uiTail & m_uiMask));
+		}
+		inline void CommitRead(size_t uiCount) { m_uiTail.store(m_uiTail.load(std::memory_order_relaxed) + uiCount, std::memory_order_release); }
+
+	private:
+		std::vector<T> m_vData;
+		size_t m_uiMask = 0;
+		// Free-running counters, the index is the low bits. Padded apart so the two sides don't share a line
+		// (without alignas, which C++11 operator new can't honour for the heap-allocated printers).
+		std::atomic_size_t m_uiHead {0};
+		char m_pad[64 - sizeof(std::atomic_size_t)];
+		std::atomic_size_t m_uiTail {0};
+};
@@ -0,0 +1,204 @@
+/*
+	ScriptBatch.cpp - Runs a list of scripts one after another on a single boot of a printer.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ScriptBatch.h"
+#include <stdio.h>     // for printf, fprintf, fopen, fclose, perror
+#include <unistd.h>    // for usleep
+#include <chrono>      // for steady_clock, duration
+#include <fstream>     // for ifstream
+#include "sim_avr.h"   // for avr_t
+#include "sim_time.h"  // for avr_cycles_to_usec
+
+bool ScriptBatch::LoadList(const std::string &strList)
+{
+	std::ifstream fIn(strList);
+	if (!fIn.is_open())
+	{
+		fprintf(stderr, "ScriptBatch: Could not open %s\n", strList.c_str());
+		return false;
+	}
+	std::string strLine;
+	while (std::getline(fIn, strLine))
+	{
+		size_t uiStart = strLine.find_first_not_of(" \t\r");
+		if (uiStart == std::string::npos || strLine[uiStart] == '#')
+			continue;
+		strLine.erase(strLine.find_last_not_of(" \t\r") + 1);
+		m_vScripts.push_back(strLine.substr(uiStart));
+	}
+	if (m_vScripts.empty())
+	{
+		fprintf(stderr, "ScriptBatch: No scripts in %s\n", strList.c_str());
+		return false;
+	}
+	return true;
+}
+
+int ScriptBatch::Run(const std::string &strList)
+{
+	if (!LoadList(strList))
+		return static_cast<int>(ScriptHost::State::Error);
+
+	m_pBoard->DetachStorage();
+	m_pBoard->SetKeepOnQuit(true);
+	Snapshot baseline;
+	m_pBoard->SaveBaseline(baseline);
+
+	int iRet = 0;
+	for (size_t i=0; i<m_vScripts.size(); i++)
+	{
+		printf("ScriptBatch: [%zu/%zu] %s\n", i+1, m_vScripts.size(), m_vScripts[i].c_str());
+		m_vResults.push_back(RunOne(m_vScripts[i], baseline));
+		const Result_t &result = m_vResults.back();
+		printf("ScriptBatch: [%zu/%zu] %s: %s after %.3f s (%.3f s simulated)\n", i+1, m_vScripts.size(), result.strScript.c_str(),
+			StateName(result), result.dWallS, result.uiSimUs/1e6);
+		if (iRet == 0 && (result.eState != ScriptHost::State::Finished || result.bStopped))
+			iRet = result.bStopped ? static_cast<int>(ScriptHost::State::Error) : static_cast<int>(result.eState);
+	}
+
+	// Back to where it started, so the caller's shutdown doesn't see the last script's quit.
+	m_pBoard->SetKeepOnQuit(false);
+	m_pBoard->RestoreBaseline(baseline);
+
+	size_t uiPassed = 0;
+	for (auto &result : m_vResults)
+		uiPassed += result.eState == ScriptHost::State::Finished && !result.bStopped;
+	printf("ScriptBatch: %zu of %zu script(s) finished cleanly.\n", uiPassed, m_vResults.size());
+	if (!m_strReport.empty() && !WriteReport() && iRet == 0)
+		iRet = 1;
+	return iRet;
+}
+
+ScriptBatch::Result_t ScriptBatch::RunOne(const std::string &strScript, const Snapshot &baseline)
+{
+	Result_t result {strScript, ScriptHost::State::Error, false, 0, 0};
+	m_pBoard->RestoreBaseline(baseline);
+	if (!ScriptHost::Restart(strScript))
+		return result; // Validation has said why.
+
+	auto tStart = std::chrono::steady_clock::now();
+	avr_cycle_count_t uiStart = m_pBoard->GetAVR()->cycle;
+	m_pBoard->StartAVR();
+	ScriptHost::State state = ScriptHost::GetState();
+	while (m_pBoard->IsRunning() && (state == ScriptHost::State::Idle || state == ScriptHost::State::Running))
+	{
+		usleep(1000);
+		state = ScriptHost::GetState();
+	}
+	m_pBoard->SuspendAVR();
+	// The script may have got to its end while the board was on the way out.
+	result.eState = ScriptHost::GetState();
+	result.bStopped = result.eState == ScriptHost::State::Idle || result.eState == ScriptHost::State::Running;
+	result.dWallS = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+	result.uiSimUs = avr_cycles_to_usec(m_pBoard->GetAVR(), m_pBoard->GetAVR()->cycle - uiStart);
+	return result;
+}
+
+const char* ScriptBatch::StateName(const Result_t &result)
+{
+	if (result.bStopped)
+		return "stopped";
+	switch (result.eState)
+	{
+		case ScriptHost::State::Finished:
+			return "finished";
+		case ScriptHost::State::Timeout:
+			return "timeout";
+		case ScriptHost::State::Error:
+			return "error";
+		default:
+			return "stopped";
+	}
+}
+
+// Script paths are the only strings from outside.
+static std::string Escape(const std::string &strIn, bool bXML)
+{
+	std::string strOut;
+	for (char c : strIn)
+	{
+		if (bXML && c == '&')
+			strOut += "&amp;";
+		else if (bXML && c == '<')
+			strOut += "&lt;";
+		else if (bXML && c == '>')
+			strOut += "&gt;";
+		else if (bXML && c == '"')
+			strOut += "&quot;";
+		else
+		{
+			if (!bXML && (c == '"' || c == '\\'))
+				strOut.push_back('\\');
+			strOut.push_back(c);
+		}
+	}
+	return strOut;
+}
+
+bool ScriptBatch::WriteReport()
+{
+	FILE *fOut = fopen(m_strReport.c_str(), "w");
+	if (!fOut)
+	{
+		perror(m_strReport.c_str());
+		return false;
+	}
+	bool bXML = m_strReport.size() >= 4 && m_strReport.compare(m_strReport.size() - 4, 4, ".xml") == 0;
+	if (bXML)
+	{
+		size_t uiFailures = 0, uiErrors = 0;
+		double dTotal = 0;
+		for (auto &result : m_vResults)
+		{
+			uiFailures += !result.bStopped && result.eState == ScriptHost::State::Timeout;
+			uiErrors += result.bStopped || result.eState == ScriptHost::State::Error;
+			dTotal += result.dWallS;
+		}
+		fprintf(fOut, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		fprintf(fOut, "<testsuite name=\"MK404\" tests=\"%zu\" failures=\"%zu\" errors=\"%zu\" time=\"%.3f\">\n", m_vResults.size(), uiFailures, uiErrors, dTotal);
+		for (auto &result : m_vResults)
+		{
+			std::string strName = Escape(result.strScript, true);
+			fprintf(fOut, "\t<testcase name=\"%s\" classname=\"MK404.script-batch\" time=\"%.3f\">", strName.c_str(), result.dWallS);
+			if (result.bStopped || result.eState == ScriptHost::State::Error)
+				fprintf(fOut, "<error message=\"%s\"/>", StateName(result));
+			else if (result.eState == ScriptHost::State::Timeout)
+				fprintf(fOut, "<failure message=\"timeout\"/>");
+			fprintf(fOut, "<system-out>%.3f s simulated</system-out></testcase>\n", result.uiSimUs/1e6);
+		}
+		fprintf(fOut, "</testsuite>\n");
+	}
+	else
+	{
+		fprintf(fOut, "{\"scripts\":[");
+		for (size_t i=0; i<m_vResults.size(); i++)
+		{
+			const Result_t &result = m_vResults[i];
+			fprintf(fOut, "%s\n{\"script\":\"%s\",\"result\":\"%s\",\"exit\":%d,\"wall_s\":%.3f,\"sim_s\":%.6f}", i ? "," : "",
+				Escape(result.strScript, false).c_str(), StateName(result),
+				result.bStopped ? static_cast<int>(ScriptHost::State::Error) : static_cast<int>(result.eState), result.dWallS, result.uiSimUs/1e6);
+		}
+		fprintf(fOut, "\n]}\n");
+	}
+	fclose(fOut);
+	printf("ScriptBatch: Wrote %s\n", m_strReport.c_str());
+	return true;
+}
@@ -0,0 +1,68 @@
+/*
+	ScriptBatch.h - Runs a list of scripts one after another on a single boot of a printer.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>      // for uint64_t
+#include <string>        // for string
+#include <vector>        // for vector
+#include "Board.h"       // for Board
+#include "ScriptHost.h"  // for ScriptHost, ScriptHost::State
+#include "Snapshot.h"    // for Snapshot
+
+// Each script starts from the board as it was created (the snapshot taken before the first one
+// runs, so flash, EEPROM, SRAM and the printer's parts), with the SD card remounted to drop its
+// overlay writes. The firmware, assets, PTYs and trace registrations are set up once for all of
+// them. EEPROM and flash are in memory only, their files are left alone. Traces (-t) run on
+// across the scripts, with the cycle count going back to 0 at each.
+// The board must be the only one in the process, and without FastBoot, which unhooks itself
+// during the first script and so would only speed up that one.
+class ScriptBatch
+{
+	public:
+		ScriptBatch(Boards::Board *pBoard, const std::string &strReport):m_pBoard(pBoard),m_strReport(strReport){};
+
+		// Runs the scripts listed in strList, one path per line (# comments), and writes the report:
+		// JUnit XML if its name ends in .xml, JSON otherwise. Returns the state of the first script
+		// that didn't finish cleanly, as MK404's exit code for a --script run, or 0.
+		int Run(const std::string &strList);
+
+	private:
+		typedef struct Result_t
+		{
+			std::string strScript;
+			ScriptHost::State eState;
+			bool bStopped; // The board quit or crashed before the script ended.
+			double dWallS;
+			uint64_t uiSimUs;
+		} Result_t;
+
+		bool LoadList(const std::string &strList);
+		Result_t RunOne(const std::string &strScript, const Snapshot &baseline);
+		bool WriteReport();
+
+		static const char* StateName(const Result_t &result);
+
+		Boards::Board *m_pBoard;
+		std::string m_strReport;
+		std::vector<std::string> m_vScripts;
+		std::vector<Result_t> m_vResults;
+};
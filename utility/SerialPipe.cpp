@@ -23,105 +23,76 @@
 #include <errno.h>       // for EAGAIN, errno
 #include <fcntl.h>       // for open, O_NONBLOCK, O_RDWR
 #include <stdio.h>       // for fprintf, printf, perror, NULL, stderr
-#include <sys/select.h>  // for FD_ISSET, FD_SET, select, FD_ZERO, fd_set
 #include <unistd.h>      // for read, write, close
 
 SerialPipe::SerialPipe(std::string strUART0, std::string strUART1):m_strPty0(strUART0),m_strPty1(strUART1)
-{
-	auto fcnThread = [](void *param){ SerialPipe *p = (SerialPipe*)param; return p->Run(); };
-
-	pthread_create(&m_thread, NULL, fcnThread, this);
-	m_bStarted = true;
-}
-
-SerialPipe::~SerialPipe()
-{
-	if (!m_bStarted)
-		return;
-	m_bQuit = true;
-	pthread_cancel(m_thread);
-	pthread_join(m_thread,NULL);
-	printf("Serial pipe finished\n");
-}
-
-void* SerialPipe::Run()
 {
 	// Not much to see here, we just open the ports and shuttle characters back and forth across them.
-	//printf("Starting serial transfer thread...\n");
-	int fdPort[2];
-	fd_set fdsIn, fdsErr;
-	unsigned char chrIn;
-	int iLastFd = 0, iReadyRead, iChrRd;
-	if ((fdPort[0]=open(m_strPty0.c_str(), O_RDWR | O_NONBLOCK)) == -1)
+	if ((m_fdPort[0]=open(m_strPty0.c_str(), O_RDWR | O_NONBLOCK)) == -1)
 	{
 		fprintf(stderr, "Could not open %s.\n",m_strPty0.c_str());
 		perror(m_strPty0.c_str());
-		m_bQuit = true;
 	}
-	if ((fdPort[1]=open(m_strPty1.c_str(), O_RDWR | O_NONBLOCK)) == -1)
+	if ((m_fdPort[1]=open(m_strPty1.c_str(), O_RDWR | O_NONBLOCK)) == -1)
 	{
 		fprintf(stderr, "Could not open %s.\n",m_strPty1.c_str());
 		perror(m_strPty1.c_str());
-		m_bQuit = true;
 	}
-	if (fdPort[0]>fdPort[1])
-		iLastFd = fdPort[0];
-	else
-		iLastFd = fdPort[1];
+	if (m_fdPort[0]<0 || m_fdPort[1]<0)
+		return;
+	for (int i=0; i<2; i++)
+		IOReactor::Get().Add(m_fdPort[i], [this, i](bool bReadable) { return Service(i, bReadable); });
+}
+
+SerialPipe::~SerialPipe()
+{
+	for (int i=0; i<2; i++)
+	{
+		if (m_fdPort[i]<0)
+			continue;
+		IOReactor::Get().Remove(m_fdPort[i]);
+		close(m_fdPort[i]);
+	}
+	printf("Serial pipe finished\n");
+}
 
-	while (!m_bQuit)
+void SerialPipe::Flush(int iFrom)
+{
+	Buffer_t &buf = m_buffer[iFrom];
+	while (buf.done < buf.len)
 	{
-		FD_ZERO(&fdsIn);
-		FD_ZERO(&fdsErr);
-		FD_SET(fdPort[0], &fdsIn);
-		FD_SET(fdPort[1], &fdsIn);
-		FD_SET(fdPort[0], &fdsErr);
-		FD_SET(fdPort[1], &fdsErr);
-		if ((iReadyRead = select(iLastFd+1,&fdsIn, NULL, &fdsErr,NULL))<0)
+		ssize_t r = write(m_fdPort[1-iFrom], buf.data + buf.done, buf.len - buf.done);
+		if (r <= 0)
 		{
-			printf("Select ERR.\n");
-			m_bQuit = true;
+			if (r < 0 && errno != EAGAIN)
+				fprintf(stderr, "Failed to write across serial pipe %d.\n", iFrom);
 			break;
 		}
+		buf.done += r;
+	}
+	if (buf.done == buf.len)
+		buf.done = buf.len = 0;
+}
 
-		if (FD_ISSET(fdPort[0],&fdsIn))
-		{
-			while ((iChrRd = read(fdPort[0], &chrIn,1))>0)
-			{
-				if(write(fdPort[1],&chrIn,1)!=1)
-					fprintf(stderr, "Failed to write byte across serial pipe 0.\n");
-
-			}
-			if (iChrRd == 0 || (iChrRd<0 && errno != EAGAIN))
-			{
-				m_bQuit = true;
-				break;
-			}
-		}
-		if (FD_ISSET(fdPort[1],&fdsIn))
-		{
-			while ((iChrRd = read(fdPort[1], &chrIn,1))>0)
-			{
-				if(write(fdPort[0],&chrIn,1) !=1)
-					fprintf(stderr, "Failed to write byte across serial pipe 0.\n");
-			}
-			if (iChrRd == 0 || (iChrRd<0 && errno != EAGAIN))
-			{
-				m_bQuit = true;
-				break;
-			}
-		}
-		if (FD_ISSET(fdPort[0], &fdsErr) || FD_ISSET(fdPort[1], &fdsErr))
+IOReactor::Interest_t SerialPipe::Service(int iPort, bool bReadable)
+{
+	if (m_bQuit)
+		return {false, false};
+	Buffer_t &buf = m_buffer[iPort];
+	if (bReadable && buf.len == 0)
+	{
+		ssize_t r = read(m_fdPort[iPort], buf.data, sizeof(buf.data));
+		if (r > 0)
+			buf.len = r;
+		else if (r == 0 || errno != EAGAIN)
 		{
 			fprintf(stderr,"Exception reading PTY. Quit.\n");
 			m_bQuit = true;
-			break;
+			return {false, false};
 		}
-
 	}
-
-	// cleanup.
-	for (int i=0; i<2; i++)
-		close(fdPort[i]);
-	return nullptr;
+	// Both directions every time, the reactor may service the ports in either order.
+	Flush(0);
+	Flush(1);
+	return {m_buffer[iPort].len == 0, m_buffer[1-iPort].len > 0};
 }
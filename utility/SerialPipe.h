@@ -19,26 +19,37 @@
 	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <pthread.h>  // for pthread_t
-#include <string>     // for string
-#include <atomic>
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint8_t
+#include <string>       // for string
+#include "IOReactor.h"  // for IOReactor
 
+// Both ends are serviced by the shared IOReactor thread.
 class SerialPipe
 {
     public:
 	// Constructs a new serial pipe betwen the named UARTs (typically /tmp/simavr-uart#)
 	SerialPipe(std::string strUART0, std::string strUART1);
 
-	// Destructor, shuts down the pipe thread.
+	// Destructor, detaches from the reactor and closes the ports.
 	~SerialPipe();
 
     private:
-		// Main thread function.
-		void* Run();
+		// Moves whatever it can in both directions. Called from the reactor for either port.
+		IOReactor::Interest_t Service(int iPort, bool bReadable);
 
-		bool m_bStarted = false;
-		std::atomic_bool m_bQuit = {false};
-		pthread_t m_thread = 0;
+		// Writes out as much of the buffer from iFrom as the other side takes.
+		void Flush(int iFrom);
+
+		bool m_bQuit = false;
+		int m_fdPort[2] = {-1, -1};
+
+		typedef struct Buffer_t
+		{
+			uint8_t data[4096];
+			size_t len = 0, done = 0;
+		} Buffer_t;
+		Buffer_t m_buffer[2]; // Data read from port N, waiting to go to the other one.
 
 		std::string m_strPty0, m_strPty1;
 
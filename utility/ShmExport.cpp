@@ -0,0 +1,136 @@
+/*
+	ShmExport.cpp - Publishes the MCU's memory and status in POSIX shared memory.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ShmExport.h"
+#include <avr_eeprom.h>  // for avr_eeprom_desc_t, AVR_IOCTL_EEPROM_GET
+#include <fcntl.h>       // for O_CREAT, O_RDWR, O_TRUNC
+#include <stdio.h>       // for printf, perror
+#include <string.h>      // for memcpy, strncpy
+#include <sys/mman.h>    // for mmap, munmap, shm_open, shm_unlink
+#include <unistd.h>      // for close, ftruncate
+#include <chrono>        // for steady_clock, nanoseconds
+#include "sim_io.h"      // for avr_ioctl
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "The sequence counter must be a plain word for other processes.");
+
+void ShmExport::SetDefaults(const std::string &strName, uint32_t uiPeriodUs)
+{
+	GetNameRef() = strName;
+	GetPeriodUs() = uiPeriodUs ? uiPeriodUs : 1;
+}
+
+ShmExport::~ShmExport()
+{
+	if (!m_pHdr)
+		return;
+	munmap(m_pHdr, m_uiMapSize);
+	shm_unlink(m_strName.c_str());
+}
+
+void ShmExport::Init(avr_t *avr, const std::string &strName)
+{
+	_Init(avr, this);
+	m_strName = strName.at(0) == '/' ? strName : "/" + strName;
+
+	avr_eeprom_desc_t desc;
+	desc.ee = nullptr;
+	desc.offset = 0;
+	desc.size = m_pAVR->e2end + 1U;
+	avr_ioctl(m_pAVR, AVR_IOCTL_EEPROM_GET, &desc); // A null ee gets the internal buffer.
+	m_pEEPROM = desc.ee;
+
+	uint32_t uiDataSize = m_pAVR->ramend + 1U, uiEEPROMSize = m_pEEPROM ? m_pAVR->e2end + 1U : 0;
+	uint32_t uiDataOffset = (sizeof(Header_t) + 63U) & ~63U; // Keep the memory on its own cache lines.
+	m_uiMapSize = uiDataOffset + uiDataSize + uiEEPROMSize;
+
+	shm_unlink(m_strName.c_str()); // A stale one from a crashed run could be the wrong size.
+	int fd = shm_open(m_strName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		perror(m_strName.c_str());
+		return;
+	}
+	if (ftruncate(fd, m_uiMapSize) < 0)
+	{
+		perror(m_strName.c_str());
+		close(fd);
+		shm_unlink(m_strName.c_str());
+		return;
+	}
+	void *pMap = mmap(nullptr, m_uiMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pMap == MAP_FAILED)
+	{
+		perror(m_strName.c_str());
+		shm_unlink(m_strName.c_str());
+		return;
+	}
+	m_pHdr = static_cast<Header_t*>(pMap); // Zero-filled by ftruncate
+	m_pHdr->uiVersion = m_uiVersion;
+	m_pHdr->uiHeaderSize = sizeof(Header_t);
+	m_pHdr->uiPeriodUs = GetPeriodUs();
+	m_pHdr->uiDataOffset = uiDataOffset;
+	m_pHdr->uiDataSize = uiDataSize;
+	m_pHdr->uiEEPROMOffset = uiDataOffset + uiDataSize;
+	m_pHdr->uiEEPROMSize = uiEEPROMSize;
+	m_pHdr->uiFrequency = m_pAVR->frequency;
+	strncpy(m_pHdr->szMCU, m_pAVR->mmcu, sizeof(m_pHdr->szMCU) - 1U);
+	Publish();
+	std::atomic_thread_fence(std::memory_order_release);
+	m_pHdr->uiMagic = m_uiMagic;
+
+	RegisterTimerUsec(m_fcnPublish, GetPeriodUs(), this);
+	printf("Exporting %s state to shared memory %s (%zu bytes, every %u us)\n", m_pAVR->mmcu, m_strName.c_str(), m_uiMapSize, GetPeriodUs());
+}
+
+avr_cycle_count_t ShmExport::OnPublishTimer(avr_t *avr, avr_cycle_count_t when)
+{
+	Publish();
+	return when + avr_usec_to_cycles(avr, GetPeriodUs());
+}
+
+void ShmExport::Publish()
+{
+	if (!m_pHdr)
+		return;
+	uint32_t uiSeq = m_pHdr->uiSeq.load(std::memory_order_relaxed);
+	m_pHdr->uiSeq.store(uiSeq + 1U, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint8_t uiSREG = 0;
+	for (int i=0; i<8; i++)
+		if (m_pAVR->sreg[i])
+			uiSREG |= 1U << i;
+	m_pHdr->uiSnapshots++;
+	m_pHdr->uiCycle = m_pAVR->cycle;
+	m_pHdr->uiWallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	m_pHdr->uiPC = m_pAVR->pc;
+	m_pHdr->uiSP = m_pAVR->data[R_SPL] | (m_pAVR->data[R_SPH] << 8U);
+	m_pHdr->uiSREG = uiSREG;
+	m_pHdr->uiState = m_pAVR->state;
+	uint8_t *pBase = reinterpret_cast<uint8_t*>(m_pHdr);
+	memcpy(pBase + m_pHdr->uiDataOffset, m_pAVR->data, m_pHdr->uiDataSize);
+	if (m_pEEPROM)
+		memcpy(pBase + m_pHdr->uiEEPROMOffset, m_pEEPROM, m_pHdr->uiEEPROMSize);
+
+	m_pHdr->uiSeq.store(uiSeq + 2U, std::memory_order_release);
+	RaiseIRQ(SNAPSHOT_OUT, static_cast<uint32_t>(m_pHdr->uiSnapshots));
+}
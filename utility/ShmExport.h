@@ -0,0 +1,102 @@
+/*
+	ShmExport.h - Publishes the MCU's memory and status in POSIX shared memory.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>            // for size_t
+#include <stdint.h>            // for uint32_t, uint64_t, uint8_t, uint16_t
+#include <atomic>              // for atomic
+#include <string>              // for string
+#include "BasePeripheral.h"    // for BasePeripheral, MAKE_C_TIMER_CALLBACK
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_irq.h"           // for avr_irq_t
+
+// Every m_uiPeriodUs of AVR time, copies the data space (registers, I/O, SRAM), the EEPROM and
+// a status block into the segment /<name>_<board>_<mcu> (shm_open), under a sequence lock, from the AVR thread.
+// Observers map it read-only and take snapshots without syscalls or stopping the MCU:
+//
+//	do {
+//		while ((s1 = atomic_load_acquire(&hdr->uiSeq)) & 1) ;  // Odd while being written
+//		copy the fields/bytes wanted
+//		atomic_thread_fence(acquire);
+//	} while (atomic_load_relaxed(&hdr->uiSeq) != s1);
+//
+// The segment is Header_t followed by the data space at uiDataOffset and the EEPROM at
+// uiEEPROMOffset. The SRAM variable at data address A is at uiDataOffset + A, as in avr-gdb or
+// the ELF (less its 0x800000). uiMagic is set last, so a reader seeing it sees the rest.
+// The segment is unlinked at exit; a reader that still has it mapped keeps the final state.
+class ShmExport: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(SNAPSHOT_OUT,">shm.snapshot")
+		#include "IRQHelper.h"
+
+		typedef struct Header_t
+		{
+			uint32_t uiMagic;        // m_uiMagic, "MK4S"
+			uint16_t uiVersion;      // m_uiVersion
+			uint16_t uiHeaderSize;   // sizeof(Header_t)
+			std::atomic<uint32_t> uiSeq;
+			uint32_t uiPeriodUs;     // AVR time between snapshots
+			uint32_t uiDataOffset, uiDataSize;
+			uint32_t uiEEPROMOffset, uiEEPROMSize;
+			uint64_t uiFrequency;    // MCU clock, Hz
+			char szMCU[16];
+			// Under uiSeq from here, like the memory:
+			uint64_t uiSnapshots;
+			uint64_t uiCycle;
+			uint64_t uiWallNs;       // Host steady clock at the snapshot, to tell a stalled sim from a slow reader
+			uint32_t uiPC;           // Byte address
+			uint16_t uiSP;
+			uint8_t uiSREG;
+			uint8_t uiState;         // simavr's cpu_* state
+		} Header_t;
+
+		static constexpr uint32_t m_uiMagic = 0x53344B4D; // "MK4S" in memory
+		static constexpr uint16_t m_uiVersion = 1;
+
+		// Set from the command line before the boards are created. An empty name disables the export.
+		static void SetDefaults(const std::string &strName, uint32_t uiPeriodUs);
+		static inline bool IsEnabled() { return !GetName().empty(); }
+		static inline const std::string& GetName() { return GetNameRef(); }
+
+		~ShmExport();
+
+		// Creates /strName (replacing any stale one) and starts publishing.
+		void Init(avr_t *avr, const std::string &strName);
+
+		// Writes a snapshot now and raises SNAPSHOT_OUT with the count. AVR thread, or any thread once it has stopped.
+		void Publish();
+
+	private:
+		static std::string& GetNameRef() { static std::string strName; return strName; }
+		static uint32_t& GetPeriodUs() { static uint32_t uiPeriod = 1000; return uiPeriod; }
+
+		avr_cycle_count_t OnPublishTimer(avr_t *avr, avr_cycle_count_t when);
+		avr_cycle_timer_t m_fcnPublish = MAKE_C_TIMER_CALLBACK(ShmExport,OnPublishTimer);
+
+		std::string m_strName;
+		Header_t *m_pHdr = nullptr;
+		size_t m_uiMapSize = 0;
+		uint8_t *m_pEEPROM = nullptr; // SimAVR's own buffer
+};
@@ -0,0 +1,86 @@
+/*
+	Snapshot.h - A named collection of raw state blobs, used by Board::SaveState
+	and the components' SaveState/LoadState to checkpoint a running simulation.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint8_t
+#include <stdio.h>   // for fprintf, stderr
+#include <cstring>   // for memcpy
+#include <map>       // for map
+#include <string>    // for string
+#include <vector>    // for vector
+
+using namespace std;
+
+// Keys are conventionally "<ScriptableName>/<field>" so parts with the same type don't collide.
+class Snapshot
+{
+	public:
+		// Stores a copy of the bytes under the given key, replacing any previous value.
+		inline void Put(const string &strKey, const void *pData, size_t uiSize)
+		{
+			const uint8_t *p = static_cast<const uint8_t*>(pData);
+			m_mData[strKey].assign(p, p + uiSize);
+		}
+
+		template<class T>
+		inline void Put(const string &strKey, const T &val)
+		{
+			Put(strKey, &val, sizeof(T));
+		}
+
+		// Copies the stored bytes out. Returns false (leaving pData alone) if
+		// the key is missing or was stored with a different size.
+		inline bool Get(const string &strKey, void *pData, size_t uiSize) const
+		{
+			auto it = m_mData.find(strKey);
+			if (it == m_mData.end() || it->second.size() != uiSize)
+			{
+				fprintf(stderr, "Snapshot: %s is missing or has the wrong size, not restored.\n", strKey.c_str());
+				return false;
+			}
+			memcpy(pData, it->second.data(), uiSize);
+			return true;
+		}
+
+		template<class T>
+		inline bool Get(const string &strKey, T &val) const
+		{
+			return Get(strKey, &val, sizeof(T));
+		}
+
+		inline size_t GetSize() const
+		{
+			size_t uiSize = 0;
+			for (auto &it : m_mData)
+				uiSize += it.second.size();
+			return uiSize;
+		}
+
+		// Whole-snapshot access, for storing them in other forms (see CheckpointRing).
+		inline const map<string, vector<uint8_t>>& GetData() const { return m_mData; }
+		inline vector<uint8_t>& At(const string &strKey) { return m_mData[strKey]; }
+
+	private:
+		map<string, vector<uint8_t>> m_mData;
+};
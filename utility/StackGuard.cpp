@@ -0,0 +1,171 @@
+/*
+	StackGuard.cpp - Watches the simulated MCU's stack pointer for its low-water
+	mark and for running into the heap/static data, and paints the free SRAM
+	so the untouched space can be measured at exit.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StackGuard.h"
+#include <stdio.h>           // for printf, fprintf, stderr
+#include <vector>            // for vector
+#include "ELFSymbols.h"      // for ELFSymbols
+#include "ScriptHost.h"      // for ScriptHost
+#include "TelemetryHost.h"   // for TelemetryHost, TC
+#include "sim_io.h"          // for avr_register_io_write
+
+constexpr uint8_t StackGuard::m_uiPaint;
+
+void StackGuard::AddSymbols(const std::string &strELF)
+{
+	std::vector<ELFSymbols::Symbol_t> vSyms;
+	if (!ELFSymbols::Read(strELF, vSyms))
+		return;
+	const ELFSymbols::Symbol_t *pHeap = ELFSymbols::Find(vSyms, "__heap_start");
+	if (!pHeap)
+		pHeap = ELFSymbols::Find(vSyms, "__bss_end");
+	const ELFSymbols::Symbol_t *pBrk = ELFSymbols::Find(vSyms, "__brkval");
+	if (pHeap)
+		m_uiHeapStart = pHeap->uiAddr - ELFSymbols::m_uiDataOffset;
+	if (pBrk)
+		m_uiBrkval = pBrk->uiAddr - ELFSymbols::m_uiDataOffset;
+}
+
+void StackGuard::Init(avr_t *avr, const std::string &strName)
+{
+	_Init(avr, this);
+	m_strName = strName;
+	auto fcnWrite = [](avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param) { static_cast<StackGuard*>(param)->OnSPWrite(addr, v); };
+	avr_register_io_write(m_pAVR, R_SPL, fcnWrite, this);
+	avr_register_io_write(m_pAVR, R_SPH, fcnWrite, this);
+
+	auto pTH = TelemetryHost::GetHost();
+	pTH->AddTrace(GetIRQ(SP_LOW_OUT), strName + "_SP_low", {TC::Misc}, 16);
+	pTH->AddTrace(GetIRQ(BREACH_OUT), strName + "_stack_breach", {TC::Misc});
+
+	if (!m_uiHeapStart)
+		printf("Stack guard: no __heap_start symbol (not an ELF?), only tracking the lowest SP on %s\n", strName.c_str());
+	else
+	{
+		m_uiPaintFrom = m_uiHeapStart;
+		m_uiMinFree = m_pAVR->ramend + 1U - m_uiHeapStart;
+		Paint(m_uiPaintFrom, m_pAVR->ramend);
+		printf("Stack guard: heap starts at 0x%04x on %s, %u bytes free for heap and stack\n", m_uiHeapStart, strName.c_str(), m_pAVR->ramend + 1U - m_uiHeapStart);
+	}
+}
+
+void StackGuard::Paint(uint16_t uiFrom, uint16_t uiTo)
+{
+	for (uint32_t i=uiFrom; i<=uiTo; i++)
+		m_pAVR->data[i] = m_uiPaint;
+}
+
+uint16_t StackGuard::HeapTop()
+{
+	if (!m_uiBrkval)
+		return m_uiHeapStart;
+	uint16_t uiBrk = m_pAVR->data[m_uiBrkval] | (m_pAVR->data[m_uiBrkval+1]<<8U);
+	return uiBrk ? uiBrk : m_uiHeapStart; // 0 until the first malloc.
+}
+
+void StackGuard::OnSPWrite(avr_io_addr_t addr, uint8_t value)
+{
+	m_pAVR->data[addr] = value;
+	// PUSH/CALL/RET/interrupts write SPL then SPH within the one instruction. Frame setup is
+	// OUT SPH, OUT SREG, OUT SPL. Evaluating halfway through either would see a bogus SP.
+	if (addr == R_SPL)
+	{
+		m_uiSPLCycle = m_pAVR->cycle;
+		if (m_bSPHFirst)
+		{
+			m_bSPHFirst = false;
+			Check();
+		}
+	}
+	else if (m_uiSPLCycle == m_pAVR->cycle)
+		Check();
+	else
+		m_bSPHFirst = true;
+}
+
+void StackGuard::Check()
+{
+	uint16_t uiSP = m_pAVR->data[R_SPL] | (m_pAVR->data[R_SPH]<<8U);
+	if (uiSP < m_uiLowSP)
+	{
+		m_uiLowSP = uiSP;
+		RaiseIRQ(SP_LOW_OUT, uiSP);
+	}
+	if (!m_uiHeapStart)
+		return;
+	uint16_t uiHeapTop = HeapTop();
+	// The stack occupies SP+1..RAMEND, the heap up to (but not including) its top.
+	if (uiSP + 1 >= uiHeapTop)
+	{
+		uint16_t uiFree = uiSP + 1 - uiHeapTop;
+		if (uiFree < m_uiMinFree)
+			m_uiMinFree = uiFree;
+		return;
+	}
+	m_uiMinFree = 0;
+	if (m_bBreached)
+		return;
+	m_bBreached = true;
+	fprintf(stderr, "STACK OVERFLOW on %s: SP 0x%04x has run into the %s (top 0x%04x) at PC 0x%05x, cycle %llu\n", m_strName.c_str(),
+		uiSP, uiHeapTop > m_uiHeapStart ? "heap" : "static data", uiHeapTop, m_pAVR->pc, static_cast<unsigned long long>(m_pAVR->cycle));
+	RaiseIRQ(BREACH_OUT, 1);
+	ScriptHost::Fail("Stack/heap collision on " + m_strName);
+}
+
+void StackGuard::OnAVRReset()
+{
+	m_bBreached = false;
+	m_bSPHFirst = false;
+	RaiseIRQ(BREACH_OUT, 0);
+	if (!m_uiHeapStart)
+		return;
+	// The firmware may already be running again, only paint what is free right now.
+	uint16_t uiSP = m_pAVR->data[R_SPL] | (m_pAVR->data[R_SPH]<<8U);
+	m_uiPaintFrom = HeapTop();
+	if (uiSP >= m_uiPaintFrom)
+		Paint(m_uiPaintFrom, uiSP);
+}
+
+void StackGuard::Print()
+{
+	if (!m_pAVR)
+		return;
+	if (m_uiLowSP > m_pAVR->ramend) // The firmware never set SP.
+		printf("Stack guard for %s: lowest SP n/a", m_strName.c_str());
+	else
+		printf("Stack guard for %s: lowest SP 0x%04x (%u bytes of stack)", m_strName.c_str(), m_uiLowSP, m_pAVR->ramend - m_uiLowSP);
+	if (!m_uiHeapStart)
+	{
+		printf("\n");
+		return;
+	}
+	// Whatever is still painted between the heap and the deepest stack write was never touched.
+	uint32_t uiLow = m_uiPaintFrom;
+	while (uiLow <= m_pAVR->ramend && m_pAVR->data[uiLow] != m_uiPaint)
+		uiLow++;
+	uint32_t uiHigh = uiLow;
+	while (uiHigh <= m_pAVR->ramend && m_pAVR->data[uiHigh] == m_uiPaint)
+		uiHigh++;
+	printf(", closest to the heap %u bytes, %u bytes never touched (0x%04x-0x%04x)%s\n", m_uiMinFree,
+		uiHigh - uiLow, uiLow, uiHigh - 1, m_bBreached ? ". STACK OVERFLOWED." : "");
+}
@@ -0,0 +1,78 @@
+/*
+	StackGuard.h - Watches the simulated MCU's stack pointer for its low-water
+	mark and for running into the heap/static data, and paints the free SRAM
+	so the untouched space can be measured at exit.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint16_t, uint8_t, uint32_t
+#include <string>              // for string
+#include "BasePeripheral.h"    // for BasePeripheral
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t, avr_io_addr_t
+#include "sim_irq.h"           // for avr_irq_t
+
+class StackGuard: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(SP_LOW_OUT,">sp_low.out") _IRQ(BREACH_OUT,">breach.out")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the boards are created.
+		static void SetEnabled(bool bVal) { GetEnabled() = bVal; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		// Picks up __heap_start (or __bss_end) and __brkval from the firmware ELF/AFX.
+		// Without them only the low-water mark is tracked.
+		void AddSymbols(const std::string &strELF);
+
+		// Hooks SPL/SPH and paints the free SRAM. Call after the firmware is loaded.
+		void Init(avr_t *avr, const std::string &strName);
+
+		// Repaints what is free after a reset and re-arms the breach report.
+		void OnAVRReset();
+
+		// Prints the stack and free RAM figures.
+		void Print();
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		void OnSPWrite(avr_io_addr_t addr, uint8_t value);
+
+		// Evaluates SP once both halves are in.
+		void Check();
+
+		// Top of the heap: __brkval if malloc has been called, otherwise __heap_start.
+		uint16_t HeapTop();
+
+		void Paint(uint16_t uiFrom, uint16_t uiTo);
+
+		std::string m_strName;
+		uint16_t m_uiHeapStart = 0, m_uiBrkval = 0; // Data addresses, 0 if unknown.
+		uint16_t m_uiLowSP = 0xFFFF, m_uiMinFree = 0xFFFF;
+		uint16_t m_uiPaintFrom = 0;
+		avr_cycle_count_t m_uiSPLCycle = ~0ULL;
+		bool m_bSPHFirst = false; // An OUT to SPH, its SPL write is still to come.
+		bool m_bBreached = false;
+
+		static constexpr uint8_t m_uiPaint = 0xC5;
+};
@@ -0,0 +1,121 @@
+/*
+	StartupTimeline.cpp - Wall-clock timeline of MK404's startup, as a Chrome trace.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StartupTimeline.h"
+#include <pthread.h>  // for pthread_getname_np, pthread_self
+#include <stdio.h>    // for fprintf, fopen, fclose, perror, printf
+#include <chrono>     // for steady_clock, duration_cast, microseconds
+
+// Close enough to the start of the process, it's set before main() runs.
+static const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+
+uint64_t StartupTimeline::Now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+unsigned int StartupTimeline::GetThread(State_t &state)
+{
+	static thread_local int iThread = -1;
+	if (iThread < 0)
+	{
+		char szName[32] = "";
+		pthread_getname_np(pthread_self(), szName, sizeof(szName));
+		iThread = state.vThreads.size();
+		state.vThreads.push_back(szName[0] ? szName : "thread " + std::to_string(iThread));
+	}
+	return iThread;
+}
+
+void StartupTimeline::Add(const std::string &strName, uint64_t uiStart, uint64_t uiEnd)
+{
+	State_t &state = GetState();
+	std::lock_guard<std::mutex> lock(state.lock);
+	state.vEvents.push_back({strName, uiStart, uiEnd, GetThread(state), false});
+}
+
+void StartupTimeline::OnRun()
+{
+	State_t &state = GetState();
+	std::lock_guard<std::mutex> lock(state.lock);
+	state.uiRun = Now();
+	state.vEvents.push_back({"AVR started", state.uiRun, state.uiRun, GetThread(state), true});
+}
+
+void StartupTimeline::OnFirmwareStart()
+{
+	State_t &state = GetState();
+	{
+		std::lock_guard<std::mutex> lock(state.lock);
+		if (state.bStarted)
+			return; // A reset, not startup.
+		state.bStarted = true;
+		uint64_t uiNow = Now();
+		unsigned int uiThread = GetThread(state);
+		state.vEvents.push_back({"firmware boot, to \"start\"", state.uiRun, uiNow, uiThread, false});
+		state.vEvents.push_back({"\"start\"", uiNow, uiNow, uiThread, true});
+		if (IsEnabled())
+			printf("StartupTimeline: The firmware said \"start\" %.3f s after launch.\n", uiNow/1e6);
+	}
+	Write();
+}
+
+// Our own names only, but they do have quotes in them.
+static std::string Escape(const std::string &strIn)
+{
+	std::string strOut;
+	for (char c : strIn)
+	{
+		if (c == '"' || c == '\\')
+			strOut.push_back('\\');
+		strOut.push_back(c);
+	}
+	return strOut;
+}
+
+void StartupTimeline::Write()
+{
+	State_t &state = GetState();
+	if (!IsEnabled())
+		return;
+	std::lock_guard<std::mutex> lock(state.lock);
+	FILE *fOut = fopen(state.strFile.c_str(), "w");
+	if (!fOut)
+	{
+		perror(state.strFile.c_str());
+		return;
+	}
+	fprintf(fOut, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fOut, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"MK404\"}}");
+	for (size_t i=0; i<state.vThreads.size(); i++)
+		fprintf(fOut, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", i, Escape(state.vThreads[i]).c_str());
+	for (auto &event : state.vEvents)
+	{
+		if (event.bInstant)
+			fprintf(fOut, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%llu,\"pid\":1,\"tid\":%u}", Escape(event.strName).c_str(),
+				static_cast<unsigned long long>(event.uiStart), event.uiThread);
+		else
+			fprintf(fOut, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u}", Escape(event.strName).c_str(),
+				static_cast<unsigned long long>(event.uiStart), static_cast<unsigned long long>(event.uiEnd - event.uiStart), event.uiThread);
+	}
+	fprintf(fOut, "\n]}\n");
+	fclose(fOut);
+}
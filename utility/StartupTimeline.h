@@ -0,0 +1,87 @@
+/*
+	StartupTimeline.h - Wall-clock timeline of MK404's startup, as a Chrome trace.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>  // for uint64_t
+#include <mutex>     // for mutex
+#include <string>    // for string
+#include <vector>    // for vector
+
+// Phases are always recorded (there are a few dozen, it costs nothing), so those timed before the
+// command line says where the trace goes aren't lost. With --startup-trace they are written out,
+// in the trace event format chrome://tracing and Perfetto open, once the firmware prints "start"
+// and again on the way out for anything after. Times are microseconds since the process started,
+// each thread on its own track.
+class StartupTimeline
+{
+	public:
+		// Times the scope it lives in, nested phases show under it.
+		class Phase
+		{
+			public:
+				explicit Phase(const std::string &strName):m_strName(strName),m_uiStart(Now()){};
+				~Phase() { Add(m_strName, m_uiStart, Now()); }
+			private:
+				std::string m_strName;
+				uint64_t m_uiStart;
+		};
+
+		static inline void SetFile(const std::string &strFile) { GetState().strFile = strFile; }
+		static inline bool IsEnabled() { return !GetState().strFile.empty(); }
+
+		// Microseconds since the process started.
+		static uint64_t Now();
+
+		// A phase that couldn't be a scope, from uiStart until uiEnd.
+		static void Add(const std::string &strName, uint64_t uiStart, uint64_t uiEnd);
+
+		// The AVR threads are running, the next step is the firmware's "start".
+		static void OnRun();
+		// Called for each "start" line from the firmware, the first ends the startup.
+		static void OnFirmwareStart();
+
+		// (Re)writes the trace with everything so far, if enabled.
+		static void Write();
+
+	private:
+		typedef struct Event_t
+		{
+			std::string strName;
+			uint64_t uiStart, uiEnd;
+			unsigned int uiThread;
+			bool bInstant;
+		} Event_t;
+
+		typedef struct State_t
+		{
+			std::string strFile;
+			std::mutex lock;
+			std::vector<Event_t> vEvents;
+			std::vector<std::string> vThreads; // Names, by track
+			uint64_t uiRun = 0;
+			bool bStarted = false;
+		} State_t;
+
+		static State_t& GetState() { static State_t state; return state; }
+		// This thread's track, named on first use. Call with the lock held.
+		static unsigned int GetThread(State_t &state);
+};
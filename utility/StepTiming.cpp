@@ -0,0 +1,118 @@
+/*
+	StepTiming.cpp - Per-axis step interval, jitter and acceleration statistics.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "StepTiming.h"
+#include <stdio.h>          // for printf
+#include <algorithm>        // for max, min
+#include "TelemetryHost.h"  // for TelemetryHost, TC
+
+void StepTiming::Init(avr_t *avr, const std::string &strAxis)
+{
+	_Init(avr, this);
+	m_strAxis = strAxis;
+	m_uiGapCycles = avr_usec_to_cycles(avr, m_uiGapUs);
+	auto pTH = TelemetryHost::GetHost();
+	pTH->AddTrace(GetIRQ(JITTER_OUT), strAxis, {TC::Stepper}, 32);
+	pTH->AddTrace(GetIRQ(SPEED_OUT), strAxis, {TC::Stepper}, 32);
+	pTH->AddTrace(GetIRQ(ACCEL_OUT), strAxis, {TC::Stepper}, 32);
+}
+
+void StepTiming::OnInterval(avr_cycle_count_t uiCycle)
+{
+	const uint32_t uiK = m_uiSteps - 1U; // This step's index in the move
+	m_hInterval.Add(uiCycle - m_uiLast[(uiK - 1U) % m_uiWindow]);
+	if (m_uiSteps >= m_uiWindow)
+	{
+		// The interval between steps k-9 and k-8 against the average over k-17..k, both centred on k-8.5.
+		int64_t iSpan = uiCycle - m_uiLast[(uiK + 1U) % m_uiWindow]; // Step k-17 is the slot after k.
+		int64_t iActual = m_uiLast[(uiK - 8U) % m_uiWindow] - m_uiLast[(uiK - 9U) % m_uiWindow];
+		int64_t iDev = 17*iActual - iSpan;
+		avr_cycle_count_t uiJitter = ((iDev < 0 ? -iDev : iDev) + 8)/17;
+		m_hJitter.Add(uiJitter);
+		if (uiJitter > m_uiMoveJitter)
+			m_uiMoveJitter = uiJitter;
+		if (uiJitter > m_uiWorstJitter)
+		{
+			m_uiWorstJitter = uiJitter;
+			m_uiWorstAt = uiCycle;
+		}
+	}
+	if (m_uiSteps % m_uiBlock == 1U && m_uiSteps > m_uiBlock)
+	{
+		avr_cycle_count_t uiStart = m_uiLast[(uiK - m_uiBlock) % m_uiWindow];
+		double dRate = static_cast<double>(m_uiBlock)*m_pAVR->frequency/(uiCycle - uiStart);
+		avr_cycle_count_t uiMid = uiStart + (uiCycle - uiStart)/2U;
+		if (m_uiBlockMid)
+		{
+			double dAccel = (dRate - m_dBlockRate)*m_pAVR->frequency/(uiMid - m_uiBlockMid);
+			m_dMoveAccel = std::max(m_dMoveAccel, dAccel);
+			m_dMoveDecel = std::min(m_dMoveDecel, dAccel);
+		}
+		m_dBlockRate = dRate;
+		m_uiBlockMid = uiMid;
+		m_dMovePeak = std::max(m_dMovePeak, dRate);
+	}
+}
+
+void StepTiming::EndMove()
+{
+	if (m_uiSteps > 1U)
+	{
+		m_uiMoves++;
+		m_uiStepsTotal += m_uiSteps;
+		m_dPeak = std::max(m_dPeak, m_dMovePeak);
+		m_dAccel = std::max(m_dAccel, m_dMoveAccel);
+		m_dDecel = std::min(m_dDecel, m_dMoveDecel);
+		RaiseIRQ(JITTER_OUT, static_cast<uint32_t>(m_uiMoveJitter*1000000000ULL/m_pAVR->frequency));
+		RaiseIRQ(SPEED_OUT, static_cast<uint32_t>(m_dMovePeak*60.0/m_fStepsPerMM + 0.5));
+		RaiseIRQ(ACCEL_OUT, static_cast<uint32_t>(std::max(m_dMoveAccel, -m_dMoveDecel)/m_fStepsPerMM + 0.5));
+	}
+	m_uiSteps = 0;
+	m_uiMoveJitter = m_uiBlockMid = 0;
+	m_dBlockRate = m_dMovePeak = m_dMoveAccel = m_dMoveDecel = 0;
+}
+
+void StepTiming::Clear()
+{
+	m_hInterval = Histogram();
+	m_hJitter = Histogram();
+	m_uiMoves = m_uiStepsTotal = 0;
+	m_uiWorstJitter = m_uiWorstAt = 0;
+	m_dPeak = m_dAccel = m_dDecel = 0;
+	m_uiStart = m_pAVR ? m_pAVR->cycle : 0;
+}
+
+void StepTiming::Print()
+{
+	if (!m_pAVR)
+		return;
+	double dUsPerCycle = 1e6/m_pAVR->frequency;
+	printf("Step timing for %s over %.3f s simulated: %llu moves, %llu steps (the move in progress not counted).\n", m_strAxis.c_str(),
+		(m_pAVR->cycle - m_uiStart)*dUsPerCycle/1e6, static_cast<unsigned long long>(m_uiMoves), static_cast<unsigned long long>(m_uiStepsTotal));
+	if (!m_hInterval.GetCount())
+		return;
+	printf("  Interval us: min %.2f, p50 %.2f, p99 %.2f, max %.2f\n", m_hInterval.GetMin()*dUsPerCycle, m_hInterval.GetPercentile(50)*dUsPerCycle,
+		m_hInterval.GetPercentile(99)*dUsPerCycle, m_hInterval.GetMax()*dUsPerCycle);
+	printf("  Jitter us:   p50 %.2f, p99 %.2f, p99.9 %.2f, max %.2f (at %.6f s)\n", m_hJitter.GetPercentile(50)*dUsPerCycle, m_hJitter.GetPercentile(99)*dUsPerCycle,
+		m_hJitter.GetPercentile(99.9)*dUsPerCycle, m_uiWorstJitter*dUsPerCycle, m_uiWorstAt*dUsPerCycle/1e6);
+	printf("  Peak %.1f mm/s, acceleration up to %.0f mm/s^2, deceleration up to %.0f mm/s^2\n", m_dPeak/m_fStepsPerMM,
+		m_dAccel/m_fStepsPerMM, -m_dDecel/m_fStepsPerMM);
+}
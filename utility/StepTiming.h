@@ -0,0 +1,93 @@
+/*
+	StepTiming.h - Per-axis step interval, jitter and acceleration statistics.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint64_t
+#include <string>              // for string
+#include "BasePeripheral.h"    // for BasePeripheral
+#include "Histogram.h"         // for Histogram
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+
+// Fed every step of one driver, in O(1). A move is a run of steps in one direction without a pause.
+// Jitter is how far each interval is from the sliding 17-step average centred on it, which is the
+// ideal for a smoothly accelerating (trapezoid) profile to well under a cycle at real accelerations,
+// so it measures the stepper ISR's timing error. Speed and acceleration come from 8-step blocks.
+// At the end of each move its worst jitter (ns), peak speed (mm/min) and peak acceleration (mm/s^2)
+// are raised on the outputs, which are telemetry (Stepper) for traces and WaitForCmp.
+// Double/quad stepping shows as jitter of up to the ISR period by design; compare runs, not absolutes.
+class StepTiming: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(JITTER_OUT,"32>step_timing.jitter_ns") _IRQ(SPEED_OUT,"32>step_timing.speed") _IRQ(ACCEL_OUT,"32>step_timing.accel")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the printers are created.
+		static void SetEnabled(bool bEnabled) { GetEnabled() = bEnabled; }
+		static inline bool IsEnabled() { return GetEnabled(); }
+
+		void Init(avr_t *avr, const std::string &strAxis);
+
+		inline void SetStepsPerMM(float fSteps) { m_fStepsPerMM = fSteps; }
+
+		inline void OnStep(avr_cycle_count_t uiCycle)
+		{
+			if (m_uiSteps && uiCycle - m_uiLast[(m_uiSteps - 1U) % m_uiWindow] > m_uiGapCycles)
+				EndMove(); // Also catches time going backwards on a rewind.
+			m_uiLast[m_uiSteps % m_uiWindow] = uiCycle;
+			m_uiSteps++;
+			if (m_uiSteps > 1U)
+				OnInterval(uiCycle);
+		}
+
+		// Direction change or standstill.
+		void EndMove();
+
+		// Prints the statistics since startup (or the last Clear) to stdout.
+		void Print();
+		void Clear();
+
+	private:
+		static bool& GetEnabled() { static bool bEnabled = false; return bEnabled; }
+
+		void OnInterval(avr_cycle_count_t uiCycle);
+
+		static constexpr unsigned int m_uiWindow = 18, m_uiBlock = 8;
+
+		std::string m_strAxis;
+		float m_fStepsPerMM = 1;
+		avr_cycle_count_t m_uiGapCycles = 0;
+
+		// The move in progress.
+		avr_cycle_count_t m_uiLast[m_uiWindow] = {0};
+		uint32_t m_uiSteps = 0;
+		avr_cycle_count_t m_uiMoveJitter = 0, m_uiBlockMid = 0;
+		double m_dBlockRate = 0, m_dMovePeak = 0, m_dMoveAccel = 0, m_dMoveDecel = 0; // steps/s, steps/s^2
+
+		// Everything since the last Clear.
+		Histogram m_hInterval, m_hJitter; // cycles
+		uint64_t m_uiMoves = 0, m_uiStepsTotal = 0;
+		avr_cycle_count_t m_uiWorstJitter = 0, m_uiWorstAt = 0, m_uiStart = 0;
+		double m_dPeak = 0, m_dAccel = 0, m_dDecel = 0;
+
+		static constexpr uint32_t m_uiGapUs = 20000; // Slower than 50 steps/s is a pause.
+};
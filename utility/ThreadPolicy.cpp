@@ -0,0 +1,196 @@
+/*
+	ThreadPolicy.cpp - Names the simulator's threads and places them on CPUs by role.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ThreadPolicy.h"
+#include <errno.h>         // for errno
+#include <pthread.h>       // for pthread_self, pthread_setname_np, pthread_setaffinity_np
+#include <sched.h>         // for sched_param, SCHED_FIFO, SCHED_OTHER, CPU_SET
+#include <stdio.h>         // for fprintf, printf, stderr
+#include <stdlib.h>        // for strtol
+#include <string.h>        // for strerror
+#include <sys/resource.h>  // for setpriority, getpriority, PRIO_PROCESS
+#ifdef __linux__
+#include <sys/syscall.h>   // for SYS_gettid
+#include <unistd.h>        // for syscall
+#endif
+
+static const char* const szRoles[] = {"avr", "gl", "io", "audio", "worker"};
+static_assert(sizeof(szRoles)/sizeof(szRoles[0]) == static_cast<size_t>(ThreadPolicy::Role::Count), "A name for every role");
+
+bool ThreadPolicy::ParseInt(const std::string &strVal, int iMin, int iMax, int &iVal)
+{
+	char *pEnd = nullptr;
+	long lVal = strtol(strVal.c_str(), &pEnd, 10);
+	if (strVal.empty() || *pEnd || lVal < iMin || lVal > iMax)
+		return false;
+	iVal = static_cast<int>(lVal);
+	return true;
+}
+
+bool ThreadPolicy::ParseCPUs(const std::string &strList, std::vector<int> &vCPUs)
+{
+	size_t uiStart = 0;
+	while (uiStart <= strList.size())
+	{
+		size_t uiEnd = strList.find(',', uiStart);
+		std::string strRange = strList.substr(uiStart, uiEnd == std::string::npos ? std::string::npos : uiEnd - uiStart);
+		size_t uiDash = strRange.find('-');
+		int iFirst, iLast;
+		if (!ParseInt(strRange.substr(0, uiDash), 0, 1023, iFirst))
+			return false;
+		iLast = iFirst;
+		if (uiDash != std::string::npos && (!ParseInt(strRange.substr(uiDash + 1), iFirst, 1023, iLast)))
+			return false;
+		for (int i = iFirst; i <= iLast; i++)
+			vCPUs.push_back(i);
+		if (uiEnd == std::string::npos)
+			break;
+		uiStart = uiEnd + 1;
+	}
+	return !vCPUs.empty();
+}
+
+bool ThreadPolicy::Configure(const std::vector<std::string> &vSpecs)
+{
+	State_t &state = GetState();
+	for (auto &strSpec : vSpecs)
+	{
+		size_t uiColon = strSpec.find(':');
+		std::string strRole = strSpec.substr(0, uiColon);
+		int iRole = -1;
+		for (int i = 0; i < static_cast<int>(Role::Count); i++)
+			if (strRole.compare(szRoles[i])==0)
+				iRole = i;
+		if (iRole < 0 || uiColon == std::string::npos)
+		{
+			fprintf(stderr, "--thread %s: expected role:key=value, roles being avr, gl, io, audio and worker.\n", strSpec.c_str());
+			return false;
+		}
+		Policy_t &policy = state.policies[iRole];
+		size_t uiStart = uiColon + 1;
+		while (uiStart < strSpec.size())
+		{
+			size_t uiEnd = strSpec.find(':', uiStart);
+			std::string strItem = strSpec.substr(uiStart, uiEnd == std::string::npos ? std::string::npos : uiEnd - uiStart);
+			size_t uiEq = strItem.find('=');
+			std::string strKey = strItem.substr(0, uiEq), strVal = uiEq == std::string::npos ? "" : strItem.substr(uiEq + 1);
+			bool bOK = false;
+			if (strKey == "cpus" || strKey == "pin")
+			{
+				policy.vCPUs.clear();
+				policy.bPin = strKey == "pin";
+				bOK = ParseCPUs(strVal, policy.vCPUs);
+			}
+			else if (strKey == "fifo")
+				bOK = ParseInt(strVal, 1, 99, policy.iFifo);
+			else if (strKey == "nice")
+				bOK = policy.bNice = ParseInt(strVal, -20, 19, policy.iNice);
+			if (!bOK)
+			{
+				fprintf(stderr, "--thread %s: bad '%s', see --thread ?\n", strSpec.c_str(), strItem.c_str());
+				return false;
+			}
+			if (uiEnd == std::string::npos)
+				break;
+			uiStart = uiEnd + 1;
+		}
+		state.bAny = true;
+	}
+	if (!state.bAny)
+		return true;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set)==0)
+		for (int i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &set))
+				state.vStartCPUs.push_back(i);
+#endif
+	errno = 0;
+	state.iStartNice = getpriority(PRIO_PROCESS, 0);
+	if (errno)
+		state.iStartNice = 0;
+	return true;
+}
+
+void ThreadPolicy::Apply(Role role, const std::string &strName)
+{
+	std::string strShort = strName.substr(0, 15); // The kernel's limit, less the terminator
+#if defined(__APPLE__)
+	pthread_setname_np(strShort.c_str());
+#else
+	pthread_setname_np(pthread_self(), strShort.c_str());
+#endif
+	State_t &state = GetState();
+	if (!state.bAny)
+		return;
+	Policy_t &policy = state.policies[static_cast<int>(role)];
+
+#ifdef __linux__
+	std::vector<int> vCPUs = policy.vCPUs.empty() ? state.vStartCPUs : policy.vCPUs;
+	if (policy.bPin)
+		vCPUs = {policy.vCPUs.at(policy.uiNext++ % policy.vCPUs.size())};
+	if (!vCPUs.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int iCPU : vCPUs)
+			CPU_SET(iCPU, &set);
+		int iErr = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (iErr)
+			fprintf(stderr, "%s: Failed to set the CPU affinity: %s\n", strShort.c_str(), strerror(iErr));
+		else if (!policy.vCPUs.empty())
+			printf("%s: on CPU%s %d%s\n", strShort.c_str(), vCPUs.size()>1 ? "s" : "", vCPUs.front(), vCPUs.size()>1 ? "..." : "");
+	}
+
+	// The thread's own nice in Linux; SCHED_FIFO ignores it, so set it first.
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), policy.bNice ? policy.iNice : state.iStartNice) < 0 && policy.bNice)
+		fprintf(stderr, "%s: Failed to set nice %d: %s\n", strShort.c_str(), policy.iNice, strerror(errno));
+
+	sched_param param {};
+	param.sched_priority = policy.iFifo;
+	int iErr = pthread_setschedparam(pthread_self(), policy.iFifo ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (iErr && policy.iFifo)
+		fprintf(stderr, "%s: Failed to set SCHED_FIFO %d: %s\n", strShort.c_str(), policy.iFifo, strerror(iErr));
+#else
+	if (!policy.vCPUs.empty() || policy.iFifo)
+		fprintf(stderr, "%s: CPU affinity and SCHED_FIFO are only supported on Linux.\n", strShort.c_str());
+	if (policy.bNice && setpriority(PRIO_PROCESS, 0, policy.iNice) < 0)
+		fprintf(stderr, "%s: Failed to set nice %d: %s\n", strShort.c_str(), policy.iNice, strerror(errno));
+#endif
+}
+
+void ThreadPolicy::PrintHelp()
+{
+	printf("--thread role:key=value[:key=value...], may be given more than once.\n");
+	printf("Roles:\n");
+	printf("\tavr     simulated MCUs, one thread each (an MMU on --mmu-same-thread shares the printer's)\n");
+	printf("\tgl      the window's main loop and the print mesher\n");
+	printf("\tio      serial PTYs, --remote, --gdb, --metrics and the G-code sniffer\n");
+	printf("\taudio   the beeper's SDL callback\n");
+	printf("\tworker  log, trace, toolpath, capture and EEPROM writers\n");
+	printf("Keys:\n");
+	printf("\tcpus=LIST  run on any CPU of LIST, e.g. 2-5 or 0,1,6\n");
+	printf("\tpin=LIST   give each thread of the role its own CPU from LIST, in turn\n");
+	printf("\tfifo=N     real-time SCHED_FIFO priority 1-99 (needs CAP_SYS_NICE or an rtprio limit)\n");
+	printf("\tnice=N     nice level -20 to 19\n");
+	printf("e.g. --thread avr:pin=2-7:fifo=10 --thread gl:cpus=0-1 --thread worker:cpus=0-1:nice=10\n");
+}
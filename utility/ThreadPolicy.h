@@ -0,0 +1,83 @@
+/*
+	ThreadPolicy.h - Names the simulator's threads and places them on CPUs by role.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>  // for atomic
+#include <string>  // for string
+#include <vector>  // for vector
+
+// Every thread calls Apply with its role first thing, which names it (for top -H, gdb, perf) and,
+// if that role was configured with --thread, sets its CPUs, scheduling class and nice level.
+// A spec is role:key=value[:key=value...], keys being
+//	cpus=LIST  may run on any of LIST (e.g. 0-3,6)
+//	pin=LIST   the Nth thread of the role gets the Nth CPU of LIST alone, wrapping around
+//	fifo=N     SCHED_FIFO at priority N (1-99, needs CAP_SYS_NICE or an rtprio limit)
+//	nice=N     nice level N (-20 to 19; below the current one needs privileges)
+// Threads inherit these from whoever created them, so once anything is configured, a thread
+// applies the startup affinity, class and nice for whatever its own role leaves unset.
+// Affinity and SCHED_FIFO are Linux only; elsewhere they are reported as unsupported.
+class ThreadPolicy
+{
+	public:
+		enum class Role
+		{
+			AVR,    // Board::RunAVR, one per simulated MCU (boards sharing a thread are one)
+			GL,     // The GLUT main loop and the print mesher
+			IO,     // Serial/PTY reactor, remote control, GDB, metrics, G-code sniffer
+			Audio,  // The SDL callback thread
+			Worker, // Log, trace, toolpath, capture and EEPROM writers
+			Count
+		};
+
+		// Parses the --thread specs, printing what is wrong. Call once on the main thread at
+		// startup, before any threads are made.
+		static bool Configure(const std::vector<std::string> &vSpecs);
+
+		// Names the calling thread strName (cut to 15 characters) and applies its role's policy.
+		static void Apply(Role role, const std::string &strName);
+
+		static void PrintHelp();
+
+	private:
+		typedef struct Policy_t
+		{
+			std::vector<int> vCPUs;
+			bool bPin = false;
+			int iFifo = 0;  // 0 is SCHED_OTHER
+			bool bNice = false;
+			int iNice = 0;
+			std::atomic<unsigned int> uiNext {0}; // Threads of this role so far, for pin=
+		} Policy_t;
+
+		typedef struct State_t
+		{
+			Policy_t policies[static_cast<int>(Role::Count)];
+			bool bAny = false;
+			std::vector<int> vStartCPUs; // Affinity at startup
+			int iStartNice = 0;
+		} State_t;
+
+		static State_t& GetState() { static State_t state; return state; }
+
+		static bool ParseCPUs(const std::string &strList, std::vector<int> &vCPUs);
+		static bool ParseInt(const std::string &strVal, int iMin, int iMax, int &iVal);
+};
@@ -0,0 +1,236 @@
+/*
+	TimerWheel.cpp - Hierarchical timer wheel that carries the peripheral cycle timers
+	on top of a single simavr one.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TimerWheel.h"
+#include <map>      // for map
+#include <memory>   // for unique_ptr
+#include <mutex>    // for mutex, lock_guard
+#include <vector>   // for vector
+
+constexpr unsigned int TimerWheel::m_uiBits;
+constexpr unsigned int TimerWheel::m_uiSlots;
+constexpr unsigned int TimerWheel::m_uiLevels;
+
+TimerWheel& TimerWheel::Get(avr_t *avr)
+{
+	static std::mutex lock;
+	static std::map<avr_t*, std::unique_ptr<TimerWheel>> mWheels;
+	std::lock_guard<std::mutex> guard(lock);
+	std::unique_ptr<TimerWheel> &pWheel = mWheels[avr];
+	if (!pWheel)
+		pWheel.reset(new TimerWheel(avr));
+	return *pWheel;
+}
+
+TimerWheel::TimerWheel(avr_t *avr):m_pAVR(avr)
+{
+	m_uiNow = avr->cycle;
+	m_hook.io.kind = "timerwheel";
+	m_hook.io.reset = OnReset;
+	m_hook.pWheel = this;
+	avr_register_io(avr, &m_hook.io);
+}
+
+TimerWheel::Node_t* TimerWheel::Find(avr_cycle_timer_t fcn, void *param, bool bCreate)
+{
+	auto it = m_mNodes.find({fcn, param});
+	if (it != m_mNodes.end())
+		return it->second;
+	if (!bCreate)
+		return nullptr;
+	m_dNodes.push_back({fcn, param, 0, nullptr, nullptr, 0, 0, false});
+	m_mNodes[{fcn, param}] = &m_dNodes.back();
+	return &m_dNodes.back();
+}
+
+void TimerWheel::Place(Node_t *p)
+{
+	avr_cycle_count_t uiDiff = p->uiWhen ^ m_uiNow;
+	unsigned int uiLevel = uiDiff ? (63U - __builtin_clzll(uiDiff))/m_uiBits : 0;
+	unsigned int uiSlot = (p->uiWhen >> (uiLevel*m_uiBits)) & (m_uiSlots - 1U);
+	Node_t *&pHead = m_pSlots[uiLevel][uiSlot];
+	p->uiLevel = uiLevel;
+	p->uiSlot = uiSlot;
+	p->pPrev = nullptr;
+	p->pNext = pHead;
+	if (pHead)
+		pHead->pPrev = p;
+	pHead = p;
+	m_uiOccupied[uiLevel] |= 1ULL << uiSlot;
+	p->bArmed = true;
+}
+
+void TimerWheel::Unlink(Node_t *p)
+{
+	if (p->pPrev)
+		p->pPrev->pNext = p->pNext;
+	else if (!(m_pSlots[p->uiLevel][p->uiSlot] = p->pNext))
+		m_uiOccupied[p->uiLevel] &= ~(1ULL << p->uiSlot);
+	if (p->pNext)
+		p->pNext->pPrev = p->pPrev;
+	p->pPrev = p->pNext = nullptr;
+	p->bArmed = false;
+}
+
+void TimerWheel::Arm(Node_t *p, avr_cycle_count_t uiWhen)
+{
+	if (p->bArmed)
+		Unlink(p);
+	p->uiWhen = uiWhen < m_uiNow ? m_uiNow : uiWhen;
+	Place(p);
+	// While processing, the return value of OnTimer takes care of this.
+	if (!m_bProcessing && (!m_uiArmedAt || p->uiWhen < m_uiArmedAt))
+	{
+		m_uiArmedAt = p->uiWhen;
+		avr_cycle_timer_register(m_pAVR, m_uiArmedAt > m_pAVR->cycle ? m_uiArmedAt - m_pAVR->cycle : 0, OnTimer, this);
+	}
+}
+
+void TimerWheel::Register(avr_cycle_timer_t fcn, void *param, avr_cycle_count_t uiWhen)
+{
+	Arm(Find(fcn, param, true), uiWhen);
+}
+
+void TimerWheel::Cancel(avr_cycle_timer_t fcn, void *param)
+{
+	// The simavr timer is left as is, waking up early to nothing is cheaper than moving it.
+	Node_t *p = Find(fcn, param, false);
+	if (p && p->bArmed)
+		Unlink(p);
+}
+
+avr_cycle_count_t TimerWheel::Status(avr_cycle_timer_t fcn, void *param)
+{
+	Node_t *p = Find(fcn, param, false);
+	if (!p || !p->bArmed)
+		return 0;
+	return p->uiWhen > m_pAVR->cycle ? p->uiWhen - m_pAVR->cycle : 1;
+}
+
+bool TimerWheel::NextEvent(avr_cycle_count_t &uiWhen, unsigned int &uiLevel, unsigned int &uiSlot)
+{
+	// Level l only holds deadlines past the span of level l-1, so the lowest occupied level has the earliest.
+	for (uiLevel = 0; uiLevel < m_uiLevels; uiLevel++)
+	{
+		if (!m_uiOccupied[uiLevel])
+			continue;
+		unsigned int uiShift = uiLevel*m_uiBits;
+		uiSlot = __builtin_ctzll(m_uiOccupied[uiLevel]);
+		avr_cycle_count_t uiBase = (uiShift + m_uiBits) < 64 ? (m_uiNow >> (uiShift + m_uiBits)) << (uiShift + m_uiBits) : 0;
+		uiWhen = uiBase | (static_cast<avr_cycle_count_t>(uiSlot) << uiShift);
+		if (uiWhen < m_uiNow)
+			uiWhen = m_uiNow;
+		return true;
+	}
+	return false;
+}
+
+avr_cycle_count_t TimerWheel::OnTimer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	return static_cast<TimerWheel*>(param)->Process(avr);
+}
+
+avr_cycle_count_t TimerWheel::Process(avr_t *avr)
+{
+	m_bProcessing = true;
+	avr_cycle_count_t uiNext;
+	unsigned int uiLevel, uiSlot;
+	while (NextEvent(uiNext, uiLevel, uiSlot) && uiNext <= avr->cycle)
+	{
+		m_uiNow = uiNext;
+		if (uiLevel > 0)
+		{
+			// Cascade: the slot's span has started, spread it over the finer levels.
+			Node_t *p = m_pSlots[uiLevel][uiSlot];
+			m_pSlots[uiLevel][uiSlot] = nullptr;
+			m_uiOccupied[uiLevel] &= ~(1ULL << uiSlot);
+			while (p)
+			{
+				Node_t *pNext = p->pNext;
+				Place(p);
+				p = pNext;
+			}
+			continue;
+		}
+		// One at a time, the callback may cancel or register any of the others.
+		Node_t *p = m_pSlots[0][uiSlot];
+		Unlink(p);
+		avr_cycle_count_t uiWhen = p->uiWhen;
+		do
+			uiWhen = p->fcn(avr, uiWhen, p->param);
+		while (uiWhen && uiWhen <= avr->cycle && !p->bArmed);
+		// One that registered itself again from the callback keeps that instead.
+		if (uiWhen && !p->bArmed)
+			Arm(p, uiWhen);
+	}
+	m_bProcessing = false;
+	m_uiArmedAt = NextEvent(uiNext, uiLevel, uiSlot) ? uiNext : 0;
+	return m_uiArmedAt;
+}
+
+void TimerWheel::OnReset(avr_io_t *io)
+{
+	reinterpret_cast<ResetHook_t*>(io)->pWheel->Reset();
+}
+
+void TimerWheel::Reset()
+{
+	// avr_reset has just dropped the simavr timers, ours go with them.
+	for (auto &node : m_dNodes)
+	{
+		node.pPrev = node.pNext = nullptr;
+		node.bArmed = false;
+	}
+	for (unsigned int i=0; i<m_uiLevels; i++)
+	{
+		m_uiOccupied[i] = 0;
+		for (unsigned int j=0; j<m_uiSlots; j++)
+			m_pSlots[i][j] = nullptr;
+	}
+	m_uiNow = 0;
+	m_uiArmedAt = 0;
+}
+
+void TimerWheel::SaveState(Snapshot &snap)
+{
+	std::vector<Saved_t> vTimers;
+	for (auto &node : m_dNodes)
+		if (node.bArmed)
+			vTimers.push_back({node.fcn, node.param, node.uiWhen});
+	snap.Put("TimerWheel/count", static_cast<uint32_t>(vTimers.size()));
+	snap.Put("TimerWheel/timers", vTimers.data(), vTimers.size()*sizeof(Saved_t));
+}
+
+void TimerWheel::LoadState(const Snapshot &snap)
+{
+	uint32_t uiCount = 0;
+	if (!snap.Get("TimerWheel/count", uiCount))
+		return;
+	std::vector<Saved_t> vTimers(uiCount);
+	if (uiCount && !snap.Get("TimerWheel/timers", vTimers.data(), uiCount*sizeof(Saved_t)))
+		return;
+	Reset();
+	// The restored simavr list may or may not hold our timer, register it afresh.
+	m_uiNow = m_pAVR->cycle;
+	for (auto &timer : vTimers)
+		Arm(Find(timer.fcn, timer.param, true), timer.uiWhen);
+}
@@ -0,0 +1,135 @@
+/*
+	TimerWheel.h - Hierarchical timer wheel that carries the peripheral cycle timers
+	on top of a single simavr one.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint64_t, uint8_t, uintptr_t
+#include <deque>               // for deque
+#include <functional>          // for hash
+#include <unordered_map>       // for unordered_map
+#include "Snapshot.h"          // for Snapshot
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_cycle_timers.h"  // for avr_cycle_timer_t
+#include "sim_io.h"            // for avr_io_t
+
+// simavr keeps its cycle timers in a fixed pool (MAX_CYCLE_TIMERS) as a sorted list, so every
+// register/cancel is a linear walk, and a busy printer (steppers, soft PWM, UART flushes...)
+// can run the pool dry. The wheel takes the peripheral timers instead: each (callback, param)
+// pair owns one node, found by hash, and arming or cancelling just relinks it. The wheel
+// itself is one simavr timer, kept on its earliest deadline, so the core timers, IdleSkip
+// and the run loop see the same deadlines as before.
+// Semantics follow avr_cycle_timer_*: registering again replaces the pending one, callbacks
+// get the cycle they were due on and may return the next one (0 to stop), and an MCU reset
+// drops everything.
+class TimerWheel
+{
+	public:
+		// One wheel per AVR. Boards are wired up on the main thread and their AVRs live until exit.
+		static TimerWheel& Get(avr_t *avr);
+
+		// Arms fcn(avr, when, param) for the absolute cycle uiWhen.
+		void Register(avr_cycle_timer_t fcn, void *param, avr_cycle_count_t uiWhen);
+		void Cancel(avr_cycle_timer_t fcn, void *param);
+		// Cycles until it is due, 0 if it isn't armed.
+		avr_cycle_count_t Status(avr_cycle_timer_t fcn, void *param);
+
+		// The pending timers. The simavr timer driving the wheel is in AVR/cycle_timers already.
+		void SaveState(Snapshot &snap);
+		void LoadState(const Snapshot &snap);
+
+	private:
+		explicit TimerWheel(avr_t *avr);
+
+		typedef struct Node_t
+		{
+			avr_cycle_timer_t fcn;
+			void *param;
+			avr_cycle_count_t uiWhen;
+			struct Node_t *pPrev, *pNext;
+			uint8_t uiLevel, uiSlot;
+			bool bArmed;
+		} Node_t;
+
+		typedef struct Saved_t
+		{
+			avr_cycle_timer_t fcn;
+			void *param;
+			avr_cycle_count_t uiWhen;
+		} Saved_t;
+
+		typedef struct Key_t
+		{
+			avr_cycle_timer_t fcn;
+			void *param;
+			bool operator==(const Key_t &o) const { return fcn == o.fcn && param == o.param; }
+		} Key_t;
+
+		struct KeyHash
+		{
+			size_t operator()(const Key_t &k) const
+			{
+				return std::hash<uintptr_t>()(reinterpret_cast<uintptr_t>(k.fcn)) ^ (std::hash<uintptr_t>()(reinterpret_cast<uintptr_t>(k.param)) << 1U);
+			}
+		};
+
+		Node_t* Find(avr_cycle_timer_t fcn, void *param, bool bCreate);
+
+		// Links p into the slot for p->uiWhen: the level is the highest 6-bit digit in which it differs from m_uiNow.
+		void Place(Node_t *p);
+		void Unlink(Node_t *p);
+		void Arm(Node_t *p, avr_cycle_count_t uiWhen);
+
+		// When the lowest occupied slot comes up: either its timers are due (level 0)
+		// or it is time to spread it over the levels below.
+		bool NextEvent(avr_cycle_count_t &uiWhen, unsigned int &uiLevel, unsigned int &uiSlot);
+
+		// The simavr timer. Runs what is due and returns the next deadline.
+		static avr_cycle_count_t OnTimer(avr_t *avr, avr_cycle_count_t when, void *param);
+		avr_cycle_count_t Process(avr_t *avr);
+
+		static void OnReset(avr_io_t *io);
+		void Reset();
+
+		static constexpr unsigned int m_uiBits = 6;
+		static constexpr unsigned int m_uiSlots = 1U<<m_uiBits; // One occupancy bit each in a uint64_t
+		static constexpr unsigned int m_uiLevels = (64 + m_uiBits - 1)/m_uiBits; // Covers the whole cycle count, no overflow list.
+
+		// Registered as an avr_io_t so avr_reset tells us, pWheel leads back from it.
+		typedef struct ResetHook_t
+		{
+			avr_io_t io;
+			TimerWheel *pWheel;
+		} ResetHook_t;
+		ResetHook_t m_hook = {};
+
+		avr_t *m_pAVR;
+		avr_cycle_count_t m_uiNow = 0; // Everything before this has been run or cascaded.
+		avr_cycle_count_t m_uiArmedAt = 0; // Deadline of the simavr timer, 0 if there isn't one.
+		bool m_bProcessing = false;
+
+		Node_t *m_pSlots[m_uiLevels][m_uiSlots] = {};
+		uint64_t m_uiOccupied[m_uiLevels] = {};
+
+		std::deque<Node_t> m_dNodes; // Stable addresses, nodes are never freed.
+		std::unordered_map<Key_t, Node_t*, KeyHash> m_mNodes;
+};
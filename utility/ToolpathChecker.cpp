@@ -0,0 +1,358 @@
+/*
+	ToolpathChecker.cpp - Follows a G-code file along a recorded toolpath and reports where they differ.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ToolpathChecker.h"
+#include <stdio.h>      // for printf, perror
+#include <stdlib.h>     // for strtof, strtol
+#include <algorithm>    // for find, max, min
+#include <cmath>        // for sqrt, floor, ceil, atan2, cos, sin, fabs
+#include <cstring>      // for strchr, memcpy
+
+bool ToolpathChecker::Open(const std::string &strGCode)
+{
+	m_strGCode = strGCode;
+	m_fIn.open(strGCode);
+	if (!m_fIn.good())
+	{
+		perror(strGCode.c_str());
+		m_bEOF = true;
+		return false;
+	}
+	return true;
+}
+
+bool ToolpathChecker::ParseMore()
+{
+	size_t uiBefore = m_dSegs.size();
+	std::string strLine;
+	while (m_dSegs.size() == uiBefore && !m_bEOF)
+	{
+		if (!getline(m_fIn, strLine))
+		{
+			m_bEOF = true;
+			break;
+		}
+		m_uiLine++;
+		size_t uiEnd = strLine.find_first_of(";*");
+		if (uiEnd != std::string::npos)
+			strLine.resize(uiEnd);
+		const char *pLine = strLine.c_str();
+		while (*pLine == ' ' || *pLine == '\t')
+			pLine++;
+		if (*pLine == 'N') // A line number, as a host would send it.
+			pLine = strchr(pLine, ' ') ? strchr(pLine, ' ') + 1 : "";
+		char chrCmd = *pLine;
+		if (chrCmd != 'G' && chrCmd != 'M')
+			continue;
+		int iCode = static_cast<int>(strtol(pLine + 1, nullptr, 10));
+		if (chrCmd == 'M')
+		{
+			if (iCode == 82 || iCode == 83)
+				m_bRelE = iCode == 83;
+			continue;
+		}
+		static constexpr char chrAxes[4] = {'X','Y','Z','E'};
+		auto fcnArg = [pLine](char chrArg, float &fOut)
+		{
+			const char *pArg = strchr(pLine + 1, chrArg);
+			if (pArg)
+				fOut = strtof(pArg + 1, nullptr);
+			return pArg != nullptr;
+		};
+		switch (iCode)
+		{
+			case 90:
+				m_bRelXYZ = m_bRelE = false;
+				break;
+			case 91:
+				m_bRelXYZ = m_bRelE = true;
+				break;
+			case 28: // Homing, where to is the firmware's business; the moves after are absolute.
+			{
+				bool bAny = false;
+				for (int i=0; i<3; i++)
+				{
+					float fDummy;
+					bAny |= fcnArg(chrAxes[i], fDummy);
+				}
+				for (int i=0; i<3; i++)
+				{
+					float fDummy;
+					if (!bAny || fcnArg(chrAxes[i], fDummy))
+						m_fPos[i] = 0;
+				}
+			}
+				break;
+			case 92:
+				for (int i=0; i<4; i++)
+					fcnArg(chrAxes[i], m_fPos[i]);
+				break;
+			case 0:
+			case 1:
+			case 2:
+			case 3:
+			{
+				float fNew[4] = {m_fPos[0], m_fPos[1], m_fPos[2], m_fPos[3]}, fVal;
+				for (int i=0; i<4; i++)
+					if (fcnArg(chrAxes[i], fVal))
+						fNew[i] = ((i == 3) ? m_bRelE : m_bRelXYZ) ? fNew[i] + fVal : fVal;
+				fcnArg('F', m_fFeed);
+				float fI = 0, fJ = 0;
+				if (iCode >= 2 && (fcnArg('I', fI) | fcnArg('J', fJ)))
+					AddArc(m_fPos, fNew, fI, fJ, iCode == 2, m_uiLine);
+				else
+					AddSegment(m_fPos, fNew, m_uiLine);
+				memcpy(m_fPos, fNew, sizeof(m_fPos));
+			}
+				break;
+		}
+	}
+	return m_dSegs.size() > uiBefore;
+}
+
+void ToolpathChecker::AddSegment(const float *pFrom, const float *pTo, uint32_t uiLine)
+{
+	if (pTo[3] <= pFrom[3] + m_fEEps || (pTo[0] == pFrom[0] && pTo[1] == pFrom[1] && pTo[2] == pFrom[2]))
+		return; // Only the extrusions are compared.
+	Seg_t seg {{pFrom[0], pFrom[1], pFrom[2]}, {pTo[0], pTo[1], pTo[2]}, m_fFeed, uiLine, 0};
+	uint64_t uiIndex = m_uiBase + m_dSegs.size();
+	m_dSegs.push_back(seg);
+	int iZ0 = static_cast<int>(floor(std::min(seg.fA[2], seg.fB[2])/m_fLayerMm)), iZ1 = static_cast<int>(floor(std::max(seg.fA[2], seg.fB[2])/m_fLayerMm));
+	int iX0 = static_cast<int>(floor(std::min(seg.fA[0], seg.fB[0])/m_fCell)), iX1 = static_cast<int>(floor(std::max(seg.fA[0], seg.fB[0])/m_fCell));
+	int iY0 = static_cast<int>(floor(std::min(seg.fA[1], seg.fB[1])/m_fCell)), iY1 = static_cast<int>(floor(std::max(seg.fA[1], seg.fB[1])/m_fCell));
+	for (int iZ = iZ0; iZ <= iZ1; iZ++)
+		for (int iX = iX0; iX <= iX1; iX++)
+			for (int iY = iY0; iY <= iY1; iY++)
+				m_mGrid[Key(iX, iY, iZ)].push_back(uiIndex);
+}
+
+void ToolpathChecker::AddArc(const float *pFrom, const float *pTo, float fI, float fJ, bool bCW, uint32_t uiLine)
+{
+	float fCX = pFrom[0] + fI, fCY = pFrom[1] + fJ, fR = sqrt(fI*fI + fJ*fJ);
+	float fA0 = atan2(pFrom[1] - fCY, pFrom[0] - fCX), fSweep = atan2(pTo[1] - fCY, pTo[0] - fCX) - fA0;
+	static constexpr float fTwoPi = 6.2831853f;
+	if (bCW && fSweep >= 0)
+		fSweep -= fTwoPi;
+	else if (!bCW && fSweep <= 0)
+		fSweep += fTwoPi;
+	unsigned int uiChords = std::max(1U, static_cast<unsigned int>(ceil(fabs(fSweep)*fR/m_fArcMm)));
+	float fPrev[4] = {pFrom[0], pFrom[1], pFrom[2], pFrom[3]};
+	for (unsigned int i=1; i<=uiChords; i++)
+	{
+		float fT = static_cast<float>(i)/uiChords, fA = fA0 + fSweep*fT;
+		float fNext[4] = {fCX + fR*cos(fA), fCY + fR*sin(fA), pFrom[2] + (pTo[2] - pFrom[2])*fT, pFrom[3] + (pTo[3] - pFrom[3])*fT};
+		if (i == uiChords)
+		{
+			fNext[0] = pTo[0];
+			fNext[1] = pTo[1];
+		}
+		AddSegment(fPrev, fNext, uiLine);
+		memcpy(fPrev, fNext, sizeof(fPrev));
+	}
+}
+
+void ToolpathChecker::Retire()
+{
+	while (!m_dSegs.empty() && m_uiBase + m_uiBehind < m_uiCursor)
+	{
+		Seg_t &seg = m_dSegs.front();
+		float fLen = sqrt((seg.fB[0]-seg.fA[0])*(seg.fB[0]-seg.fA[0]) + (seg.fB[1]-seg.fA[1])*(seg.fB[1]-seg.fA[1]) + (seg.fB[2]-seg.fA[2])*(seg.fB[2]-seg.fA[2]));
+		if (seg.uiHits)
+		{
+			m_uiMatchedSegs++;
+			GetLayer(seg.fB[2]).dExpected += fLen/(std::max(seg.fFeed, 1.f)/60.f);
+		}
+		else if (++m_uiMissed <= m_uiReportMax)
+			printf("Toolpath: the print went past the extrusion on line %u of %s (%.2f mm at Z%.2f) without making it.\n", seg.uiLine, m_strGCode.c_str(), fLen, seg.fB[2]);
+		int iZ0 = static_cast<int>(floor(std::min(seg.fA[2], seg.fB[2])/m_fLayerMm)), iZ1 = static_cast<int>(floor(std::max(seg.fA[2], seg.fB[2])/m_fLayerMm));
+		int iX0 = static_cast<int>(floor(std::min(seg.fA[0], seg.fB[0])/m_fCell)), iX1 = static_cast<int>(floor(std::max(seg.fA[0], seg.fB[0])/m_fCell));
+		int iY0 = static_cast<int>(floor(std::min(seg.fA[1], seg.fB[1])/m_fCell)), iY1 = static_cast<int>(floor(std::max(seg.fA[1], seg.fB[1])/m_fCell));
+		for (int iZ = iZ0; iZ <= iZ1; iZ++)
+			for (int iX = iX0; iX <= iX1; iX++)
+				for (int iY = iY0; iY <= iY1; iY++)
+				{
+					auto it = m_mGrid.find(Key(iX, iY, iZ));
+					if (it == m_mGrid.end())
+						continue;
+					auto itSeg = std::find(it->second.begin(), it->second.end(), m_uiBase);
+					if (itSeg != it->second.end())
+						it->second.erase(itSeg);
+					if (it->second.empty())
+						m_mGrid.erase(it);
+				}
+		m_dSegs.pop_front();
+		m_uiBase++;
+	}
+}
+
+ToolpathChecker::Layer_t& ToolpathChecker::GetLayer(float fZ)
+{
+	for (auto it = m_vLayers.rbegin(); it != m_vLayers.rend(); ++it) // Nearly always the last.
+		if (fabs(it->fZ - fZ) < m_fLayerMm/2.f)
+			return *it;
+	m_vLayers.push_back({fZ, 0, 0});
+	return m_vLayers.back();
+}
+
+void ToolpathChecker::Check(const float *pP, uint64_t uiCycle)
+{
+	auto fcnDist = [pP](const Seg_t &seg)
+	{
+		float fD[3], fV[3], fLen2 = 0, fT = 0;
+		for (int i=0; i<3; i++)
+		{
+			fD[i] = seg.fB[i] - seg.fA[i];
+			fV[i] = pP[i] - seg.fA[i];
+			fLen2 += fD[i]*fD[i];
+			fT += fD[i]*fV[i];
+		}
+		fT = fLen2 > 0 ? std::max(0.f, std::min(1.f, fT/fLen2)) : 0.f;
+		float fDist2 = 0;
+		for (int i=0; i<3; i++)
+			fDist2 += (fV[i] - fT*fD[i])*(fV[i] - fT*fD[i]);
+		return sqrt(fDist2);
+	};
+	// The nearest, and of those within the tolerance the one closest to (preferably after) the cursor,
+	// so a pass over the same spot on the next layer or a crossing line doesn't pull the cursor away.
+	float fBest = m_fCell*2.f;
+	uint64_t uiBest = UINT64_MAX, uiMatch = UINT64_MAX, uiMatchScore = UINT64_MAX;
+	int iX = static_cast<int>(floor(pP[0]/m_fCell)), iY = static_cast<int>(floor(pP[1]/m_fCell)), iZ = static_cast<int>(floor(pP[2]/m_fLayerMm));
+	for (int iDZ = -1; iDZ <= 1; iDZ++)
+		for (int iDX = -1; iDX <= 1; iDX++)
+			for (int iDY = -1; iDY <= 1; iDY++)
+			{
+				auto it = m_mGrid.find(Key(iX + iDX, iY + iDY, iZ + iDZ));
+				if (it == m_mGrid.end())
+					continue;
+				for (auto uiSeg : it->second)
+				{
+					float fDist = fcnDist(m_dSegs[uiSeg - m_uiBase]);
+					if (fDist < fBest)
+					{
+						fBest = fDist;
+						uiBest = uiSeg;
+					}
+					uint64_t uiScore = uiSeg >= m_uiCursor ? uiSeg - m_uiCursor : 4U*(m_uiCursor - uiSeg);
+					if (fDist <= m_fTolMm && uiScore < uiMatchScore)
+					{
+						uiMatch = uiSeg;
+						uiMatchScore = uiScore;
+					}
+				}
+			}
+	m_uiChecked++;
+	if (uiMatch != UINT64_MAX)
+	{
+		m_dSegs[uiMatch - m_uiBase].uiHits++;
+		m_uiCursor = std::max(m_uiCursor, uiMatch);
+		m_bReached = true;
+		m_uiUnmatched = 0;
+	}
+	else if (++m_uiUnmatched >= m_uiResyncAfter)
+	{
+		// Lost: the print skipped ahead (or this is not its G-code). Move on and see if it turns up.
+		m_uiCursor = std::min(m_uiCursor + m_uiAhead/2U, m_uiBase + m_dSegs.size());
+		m_uiUnmatched = 0;
+		m_uiResyncs++;
+	}
+	m_dSum += std::min(fBest, m_fCell*2.f);
+	m_dMax = std::max(m_dMax, static_cast<double>(fBest));
+	if (fBest <= m_fTolMm)
+	{
+		m_bOff = false;
+		return;
+	}
+	m_uiBeyond++;
+	if (m_bOff)
+		return;
+	m_bOff = true;
+	if (++m_uiStretches > m_uiReportMax)
+		return;
+	if (uiBest == UINT64_MAX)
+		printf("Toolpath: extruding at X%.2f Y%.2f Z%.2f (t = %.3f s) with no extrusion in %s within %.0f mm.\n", pP[0], pP[1], pP[2],
+			static_cast<double>(uiCycle)/m_uiFreq, m_strGCode.c_str(), m_fCell*2.f);
+	else
+		printf("Toolpath: %.3f mm off course at X%.2f Y%.2f Z%.2f (t = %.3f s), nearest line %u of %s.\n", fBest, pP[0], pP[1], pP[2],
+			static_cast<double>(uiCycle)/m_uiFreq, m_dSegs[uiBest - m_uiBase].uiLine, m_strGCode.c_str());
+}
+
+void ToolpathChecker::OnPoint(const ToolpathWriter::Record_t &rec)
+{
+	while (!m_bEOF && m_uiBase + m_dSegs.size() < m_uiCursor + m_uiAhead)
+		ParseMore();
+	bool bExtruding = m_bAny && rec.fPos[3] > m_recLast.fPos[3] + m_fEEps;
+	if (bExtruding)
+	{
+		const float *pA = m_recLast.fPos, *pB = rec.fPos;
+		float fLen = sqrt((pB[0]-pA[0])*(pB[0]-pA[0]) + (pB[1]-pA[1])*(pB[1]-pA[1]) + (pB[2]-pA[2])*(pB[2]-pA[2]));
+		unsigned int uiSamples = std::max(1U, static_cast<unsigned int>(ceil(fLen/m_fSampleMm)));
+		// The start was checked as the end of the last one, unless that wasn't an extrusion.
+		for (unsigned int i = m_bLastExtruded ? 1 : 0; i<=uiSamples; i++)
+		{
+			float fT = static_cast<float>(i)/uiSamples, fP[3];
+			for (int j=0; j<3; j++)
+				fP[j] = pA[j] + (pB[j] - pA[j])*fT;
+			Check(fP, m_recLast.uiCycle + static_cast<uint64_t>((rec.uiCycle - m_recLast.uiCycle)*fT));
+		}
+		GetLayer(pB[2]).dActual += static_cast<double>(rec.uiCycle - m_recLast.uiCycle)/m_uiFreq;
+		Retire();
+	}
+	m_bLastExtruded = bExtruding;
+	m_recLast = rec;
+	m_bAny = true;
+}
+
+bool ToolpathChecker::Report()
+{
+	// Everything up to the last extrusion reached has been through; what's after it was never printed.
+	m_uiCursor = (m_bReached ? m_uiCursor + 1U : 0) + m_uiBehind;
+	Retire();
+	uint64_t uiNotReached = m_dSegs.size();
+	while (!m_bEOF)
+	{
+		size_t uiBefore = m_dSegs.size();
+		ParseMore();
+		uiNotReached += m_dSegs.size() - uiBefore;
+		m_dSegs.clear(); // Only counting now.
+	}
+	double dExpected = 0, dActual = 0, dWorst = 0;
+	float fWorstZ = 0;
+	for (auto &layer : m_vLayers)
+	{
+		dExpected += layer.dExpected;
+		dActual += layer.dActual;
+		if (layer.dExpected > 0.5 && layer.dActual/layer.dExpected > dWorst) // Ignore the odd stray blob.
+		{
+			dWorst = layer.dActual/layer.dExpected;
+			fWorstZ = layer.fZ;
+		}
+	}
+	printf("Toolpath check against %s:\n", m_strGCode.c_str());
+	printf("  %llu points: mean deviation %.3f mm, max %.3f mm; %llu beyond %.3f mm in %llu stretches.\n", static_cast<unsigned long long>(m_uiChecked),
+		m_uiChecked ? m_dSum/m_uiChecked : 0.0, m_dMax, static_cast<unsigned long long>(m_uiBeyond), m_fTolMm, static_cast<unsigned long long>(m_uiStretches));
+	printf("  %llu expected extrusions made, %llu missed, %llu not reached%s.\n", static_cast<unsigned long long>(m_uiMatchedSegs),
+		static_cast<unsigned long long>(m_uiMissed), static_cast<unsigned long long>(uiNotReached), m_uiResyncs ? " (lost track of the G-code at times)" : "");
+	printf("  Extruding took %.1f s, %.1f s at the G-code's feed rates (x%.2f)", dActual, dExpected, dExpected > 0 ? dActual/dExpected : 0.0);
+	if (dWorst > 0)
+		printf(", slowest layer Z%.2f (x%.2f)", fWorstZ, dWorst);
+	printf(".\n");
+	return m_uiBeyond == 0 && m_uiMissed == 0;
+}
@@ -0,0 +1,112 @@
+/*
+	ToolpathChecker.h - Follows a G-code file along a recorded toolpath and reports where they differ.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>            // for uint32_t, uint64_t
+#include <deque>               // for deque
+#include <fstream>             // for ifstream
+#include <string>              // for string
+#include <unordered_map>       // for unordered_map
+#include <vector>              // for vector
+#include "ToolpathWriter.h"    // for ToolpathWriter::Record_t
+
+// Takes the points of a toolpath as they are recorded and walks the expected G-code along with them,
+// parsing only a window ahead of where the print has got to, so it keeps up with any length of print.
+// The window's extrusions (G0/G1, G2/G3 arcs as 1mm chords) are binned on a grid, and each recorded
+// extrusion (sampled every mm) is matched to the nearest one, so the firmware's own arc segmentation
+// and the merged runs don't matter. Reports:
+//  - deviations: the distance to the nearest expected extrusion, and each stretch beyond the tolerance
+//    as it starts (a layer shift from lost steps shows as one that doesn't end),
+//  - missed moves: expected extrusions that the print went past without coming near,
+//  - timing: recorded time against the G-code's feed rates, per layer and overall.
+// Not thread safe, used from one thread (ToolpathWriter's writer, or offline).
+class ToolpathChecker
+{
+	public:
+		explicit ToolpathChecker(float fTolMm):m_fTolMm(fTolMm){};
+
+		bool Open(const std::string &strGCode);
+		inline void SetFrequency(uint32_t uiHz) { m_uiFreq = uiHz; }
+
+		void OnPoint(const ToolpathWriter::Record_t &rec);
+
+		// Prints the results. False if anything strayed or was missed.
+		bool Report();
+
+	private:
+		typedef struct Seg_t
+		{
+			float fA[3], fB[3];
+			float fFeed; // mm/min
+			uint32_t uiLine, uiHits;
+		} Seg_t;
+
+		typedef struct Layer_t
+		{
+			float fZ;
+			double dExpected, dActual; // s
+		} Layer_t;
+
+		// Parses until there is another extrusion in the window, false at the end of the file.
+		bool ParseMore();
+		void AddSegment(const float *pFrom, const float *pTo, uint32_t uiLine);
+		void AddArc(const float *pFrom, const float *pTo, float fI, float fJ, bool bCW, uint32_t uiLine);
+		// Drops the segments that fell behind the cursor, counting any never reached as missed.
+		void Retire();
+		void Check(const float *pP, uint64_t uiCycle);
+		Layer_t& GetLayer(float fZ);
+
+		inline uint64_t Key(int iX, int iY, int iZ) const
+		{
+			return (static_cast<uint64_t>(iX & 0xFFFFF)<<40U) | (static_cast<uint64_t>(iY & 0xFFFFF)<<20U) | static_cast<uint64_t>(iZ & 0xFFFFF);
+		}
+
+		float m_fTolMm;
+		uint32_t m_uiFreq = 16000000;
+		std::string m_strGCode;
+		std::ifstream m_fIn;
+		bool m_bEOF = false;
+
+		// G-code state.
+		uint32_t m_uiLine = 0;
+		float m_fPos[4] = {0,0,0,0}, m_fFeed = 1500;
+		bool m_bRelXYZ = false, m_bRelE = false;
+
+		// The window: segment N is m_dSegs[N - m_uiBase].
+		std::deque<Seg_t> m_dSegs;
+		uint64_t m_uiBase = 0, m_uiCursor = 0; // The cursor is the furthest extrusion matched so far...
+		bool m_bReached = false; // ...once there is one.
+		std::unordered_map<uint64_t, std::vector<uint64_t>> m_mGrid;
+
+		// The recording.
+		ToolpathWriter::Record_t m_recLast {};
+		bool m_bAny = false, m_bLastExtruded = false, m_bOff = false;
+		unsigned int m_uiUnmatched = 0; // In a row, to resync after a gap
+
+		uint64_t m_uiChecked = 0, m_uiBeyond = 0, m_uiStretches = 0, m_uiMissed = 0, m_uiMatchedSegs = 0, m_uiResyncs = 0;
+		double m_dSum = 0, m_dMax = 0;
+		std::vector<Layer_t> m_vLayers;
+
+		static constexpr float m_fCell = 2.f, m_fLayerMm = 0.1f, m_fSampleMm = 1.f, m_fArcMm = 1.f, m_fEEps = 0.001f;
+		static constexpr uint64_t m_uiAhead = 4096, m_uiBehind = 512;
+		static constexpr unsigned int m_uiResyncAfter = 64, m_uiReportMax = 10;
+};
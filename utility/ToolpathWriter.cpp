@@ -0,0 +1,358 @@
+/*
+	ToolpathWriter.cpp - Streams the nozzle's path to disk as it prints.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ToolpathWriter.h"
+#include <stdio.h>           // for fopen, fwrite, fread, fclose, printf, perror
+#include <unistd.h>          // for usleep
+#include <algorithm>         // for min
+#include <cmath>             // for sqrt, fabs
+#include <cstring>           // for memcmp, memcpy
+#include "ThreadPolicy.h"    // for ThreadPolicy
+#include "ToolpathChecker.h" // for ToolpathChecker
+
+static constexpr char TP_MAGIC[8] = {'M','K','4','0','4','T','P','H'};
+static constexpr size_t TP_RECORD = 28;
+
+ToolpathWriter::ToolpathWriter()
+{
+}
+
+ToolpathWriter::~ToolpathWriter()
+{
+	if (!m_thread)
+		return;
+	if (m_bPending)
+		Emit(m_recPending);
+	m_bQuit = true;
+	pthread_join(m_thread, nullptr);
+	if (m_fOut)
+	{
+		fclose(m_fOut);
+		printf("Toolpath: wrote %llu points to %s", static_cast<unsigned long long>(m_uiWritten), m_strFile.c_str());
+		if (m_uiDropped)
+			printf(", %llu lost to a full queue", static_cast<unsigned long long>(m_uiDropped));
+		printf(".\n");
+	}
+	else if (m_uiDropped)
+		printf("Toolpath: %llu points lost to a full queue, expect gaps in the check.\n", static_cast<unsigned long long>(m_uiDropped));
+	if (m_pChecker)
+		m_pChecker->Report();
+}
+
+void ToolpathWriter::Init(avr_t *avr, const std::string &strFile)
+{
+	_Init(avr, this);
+	m_strFile = strFile;
+	if (!GetCheckFile().empty())
+	{
+		m_pChecker.reset(new ToolpathChecker(GetCheckTol()));
+		m_pChecker->SetFrequency(avr->frequency);
+		if (!m_pChecker->Open(GetCheckFile()))
+			m_pChecker.reset();
+	}
+	if (!strFile.empty())
+	{
+		m_fOut = fopen(strFile.c_str(), "wb");
+		if (!m_fOut)
+			perror(strFile.c_str());
+	}
+	if (!m_fOut && !m_pChecker)
+		return;
+	if (m_fOut)
+	{
+		uint8_t uiHeader[16];
+		uint32_t uiFreq = avr->frequency;
+		memcpy(uiHeader, TP_MAGIC, 8);
+		memcpy(uiHeader + 8, &m_uiVersion, 4);
+		memcpy(uiHeader + 12, &uiFreq, 4);
+		fwrite(uiHeader, sizeof(uiHeader), 1, m_fOut);
+	}
+
+	RegisterNotify(X_IN, MAKE_C_CALLBACK(ToolpathWriter, OnAxisChanged), this);
+	RegisterNotify(Y_IN, MAKE_C_CALLBACK(ToolpathWriter, OnAxisChanged), this);
+	RegisterNotify(Z_IN, MAKE_C_CALLBACK(ToolpathWriter, OnAxisChanged), this);
+	RegisterNotify(E_IN, MAKE_C_CALLBACK(ToolpathWriter, OnAxisChanged), this);
+	RegisterNotify(TOOL_IN, MAKE_C_CALLBACK(ToolpathWriter, OnToolChanged), this);
+
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "toolpath"); ToolpathWriter *p = static_cast<ToolpathWriter*>(param); return p->Run(); };
+	pthread_create(&m_thread, nullptr, fcnRun, this);
+	if (m_fOut)
+		printf("Recording the toolpath to %s\n", strFile.c_str());
+	if (m_pChecker)
+		printf("Checking the toolpath against %s\n", GetCheckFile().c_str());
+}
+
+// Positions come in as floats in mm, mangled into the IRQ value.
+void ToolpathWriter::OnAxisChanged(avr_irq_t *irq, uint32_t value)
+{
+	m_fPos[irq - GetIRQ(X_IN)] = reinterpret_cast<float*>(&value)[0];
+	Update();
+}
+
+void ToolpathWriter::OnToolChanged(avr_irq_t *irq, uint32_t value)
+{
+	if (value == m_uiTool)
+		return;
+	if (m_bPending)
+		Emit(m_recPending);
+	m_bPending = false;
+	m_uiTool = value;
+	if (!m_bAny)
+		return;
+	m_recLast.uiTool = m_uiTool; // The next run starts here with the new tool.
+	m_recLast.uiCycle = m_pAVR->cycle;
+	Emit(m_recLast);
+}
+
+void ToolpathWriter::Update()
+{
+	Record_t rec {m_pAVR->cycle, {m_fPos[0], m_fPos[1], m_fPos[2], m_fPos[3]}, m_uiTool};
+	if (!m_bAny)
+	{
+		m_bAny = true;
+		m_recLast = rec;
+		Emit(rec);
+		return;
+	}
+	if (m_bPending && !Continues(rec))
+	{
+		m_recLast = m_recPending;
+		Emit(m_recLast);
+		m_bPending = false;
+	}
+	if (!m_bPending)
+		StartRun(rec);
+	m_recPending = rec;
+	m_bPending = true;
+}
+
+void ToolpathWriter::StartRun(const Record_t &rec)
+{
+	m_bAnchored = false;
+	for (int i=0; i<4; i++)
+	{
+		float fD = rec.fPos[i] - m_recLast.fPos[i];
+		m_iSign[i] = fD > m_fEEps ? 1 : (fD < -m_fEEps ? -1 : 0);
+	}
+}
+
+bool ToolpathWriter::Continues(const Record_t &rec)
+{
+	// No axis may turn back...
+	for (int i=0; i<4; i++)
+	{
+		float fD = rec.fPos[i] - m_recPending.fPos[i];
+		int iSign = fD > m_fEEps ? 1 : (fD < -m_fEEps ? -1 : 0);
+		if (iSign && m_iSign[i] && iSign != m_iSign[i])
+			return false;
+		if (iSign)
+			m_iSign[i] = iSign;
+	}
+	float fV[3], fLen = 0;
+	for (int i=0; i<3; i++)
+	{
+		fV[i] = rec.fPos[i] - m_recLast.fPos[i];
+		fLen += fV[i]*fV[i];
+	}
+	fLen = sqrt(fLen);
+	if (!m_bAnchored)
+	{
+		// ...and once far enough from the start for the steps not to matter, the run has a direction.
+		if (fLen >= m_fAnchorMm)
+		{
+			m_bAnchored = true;
+			for (int i=0; i<3; i++)
+				m_fDir[i] = fV[i]/fLen;
+			m_fEPerMm = (rec.fPos[3] - m_recLast.fPos[3])/fLen;
+		}
+		return true;
+	}
+	// From then on it ends when the path leaves that line, or extrudes at another rate.
+	float fAlong = fV[0]*m_fDir[0] + fV[1]*m_fDir[1] + fV[2]*m_fDir[2], fOff = 0;
+	for (int i=0; i<3; i++)
+		fOff += (fV[i] - fAlong*m_fDir[i])*(fV[i] - fAlong*m_fDir[i]);
+	if (fOff > m_fTolMm*m_fTolMm)
+		return false;
+	return fabs(rec.fPos[3] - (m_recLast.fPos[3] + fAlong*m_fEPerMm)) <= m_fTolEMm;
+}
+
+// AVR thread: never waits for the disk.
+void ToolpathWriter::Emit(const Record_t &rec)
+{
+	if (!m_fOut && !m_pChecker)
+		return;
+	if (!m_ring.Push(rec))
+		m_uiDropped++;
+}
+
+void* ToolpathWriter::Run()
+{
+	while (!m_bQuit)
+	{
+		Drain();
+		usleep(m_uiPollMs*1000U);
+	}
+	Drain();
+	return nullptr;
+}
+
+void ToolpathWriter::Drain()
+{
+	Record_t *pRecs;
+	size_t uiLen;
+	uint8_t uiBuf[TP_RECORD*256];
+	while ((uiLen = m_ring.GetReadSpan(pRecs))>0)
+	{
+		uiLen = std::min<size_t>(uiLen, 256);
+		for (size_t i=0; m_pChecker && i<uiLen; i++)
+			m_pChecker->OnPoint(pRecs[i]);
+		for (size_t i=0; m_fOut && i<uiLen; i++)
+		{
+			uint8_t *p = uiBuf + i*TP_RECORD;
+			memcpy(p, &pRecs[i].uiCycle, 8);
+			memcpy(p + 8, pRecs[i].fPos, 16);
+			memcpy(p + 24, &pRecs[i].uiTool, 4);
+		}
+		m_ring.CommitRead(uiLen);
+		if (m_fOut && fwrite(uiBuf, TP_RECORD, uiLen, m_fOut) != uiLen)
+			perror(m_strFile.c_str());
+		m_uiWritten += uiLen;
+	}
+	if (m_fOut)
+		fflush(m_fOut);
+}
+
+bool ToolpathWriter::ReadAll(const std::string &strIn, std::vector<Record_t> &vOut, uint32_t &uiFreq)
+{
+	FILE *fIn = fopen(strIn.c_str(), "rb");
+	if (!fIn)
+	{
+		perror(strIn.c_str());
+		return false;
+	}
+	uint8_t uiHeader[16] = {0};
+	uint32_t uiVersion = 0;
+	bool bOK = fread(uiHeader, sizeof(uiHeader), 1, fIn) == 1 && memcmp(uiHeader, TP_MAGIC, 8) == 0;
+	memcpy(&uiVersion, uiHeader + 8, 4);
+	if (!bOK || uiVersion != m_uiVersion)
+	{
+		fprintf(stderr, "%s is not a toolpath recording (version %u).\n", strIn.c_str(), m_uiVersion);
+		fclose(fIn);
+		return false;
+	}
+	memcpy(&uiFreq, uiHeader + 12, 4);
+	uint8_t uiRec[TP_RECORD];
+	while (fread(uiRec, TP_RECORD, 1, fIn) == 1) // A cut-off last record (a crash) is just dropped.
+	{
+		Record_t rec;
+		memcpy(&rec.uiCycle, uiRec, 8);
+		memcpy(rec.fPos, uiRec + 8, 16);
+		memcpy(&rec.uiTool, uiRec + 24, 4);
+		vOut.push_back(rec);
+	}
+	fclose(fIn);
+	return true;
+}
+
+bool ToolpathWriter::ConvertToSTL(const std::string &strIn, const std::string &strOut)
+{
+	std::vector<Record_t> vRecs;
+	uint32_t uiFreq = 0;
+	if (!ReadAll(strIn, vRecs, uiFreq))
+		return false;
+	FILE *fOut = fopen(strOut.c_str(), "wb");
+	if (!fOut)
+	{
+		perror(strOut.c_str());
+		return false;
+	}
+	uint8_t uiHeader[84] = {0};
+	snprintf(reinterpret_cast<char*>(uiHeader), 80, "MK404 toolpath %s", strIn.c_str());
+	fwrite(uiHeader, sizeof(uiHeader), 1, fOut); // The count is filled in at the end.
+	uint32_t uiTris = 0;
+	auto fcnTri = [&](const float *pA, const float *pB, const float *pC)
+	{
+		float fU[3], fV[3], fN[3];
+		for (int i=0; i<3; i++)
+		{
+			fU[i] = pB[i] - pA[i];
+			fV[i] = pC[i] - pA[i];
+		}
+		fN[0] = fU[1]*fV[2] - fU[2]*fV[1];
+		fN[1] = fU[2]*fV[0] - fU[0]*fV[2];
+		fN[2] = fU[0]*fV[1] - fU[1]*fV[0];
+		float fLen = sqrt(fN[0]*fN[0] + fN[1]*fN[1] + fN[2]*fN[2]);
+		for (int i=0; fLen>0 && i<3; i++)
+			fN[i] /= fLen;
+		uint8_t uiTri[50] = {0};
+		memcpy(uiTri, fN, 12);
+		memcpy(uiTri + 12, pA, 12);
+		memcpy(uiTri + 24, pB, 12);
+		memcpy(uiTri + 36, pC, 12);
+		fwrite(uiTri, sizeof(uiTri), 1, fOut);
+		uiTris++;
+	};
+	for (size_t i=1; i<vRecs.size(); i++)
+	{
+		const float *pA = vRecs[i-1].fPos, *pB = vRecs[i].fPos;
+		float fDX = pB[0] - pA[0], fDY = pB[1] - pA[1], fLen = sqrt(fDX*fDX + fDY*fDY);
+		if (pB[3] - pA[3] <= m_fEEps || fLen < 1e-4f || vRecs[i].uiTool != vRecs[i-1].uiTool)
+			continue;
+		// A box under the nozzle's path, the line's width across and a layer deep.
+		float fNX = -fDY/fLen*m_fWidthMm/2.f, fNY = fDX/fLen*m_fWidthMm/2.f;
+		float fC[8][3];
+		for (int iCorner=0; iCorner<8; iCorner++)
+		{
+			const float *pEnd = (iCorner & 1) ? pB : pA;
+			float fSide = (iCorner & 2) ? 1.f : -1.f;
+			fC[iCorner][0] = pEnd[0] + fSide*fNX;
+			fC[iCorner][1] = pEnd[1] + fSide*fNY;
+			fC[iCorner][2] = (iCorner & 4) ? pEnd[2] : pEnd[2] - m_fHeightMm;
+		}
+		static constexpr int iFaces[6][4] = {{4,5,7,6},{0,2,3,1},{0,1,5,4},{2,6,7,3},{0,4,6,2},{1,3,7,5}}; // Top, bottom, sides, ends
+		for (auto &face : iFaces)
+		{
+			fcnTri(fC[face[0]], fC[face[1]], fC[face[2]]);
+			fcnTri(fC[face[0]], fC[face[2]], fC[face[3]]);
+		}
+	}
+	fseek(fOut, 80, SEEK_SET);
+	fwrite(&uiTris, 4, 1, fOut);
+	bool bOK = ferror(fOut) == 0;
+	fclose(fOut);
+	printf("Toolpath: %zu points from %s, %u triangles in %s\n", vRecs.size(), strIn.c_str(), uiTris, strOut.c_str());
+	return bOK;
+}
+
+bool ToolpathWriter::Compare(const std::string &strIn, const std::string &strGCode, float fTolMm)
+{
+	std::vector<Record_t> vRecs;
+	uint32_t uiFreq = 0;
+	if (!ReadAll(strIn, vRecs, uiFreq))
+		return false;
+	ToolpathChecker checker(fTolMm);
+	checker.SetFrequency(uiFreq);
+	if (!checker.Open(strGCode))
+		return false;
+	for (auto &rec : vRecs)
+		checker.OnPoint(rec);
+	return checker.Report();
+}
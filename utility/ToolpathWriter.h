@@ -0,0 +1,129 @@
+/*
+	ToolpathWriter.h - Streams the nozzle's path to disk as it prints.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>           // for pthread_t
+#include <stdint.h>            // for uint32_t, uint64_t
+#include <stdio.h>             // for FILE
+#include <atomic>              // for atomic_bool
+#include <memory>              // for unique_ptr
+#include <string>              // for string
+#include <vector>              // for vector
+#include "BasePeripheral.h"    // for BasePeripheral
+#include "SPSCRing.h"          // for SPSCRing
+#include "sim_avr.h"           // for avr_t
+#include "sim_avr_types.h"     // for avr_cycle_count_t
+#include "sim_irq.h"           // for avr_irq_t
+
+/*
+ * Records the X/Y/Z/E positions (and the tool, for the MMU) to an append-only file from a writer
+ * thread, so a print of any length can be checked afterwards without keeping it in memory or
+ * having a window open. Straight runs are merged: a point is only written where the path turns
+ * by more than m_fTolMm, extrusion starts or stops, or the tool changes.
+ *
+ * File layout, little endian:
+ *  "MK404TPH" (8 bytes), version (u32), AVR frequency (u32)
+ *  then records of: cycle (u64), X, Y, Z, E in mm (f32 each), tool (u32)
+ * The segment ending at a record extruded if its E is above the previous record's.
+ * With a G-code file to check against, the writer thread also feeds the points to a ToolpathChecker
+ * as they are written, and it reports at exit (the file is then optional).
+ */
+class ToolpathChecker;
+
+class ToolpathWriter: public BasePeripheral
+{
+	public:
+		#define IRQPAIRS _IRQ(X_IN,"<x.in") _IRQ(Y_IN,"<y.in") _IRQ(Z_IN,"<z.in") _IRQ(E_IN,"<e.in") _IRQ(TOOL_IN,"8<tool.in")
+		#include "IRQHelper.h"
+
+		// Set from the command line before the printers are created. Empty disables it.
+		static void SetDefaultFile(const std::string &strFile) { GetDefaultFile() = strFile; }
+		static inline bool IsEnabled() { return !GetDefaultFile().empty() || !GetCheckFile().empty(); }
+		static inline const std::string& GetFile() { return GetDefaultFile(); }
+		// The G-code being printed, to follow along with and report deviations from.
+		static void SetCheck(const std::string &strGCode, float fTolMm) { GetCheckFile() = strGCode; GetCheckTol() = fTolMm; }
+
+		ToolpathWriter();
+		// Writes the last point and closes the file.
+		~ToolpathWriter();
+
+		// strFile may be empty when only checking.
+		void Init(avr_t *avr, const std::string &strFile);
+
+		// Offline: writes the extruded segments of a recording as boxes to a binary STL.
+		static bool ConvertToSTL(const std::string &strIn, const std::string &strOut);
+
+		// Offline: runs a recording through a ToolpathChecker against a G-code file and prints the result.
+		// False if either could not be read, or the print strayed by more than fTolMm or missed anything.
+		static bool Compare(const std::string &strIn, const std::string &strGCode, float fTolMm);
+
+		typedef struct Record_t
+		{
+			uint64_t uiCycle;
+			float fPos[4]; // X, Y, Z, E
+			uint32_t uiTool;
+		} Record_t;
+
+	private:
+		static std::string& GetDefaultFile() { static std::string strFile; return strFile; }
+		static std::string& GetCheckFile() { static std::string strFile; return strFile; }
+		static float& GetCheckTol() { static float fTol = 0.1f; return fTol; }
+
+		void OnAxisChanged(avr_irq_t *irq, uint32_t value);
+		void OnToolChanged(avr_irq_t *irq, uint32_t value);
+
+		// Takes the latest position, writing the previous one if the path doesn't carry straight on through it.
+		void Update();
+		bool Continues(const Record_t &rec);
+		// Starts a new run from the last written point towards rec.
+		void StartRun(const Record_t &rec);
+		void Emit(const Record_t &rec);
+
+		void* Run();
+		void Drain();
+
+		static bool ReadAll(const std::string &strIn, std::vector<Record_t> &vOut, uint32_t &uiFreq);
+
+		// AVR thread.
+		float m_fPos[4] = {0,0,0,0};
+		uint32_t m_uiTool = 0;
+		Record_t m_recLast {}, m_recPending {}; // Written, and the furthest point of the run since.
+		bool m_bPending = false, m_bAny = false;
+		// The run: which way each axis goes (0 not yet), and once it is m_fAnchorMm long, its direction and E per mm.
+		int m_iSign[4] = {0,0,0,0};
+		bool m_bAnchored = false;
+		float m_fDir[3] = {0,0,0}, m_fEPerMm = 0;
+		uint64_t m_uiDropped = 0;
+
+		SPSCRing<Record_t> m_ring {1U<<16};
+		FILE *m_fOut = nullptr;
+		std::unique_ptr<ToolpathChecker> m_pChecker; // Writer thread
+		std::string m_strFile;
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+		uint64_t m_uiWritten = 0;
+
+		static constexpr float m_fTolMm = 0.05f, m_fTolEMm = 0.005f, m_fAnchorMm = 0.5f, m_fEEps = 0.001f;
+		static constexpr uint32_t m_uiPollMs = 20, m_uiVersion = 1;
+		// For the STL, a typical 0.4mm nozzle line.
+		static constexpr float m_fWidthMm = 0.45f, m_fHeightMm = 0.2f;
+};
@@ -0,0 +1,477 @@
+/*
+	TraceWriter.cpp - Compact binary streaming trace writer for TelemetryHost.
+	Records IRQ value changes with exact cycle timestamps into a ring buffer
+	that is drained to disk by a background thread.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TraceWriter.h"
+#include <unistd.h>    // for usleep
+#include <algorithm>   // for max
+#include <cstring>     // for memcmp
+#include <fstream>     // IWYU pragma: keep for ifstream
+#include <iterator>    // for istreambuf_iterator
+#include "Deflate.h"   // for Deflate
+#include "ThreadPolicy.h" // for ThreadPolicy
+
+static constexpr char m_strMagic[] = "MK404TRC";
+static constexpr uint64_t m_uiVersion = 1;
+
+TraceWriter::~TraceWriter()
+{
+	Stop();
+	if (m_fOut)
+		fclose(m_fOut);
+	if (!m_vWorkers.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lockJobs);
+			m_bWorkersQuit = true;
+		}
+		m_cvJobs.notify_all();
+		for (auto &thread : m_vWorkers)
+			thread.join();
+	}
+	if (m_fIndex)
+	{
+		fclose(m_fIndex);
+		printf("TraceWriter: wrote %u chunks, listed in %s.index\n", m_uiChunks, m_strBase.c_str());
+	}
+}
+
+void TraceWriter::Init(avr_t *pAVR, const std::string &strFile, bool bVCD)
+{
+	m_pAVR = pAVR;
+	m_strFile = strFile;
+	m_bVCD = bVCD;
+}
+
+void TraceWriter::AddSignal(avr_irq_t *pIRQ, uint8_t uiBits, const std::string &strName)
+{
+	if (m_bHeader)
+	{
+		fprintf(stderr, "TraceWriter: Can't add %s after the trace has started.\n", strName.c_str());
+		return;
+	}
+	Signal_t *pSig = new Signal_t {this, pIRQ, static_cast<uint16_t>(m_vSignals.size()), uiBits, strName};
+	m_vSignals.emplace_back(pSig);
+	auto fcnNotify = [](avr_irq_t *irq, uint32_t value, void *param)
+	{
+		Signal_t *p = static_cast<Signal_t*>(param);
+		p->pOwner->Push(p->uiIndex, value);
+	};
+	avr_irq_register_notify(pIRQ, fcnNotify, pSig);
+}
+
+void TraceWriter::Start()
+{
+	if (m_bRunning)
+		return;
+	if (m_uiChunkSeconds && !m_fIndex)
+	{
+		m_strBase = m_strFile.substr(0, m_strFile.rfind('.'));
+		std::string strIndex = m_strBase + ".index";
+		m_fIndex = fopen(strIndex.c_str(), "w");
+		if (!m_fIndex)
+		{
+			perror(strIndex.c_str());
+			fprintf(stderr, "ERROR: Could not open the trace index, trace will not be recorded.\n");
+			return;
+		}
+		fprintf(m_fIndex, "# MK404 trace in %us chunks at %u Hz: chunk first_cycle last_cycle file\n", m_uiChunkSeconds, m_pAVR->frequency);
+		m_uiChunkCycles = static_cast<uint64_t>(m_uiChunkSeconds) * m_pAVR->frequency;
+		m_vValues.resize(m_vSignals.size());
+		m_bHeader = true; // Each chunk gets its own.
+		unsigned int uiThreads = std::max(1U, std::thread::hardware_concurrency()/2U);
+		for (unsigned int i=0; i<uiThreads; i++)
+			m_vWorkers.emplace_back(&TraceWriter::RunWorker, this);
+	}
+	else if (!m_uiChunkSeconds && !m_fOut)
+	{
+		m_fOut = fopen(m_strFile.c_str(), "wb");
+		if (!m_fOut)
+		{
+			perror(m_strFile.c_str());
+			fprintf(stderr, "ERROR: Could not open trace file, trace will not be recorded.\n");
+			return;
+		}
+	}
+	if (!m_bHeader)
+	{
+		m_uiLastCycle = m_pAVR->cycle;
+		WriteHeader();
+	}
+	for (size_t i=0; i<m_vValues.size(); i++) // The writer thread isn't running yet.
+		m_vValues[i] = m_vSignals[i]->pIRQ->value;
+
+	m_bRunning = true;
+	// Log the starting values so the trace has a known state.
+	for (auto &pSig : m_vSignals)
+		Push(pSig->uiIndex, pSig->pIRQ->value);
+
+	if (m_thread == 0)
+	{
+		m_bQuit = false;
+		auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "trace"); TraceWriter *p = static_cast<TraceWriter*>(param); return p->Run(); };
+		pthread_create(&m_thread, NULL, fcnRun, this);
+	}
+}
+
+void TraceWriter::Stop()
+{
+	m_bRunning = false;
+	if (m_thread)
+	{
+		m_bQuit = true;
+		pthread_join(m_thread, NULL);
+		m_thread = 0;
+	}
+	if (m_fOut)
+	{
+		Drain();
+		fflush(m_fOut);
+	}
+	else if (m_fIndex)
+	{
+		Drain();
+		CloseChunk(); // A stop is a good place to have everything on disk.
+		std::unique_lock<std::mutex> lock(m_lockJobs);
+		m_cvDone.wait(lock, [this]{ return m_dJobs.empty() && !m_uiBusy; });
+	}
+	if (m_uiDropped)
+	{
+		fprintf(stderr, "TraceWriter: WARNING: %lu events were dropped because the buffer was full.\n", static_cast<unsigned long>(m_uiDropped));
+		m_uiDropped = 0;
+	}
+}
+
+void TraceWriter::Push(uint16_t uiSignal, uint32_t uiValue)
+{
+	if (!m_bRunning)
+		return;
+	while (m_lockPush.test_and_set(std::memory_order_acquire)) {};
+	size_t uiHead = m_uiHead.load(std::memory_order_relaxed);
+	size_t uiNext = (uiHead + 1) & (m_uiRingSize - 1);
+	if (uiNext == m_uiTail.load(std::memory_order_acquire))
+		m_uiDropped++;
+	else
+	{
+		m_vRing[uiHead] = {m_pAVR->cycle, uiValue, uiSignal};
+		m_uiHead.store(uiNext, std::memory_order_release);
+	}
+	m_lockPush.clear(std::memory_order_release);
+}
+
+void* TraceWriter::Run()
+{
+	while (!m_bQuit)
+	{
+		if (m_uiTail.load(std::memory_order_relaxed) == m_uiHead.load(std::memory_order_acquire))
+			usleep(1000);
+		else
+			Drain();
+	}
+	return nullptr;
+}
+
+void TraceWriter::Drain()
+{
+	size_t uiTail = m_uiTail.load(std::memory_order_relaxed);
+	size_t uiHead = m_uiHead.load(std::memory_order_acquire);
+	if (!m_uiChunkCycles) // Chunks build up until they are full.
+	{
+		m_vBuffer.clear();
+		m_strVCD.clear();
+	}
+	while (uiTail != uiHead)
+	{
+		const Event_t &evt = m_vRing[uiTail];
+		// Cycle counts can go backwards across an AVR reset, hold the last time for those.
+		uint64_t uiCycle = evt.uiCycle >= m_uiLastCycle ? evt.uiCycle : m_uiLastCycle;
+		if (m_uiChunkCycles)
+		{
+			if (uiCycle >= m_uiChunkEnd)
+				NextChunk(uiCycle);
+			m_vValues[evt.uiSignal] = evt.uiValue;
+		}
+		PutEvent(uiCycle, evt.uiSignal, evt.uiValue);
+		uiTail = (uiTail + 1) & (m_uiRingSize - 1);
+	}
+	m_uiTail.store(uiTail, std::memory_order_release);
+	if (m_uiChunkCycles)
+		return;
+	if (!m_vBuffer.empty())
+		fwrite(m_vBuffer.data(), 1, m_vBuffer.size(), m_fOut);
+	if (!m_strVCD.empty())
+		fwrite(m_strVCD.data(), 1, m_strVCD.size(), m_fOut);
+}
+
+void TraceWriter::PutEvent(uint64_t uiCycle, uint16_t uiSignal, uint32_t uiValue)
+{
+	if (m_bVCD)
+	{
+		uint64_t uiNs = CyclesToNs(uiCycle, m_pAVR->frequency);
+		if (uiNs != m_uiLastNs)
+			m_strVCD += "#" + std::to_string(m_uiLastNs = uiNs) + "\n";
+		PutVCDValue(m_strVCD, m_vSignals[uiSignal]->uiBits, uiValue, uiSignal);
+	}
+	else
+	{
+		PutVarint(m_vBuffer, uiCycle - m_uiLastCycle);
+		PutVarint(m_vBuffer, uiSignal);
+		PutVarint(m_vBuffer, uiValue);
+	}
+	m_uiLastCycle = uiCycle;
+}
+
+void TraceWriter::NextChunk(uint64_t uiCycle)
+{
+	CloseChunk();
+	m_uiChunkStart = uiCycle - (uiCycle % m_uiChunkCycles);
+	m_uiChunkEnd = m_uiChunkStart + m_uiChunkCycles;
+	m_vBuffer.clear();
+	m_strVCD.clear();
+	WriteHeader();
+	m_uiLastCycle = 0; // So binary chunks carry absolute cycles.
+	m_uiLastNs = UINT64_MAX;
+	for (size_t i=0; i<m_vValues.size(); i++)
+		PutEvent(m_uiChunkStart, i, m_vValues[i]);
+}
+
+void TraceWriter::CloseChunk()
+{
+	if (!m_uiChunkEnd)
+		return;
+	Chunk_t chunk {++m_uiChunks, m_uiChunkStart, m_uiLastCycle, {}};
+	if (m_bVCD)
+		chunk.vData.assign(m_strVCD.begin(), m_strVCD.end());
+	else
+		chunk.vData.swap(m_vBuffer);
+	m_uiChunkEnd = 0;
+	// A few waiting is plenty; past that, hold up here and let the ring take the strain.
+	std::unique_lock<std::mutex> lock(m_lockJobs);
+	m_cvDone.wait(lock, [this]{ return m_dJobs.size() < m_vWorkers.size(); });
+	m_dJobs.push_back(std::move(chunk));
+	m_cvJobs.notify_one();
+}
+
+void TraceWriter::RunWorker()
+{
+	ThreadPolicy::Apply(ThreadPolicy::Role::Worker, "trace-deflate");
+	std::unique_lock<std::mutex> lock(m_lockJobs);
+	while (true)
+	{
+		m_cvJobs.wait(lock, [this]{ return !m_dJobs.empty() || m_bWorkersQuit; });
+		if (m_dJobs.empty())
+			return;
+		Chunk_t chunk = std::move(m_dJobs.front());
+		m_dJobs.pop_front();
+		m_uiBusy++;
+		m_cvDone.notify_all(); // Room in the queue
+		lock.unlock();
+		WriteChunk(chunk);
+		lock.lock();
+		m_uiBusy--;
+		m_cvDone.notify_all();
+	}
+}
+
+void TraceWriter::WriteChunk(const Chunk_t &chunk)
+{
+	std::vector<uint8_t> vGZ = Deflate::GZip(chunk.vData.data(), chunk.vData.size());
+	char strNumber[16];
+	snprintf(strNumber, sizeof(strNumber), "_%05u", chunk.uiNumber);
+	std::string strFile = m_strBase + strNumber + (m_bVCD ? ".vcd.gz" : ".trace.gz");
+	FILE *fOut = fopen(strFile.c_str(), "wb");
+	if (!fOut || fwrite(vGZ.data(), 1, vGZ.size(), fOut) != vGZ.size())
+		perror(strFile.c_str());
+	if (fOut)
+		fclose(fOut);
+	std::lock_guard<std::mutex> lock(m_lockJobs);
+	fprintf(m_fIndex, "%u %llu %llu %s\n", chunk.uiNumber, static_cast<unsigned long long>(chunk.uiFirst), static_cast<unsigned long long>(chunk.uiLast),
+		strFile.substr(strFile.rfind('/') + 1).c_str()); // Relative, the index sits with the chunks.
+	fflush(m_fIndex);
+}
+
+void TraceWriter::WriteHeader()
+{
+	m_bHeader = true;
+	if (m_bVCD)
+	{
+		std::vector<std::pair<uint8_t, std::string>> vSignals;
+		for (auto &pSig : m_vSignals)
+			vSignals.push_back({pSig->uiBits, pSig->strName});
+		if (m_uiChunkCycles)
+			PutVCDHeader(m_strVCD, vSignals);
+		else
+			PutVCDHeader(m_fOut, vSignals);
+		return;
+	}
+	m_vBuffer.clear();
+	m_vBuffer.insert(m_vBuffer.end(), m_strMagic, m_strMagic + 8);
+	PutVarint(m_vBuffer, m_uiVersion);
+	PutVarint(m_vBuffer, m_pAVR->frequency);
+	PutVarint(m_vBuffer, m_vSignals.size());
+	for (auto &pSig : m_vSignals)
+	{
+		PutVarint(m_vBuffer, pSig->uiBits);
+		PutVarint(m_vBuffer, pSig->strName.size());
+		m_vBuffer.insert(m_vBuffer.end(), pSig->strName.begin(), pSig->strName.end());
+	}
+	if (!m_uiChunkCycles)
+		fwrite(m_vBuffer.data(), 1, m_vBuffer.size(), m_fOut);
+}
+
+void TraceWriter::PutVarint(std::vector<uint8_t> &vOut, uint64_t uiVal)
+{
+	while (uiVal >= 0x80)
+	{
+		vOut.push_back(static_cast<uint8_t>(uiVal) | 0x80);
+		uiVal >>= 7;
+	}
+	vOut.push_back(static_cast<uint8_t>(uiVal));
+}
+
+void TraceWriter::PutVCDHeader(FILE *fOut, const std::vector<std::pair<uint8_t, std::string>> &vSignals)
+{
+	std::string strOut;
+	PutVCDHeader(strOut, vSignals);
+	fputs(strOut.c_str(), fOut);
+}
+
+void TraceWriter::PutVCDHeader(std::string &strOut, const std::vector<std::pair<uint8_t, std::string>> &vSignals)
+{
+	strOut += "$timescale 1ns $end\n$scope module MK404 $end\n";
+	for (size_t i=0; i<vSignals.size(); i++)
+	{
+		strOut += "$var wire " + std::to_string(vSignals[i].first) + " ";
+		PutVCDValue(strOut, 0, 0, i);
+		strOut += " " + vSignals[i].second + " $end\n";
+	}
+	strOut += "$upscope $end\n$enddefinitions $end\n";
+}
+
+// Appends a value change line. With uiBits == 0, appends just the identifier.
+void TraceWriter::PutVCDValue(std::string &strOut, uint8_t uiBits, uint64_t uiValue, uint64_t uiSignal)
+{
+	if (uiBits == 1)
+		strOut.push_back((uiValue & 1) ? '1' : '0');
+	else if (uiBits > 1)
+	{
+		strOut.push_back('b');
+		for (int i = uiBits-1; i>=0; i--)
+			strOut.push_back((uiValue >> i) & 1 ? '1' : '0');
+		strOut.push_back(' ');
+	}
+	do
+	{
+		strOut.push_back('!' + (uiSignal % 94));
+		uiSignal /= 94;
+	} while (uiSignal > 0);
+	if (uiBits > 0)
+		strOut.push_back('\n');
+}
+
+bool TraceWriter::ConvertToVCD(const std::string &strIn, const std::string &strOut)
+{
+	std::ifstream fIn(strIn, std::ios::binary);
+	std::vector<uint8_t> vIn((std::istreambuf_iterator<char>(fIn)), std::istreambuf_iterator<char>());
+	size_t uiPos = 8;
+	bool bOK = true;
+	auto fcnGet = [&]()
+	{
+		uint64_t uiVal = 0;
+		unsigned uiShift = 0;
+		while (uiPos < vIn.size())
+		{
+			uint8_t uiByte = vIn[uiPos++];
+			uiVal |= static_cast<uint64_t>(uiByte & 0x7F) << uiShift;
+			if (!(uiByte & 0x80))
+				return uiVal;
+			uiShift += 7;
+		}
+		bOK = false; // Ran off the end.
+		return uiVal;
+	};
+
+	if (vIn.size() < 8 || memcmp(vIn.data(), m_strMagic, 8) != 0)
+	{
+		fprintf(stderr, "%s is not an MK404 binary trace.\n", strIn.c_str());
+		return false;
+	}
+	if (fcnGet() != m_uiVersion)
+	{
+		fprintf(stderr, "%s has an unsupported trace version.\n", strIn.c_str());
+		return false;
+	}
+	uint64_t uiFreq = fcnGet();
+	uint64_t uiCount = fcnGet();
+	if (!bOK || uiFreq == 0)
+	{
+		fprintf(stderr, "%s has a corrupt header.\n", strIn.c_str());
+		return false;
+	}
+
+	FILE *fOut = fopen(strOut.c_str(), "w");
+	if (!fOut)
+	{
+		perror(strOut.c_str());
+		return false;
+	}
+
+	std::vector<std::pair<uint8_t, std::string>> vSignals;
+	for (uint64_t i=0; i<uiCount && bOK; i++)
+	{
+		uint8_t uiBits = fcnGet();
+		uint64_t uiLen = fcnGet();
+		if (uiPos + uiLen > vIn.size())
+		{
+			bOK = false;
+			break;
+		}
+		vSignals.push_back({uiBits, std::string(vIn.begin() + uiPos, vIn.begin() + uiPos + uiLen)});
+		uiPos += uiLen;
+	}
+	PutVCDHeader(fOut, vSignals);
+
+	uint64_t uiCycle = 0, uiLastNs = UINT64_MAX;
+	std::string strLine;
+	while (bOK && uiPos < vIn.size())
+	{
+		uiCycle += fcnGet();
+		uint64_t uiSig = fcnGet();
+		uint64_t uiVal = fcnGet();
+		if (!bOK || uiSig >= vSignals.size())
+		{
+			bOK = false;
+			break;
+		}
+		strLine.clear();
+		uint64_t uiNs = CyclesToNs(uiCycle, uiFreq);
+		if (uiNs != uiLastNs)
+			strLine += "#" + std::to_string(uiLastNs = uiNs) + "\n";
+		PutVCDValue(strLine, vSignals[uiSig].first, uiVal, uiSig);
+		fputs(strLine.c_str(), fOut);
+	}
+	fclose(fOut);
+	if (!bOK)
+		fprintf(stderr, "WARNING: %s is truncated or corrupt, converted as much as possible.\n", strIn.c_str());
+	printf("Converted %s to %s\n", strIn.c_str(), strOut.c_str());
+	return true;
+}
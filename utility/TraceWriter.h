@@ -0,0 +1,185 @@
+/*
+	TraceWriter.h - Compact binary streaming trace writer for TelemetryHost.
+	Records IRQ value changes with exact cycle timestamps into a ring buffer
+	that is drained to disk by a background thread.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>           // for pthread_t
+#include <stdint.h>            // for uint32_t, uint64_t, uint8_t, uint16_t
+#include <stdio.h>             // for FILE
+#include <atomic>              // for atomic_bool, atomic_flag, atomic_size_t
+#include <condition_variable>  // for condition_variable
+#include <deque>               // for deque
+#include <memory>              // for unique_ptr
+#include <mutex>               // for mutex
+#include <string>              // for string
+#include <thread>              // for thread
+#include <utility>             // for pair
+#include <vector>              // for vector
+#include "sim_avr.h"           // for avr_t
+#include "sim_irq.h"           // for avr_irq_t
+
+/*
+ * Two output formats are available, both record every change with its exact cycle:
+ *  - Binary (default), described below.
+ *  - VCD, for direct use with GTKWave, at the cost of larger files.
+ *
+ * Binary file layout (all integers are LEB128 varints unless noted):
+ *  "MK404TRC" (8 bytes, raw)
+ *  version, AVR frequency, signal count
+ *  per signal: bit width, name length, name (raw bytes)
+ *  then a stream of records: cycle delta since previous record, signal index, value
+ *
+ * Chunked (SetChunkSeconds) the trace is instead cut at every N seconds of AVR time into
+ * <name>_<NNNNN>.trace.gz (or .vcd.gz), gzipped on a pool of worker threads. Each chunk is a
+ * complete trace of its own: the header, every signal's value at the start of its window, then
+ * the changes. Binary chunks count cycles from 0 rather than from the start of the trace, so
+ * their times line up. <name>.index lists them, one line per chunk (in the order they finish):
+ *  chunk number, first cycle, last cycle, file name
+ * so a viewer or script only has to open those covering the window it wants.
+ */
+class TraceWriter
+{
+	public:
+		TraceWriter(){};
+
+		// Stops the writer thread and flushes anything left over.
+		~TraceWriter();
+
+		// Prepares the trace for the given file, AVR is used for the cycle timestamps.
+		// If bVCD is set the output is written as VCD text instead of the binary format.
+		void Init(avr_t *pAVR, const std::string &strFile, bool bVCD = false);
+
+		// Cuts the trace into gzipped chunks of this many seconds (AVR time), see above. 0 (the default) doesn't.
+		// Must be set before the first Start().
+		inline void SetChunkSeconds(uint32_t uiSeconds) { m_uiChunkSeconds = uiSeconds; }
+
+		// Adds a signal to the trace. Signals must be added before the first Start()
+		void AddSignal(avr_irq_t *pIRQ, uint8_t uiBits, const std::string &strName);
+
+		// Starts (or resumes) recording.
+		void Start();
+
+		// Stops recording and flushes the buffer to disk.
+		void Stop();
+
+		inline bool IsRunning() { return m_bRunning; }
+
+		// Converts a binary trace to a VCD file for use with GTKWave et. al.
+		static bool ConvertToVCD(const std::string &strIn, const std::string &strOut);
+
+		// VCD helpers, shared with ConvertToVCD and the FlightRecorder.
+		static void PutVCDHeader(FILE *fOut, const std::vector<std::pair<uint8_t, std::string>> &vSignals);
+		static void PutVCDHeader(std::string &strOut, const std::vector<std::pair<uint8_t, std::string>> &vSignals);
+		static void PutVCDValue(std::string &strOut, uint8_t uiBits, uint64_t uiValue, uint64_t uiSignal);
+		static inline uint64_t CyclesToNs(uint64_t uiCycle, uint64_t uiFreq)
+		{
+			return (uiCycle / uiFreq) * 1000000000ULL + ((uiCycle % uiFreq) * 1000000000ULL) / uiFreq;
+		}
+
+	private:
+		typedef struct Signal_t
+		{
+			TraceWriter *pOwner;
+			avr_irq_t *pIRQ;
+			uint16_t uiIndex;
+			uint8_t uiBits;
+			std::string strName;
+		} Signal_t;
+
+		typedef struct Event_t
+		{
+			uint64_t uiCycle;
+			uint32_t uiValue;
+			uint16_t uiSignal;
+		} Event_t;
+
+		// Queues an event, called from the AVR thread(s)
+		void Push(uint16_t uiSignal, uint32_t uiValue);
+
+		// Writer thread function.
+		void* Run();
+
+		// A finished chunk on its way to a worker.
+		typedef struct Chunk_t
+		{
+			unsigned int uiNumber;
+			uint64_t uiFirst, uiLast; // Cycles
+			std::vector<uint8_t> vData;
+		} Chunk_t;
+
+		// Encodes and writes everything currently in the ring.
+		void Drain();
+
+		// Appends one change in the current format.
+		void PutEvent(uint64_t uiCycle, uint16_t uiSignal, uint32_t uiValue);
+
+		// Into m_vBuffer (or m_strVCD), and the file when not chunked.
+		void WriteHeader();
+
+		// Hands the chunk so far to the workers (waiting for room), then starts the one holding uiCycle.
+		void NextChunk(uint64_t uiCycle);
+		void CloseChunk();
+
+		// Worker thread function: compresses and writes chunks until told to quit.
+		void RunWorker();
+		void WriteChunk(const Chunk_t &chunk);
+
+		static void PutVarint(std::vector<uint8_t> &vOut, uint64_t uiVal);
+
+		static constexpr size_t m_uiRingSize = 1U<<16; // Must be a power of two.
+
+		avr_t *m_pAVR = nullptr;
+		FILE *m_fOut = nullptr;
+		std::string m_strFile;
+
+		std::vector<std::unique_ptr<Signal_t>> m_vSignals;
+		std::vector<Event_t> m_vRing = std::vector<Event_t>(m_uiRingSize);
+		std::atomic_size_t m_uiHead = {0}, m_uiTail = {0};
+		std::atomic_flag m_lockPush = ATOMIC_FLAG_INIT; // Multiple boards may raise traced IRQs.
+		std::vector<uint8_t> m_vBuffer;
+
+		uint64_t m_uiLastCycle = 0;
+		uint64_t m_uiLastNs = UINT64_MAX;
+		std::string m_strVCD;
+		bool m_bVCD = false;
+		uint64_t m_uiDropped = 0;
+
+		std::atomic_bool m_bRunning = {false}, m_bQuit = {false};
+		bool m_bHeader = false;
+		pthread_t m_thread = 0;
+
+		// Chunking, all but the job queue on the writer thread.
+		uint32_t m_uiChunkSeconds = 0;
+		uint64_t m_uiChunkCycles = 0, m_uiChunkStart = 0, m_uiChunkEnd = 0; // End 0: no chunk open
+		unsigned int m_uiChunks = 0;
+		std::vector<uint32_t> m_vValues; // Every signal's latest value, to start each chunk with.
+		std::string m_strBase; // m_strFile less its extension
+		FILE *m_fIndex = nullptr;
+
+		std::vector<std::thread> m_vWorkers;
+		std::deque<Chunk_t> m_dJobs;
+		unsigned int m_uiBusy = 0;
+		bool m_bWorkersQuit = false;
+		std::mutex m_lockJobs; // For the above and m_fIndex
+		std::condition_variable m_cvJobs, m_cvDone;
+};
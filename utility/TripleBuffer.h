@@ -0,0 +1,57 @@
+/*
+	TripleBuffer.h - Lock-free hand-off of a whole struct from one writer thread
+	to one reader thread. Neither side ever waits, and the reader always sees a
+	complete, consistent copy of whatever was published last.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>  // for atomic_uint, memory_order_acq_rel, memory_order_relaxed
+
+template<class T>
+class TripleBuffer
+{
+	public:
+		explicit TripleBuffer(const T &init = T()) { m_buf[0] = m_buf[1] = m_buf[2] = init; }
+
+		// Writer side.
+		inline void Publish(const T &val)
+		{
+			m_buf[m_uiBack] = val;
+			m_uiBack = m_uiMiddle.exchange(m_uiBack | m_uiFresh, std::memory_order_acq_rel) & m_uiIndex;
+		}
+
+		// Reader side: takes the newest published value, if there is one. Returns true if it changed.
+		inline bool Update()
+		{
+			if (!(m_uiMiddle.load(std::memory_order_relaxed) & m_uiFresh))
+				return false;
+			m_uiFront = m_uiMiddle.exchange(m_uiFront, std::memory_order_acq_rel) & m_uiIndex;
+			return true;
+		}
+		inline const T& Get() const { return m_buf[m_uiFront]; }
+
+	private:
+		T m_buf[3];
+		unsigned int m_uiBack = 0;              // Writer only
+		std::atomic_uint m_uiMiddle {2};        // Last published, plus the fresh bit
+		unsigned int m_uiFront = 1;             // Reader only
+		static constexpr unsigned int m_uiFresh = 4, m_uiIndex = 3;
+};
@@ -0,0 +1,410 @@
+/*
+	VirtualFat.cpp - Presents a host directory as a FAT32 volume for the SD card
+	simulator. The boot sector, FATs and directories are built up front; file
+	contents are read from the host files the first time a block is accessed.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "VirtualFat.h"
+#include <dirent.h>     // for closedir, opendir, readdir, dirent, DIR
+#include <fcntl.h>      // for open, O_RDONLY, O_CLOEXEC
+#include <stdio.h>      // for fprintf, perror, printf, stderr
+#include <sys/mman.h>   // for mmap, munmap, MAP_ANONYMOUS, MAP_FAILED
+#include <sys/stat.h>   // for stat, lstat, S_ISDIR, S_ISLNK, S_ISREG
+#include <unistd.h>     // for close, pread
+#include <algorithm>    // for min, max, sort, upper_bound
+#include <cstring>      // for memcpy, memset, strcmp
+
+// Little-endian helpers for the on-disk structures.
+static inline void Put16(uint8_t *p, uint16_t uiVal) { p[0] = uiVal; p[1] = uiVal >> 8; }
+static inline void Put32(uint8_t *p, uint32_t uiVal) { Put16(p, uiVal); Put16(p + 2, uiVal >> 16); }
+
+static constexpr uint32_t FAT_EOC = 0x0FFFFFFF;
+
+VirtualFat::~VirtualFat()
+{
+	for (auto &ext : m_vExtents)
+		if (ext.fd >= 0)
+			close(ext.fd);
+	if (m_pData)
+		munmap(m_pData, m_uiSize);
+}
+
+bool VirtualFat::Build(const string &strDir)
+{
+	m_root.strPath = strDir;
+	m_root.bDir = true;
+	if (!Scan(m_root))
+		return false;
+
+	// Pick the smallest card the contents fit on. Cluster sizes match FatImage.
+	uint32_t uiClusterCount = 0;
+	for (uint64_t uiMB = 64; uiMB <= 16384; uiMB <<= 1)
+	{
+		m_uiClusterBytes = uiMB > 256 ? 4096 : 512;
+		uint32_t uiSectors = (uiMB << 20) >> 9;
+		uint32_t uiSPC = m_uiClusterBytes >> 9;
+		uint32_t uiDiv = (256*uiSPC + 2)/2; // FAT size formula from the FAT32 spec, with 2 FATs.
+		m_uiFatSectors = (uiSectors - m_uiReserved + uiDiv - 1)/uiDiv;
+		m_uiDataSector = m_uiReserved + 2*m_uiFatSectors;
+		uiClusterCount = (uiSectors - m_uiDataSector)/uiSPC;
+		if (CountClusters(m_root, m_uiClusterBytes) < uiClusterCount)
+		{
+			m_uiSize = uiMB << 20;
+			break;
+		}
+	}
+	if (m_uiSize == 0)
+	{
+		fprintf(stderr, "VirtualFat: %s is too big for a virtual card.\n", strDir.c_str());
+		return false;
+	}
+
+	// Untouched pages cost nothing, so the whole card can be mapped.
+	void *p = mmap(nullptr, m_uiSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		perror("VirtualFat");
+		return false;
+	}
+	m_pData = static_cast<uint8_t*>(p);
+
+	uint32_t uiNext = 2;
+	Allocate(m_root, uiNext);
+
+	// Boot sector
+	static const uint8_t bootJump[] = {0xEB, 0x58, 0x90, 'M', 'K', '4', '0', '4', ' ', ' ', ' '};
+	uint8_t *pBoot = m_pData;
+	memcpy(pBoot, bootJump, sizeof(bootJump));
+	Put16(pBoot + 11, 512);
+	pBoot[13] = m_uiClusterBytes >> 9;
+	Put16(pBoot + 14, m_uiReserved);
+	pBoot[16] = 2; // FATs
+	pBoot[21] = 0xF8; // Media
+	Put16(pBoot + 24, 63);
+	Put16(pBoot + 26, 255);
+	Put32(pBoot + 32, m_uiSize >> 9);
+	Put32(pBoot + 36, m_uiFatSectors);
+	Put32(pBoot + 44, m_root.uiCluster);
+	Put16(pBoot + 48, 1); // FSInfo sector
+	Put16(pBoot + 50, 6); // Backup boot sector
+	pBoot[64] = 0x80;
+	pBoot[66] = 0x29;
+	Put32(pBoot + 67, 0x4D4B3430);
+	memcpy(pBoot + 71, "MK404      FAT32   ", 19);
+	pBoot[510] = 0x55;
+	pBoot[511] = 0xAA;
+	memcpy(m_pData + 6*512, pBoot, 512);
+
+	uint8_t *pInfo = m_pData + 512;
+	Put32(pInfo, 0x41615252);
+	Put32(pInfo + 484, 0x61417272);
+	Put32(pInfo + 488, uiClusterCount - (uiNext - 2));
+	Put32(pInfo + 492, uiNext);
+	pInfo[510] = 0x55;
+	pInfo[511] = 0xAA;
+
+	uint8_t *pFat = m_pData + (m_uiReserved << 9);
+	Put32(pFat, 0x0FFFFFF8);
+	Put32(pFat + 4, FAT_EOC);
+	memcpy(pFat + (m_uiFatSectors << 9), pFat, 8);
+
+	WriteDir(m_root, 0);
+
+	printf("Synthesized a %lu MB FAT32 card from %s (%lu files)\n", static_cast<unsigned long>(m_uiSize >> 20), strDir.c_str(), static_cast<unsigned long>(m_vExtents.size()));
+	return true;
+}
+
+bool VirtualFat::Scan(Node_t &dir)
+{
+	DIR *pDir = opendir(dir.strPath.c_str());
+	if (!pDir)
+	{
+		perror(dir.strPath.c_str());
+		return false;
+	}
+	struct dirent *pEnt;
+	while ((pEnt = readdir(pDir)) != nullptr)
+	{
+		if (!strcmp(pEnt->d_name, ".") || !strcmp(pEnt->d_name, ".."))
+			continue;
+		Node_t node;
+		node.strName = pEnt->d_name;
+		node.strPath = dir.strPath + "/" + node.strName;
+		struct stat st;
+		if (lstat(node.strPath.c_str(), &st) != 0)
+			continue;
+		bool bLink = S_ISLNK(st.st_mode);
+		if (bLink && stat(node.strPath.c_str(), &st) != 0)
+			continue;
+		if (S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) <= 0xFFFFFFFFULL)
+			node.uiSize = st.st_size;
+		else if (S_ISDIR(st.st_mode) && !bLink) // A linked directory could loop back on itself.
+			node.bDir = true;
+		else
+		{
+			fprintf(stderr, "VirtualFat: Skipping %s\n", node.strPath.c_str());
+			continue;
+		}
+		node.tMod = st.st_mtime;
+		dir.vChildren.push_back(node);
+	}
+	closedir(pDir);
+
+	sort(dir.vChildren.begin(), dir.vChildren.end(), [](const Node_t &a, const Node_t &b) { return a.strName < b.strName; });
+	set<string> used;
+	for (auto &child : dir.vChildren)
+	{
+		child.bLFN = MakeShortName(child.strName, used, child.shortName);
+		if (child.bDir && !Scan(child))
+			return false;
+	}
+	return true;
+}
+
+bool VirtualFat::MakeShortName(const string &strName, set<string> &used, uint8_t shortName[11])
+{
+	static const string strValid = "$%'-_@~`!(){}^#&";
+	bool bLFN = false;
+	auto fcnConvert = [&bLFN](const string &strIn, size_t uiMax)
+	{
+		string strOut;
+		for (char c : strIn)
+		{
+			if (c == ' ' || c == '.')
+			{
+				bLFN = true;
+				continue;
+			}
+			char cUp = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+			if (cUp != c)
+				bLFN = true; // Keep the case in the long name.
+			if (!((cUp >= 'A' && cUp <= 'Z') || (cUp >= '0' && cUp <= '9') || strValid.find(cUp) != string::npos))
+			{
+				cUp = '_';
+				bLFN = true;
+			}
+			strOut.push_back(cUp);
+		}
+		if (strOut.size() > uiMax)
+		{
+			strOut.resize(uiMax);
+			bLFN = true;
+		}
+		return strOut;
+	};
+
+	size_t uiDot = strName.rfind('.');
+	if (uiDot == 0)
+		uiDot = string::npos; // Dotfile, it's all name.
+	string strBase = fcnConvert(strName.substr(0, uiDot), 8);
+	string strExt = uiDot == string::npos ? "" : fcnConvert(strName.substr(uiDot + 1), 3);
+	if (strBase.empty())
+	{
+		strBase = "_";
+		bLFN = true;
+	}
+
+	auto fcnKey = [](const string &strB, const string &strE)
+	{
+		string strKey = strB;
+		strKey.resize(8, ' ');
+		strKey.append(strE).resize(11, ' ');
+		return strKey;
+	};
+	string strKey = fcnKey(strBase, strExt);
+	// Lossy names get a numeric tail, like Windows does.
+	for (unsigned int i = 1; bLFN || used.count(strKey); i++)
+	{
+		bLFN = true;
+		string strTail = "~" + to_string(i);
+		strKey = fcnKey(strBase.substr(0, 8 - strTail.size()) + strTail, strExt);
+		if (!used.count(strKey))
+			break;
+	}
+	used.insert(strKey);
+	memcpy(shortName, strKey.data(), 11);
+	return bLFN;
+}
+
+uint32_t VirtualFat::CountClusters(const Node_t &dir, uint32_t uiClusterBytes)
+{
+	uint32_t uiEntries = (dir.strPath == m_root.strPath ? 0 : 2) + 1; // Dot entries and end marker.
+	uint32_t uiCount = 0;
+	for (auto &child : dir.vChildren)
+	{
+		uiEntries += EntriesFor(child);
+		if (child.bDir)
+			uiCount += CountClusters(child, uiClusterBytes);
+		else
+			uiCount += (child.uiSize + uiClusterBytes - 1)/uiClusterBytes;
+	}
+	return uiCount + (uiEntries*32 + uiClusterBytes - 1)/uiClusterBytes;
+}
+
+void VirtualFat::Allocate(Node_t &dir, uint32_t &uiNext)
+{
+	uint32_t uiEntries = (&dir == &m_root ? 0 : 2) + 1;
+	for (auto &child : dir.vChildren)
+		uiEntries += EntriesFor(child);
+	dir.uiCluster = uiNext;
+	dir.uiClusters = (uiEntries*32 + m_uiClusterBytes - 1)/m_uiClusterBytes;
+	uiNext += dir.uiClusters;
+	WriteChain(dir.uiCluster, dir.uiClusters);
+
+	for (auto &child : dir.vChildren)
+	{
+		if (child.bDir)
+			Allocate(child, uiNext);
+		else if (child.uiSize > 0)
+		{
+			child.uiCluster = uiNext;
+			child.uiClusters = (child.uiSize + m_uiClusterBytes - 1)/m_uiClusterBytes;
+			uiNext += child.uiClusters;
+			WriteChain(child.uiCluster, child.uiClusters);
+			Extent_t ext;
+			ext.uiStart = ClusterToByte(child.uiCluster);
+			ext.uiSize = child.uiSize;
+			ext.strPath = child.strPath;
+			ext.vFilled.resize(child.uiClusters, false);
+			m_vExtents.push_back(ext); // Allocation only moves forward, so these stay sorted.
+		}
+	}
+}
+
+void VirtualFat::WriteChain(uint32_t uiFirst, uint32_t uiCount)
+{
+	uint8_t *pFat = m_pData + (m_uiReserved << 9);
+	for (uint32_t i = 0; i < uiCount; i++)
+	{
+		uint32_t uiCluster = uiFirst + i;
+		uint32_t uiVal = (i + 1 == uiCount) ? FAT_EOC : uiCluster + 1;
+		Put32(pFat + uiCluster*4, uiVal);
+		Put32(pFat + (m_uiFatSectors << 9) + uiCluster*4, uiVal);
+	}
+}
+
+void VirtualFat::WriteEntry(uint8_t *pEntry, const uint8_t name[11], uint8_t uiAttr, uint32_t uiCluster, uint32_t uiSize, time_t tMod)
+{
+	struct tm tmMod;
+	localtime_r(&tMod, &tmMod);
+	if (tmMod.tm_year < 80)
+	{
+		tmMod.tm_year = 80;
+		tmMod.tm_mon = 0;
+		tmMod.tm_mday = 1;
+	}
+	uint16_t uiDate = ((tmMod.tm_year - 80) << 9) | ((tmMod.tm_mon + 1) << 5) | tmMod.tm_mday;
+	uint16_t uiTime = (tmMod.tm_hour << 11) | (tmMod.tm_min << 5) | (tmMod.tm_sec/2);
+	memcpy(pEntry, name, 11);
+	pEntry[11] = uiAttr;
+	Put16(pEntry + 14, uiTime);
+	Put16(pEntry + 16, uiDate);
+	Put16(pEntry + 18, uiDate);
+	Put16(pEntry + 20, uiCluster >> 16);
+	Put16(pEntry + 22, uiTime);
+	Put16(pEntry + 24, uiDate);
+	Put16(pEntry + 26, uiCluster);
+	Put32(pEntry + 28, uiSize);
+}
+
+uint8_t* VirtualFat::WriteLongName(uint8_t *pEntry, const string &strName, const uint8_t shortName[11])
+{
+	uint8_t uiSum = 0;
+	for (int i = 0; i < 11; i++)
+		uiSum = ((uiSum & 1) << 7) + (uiSum >> 1) + shortName[i];
+	uint32_t uiCount = EntriesFor(strName, true) - 1;
+	// Stored last part first. Names are taken bytewise; short names cover the ASCII case.
+	for (uint32_t uiOrd = uiCount; uiOrd > 0; uiOrd--)
+	{
+		static const uint8_t offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+		memset(pEntry, 0, 32);
+		pEntry[0] = uiOrd | (uiOrd == uiCount ? 0x40 : 0);
+		pEntry[11] = ATTR_LFN;
+		pEntry[13] = uiSum;
+		for (int i = 0; i < 13; i++)
+		{
+			size_t uiPos = (uiOrd - 1)*13 + i;
+			uint16_t uiChar = 0xFFFF;
+			if (uiPos < strName.size())
+				uiChar = static_cast<uint8_t>(strName[uiPos]);
+			else if (uiPos == strName.size())
+				uiChar = 0;
+			Put16(pEntry + offsets[i], uiChar);
+		}
+		pEntry += 32;
+	}
+	return pEntry;
+}
+
+void VirtualFat::WriteDir(const Node_t &dir, uint32_t uiParent)
+{
+	uint8_t *pEntry = m_pData + ClusterToByte(dir.uiCluster);
+	if (&dir != &m_root)
+	{
+		static const uint8_t dot[11] = {'.',' ',' ',' ',' ',' ',' ',' ',' ',' ',' '};
+		static const uint8_t dotdot[11] = {'.','.',' ',' ',' ',' ',' ',' ',' ',' ',' '};
+		WriteEntry(pEntry, dot, ATTR_DIR, dir.uiCluster, 0, dir.tMod);
+		WriteEntry(pEntry + 32, dotdot, ATTR_DIR, uiParent, 0, dir.tMod);
+		pEntry += 64;
+	}
+	for (auto &child : dir.vChildren)
+	{
+		if (child.bLFN)
+			pEntry = WriteLongName(pEntry, child.strName, child.shortName);
+		WriteEntry(pEntry, child.shortName, child.bDir ? ATTR_DIR : ATTR_ARCHIVE, child.uiCluster, child.bDir ? 0 : child.uiSize, child.tMod);
+		pEntry += 32;
+	}
+	for (auto &child : dir.vChildren)
+		if (child.bDir)
+			WriteDir(child, &dir == &m_root ? 0 : dir.uiCluster); // ".." to the root is cluster 0.
+}
+
+void VirtualFat::Fill(off_t addr, size_t uiLen)
+{
+	uint64_t uiStart = addr, uiEnd = addr + uiLen;
+	auto it = upper_bound(m_vExtents.begin(), m_vExtents.end(), uiStart, [](uint64_t uiVal, const Extent_t &ext) { return uiVal < ext.uiStart; });
+	if (it != m_vExtents.begin())
+		--it;
+	for (; it != m_vExtents.end() && it->uiStart < uiEnd; ++it)
+	{
+		uint64_t uiExtEnd = it->uiStart + it->uiSize;
+		if (uiExtEnd <= uiStart)
+			continue;
+		uint32_t uiFirst = (max(uiStart, it->uiStart) - it->uiStart)/m_uiClusterBytes;
+		uint32_t uiLast = (min(uiEnd, uiExtEnd) - 1 - it->uiStart)/m_uiClusterBytes;
+		for (uint32_t uiCl = uiFirst; uiCl <= uiLast; uiCl++)
+		{
+			if (it->vFilled[uiCl])
+				continue;
+			it->vFilled[uiCl] = true;
+			if (it->fd < 0)
+				it->fd = open(it->strPath.c_str(), O_RDONLY | O_CLOEXEC);
+			if (it->fd < 0)
+			{
+				perror(it->strPath.c_str()); // Reads as zeros.
+				continue;
+			}
+			uint64_t uiOff = static_cast<uint64_t>(uiCl)*m_uiClusterBytes;
+			size_t uiCount = min<uint64_t>(m_uiClusterBytes, it->uiSize - uiOff);
+			if (pread(it->fd, m_pData + it->uiStart + uiOff, uiCount, uiOff) < 0)
+				perror(it->strPath.c_str());
+		}
+	}
+}
@@ -0,0 +1,105 @@
+/*
+	VirtualFat.h - Presents a host directory as a FAT32 volume for the SD card
+	simulator. The boot sector, FATs and directories are built up front; file
+	contents are read from the host files the first time a block is accessed.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint32_t, uint8_t, uint64_t, uint16_t
+#include <sys/types.h>  // for off_t
+#include <time.h>       // for time_t
+#include <set>          // for set
+#include <string>       // for string
+#include <vector>       // for vector
+
+using namespace std;
+
+// Writes from the AVR land in memory only and are lost on unmount;
+// the host files are never modified.
+class VirtualFat
+{
+	public:
+		~VirtualFat();
+
+		// Scans the directory (recursively) and lays out the volume. Returns false on failure.
+		bool Build(const string &strDir);
+
+		// Makes sure the given byte range has been read in from the host files.
+		// Must be called before the range is read or written.
+		void Fill(off_t addr, size_t uiLen);
+
+		inline uint8_t* GetData() { return m_pData; }
+		inline off_t GetSize() { return m_uiSize; }
+
+		// Directory entry helpers, FatImage uses these too.
+		static constexpr uint8_t ATTR_DIR = 0x10, ATTR_ARCHIVE = 0x20, ATTR_LFN = 0x0F;
+
+		// Makes the 8.3 name for strName, unique among those used. Returns whether it needs a long name as well.
+		static bool MakeShortName(const string &strName, set<string> &used, uint8_t shortName[11]);
+
+		// How many 32-byte entries a name takes.
+		static inline uint32_t EntriesFor(const string &strName, bool bLFN) { return 1 + (bLFN ? (strName.size() + 12)/13 : 0); }
+
+		// Writes the long name entries for strName, returns where its short entry goes.
+		static uint8_t* WriteLongName(uint8_t *pEntry, const string &strName, const uint8_t shortName[11]);
+
+		static void WriteEntry(uint8_t *pEntry, const uint8_t name[11], uint8_t uiAttr, uint32_t uiCluster, uint32_t uiSize, time_t tMod);
+
+	private:
+		typedef struct Node_t
+		{
+			string strName, strPath;
+			bool bDir = false;
+			uint64_t uiSize = 0;
+			time_t tMod = 0;
+			uint8_t shortName[11];
+			bool bLFN = false;
+			uint32_t uiCluster = 0, uiClusters = 0;
+			vector<Node_t> vChildren;
+		} Node_t;
+
+		typedef struct Extent_t
+		{
+			uint64_t uiStart = 0; // Byte offset of the first cluster in the volume
+			uint64_t uiSize = 0;
+			string strPath;
+			int fd = -1;
+			vector<bool> vFilled; // Per cluster
+		} Extent_t;
+
+		bool Scan(Node_t &dir);
+		static inline uint32_t EntriesFor(const Node_t &node) { return EntriesFor(node.strName, node.bLFN); }
+		uint32_t CountClusters(const Node_t &dir, uint32_t uiClusterBytes);
+		void Allocate(Node_t &dir, uint32_t &uiNext);
+		void WriteDir(const Node_t &dir, uint32_t uiParent);
+		void WriteChain(uint32_t uiFirst, uint32_t uiCount);
+
+		inline uint64_t ClusterToByte(uint32_t uiCluster) { return (static_cast<uint64_t>(m_uiDataSector) << 9) + static_cast<uint64_t>(uiCluster - 2) * m_uiClusterBytes; }
+
+		uint8_t *m_pData = nullptr;
+		off_t m_uiSize = 0;
+		uint32_t m_uiClusterBytes = 512, m_uiFatSectors = 0, m_uiDataSector = 0;
+		Node_t m_root;
+		vector<Extent_t> m_vExtents; // Sorted by uiStart
+
+		static constexpr uint32_t m_uiReserved = 32;
+};
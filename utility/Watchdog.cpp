@@ -0,0 +1,212 @@
+/*
+	Watchdog.cpp - Notices when a simulation stops making progress or slows to a crawl.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "Watchdog.h"
+#include <stdio.h>          // for fprintf, stderr, fflush, snprintf
+#include <stdlib.h>         // for atol
+#include <unistd.h>         // for usleep, getpid
+#include <fstream>          // for ifstream
+#include "CountedMutex.h"   // for CountedMutex
+#include "ScriptHost.h"     // for ScriptHost
+#include "ThreadPolicy.h"   // for ThreadPolicy
+#include "sim_avr.h"        // for avr_t, cpu_Running...
+#ifdef __linux__
+#include <dirent.h>         // for opendir, readdir, closedir
+#include <execinfo.h>       // for backtrace, backtrace_symbols_fd
+#include <signal.h>         // for sigaction, SIGUSR2
+#include <sys/syscall.h>    // for SYS_tgkill, SYS_gettid
+#endif
+
+#ifdef __linux__
+static std::atomic_bool s_bStackDone {false};
+
+// In the signalled thread. backtrace() was primed at Start, so it won't be loading libgcc here.
+static void OnStackSignal(int)
+{
+	void *pFrames[64];
+	int iFrames = backtrace(pFrames, 64);
+	backtrace_symbols_fd(pFrames, iFrames, STDERR_FILENO);
+	s_bStackDone = true;
+}
+#endif
+
+void Watchdog::SetDefaults(uint32_t uiWindowSecs, float fMinRTF)
+{
+	GetWindowSecs() = uiWindowSecs;
+	GetMinRTF() = fMinRTF;
+}
+
+void Watchdog::Add(Boards::Board *pBoard, const std::string &strName)
+{
+	Target_t target;
+	target.pBoard = pBoard;
+	target.strName = strName;
+	m_vTargets.push_back(target);
+}
+
+void Watchdog::Start()
+{
+	if (!IsEnabled() || m_thread)
+		return;
+#ifdef __linux__
+	void *pFrame;
+	backtrace(&pFrame, 1);
+	struct sigaction sa {};
+	sa.sa_handler = OnStackSignal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, nullptr);
+#endif
+	auto fcnRun = [](void *param) { ThreadPolicy::Apply(ThreadPolicy::Role::IO, "watchdog"); Watchdog *p = static_cast<Watchdog*>(param); return p->Run(); };
+	pthread_create(&m_thread, nullptr, fcnRun, this);
+	printf("Watchdog: reporting boards that stall for %us", GetWindowSecs());
+	if (GetMinRTF() > 0)
+		printf(" or run below %.2fx real time over that", GetMinRTF());
+	printf("\n");
+}
+
+void Watchdog::Stop()
+{
+	if (!m_thread)
+		return;
+	m_bQuit = true;
+	pthread_join(m_thread, nullptr);
+	m_thread = 0;
+}
+
+void* Watchdog::Run()
+{
+	while (!m_bQuit)
+	{
+		for (int i=0; i<10 && !m_bQuit; i++)
+			usleep(100000);
+		time_point tpNow = std::chrono::steady_clock::now();
+		for (auto &target : m_vTargets)
+			Check(target, tpNow);
+	}
+	return nullptr;
+}
+
+void Watchdog::Check(Target_t &target, time_point tpNow)
+{
+	Boards::Board *pBoard = target.pBoard;
+	uint64_t uiCycle = pBoard->GetProgress();
+	if (!pBoard->IsRunning() || pBoard->IsPaused() || pBoard->IsStopped())
+	{
+		// Standing still on purpose, start over when it goes again.
+		target.uiLastCycle = uiCycle;
+		target.tpLastMove = tpNow;
+		target.dSamples.clear();
+		target.bStalled = target.bSlow = false;
+		return;
+	}
+	if (target.dSamples.empty())
+		target.tpLastMove = tpNow;
+	std::chrono::duration<double> dWindow(GetWindowSecs());
+	target.dSamples.emplace_back(tpNow, uiCycle);
+	while (tpNow - target.dSamples.front().first > dWindow)
+		target.dSamples.pop_front();
+
+	if (uiCycle != target.uiLastCycle)
+	{
+		if (target.bStalled)
+			fprintf(stderr, "Watchdog: %s is moving again, after %.1f s\n", target.strName.c_str(), std::chrono::duration<double>(tpNow - target.tpLastMove).count());
+		target.uiLastCycle = uiCycle;
+		target.tpLastMove = tpNow;
+		target.bStalled = false;
+	}
+	else if (!target.bStalled && tpNow - target.tpLastMove >= dWindow)
+	{
+		target.bStalled = true;
+		Report(target, "has made no progress for " + std::to_string(GetWindowSecs()) + " s");
+		return;
+	}
+
+	// Only over a full window, so a quick hiccup doesn't count.
+	auto &oldest = target.dSamples.front();
+	double dSecs = std::chrono::duration<double>(tpNow - oldest.first).count();
+	if (GetMinRTF() <= 0 || target.bStalled || dSecs < GetWindowSecs() - 0.5)
+		return;
+	double dRTF = static_cast<double>(uiCycle - oldest.second)/(dSecs*static_cast<double>(pBoard->GetAVR()->frequency));
+	if (!target.bSlow && dRTF < GetMinRTF())
+	{
+		target.bSlow = true;
+		char szWhat[96];
+		snprintf(szWhat, sizeof(szWhat), "is running at %.3fx real time over the last %.0f s", dRTF, dSecs);
+		Report(target, szWhat);
+	}
+	else if (target.bSlow && dRTF >= GetMinRTF())
+	{
+		target.bSlow = false;
+		fprintf(stderr, "Watchdog: %s is back up to %.3fx real time\n", target.strName.c_str(), dRTF);
+	}
+}
+
+void Watchdog::Report(Target_t &target, const std::string &strWhat)
+{
+	avr_t *pAVR = target.pBoard->GetAVR();
+	static const char* const szStates[] = {"limbo", "stopped", "running", "sleeping", "step", "step done", "done", "crashed"};
+	int iState = pAVR->state;
+	fprintf(stderr, "Watchdog: %s %s, at cycle %llu (%.3f s simulated)\n", target.strName.c_str(), strWhat.c_str(),
+		static_cast<unsigned long long>(target.uiLastCycle), static_cast<double>(target.uiLastCycle)/pAVR->frequency);
+	// Read while it runs, so a snapshot, but from a stalled board it's where it stopped.
+	fprintf(stderr, "\tPC 0x%05x SP 0x%04x, CPU %s\n", pAVR->pc, pAVR->data[R_SPL] | (pAVR->data[R_SPH] << 8U),
+		iState >= 0 && iState < 8 ? szStates[iState] : "?");
+	ScriptHost *pHost = target.pBoard->GetScriptHost();
+	std::string strLine = pHost ? pHost->GetActiveLine() : "";
+	if (!strLine.empty())
+		fprintf(stderr, "\tScript line %s\n", strLine.c_str());
+	CountedMutex::PrintAll(stderr);
+	DumpStacks();
+	fflush(stderr);
+}
+
+void Watchdog::DumpStacks()
+{
+#ifdef __linux__
+	DIR *pDir = opendir("/proc/self/task");
+	if (!pDir)
+		return;
+	long lSelf = syscall(SYS_gettid);
+	fprintf(stderr, "Thread stacks (addr2line -e <binary> or gdb for the lines):\n");
+	while (struct dirent *pEnt = readdir(pDir))
+	{
+		long lTid = atol(pEnt->d_name);
+		if (lTid <= 0 || lTid == lSelf)
+			continue;
+		std::string strName;
+		std::ifstream fComm("/proc/self/task/" + std::string(pEnt->d_name) + "/comm");
+		std::getline(fComm, strName);
+		fprintf(stderr, "--- Thread %ld (%s):\n", lTid, strName.c_str());
+		fflush(stderr);
+		s_bStackDone = false;
+		if (syscall(SYS_tgkill, getpid(), lTid, SIGUSR2) != 0)
+			continue; // Gone since
+		for (int i=0; i<50 && !s_bStackDone; i++)
+			usleep(10000);
+		if (!s_bStackDone)
+			fprintf(stderr, "\t(no answer, it may have signals blocked)\n");
+	}
+	closedir(pDir);
+#else
+	fprintf(stderr, "(Thread stacks are only dumped on Linux.)\n");
+#endif
+}
@@ -0,0 +1,79 @@
+/*
+	Watchdog.h - Notices when a simulation stops making progress or slows to a crawl.
+
+	Copyright 2020 VintagePC <https://github.com/vintagepc/>
+
+ 	This file is part of MK404.
+
+	MK404 is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	MK404 is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with MK404.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <pthread.h>  // for pthread_t
+#include <stdint.h>   // for uint64_t, uint32_t
+#include <atomic>     // for atomic_bool
+#include <chrono>     // for steady_clock
+#include <deque>      // for deque
+#include <string>     // for string
+#include <utility>    // for pair
+#include <vector>     // for vector
+#include "Board.h"    // for Board
+
+// A thread of its own samples each board's cycle count once a second against the wall clock.
+// A board that is running (not paused, not halted by gdb) but hasn't moved for a whole window
+// has stalled, e.g. its AVR thread is stuck on a lock; one that moved, but slower than the given
+// real-time factor over the window, has collapsed. Either way it prints the board's PC, SP and
+// script line, the CountedMutex contention, and (on Linux) the stack of every thread, then
+// once more when it recovers. Nothing is stopped, it only reports.
+class Watchdog
+{
+	public:
+		// uiWindowSecs of 0 is off; fMinRTF of 0 only looks for stalls.
+		static void SetDefaults(uint32_t uiWindowSecs, float fMinRTF);
+		static inline bool IsEnabled() { return GetWindowSecs() > 0; }
+
+		~Watchdog() { Stop(); }
+
+		void Add(Boards::Board *pBoard, const std::string &strName);
+
+		void Start();
+		void Stop();
+
+	private:
+		typedef std::chrono::steady_clock::time_point time_point;
+
+		typedef struct Target_t
+		{
+			Boards::Board *pBoard;
+			std::string strName;
+			uint64_t uiLastCycle = 0;
+			time_point tpLastMove;
+			std::deque<std::pair<time_point, uint64_t>> dSamples; // The window, oldest first
+			bool bStalled = false, bSlow = false;
+		} Target_t;
+
+		static uint32_t& GetWindowSecs() { static uint32_t uiSecs = 0; return uiSecs; }
+		static float& GetMinRTF() { static float fRTF = 0; return fRTF; }
+
+		void* Run();
+		void Check(Target_t &target, time_point tpNow);
+		void Report(Target_t &target, const std::string &strWhat);
+		// Has each thread print its own stack to stderr, one at a time.
+		void DumpStacks();
+
+		std::vector<Target_t> m_vTargets;
+		pthread_t m_thread = 0;
+		std::atomic_bool m_bQuit {false};
+};